@@ -0,0 +1,474 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "archive.h"
+#include "frames.h"
+#include "metrics.h"
+#include "trace.h"
+#include "fate.h"
+#include "startup.h"
+
+namespace detector {
+
+static const unsigned char start_code[] = { 0x00, 0x00, 0x00, 0x01 };
+
+static bool has_suffix(const std::string& name, const char* suffix) {
+  size_t n = strlen(suffix);
+  return name.size() > n && name.compare(name.size() - n, n, suffix) == 0;
+}
+
+static bool is_media(const std::string& name) {
+  return has_suffix(name, ".mp4") || has_suffix(name, ".h264") || has_suffix(name, ".264");
+}
+
+// the media files under 'path' in name order, or 'path' itself
+static std::vector<std::string> media_files(const std::string& path) {
+  std::vector<std::string> files;
+  DIR* d = opendir(path.c_str());
+  if (d == nullptr) {
+    files.push_back(path);
+    return files;
+  }
+  struct dirent* ent;
+  while ((ent = readdir(d)) != nullptr) {
+    if (ent->d_name[0] != '.' && is_media(ent->d_name)) {
+      files.push_back(path + "/" + ent->d_name);
+    }
+  }
+  closedir(d);
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+Archive::Archive(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Archive::~Archive() {
+  closeFile();
+}
+
+std::unique_ptr<Archive> Archive::create(unsigned int yield_time, bool quiet,
+    Tflow* tfl, const std::string& path, unsigned int framerate,
+    unsigned int width, unsigned int height) {
+  auto obj = std::unique_ptr<Archive>(new Archive(yield_time));
+  obj->init(quiet, tfl, path, framerate, width, height);
+  return obj;
+}
+
+void Archive::setJournal(Journal* jnl) {
+  jnl_ = jnl;
+}
+
+void Archive::metrics(Exposition& out, const std::string& labels) {
+  out.counter("detector_frames_total", "frames captured", labels, frame_cnt_);
+  out.counter("detector_archive_files_total", "archive files read", labels, file_cnt_);
+  out.counter("detector_archive_bad_files_total", "archive files that couldn't be read",
+      labels, bad_file_cnt_);
+  out.counter("detector_archive_access_units_total", "access units from the archive",
+      labels, au_cnt_);
+  out.counter("detector_decode_errors_total", "access units that didn't go to the decoder",
+      labels, decode_err_cnt_);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"h264_decode\"", differ_dec_.hist);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"tflow_copy\"", differ_tfl_.hist);
+}
+
+void Archive::footprint(Footprint& out) {
+  if (dec_) {
+    dec_->footprint(out);
+  }
+  size_t num, bytes;
+  pyr_->footprint(num, bytes);
+  out.add("pyramid", num, bytes);
+}
+
+bool Archive::init(bool quiet, Tflow* tfl, const std::string& path,
+    unsigned int framerate, unsigned int width, unsigned int height) {
+
+  quiet_ = quiet;
+  tfl_ = tfl;
+  jnl_ = nullptr;
+  path_ = path;
+  framerate_ = std::max(framerate, 1u);
+  width_ = width;
+  height_ = height;
+
+  file_idx_ = 0;
+  fd_ = -1;
+  map_ = nullptr;
+  map_len_ = 0;
+  prefixed_ = false;
+  nal_len_ = 4;
+  timescale_ = framerate_;
+  unit_idx_ = 0;
+  file_us_ = 0;
+  end_us_ = 0;
+
+  pyr_ = Pyramid::create(width_, height_, V4L2_PIX_FMT_YUV420);
+  held_ = 0;
+  fed_all_ = false;
+  done_ = false;
+  archive_on_ = false;
+
+  file_cnt_ = 0;
+  bad_file_cnt_ = 0;
+  frame_cnt_ = 0;
+  au_cnt_ = 0;
+  decode_err_cnt_ = 0;
+  media_us_ = 0;
+  first_ms_ = -1;
+
+  return true;
+}
+
+void Archive::indexAnnexB() {
+
+  // an access unit starts at the first nal after a picture's slices that
+  // is a new picture's first slice or comes before one
+  timescale_ = framerate_;
+  params_.clear();
+  units_.clear();
+  size_t begin = map_len_;
+  bool vcl = false, key = false;
+  auto close_unit = [&](size_t end) {
+    if (begin < end && vcl) {
+      Mp4Entry e;
+      e.offset = begin;
+      e.size = end - begin;
+      e.time = units_.size();
+      e.key = key;
+      units_.push_back(e);
+    }
+  };
+  for (size_t i = 0; i + 3 < map_len_; i++) {
+    if (map_[i] != 0 || map_[i + 1] != 0 || map_[i + 2] != 1) {
+      continue;
+    }
+    size_t at = (i > 0 && map_[i - 1] == 0) ? i - 1 : i;
+    unsigned int type = map_[i + 3] & 0x1f;
+    bool slice = type == 1 || type == 5;
+    bool first = slice && i + 4 < map_len_ && (map_[i + 4] & 0x80);
+    if (begin == map_len_) {
+      begin = at;
+    } else if (vcl && (first || (type >= 6 && type <= 9))) {
+      close_unit(at);
+      begin = at;
+      vcl = false;
+      key = false;
+    }
+    vcl = vcl || slice;
+    key = key || type == 5;
+    i += 2;
+  }
+  close_unit(map_len_);
+}
+
+bool Archive::openFile() {
+
+  closeFile();
+  while (file_idx_ < files_.size()) {
+    const std::string& name = files_[file_idx_++];
+    fd_ = ::open(name.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) != 0 || st.st_size == 0) {
+      dbgMsg("failed: archive file %s\n", name.c_str());
+      bad_file_cnt_++;
+      closeFile();
+      continue;
+    }
+    map_len_ = st.st_size;
+    void* map = mmap(nullptr, map_len_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (map == MAP_FAILED) {
+      dbgMsg("failed: map archive file %s (errno: %d)\n", name.c_str(), errno);
+      bad_file_cnt_++;
+      closeFile();
+      continue;
+    }
+    map_ = static_cast<unsigned char*>(map);
+    madvise(map_, map_len_, MADV_SEQUENTIAL);
+
+    prefixed_ = has_suffix(name, ".mp4");
+    if (prefixed_) {
+      if (!mp4Read(map_, map_len_, timescale_, nal_len_, params_, units_)) {
+        dbgMsg("failed: archive file %s isn't fragmented mp4\n", name.c_str());
+        units_.clear();
+      }
+    } else {
+      indexAnnexB();
+    }
+    if (units_.empty() || timescale_ == 0) {
+      bad_file_cnt_++;
+      closeFile();
+      continue;
+    }
+
+    // this file picks up where the last one ended
+    std::sort(units_.begin(), units_.end(),
+        [](const Mp4Entry& a, const Mp4Entry& b) { return a.time < b.time; });
+    uint64_t t0 = units_.front().time;
+    for (auto& u : units_) {
+      u.time -= t0;
+    }
+    file_us_ = end_us_;
+    uint64_t len_us = (units_.back().time * 1000000) / timescale_ + 1000000 / framerate_;
+    media_us_ += len_us;
+
+    if (jnl_) {
+      int64_t mtime_ms = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000 +
+        st.st_mtim.tv_nsec / 1000000;
+      jnl_->rebase(origin_ + std::chrono::microseconds(file_us_),
+          mtime_ms - static_cast<int64_t>(len_us / 1000));
+    }
+    unit_idx_ = 0;
+    file_cnt_++;
+    if (!quiet_) {
+      fprintf(stderr, "\narchive: %s, %zu frames\n", name.c_str(), units_.size());
+    }
+    return true;
+  }
+  return false;
+}
+
+void Archive::closeFile() {
+  if (map_ != nullptr) {
+    munmap(map_, map_len_);
+    map_ = nullptr;
+  }
+  map_len_ = 0;
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+  units_.clear();
+  unit_idx_ = 0;
+}
+
+bool Archive::feed() {
+
+  while (map_ == nullptr || unit_idx_ >= units_.size()) {
+    if (!openFile()) {
+      return false;
+    }
+  }
+
+  // in decode order, as start codes with the parameter sets on key frames
+  const Mp4Entry& u = units_[unit_idx_++];
+  au_.clear();
+  if (u.offset + u.size > map_len_) {
+    decode_err_cnt_++;
+    return true;
+  }
+  const unsigned char* p = map_ + u.offset;
+  if (prefixed_) {
+    if (u.key) {
+      au_.insert(au_.end(), params_.begin(), params_.end());
+    }
+    size_t at = 0;
+    while (at + nal_len_ <= u.size) {
+      size_t n = 0;
+      for (unsigned int k = 0; k < nal_len_; k++) {
+        n = (n << 8) | p[at + k];
+      }
+      at += nal_len_;
+      if (n > u.size - at) {
+        break;
+      }
+      au_.insert(au_.end(), start_code, start_code + sizeof(start_code));
+      au_.insert(au_.end(), p + at, p + at + n);
+      at += n;
+    }
+  } else {
+    au_.insert(au_.end(), p, p + u.size);
+  }
+
+  uint64_t at_us = file_us_ + (u.time * 1000000) / timescale_;
+  end_us_ = std::max(end_us_, at_us + 1000000 / framerate_);
+  au_cnt_++;
+  differ_dec_.begin();
+  if (au_.empty() || !dec_->feed(au_.data(), au_.size(), origin_ + std::chrono::microseconds(at_us))) {
+    decode_err_cnt_++;
+  }
+  differ_dec_.end();
+  return true;
+}
+
+unsigned int Archive::take(unsigned int wait) {
+
+  unsigned int num = 0;
+  unsigned int index, used;
+  std::chrono::steady_clock::time_point stamp;
+  while (dec_->take(index, used, stamp, wait)) {
+    FrameBuf fbuf = dec_->buffers()[index];
+    fbuf.length = used;
+    fbuf.id = frame_cnt_++;
+    fbuf.stamp = stamp;
+    if (first_ms_ < 0) {
+      first_ms_ = since_start_ms();
+      Startup::ready(Startup::kFrame);
+    }
+    Trace::span(Trace::Hop::kDqbuf, fbuf.stamp, fbuf.id, fbuf.stamp);
+  Fate::reach(Fate::kCaptured, fbuf.stamp);
+    Decoder* dec = dec_.get();
+    held_++;
+    Frames::wrap(fbuf, [this, index, dec]() { dec->release(index); held_--; });
+    fbuf.levels = pyr_->make(fbuf.addr);
+    ready_.push_back(fbuf);
+    wait = 0;
+    num++;
+  }
+  return num;
+}
+
+bool Archive::waitingToRun() {
+
+  if (!archive_on_) {
+
+    files_ = media_files(path_);
+    if (files_.empty()) {
+      if (!quiet_) {
+        fprintf(stderr, "  no recordings under %s\n", path_.c_str());
+      }
+      return false;
+    }
+
+    dbgMsg("open h264 decoder\n");
+    dec_ = Decoder::create("/dev/video10", V4L2_PIX_FMT_H264);
+    if (!dec_->open(width_, height_, false)) {
+      if (!quiet_) {
+        fprintf(stderr, "  no h264 decoder for %ux%u\n", width_, height_);
+      }
+      dec_.reset();
+      return false;
+    }
+
+    origin_ = std::chrono::steady_clock::now();
+    differ_tot_.begin();
+    archive_on_ = true;
+  }
+
+  return true;
+}
+
+bool Archive::running() {
+
+  if (archive_on_ && !done_) {
+
+    // a frame at a time, as tflow takes them
+    if (!ready_.empty() && (!tfl_ || tfl_->hungry())) {
+      if (tfl_) {
+        differ_tfl_.begin();
+        tfl_->addMessage(ready_.front());
+        differ_tfl_.end();
+      }
+      ready_.pop_front();
+    }
+
+    // the decoder's queue only so deep, the frames it has may all be held
+    unsigned int queued = au_cnt_ - std::min(au_cnt_, decode_err_cnt_ + frame_cnt_);
+    bool backed_up = !fed_all_ && queued >= queue_max_;
+    if (ready_.size() < ahead_ && (!backed_up || take(queue_wait_) == 0)) {
+      if (!fed_all_ && feed()) {
+        take(0);
+      } else {
+        if (!fed_all_) {
+          fed_all_ = true;
+          drain_by_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(drain_time_);
+        }
+        take(yield_time_ / 1000);
+        if (ready_.empty() && std::chrono::steady_clock::now() >= drain_by_) {
+          closeFile();
+          done_ = true;
+          if (!quiet_) {
+            fprintf(stderr, "\narchive: done, %u frames of %u files\n", frame_cnt_, file_cnt_);
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+bool Archive::paused() {
+  return true;
+}
+
+bool Archive::waitingToHalt() {
+
+  if (archive_on_) {
+
+    archive_on_ = false;
+    differ_tot_.end();
+    ready_.clear();
+    closeFile();
+
+    // wait for consumers to release their frames
+    dbgMsg("wait for held frames\n");
+    auto limit = std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(release_timeout_);
+    while (held_ != 0 && std::chrono::steady_clock::now() < limit) {
+      std::this_thread::sleep_for(std::chrono::microseconds(yield_time_));
+    }
+    if (held_ != 0) {
+      dbgMsg("warning: %u frames still held, leaving the decoder open\n",
+          static_cast<unsigned int>(held_));
+      dec_.release();
+    } else {
+      dec_.reset();
+    }
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\n\nArchive Results...\n");
+      fprintf(stderr, "       files read (failed): %u (%u)\n", file_cnt_, bad_file_cnt_);
+      fprintf(stderr, "            frames decoded: %u\n", frame_cnt_);
+      fprintf(stderr, "     access units (errors): %u (%u)\n", au_cnt_, decode_err_cnt_);
+      fprintf(stderr, "          media time (sec): %f\n", media_us_ / 1000000.f);
+      fprintf(stderr, "    first frame (ms start): %d\n", first_ms_);
+      fprintf(stderr, "          decode time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_dec_.pct(.5), differ_dec_.pct(.9), differ_dec_.pct(.99), differ_dec_.pct(.999),
+          differ_dec_.high, differ_dec_.avg,
+          differ_dec_.low,  differ_dec_.cnt);
+      fprintf(stderr, "      tflow copy time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_tfl_.pct(.5), differ_tfl_.pct(.9), differ_tfl_.pct(.99), differ_tfl_.pct(.999),
+          differ_tfl_.high, differ_tfl_.avg,
+          differ_tfl_.low,  differ_tfl_.cnt);
+      fprintf(stderr, "           total test time: %f sec\n",
+          differ_tot_.avg / 1000000.f);
+      fprintf(stderr, "         frames per second: %f fps\n",
+          frame_cnt_ * 1000000.f / differ_tot_.avg);
+      fprintf(stderr, "  faster than real time by: %fx\n",
+          media_us_ / static_cast<float>(std::max(differ_tot_.avg, 1u)));
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
@@ -0,0 +1,149 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Stand-in for the Capturer that runs recorded footage through the
+ *  pipeline as fast as it can be detected on.
+ *
+ *  --archive takes a directory (or one file) of the recorder's fmp4
+ *  files and raw h264 '.h264'/'.264' files, in name order.  Each file is
+ *  mapped and indexed up front, fmp4 from its fragments (see mp4.h) and
+ *  raw h264 by its access units at the framerate, then decoded on the
+ *  VideoCore into i420 frames like an ip camera's (see ingest.h).  A
+ *  frame only goes to tflow once it has taken the last one, so none are
+ *  dropped however slow the model is, and the files are one timeline:
+ *  frames are stamped at their media time from the start of the run, so
+ *  the tracker follows across files as it would live.  The journal gets
+ *  each file's recording time (its mtime less its length), so detections
+ *  are logged at when they were recorded.  The session ends when the
+ *  last frame has been handed out.
+ */
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <string>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <chrono>
+
+#include "utils.h"
+#include "listener.h"
+#include "base.h"
+#include "tflow.h"
+#include "pyramid.h"
+#include "decoder.h"
+#include "journal.h"
+#include "mp4.h"
+
+namespace detector {
+
+class Archive : public Base {
+  public:
+    static std::unique_ptr<Archive> create(unsigned int yield_time, bool quiet,
+        Tflow* tfl, const std::string& path, unsigned int framerate,
+        unsigned int width, unsigned int height);
+    virtual ~Archive();
+
+    // detections logged at the files' recording time; before start
+    void setJournal(Journal* jnl);
+
+    // every file read and every frame handed out
+    inline bool done() { return done_; }
+
+    // the metrics endpoint's samples
+    virtual void metrics(Exposition& out, const std::string& labels);
+    virtual void footprint(Footprint& out);
+
+  protected:
+    Archive() = delete;
+    Archive(unsigned int yield_time);
+    bool init(bool quiet, Tflow* tfl, const std::string& path,
+        unsigned int framerate, unsigned int width, unsigned int height);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    Tflow* tfl_;
+    Journal* jnl_;
+    std::string path_;
+    unsigned int framerate_;
+    unsigned int width_;
+    unsigned int height_;
+
+    // the file being read, its access units in decode order
+    std::vector<std::string> files_;
+    unsigned int file_idx_;
+    int fd_;
+    unsigned char* map_;
+    size_t map_len_;
+    bool prefixed_;                   // length prefixed nals, not start codes
+    unsigned int nal_len_;
+    unsigned int timescale_;
+    std::vector<unsigned char> params_;
+    std::vector<Mp4Entry> units_;
+    unsigned int unit_idx_;
+    bool openFile();
+    void closeFile();
+    void indexAnnexB();
+
+    // media time, usec from the start of the run
+    std::chrono::steady_clock::time_point origin_;
+    uint64_t file_us_;
+    uint64_t end_us_;
+
+    std::vector<unsigned char> au_;
+    std::unique_ptr<Decoder> dec_;
+    std::unique_ptr<Pyramid> pyr_;
+    std::deque<FrameBuf> ready_;
+    const unsigned int ahead_ = {2};               // decoded frames waiting
+    const unsigned int queue_max_ = {4};           // access units in the decoder
+    const unsigned int queue_wait_ = {20};         // msec
+    std::atomic<unsigned int> held_;
+    const unsigned int release_timeout_ = {2000};  // msec
+    const unsigned int drain_time_ = {1000};       // msec
+    bool fed_all_;
+    std::chrono::steady_clock::time_point drain_by_;
+    bool feed();
+    unsigned int take(unsigned int wait);
+
+    std::atomic<bool> done_;
+    std::atomic<bool> archive_on_;
+
+    unsigned int file_cnt_;
+    unsigned int bad_file_cnt_;
+    unsigned int frame_cnt_;
+    unsigned int au_cnt_;
+    unsigned int decode_err_cnt_;
+    uint64_t media_us_;
+    int first_ms_;
+    MicroDiffer<uint32_t> differ_dec_;
+    MicroDiffer<uint32_t> differ_tfl_;
+    MicroDiffer<uint32_t> differ_tot_;
+};
+
+} // namespace detector
+
+#endif // ARCHIVE_H
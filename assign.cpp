@@ -0,0 +1,104 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <limits>
+#include <algorithm>
+
+#include "assign.h"
+
+namespace detector {
+
+double* Assignment::costs(unsigned int rows, unsigned int cols) {
+  rows_ = rows;
+  cols_ = cols;
+  cost_.resize(rows * cols);
+  return cost_.data();
+}
+
+void Assignment::solve(std::vector<int>& row_to_col) {
+
+  row_to_col.assign(rows_, -1);
+
+  unsigned int n = std::max(rows_, cols_);
+  if (n == 0) {
+    return;
+  }
+
+  // index 0 is the virtual start column
+  u_.assign(n + 1, 0.0);
+  v_.assign(n + 1, 0.0);
+  minv_.resize(n + 1);
+  match_.assign(n + 1, 0);
+  way_.assign(n + 1, 0);
+  used_.resize(n + 1);
+
+  const double inf = std::numeric_limits<double>::max();
+
+  // add rows one at a time along the shortest augmenting path
+  for (unsigned int r = 1; r <= n; r++) {
+    match_[0] = r;
+    unsigned int c0 = 0;
+    std::fill(minv_.begin(), minv_.end(), inf);
+    std::fill(used_.begin(), used_.end(), 0);
+
+    do {
+      used_[c0] = 1;
+      unsigned int r0 = match_[c0];
+      double delta = inf;
+      unsigned int c1 = 0;
+      for (unsigned int c = 1; c <= n; c++) {
+        if (!used_[c]) {
+          double cur = cost(r0 - 1, c - 1) - u_[r0] - v_[c];
+          if (cur < minv_[c]) {
+            minv_[c] = cur;
+            way_[c] = c0;
+          }
+          if (minv_[c] < delta) {
+            delta = minv_[c];
+            c1 = c;
+          }
+        }
+      }
+      for (unsigned int c = 0; c <= n; c++) {
+        if (used_[c]) {
+          u_[match_[c]] += delta;
+          v_[c] -= delta;
+        } else {
+          minv_[c] -= delta;
+        }
+      }
+      c0 = c1;
+    } while (match_[c0] != 0);
+
+    // flip the path
+    do {
+      unsigned int c1 = way_[c0];
+      match_[c0] = match_[c1];
+      c0 = c1;
+    } while (c0 != 0);
+  }
+
+  for (unsigned int c = 1; c <= n; c++) {
+    unsigned int r = match_[c] - 1;
+    if (r < rows_ && c - 1 < cols_) {
+      row_to_col[r] = c - 1;
+    }
+  }
+}
+
+} // namespace detector
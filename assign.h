@@ -0,0 +1,65 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Linear assignment solver (Jonker-Volgenant shortest augmenting paths).
+ *
+ *  The cost matrix is one flat row-major buffer.  Rectangular problems are
+ *  padded to square with zero cost dummies.  All scratch space is kept
+ *  between solves so a steady scene never allocates.
+ */
+
+#ifndef ASSIGN_H
+#define ASSIGN_H
+
+#include <vector>
+
+namespace detector {
+
+class Assignment {
+  public:
+    Assignment() {}
+    ~Assignment() {}
+
+  public:
+    // resize the cost buffer for 'rows' x 'cols' and hand it back for filling
+    double* costs(unsigned int rows, unsigned int cols);
+
+    // row_to_col[r] is the assigned column or -1
+    void solve(std::vector<int>& row_to_col);
+
+  private:
+    unsigned int rows_ = {0};
+    unsigned int cols_ = {0};
+    std::vector<double> cost_;
+
+    std::vector<double> u_;
+    std::vector<double> v_;
+    std::vector<double> minv_;
+    std::vector<unsigned int> match_;
+    std::vector<unsigned int> way_;
+    std::vector<unsigned char> used_;
+
+    inline double cost(unsigned int r, unsigned int c) {
+      return (r < rows_ && c < cols_) ? cost_[r * cols_ + c] : 0.0;
+    }
+};
+
+} // namespace detector
+
+#endif // ASSIGN_H
@@ -17,14 +17,27 @@
  */
 
 #include <chrono>
+#include <algorithm>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "base.h"
+#include "startup.h"
+#include "loop.h"
 
 namespace detector {
 
 Base::Base(unsigned int yield_time)
   : yield_time_(yield_time),
-    state_(Base::State::kStopped) {
+    priority_(50),
+    policy_(Base::Policy::kRr),
+    sched_ok_(true),
+    tid_(0),
+    state_(Base::State::kStopped),
+    failed_(false),
+    beat_(0) {
 }
 
 Base::~Base() {
@@ -32,28 +45,145 @@ Base::~Base() {
 }
 
 Base::State Base::getState() {
-  std::unique_lock<std::mutex> lck(lock_);
   return state_;
 }
 
-void Base::setState(State s) {
-  std::unique_lock<std::mutex> lck(lock_);
-  state_ = s;
+bool Base::setState(State from, State to) {
+  if (!state_.compare_exchange_strong(from, to)) {
+    return false;
+  }
+  changed();
+  return true;
+}
+
+void Base::changed() {
+  // taking the lock means a waiter is either asleep or sees the new state
+  std::lock_guard<std::mutex> lck(state_lock_);
+  state_cv_.notify_all();
+}
+
+void Base::wake() {
+  if (loop_) {
+    loop_->wake();
+  } else {
+    work_evt_.set();
+  }
+}
+
+bool Base::useLoop() {
+  if (state_ != Base::State::kStopped) {
+    return false;
+  }
+  if (!loop_) {
+    loop_ = Loop::create();
+  }
+  return loop_ != nullptr;
+}
+
+bool Base::failed() {
+  return failed_;
+}
+
+void Base::beat() {
+  beat_ = std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+unsigned int Base::sinceBeat() {
+  using namespace std::chrono;
+  int64_t b = beat_;
+  if (b == 0) {
+    return 0;
+  }
+  auto now = steady_clock::now().time_since_epoch().count();
+  return duration_cast<milliseconds>(steady_clock::duration(now - b)).count();
 }
 
-unsigned int Base::getPriority() {
+void Base::fail(bool halted) {
+  dbgMsg("failed: %s gave up\n", name_.c_str());
+  failed_ = true;
+  if (!halted) {
+    waitingToHalt();
+  }
+  beat_ = 0;
+  state_ = Base::State::kStopped;
+  changed();
+}
+
+int Base::getPriority() {
   return priority_;
 }
 
 bool Base::setPriority(int priority) {
-  sched_param sch_params;
-  sch_params.sched_priority = priority;
+  return setPolicy(policy_, priority);
+}
+
+Base::Policy Base::getPolicy() {
+  return policy_;
+}
+
+bool Base::setPolicy(Policy policy, int priority) {
+  policy_ = policy;
   priority_ = priority;
-  if(pthread_setschedparam(thread_.native_handle(), SCHED_RR, &sch_params)) {
-    dbgMsg("failed to set thread scheduling\n");
-    return false;
+  return tid_ == 0 || applySched();
+}
+
+bool Base::setAffinity(const std::vector<unsigned int>& cpus) {
+  cpus_ = cpus;
+  return tid_ == 0 || applySched();
+}
+
+bool Base::schedOk() {
+  return sched_ok_;
+}
+
+bool Base::applySched() {
+
+  // before the thread is up there is nothing to apply it to
+  pid_t tid = tid_;
+  if (tid == 0) {
+    return true;
   }
-  return true;
+  bool ok = true;
+
+  sched_param sch_params;
+  sch_params.sched_priority = 0;
+  int policy = SCHED_OTHER;
+  if (policy_ == Base::Policy::kFifo) {
+    policy = SCHED_FIFO;
+  } else if (policy_ == Base::Policy::kRr) {
+    policy = SCHED_RR;
+  }
+  if (policy != SCHED_OTHER) {
+    sch_params.sched_priority = std::max(sched_get_priority_min(policy),
+        std::min(priority_, sched_get_priority_max(policy)));
+  }
+  if (sched_setscheduler(tid, policy, &sch_params)) {
+    dbgMsg("failed: %s scheduling\n", name_.c_str());
+    ok = false;
+  }
+  if (policy == SCHED_OTHER && setpriority(PRIO_PROCESS, tid, priority_)) {
+    dbgMsg("failed: %s nice\n", name_.c_str());
+    ok = false;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (cpus_.empty()) {
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+      CPU_SET(i, &set);
+    }
+  } else {
+    for (auto cpu : cpus_) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  if (sched_setaffinity(tid, sizeof(set), &set)) {
+    dbgMsg("failed: %s affinity\n", name_.c_str());
+    ok = false;
+  }
+
+  sched_ok_ = ok;
+  return ok;
 }
 
 std::string Base::getName() {
@@ -62,124 +192,135 @@ std::string Base::getName() {
 
 bool Base::setName(const char* name) {
   if (name) {
-    std::string str(name, max_name_len_);
-    name_ = str;
-    int err = pthread_setname_np(thread_.native_handle(), str.c_str());
-    return err != 0;
+    std::string str(name);
+    name_ = str.substr(0, max_name_len_);
+    if (tid_ != 0) {
+      return pthread_setname_np(thread_.native_handle(), name_.c_str()) == 0;
+    }
   }
   return true;
 }
 
-void Base::wait(State s, int usec) {
-  while (getState() != s) {
-    std::this_thread::sleep_for(std::chrono::microseconds(usec));
-  }
+bool Base::wait(State s) {
+  std::unique_lock<std::mutex> lck(state_lock_);
+  state_cv_.wait(lck, [this, s]() { return state_ == s || failed_; });
+  return !failed_;
 }
 
 bool Base::start(const char* name, int priority) {
-  {
-    std::unique_lock<std::mutex> lck(lock_);
-    if (state_ != Base::State::kStopped) {
-      return false;
-    }
-    state_ = Base::State::kWaitingToPause;
+  if (!setState(Base::State::kStopped, Base::State::kWaitingToPause)) {
+    return false;
   }
 
-  thread_ = std::thread(Base::wrapper0, this);
-  setPriority(priority);
+  // a thread that failed has returned, but not been joined
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  failed_ = false;
+  beat();
+
+  // the thread picks these up itself before the first callback
+  priority_ = priority;
   setName(name);
+  thread_ = std::thread(Base::wrapper0, this);
 
-  wait(Base::State::kPaused, 10);
-  return true;
+  return wait(Base::State::kPaused);
 }
 
-bool Base::run() {
-  {
-    std::unique_lock<std::mutex> lck(lock_);
-    if (state_ == Base::State::kRunning) {
-      return true;
-    }
-
-    if (state_ != Base::State::kPaused) {
-      return false;
-    }
-    state_ = Base::State::kWaitingToRun;
+bool Base::run(bool block) {
+  if (!setState(Base::State::kPaused, Base::State::kWaitingToRun)) {
+    return state_ == Base::State::kRunning ||
+        (!block && state_ == Base::State::kWaitingToRun);
   }
 
-  wait(Base::State::kRunning, 10);
-  return true;
+  wake();
+  return !block || wait(Base::State::kRunning);
 }
 
 bool Base::pause() {
-  {
-    std::unique_lock<std::mutex> lck(lock_);
-    if (state_ == Base::State::kPaused) {
-      return true;
-    }
-
-    if (state_ != Base::State::kRunning) {
-      return false;
-    }
-    state_ = Base::State::kWaitingToPause;
+  if (!setState(Base::State::kRunning, Base::State::kWaitingToPause)) {
+    return state_ == Base::State::kPaused;
   }
 
-  wait(Base::State::kPaused, 10);
-
-  return true;
+  wake();
+  return wait(Base::State::kPaused);
 }
 
 bool Base::stop() {
-  {
-    std::unique_lock<std::mutex> lck(lock_);
-    if (state_ == Base::State::kStopped) {
+  State s = state_;
+  do {
+    if (s == Base::State::kStopped) {
+      if (thread_.joinable()) {
+        thread_.join();
+        tid_ = 0;
+      }
       return true;
     }
+  } while (!state_.compare_exchange_weak(s, Base::State::kWaitingToStop));
 
-    state_ = Base::State::kWaitingToStop;
-  }
-
-  wait(Base::State::kStopped, 10);
+  changed();
+  wake();
+  wait(Base::State::kStopped);
   thread_.join();
+  tid_ = 0;
+  beat_ = 0;
 
   return true;
 }
 
 void Base::wrapper() { 
 
-  while (1) {
-    {
-      std::unique_lock<std::mutex> lck(lock_);
-      if (state_ == Base::State::kWaitingToRun) {
+  pthread_setname_np(pthread_self(), name_.c_str());
+  tid_ = static_cast<pid_t>(syscall(SYS_gettid));
+  applySched();
 
-        if (!waitingToRun()) { return; }
-        state_ = Base::State::kRunning;
+  while (1) {
+    // a control call may change the state while a callback runs,
+    // in which case the single-shot transition is skipped
+    beat();
+    State s = state_;
+    if (s == Base::State::kWaitingToRun) {
+
+      {
+        Startup::Scope step("run");
+        if (!waitingToRun()) { fail(false); return; }
+      }
+      setState(s, Base::State::kRunning);
+      continue;
 
-      } else if (state_ == Base::State::kRunning) {
+    } else if (s == Base::State::kRunning) {
 
-        if (!running()) { return; }
+      if (!running()) { fail(false); return; }
 
-      } else if (state_ == Base::State::kWaitingToPause) {
+    } else if (s == Base::State::kWaitingToPause) {
 
-        if (!waitingToHalt()) { return; }
-        state_ = Base::State::kPaused;
+      if (!waitingToHalt()) { fail(true); return; }
+      setState(s, Base::State::kPaused);
+      continue;
 
-      } else if (state_ == Base::State::kPaused) {
+    } else if (s == Base::State::kPaused) {
 
-        if (!paused()) { return; }
+      if (!paused()) { fail(false); return; }
 
-      } else if (state_ == Base::State::kWaitingToStop) {
+    } else if (s == Base::State::kWaitingToStop) {
 
-        if (!waitingToHalt()) { return; }
-        state_ = Base::State::kStopped;
+      if (!waitingToHalt()) { fail(true); return; }
+      beat_ = 0;
+      setState(s, Base::State::kStopped);
+      continue;
 
-      } else if (state_ == Base::State::kStopped) {
+    } else if (s == Base::State::kStopped) {
 
-        break;
+      break;
 
-      }
     }
 
-    std::this_thread::sleep_for(std::chrono::microseconds(yield_time_));
+    // sleep until there is work
+    if (loop_) {
+      loop_->turn(yield_time_);
+    } else {
+      work_evt_.wait_for(yield_time_);
+    }
   }
 }
 
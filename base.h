@@ -42,6 +42,26 @@
  *  thread falls into one of the 'resting' states ('Paused', 'Running', 'Stopped').
  *
  *  The internal thread is created on 'start' and destroyed on 'stop'.
+ *
+ *  Between callbacks the thread sleeps until 'wake' is called or the yield time
+ *  passes, so stages that call 'wake' when work arrives run without polling delay.
+ *  Wakes that come in while a callback runs add up to one more callback.
+ *  A stage that waits on descriptors asks for a loop (see loop.h) before
+ *  'start' and then sleeps in it instead, so its sockets and timers run
+ *  their handlers on this thread between callbacks, and 'wake' still
+ *  brings the next callback straight away.
+ *
+ *  The thread sets its own scheduling policy and cpu mask before the first
+ *  callback, so any thread it starts (tflite's workers included) inherits them.
+ *
+ *  A callback returning false fails the thread: 'waitingToHalt' still runs so
+ *  the stage lets go of its devices, then it rests in 'Stopped' with 'failed'
+ *  set and 'start' can bring it back.  Every pass through the loop is a
+ *  heartbeat, a thread stuck inside a callback stops beating.
+ *
+ *  Waiting for a state sleeps until the thread reports it got there.
+ *  'run(false)' only asks, so a pipeline can have every stage opening its
+ *  devices at once and then 'wait' for each to be running.
  */
 
 #ifndef BASE_H
@@ -49,15 +69,43 @@
 
 #include <string>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <pthread.h>
 #include <vector>
 #include <atomic>
+#include <memory>
 
 #include "utils.h"
 
 namespace detector {
 
+class Exposition;
+class Loop;
+
+// the buffers a stage owns, by pool, so the pools can be sized to the board
+class Footprint {
+  public:
+    class Pool {
+      public:
+        std::string name;
+        size_t num;       // buffers in it
+        size_t bytes;     // all of them together
+    };
+    inline void add(const char* name, size_t num, size_t bytes) {
+      pools.push_back(Footprint::Pool{name, num, bytes});
+    }
+    inline size_t total() const {
+      size_t sum = 0;
+      for (auto& p : pools) {
+        sum += p.bytes;
+      }
+      return sum;
+    }
+  public:
+    std::vector<Footprint::Pool> pools;
+};
+
 class Base {
   protected:
     Base() = delete;
@@ -75,15 +123,27 @@ class Base {
     };
 
     State getState();
-    void wait(State s, int usec);
+    bool wait(State s);       // until the thread gets to 's', false if it failed
 
     bool start(const char* name, int priority=50);  // creates the thread in kPaused state
-    bool run();               // moves thread to kRunning state
+    bool run(bool block=true);  // moves thread to kRunning state, or just asks to
     bool pause();             // moves thread to kPaused state
     bool stop();              // destroys the thread and leaves in kStopped state
 
-    unsigned int getPriority();
+    enum class Policy {
+      kOther,               // priority is a nice value
+      kFifo,
+      kRr
+    };
+
+    int getPriority();
     bool setPriority(int priority);
+    Policy getPolicy();
+    bool setPolicy(Policy policy, int priority);
+
+    // cpus the thread may run on, empty for any
+    bool setAffinity(const std::vector<unsigned int>& cpus);
+    bool schedOk();           // the last policy and mask took
 
     std::string getName();
     bool setName(const char* name);
@@ -91,12 +151,30 @@ class Base {
     inline unsigned int getSleepTime()                { return yield_time_; }
     inline void setSleepTime(unsigned int yield_time) { yield_time_ = yield_time; }
 
+    void wake();              // run the next callback now
+
+    bool failed();            // a callback gave up, the thread is stopped
+    unsigned int sinceBeat(); // msec since the loop last went round, 0 if stopped
+
+    // the stage's own metrics, asked from another thread
+    virtual void metrics(Exposition& out, const std::string& labels) {}
+
+    // and what it holds, also asked from another thread
+    virtual void footprint(Footprint& out) {}
+
+    // frames it has queued or is still working on, for a drain
+    virtual unsigned int pending() { return 0; }
+
   protected:
     virtual bool waitingToRun()   = 0;  // called once before entering kRunning state
     virtual bool running()        = 0;  // called repeatedly while in kRunning state
     virtual bool paused()         = 0;  // called repeatedly while in kPaused state
     virtual bool waitingToHalt()  = 0;  // called once before entering kStopped or kPaused state
 
+    // sleep in an event loop between callbacks, before 'start'
+    bool useLoop();
+    inline Loop* loop()               { return loop_.get(); }
+
   private:
     void wrapper();                     // wrapper around the loop callbacks
     static void wrapper0(Base* self);
@@ -106,11 +184,26 @@ class Base {
     const unsigned int max_name_len_ = {15};
 
   private:
-    unsigned int priority_;
+    int priority_;
+    Policy policy_;
+    std::vector<unsigned int> cpus_;
+    std::atomic<bool> sched_ok_;
+    std::atomic<pid_t> tid_;
+    bool applySched();
     std::string name_;
-    void setState(State s);
-    State state_;
-    std::mutex lock_;
+    bool setState(State from, State to);
+    std::atomic<State> state_;
+    std::mutex state_lock_;
+    std::condition_variable state_cv_;
+    void changed();
+    std::atomic<bool> failed_;
+
+    // the thread writes it every time round, the watchdog only reads it
+    alignas(64) std::atomic<int64_t> beat_;
+    void beat();
+    void fail(bool halted);
+    Event work_evt_;
+    std::unique_ptr<Loop> loop_;
     std::thread thread_;
 };
 
@@ -0,0 +1,87 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Recycled message batches.
+ *
+ *  The box and track messages are shared vectors.  Making a new one per
+ *  detection or tracker pass means two heap allocations every time, for
+ *  weeks.  A BatchPool makes its vectors up front, with room for the
+ *  most a batch can hold, and hands back one nobody else holds any more
+ *  (the pool's own reference is the only one left), emptied but with its
+ *  storage kept.  Receivers keep them as they always have.  If every
+ *  batch is still out a new one is allocated and counted as a miss.
+ *  One thread takes from a pool.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <memory>
+#include <vector>
+#include <atomic>
+
+namespace detector {
+
+template<typename T>
+class BatchPool {
+  public:
+    BatchPool(unsigned int num, unsigned int cap)
+      : cap_(cap), next_(0), misses_(0) {
+      for (unsigned int i = 0; i < num; i++) {
+        auto b = std::make_shared<std::vector<T>>();
+        b->reserve(cap);
+        batches_.push_back(b);
+      }
+    }
+    ~BatchPool() {}
+
+    std::shared_ptr<std::vector<T>> get() {
+      unsigned int num = batches_.size();
+      for (unsigned int i = 0; i < num; i++) {
+        auto& b = batches_[(next_ + i) % num];
+        if (b.use_count() == 1) {
+          // the last holder's reads come before our writes
+          std::atomic_thread_fence(std::memory_order_acquire);
+          next_ = (next_ + i + 1) % num;
+          b->clear();
+          return b;
+        }
+      }
+      misses_++;
+      auto b = std::make_shared<std::vector<T>>();
+      b->reserve(cap_);
+      return b;
+    }
+
+    unsigned int misses() { return misses_; }
+
+    // what was made up front, the misses are the receivers' to free
+    unsigned int size() { return batches_.size(); }
+    size_t bytes() { return batches_.size() * cap_ * sizeof(T); }
+
+  private:
+    unsigned int cap_;
+    unsigned int next_;
+    std::atomic<unsigned int> misses_;
+    std::vector<std::shared_ptr<std::vector<T>>> batches_;
+};
+
+} // namespace detector
+
+#endif // BATCH_H
@@ -0,0 +1,280 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './pixbench -h' for usage.
+ *
+ * ----------
+ *
+ *  Pixel kernel benchmark ('make bench').
+ *
+ *  Times the utils.cpp kernels the pipeline runs on every frame at the
+ *  usual camera sizes and reports ns per pixel and GB/s, counting the
+ *  bytes each kernel reads and writes once.  Every case runs for a fixed
+ *  time and the median of its passes is kept, so a busy core doesn't
+ *  skew it much.  '-o' saves the results and '-c' compares against a
+ *  saved run and fails if anything got slower by more than '-r' percent.
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <string>
+#include <map>
+#include <chrono>
+#include <cstdio>
+#include <unistd.h>
+
+#include "utils.h"
+#include "pool.h"
+#include "kernels.h"
+
+namespace detector {
+
+class Size {
+  public:
+    unsigned int w;
+    unsigned int h;
+};
+
+static const Size sizes[] = {
+  { 320, 240 }, { 640, 480 }, { 1280, 720 }, { 1920, 1080 }
+};
+
+// tflow's model input
+static const unsigned int model_w = 300;
+static const unsigned int model_h = 300;
+
+class Result {
+  public:
+    std::string name;
+    Size size;
+    double ns_px;
+    double gbs;
+};
+
+class Case {
+  public:
+    std::string name;
+    double bytes_px;      // read and written, per source pixel, 0 if it's not a pass
+    std::function<void()> fn;
+};
+
+static double median_ns(const std::function<void()>& fn, unsigned int msec) {
+  std::vector<double> passes;
+  auto stop = std::chrono::steady_clock::now() + std::chrono::milliseconds(msec);
+  fn();   // warm the caches and the pool
+  do {
+    auto t0 = std::chrono::steady_clock::now();
+    fn();
+    auto t1 = std::chrono::steady_clock::now();
+    passes.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count());
+  } while (std::chrono::steady_clock::now() < stop || passes.size() < 5);
+  std::nth_element(passes.begin(), passes.begin() + passes.size() / 2, passes.end());
+  return passes[passes.size() / 2];
+}
+
+static std::vector<Case> cases(const Size& sz, std::vector<unsigned char>& src,
+    std::vector<unsigned char>& dst) {
+
+  unsigned int w = sz.w, h = sz.h;
+  unsigned int px = w * h;
+  src.assign(px * 3, 0);
+  dst.assign(std::max(px, model_w * model_h) * 3, 0);
+  for (unsigned int i = 0; i < src.size(); i++) {
+    src[i] = static_cast<unsigned char>(i * 7 + (i >> 9));
+  }
+  unsigned char* s = src.data();
+  unsigned char* d = dst.data();
+  Rect full = { 0, 0, w, h };
+  Rect model = { 0, 0, model_w, model_h };
+  double model_px = static_cast<double>(model_w * model_h) / px;
+
+  std::vector<Case> out;
+  const std::pair<const char*, int> fmts[] = {
+    { "yuv420", V4L2_PIX_FMT_YUV420 }, { "yuyv", V4L2_PIX_FMT_YUYV },
+    { "yvyu", V4L2_PIX_FMT_YVYU }, { "nv12", V4L2_PIX_FMT_NV12 },
+    { "nv21", V4L2_PIX_FMT_NV21 },
+  };
+  for (auto& f : fmts) {
+    int fmt = f.second;
+    double in = (fmt == V4L2_PIX_FMT_YUYV || fmt == V4L2_PIX_FMT_YVYU) ? 2.0 : 1.5;
+    out.push_back({ std::string("convert_to_yuv420/") + f.first, in + 1.5,
+        [=]() { convert_to_yuv420(fmt, s, w, h, d, w, h); } });
+    unsigned int stride = (in == 2.0) ? w * 2 : w;
+    out.push_back({ std::string("convert_to_rgb24/") + f.first, in + 3.0,
+        [=]() { convert_to_rgb24(fmt, s, stride, h, d, w * 3, w, h, false); } });
+  }
+  out.push_back({ "convert_rgb24_to_yuv420", 3.0 + 1.5,
+      [=]() { convert_rgb24_to_yuv420(s, w * 3, d, w, h, w, h, false); } });
+  out.push_back({ "convert_yuv420_to_rgb24", 1.5 + 3.0,
+      [=]() { convert_yuv420_to_rgb24(s, d, w, h); } });
+  for (auto& f : fmts) {
+    int fmt = f.second;
+    bool packed = (fmt == V4L2_PIX_FMT_YUYV || fmt == V4L2_PIX_FMT_YVYU);
+    out.push_back({ std::string("tflow_resize/") + f.first, (packed ? 2.0 : 1.5) + 3.0 * model_px,
+        [=]() { convert_to_rgb24_scaled(fmt, s, packed ? w * 2 : w, h, full,
+            d, model_w, model_h, model, 0); } });
+  }
+  out.push_back({ "tflow_resize/rgb24", 3.0 + 3.0 * model_px,
+      [=]() { resize_rgb24(s, w * 3, full, d, model_w, model_h, model, 0); } });
+
+  // a frame's worth of overlay: a few boxes with their labels
+  out.push_back({ "drawRGBBox", 0.0, [=]() {
+      for (unsigned int i = 0; i < 4; i++) {
+        drawRGBBox(4, d, w * 3, w, h, w / 8 + i * w / 8, h / 8, w / 4, h / 2, 0xff, 0x00, 0x00);
+      }
+    } });
+  out.push_back({ "drawRGBText", 0.0, [=]() {
+      for (unsigned int i = 0; i < 4; i++) {
+        drawRGBText(d, w * 3, w, h, w / 8 + i * w / 8, h / 8, "person 87%",
+            0xff, 0xff, 0xff, 0x00, 0x00, 0x00);
+      }
+    } });
+  // what 30 tracks put on a frame, some past its edges
+  std::vector<DrawBox> boxes;
+  for (unsigned int i = 0; i < 30; i++) {
+    boxes.push_back({ { (i % 6) * w / 5, (i / 6) * h / 4, w / 4, h / 3 }, { 0xff, 0x00, 0x00 } });
+  }
+  out.push_back({ "drawRGBBoxes", 0.0, [=]() {
+      drawRGBBoxes(4, d, w * 3, w, h, boxes.data(), boxes.size());
+    } });
+  unsigned char* dy = d;
+  unsigned char* du = d + px;
+  unsigned char* dv = d + px + px / 4;
+  out.push_back({ "drawYUVBox", 0.0, [=]() {
+      for (unsigned int i = 0; i < 4; i++) {
+        drawYUVBox(4, dy, w, du, w / 2, dv, w / 2, w, h,
+            w / 8 + i * w / 8, h / 8, w / 4, h / 2, 0x51, 0x5a, 0xf0);
+      }
+    } });
+  return out;
+}
+
+static bool load(const std::string& path, std::map<std::string, double>& base) {
+  FILE* fd = fopen(path.c_str(), "r");
+  if (!fd) {
+    return false;
+  }
+  char name[128];
+  unsigned int w, h;
+  double ns_px, gbs;
+  while (fscanf(fd, "%127s %ux%u %lf %lf", name, &w, &h, &ns_px, &gbs) == 5) {
+    base[std::string(name) + " " + std::to_string(w) + "x" + std::to_string(h)] = ns_px;
+  }
+  fclose(fd);
+  return true;
+}
+
+void usage() {
+  std::cout << "pixbench -?tkocrs"                 << std::endl;
+  std::cout                                        << std::endl;
+  std::cout << "  where:"                          << std::endl;
+  std::cout << "  ?            = this screen"      << std::endl;
+  std::cout << "  (t)ime       = msec per case (default = 200)" << std::endl;
+  std::cout << "  wor(k)ers    = shared pool workers (default = 0)" << std::endl;
+  std::cout << "  (o)utput     = save the results here (default = none)" << std::endl;
+  std::cout << "  (c)ompare    = against results saved earlier (default = none)" << std::endl;
+  std::cout << "  (r)egression = percent slower that fails a compare (default = 10)" << std::endl;
+  std::cout << "  (s)calar     = no neon rows, even if the cpu has neon" << std::endl;
+}
+
+} // namespace detector
+
+int main(int argc, char** argv) {
+
+  unsigned int msec = 200;
+  unsigned int workers = 0;
+  std::string output;
+  std::string compare;
+  double margin = 10.0;
+
+  int c;
+  while ((c = getopt(argc, argv, ":t:k:o:c:r:s")) != -1) {
+    switch (c) {
+      case 't': msec = std::stoul(optarg);    break;
+      case 'k': workers = std::stoul(optarg); break;
+      case 'o': output = optarg;              break;
+      case 'c': compare = optarg;             break;
+      case 'r': margin = std::stod(optarg);   break;
+      case 's': detector::Kernels::use("scalar"); break;
+      default:  detector::usage();            return -1;
+    }
+  }
+
+  std::map<std::string, double> base;
+  if (!compare.empty() && !detector::load(compare, base)) {
+    fprintf(stderr, "can't read %s\n", compare.c_str());
+    return -1;
+  }
+  if (workers) {
+    detector::Pool::start(workers, {});
+  }
+
+  std::vector<detector::Result> results;
+  std::vector<unsigned char> src, dst;
+  unsigned int slower = 0;
+  fprintf(stderr, "cpu: %s, kernels: %s\n", detector::Cpu::describe().c_str(),
+      detector::Kernels::name());
+  fprintf(stderr, "%-28s %10s %10s %10s\n", "kernel", "size", "ns/px", "GB/s");
+  for (auto& sz : detector::sizes) {
+    for (auto& cs : detector::cases(sz, src, dst)) {
+      double ns = detector::median_ns(cs.fn, msec);
+      double px = static_cast<double>(sz.w) * sz.h;
+      detector::Result res = { cs.name, sz, ns / px, cs.bytes_px * px / ns };
+      results.push_back(res);
+
+      std::string key = cs.name + " " + std::to_string(sz.w) + "x" + std::to_string(sz.h);
+      std::string note;
+      auto it = base.find(key);
+      if (it != base.end() && it->second > 0.0) {
+        double pct = (res.ns_px / it->second - 1.0) * 100.0;
+        char buf[32];
+        snprintf(buf, sizeof(buf), "  %+.1f%%", pct);
+        note = buf;
+        if (pct > margin) {
+          note += " slower";
+          slower++;
+        }
+      }
+      // the overlays only touch a few rows, a rate means little there
+      char size[16], gbs[16];
+      snprintf(size, sizeof(size), "%ux%u", sz.w, sz.h);
+      snprintf(gbs, sizeof(gbs), cs.bytes_px > 0.0 ? "%.3f" : "-", res.gbs);
+      fprintf(stderr, "%-28s %10s %10.3f %10s%s\n",
+          cs.name.c_str(), size, res.ns_px, gbs, note.c_str());
+    }
+  }
+
+  if (!output.empty()) {
+    FILE* fd = fopen(output.c_str(), "w");
+    if (!fd) {
+      fprintf(stderr, "can't write %s\n", output.c_str());
+      return -1;
+    }
+    for (auto& res : results) {
+      fprintf(fd, "%s %ux%u %.4f %.4f\n", res.name.c_str(), res.size.w, res.size.h,
+          res.ns_px, res.gbs);
+    }
+    fclose(fd);
+  }
+
+  detector::Pool::stop();
+  if (slower) {
+    fprintf(stderr, "%u cases more than %.0f%% slower\n", slower, margin);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,564 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include "camera.h"
+
+#ifdef HAVE_LIBCAMERA
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <mutex>
+#include <deque>
+#include <string>
+#include <tuple>
+#include <algorithm>
+
+#include <libcamera/libcamera.h>
+
+
+namespace detector {
+
+namespace lc = libcamera;
+
+// there can only be one manager in a process, shared by every camera
+static std::shared_ptr<lc::CameraManager> manager() {
+  static std::mutex lock;
+  static std::weak_ptr<lc::CameraManager> weak;
+  std::unique_lock<std::mutex> lck(lock);
+  auto mgr = weak.lock();
+  if (!mgr) {
+    mgr = std::make_shared<lc::CameraManager>();
+    if (mgr->start() < 0) {
+      dbgMsg("failed: start camera manager\n");
+      return nullptr;
+    }
+    weak = mgr;
+  }
+  return mgr;
+}
+
+// SRGGB10_CSI2P, R12, ... the bits are the first number in the name
+static unsigned int depthOf(const lc::PixelFormat& pf) {
+  std::string name = pf.toString();
+  size_t at = name.find_first_of("0123456789");
+  return (at == std::string::npos) ? 0 : std::stoul(name.substr(at));
+}
+
+class Camera::Impl {
+  public:
+    std::shared_ptr<lc::CameraManager> mgr;
+    std::shared_ptr<lc::Camera> cam;
+    std::unique_ptr<lc::CameraConfiguration> config;
+    std::unique_ptr<lc::FrameBufferAllocator> alloc;
+    std::vector<std::unique_ptr<lc::Request>> requests;
+    lc::Stream* main = nullptr;
+    lc::Stream* second = nullptr;
+    std::vector<FrameBuf> bufs;
+    std::vector<Level> levels;
+    std::vector<std::pair<void*, size_t>> maps;
+    lc::Rectangle crop_max;
+    SensorMode mode;
+    unsigned int mode_depth = 0;
+    unsigned int stride = 0;
+    int fd_event = -1;
+    bool acquired = false;
+    bool started = false;
+
+    std::mutex lock;
+    std::deque<unsigned int> done;
+    std::unique_ptr<lc::ControlList> pending;
+
+    // on libcamera's thread
+    void completed(lc::Request* req) {
+      if (req->status() == lc::Request::RequestCancelled) {
+        return;
+      }
+      {
+        std::unique_lock<std::mutex> lck(lock);
+        done.push_back(req->cookie());
+      }
+      uint64_t one = 1;
+      if (write(fd_event, &one, sizeof(one)) < 0) {
+        dbgMsg("failed: camera event (errno: %d)\n", errno);
+      }
+    }
+
+    // the part of the active pixel array the configured mode sees
+    void field(SensorMode& m) {
+      auto areas = cam->properties().get(lc::properties::PixelArrayActiveAreas);
+      auto it = cam->controls().find(&lc::controls::ScalerCrop);
+      if (areas && !areas->empty() && (*areas)[0].width && (*areas)[0].height &&
+          it != cam->controls().end()) {
+        lc::Rectangle r = it->second.max().get<lc::Rectangle>();
+        m.field_w = std::min(static_cast<float>(r.width) / (*areas)[0].width, 1.f);
+        m.field_h = std::min(static_cast<float>(r.height) / (*areas)[0].height, 1.f);
+      }
+      auto lim = cam->controls().find(&lc::controls::FrameDurationLimits);
+      if (lim != cam->controls().end() && lim->second.min().get<int64_t>() > 0) {
+        m.fps = 1000000.f / lim->second.min().get<int64_t>();
+      }
+    }
+
+    // the sensor's modes are the raw stream's sizes, each configured in
+    // turn for how fast it goes and what it sees; of those covering the
+    // frame the fast enough first, then the widest, then the smallest
+    void pick(unsigned int width, unsigned int height, unsigned int fps) {
+      mode = SensorMode();
+      mode_depth = 0;
+      std::vector<lc::StreamRole> roles = { lc::StreamRole::Raw };
+      auto raw = cam->generateConfiguration(roles);
+      if (!raw || raw->size() != 1) {
+        dbgMsg("warning: no sensor modes, libcamera picks\n");
+        return;
+      }
+      lc::StreamConfiguration& sc = raw->at(0);
+      lc::StreamFormats formats = sc.formats();
+      std::vector<std::pair<SensorMode, unsigned int>> found;
+      for (auto& pf : formats.pixelformats()) {
+        unsigned int depth = depthOf(pf);
+        for (auto& sz : formats.sizes(pf)) {
+          if (sz.width < width || sz.height < height || !depth) {
+            continue;
+          }
+          if (std::any_of(found.begin(), found.end(), [&](const std::pair<SensorMode, unsigned int>& f) {
+                return f.first.width == sz.width && f.first.height == sz.height && f.second == depth; })) {
+            continue;
+          }
+          sc.pixelFormat = pf;
+          sc.size = sz;
+          sc.bufferCount = 1;
+          if (raw->validate() == lc::CameraConfiguration::Invalid || sc.size != sz ||
+              cam->configure(raw.get()) < 0) {
+            continue;
+          }
+          SensorMode m;
+          m.width = sz.width;
+          m.height = sz.height;
+          field(m);
+          dbgMsg("  sensor mode %ux%u %u bit, %.1f fps, %.0f%% x %.0f%%\n", m.width, m.height,
+              depth, m.fps, m.field_w * 100.f, m.field_h * 100.f);
+          found.push_back({ m, depth });
+        }
+      }
+      if (found.empty()) {
+        dbgMsg("warning: no sensor mode covers %ux%u, libcamera picks\n", width, height);
+        return;
+      }
+      float widest = 0.f;
+      for (auto& f : found) {
+        widest = std::max(widest, f.first.field_w * f.first.field_h);
+      }
+      auto key = [&](const std::pair<SensorMode, unsigned int>& f) {
+        const SensorMode& m = f.first;
+        bool fast = m.fps == 0.f || m.fps + .5f >= fps;
+        bool wide = m.field_w * m.field_h >= widest * .99f;
+        return std::make_tuple(!fast, !wide, m.width * m.height, 32 - f.second);
+      };
+      auto best = std::min_element(found.begin(), found.end(),
+          [&](const std::pair<SensorMode, unsigned int>& a, const std::pair<SensorMode, unsigned int>& b) {
+            return key(a) < key(b); });
+      mode = best->first;
+      mode_depth = best->second;
+    }
+
+    // the image of 'buf', its planes mapped once for all of them
+    unsigned char* map(const lc::FrameBuffer* buf, unsigned int& len) {
+      auto& planes = buf->planes();
+      int fd = planes[0].fd.get();
+      size_t end = 0;
+      len = 0;
+      for (auto& p : planes) {
+        if (p.fd.get() == fd) {
+          end = std::max(end, static_cast<size_t>(p.offset + p.length));
+        }
+        len += p.length;
+      }
+      void* addr = mmap(nullptr, end, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (addr == MAP_FAILED) {
+        dbgMsg("failed: map camera buffer (errno: %d)\n", errno);
+        return nullptr;
+      }
+      maps.push_back({ addr, end });
+      return static_cast<unsigned char*>(addr) + planes[0].offset;
+    }
+};
+
+Camera::Camera() {
+}
+
+Camera::~Camera() {
+  close();
+}
+
+std::unique_ptr<Camera> Camera::create(unsigned int index) {
+  auto obj = std::unique_ptr<Camera>(new Camera());
+  if (!obj->init(index)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Camera::available() {
+  return true;
+}
+
+bool Camera::init(unsigned int index) {
+
+  impl_ = std::unique_ptr<Impl>(new Impl());
+  impl_->mgr = manager();
+  if (!impl_->mgr) {
+    return false;
+  }
+  auto cams = impl_->mgr->cameras();
+  if (index >= cams.size()) {
+    dbgMsg("failed: no camera %u of %zu\n", index, cams.size());
+    return false;
+  }
+  impl_->cam = cams[index];
+  if (impl_->cam->acquire() < 0) {
+    dbgMsg("failed: acquire camera %s\n", impl_->cam->id().c_str());
+    return false;
+  }
+  impl_->acquired = true;
+  impl_->pending = std::unique_ptr<lc::ControlList>(new lc::ControlList(lc::controls::controls));
+  impl_->fd_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return impl_->fd_event != -1;
+}
+
+bool Camera::open(unsigned int width, unsigned int height, unsigned int pix_fmt,
+    bool hflip, bool vflip, unsigned int count, unsigned int fps,
+    unsigned int scaled_width, unsigned int scaled_height) {
+
+  Impl& im = *impl_;
+  im.pick(width, height, fps);
+
+  // v4l2's rgb24 is libcamera's bgr888, byte for byte
+  lc::PixelFormat fmt = (pix_fmt == V4L2_PIX_FMT_YUV420) ? lc::formats::YUV420 : lc::formats::BGR888;
+  std::vector<lc::StreamRole> roles = { lc::StreamRole::VideoRecording };
+  if (scaled_width && scaled_height) {
+    roles.push_back(lc::StreamRole::Viewfinder);
+  }
+  im.config = im.cam->generateConfiguration(roles);
+  if (!im.config || im.config->size() != roles.size()) {
+    dbgMsg("failed: camera streams\n");
+    return false;
+  }
+  lc::StreamConfiguration& full = im.config->at(0);
+  full.pixelFormat = fmt;
+  full.size = lc::Size(width, height);
+  full.bufferCount = count;
+  if (roles.size() > 1) {
+    lc::StreamConfiguration& small = im.config->at(1);
+    small.pixelFormat = lc::formats::BGR888;
+    small.size = lc::Size(scaled_width, scaled_height);
+    small.bufferCount = count;
+  }
+  im.config->orientation = hflip ?
+    (vflip ? lc::Orientation::Rotate180 : lc::Orientation::Rotate0Mirror) :
+    (vflip ? lc::Orientation::Rotate180Mirror : lc::Orientation::Rotate0);
+  if (im.mode_depth) {
+    lc::SensorConfiguration sensor;
+    sensor.bitDepth = im.mode_depth;
+    sensor.outputSize = lc::Size(im.mode.width, im.mode.height);
+    im.config->sensorConfig = sensor;
+    if (im.config->validate() == lc::CameraConfiguration::Invalid) {
+      dbgMsg("warning: sensor mode %ux%u refused, libcamera picks\n", im.mode.width, im.mode.height);
+      im.config->sensorConfig.reset();
+      im.mode = SensorMode();
+      im.mode_depth = 0;
+    }
+  }
+
+  // the pipeline is built for one size, so no adjusting it
+  if (im.config->validate() == lc::CameraConfiguration::Invalid ||
+      full.size != lc::Size(width, height) || full.pixelFormat != fmt) {
+    dbgMsg("failed: camera can't give %ux%u %s\n", width, height, fmt.toString().c_str());
+    return false;
+  }
+  if (roles.size() > 1 && im.config->at(1).size != lc::Size(scaled_width, scaled_height)) {
+    dbgMsg("failed: camera can't scale to %ux%u\n", scaled_width, scaled_height);
+    return false;
+  }
+  if (im.cam->configure(im.config.get()) < 0) {
+    dbgMsg("failed: configure camera\n");
+    return false;
+  }
+  im.main = full.stream();
+  im.stride = full.stride;
+  im.second = (roles.size() > 1) ? im.config->at(1).stream() : nullptr;
+
+  auto it = im.cam->controls().find(&lc::controls::ScalerCrop);
+  if (it != im.cam->controls().end()) {
+    im.crop_max = it->second.max().get<lc::Rectangle>();
+  }
+  im.field(im.mode);
+
+  // a request per buffer, each with its frame and its scaled copy
+  im.alloc = std::unique_ptr<lc::FrameBufferAllocator>(new lc::FrameBufferAllocator(im.cam));
+  for (auto& c : *im.config) {
+    if (im.alloc->allocate(c.stream()) < 0) {
+      dbgMsg("failed: camera buffers\n");
+      return false;
+    }
+  }
+  auto& fulls = im.alloc->buffers(im.main);
+  size_t num = fulls.size();
+  if (im.second) {
+    num = std::min(num, im.alloc->buffers(im.second).size());
+  }
+  for (size_t i = 0; i < num; i++) {
+    auto req = im.cam->createRequest(i);
+    if (!req || req->addBuffer(im.main, fulls[i].get()) < 0) {
+      dbgMsg("failed: camera request %zu\n", i);
+      return false;
+    }
+    FrameBuf fb;
+    fb.addr = im.map(fulls[i].get(), fb.length);
+    fb.fd = fulls[i]->planes()[0].fd.get();
+    if (!fb.addr) {
+      return false;
+    }
+    im.bufs.push_back(fb);
+
+    if (im.second) {
+      auto& small = im.alloc->buffers(im.second)[i];
+      if (req->addBuffer(im.second, small.get()) < 0) {
+        dbgMsg("failed: camera scaled request %zu\n", i);
+        return false;
+      }
+      unsigned int len = 0;
+      Level lvl;
+      lvl.addr = im.map(small.get(), len);
+      lvl.width = scaled_width;
+      lvl.height = scaled_height;
+      lvl.stride = im.config->at(1).stride;
+      lvl.slice = scaled_height;
+      if (!lvl.addr) {
+        return false;
+      }
+      im.levels.push_back(lvl);
+    }
+    im.requests.push_back(std::move(req));
+  }
+  im.cam->requestCompleted.connect(&im, &Camera::Impl::completed);
+  return true;
+}
+
+void Camera::close() {
+
+  if (!impl_) {
+    return;
+  }
+  Impl& im = *impl_;
+  stop();
+  if (im.cam) {
+    im.cam->requestCompleted.disconnect(&im, &Camera::Impl::completed);
+  }
+  im.requests.clear();
+  for (auto& m : im.maps) {
+    munmap(m.first, m.second);
+  }
+  im.maps.clear();
+  im.bufs.clear();
+  im.levels.clear();
+  im.alloc.reset();
+  im.config.reset();
+  if (im.acquired) {
+    im.cam->release();
+    im.acquired = false;
+  }
+  im.cam.reset();
+  if (im.fd_event != -1) {
+    ::close(im.fd_event);
+    im.fd_event = -1;
+  }
+}
+
+bool Camera::start() {
+
+  Impl& im = *impl_;
+  std::unique_lock<std::mutex> lck(im.lock);
+  if (im.cam->start(im.pending.get()) < 0) {
+    dbgMsg("failed: start camera\n");
+    return false;
+  }
+  im.pending->clear();
+  im.started = true;
+  return true;
+}
+
+void Camera::stop() {
+
+  Impl& im = *impl_;
+  if (im.started) {
+    im.cam->stop();
+    im.started = false;
+  }
+  std::unique_lock<std::mutex> lck(im.lock);
+  im.done.clear();
+}
+
+std::vector<FrameBuf>& Camera::buffers() {
+  return impl_->bufs;
+}
+
+unsigned int Camera::stride() {
+  return impl_->stride;
+}
+
+int Camera::fd() {
+  return impl_->fd_event;
+}
+
+const SensorMode& Camera::mode() {
+  return impl_->mode;
+}
+
+bool Camera::dequeue(unsigned int& index, std::chrono::steady_clock::time_point& stamp) {
+
+  Impl& im = *impl_;
+  std::unique_lock<std::mutex> lck(im.lock);
+
+  // the eventfd stays readable until the last one is taken
+  bool some = !im.done.empty();
+  if (some) {
+    index = im.done.front();
+    im.done.pop_front();
+  }
+  if (im.done.empty()) {
+    uint64_t cnt;
+    if (read(im.fd_event, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+      dbgMsg("failed: read camera event (errno: %d)\n", errno);
+    }
+  }
+  if (!some) {
+    return false;
+  }
+
+  // sensor stamps are monotonic, steady_clock's epoch
+  uint64_t ns = im.requests[index]->buffers().at(im.main)->metadata().timestamp;
+  stamp = ns ? std::chrono::steady_clock::time_point(std::chrono::nanoseconds(ns)) :
+    std::chrono::steady_clock::now();
+  return true;
+}
+
+bool Camera::queue(unsigned int index) {
+
+  Impl& im = *impl_;
+  lc::Request* req = im.requests[index].get();
+  req->reuse(lc::Request::ReuseBuffers);
+  {
+    std::unique_lock<std::mutex> lck(im.lock);
+    if (!im.pending->empty()) {
+      req->controls().merge(*im.pending);
+      im.pending->clear();
+    }
+  }
+  if (im.cam->queueRequest(req) < 0) {
+    dbgMsg("failed: queue camera request %u\n", index);
+    return false;
+  }
+  return true;
+}
+
+const Level* Camera::scaled(unsigned int index) {
+  return (index < impl_->levels.size()) ? &impl_->levels[index] : nullptr;
+}
+
+void Camera::setFramerate(unsigned int fps) {
+  int64_t usec = 1000000 / std::max(fps, 1u);
+  std::unique_lock<std::mutex> lck(impl_->lock);
+  impl_->pending->set(lc::controls::FrameDurationLimits, lc::Span<const int64_t, 2>({ usec, usec }));
+}
+
+void Camera::setExposure(unsigned int usec) {
+  // 0 leaves it to the camera's agc
+  std::unique_lock<std::mutex> lck(impl_->lock);
+  impl_->pending->set(lc::controls::ExposureTime, static_cast<int32_t>(usec));
+}
+
+void Camera::setGain(unsigned int gain) {
+  std::unique_lock<std::mutex> lck(impl_->lock);
+  impl_->pending->set(lc::controls::AnalogueGain, static_cast<float>(gain));
+}
+
+void Camera::setCrop(const Rect& crop) {
+
+  Impl& im = *impl_;
+  if (im.crop_max.isNull()) {
+    dbgMsg("warning: no crop on this camera\n");
+    return;
+  }
+  lc::Rectangle r = im.crop_max;
+  if (crop.w != 0 && crop.h != 0) {
+    unsigned int x = std::min(crop.x, im.crop_max.width - 2);
+    unsigned int y = std::min(crop.y, im.crop_max.height - 2);
+    r.x = im.crop_max.x + x;
+    r.y = im.crop_max.y + y;
+    r.width = std::min(crop.w, im.crop_max.width - x);
+    r.height = std::min(crop.h, im.crop_max.height - y);
+  }
+  std::unique_lock<std::mutex> lck(im.lock);
+  im.pending->set(lc::controls::ScalerCrop, r);
+}
+
+} // namespace detector
+
+#else
+
+namespace detector {
+
+class Camera::Impl {
+};
+
+Camera::Camera() {
+}
+
+Camera::~Camera() {
+}
+
+std::unique_ptr<Camera> Camera::create(unsigned int index) {
+  dbgMsg("failed: built without libcamera\n");
+  return nullptr;
+}
+
+bool Camera::available() { return false; }
+bool Camera::init(unsigned int index) { return false; }
+bool Camera::open(unsigned int, unsigned int, unsigned int, bool, bool, unsigned int,
+    unsigned int, unsigned int, unsigned int) { return false; }
+void Camera::close() {}
+bool Camera::start() { return false; }
+void Camera::stop() {}
+std::vector<FrameBuf>& Camera::buffers() { static std::vector<FrameBuf> none; return none; }
+unsigned int Camera::stride() { return 0; }
+int Camera::fd() { return -1; }
+const SensorMode& Camera::mode() { static SensorMode none; return none; }
+bool Camera::dequeue(unsigned int&, std::chrono::steady_clock::time_point&) { return false; }
+bool Camera::queue(unsigned int) { return false; }
+const Level* Camera::scaled(unsigned int) { return nullptr; }
+void Camera::setFramerate(unsigned int) {}
+void Camera::setExposure(unsigned int) {}
+void Camera::setGain(unsigned int) {}
+void Camera::setCrop(const Rect&) {}
+
+} // namespace detector
+
+#endif // HAVE_LIBCAMERA
@@ -0,0 +1,116 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  libcamera capture (Raspberry Pi OS from bullseye on, the Pi 5).
+ *
+ *  Newer kernels no longer have the legacy bcm2835-v4l2 camera, the
+ *  sensor goes through libcamera's pipeline handler instead.  This wraps
+ *  it in the few calls the capturer makes of a v4l2 device: a ring of
+ *  requests made once at 'open', 'queue' and 'dequeue' by index, and an
+ *  eventfd for the capturer's epoll set that is readable while a request
+ *  is done.  The buffers are libcamera's dmabufs, mapped once, so they
+ *  go to the encoder as they are.  A second, model sized rgb24 stream is
+ *  scaled by the isp into the same requests and comes with each frame.
+ *  Frame rate, exposure, gain and the crop go with the next request.
+ *
+ *  The sensor mode is ours to pick rather than the pipeline handler's,
+ *  whose pick weighs size alone: of the modes that cover the frame the
+ *  smallest that keeps up with the frame rate and sees as much of the
+ *  pixel array as any, so a binned mode is read out and scaled instead
+ *  of the whole array or a window of it.
+ *
+ *  Without HAVE_LIBCAMERA (see the Makefile) 'create' gives nullptr.
+ */
+
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include <memory>
+#include <vector>
+#include <chrono>
+
+#include "utils.h"
+#include "listener.h"
+#include "pyramid.h"
+
+namespace detector {
+
+// a sensor mode, how fast it can go and how much of the pixel array it
+// sees, 0 where the driver doesn't say
+class SensorMode {
+  public:
+    unsigned int width = 0;
+    unsigned int height = 0;
+    float fps = 0.f;
+    float field_w = 0.f;      // 0..1 of the array
+    float field_h = 0.f;
+};
+
+class Camera {
+  public:
+    // the 'index'th camera libcamera knows of
+    static std::unique_ptr<Camera> create(unsigned int index);
+    ~Camera();
+
+    // false when built without libcamera
+    static bool available();
+
+  public:
+    // pix_fmt is the v4l2 one, i420 or rgb24, 'fps' picks the sensor mode
+    // with the size, and the second stream is left out when
+    // 'scaled_width' is 0
+    bool open(unsigned int width, unsigned int height, unsigned int pix_fmt,
+        bool hflip, bool vflip, unsigned int count, unsigned int fps,
+        unsigned int scaled_width, unsigned int scaled_height);
+    void close();
+    bool start();
+    void stop();
+
+    // the frames, 'fd' is the dmabuf and stays ours
+    std::vector<FrameBuf>& buffers();
+    unsigned int stride();
+    int fd();
+
+    // the sensor mode open took
+    const SensorMode& mode();
+
+    // the next finished request, false when there is none
+    bool dequeue(unsigned int& index, std::chrono::steady_clock::time_point& stamp);
+    bool queue(unsigned int index);
+
+    // the second stream's image in request 'index', nullptr without one
+    const Level* scaled(unsigned int index);
+
+    void setFramerate(unsigned int fps);
+    void setExposure(unsigned int usec);
+    void setGain(unsigned int gain);
+    void setCrop(const Rect& crop);
+
+  protected:
+    Camera();
+    bool init(unsigned int index);
+
+  private:
+    class Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+} // namespace detector
+
+#endif // CAMERA_H
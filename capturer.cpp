@@ -25,12 +25,25 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/dma-heap.h>
+#include <unistd.h>
 #include <errno.h>
 #include <string>
 #include <algorithm>
 #include <cmath>
+#include <chrono>
+#include <thread>
 
 #include "capturer.h"
+#include "frames.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "fate.h"
+#include "startup.h"
+#include "deadline.h"
 
 namespace detector {
 
@@ -40,22 +53,517 @@ Capturer::Capturer(unsigned int yieldtime)
 }
 
 Capturer::~Capturer() {
+  if (host_) {
+    host_->detach(this);
+  }
+  if (fd_epoll_ != -1) {
+    close(fd_epoll_);
+  }
+  if (fd_event_ != -1) {
+    close(fd_event_);
+  }
 }
 
 std::unique_ptr<Capturer> Capturer::create(unsigned int yield_time, bool quiet, 
     Encoder* enc, Tflow* tfl, unsigned int device, unsigned int framerate, 
-    int width, int height) {
+    int width, int height, bool direct, unsigned int pix_fmt) {
   auto obj = std::unique_ptr<Capturer>(new Capturer(yield_time));
-  obj->init(quiet, enc, tfl, device, framerate, width, height);
+  obj->init(quiet, enc, tfl, device, framerate, width, height, direct, pix_fmt);
   return obj;
 }
 
+void Capturer::setPublisher(Publisher* pub) {
+  pub_ = pub;
+}
+
+void Capturer::setHost(Capturer* host) {
+  host_ = (host != this) ? host : nullptr;
+}
+
+void Capturer::setScaled(Capturer* full) {
+  scales_ = full;
+  setHost(full);
+}
+
+const char* Capturer::memoryStr(Capturer::Memory mem) {
+  switch (mem) {
+    case Capturer::Memory::kMmap:    return "mmap";
+    case Capturer::Memory::kDmabuf:  return "dmabuf";
+    case Capturer::Memory::kUserptr: return "userptr";
+  }
+  return "unknown";
+}
+
+void Capturer::setMemory(Capturer::Memory mem) {
+  memory_ = mem;
+}
+
+void Capturer::setBuffers(unsigned int num) {
+  framebuf_num_ = std::max(num, starve_at_ + 1);
+  framebuf_pool_.assign(framebuf_num_, FrameBuf());
+}
+
+void Capturer::setCrop(const Rect& crop) {
+  std::unique_lock<std::mutex> lck(crop_lock_);
+  crop_ = crop;
+  crop_dirty_ = true;
+}
+
+Rect Capturer::getCrop() {
+  std::unique_lock<std::mutex> lck(crop_lock_);
+  return crop_;
+}
+
+bool Capturer::applyCrop() {
+
+  Rect crop = getCrop();
+  crop_dirty_ = false;
+  if (cam_) {
+    cam_->setCrop(crop);
+    return true;
+  }
+
+  // the sensor area the driver can crop from, everything if it's empty
+  struct v4l2_selection sel;
+  memset(&sel, 0, sizeof(sel));
+  sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  sel.target = V4L2_SEL_TGT_CROP_BOUNDS;
+  if (xioctl(fd_video_, VIDIOC_G_SELECTION, &sel) < 0) {
+    dbgMsg("warning: no crop on device %d (errno: %d)\n", device_, errno);
+    return false;
+  }
+  struct v4l2_rect bounds = sel.r;
+  sel.target = V4L2_SEL_TGT_CROP;
+  if (crop.w != 0 && crop.h != 0) {
+    sel.r.left = bounds.left + std::min(crop.x, bounds.width - 2);
+    sel.r.top = bounds.top + std::min(crop.y, bounds.height - 2);
+    sel.r.width = std::min(crop.w, bounds.width - (sel.r.left - bounds.left));
+    sel.r.height = std::min(crop.h, bounds.height - (sel.r.top - bounds.top));
+  }
+  if (xioctl(fd_video_, VIDIOC_S_SELECTION, &sel) < 0) {
+    dbgMsg("failed: set crop %d,%d %ux%u (errno: %d)\n", 
+        sel.r.left, sel.r.top, sel.r.width, sel.r.height, errno);
+    return false;
+  }
+  dbgMsg("crop %d,%d %ux%u\n", sel.r.left, sel.r.top, sel.r.width, sel.r.height);
+  return true;
+}
+
+void Capturer::setFramerate(unsigned int fps) {
+  want_fps_ = std::max(fps, 1u);
+  ctrl_dirty_ = true;
+}
+
+unsigned int Capturer::getFramerate() {
+  return want_fps_;
+}
+
+void Capturer::setExposure(unsigned int usec) {
+  exposure_ = usec;
+  ctrl_dirty_ = true;
+}
+
+unsigned int Capturer::getExposure() {
+  return exposure_;
+}
+
+void Capturer::setGain(unsigned int gain) {
+  gain_ = gain;
+  ctrl_dirty_ = true;
+}
+
+unsigned int Capturer::getGain() {
+  return gain_;
+}
+
+bool Capturer::setCtrl(unsigned int id, int value, bool clamp) {
+
+  struct v4l2_queryctrl queryctrl;
+  memset(&queryctrl, 0, sizeof(queryctrl));
+  queryctrl.id = id;
+  if (xioctl(fd_video_, VIDIOC_QUERYCTRL, &queryctrl) < 0 ||
+      (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED)) {
+    return false;
+  }
+  struct v4l2_control control;
+  memset(&control, 0, sizeof(control));
+  control.id = id;
+  control.value = clamp ? std::min(std::max(value, queryctrl.minimum), queryctrl.maximum) : value;
+  if (xioctl(fd_video_, VIDIOC_S_CTRL, &control) < 0) {
+    dbgMsg("failed: set control 0x%x to %d (errno: %d)\n", id, control.value, errno);
+    return false;
+  }
+  return true;
+}
+
+bool Capturer::setStreamRate(unsigned int fps) {
+
+  struct v4l2_streamparm params;
+  memset(&params, 0, sizeof(params));
+  params.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(fd_video_, VIDIOC_G_PARM, &params) < 0) {
+    dbgMsg("failed: get stream params\n");
+    return false;
+  }
+  params.parm.capture.timeperframe.numerator = 1;
+  params.parm.capture.timeperframe.denominator = fps;
+  params.parm.capture.capturemode |= V4L2_CAP_TIMEPERFRAME;
+  if (xioctl(fd_video_, VIDIOC_S_PARM, &params) < 0) {
+    dbgMsg("failed: set stream params %u fps (errno: %d)\n", fps, errno);
+    return false;
+  }
+  return true;
+}
+
+bool Capturer::applyControls() {
+
+  ctrl_dirty_ = false;
+  bool ok = true;
+
+  // libcamera takes them all with the next request
+  unsigned int fps = want_fps_;
+  if (cam_) {
+    if (fps != framerate_) {
+      cam_->setFramerate(fps);
+      framerate_ = fps;
+      fps_cnt_++;
+    }
+    cam_->setExposure(exposure_);
+    cam_->setGain(gain_);
+    return true;
+  }
+  if (fps != framerate_) {
+    if (setStreamRate(fps)) {
+      framerate_ = fps;
+      fps_cnt_++;
+    } else {
+      want_fps_ = framerate_;
+      fps_fail_cnt_++;
+      ok = false;
+    }
+  }
+
+  // exposure is in 100 usec steps, either control may be missing
+  unsigned int usec = exposure_;
+  if (usec) {
+    setCtrl(V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_MANUAL, false);
+    ok = setCtrl(V4L2_CID_EXPOSURE_ABSOLUTE, (usec + 50) / 100, true) && ok;
+  } else {
+    setCtrl(V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_AUTO, false);
+  }
+  unsigned int gain = gain_;
+  setCtrl(V4L2_CID_AUTOGAIN, gain == 0, false);
+  if (gain) {
+    ok = (setCtrl(V4L2_CID_ANALOGUE_GAIN, gain, true) || setCtrl(V4L2_CID_GAIN, gain, true)) && ok;
+  }
+  return ok;
+}
+
+bool Capturer::setCamera(int index, unsigned int scaled_width, unsigned int scaled_height) {
+  if (!Camera::available()) {
+    return false;
+  }
+  cam_index_ = index;
+  cam_scaled_width_ = (scaled_height != 0) ? scaled_width : 0;
+  cam_scaled_height_ = (scaled_width != 0) ? scaled_height : 0;
+  return true;
+}
+
+bool Capturer::setRotate(unsigned int degrees) {
+  if (stream_on_ || (degrees != 0 && degrees != 90 && degrees != 180 && degrees != 270)) {
+    return false;
+  }
+  rotate_ = degrees;
+  bool quarter = (rotate_ == 90 || rotate_ == 270);
+  unsigned int pix_fmt = (formats_.back() == V4L2_PIX_FMT_MJPEG) ? V4L2_PIX_FMT_YUV420 : formats_[0];
+  pyr_ = Pyramid::create(quarter ? height_ : width_, quarter ? width_ : height_, pix_fmt);
+  return true;
+}
+
+// the sensor's flips, then the turn, as one pass of orient_plane
+void Capturer::orientation() {
+
+  bool h = soft_hflip_;
+  bool v = soft_vflip_;
+  switch (rotate_) {
+    case 90:  orient_swap_ = true;  orient_mirror_ = !v; orient_flip_ = h;  break;
+    case 180: orient_swap_ = false; orient_mirror_ = !h; orient_flip_ = !v; break;
+    case 270: orient_swap_ = true;  orient_mirror_ = v;  orient_flip_ = !h; break;
+    default:  orient_swap_ = false; orient_mirror_ = h;  orient_flip_ = v;  break;
+  }
+  orienting_ = orient_swap_ || orient_mirror_ || orient_flip_;
+  if (orienting_ && !quiet_) {
+    fprintf(stderr, "capture: %s%s%s in software\n",
+        (soft_hflip_ || soft_vflip_) ? "flip" : "",
+        ((soft_hflip_ || soft_vflip_) && rotate_) ? " and " : "",
+        rotate_ ? (rotate_ == 180 ? "half turn" : "quarter turn") : "");
+  }
+}
+
+// the sensor flips if it can, otherwise we do
+void Capturer::setFlip(unsigned int id, bool on, bool& soft) {
+
+  const char* name = (id == V4L2_CID_HFLIP) ? "horizontal" : "vertical";
+  soft = false;
+  struct v4l2_queryctrl queryctrl;
+  memset(&queryctrl, 0, sizeof(queryctrl));
+  queryctrl.id = id;
+  if (xioctl(fd_video_, VIDIOC_QUERYCTRL, &queryctrl) < 0 ||
+      (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED)) {
+    dbgMsg("warning: %s flip not supported\n", name);
+    soft = on;
+    return;
+  }
+  struct v4l2_control control;
+  memset(&control, 0, sizeof (control));
+  control.id = id;
+  if (xioctl(fd_video_, VIDIOC_G_CTRL, &control) < 0) {
+    dbgMsg("failed: get %s flip\n", name);
+  }
+  control.value = on;
+  if (xioctl(fd_video_, VIDIOC_S_CTRL, &control) < 0) {
+    dbgMsg("warning: set %s flip refused\n", name);
+    soft = on;
+  }
+}
+
+// the fastest the driver goes at a size, 0 if it doesn't say
+float Capturer::maxRate(unsigned int width, unsigned int height) {
+
+  float fps = 0.f;
+  struct v4l2_frmivalenum fi;
+  memset(&fi, 0, sizeof(fi));
+  fi.pixel_format = pix_fmt_;
+  fi.width = width;
+  fi.height = height;
+  for (fi.index = 0; xioctl(fd_video_, VIDIOC_ENUM_FRAMEINTERVALS, &fi) == 0; fi.index++) {
+    const struct v4l2_fract& f = (fi.type == V4L2_FRMIVAL_TYPE_DISCRETE) ?
+      fi.discrete : fi.stepwise.min;
+    if (f.numerator) {
+      fps = std::max(fps, static_cast<float>(f.denominator) / f.numerator);
+    }
+    if (fi.type != V4L2_FRMIVAL_TYPE_DISCRETE) {
+      break;
+    }
+  }
+  return fps;
+}
+
+// a driver that lists sizes is the sensor's, they can't be scaled to
+// and one that isn't the frame's would have the whole pipeline at the
+// wrong size; a range is the driver scaling, from a mode of its own
+// picked from the size and the rate, so the rate goes in first
+bool Capturer::pickMode() {
+
+  std::vector<SensorMode> modes;
+  struct v4l2_frmsizeenum fs;
+  memset(&fs, 0, sizeof(fs));
+  fs.pixel_format = pix_fmt_;
+  for (fs.index = 0; xioctl(fd_video_, VIDIOC_ENUM_FRAMESIZES, &fs) == 0; fs.index++) {
+    if (fs.type != V4L2_FRMSIZE_TYPE_DISCRETE) {
+      break;
+    }
+    SensorMode m;
+    m.width = fs.discrete.width;
+    m.height = fs.discrete.height;
+    m.fps = maxRate(m.width, m.height);
+    dbgMsg("  mode %ux%u, %.1f fps\n", m.width, m.height, m.fps);
+    modes.push_back(m);
+  }
+
+  mode_ = SensorMode();
+  if (modes.empty()) {
+    mode_.fps = maxRate(width_, height_);
+  } else {
+    auto it = std::find_if(modes.begin(), modes.end(), [&](const SensorMode& m) {
+        return m.width == width_ && m.height == height_; });
+    if (it == modes.end()) {
+      if (!quiet_) {
+        fprintf(stderr, "capture: device %u has no %ux%u %s, it has", device_, width_, height_,
+            PixelFormatToStr(pix_fmt_));
+        for (auto& m : modes) {
+          fprintf(stderr, " %ux%u", m.width, m.height);
+        }
+        fprintf(stderr, "\n");
+      }
+      return false;
+    }
+    mode_ = *it;
+  }
+
+  // a rate it can't keep would be refused, or quietly halved
+  if (mode_.fps != 0.f && want_fps_ > mode_.fps + .5f) {
+    dbgMsg("warning: %u fps is more than %ux%u goes, %.1f\n", static_cast<unsigned int>(want_fps_),
+        width_, height_, mode_.fps);
+    want_fps_ = std::max(static_cast<unsigned int>(mode_.fps), 1u);
+  }
+  return true;
+}
+
+// the crop the format came with, before any of ours, against the array
+void Capturer::field() {
+
+  struct v4l2_selection sel;
+  memset(&sel, 0, sizeof(sel));
+  sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  sel.target = V4L2_SEL_TGT_NATIVE_SIZE;
+  if (xioctl(fd_video_, VIDIOC_G_SELECTION, &sel) < 0) {
+    sel.target = V4L2_SEL_TGT_CROP_BOUNDS;
+    if (xioctl(fd_video_, VIDIOC_G_SELECTION, &sel) < 0) {
+      return;
+    }
+  }
+  struct v4l2_rect array = sel.r;
+  sel.target = V4L2_SEL_TGT_CROP;
+  if (xioctl(fd_video_, VIDIOC_G_SELECTION, &sel) < 0 || !array.width || !array.height) {
+    return;
+  }
+  mode_.field_w = std::min(static_cast<float>(sel.r.width) / array.width, 1.f);
+  mode_.field_h = std::min(static_cast<float>(sel.r.height) / array.height, 1.f);
+}
+
+void Capturer::reportMode() {
+
+  if (quiet_) {
+    return;
+  }
+  fprintf(stderr, "capture: ");
+  if (mode_.width) {
+    fprintf(stderr, "sensor mode %ux%u, ", mode_.width, mode_.height);
+  }
+  if (mode_.fps != 0.f) {
+    fprintf(stderr, "up to %.1f fps, ", mode_.fps);
+  }
+  if (mode_.field_w != 0.f) {
+    fprintf(stderr, "sees %.0f%% x %.0f%% of the sensor\n",
+        mode_.field_w * 100.f, mode_.field_h * 100.f);
+  } else {
+    fprintf(stderr, "field of view unknown\n");
+  }
+}
+
+bool Capturer::setMjpeg(bool on) {
+  if (formats_.back() != V4L2_PIX_FMT_MJPEG) {
+    return !on;
+  }
+  if (on && formats_.size() > 1) {
+    formats_.erase(formats_.begin());
+  }
+  return true;
+}
+
+void Capturer::attach(Capturer* guest) {
+  std::unique_lock<std::mutex> lck(serve_lock_);
+  if (std::find(served_.begin(), served_.end(), guest) == served_.end()) {
+    guest->armed_ = false;
+    served_.push_back(guest);
+  }
+  kick();
+}
+
+void Capturer::detach(Capturer* guest) {
+  std::unique_lock<std::mutex> lck(serve_lock_);
+  unserve(guest);
+}
+
+void Capturer::unserve(Capturer* guest) {
+  auto it = std::find(served_.begin(), served_.end(), guest);
+  if (it == served_.end() || guest == this) {
+    return;
+  }
+  arm(guest, false);
+  served_.erase(it);
+  if (guest->scales_ == this) {
+    latest_ = FrameBuf();
+  }
+}
+
+void Capturer::arm(Capturer* cap, bool on) {
+
+  // a device with no buffers queued reports an error until it has one
+  if (cap->armed_ == on) {
+    return;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = cap;
+  if (epoll_ctl(fd_epoll_, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, cap->fd_video_, &ev) < 0) {
+    dbgMsg("failed: epoll %s device %d (errno: %d)\n", 
+        on ? "add" : "remove", cap->device_, errno);
+    return;
+  }
+  cap->armed_ = on;
+  if (on) {
+    cap->last_ms_ = since_start_ms();
+  }
+}
+
+void Capturer::kick() {
+  uint64_t one = 1;
+  if (write(fd_event_, &one, sizeof(one)) < 0) {
+    dbgMsg("failed: kick capture (errno: %d)\n", errno);
+  }
+}
+
+void Capturer::metrics(Exposition& out, const std::string& labels) {
+  out.counter("detector_frames_total", "frames captured", labels, frame_cnt_);
+  out.counter("detector_capture_timeouts_total", "frames the camera didn't deliver in time",
+      labels, timeout_cnt_);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"tflow_copy\"", differ_tfl_.hist);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"encode_copy\"", differ_enc_.hist);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"jpeg_decode\"", differ_dec_.hist);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"orient\"", differ_orient_.hist);
+  out.counter("detector_decode_errors_total", "camera jpegs that didn't decode", labels, decode_err_cnt_);
+  const char* holder[] = { "tflow", "publish", "encode" };
+  for (unsigned int h = 0; h < kHolders; h++) {
+    std::string lbl = labels + ",holder=\"" + holder[h] + "\"";
+    out.summary("detector_buffer_hold_us", "how long a stage holds a capture buffer", lbl, hold_hist_[h]);
+    out.counter("detector_capture_starved_total", "frames the driver was almost out of buffers on, by the oldest holder",
+        lbl, blame_cnt_[h]);
+    out.counter("detector_capture_uncredited_total", "frames not lent to a stage that had no room for them",
+        lbl, refused_cnt_[h]);
+  }
+  out.gauge("detector_capture_fps", "frame rate asked of the camera", labels, framerate_);
+  out.gauge("detector_capture_mode_fps", "the fastest the sensor mode goes, 0 unknown", labels, mode_.fps);
+  out.gauge("detector_capture_field_ratio", "how much of the sensor the frames see, 0 unknown",
+      labels + ",axis=\"x\"", mode_.field_w);
+  out.gauge("detector_capture_field_ratio", "how much of the sensor the frames see, 0 unknown",
+      labels + ",axis=\"y\"", mode_.field_h);
+  out.counter("detector_capture_fps_changes_total", "frame rate changes the driver took",
+      labels + ",result=\"ok\"", fps_cnt_);
+  out.counter("detector_capture_fps_changes_total", "frame rate changes the driver took",
+      labels + ",result=\"refused\"", fps_fail_cnt_);
+  out.counter("detector_frames_unwanted_total", "frames no consumer's decimation took, requeued untouched",
+      labels, idle_cnt_);
+  out.counter("detector_capture_shed_total", "frames tflow gave back to a capturer short of buffers",
+      labels, shed_cnt_);
+}
+
+void Capturer::footprint(Footprint& out) {
+  size_t num = 0, bytes = 0;
+  for (auto& fb : framebuf_pool_) {
+    if (fb.addr != nullptr) {
+      num++;
+      bytes += fb.length;
+    }
+  }
+  out.add("v4l2_mmap", num, bytes);
+  if (dec_) {
+    dec_->footprint(out);
+  }
+  pyr_->footprint(num, bytes);
+  out.add("pyramid", num, bytes);
+}
+
 bool Capturer::init(bool quiet, Encoder* enc, Tflow* tfl, unsigned int device, 
-    unsigned int framerate, int width, int height) { 
+    unsigned int framerate, int width, int height, bool direct,
+    unsigned int pix_fmt) { 
 
   quiet_ = quiet;
   enc_ = enc;
   tfl_ = tfl;
+  pub_ = nullptr;
   device_ = device;
   framerate_ = framerate;
 
@@ -63,20 +571,177 @@ bool Capturer::init(bool quiet, Encoder* enc, Tflow* tfl, unsigned int device,
   height_flip_ = height < 0;
   width_ = std::abs(width);
   height_ = std::abs(height);
+  direct_ = direct;
+  rotate_ = 0;
+  soft_hflip_ = false;
+  soft_vflip_ = false;
+  orient_swap_ = false;
+  orient_mirror_ = false;
+  orient_flip_ = false;
+  orienting_ = false;
+
+  // the rest of the pipeline is built for one format, an i420 one
+  // can also have mjpeg decoded into it
+  formats_ = { static_cast<int>(pix_fmt) };
+  if (pix_fmt == V4L2_PIX_FMT_YUV420) {
+    formats_.push_back(V4L2_PIX_FMT_MJPEG);
+  }
+  decode_err_cnt_ = 0;
+  cam_index_ = -1;
+  cam_scaled_width_ = 0;
+  cam_scaled_height_ = 0;
+  idle_cnt_ = 0;
+  memory_ = Capturer::Memory::kMmap;
+  v4l2_memory_ = V4L2_MEMORY_MMAP;
+  starve_cnt_ = 0;
+  shed_cnt_ = 0;
+  for (auto& c : blame_cnt_) {
+    c = 0;
+  }
+  for (auto& c : refused_cnt_) {
+    c = 0;
+  }
+  pyr_ = Pyramid::create(width_, height_, pix_fmt);
 
   fd_video_ = -1;
+  crop_ = { 0, 0, 0, 0 };
+  crop_dirty_ = false;
+  want_fps_ = framerate_;
+  exposure_ = 0;
+  gain_ = 0;
+  ctrl_dirty_ = false;
+  fps_cnt_ = 0;
+  fps_fail_cnt_ = 0;
+  host_ = nullptr;
+  scales_ = nullptr;
+  served_ = { this };
+  dropped_ = false;
+  armed_ = false;
+  last_ms_ = 0;
+  own_sleep_ = getSleepTime();
+  events_.resize(8);
 
   frame_cnt_ = 0;
+  first_ms_ = -1;
+  held_ = 0;
+  gen_ = 0;
+  queued_ = 0;
   stream_on_ = false;
 
 #ifdef CAPTURE_ONE_RAW_FRAME
   fd_raw_ = nullptr;
 #endif
 
+  fd_event_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  fd_epoll_ = epoll_create1(EPOLL_CLOEXEC);
+  if (fd_event_ == -1 || fd_epoll_ == -1) {
+    dbgMsg("failed: epoll set (errno: %d)\n", errno);
+    return false;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  if (epoll_ctl(fd_epoll_, EPOLL_CTL_ADD, fd_event_, &ev) < 0) {
+    dbgMsg("failed: epoll add event (errno: %d)\n", errno);
+    return false;
+  }
+
  return true;
 }
 
+void Capturer::streamOn() {
+
+  differ_tot_.begin();
+  timeout_cnt_ = 0;
+  last_ms_ = since_start_ms();
+  stream_on_ = true;
+
+  // the host's thread takes it from here
+  if (host_) {
+    dropped_ = false;
+    setSleepTime(guest_sleep_);
+    host_->attach(this);
+  }
+}
+
+bool Capturer::openCamera() {
+
+  dbgMsg("open libcamera camera %d\n", cam_index_);
+  if (rotate_ != 0 && cam_scaled_width_ != 0) {
+    dbgMsg("failed: no turning a scaled camera stream\n");
+    return false;
+  }
+  pix_fmt_ = formats_[0];
+  if (pix_fmt_ != V4L2_PIX_FMT_YUV420 && pix_fmt_ != V4L2_PIX_FMT_RGB24) {
+    dbgMsg("failed: libcamera gives i420 or rgb24, not %s\n", PixelFormatToStr(pix_fmt_));
+    return false;
+  }
+  cam_ = Camera::create(cam_index_);
+  if (!cam_ || !cam_->open(width_, height_, pix_fmt_, width_flip_, height_flip_,
+        framebuf_num_, want_fps_, cam_scaled_width_, cam_scaled_height_)) {
+    dbgMsg("failed: open libcamera camera %d\n", cam_index_);
+    cam_.reset();
+    return false;
+  }
+
+  mode_ = cam_->mode();
+  reportMode();
+
+  // the camera flips, only a turn is left
+  soft_hflip_ = false;
+  soft_vflip_ = false;
+  orientation();
+
+  // its buffers are dmabufs and stay the camera's
+  framebuf_pool_ = cam_->buffers();
+  framebuf_num_ = framebuf_pool_.size();
+  memory_ = Capturer::Memory::kDmabuf;
+  pix_width_ = width_;
+  pix_height_ = height_;
+  pix_stride_ = cam_->stride();
+  fd_video_ = cam_->fd();
+  {
+    std::unique_lock<std::mutex> lck(release_lock_);
+    holders_.assign(framebuf_num_, 0);
+    since_.assign(framebuf_num_, std::chrono::steady_clock::time_point());
+  }
+
+  framerate_ = want_fps_;
+  cam_->setFramerate(framerate_);
+  if (exposure_ || gain_) {
+    cam_->setExposure(exposure_);
+    cam_->setGain(gain_);
+  }
+  Rect crop = getCrop();
+  if (crop.w != 0 && crop.h != 0) {
+    applyCrop();
+  }
+
+  if (direct_ && enc_ && !orienting_) {
+    dbgMsg("offer camera buffers to encoder\n");
+    enc_->useBuffers(framebuf_pool_);
+  }
+  if (!cam_->start()) {
+    return false;
+  }
+  queued_ = 0;
+  for (unsigned int i = 0; i < framebuf_num_; i++) {
+    if (!queue(i)) {
+      dbgMsg("  failed: queue camera request %d\n", i);
+      return false;
+    }
+  }
+  dbgMsg("  %u libcamera buffers queued.  size: %u\n", framebuf_num_, framebuf_pool_[0].length);
+  streamOn();
+  return true;
+}
+
 bool Capturer::waitingToRun() {
+
+  if (!stream_on_ && cam_index_ >= 0) {
+    return openCamera();
+  }
  
   if (!stream_on_) {
 
@@ -109,26 +774,26 @@ bool Capturer::waitingToRun() {
     dbgMsg("  streaming: %s\n", (cap.capabilities & V4L2_CAP_STREAMING) ? "yes" : "no");
 #endif
 
-    pix_fmt_ = V4L2_PIX_FMT_RGB24;
+    pix_fmt_ = formats_[0];
 
     dbgMsg("v4l2 formats\n");
     struct v4l2_fmtdesc fmtdesc;
     memset(&fmtdesc, 0, sizeof(fmtdesc));
     fmtdesc.index = 0;
     fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    bool found = false;
+    auto best = formats_.end();
     while (xioctl(fd_video_, VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
       auto it = std::find_if(formats_.begin(), formats_.end(), 
           [&](unsigned int const & fmt) -> bool { return fmt == fmtdesc.pixelformat; });
-      if (!found && it != formats_.end()) {
+      if (it < best) {
         pix_fmt_ = fmtdesc.pixelformat;
-        found = true;
+        best = it;
       }
       dbgMsg("  fmt %02d) %s, %s, %s\n", fmtdesc.index, BufTypeToStr(fmtdesc.type),
           fmtdesc.description, PixelFormatToStr(fmtdesc.pixelformat));
       fmtdesc.index++;
     }
-    if (!found) {
+    if (best == formats_.end()) {
       if (!quiet_) {
         fprintf(stderr, "  no supported pixel format found\n");
       }
@@ -155,76 +820,26 @@ bool Capturer::waitingToRun() {
       return false;
     }
 
-    // v4l2 set horizontal flip
-    dbgMsg("v4l2 set horizontal flip\n");
-    struct v4l2_queryctrl queryctrl;
-    memset(&queryctrl, 0, sizeof(queryctrl));
-    queryctrl.id = V4L2_CID_HFLIP;
-    res = xioctl(fd_video_, VIDIOC_QUERYCTRL, &queryctrl);
-    if (res < 0) {
-      dbgMsg("failed: query horizontal flip\n");
-      return false;
-    } else if (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) {
-      dbgMsg("warning: horizontal flip not supported\n");
-    } else {
-      struct v4l2_control control;
-      memset(&control, 0, sizeof (control));
-      control.id = V4L2_CID_HFLIP;
-      res = xioctl(fd_video_, VIDIOC_G_CTRL, &control);
-      if (res < 0) {
-        dbgMsg("failed: get horizontal flip\n");
-      }
-      control.value = width_flip_;
-      res = xioctl(fd_video_, VIDIOC_S_CTRL, &control);
-      if (res < 0) {
-        dbgMsg("failed: set horizontal flip\n");
-        return false;
-      }
-    }
+    // v4l2 set horizontal and vertical flip
+    dbgMsg("v4l2 set flips\n");
+    setFlip(V4L2_CID_HFLIP, width_flip_, soft_hflip_);
+    setFlip(V4L2_CID_VFLIP, height_flip_, soft_vflip_);
+    orientation();
 
-    // v4l2 set vertical flip
-    dbgMsg("v4l2 set vertical flip\n");
-    memset(&queryctrl, 0, sizeof(queryctrl));
-    queryctrl.id = V4L2_CID_VFLIP;
-    res = xioctl(fd_video_, VIDIOC_QUERYCTRL, &queryctrl);
-    if (res < 0) {
-      dbgMsg("failed: query vertical flip\n");
+    // v4l2 sensor mode
+    dbgMsg("v4l2 frame sizes\n");
+    if (!pickMode()) {
       return false;
-    } else if (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) {
-      dbgMsg("warning: vertical flip not supported\n");
-    } else {
-      struct v4l2_control control;
-      memset(&control, 0, sizeof (control));
-      control.id = V4L2_CID_VFLIP;
-      res = xioctl(fd_video_, VIDIOC_G_CTRL, &control);
-      if (res < 0) {
-        dbgMsg("failed: get vertical flip\n");
-      }
-      control.value = height_flip_;
-      res = xioctl(fd_video_, VIDIOC_S_CTRL, &control);
-      if (res < 0) {
-        dbgMsg("failed: set vertical flip\n");
-        return false;
-      }
     }
 
     // v4l2 set stream params
     dbgMsg("v4l2 set stream params\n");
-    struct v4l2_streamparm params;
-    memset(&params, 0, sizeof(params));
-    params.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    res = xioctl(fd_video_, VIDIOC_G_PARM, &params);
-    if (res < 0) {
-      dbgMsg("failed: get stream params\n");
+    framerate_ = want_fps_;
+    if (!setStreamRate(framerate_)) {
       return false;
     }
-    params.parm.capture.timeperframe.numerator = 1;
-    params.parm.capture.timeperframe.denominator = framerate_;
-    params.parm.capture.capturemode |= V4L2_CAP_TIMEPERFRAME;
-    res = xioctl(fd_video_, VIDIOC_S_PARM, &params);
-    if (res < 0) {
-      dbgMsg("failed: set stream params\n");
-      return false;
+    if (exposure_ || gain_) {
+      ctrl_dirty_ = true;
     }
 
     // set v4l2 format
@@ -252,6 +867,29 @@ bool Capturer::waitingToRun() {
     }
     pix_width_ = fmt.fmt.pix.width;
     pix_height_ = fmt.fmt.pix.height;
+    unsigned int image_len = fmt.fmt.pix.sizeimage;
+    pix_stride_ = fmt.fmt.pix.bytesperline;
+
+    field();
+    reportMode();
+
+    // setting the format resets the crop
+    Rect crop = getCrop();
+    if (crop.w != 0 && crop.h != 0) {
+      applyCrop();
+    }
+
+    if (pix_fmt_ == V4L2_PIX_FMT_MJPEG) {
+      dbgMsg("open jpeg decoder\n");
+      dec_ = Decoder::create();
+      if (!dec_->open(width_, height_, direct_)) {
+        if (!quiet_) {
+          fprintf(stderr, "  no jpeg decoder for %ux%u\n", width_, height_);
+        }
+        dec_.reset();
+        return false;
+      }
+    }
 #ifdef OUTPUT_VARIOUS_BITS_OF_INFO
     dbgMsg("  format: %s\n", PixelFormatToStr(fmt.fmt.pix.pixelformat));
     dbgMsg("  width:  %d\n", fmt.fmt.pix.width);
@@ -263,15 +901,40 @@ bool Capturer::waitingToRun() {
     struct v4l2_requestbuffers rb;
     memset(&rb, 0, sizeof(rb));
     rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    rb.memory = V4L2_MEMORY_MMAP;
+    v4l2_memory_ = (memory_ == Capturer::Memory::kDmabuf) ? V4L2_MEMORY_DMABUF :
+      (memory_ == Capturer::Memory::kUserptr) ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+    rb.memory = v4l2_memory_;
     rb.count = framebuf_num_;
-    res = xioctl(fd_video_, VIDIOC_REQBUFS, &rb);
+    {
+      Startup::Scope step("v4l2 reqbufs");
+      res = xioctl(fd_video_, VIDIOC_REQBUFS, &rb);
+    }
+    if (res < 0 && v4l2_memory_ != V4L2_MEMORY_MMAP) {
+      dbgMsg("  warning: no %s buffers (errno: %d), using mmap\n", memoryStr(memory_), errno);
+      memory_ = Capturer::Memory::kMmap;
+      v4l2_memory_ = V4L2_MEMORY_MMAP;
+      rb.memory = v4l2_memory_;
+      rb.count = framebuf_num_;
+      res = xioctl(fd_video_, VIDIOC_REQBUFS, &rb);
+    }
     if (res < 0) {
       dbgMsg("  failed: request buffers (errno: %d)", errno);
       return false;
     }
     dbgMsg("  buffer count: %d\n", rb.count);
-    for (unsigned int i = 0; i < framebuf_num_; i++) {
+    if (rb.count < framebuf_num_) {
+      framebuf_num_ = rb.count;
+      framebuf_pool_.resize(framebuf_num_);
+    }
+    {
+      std::unique_lock<std::mutex> lck(release_lock_);
+      holders_.assign(framebuf_num_, 0);
+      since_.assign(framebuf_num_, std::chrono::steady_clock::time_point());
+    }
+    if (v4l2_memory_ != V4L2_MEMORY_MMAP && !allocate(image_len)) {
+      return false;
+    }
+    for (unsigned int i = 0; i < framebuf_num_ && v4l2_memory_ == V4L2_MEMORY_MMAP; i++) {
       struct v4l2_buffer buf;
       memset(&buf, 0, sizeof(buf));
       buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -290,32 +953,50 @@ bool Capturer::waitingToRun() {
         return false;
       }
       framebuf_pool_[i].length = buf.length;
+
+      if (direct_ && !dec_) {
+        struct v4l2_exportbuffer expbuf;
+        memset(&expbuf, 0, sizeof(expbuf));
+        expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        expbuf.index = i;
+        expbuf.flags = O_RDWR | O_CLOEXEC;
+        res = xioctl(fd_video_, VIDIOC_EXPBUF, &expbuf);
+        if (res < 0) {
+          dbgMsg("  warning: export buffer %d (errno: %d)\n", i, errno);
+        } else {
+          framebuf_pool_[i].fd = expbuf.fd;
+        }
+      }
     }
+
+    // let the encoder work straight out of our buffers
+    if (direct_ && enc_ && !orienting_) {
+      dbgMsg("offer capture buffers to encoder\n");
+      enc_->useBuffers(dec_ ? dec_->buffers() : framebuf_pool_);
+    }
+    queued_ = 0;
     for (unsigned int i = 0; i < framebuf_num_; i++) {
-      struct v4l2_buffer buf;
-      memset(&buf, 0, sizeof(buf));
-      buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-      buf.memory = V4L2_MEMORY_MMAP;
-      buf.index = i;
-      res = xioctl(fd_video_, VIDIOC_QBUF, &buf);
-      if (res < 0) {
+      if (!queue(i)) {
         dbgMsg("  failed: queue buffer %d\n", i);
         return false;
       }
-      dbgMsg("  buffer %d queued.  size: %zu\n", i, buf.length);
     }
+    dbgMsg("  %u %s buffers queued.  size: %u\n", framebuf_num_, 
+        memoryStr(memory_), framebuf_pool_[0].length);
 
     // v4l2 stream on
     dbgMsg("v4l2 stream on\n");
     enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    res = xioctl(fd_video_, VIDIOC_STREAMON, &type);
+    {
+      Startup::Scope step("v4l2 streamon");
+      res = xioctl(fd_video_, VIDIOC_STREAMON, &type);
+    }
     if (res < 0) {
       dbgMsg("failed: stream on (errno: %d)\n", errno);
       return false;
     }
 
-    differ_tot_.begin();
-    stream_on_ = true;
+    streamOn();
   }
 
   return true;
@@ -332,70 +1013,493 @@ void Capturer::captureFrame(FILE* fd, int fmt, unsigned int len, unsigned char*
 }
 #endif
 
-bool Capturer::running() {
+FrameBuf Capturer::orient(const FrameBuf& src, unsigned int pix_fmt) {
 
-  if (stream_on_) {
-    fd_set fd_Set;
-    struct timeval timeout;
+  unsigned int w = orient_swap_ ? height_ : width_;
+  unsigned int h = orient_swap_ ? width_ : height_;
+  FrameBuf out = Frames::take(Shape(w, h, pix_fmt));
+  Planes s(src.addr, Shape(width_, height_, pix_fmt));
+  Planes d(out.addr, Shape(w, h, pix_fmt));
+  differ_orient_.begin();
+  if (s.yuv) {
+    orient_plane(s.y, s.stride, width_, height_, 1, d.y, d.stride,
+        orient_swap_, orient_mirror_, orient_flip_);
+    orient_plane(s.u, s.uv_stride, width_ / 2, height_ / 2, 1, d.u, d.uv_stride,
+        orient_swap_, orient_mirror_, orient_flip_);
+    orient_plane(s.v, s.uv_stride, width_ / 2, height_ / 2, 1, d.v, d.uv_stride,
+        orient_swap_, orient_mirror_, orient_flip_);
+  } else {
+    orient_plane(s.y, s.stride, width_, height_, 3, d.y, d.stride,
+        orient_swap_, orient_mirror_, orient_flip_);
+  }
+  differ_orient_.end();
+  out.stamp = src.stamp;
+  return out;
+}
 
-    FD_ZERO(&fd_Set);
-    FD_SET(fd_video_, &fd_Set);
-    timeout.tv_sec = 2;
-    timeout.tv_usec = 0;
+void Capturer::release(unsigned int index, Decoder* dec, unsigned int gen) {
+  {
+    std::unique_lock<std::mutex> lck(release_lock_);
 
-    int res = select(fd_video_+1, &fd_Set, NULL, NULL, &timeout);
+    // let go after a halt gave up on it, the index is of a ring long gone
+    if (gen != gen_) {
+      return;
+    }
+    if (dec) {
+      dec->release(index);
+    } else {
+      release_.push_back(index);
+    }
+    held_--;
+  }
+  if (dec) {
+    return;
+  }
 
-    if (res < 0 && errno != EINTR) {
-      dbgMsg("select failed\n");
-    } else if (res == 0) {
-      dbgMsg("select timed out\n");
-    } else if (FD_ISSET(fd_video_, &fd_Set)) {
+  // get the buffer back to the driver
+  (host_ ? host_ : this)->kick();
+}
 
-      // dequeue buffer
-      struct v4l2_buffer buf;
-      memset(&buf, 0, sizeof(struct v4l2_buffer));
-      buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-      buf.memory = V4L2_MEMORY_MMAP;
-      int res = xioctl(fd_video_, VIDIOC_DQBUF, &buf);
-      if (res < 0) {
-        dbgMsg("failed: dequeue (errno: %d)\n", errno);
-        return false;
+bool Capturer::requeue() {
+
+  std::vector<unsigned int> indices;
+  {
+    std::unique_lock<std::mutex> lck(release_lock_);
+    indices.swap(release_);
+  }
+
+  for (auto index : indices) {
+    if (!queue(index)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+FrameBuf Capturer::lend(FrameBuf& fbuf, Capturer::Holder who, unsigned int index, bool ring) {
+
+  // each holder gets its own reference on top of ours, so we know when
+  // it lets go
+  FrameBuf out = fbuf;
+  if (ring) {
+    std::unique_lock<std::mutex> lck(release_lock_);
+    holders_[index] |= 1u << who;
+  }
+  auto base = fbuf.ref;
+  auto since = std::chrono::steady_clock::now();
+  out.ref = std::shared_ptr<void>(fbuf.addr, [this, base, who, index, ring, since](void*) {
+    hold_hist_[who].record(std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - since).count());
+    if (ring) {
+      std::unique_lock<std::mutex> lck(release_lock_);
+      holders_[index] &= ~(1u << who);
+    }
+  });
+  return out;
+}
+
+void Capturer::starve() {
+
+  // the buffer out the longest, and the least important stage holding it
+  starve_cnt_++;
+  unsigned int who = 0;
+  {
+    std::unique_lock<std::mutex> lck(release_lock_);
+    int oldest = -1;
+    for (unsigned int i = 0; i < holders_.size(); i++) {
+      if (holders_[i] != 0 && (oldest < 0 || since_[i] < since_[oldest])) {
+        oldest = i;
       }
+    }
+    if (oldest >= 0) {
+      who = holders_[oldest];
+    }
+  }
+  for (unsigned int h = 0; h < kHolders; h++) {
+    if (who & (1u << h)) {
+      blame_cnt_[h]++;
+      if (h == kTflow && tfl_ && tfl_->shed()) {
+        shed_cnt_++;
+      }
+      break;
+    }
+  }
+}
 
-      framebuf_pool_[buf.index].id = frame_cnt_++;
+bool Capturer::allocate(unsigned int len) {
 
-#ifdef CAPTURE_ONE_RAW_FRAME
-      // write frames
-      if (frame_cnt_ == capture_cnt_) {
-        captureFrame(fd_raw_, pix_fmt_, framebuf_pool_[buf.index].length, 
-            framebuf_pool_[buf.index].addr);
+  // our own buffers, the same memory all the way to the encoder
+  len = (len + 4095) & ~4095;
+  int heap = -1;
+  if (v4l2_memory_ == V4L2_MEMORY_DMABUF) {
+    heap = ::open(heap_, O_RDWR | O_CLOEXEC);
+    if (heap < 0) {
+      dbgMsg("  failed: open %s (errno: %d)\n", heap_, errno);
+      return false;
+    }
+  }
+  bool res = true;
+  for (unsigned int i = 0; i < framebuf_num_ && res; i++) {
+    FrameBuf& fb = framebuf_pool_[i];
+    if (heap >= 0) {
+      struct dma_heap_allocation_data alloc;
+      memset(&alloc, 0, sizeof(alloc));
+      alloc.len = len;
+      alloc.fd_flags = O_RDWR | O_CLOEXEC;
+      if (xioctl(heap, DMA_HEAP_IOCTL_ALLOC, &alloc) < 0) {
+        dbgMsg("  failed: dma heap alloc %u (errno: %d)\n", i, errno);
+        res = false;
+        break;
+      }
+      fb.fd = alloc.fd;
+      fb.addr = (unsigned char*)mmap(nullptr, len, PROT_READ | PROT_WRITE, 
+          MAP_SHARED, alloc.fd, 0);
+      if (fb.addr == MAP_FAILED) {
+        dbgMsg("  failed: map dmabuf %u (errno: %d)\n", i, errno);
+        fb.addr = 0;
+        res = false;
+      }
+    } else {
+      void* addr = nullptr;
+      if (posix_memalign(&addr, 4096, len) != 0) {
+        dbgMsg("  failed: allocate buffer %u\n", i);
+        res = false;
+        break;
       }
+      fb.addr = static_cast<unsigned char*>(addr);
+    }
+    fb.length = len;
+  }
+  if (heap >= 0) {
+    ::close(heap);
+  }
+  return res;
+}
+
+void Capturer::setDecimation(Capturer::Holder who, unsigned int every, float rate) {
+  pace_[who].every = every;
+  pace_[who].rate = rate;
+}
+
+bool Capturer::credited(Capturer::Holder who, unsigned int credits) {
+  if (credits != 0) {
+    return true;
+  }
+  refused_cnt_[who]++;
+  return false;
+}
+
+bool Capturer::wants(Capturer::Holder who, std::chrono::steady_clock::time_point stamp) {
+
+  Pace& p = pace_[who];
+  if (p.every > 1 && (p.cnt++ % p.every) != 0) {
+    return false;
+  }
+  if (p.rate > 0.f) {
+    if (stamp < p.next) {
+      return false;
+    }
+
+    // keep the cadence unless we fell behind it
+    auto period = std::chrono::microseconds(static_cast<int64_t>(1000000.f / p.rate));
+    p.next = ((stamp - p.next < period) ? p.next : stamp) + period;
+  }
+  return true;
+}
+
+bool Capturer::queue(unsigned int index) {
+  if (cam_) {
+    if (!cam_->queue(index)) {
+      return false;
+    }
+    queued_++;
+    return true;
+  }
+  struct v4l2_buffer buf;
+  memset(&buf, 0, sizeof(struct v4l2_buffer));
+  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buf.memory = v4l2_memory_;
+  buf.index = index;
+  if (v4l2_memory_ == V4L2_MEMORY_DMABUF) {
+    buf.m.fd = framebuf_pool_[index].fd;
+    buf.length = framebuf_pool_[index].length;
+  } else if (v4l2_memory_ == V4L2_MEMORY_USERPTR) {
+    buf.m.userptr = reinterpret_cast<unsigned long>(framebuf_pool_[index].addr);
+    buf.length = framebuf_pool_[index].length;
+  }
+  int res = xioctl(fd_video_, VIDIOC_QBUF, &buf);
+  if (res < 0) {
+    dbgMsg("failed: enqueue (errno: %d)\n", errno);
+    return false;
+  }
+  queued_++;
+  return true;
+}
+
+bool Capturer::dequeue() {
+
+  // dequeue buffer
+  struct v4l2_buffer buf;
+  memset(&buf, 0, sizeof(struct v4l2_buffer));
+  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buf.memory = v4l2_memory_;
+  std::chrono::steady_clock::time_point cam_stamp;
+  int res = 0;
+  if (cam_) {
+    if (!cam_->dequeue(buf.index, cam_stamp)) {
+      return true;
+    }
+  } else {
+    res = xioctl(fd_video_, VIDIOC_DQBUF, &buf);
+  }
+  if (res < 0 && errno == EAGAIN) {
+    return true;
+  } else if (res < 0) {
+    dbgMsg("failed: dequeue (errno: %d)\n", errno);
+    return false;
+  }
+  timeout_cnt_ = 0;
+  last_ms_ = since_start_ms();
+
+  queued_--;
+
+  // a new crop shows up a frame or two later
+  if (crop_dirty_) {
+    applyCrop();
+  }
+  if (ctrl_dirty_) {
+    applyControls();
+  }
+
+  // the buffer is re-queued once every consumer lets go of it
+  unsigned int index = buf.index;
+  FrameBuf fbuf = framebuf_pool_[index];
+  if (buf.bytesused != 0) {
+    fbuf.length = buf.bytesused;
+  }
+
+  // v4l2 monotonic stamps share the steady_clock epoch
+  if (cam_) {
+    fbuf.stamp = cam_stamp;
+  } else if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+    fbuf.stamp = std::chrono::steady_clock::time_point(
+        std::chrono::seconds(buf.timestamp.tv_sec) + 
+        std::chrono::microseconds(buf.timestamp.tv_usec));
+  } else {
+    fbuf.stamp = std::chrono::steady_clock::now();
+  }
+
+  // a frame nobody wants, or has room for, goes back untouched
+  bool to_tfl = !scales_ && tfl_ && credited(kTflow, tfl_->credits(fbuf)) && wants(kTflow, fbuf.stamp);
+  bool to_enc = !scales_ && enc_ && credited(kEncoder, enc_->credits(fbuf)) && wants(kEncoder, fbuf.stamp);
+  bool to_pub = !scales_ && pub_ && wants(kPublisher, fbuf.stamp);
+  if (!scales_ && !to_tfl && !to_enc && !to_pub) {
+    idle_cnt_++;
+    latest_ = FrameBuf();
+    return queue(index);
+  }
+
+  // a jpeg goes straight back to the camera, the frame it decodes to is held
+  Decoder* dec = dec_.get();
+  if (dec) {
+    unsigned int out = 0, used = 0;
+    differ_dec_.begin();
+    bool ok = dec->decode(fbuf.addr, fbuf.length, out, used);
+    differ_dec_.end();
+    if (!queue(index)) {
+      return false;
+    }
+    if (!ok) {
+      decode_err_cnt_++;
+      return true;
+    }
+    auto stamp = fbuf.stamp;
+    fbuf = dec->buffers()[out];
+    fbuf.stamp = stamp;
+    fbuf.length = used;
+    index = out;
+  }
+
+  // turned or flipped into a frame of our own, the source goes straight back
+  bool ring = !dec;
+  if (orienting_) {
+    fbuf = orient(fbuf, dec ? V4L2_PIX_FMT_YUV420 : pix_fmt_);
+    if (dec) {
+      std::unique_lock<std::mutex> lck(release_lock_);
+      dec->release(index);
+    } else if (!queue(index)) {
+      return false;
+    }
+    ring = false;
+  }
+  fbuf.id = frame_cnt_++;
+  fbuf.source = device_;
+  if (first_ms_ < 0) {
+    first_ms_ = since_start_ms();
+    Startup::ready(Startup::kFrame);
+  }
+  Trace::span(Trace::Hop::kDqbuf, fbuf.stamp, fbuf.id, fbuf.stamp);
+  PROBE(dequeue, probe_us(fbuf.stamp), fbuf.id, fbuf.length,
+      orient_swap_ ? height_ : width_, orient_swap_ ? width_ : height_);
+  Fate::reach(Fate::kCaptured, fbuf.stamp);
+  if (!orienting_) {
+    unsigned int gen;
+    {
+      std::unique_lock<std::mutex> lck(release_lock_);
+      held_++;
+      gen = gen_;
+    }
+    Frames::wrap(fbuf, [this, index, dec, gen]() { release(index, dec, gen); });
+  }
+  if (ring) {
+    std::unique_lock<std::mutex> lck(release_lock_);
+    since_[index] = fbuf.stamp;
+  }
+
+  // a scaled copy comes out of the isp with its full frame and is
+  // dequeued first
+  if (scales_) {
+    scales_->latest_ = fbuf;
+    scales_->latest_lvl_ = { fbuf.addr, pix_width_, pix_height_, pix_stride_, pix_height_ };
+    return true;
+  }
+  if (latest_.ref) {
+    auto gap = std::chrono::duration_cast<std::chrono::microseconds>(
+        fbuf.stamp - latest_.stamp).count();
+    if (std::abs(gap) * framerate_ < 500000) {
+      auto ref = latest_.ref;
+      fbuf.scaled = std::shared_ptr<Level>(new Level(latest_lvl_),
+          [ref](Level* lvl) { delete lvl; });
+    }
+    latest_ = FrameBuf();
+  }
+  if (cam_ && cam_->scaled(index)) {
+    auto ref = fbuf.ref;
+    fbuf.scaled = std::shared_ptr<Level>(new Level(*cam_->scaled(index)),
+        [ref](Level* lvl) { delete lvl; });
+  }
+  fbuf.levels = pyr_->make(fbuf.addr);
+
+#ifdef CAPTURE_ONE_RAW_FRAME
+  // write frames
+  if (frame_cnt_ == capture_cnt_) {
+    captureFrame(fd_raw_, pix_fmt_, fbuf.length, fbuf.addr);
+  }
 #endif
-      // send frame to tflow
-      if (tfl_) {
-        differ_tfl_.begin();
-        if (!tfl_->addMessage(framebuf_pool_[buf.index])) {
+  // send frame to tflow
+  if (to_tfl) {
+    differ_tfl_.begin();
+    FrameBuf lent = lend(fbuf, kTflow, index, ring);
+    lent.deadline = Deadline::forTflow(lent.stamp);
+    if (!tfl_->addMessage(lent)) {
 //          dbgMsg("warning: tflow is busy\n");
+    }
+    differ_tfl_.end();
+  }
+
+  // send frame to encoder
+  if (to_enc) {
+    differ_enc_.begin();
+    FrameBuf lent = lend(fbuf, kEncoder, index, ring);
+    lent.deadline = Deadline::forEncoder(lent.stamp);
+    if (!enc_->addMessage(lent)) {
+//          dbgMsg("warning: encoder is busy\n");
+    }
+    differ_enc_.end();
+  }
+
+  if (to_pub) {
+    FrameBuf lent = lend(fbuf, kPublisher, index, ring);
+    pub_->addMessage(lent);
+  }
+
+  // rather than stall, have the least important holder give one back
+  if (ring && queued_ <= starve_at_) {
+    starve();
+  }
+
+  // drop our reference
+  fbuf.ref.reset();
+  fbuf.levels.reset();
+  fbuf.scaled.reset();
+  return true;
+}
+
+bool Capturer::running() {
+
+  if (stream_on_) {
+
+    // a guest only finds out when the host gives up on it
+    if (host_) {
+      return !dropped_;
+    }
+
+    // give back buffers the consumers are done with, a device with
+    // every buffer held downstream sits out of the set until then
+    std::vector<Capturer*> failed;
+    std::unique_lock<std::mutex> lck(serve_lock_);
+    for (auto cap : served_) {
+      if (!cap->requeue()) {
+        failed.push_back(cap);
+      }
+      arm(cap, cap->queued_ != 0);
+    }
+    lck.unlock();
+
+    int num = epoll_wait(fd_epoll_, events_.data(), events_.size(), timeout_ms_);
+    if (num < 0 && errno != EINTR) {
+      dbgMsg("epoll failed\n");
+    }
+
+    // scaled copies first, for the full frames that come with them
+    lck.lock();
+    for (int pass = 0; pass < 2; pass++) {
+      for (int i = 0; i < num; i++) {
+        auto cap = static_cast<Capturer*>(events_[i].data.ptr);
+        if (cap == nullptr) {
+          uint64_t cnt;
+          if (pass == 0 && read(fd_event_, &cnt, sizeof(cnt)) < 0) {
+            dbgMsg("failed: read capture kicks (errno: %d)\n", errno);
+          }
+          continue;
+        }
+        if ((cap->scales_ != nullptr) != (pass == 0)) {
+          continue;
+        }
+
+        // a guest may have left while we waited
+        if (std::find(served_.begin(), served_.end(), cap) == served_.end() || !cap->armed_) {
+          continue;
+        }
+        if (!cap->dequeue()) {
+          failed.push_back(cap);
         }
-        differ_tfl_.end();
       }
+    }
 
-      // send frame to encoder
-      if (enc_) {
-        differ_enc_.begin();
-        if (!enc_->addMessage(framebuf_pool_[buf.index])) {
-//          dbgMsg("warning: encoder is busy\n");
+    // a camera that stays quiet gives up, so the device can be reopened
+    int now = since_start_ms();
+    for (auto cap : served_) {
+      if (cap->armed_ && now - cap->last_ms_ >= static_cast<int>(timeout_ms_)) {
+        dbgMsg("device %d timed out\n", cap->device_);
+        cap->last_ms_ = now;
+        if (++cap->timeout_cnt_ >= cap->timeout_max_) {
+          failed.push_back(cap);
         }
-        differ_enc_.end();
       }
+    }
 
-      // enqueue buffer
-      res = xioctl(fd_video_, VIDIOC_QBUF, &buf);
-      if (res < 0) {
-        dbgMsg("failed: enqueue (errno: %d)\n", errno);
-        return false;
+    bool res = true;
+    for (auto cap : failed) {
+      if (cap == this) {
+        res = false;
+      } else {
+        unserve(cap);
+        cap->dropped_ = true;
+        cap->wake();
       }
     }
+    return res;
   }
   return true;
 }
@@ -411,23 +1515,87 @@ bool Capturer::waitingToHalt() {
     stream_on_ = false;
     differ_tot_.end();
 
+    // out of the epoll set, and the guests are on their own
+    if (host_) {
+      host_->detach(this);
+      setSleepTime(own_sleep_);
+    } else {
+      std::unique_lock<std::mutex> lck(serve_lock_);
+      arm(this, false);
+      latest_ = FrameBuf();
+      while (served_.size() > 1) {
+        Capturer* guest = served_.back();
+        unserve(guest);
+        guest->dropped_ = true;
+        guest->wake();
+      }
+    }
+
     // v4l2 stream off
     dbgMsg("v4l2 stream off\n");
-    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    int res = xioctl(fd_video_, VIDIOC_STREAMOFF, &type);
-    if (res < 0) {
-      dbgMsg("failed: stream off (errno: %d)", errno);
+    if (cam_) {
+      cam_->stop();
+    } else {
+      enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      int res = xioctl(fd_video_, VIDIOC_STREAMOFF, &type);
+      if (res < 0) {
+        dbgMsg("failed: stream off (errno: %d)", errno);
+      }
     }
 
-    // return v4l2 buffers
+    // wait for consumers to release their buffers
+    dbgMsg("wait for held buffers\n");
+    auto limit = std::chrono::steady_clock::now() + 
+      std::chrono::milliseconds(release_timeout_);
+    while (held_ != 0 && std::chrono::steady_clock::now() < limit) {
+      std::this_thread::sleep_for(std::chrono::microseconds(yield_time_));
+    }
+
+    // whatever is still out is dropped when it comes back, not counted
+    // against or queued to the next ring
+    unsigned int held;
+    {
+      std::unique_lock<std::mutex> lck(release_lock_);
+      release_.clear();
+      held = held_.exchange(0);
+      gen_++;
+    }
+
+    // return v4l2 buffers, the camera's go with it
     dbgMsg("return v4l2 buffers\n");
+    if (cam_) {
+      if (held != 0) {
+        dbgMsg("warning: %u buffers still held, leaving the camera open\n", held);
+        cam_.release();
+      }
+      cam_.reset();
+      for (auto& fb : framebuf_pool_) {
+        fb.addr = 0;
+        fb.fd = -1;
+      }
+      fd_video_ = -1;
+    } else if (held != 0) {
+      dbgMsg("warning: %u buffers still held, leaving them mapped\n", held);
+      dec_.release();   // and the decoder they came from
+    } else {
+      dec_.reset();
+      for (unsigned int i = 0; i < framebuf_num_; i++) {
+        if (framebuf_pool_[i].addr != 0 && v4l2_memory_ == V4L2_MEMORY_USERPTR) {
+          free(framebuf_pool_[i].addr);
+          framebuf_pool_[i].addr = 0;
+        } else if (framebuf_pool_[i].addr != 0) {
+          int res = munmap(framebuf_pool_[i].addr, framebuf_pool_[i].length);
+          if (res < 0) {
+            dbgMsg("failed: unmap buffer: %d (errno: %d)", i, errno);
+          }  
+          framebuf_pool_[i].addr = 0;
+        }
+      }
+    }
     for (unsigned int i = 0; i < framebuf_num_; i++) {
-      if (framebuf_pool_[i].addr != 0) {
-        int res = munmap(framebuf_pool_[i].addr, framebuf_pool_[i].length);
-        if (res < 0) {
-          dbgMsg("failed: unmap buffer: %d (errno: %d)", i, errno);
-        }  
-        framebuf_pool_[i].addr = 0;
+      if (framebuf_pool_[i].fd != -1) {
+        close(framebuf_pool_[i].fd);
+        framebuf_pool_[i].fd = -1;
       }
     }
 
@@ -447,12 +1615,48 @@ bool Capturer::waitingToHalt() {
     if (!quiet_) {
       fprintf(stderr, "\n\nCapturer Results...\n");
       fprintf(stderr, "   number of frames captured: %d\n", frame_cnt_); 
-      fprintf(stderr, "   tflow copy time (us): high:%u avg:%u low:%u cnt:%u\n", 
+      fprintf(stderr, "   first frame at (ms start): %d\n", first_ms_);
+      fprintf(stderr, "   tflow copy time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_tfl_.pct(.5), differ_tfl_.pct(.9), differ_tfl_.pct(.99), differ_tfl_.pct(.999),
           differ_tfl_.high, differ_tfl_.avg, 
           differ_tfl_.low,  differ_tfl_.cnt);
-      fprintf(stderr, "  encode copy time (us): high:%u avg:%u low:%u cnt:%u\n", 
+      fprintf(stderr, "  encode copy time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_enc_.pct(.5), differ_enc_.pct(.9), differ_enc_.pct(.99), differ_enc_.pct(.999),
           differ_enc_.high, differ_enc_.avg, 
           differ_enc_.low,  differ_enc_.cnt);
+      if (differ_dec_.cnt) {
+        fprintf(stderr, "  jpeg decode time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+            differ_dec_.pct(.5), differ_dec_.pct(.9), differ_dec_.pct(.99), differ_dec_.pct(.999),
+            differ_dec_.high, differ_dec_.avg, 
+            differ_dec_.low,  differ_dec_.cnt);
+        fprintf(stderr, "          decode errors: %u\n", decode_err_cnt_);
+      }
+      if (differ_orient_.cnt) {
+        fprintf(stderr, "       orient time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+            differ_orient_.pct(.5), differ_orient_.pct(.9), differ_orient_.pct(.99), differ_orient_.pct(.999),
+            differ_orient_.high, differ_orient_.avg, 
+            differ_orient_.low,  differ_orient_.cnt);
+      }
+      const char* holder[] = { "tflow", "publish", "encode" };
+      for (unsigned int h = 0; h < kHolders; h++) {
+        auto pct = hold_hist_[h].percentiles();
+        if (pct.cnt != 0) {
+          std::string name = std::string(holder[h]) + " hold time (us)";
+          fprintf(stderr, "%23s: p50:%u p90:%u p99:%u p999:%u cnt:%llu\n", name.c_str(),
+              pct.p50, pct.p90, pct.p99, pct.p999, static_cast<unsigned long long>(pct.cnt));
+        }
+      }
+      fprintf(stderr, "   ring starved (of %u): %u, tflow shed %u\n", framebuf_num_,
+          starve_cnt_, shed_cnt_);
+      fprintf(stderr, "  no credit (tfl, enc): %u, %u\n", refused_cnt_[kTflow],
+          refused_cnt_[kEncoder]);
+      if (idle_cnt_) {
+        fprintf(stderr, "   frames nobody wanted: %u\n", idle_cnt_);
+      }
+      if (fps_cnt_ || fps_fail_cnt_) {
+        fprintf(stderr, "  fps changes (refused): %u (%u), last %u fps\n",
+            fps_cnt_, fps_fail_cnt_, framerate_);
+      }
       fprintf(stderr, "        total test time: %f sec\n", 
           differ_tot_.avg / 1000000.f);
       fprintf(stderr, "      frames per second: %f fps\n", 
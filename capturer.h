@@ -23,27 +23,98 @@
 #include <thread>
 #include <atomic>
 #include <memory>
+#include <mutex>
+#include <sys/epoll.h>
 
 #include "utils.h"
 #include "listener.h"
 #include "base.h"
 #include "encoder.h"
 #include "tflow.h"
+#include "publish.h"
+#include "pyramid.h"
+#include "decoder.h"
+#include "camera.h"
 
 namespace detector {
 
 class Capturer : public Base {
   public:
+    // the stages frames go to, in the order they give way when the
+    // driver is about to run dry
+    enum Holder : unsigned int { kTflow = 0, kPublisher, kEncoder, kHolders };
+
+    // where the ring's buffers come from
+    enum class Memory {
+      kMmap = 0,    // the driver's
+      kDmabuf,      // ours, from the dma heap, shared with the codecs as they are
+      kUserptr      // ours, page aligned
+    };
+    static const char* memoryStr(Capturer::Memory mem);
+
     static std::unique_ptr<Capturer> create(unsigned int yield_time, bool quiet, 
         Encoder* enc, Tflow* tfl, unsigned int device, unsigned int framerate, 
-        int width, int height);
+        int width, int height, bool direct, unsigned int pix_fmt);
     virtual ~Capturer();
 
+    // frames also go to the shared memory publisher
+    void setPublisher(Publisher* pub);
+
+    // capture on another capturer's thread, which waits on every device
+    // it serves at once, instead of on our own
+    void setHost(Capturer* host);
+
+    // our device is a model sized rgb24 copy of 'full's stream, the isp's
+    // second output, to go with its frames as FrameBuf::scaled
+    void setScaled(Capturer* full);
+
+    // capture from libcamera's 'index'th camera rather than the v4l2
+    // device, with its isp's 'scaled' rgb24 copy as FrameBuf::scaled
+    // unless that is 0x0; before start, false without libcamera
+    bool setCamera(int index, unsigned int scaled_width, unsigned int scaled_height);
+
+    // the v4l2 ring, before start, the driver may give fewer
+    void setBuffers(unsigned int num);
+
+    // before start, falls back to the driver's buffers if need be
+    void setMemory(Capturer::Memory mem);
+
+    // capture only 'crop' of the sensor, scaled to the frame size, and
+    // all of it when empty; taken up with the next frame
+    void setCrop(const Rect& crop);
+    Rect getCrop();
+
+    // the camera's frame rate, exposure in usec and gain, 0 leaves
+    // exposure and gain to the camera; taken up with the next frame, a
+    // driver that can't change them while streaming keeps what it has
+    void setFramerate(unsigned int fps);
+    unsigned int getFramerate();
+    void setExposure(unsigned int usec);
+    unsigned int getExposure();
+    void setGain(unsigned int gain);
+    unsigned int getGain();
+
+    // hand 'who' only every 'every'th frame and no more than 'rate' a
+    // second, 0 for no limit; before start
+    void setDecimation(Capturer::Holder who, unsigned int every, float rate);
+
+    // only take mjpeg from the camera, decoded by the codec, i420 only
+    bool setMjpeg(bool on);
+
+    // turn the frames 90, 180 or 270 degrees clockwise before anyone gets
+    // them, a quarter turn makes them height x width; before start
+    bool setRotate(unsigned int degrees);
+
+    // the metrics endpoint's samples
+    virtual void metrics(Exposition& out, const std::string& labels);
+    virtual void footprint(Footprint& out);
+
   protected:
     Capturer() = delete;
     Capturer(unsigned int yield_time);
     bool init(bool quiet, Encoder* enc, Tflow* tfl, unsigned int device,
-        unsigned int framerate, int width, int height);
+        unsigned int framerate, int width, int height, bool direct,
+        unsigned int pix_fmt);
 
   protected:
     virtual bool waitingToRun();
@@ -55,6 +126,7 @@ class Capturer : public Base {
     bool quiet_;
     Encoder* enc_;
     Tflow* tfl_;
+    Publisher* pub_;
     unsigned int device_;
     unsigned int framerate_;
     unsigned int width_;
@@ -62,27 +134,148 @@ class Capturer : public Base {
     const unsigned int channels_ = {3};
     bool width_flip_;
     bool height_flip_;
+    bool direct_;
+
+    // the flips the sensor can't do and the turn, done into a frame of
+    // our own so the driver gets its buffer straight back
+    unsigned int rotate_;
+    bool soft_hflip_;
+    bool soft_vflip_;
+    bool orient_swap_;
+    bool orient_mirror_;
+    bool orient_flip_;
+    bool orienting_;
+    void orientation();
+    FrameBuf orient(const FrameBuf& src, unsigned int pix_fmt);
+    void setFlip(unsigned int id, bool on, bool& soft);
 
     unsigned int pix_fmt_;
     unsigned int pix_width_;
     unsigned int pix_height_;
+    unsigned int pix_stride_;
 
-    std::vector<int> formats_ = {
-      V4L2_PIX_FMT_RGB24   // in order of preference
-    };
+    std::vector<int> formats_;   // in order of preference
+
+    // the sensor mode under the frames; a v4l2 driver that lists sizes
+    // lists its sensor's, and the frame has to be one of them
+    SensorMode mode_;
+    bool pickMode();
+    float maxRate(unsigned int width, unsigned int height);
+    void field();
+    void reportMode();
+
+    // mjpeg cameras go through the codec's jpeg decoder
+    std::unique_ptr<Decoder> dec_;
+    unsigned int decode_err_cnt_;
+
+    // libcamera in place of the v4l2 device, its eventfd as fd_video_
+    int cam_index_;
+    unsigned int cam_scaled_width_;
+    unsigned int cam_scaled_height_;
+    std::unique_ptr<Camera> cam_;
+    bool openCamera();
+    void streamOn();
 
     unsigned int frame_cnt_;
+    int first_ms_;
     int fd_video_;
 
-    const unsigned int framebuf_num_ = {3};
+    // buffers stay dequeued while a consumer holds a reference so
+    // there must be enough to cover tflow, the encoder queue and capture
+    unsigned int framebuf_num_ = {6};
     std::vector<FrameBuf> framebuf_pool_;
+    Capturer::Memory memory_;
+    unsigned int v4l2_memory_;
+    const char* heap_ = {"/dev/dma_heap/linux,cma"};
+    bool allocate(unsigned int len);
+
+    // who holds each buffer and since when
+    std::vector<unsigned int> holders_;
+    std::vector<std::chrono::steady_clock::time_point> since_;
+    Histogram hold_hist_[kHolders];
+    unsigned int blame_cnt_[kHolders];
+    unsigned int refused_cnt_[kHolders];
+    unsigned int starve_cnt_;
+    unsigned int shed_cnt_;
+    const unsigned int starve_at_ = {1};    // buffers left with the driver
+    class Pace {
+      public:
+        unsigned int every = 0;
+        float rate = 0.f;
+        unsigned int cnt = 0;
+        std::chrono::steady_clock::time_point next;
+    };
+    Pace pace_[kHolders];
+    unsigned int idle_cnt_;
+    bool credited(Capturer::Holder who, unsigned int credits);
+    bool wants(Capturer::Holder who, std::chrono::steady_clock::time_point stamp);
+    FrameBuf lend(FrameBuf& fbuf, Capturer::Holder who, unsigned int index, bool ring);
+    void starve();
+    std::unique_ptr<Pyramid> pyr_;
+
+    std::mutex release_lock_;
+    std::vector<unsigned int> release_;
+    std::atomic<unsigned int> held_;
+    unsigned int gen_;          // of the ring, a halt starts the next
+    unsigned int queued_;
+    const unsigned int release_timeout_ = {2000};  // msec
+    void release(unsigned int index, Decoder* dec, unsigned int gen);
+    bool queue(unsigned int index);
+    bool requeue();
 
     std::atomic<bool> stream_on_;
 
+    std::mutex crop_lock_;
+    Rect crop_;
+    std::atomic<bool> crop_dirty_;
+    bool applyCrop();
+
+    std::atomic<unsigned int> want_fps_;
+    std::atomic<unsigned int> exposure_;
+    std::atomic<unsigned int> gain_;
+    std::atomic<bool> ctrl_dirty_;
+    unsigned int fps_cnt_;
+    unsigned int fps_fail_cnt_;
+    bool applyControls();
+    bool setCtrl(unsigned int id, int value, bool clamp);
+    bool setStreamRate(unsigned int fps);
+
+    // a camera that stays quiet gives up, so the device can be reopened
+    unsigned int timeout_cnt_;
+    const unsigned int timeout_max_ = {3};
+    const unsigned int timeout_ms_ = {2000};
+
     int xioctl(int fd, int request, void* arg);
 
+    // one epoll set for our device and the devices of our guests, with
+    // an eventfd so released buffers get requeued without delay
+    Capturer* host_;
+    std::mutex serve_lock_;
+    std::vector<Capturer*> served_;
+    int fd_epoll_;
+    int fd_event_;
+    std::vector<struct epoll_event> events_;
+    std::atomic<bool> dropped_;
+    bool armed_;
+    int last_ms_;
+    unsigned int own_sleep_;
+    const unsigned int guest_sleep_ = {500000};   // usec, the host wakes us
+    void attach(Capturer* guest);
+    void detach(Capturer* guest);
+    void unserve(Capturer* guest);
+    void arm(Capturer* cap, bool on);
+    void kick();
+    bool dequeue();
+
+    // the isp's latest scaled copy, until a full frame takes it
+    Capturer* scales_;
+    FrameBuf latest_;
+    Level latest_lvl_;
+
     MicroDiffer<uint32_t> differ_enc_;
     MicroDiffer<uint32_t> differ_tfl_;
+    MicroDiffer<uint32_t> differ_dec_;
+    MicroDiffer<uint32_t> differ_orient_;
     MicroDiffer<uint32_t> differ_tot_;
 
 #ifdef CAPTURE_ONE_RAW_FRAME
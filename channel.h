@@ -0,0 +1,195 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Bounded lock-free channel between pipeline threads.
+ *
+ *  The ring is a sequence numbered array (one sequence per cell) so any
+ *  number of producers can push without a lock.  The pop side is not
+ *  single consumer: with kDropOldest a producer that finds the channel
+ *  full pops the oldest cell itself, racing the consumer for it.  The
+ *  pop claims a cell by a compare and swap on the tail against its
+ *  sequence, so it must stay safe with more than one popper.  When the
+ *  channel is full the policy decides what happens:
+ *
+ *    kDropNewest - the pushed item is refused
+ *    kDropOldest - the oldest queued item is popped by the producer and
+ *                  thrown away to make room
+ *    kBlock      - the producer yields until there is room
+ *
+ *  Dropped items are counted so stages can report them.
+ *
+ *  The head, the tail and the count each have a cache line and so does
+ *  every cell, a push and the pop of the cell before it don't share one.
+ */
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <cstdint>
+
+namespace detector {
+
+template<typename T>
+class Channel {
+  public:
+    enum class Policy {
+      kDropNewest,
+      kDropOldest,
+      kBlock
+    };
+
+  public:
+    Channel() = delete;
+    Channel(unsigned int capacity, Channel::Policy policy)
+      : capacity_(capacity ? capacity : 1), policy_(policy),
+        mask_(ringSize(capacity_) - 1), cells_(mask_ + 1),
+        head_(0), tail_(0), count_(0), drops_(0) {
+      for (unsigned int i = 0; i <= mask_; i++) {
+        cells_[i].seq.store(i, std::memory_order_relaxed);
+      }
+    }
+    Channel(Channel const &) = delete;
+    ~Channel() {}
+
+    // returns false if the item was not queued
+    bool push(T& item) {
+      while (!reserve()) {
+        if (policy_ == Channel::Policy::kDropNewest) {
+          drops_++;
+          return false;
+        } else if (policy_ == Channel::Policy::kDropOldest) {
+          T old;
+          if (pop(old)) {
+            drops_++;
+          }
+        } else {
+          std::this_thread::yield();
+        }
+      }
+      enqueue(item);
+      return true;
+    }
+
+    // returns false if the channel is empty
+    bool pop(T& item) {
+      uint32_t pos = tail_.load(std::memory_order_relaxed);
+      while (1) {
+        Cell& cell = cells_[pos & mask_];
+        uint32_t seq = cell.seq.load(std::memory_order_acquire);
+        int32_t dif = static_cast<int32_t>(seq - (pos + 1));
+        if (dif == 0) {
+          if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            item = std::move(cell.data);
+            cell.data = T();
+            cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+            count_.fetch_sub(1, std::memory_order_release);
+            return true;
+          }
+        } else if (dif < 0) {
+          return false;
+        } else {
+          pos = tail_.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    // drain the channel keeping only the newest item
+    bool latest(T& item) {
+      bool found = false;
+      while (pop(item)) {
+        found = true;
+      }
+      return found;
+    }
+
+    inline unsigned int size()     { return count_.load(std::memory_order_acquire); }
+    inline unsigned int capacity() { return capacity_; }
+    inline unsigned int room()     { unsigned int n = size(); return (n < capacity_) ? capacity_ - n : 0; }
+    inline uint64_t drops()        { return drops_.load(std::memory_order_relaxed); }
+    inline size_t bytes()          { return cells_.size() * sizeof(Cell); }   // the cells only
+
+  private:
+    class alignas(64) Cell {
+      public:
+        Cell() : seq(0) {}
+        ~Cell() {}
+      public:
+        std::atomic<uint32_t> seq;
+        T data;
+    };
+
+    const unsigned int capacity_;
+    const Channel::Policy policy_;
+    const uint32_t mask_;
+    std::vector<Cell> cells_;
+
+    alignas(64) std::atomic<uint32_t> head_;
+    alignas(64) std::atomic<uint32_t> tail_;
+    alignas(64) std::atomic<unsigned int> count_;
+    std::atomic<uint64_t> drops_;
+
+    // power of two and never less than two so a full cell can't look empty
+    static uint32_t ringSize(unsigned int capacity) {
+      uint32_t size = 2;
+      while (size < capacity) {
+        size <<= 1;
+      }
+      return size;
+    }
+
+    // claim room for one item against the logical capacity
+    bool reserve() {
+      unsigned int cnt = count_.load(std::memory_order_acquire);
+      while (cnt < capacity_) {
+        if (count_.compare_exchange_weak(cnt, cnt + 1, std::memory_order_acq_rel)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void enqueue(T& item) {
+      uint32_t pos = head_.load(std::memory_order_relaxed);
+      while (1) {
+        Cell& cell = cells_[pos & mask_];
+        uint32_t seq = cell.seq.load(std::memory_order_acquire);
+        int32_t dif = static_cast<int32_t>(seq - pos);
+        if (dif == 0) {
+          if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            cell.data = item;
+            cell.seq.store(pos + 1, std::memory_order_release);
+            return;
+          }
+        } else if (dif < 0) {
+          // reserved room is freed by a pop still in flight
+          std::this_thread::yield();
+          pos = head_.load(std::memory_order_relaxed);
+        } else {
+          pos = head_.load(std::memory_order_relaxed);
+        }
+      }
+    }
+};
+
+} // namespace detector
+
+#endif // CHANNEL_H
@@ -0,0 +1,250 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include "classify.h"
+#include "pyramid.h"
+#include "names.h"
+
+namespace detector {
+
+Classify::Classify() {
+}
+
+Classify::~Classify() {
+}
+
+std::unique_ptr<Classify> Classify::create(unsigned int width, unsigned int height,
+    unsigned int pix_fmt, unsigned int stride, const std::string& model,
+    const std::string& labels, unsigned int threads) {
+  auto obj = std::unique_ptr<Classify>(new Classify());
+  if (!obj->init(width, height, pix_fmt, stride, model, labels, threads)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Classify::init(unsigned int width, unsigned int height,
+    unsigned int pix_fmt, unsigned int stride, const std::string& model,
+    const std::string& labels, unsigned int threads) {
+
+  width_ = width;
+  height_ = height;
+  pix_fmt_ = pix_fmt;
+  stride_ = stride;
+  threads_ = threads;
+  crop_cnt = 0;
+
+  scaler_ = pick_rgb24_scaler(pix_fmt_);
+  if (!scaler_) {
+    dbgMsg("unsupported frame format %s\n", PixelFormatToStr(pix_fmt_));
+    return false;
+  }
+
+  model_ = tflite::FlatBufferModel::BuildFromFile(model.c_str());
+  if (!model_) {
+    dbgMsg("failed: classify model %s\n", model.c_str());
+    return false;
+  }
+
+  // one label a line, attr is the line number
+  labels_.clear();
+  if (!labels.empty()) {
+    std::ifstream ifs(labels.c_str(), std::ifstream::in);
+    if (!ifs) {
+      dbgMsg("could not open classify labels %s\n", labels.c_str());
+    }
+    std::string line;
+    while (std::getline(ifs, line)) {
+      labels_.push_back(Names::intern(line));
+    }
+  }
+
+  // the compiler's name for what it made, that one waits for the tpu
+  tpu_ = model.find("_edgetpu") != std::string::npos;
+  return tpu_ || build();
+}
+
+bool Classify::attach(const std::shared_ptr<edgetpu::EdgeTpuContext>& context) {
+  if (!tpu_ || !context || (context == context_ && interpreter_)) {
+    return true;
+  }
+  interpreter_.reset();
+  context_ = context;
+  share_ = TpuShare::get(context.get());
+  return build();
+}
+
+bool Classify::build() {
+
+  tflite::ops::builtin::BuiltinOpResolver resolver;
+  if (context_) {
+    resolver.AddCustom(edgetpu::kCustomOp, edgetpu::RegisterCustomOp());
+  }
+  tflite::InterpreterBuilder(*model_, resolver)(&interpreter_);
+  if (!interpreter_) {
+    dbgMsg("failed: classify interpreter\n");
+    return false;
+  }
+  if (context_) {
+    interpreter_->SetExternalContext(kTfLiteEdgeTpuContext, context_.get());
+  }
+  interpreter_->SetNumThreads(std::max(threads_, 1u));
+  if (interpreter_->AllocateTensors() != kTfLiteOk) {
+    dbgMsg("failed: classify tensors\n");
+    interpreter_.reset();
+    return false;
+  }
+
+  TfLiteTensor* in = interpreter_->tensor(interpreter_->inputs()[0]);
+  TfLiteTensor* out = interpreter_->tensor(interpreter_->outputs()[0]);
+  if (in->dims->size != 4 || in->dims->data[3] != 3 ||
+      (in->type != kTfLiteUInt8 && in->type != kTfLiteFloat32) ||
+      (out->type != kTfLiteUInt8 && out->type != kTfLiteFloat32)) {
+    dbgMsg("failed: classify model wants a 3 channel uint8 or float input and output\n");
+    interpreter_.reset();
+    return false;
+  }
+  batch_ = in->dims->data[0];
+  batched_ = true;
+  in_height_ = in->dims->data[1];
+  in_width_ = in->dims->data[2];
+  rgb_.resize(batch_max_ * in_width_ * in_height_ * 3);
+  return true;
+}
+
+bool Classify::resize(unsigned int batch) {
+  if (batch == batch_) {
+    return true;
+  }
+  if (!batched_) {
+    return false;
+  }
+  int input = interpreter_->inputs()[0];
+  if (interpreter_->ResizeInputTensor(input,
+        { static_cast<int>(batch), static_cast<int>(in_height_),
+          static_cast<int>(in_width_), 3 }) != kTfLiteOk ||
+      interpreter_->AllocateTensors() != kTfLiteOk) {
+    dbgMsg("classify model can't batch, one crop an invoke\n");
+    batched_ = false;
+    interpreter_->ResizeInputTensor(input,
+        { static_cast<int>(batch_), static_cast<int>(in_height_),
+          static_cast<int>(in_width_), 3 });
+    interpreter_->AllocateTensors();
+    return false;
+  }
+  batch_ = batch;
+  return true;
+}
+
+void Classify::crop(const FrameBuf& frame, const BoxBuf& box, unsigned char* dst) {
+
+  Rect src = { box.x & ~1u, box.y & ~1u, 0, 0 };
+  src.w = std::max(std::min(box.w, width_ - src.x) & ~1u, 2u);
+  src.h = std::max(std::min(box.h, height_ - src.y) & ~1u, 2u);
+  Rect out = { 0, 0, in_width_, in_height_ };
+
+  // a big box has all the detail it needs in a smaller level
+  unsigned int k = frame.levels ? frame.levels->find(src, in_width_, in_height_) : 0;
+  const Level* lvl = (k > 0) ? frame.levels->get(k) : nullptr;
+  if (lvl) {
+    Rect s = { (src.x >> k) & ~1u, (src.y >> k) & ~1u,
+      (src.w >> k) & ~1u, (src.h >> k) & ~1u };
+    s.w = std::max(std::min(s.w, lvl->width - s.x), 2u);
+    s.h = std::max(std::min(s.h, lvl->height - s.y), 2u);
+    scaler_(lvl->addr, lvl->stride, lvl->slice, s, dst, in_width_, in_height_, out, 0);
+  } else {
+    scaler_(frame.addr, stride_, ALIGN_16B(height_), src, dst, in_width_, in_height_, out, 0);
+  }
+}
+
+void Classify::invoke(unsigned int num, BoxBuf* boxes) {
+
+  size_t len = in_width_ * in_height_ * 3;
+  TfLiteTensor* in = interpreter_->tensor(interpreter_->inputs()[0]);
+  if (in->type == kTfLiteUInt8) {
+    std::memcpy(in->data.uint8, rgb_.data(), num * len);
+  } else {
+    float scale = (in->params.scale > 0.f) ? in->params.scale : 1.f / 127.5f;
+    float zero = (in->params.scale > 0.f) ? in->params.zero_point : 127.5f;
+    quantise_rgb24(rgb_.data(), in->data.f, num * len, scale, zero);
+  }
+  if (share_) {
+    share_->begin(model_.get());
+  }
+  bool ok = interpreter_->Invoke() == kTfLiteOk;
+  if (share_) {
+    share_->end();
+  }
+  if (!ok) {
+    dbgMsg("failed: classify invoke\n");
+    return;
+  }
+
+  // one row of class scores a crop
+  TfLiteTensor* out = interpreter_->tensor(interpreter_->outputs()[0]);
+  unsigned int classes = out->bytes / ((out->type == kTfLiteUInt8) ? 1 : sizeof(float)) / num;
+  for (unsigned int b = 0; b < num; b++) {
+    int best = -1;
+    float best_score = 0.f;
+    for (unsigned int i = 0; i < classes; i++) {
+      unsigned int at = b * classes + i;
+      float s = (out->type == kTfLiteUInt8) ?
+        (out->data.uint8[at] - out->params.zero_point) * out->params.scale : out->data.f[at];
+      if (best < 0 || s > best_score) {
+        best = i;
+        best_score = s;
+      }
+    }
+    while (best >= 0 && static_cast<unsigned int>(best) >= labels_.size()) {
+      labels_.push_back(Names::intern(std::to_string(labels_.size())));
+    }
+    boxes[b].attr = (best >= 0) ? labels_[best] : -1;
+    boxes[b].attr_score = best_score;
+  }
+}
+
+void Classify::run(const FrameBuf& frame, std::vector<BoxBuf>& boxes,
+    unsigned int most) {
+
+  unsigned int num = std::min({ static_cast<unsigned int>(boxes.size()), batch_max_, most });
+  if (frame.addr == nullptr || num == 0 || !interpreter_) {
+    return;
+  }
+
+  differ_eval.begin();
+  size_t len = in_width_ * in_height_ * 3;
+  for (unsigned int i = 0; i < num; i++) {
+    crop(frame, boxes[i], rgb_.data() + i * len);
+  }
+  if (resize(num)) {
+    invoke(num, boxes.data());
+  } else {
+    for (unsigned int i = 0; i < num; i++) {
+      std::memmove(rgb_.data(), rgb_.data() + i * len, len);
+      invoke(1, boxes.data() + i);
+    }
+  }
+  crop_cnt += num;
+  differ_eval.end();
+}
+
+} // namespace detector
@@ -0,0 +1,110 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Second model on the detected boxes.
+ *
+ *  A classifier (vehicle type or colour, person attributes) run on the
+ *  crops of a frame's boxes after post.  Each crop is cut out of the
+ *  smallest pyramid level that still covers the model's input and
+ *  scaled to it, and all of a frame's crops go through one invoke with a
+ *  batch of that many, or one invoke each when the model's batch can't
+ *  be resized.  The best class, by its interned label (see names.h, its
+ *  number without a labels file), and its score end up in the box's 'attr'
+ *  and 'attr_score'.  It has its own interpreter and threads and runs on
+ *  tflow's post thread.  A model named *_edgetpu* goes on the detector's
+ *  first tpu once tflow has it open, taking turns with the detector
+ *  there (see tpushare.h); compile the two together so the tpu caches
+ *  both sets of parameters.
+ */
+
+#ifndef CLASSIFY_H
+#define CLASSIFY_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+#include "listener.h"
+#include "edgetpu.h"
+#include "tpushare.h"
+
+#include <tensorflow/lite/interpreter.h>
+#include <tensorflow/lite/kernels/register.h>
+#include <tensorflow/lite/model.h>
+
+namespace detector {
+
+class Classify {
+  public:
+    static std::unique_ptr<Classify> create(unsigned int width, unsigned int height,
+        unsigned int pix_fmt, unsigned int stride, const std::string& model,
+        const std::string& labels, unsigned int threads);
+    ~Classify();
+
+  public:
+    // the first 'batch_max_' boxes of 'frame' get their attr, or the
+    // first 'most' while the caller is behind
+    void run(const FrameBuf& frame, std::vector<BoxBuf>& boxes,
+        unsigned int most = credit_any);
+
+    // an edgetpu model's interpreter is made on 'context', until then
+    // it doesn't run; a cpu model ignores it
+    bool attach(const std::shared_ptr<edgetpu::EdgeTpuContext>& context);
+    inline bool onTpu() { return tpu_; }
+
+    MicroDiffer<uint32_t> differ_eval;
+    unsigned int crop_cnt;
+
+  protected:
+    Classify();
+    bool init(unsigned int width, unsigned int height,
+        unsigned int pix_fmt, unsigned int stride, const std::string& model,
+        const std::string& labels, unsigned int threads);
+
+  private:
+    unsigned int width_;
+    unsigned int height_;
+    unsigned int pix_fmt_;
+    unsigned int stride_;
+    unsigned int threads_;
+
+    std::unique_ptr<tflite::FlatBufferModel> model_;
+    std::unique_ptr<tflite::Interpreter> interpreter_;
+    bool tpu_;
+    std::shared_ptr<edgetpu::EdgeTpuContext> context_;   // outlives the interpreter
+    std::shared_ptr<TpuShare> share_;
+    bool build();
+    Rgb24Scaler scaler_;
+    unsigned int in_width_;
+    unsigned int in_height_;
+    std::vector<int> labels_;        // interned, see names.h
+    std::vector<unsigned char> rgb_;
+
+    const unsigned int batch_max_ = {8};
+    unsigned int batch_;        // what the input is sized for
+    bool batched_;              // false once a resize failed
+    bool resize(unsigned int batch);
+    void crop(const FrameBuf& frame, const BoxBuf& box, unsigned char* dst);
+    void invoke(unsigned int num, BoxBuf* boxes);
+};
+
+} // namespace detector
+
+#endif // CLASSIFY_H
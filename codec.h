@@ -0,0 +1,113 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Hardware H264 codec interface.
+ *
+ *  The encoder thread drives a backend through this interface.  It fills
+ *  input buffers with frames, hands them over and collects the H264 that
+ *  comes back.  Backends only call 'wake' on the owner when something is
+ *  done, everything else happens on the encoder thread.
+ *
+ *    omx.{h,cpp}:  OMX.broadcom.video_encode
+ *    m2m.{h,cpp}:  bcm2835-codec through V4L2 mem2mem (/dev/video11)
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <vector>
+
+#include "listener.h"
+
+namespace detector {
+
+class Footprint;
+
+class Codec {
+  public:
+    // a raw frame buffer, one of the codec's own or an imported capture buffer
+    class Input {
+      public:
+        Input() : index(0), addr(nullptr), length(0) {}
+        ~Input() {}
+      public:
+        unsigned int index;
+        unsigned char* addr;
+        unsigned int length;
+    };
+
+    // H264 out of the codec, 'end' marks the last piece of a frame
+    class Output {
+      public:
+        Output() : index(0), data(nullptr), length(0), end(false), key(false), vectors(false) {}
+        ~Output() {}
+      public:
+        unsigned int index;
+        unsigned char* data;
+        unsigned int length;
+        bool end;
+        bool key;
+        bool vectors;   // the frame's motion vectors, not a NAL
+    };
+
+  public:
+    virtual ~Codec() {}
+
+    virtual const char* name() = 0;
+
+    virtual bool open(unsigned int width, unsigned int height, unsigned int framerate,
+        unsigned int pix_fmt, unsigned int bitrate) = 0;
+    virtual bool close() = 0;
+
+    // encode straight out of the capture buffers, every input has to be back first
+    virtual bool useBuffers(std::vector<FrameBuf>& bufs) = 0;
+
+    virtual bool getInput(Codec::Input& in) = 0;                      // one of our own
+    virtual bool findInput(const FrameBuf& frame, Codec::Input& in) = 0;  // imported
+    virtual void putInput(Codec::Input& in) = 0;                      // not used after all
+    virtual bool encode(Codec::Input& in, unsigned int len) = 0;
+    virtual bool doneInput(Codec::Input& in) = 0;                     // codec is finished with it
+
+    virtual bool getOutput(Codec::Output& out) = 0;
+    virtual bool putOutput(Codec::Output& out) = 0;
+
+    virtual bool setBitrate(unsigned int bitrate) = 0;
+    virtual bool requestKeyFrame() = 0;
+
+    // before 'open', 'rows' of macroblocks a slice with each NAL handed out as
+    // soon as it is done, 0 for whole frames
+    virtual void setSlices(unsigned int rows) {}
+
+    // before 'open', frames from one key frame to the next, 0 for its own
+    virtual void setGop(unsigned int frames) {}
+
+    // before 'open', a buffer of macroblock motion vectors after each frame
+    virtual void setVectors(bool on) {}
+
+    // before 'open', 'num' frames in flight, our own input buffers and one
+    // more output, 0 keeps its own
+    virtual void setBuffers(unsigned int num) {}
+
+    // the buffers it allocated, not the imported ones
+    virtual void footprint(Footprint& out) {}
+};
+
+} // namespace detector
+
+#endif // CODEC_H
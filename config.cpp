@@ -0,0 +1,211 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <fstream>
+#include <cstring>
+
+#include "utils.h"
+#include "config.h"
+
+namespace detector {
+
+static std::string trim(const std::string& str) {
+  size_t b = str.find_first_not_of(" \t\r");
+  if (b == std::string::npos) {
+    return "";
+  }
+  size_t e = str.find_last_not_of(" \t\r");
+  return str.substr(b, e - b + 1);
+}
+
+Config::Config() {
+}
+
+Config::~Config() {
+}
+
+std::unique_ptr<Config> Config::create(const std::string& path) {
+  auto obj = std::unique_ptr<Config>(new Config());
+  if (!obj->init(path)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Config::init(const std::string& path) {
+
+  path_ = path;
+  std::ifstream ifs(path.c_str(), std::ifstream::in);
+  if (!ifs) {
+    fprintf(stderr, "%s: could not open it\n", path.c_str());
+    return false;
+  }
+
+  // the lines in front of the first profile
+  Profile* cur = &profiles_[""];
+  cur->line = 0;
+
+  std::string line;
+  unsigned int num = 0;
+  while (std::getline(ifs, line)) {
+    num++;
+    size_t hash = line.find('#');
+    if (hash != std::string::npos) {
+      line.resize(hash);
+    }
+    line = trim(line);
+    if (line.empty()) {
+      continue;
+    }
+
+    // [name] or [name : base]
+    if (line[0] == '[') {
+      if (line.back() != ']') {
+        fprintf(stderr, "%s:%u: bad profile: %s\n", path.c_str(), num, line.c_str());
+        return false;
+      }
+      std::string name = line.substr(1, line.size() - 2);
+      std::string base;
+      size_t colon = name.find(':');
+      if (colon != std::string::npos) {
+        base = trim(name.substr(colon + 1));
+        name.resize(colon);
+        if (base.empty()) {
+          fprintf(stderr, "%s:%u: bad profile base: %s\n", path.c_str(), num, line.c_str());
+          return false;
+        }
+      }
+      name = trim(name);
+      if (name.empty() || profiles_.count(name)) {
+        fprintf(stderr, "%s:%u: %s profile: %s\n", path.c_str(), num,
+            name.empty() ? "unnamed" : "second", line.c_str());
+        return false;
+      }
+      cur = &profiles_[name];
+      cur->base = base;
+      cur->line = num;
+      continue;
+    }
+
+    // key or key = value
+    Setting s;
+    size_t eq = line.find('=');
+    s.key = trim(line.substr(0, eq));
+    s.has_value = (eq != std::string::npos);
+    s.value = s.has_value ? trim(line.substr(eq + 1)) : "";
+    s.line = num;
+    if (s.key.empty() || (s.has_value && s.value.empty())) {
+      fprintf(stderr, "%s:%u: bad setting: %s\n", path.c_str(), num, line.c_str());
+      return false;
+    }
+    cur->settings.push_back(s);
+  }
+  return true;
+}
+
+std::vector<std::string> Config::profiles() {
+  std::vector<std::string> names;
+  for (auto& p : profiles_) {
+    if (!p.first.empty()) {
+      names.push_back(p.first);
+    }
+  }
+  return names;
+}
+
+bool Config::args(const std::string& profile, const struct option* long_opts,
+    const char* short_opts, std::vector<std::string>& out) {
+
+  if (!profile.empty() && !profiles_.count(profile)) {
+    fprintf(stderr, "%s: no profile '%s'\n", path_.c_str(), profile.c_str());
+    return false;
+  }
+  std::vector<std::string> seen;
+  if (!add("", long_opts, short_opts, seen, out)) {
+    return false;
+  }
+  return profile.empty() || add(profile, long_opts, short_opts, seen, out);
+}
+
+bool Config::add(const std::string& name, const struct option* long_opts,
+    const char* short_opts, std::vector<std::string>& seen,
+    std::vector<std::string>& out) {
+
+  Profile& p = profiles_[name];
+  for (auto& s : seen) {
+    if (s == name) {
+      fprintf(stderr, "%s:%u: profile '%s' is its own base\n",
+          path_.c_str(), p.line, name.c_str());
+      return false;
+    }
+  }
+  seen.push_back(name);
+  if (!p.base.empty()) {
+    if (!profiles_.count(p.base)) {
+      fprintf(stderr, "%s:%u: no profile '%s'\n", path_.c_str(), p.line, p.base.c_str());
+      return false;
+    }
+    if (!add(p.base, long_opts, short_opts, seen, out)) {
+      return false;
+    }
+  }
+
+  for (auto& s : p.settings) {
+
+    // the option and whether it takes a value
+    std::string arg;
+    int takes = -1;
+    if (s.key.size() == 1) {
+      const char* c = strchr(short_opts, s.key[0]);
+      if (c && *c != ':') {
+        takes = (c[1] == ':') ? required_argument : no_argument;
+        arg = "-" + s.key;
+      }
+    } else if (s.key != "config") {
+      for (const struct option* o = long_opts; o->name; o++) {
+        if (s.key == o->name) {
+          takes = o->has_arg;
+          arg = "--" + s.key;
+          break;
+        }
+      }
+    }
+    if (takes < 0) {
+      fprintf(stderr, "%s:%u: no option '%s'\n", path_.c_str(), s.line, s.key.c_str());
+      return false;
+    }
+
+    if (takes == no_argument) {
+      if (!s.has_value || s.value == "on" || s.value == "true" || s.value == "1") {
+        out.push_back(arg);
+      } else if (s.value != "off" && s.value != "false" && s.value != "0") {
+        fprintf(stderr, "%s:%u: '%s' is on or off\n", path_.c_str(), s.line, s.key.c_str());
+        return false;
+      }
+    } else if (!s.has_value) {
+      fprintf(stderr, "%s:%u: '%s' needs a value\n", path_.c_str(), s.line, s.key.c_str());
+      return false;
+    } else {
+      out.push_back(arg);
+      out.push_back(s.value);
+    }
+  }
+  return true;
+}
+
+} // namespace detector
@@ -0,0 +1,102 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Configuration file of named profiles.
+ *
+ *  With --config file[,profile] the options come from a file as well as
+ *  the command line, so a camera or a board is tuned without a rebuild
+ *  or a long script.  One setting a line, '#' starts a comment:
+ *
+ *    framerate = 15
+ *    tpu
+ *
+ *    [pi4]
+ *    f = 30
+ *    A = cap=fifo:90@0,enc=rr:50@1,tfl=other:5@2-3
+ *    K = 2@2-3
+ *    buffers = 8
+ *
+ *    [pi4-usb : pi4]
+ *    mjpeg
+ *
+ *  A key is a long option's name or a letter option, as on the command
+ *  line and with no dashes; an option without a value is on with just
+ *  its name.  The lines in front of the first profile are used by all of
+ *  them, and '[name : base]' starts with base's.  The profile's settings
+ *  go in front of the real command line, so the command line wins, and
+ *  they are checked against the options before anything starts: a key
+ *  that is no option, a value missing or given to a switch, a profile
+ *  that isn't there or a loop of bases stops the run with the file and
+ *  line.
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <map>
+#include <getopt.h>
+
+namespace detector {
+
+class Config {
+  public:
+    static std::unique_ptr<Config> create(const std::string& path);
+    ~Config();
+
+  public:
+    // 'profile' as command line arguments checked against the options,
+    // an empty profile is just the lines in front of the first one
+    bool args(const std::string& profile, const struct option* long_opts,
+        const char* short_opts, std::vector<std::string>& out);
+
+    std::vector<std::string> profiles();
+
+  protected:
+    Config();
+    bool init(const std::string& path);
+
+  private:
+    class Setting {
+      public:
+        std::string key;
+        std::string value;
+        bool has_value;
+        unsigned int line;
+    };
+    class Profile {
+      public:
+        std::string base;
+        unsigned int line;
+        std::vector<Setting> settings;
+    };
+
+    std::string path_;
+    std::map<std::string, Profile> profiles_;
+
+    bool add(const std::string& name, const struct option* long_opts,
+        const char* short_opts, std::vector<std::string>& seen,
+        std::vector<std::string>& out);
+};
+
+} // namespace detector
+
+#endif // CONFIG_H
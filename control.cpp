@@ -0,0 +1,355 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cstring>
+#include <sstream>
+
+#include "control.h"
+#include "encoder.h"
+#include "tracker.h"
+#include "tflow.h"
+#include "capturer.h"
+#include "trace.h"
+
+namespace detector {
+
+Control::Control(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Control::~Control() {
+}
+
+std::unique_ptr<Control> Control::create(unsigned int yield_time, bool quiet,
+    const std::string& path, Pipeline* pipe) {
+  auto obj = std::unique_ptr<Control>(new Control(yield_time));
+  obj->init(quiet, path, pipe);
+  return obj;
+}
+
+bool Control::init(bool quiet, const std::string& path, Pipeline* pipe) {
+
+  quiet_ = quiet;
+  path_ = path;
+  pipe_ = pipe;
+
+  listen_fd_ = -1;
+
+  control_on_ = false;
+  cmd_cnt_ = 0;
+  bad_cnt_ = 0;
+  model_cnt_ = 0;
+
+  return true;
+}
+
+std::string Control::apply(const std::string& line) {
+
+  std::istringstream iss(line);
+  std::string cmd;
+  if (!(iss >> cmd)) {
+    return "";
+  }
+
+  auto enc = pipe_->get<Encoder>("enc");
+  auto tfl = pipe_->get<Tflow>("tfl");
+  auto trk = pipe_->get<Tracker>("trk");
+  auto cap = pipe_->get<Capturer>("cap");
+
+  if (cmd == "get") {
+    std::ostringstream oss;
+    if (tfl) {
+      oss << "threshold " << tfl->getThreshold() << "\n";
+      oss << "low " << tfl->getLowThreshold() << "\n";
+      oss << "rate " << tfl->getRate() << "\n";
+      oss << "regions " << tfl->getRegions() << "\n";
+      oss << "model " << tfl->getModel() << "\n";
+    }
+    if (enc) {
+      oss << "bitrate " << enc->getBitrate() << "\n";
+      oss << "draw " << (enc->getDraw() ? "on" : "off") << "\n";
+    }
+    if (cap) {
+      Rect crop = cap->getCrop();
+      if (crop.w && crop.h) {
+        oss << "crop " << crop.x << " " << crop.y << " " << crop.w << " " << crop.h << "\n";
+      } else {
+        oss << "crop off\n";
+      }
+      oss << "fps " << cap->getFramerate() << "\n";
+      oss << "exposure " << cap->getExposure() << "\n";
+      oss << "gain " << cap->getGain() << "\n";
+    }
+    return oss.str() + "ok\n";
+
+  } else if (cmd == "latency") {
+    // each ask starts a new interval
+    std::ostringstream oss;
+    auto line = [&oss](const char* name, const Histogram::Percentiles& p) {
+      oss << name << " cnt " << p.cnt << " p50 " << p.p50 << " p90 " << p.p90
+        << " p99 " << p.p99 << " p999 " << p.p999 << " us\n";
+    };
+    if (tfl) {
+      line("tflow", tfl->latency());
+    }
+    if (enc) {
+      line("encoder", enc->latency());
+    }
+    return oss.str() + "ok\n";
+
+  } else if (cmd == "trace") {
+    std::string path;
+    if (!(iss >> path)) {
+      return "error: trace <file>\n";
+    }
+    if (!Trace::write(path)) {
+      return "error: tracing is off or can't write the file\n";
+    }
+
+  } else if (cmd == "threshold" || cmd == "low") {
+    float score;
+    if (!tfl || !(iss >> score) || score <= 0.f || score > 1.f) {
+      return "error: score is (0,1]\n";
+    }
+    if (cmd == "threshold") {
+      float low = tfl->getLowThreshold();
+      bool two_stage = low < tfl->getThreshold();
+      tfl->setThresholds(score, two_stage ? low : score);
+      if (trk) {
+        trk->setHighScore(score);
+      }
+    } else {
+      tfl->setThresholds(tfl->getThreshold(), score);
+    }
+
+  } else if (cmd == "rate") {
+    float rate;
+    if (!tfl || !(iss >> rate) || rate < 0.f) {
+      return "error: rate is 0 or more\n";
+    }
+    tfl->setRate(rate);
+
+  } else if (cmd == "regions") {
+    unsigned int regions;
+    if (!tfl || !(iss >> regions)) {
+      return "error: regions is a count\n";
+    }
+    tfl->setRegions(regions);
+
+  } else if (cmd == "bitrate") {
+    unsigned int bitrate;
+    if (!enc || !(iss >> bitrate) || bitrate == 0) {
+      return "error: bitrate is bits per second\n";
+    }
+    enc->setBitrate(bitrate);
+
+  } else if (cmd == "key") {
+    if (!enc) {
+      return "error: no encoder\n";
+    }
+    enc->requestKeyFrame();
+
+  } else if (cmd == "draw") {
+    std::string on;
+    if (!enc || !(iss >> on) || (on != "on" && on != "off")) {
+      return "error: draw on or off\n";
+    }
+    enc->setDraw(on == "on");
+
+  } else if (cmd == "crop") {
+    Rect crop = { 0, 0, 0, 0 };
+    std::string off;
+    if (!cap) {
+      return "error: no camera\n";
+    }
+    if (!(iss >> crop.x >> crop.y >> crop.w >> crop.h)) {
+      iss.clear();
+      if (!(iss >> off) || off != "off") {
+        return "error: crop x y w h or off\n";
+      }
+      crop = { 0, 0, 0, 0 };
+    } else if (crop.w == 0 || crop.h == 0) {
+      return "error: crop x y w h or off\n";
+    }
+    cap->setCrop(crop);
+
+  } else if (cmd == "fps") {
+    unsigned int fps;
+    if (!cap || !(iss >> fps) || fps == 0) {
+      return "error: fps is frames per second\n";
+    }
+    cap->setFramerate(fps);
+
+  } else if (cmd == "exposure" || cmd == "gain") {
+    unsigned int val = 0;
+    std::string word;
+    if (!cap) {
+      return "error: no camera\n";
+    }
+    if (!(iss >> val)) {
+      iss.clear();
+      if (!(iss >> word) || word != "auto") {
+        return "error: " + cmd + " is a value or auto\n";
+      }
+      val = 0;
+    }
+    if (cmd == "exposure") {
+      cap->setExposure(val);
+    } else {
+      cap->setGain(val);
+    }
+
+  } else if (cmd == "model") {
+    std::string model, labels;
+    if (!tfl || !(iss >> model >> labels)) {
+      return "error: model <file> <labels>\n";
+    }
+
+    // loaded beside the running model and swapped in between frames
+    if (!tfl->swapModel(model, labels)) {
+      return "error: can't read the model or labels\n";
+    }
+    model_cnt_++;
+
+  } else {
+    return "error: unknown command\n";
+  }
+  return "ok\n";
+}
+
+void Control::handle(int fd) {
+
+  // one short line at a time, a slow client gets dropped
+  std::string req;
+  char buf[256];
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  while (req.size() < req_max_ && poll(&pfd, 1, req_timeout_) > 0) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0) {
+      break;
+    }
+    req.append(buf, n);
+
+    size_t eol;
+    while ((eol = req.find('\n')) != std::string::npos) {
+      std::string res = apply(req.substr(0, eol));
+      req.erase(0, eol + 1);
+      if (res.empty()) {
+        continue;
+      }
+      cmd_cnt_++;
+      if (res.compare(0, 6, "error:") == 0) {
+        bad_cnt_++;
+      }
+      if (write(fd, res.data(), res.size()) < 0) {
+        return;
+      }
+    }
+  }
+
+  // a last command without a newline
+  std::string res = apply(req);
+  if (!res.empty()) {
+    cmd_cnt_++;
+    if (res.compare(0, 6, "error:") == 0) {
+      bad_cnt_++;
+    }
+    if (write(fd, res.data(), res.size()) < 0) {
+      return;
+    }
+  }
+}
+
+bool Control::waitingToRun() {
+
+  if (!control_on_) {
+
+    dbgMsg("open control socket %s\n", path_.c_str());
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path_.size() >= sizeof(addr.sun_path)) {
+      dbgMsg("failed: control path too long\n");
+      return false;
+    }
+    std::strncpy(addr.sun_path, path_.c_str(), sizeof(addr.sun_path) - 1);
+
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd_ < 0) {
+      dbgMsg("failed: control socket\n");
+      return false;
+    }
+    unlink(path_.c_str());
+    if (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(listen_fd_, client_max_) < 0) {
+      dbgMsg("failed: control bind %s\n", path_.c_str());
+      close(listen_fd_);
+      listen_fd_ = -1;
+      return false;
+    }
+
+    control_on_ = true;
+  }
+
+  return true;
+}
+
+bool Control::running() {
+
+  if (control_on_) {
+    int fd;
+    while ((fd = accept(listen_fd_, nullptr, nullptr)) >= 0) {
+      handle(fd);
+      close(fd);
+    }
+  }
+  return true;
+}
+
+bool Control::paused() {
+  return true;
+}
+
+bool Control::waitingToHalt() {
+
+  if (control_on_) {
+    control_on_ = false;
+
+    close(listen_fd_);
+    listen_fd_ = -1;
+    unlink(path_.c_str());
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nControl Results...\n");
+      fprintf(stderr, "     commands: %u\n", cmd_cnt_);
+      fprintf(stderr, "     rejected: %u\n", bad_cnt_);
+      fprintf(stderr, "  model loads: %u\n", model_cnt_);
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
@@ -0,0 +1,96 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Live controls.
+ *
+ *  A unix socket that takes one command per line and changes the running
+ *  stages in place, e.g. 'echo "threshold 0.6" | socat - UNIX:<path>'.
+ *
+ *    get                    current settings
+ *    latency                tflow and encoder percentiles since last asked
+ *    trace <file>           per frame spans so far as chrome trace json
+ *    threshold <score>      detection score, held to low if it is above
+ *    low <score>            low score boxes for the tracker
+ *    rate <per sec>         detections per second, 0 as fast as possible
+ *    regions <n>            full frame every n detections
+ *    bitrate <bps>          encoder bitrate
+ *    key                    key frame now
+ *    draw on|off            boxes on the video
+ *    crop x y w h|off       sensor area the camera captures, see Capturer::setCrop
+ *    fps <n>                camera frame rate
+ *    exposure <usec>|auto   camera exposure
+ *    gain <n>|auto          camera gain
+ *    model <file> <labels>  new model, swapped in once it is loaded
+ *
+ *  A new model is built and warmed up beside the running one and tflow
+ *  swaps it in between two frames, so detections only stop for the frames
+ *  already in flight.  Everything else is a value the stage picks up with
+ *  its next frame.
+ */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <string>
+#include <memory>
+
+#include "utils.h"
+#include "base.h"
+#include "pipeline.h"
+
+namespace detector {
+
+class Control : public Base {
+  public:
+    static std::unique_ptr<Control> create(unsigned int yield_time, bool quiet,
+        const std::string& path, Pipeline* pipe);
+    virtual ~Control();
+
+  protected:
+    Control() = delete;
+    Control(unsigned int yield_time);
+    bool init(bool quiet, const std::string& path, Pipeline* pipe);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    std::string path_;
+    Pipeline* pipe_;
+
+    int listen_fd_;
+    const unsigned int client_max_ = {4};
+    const unsigned int req_timeout_ = {500};   // msec
+    const size_t req_max_ = {1024};
+    void handle(int fd);
+    std::string apply(const std::string& line);
+
+    bool control_on_;
+    unsigned int cmd_cnt_;
+    unsigned int bad_cnt_;
+    unsigned int model_cnt_;
+};
+
+} // namespace detector
+
+#endif // CONTROL_H
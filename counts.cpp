@@ -0,0 +1,344 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "counts.h"
+#include "metrics.h"
+
+namespace detector {
+
+static const char* type_names[] = { "unknown", "person", "pet", "vehicle" };
+
+void Counts::Sketch::clear() {
+  std::fill(reg, reg + kRegs, 0);
+}
+
+void Counts::Sketch::add(unsigned int id) {
+
+  // splitmix64 spreads sequential ids over the registers
+  uint64_t h = id + 0x9e3779b97f4a7c15ull;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+  h ^= h >> 31;
+  unsigned int k = h >> 56;
+  uint64_t rest = (h << 8) | 0xff;
+  uint8_t rank = __builtin_clzll(rest) + 1;
+  reg[k] = std::max(reg[k], rank);
+}
+
+void Counts::Sketch::merge(const Counts::Sketch& other) {
+  for (unsigned int k = 0; k < kRegs; k++) {
+    reg[k] = std::max(reg[k], other.reg[k]);
+  }
+}
+
+unsigned int Counts::Sketch::estimate() const {
+  double m = kRegs;
+  double sum = 0.;
+  unsigned int zeros = 0;
+  for (unsigned int k = 0; k < kRegs; k++) {
+    sum += std::ldexp(1., -reg[k]);
+    zeros += (reg[k] == 0);
+  }
+  double est = 0.7213 / (1. + 1.079 / m) * m * m / sum;
+
+  // few ids, linear counting on the empty registers
+  if (est <= 2.5 * m && zeros != 0) {
+    est = m * std::log(m / zeros);
+  }
+  return static_cast<unsigned int>(est + .5);
+}
+
+void Counts::Bucket::clear() {
+  enters = 0;
+  exits = 0;
+  peak = 0;
+  occupied_ms = 0;
+  seen.clear();
+}
+
+Counts::Counts(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Counts::~Counts() {
+}
+
+std::unique_ptr<Counts> Counts::create(unsigned int yield_time, bool quiet,
+    unsigned int period) {
+  auto obj = std::unique_ptr<Counts>(new Counts(yield_time));
+  if (!obj->init(quiet, period)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Counts::init(bool quiet, unsigned int period) {
+
+  quiet_ = quiet;
+  period_ = period;
+  evt_ = nullptr;
+  counts_on_ = false;
+  for (unsigned int t = 0; t < kTypes; t++) {
+    frame_in_[t] = 0;
+  }
+  summary_cnt_ = 0;
+  enter_cnt_ = 0;
+  exit_cnt_ = 0;
+  head_ = 0;
+  if (period_ == 0) {
+    dbgMsg("failed: counts period 0\n");
+    return false;
+  }
+  scope(0);
+  return true;
+}
+
+Counts::Scope& Counts::scope(unsigned int n) {
+  while (scopes_.size() <= n) {
+    scopes_.emplace_back();
+    Counts::Scope& s = scopes_.back();
+    for (unsigned int t = 0; t < kTypes; t++) {
+      s.ring[t].resize(kBuckets);
+      for (auto& b : s.ring[t]) {
+        b.clear();
+      }
+      s.in[t] = 0;
+    }
+  }
+  return scopes_[n];
+}
+
+bool Counts::addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks) {
+  if (!counts_on_ || !tracks || !track_chan_.push(tracks)) {
+    return false;
+  }
+  wake();
+  return true;
+}
+
+bool Counts::addMessage(Events::Rule& hit) {
+  if (!counts_on_ || !rule_chan_.push(hit)) {
+    return false;
+  }
+  wake();
+  return true;
+}
+
+void Counts::setEvents(Events* evt) {
+  evt_ = evt;
+}
+
+void Counts::metrics(Exposition& out, const std::string& labels) {
+  for (unsigned int t = 1; t < kTypes; t++) {
+    out.gauge("detector_occupancy", "tracks in the frame", 
+        labels + ",type=\"" + type_names[t] + "\"", frame_in_[t]);
+  }
+  out.counter("detector_count_summaries_total", "count summaries sent", labels, summary_cnt_);
+  out.gauge("detector_queue_depth", "messages waiting for the stage", labels,
+      track_chan_.size() + rule_chan_.size());
+  out.counter("detector_queue_drops_total", "messages the stage's queue dropped", labels,
+      track_chan_.drops() + rule_chan_.drops());
+}
+
+void Counts::occupy(std::chrono::steady_clock::time_point now) {
+
+  // what was in each scope since the last change, by the msec
+  using namespace std::chrono;
+  if (now <= occupied_at_) {
+    return;
+  }
+  uint64_t ms = duration_cast<milliseconds>(now - occupied_at_).count();
+  for (auto& s : scopes_) {
+    for (unsigned int t = 0; t < kTypes; t++) {
+      s.ring[t][head_].occupied_ms += s.in[t] * ms;
+    }
+  }
+  occupied_at_ = now;
+}
+
+void Counts::publish(std::chrono::steady_clock::time_point stamp) {
+
+  for (unsigned int n = 0; n < scopes_.size(); n++) {
+    Counts::Scope& s = scopes_[n];
+    for (unsigned int t = 0; t < kTypes; t++) {
+      const Counts::Bucket& b = s.ring[t][head_];
+      if (b.enters == 0 && b.exits == 0 && b.peak == 0) {
+        continue;
+      }
+      Counts::Sketch window = b.seen;
+      for (auto& o : s.ring[t]) {
+        window.merge(o.seen);
+      }
+      Events::Count c;
+      c.stamp = stamp;
+      c.scope = n;
+      c.type = static_cast<BoxBuf::Type>(t);
+      c.enters = b.enters;
+      c.exits = b.exits;
+      c.peak = b.peak;
+      c.mean = b.occupied_ms * 10 / (period_ * 1000ull);
+      c.uniques = b.seen.estimate();
+      c.window = window.estimate();
+      if (evt_) {
+        evt_->addMessage(c);
+      }
+      summary_cnt_++;
+    }
+  }
+}
+
+void Counts::roll(std::chrono::steady_clock::time_point now) {
+
+  // close the periods that ended, after a long gap only the last ones
+  using namespace std::chrono;
+  unsigned int num = 0;
+  while (now >= bucket_end_) {
+    occupy(bucket_end_);
+    publish(bucket_end_);
+    head_ = (head_ + 1) % kBuckets;
+    for (auto& s : scopes_) {
+      for (unsigned int t = 0; t < kTypes; t++) {
+        s.ring[t][head_].clear();
+        s.ring[t][head_].peak = s.in[t];
+      }
+    }
+    bucket_end_ += seconds(period_);
+    if (++num >= kBuckets) {
+      occupied_at_ = now;
+      bucket_end_ = now + seconds(period_);
+    }
+  }
+}
+
+void Counts::tracks(const std::vector<TrackBuf>& tracks) {
+
+  Counts::Scope& s = scopes_[0];
+  next_.clear();
+  for (auto& track : tracks) {
+    unsigned int t = static_cast<unsigned int>(track.type) % kTypes;
+    next_[track.id] = track.type;
+    if (live_.find(track.id) == live_.end()) {
+      s.ring[t][head_].enters++;
+      s.ring[t][head_].seen.add(track.id);
+      enter_cnt_++;
+    }
+  }
+  for (auto& l : live_) {
+    if (next_.find(l.first) == next_.end()) {
+      s.ring[static_cast<unsigned int>(l.second) % kTypes][head_].exits++;
+      exit_cnt_++;
+    }
+  }
+  std::fill(s.in, s.in + kTypes, 0);
+  for (auto& n : next_) {
+    s.in[static_cast<unsigned int>(n.second) % kTypes]++;
+  }
+  for (unsigned int t = 0; t < kTypes; t++) {
+    Counts::Bucket& b = s.ring[t][head_];
+    b.peak = std::max(b.peak, s.in[t]);
+    frame_in_[t] = s.in[t];
+  }
+  live_.swap(next_);
+}
+
+void Counts::hit(const Events::Rule& hit) {
+
+  Counts::Scope& s = scope(hit.rule + 1);
+  unsigned int t = static_cast<unsigned int>(hit.type) % kTypes;
+  Counts::Bucket& b = s.ring[t][head_];
+  switch (hit.what) {
+    case Events::Rule::What::kEnter:
+      s.in[t]++;
+      b.enters++;
+      b.seen.add(hit.id);
+      b.peak = std::max(b.peak, s.in[t]);
+      break;
+    case Events::Rule::What::kExit:
+      s.in[t] -= (s.in[t] != 0);
+      b.exits++;
+      break;
+    case Events::Rule::What::kCross:
+      if (hit.value == 0) {
+        b.enters++;
+      } else {
+        b.exits++;
+      }
+      b.seen.add(hit.id);
+      break;
+    case Events::Rule::What::kDwell:
+      break;
+  }
+}
+
+bool Counts::waitingToRun() {
+
+  if (!counts_on_) {
+    auto now = std::chrono::steady_clock::now();
+    occupied_at_ = now;
+    bucket_end_ = now + std::chrono::seconds(period_);
+    counts_on_ = true;
+  }
+  return true;
+}
+
+bool Counts::running() {
+
+  if (counts_on_) {
+    std::shared_ptr<std::vector<TrackBuf>> posted;
+    Events::Rule rule;
+    while (track_chan_.pop(posted)) {
+      roll(std::chrono::steady_clock::now());
+      occupy(std::chrono::steady_clock::now());
+      tracks(*posted);
+      posted.reset();
+    }
+    while (rule_chan_.pop(rule)) {
+      roll(std::chrono::steady_clock::now());
+      occupy(std::chrono::steady_clock::now());
+      hit(rule);
+    }
+    roll(std::chrono::steady_clock::now());
+  }
+  return true;
+}
+
+bool Counts::paused() {
+  return true;
+}
+
+bool Counts::waitingToHalt() {
+
+  if (counts_on_) {
+    counts_on_ = false;
+
+    if (!quiet_) {
+      fprintf(stderr, "\nCounts Results...\n");
+      fprintf(stderr, "         scopes: %zu\n", scopes_.size());
+      fprintf(stderr, "   period (sec): %u\n", period_);
+      fprintf(stderr, "   enters/exits: %u/%u\n", enter_cnt_, exit_cnt_);
+      fprintf(stderr, "      summaries: %u\n", summary_cnt_);
+      fprintf(stderr, "\n");
+    }
+  }
+  return true;
+}
+
+} // namespace detector
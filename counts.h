@@ -0,0 +1,150 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  On-device counts and occupancy.
+ *
+ *  With --counts sec the tracks and the rules' events (see rules.h) are
+ *  folded into per scope and per class aggregates, scope 0 being the
+ *  whole frame and scope n the rule on line n-1 of the rules file, and
+ *  every 'sec' the period just closed goes out with the events (see
+ *  events.h) as
+ *
+ *    [10, msec, scope, type, enters, exits, peak, mean, uniques, window]
+ *
+ *  where for the frame enters and exits are tracks starting and going,
+ *  for a zone tracks entering and leaving it and for a line the crosses
+ *  to the left and to the right.  Peak and mean (in tenths, weighted by
+ *  time) are the tracks in the frame or zone over the period, uniques
+ *  the different track ids counted and window the ids over the last
+ *  kBuckets periods.  Scopes and classes with nothing in the period are
+ *  left out.
+ *
+ *  Memory is fixed once the scopes are known: a ring of kBuckets time
+ *  buckets each for every scope and class, and uniques are HyperLogLog
+ *  sketches of 256 registers (about 6.5% error), merged across the ring
+ *  for the window.
+ */
+
+#ifndef COUNTS_H
+#define COUNTS_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <atomic>
+#include <cstdint>
+
+#include "utils.h"
+#include "listener.h"
+#include "channel.h"
+#include "base.h"
+#include "events.h"
+
+namespace detector {
+
+class Counts : public Base, Listener<std::shared_ptr<std::vector<TrackBuf>>> {
+  public:
+    static std::unique_ptr<Counts> create(unsigned int yield_time, bool quiet,
+        unsigned int period);
+    virtual ~Counts();
+
+  public:
+    virtual bool addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks);
+    bool addMessage(Events::Rule& hit);
+
+    // where the summaries go, set before start
+    void setEvents(Events* evt);
+
+    virtual void metrics(Exposition& out, const std::string& labels);
+
+  protected:
+    Counts() = delete;
+    Counts(unsigned int yield_time);
+    bool init(bool quiet, unsigned int period);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    unsigned int period_;     // sec
+    Events* evt_;
+
+    Channel<std::shared_ptr<std::vector<TrackBuf>>> track_chan_{4,
+      Channel<std::shared_ptr<std::vector<TrackBuf>>>::Policy::kDropOldest};
+    Channel<Events::Rule> rule_chan_{64, Channel<Events::Rule>::Policy::kDropOldest};
+
+    class Sketch {
+      public:
+        static constexpr unsigned int kRegs = 256;
+        uint8_t reg[kRegs];
+        void clear();
+        void add(unsigned int id);
+        void merge(const Counts::Sketch& other);
+        unsigned int estimate() const;
+    };
+
+    // one period of a scope and class
+    class Bucket {
+      public:
+        unsigned int enters, exits;
+        unsigned int peak;
+        uint64_t occupied_ms;     // tracks in it times msec
+        Counts::Sketch seen;
+        void clear();
+    };
+
+    static constexpr unsigned int kBuckets = 60;
+    static constexpr unsigned int kTypes = 4;
+    class Scope {
+      public:
+        std::vector<Counts::Bucket> ring[kTypes];
+        unsigned int in[kTypes];
+    };
+    std::vector<Counts::Scope> scopes_;
+    Counts::Scope& scope(unsigned int n);
+
+    // the bucket of every ring being filled, and when it closes
+    unsigned int head_;
+    std::chrono::steady_clock::time_point bucket_end_;
+    std::chrono::steady_clock::time_point occupied_at_;
+    void occupy(std::chrono::steady_clock::time_point now);
+    void roll(std::chrono::steady_clock::time_point now);
+    void publish(std::chrono::steady_clock::time_point stamp);
+
+    // the frame's tracks on the last post, by id
+    std::unordered_map<unsigned int, BoxBuf::Type> live_;
+    std::unordered_map<unsigned int, BoxBuf::Type> next_;
+    void tracks(const std::vector<TrackBuf>& tracks);
+    void hit(const Events::Rule& hit);
+
+    std::atomic<bool> counts_on_;
+    std::atomic<unsigned int> frame_in_[kTypes];
+    unsigned int summary_cnt_;
+    unsigned int enter_cnt_, exit_cnt_;
+};
+
+} // namespace detector
+
+#endif // COUNTS_H
@@ -0,0 +1,300 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include "crops.h"
+#include "encoder.h"
+#include "metrics.h"
+#include "frames.h"
+
+namespace detector {
+
+Crops::Crops(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Crops::~Crops() {
+}
+
+std::unique_ptr<Crops> Crops::create(unsigned int yield_time, bool quiet,
+    const std::string& spec, unsigned int width, unsigned int height,
+    unsigned int pix_fmt) {
+  auto obj = std::unique_ptr<Crops>(new Crops(yield_time));
+  if (!obj->init(quiet, spec, width, height, pix_fmt)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Crops::init(bool quiet, const std::string& spec, unsigned int width,
+    unsigned int height, unsigned int pix_fmt) {
+
+  quiet_ = quiet;
+  width_ = width;
+  height_ = height;
+  pix_fmt_ = pix_fmt;
+  out_ = nullptr;
+
+  // size[,tiles[,kbps[,fps]]]
+  size_ = 128;
+  unsigned int tiles = 4;
+  kbps_ = 200;
+  fps_ = 5;
+  int num = sscanf(spec.c_str(), "%u,%u,%u,%u", &size_, &tiles, &kbps_, &fps_);
+  if (num < 1 || size_ < 32 || size_ % 16 != 0 || tiles == 0 || tiles > 16 ||
+      kbps_ == 0 || fps_ == 0) {
+    dbgMsg("failed: crops spec %s\n", spec.c_str());
+    return false;
+  }
+  if (pix_fmt_ != V4L2_PIX_FMT_YUV420 && pix_fmt_ != V4L2_PIX_FMT_RGB24) {
+    dbgMsg("failed: crops need i420 or rgb24\n");
+    return false;
+  }
+  cols_ = static_cast<unsigned int>(std::ceil(std::sqrt(static_cast<float>(tiles))));
+  rows_ = (tiles + cols_ - 1) / cols_;
+
+  busy_ = false;
+  last_ = 0;
+  crops_on_ = false;
+
+  mosaic_cnt_ = 0;
+  waiting_cnt_ = 0;
+
+  return true;
+}
+
+void Crops::setEncoder(Encoder* out) {
+  out_ = out;
+}
+
+bool Crops::wanted() {
+  using namespace std::chrono;
+  auto now = steady_clock::now().time_since_epoch().count();
+  return crops_on_ && out_ && !busy_ &&
+    steady_clock::duration(now - last_.load()) >= milliseconds(1000 / fps_);
+}
+
+bool Crops::addMessage(FrameBuf& frame, std::shared_ptr<std::vector<BoxBuf>>& tracks) {
+
+  Crops::Shot shot;
+  shot.frame = frame;
+  shot.tracks = tracks;
+  busy_ = true;
+  last_ = std::chrono::steady_clock::now().time_since_epoch().count();
+  if (!shot_chan_.push(shot)) {
+    busy_ = false;
+    return false;
+  }
+  wake();
+  return true;
+}
+
+void Crops::metrics(Exposition& out, const std::string& labels) {
+  out.counter("detector_crop_mosaics_total", "crop stream mosaics made", labels, mosaic_cnt_);
+  out.gauge("detector_crop_waiting", "tracks without a crop tile", labels, waiting_cnt_);
+  out.summary("detector_latency_us", "stage latency percentiles",
+      labels + ",step=\"crops\"", differ_cut_.hist);
+}
+
+void Crops::assign(const std::vector<BoxBuf>& tracks) {
+
+  for (auto& tl : tiles_) {
+    tl.seen = false;
+  }
+
+  // a track keeps its tile, its window follows the box a little at a time
+  std::vector<const BoxBuf*> fresh;
+  for (auto& box : tracks) {
+    float cx = box.x + box.w / 2.f;
+    float cy = box.y + box.h / 2.f;
+    float side = std::max(std::max(box.w, box.h) * margin_, size_ / 2.f);
+    auto it = std::find_if(tiles_.begin(), tiles_.end(),
+        [&box](const Crops::Tile& tl) { return tl.used && tl.id == box.id; });
+    if (it == tiles_.end()) {
+      fresh.push_back(&box);
+      continue;
+    }
+    it->seen = true;
+    it->type = box.type;
+    it->score = box.score;
+    it->cx += follow_ * (cx - it->cx);
+    it->cy += follow_ * (cy - it->cy);
+    float most = grow_ * it->side;
+    it->side += std::min(std::max(side - it->side, -most), most);
+  }
+  for (auto& tl : tiles_) {
+    tl.used = tl.used && tl.seen;
+  }
+
+  // the biggest of the new ones first
+  std::sort(fresh.begin(), fresh.end(), [](const BoxBuf* a, const BoxBuf* b) {
+    return a->w * a->h > b->w * b->h;
+  });
+  waiting_cnt_ = 0;
+  for (auto box : fresh) {
+    auto it = std::find_if(tiles_.begin(), tiles_.end(),
+        [](const Crops::Tile& tl) { return !tl.used; });
+    if (it == tiles_.end()) {
+      waiting_cnt_++;
+      continue;
+    }
+    it->used = true;
+    it->seen = true;
+    it->id = box->id;
+    it->type = box->type;
+    it->score = box->score;
+    it->cx = box->x + box->w / 2.f;
+    it->cy = box->y + box->h / 2.f;
+    it->side = std::max(std::max(box->w, box->h) * margin_, size_ / 2.f);
+  }
+}
+
+void Crops::cut(const FrameBuf& frame, unsigned int t, FrameBuf& mosaic) {
+
+  // the window, square, even and inside the frame
+  Crops::Tile& tl = tiles_[t];
+  unsigned int side = static_cast<unsigned int>(tl.side);
+  side = std::max(std::min(side, std::min(width_, height_)) & ~1u, 2u);
+  int x = static_cast<int>(tl.cx) - static_cast<int>(side / 2);
+  int y = static_cast<int>(tl.cy) - static_cast<int>(side / 2);
+  x = std::min(std::max(x, 0), static_cast<int>(width_ - side));
+  y = std::min(std::max(y, 0), static_cast<int>(height_ - side));
+  Rect src = { static_cast<unsigned int>(x) & ~1u, static_cast<unsigned int>(y) & ~1u,
+    side, side };
+
+  unsigned int tx = (t % cols_) * size_;
+  unsigned int ty = (t / cols_) * size_;
+  Planes s(frame.addr, Shape(width_, height_, pix_fmt_));
+  Planes d(mosaic.addr, Shape(mosaicWidth(), mosaicHeight(), pix_fmt_));
+  if (s.yuv) {
+    resize_plane(s.y, s.stride, src, 1, d.y + ty * d.stride + tx, d.stride, size_, size_);
+    Rect half = { src.x / 2, src.y / 2, src.w / 2, src.h / 2 };
+    resize_plane(s.u, s.uv_stride, half, 1, d.u + ty / 2 * d.uv_stride + tx / 2,
+        d.uv_stride, size_ / 2, size_ / 2);
+    resize_plane(s.v, s.uv_stride, half, 1, d.v + ty / 2 * d.uv_stride + tx / 2,
+        d.uv_stride, size_ / 2, size_ / 2);
+  } else {
+    resize_plane(s.y, s.stride, src, 3, d.y + ty * d.stride + tx * 3, d.stride, size_, size_);
+  }
+}
+
+void Crops::blank(unsigned int t, FrameBuf& mosaic) {
+
+  unsigned int tx = (t % cols_) * size_;
+  unsigned int ty = (t / cols_) * size_;
+  Planes d(mosaic.addr, Shape(mosaicWidth(), mosaicHeight(), pix_fmt_));
+  if (d.yuv) {
+    for (unsigned int j = 0; j < size_; j++) {
+      std::memset(d.y + (ty + j) * d.stride + tx, 16, size_);
+    }
+    for (unsigned int j = 0; j < size_ / 2; j++) {
+      std::memset(d.u + (ty / 2 + j) * d.uv_stride + tx / 2, 128, size_ / 2);
+      std::memset(d.v + (ty / 2 + j) * d.uv_stride + tx / 2, 128, size_ / 2);
+    }
+  } else {
+    for (unsigned int j = 0; j < size_; j++) {
+      std::memset(d.y + (ty + j) * d.stride + tx * 3, 0, size_ * 3);
+    }
+  }
+}
+
+bool Crops::waitingToRun() {
+
+  if (!crops_on_) {
+    if (!out_) {
+      dbgMsg("failed: crops without an encoder\n");
+      return false;
+    }
+    tiles_.assign(cols_ * rows_, Crops::Tile{false, 0, BoxBuf::Type::kUnknown, 0.f,
+        0.f, 0.f, 0.f, false});
+    crops_on_ = true;
+  }
+  return true;
+}
+
+bool Crops::running() {
+
+  if (crops_on_) {
+    Crops::Shot shot;
+    if (!shot_chan_.pop(shot)) {
+      return true;
+    }
+
+    differ_cut_.begin();
+    assign(*shot.tracks);
+    FrameBuf mosaic = Frames::take(Shape(mosaicWidth(), mosaicHeight(), pix_fmt_));
+    mosaic.id = mosaic_cnt_;
+    mosaic.stamp = shot.frame.stamp;
+    auto boxes = std::make_shared<std::vector<BoxBuf>>();
+    for (unsigned int t = 0; t < tiles_.size(); t++) {
+      if (!tiles_[t].used) {
+        blank(t, mosaic);
+        continue;
+      }
+      cut(shot.frame, t, mosaic);
+      boxes->emplace_back(tiles_[t].type, tiles_[t].id, (t % cols_) * size_,
+          (t / cols_) * size_, size_, size_, shot.frame.stamp, tiles_[t].score);
+    }
+    shot.frame = FrameBuf();
+    busy_ = false;
+    differ_cut_.end();
+
+    // the tiles' tracks first, so they go out with this mosaic
+    out_->addMessage(boxes, mosaic.stamp);
+    if (out_->addMessage(mosaic)) {
+      mosaic_cnt_++;
+    }
+  }
+  return true;
+}
+
+bool Crops::paused() {
+  return true;
+}
+
+bool Crops::waitingToHalt() {
+
+  if (crops_on_) {
+    crops_on_ = false;
+
+    Crops::Shot shot;
+    while (shot_chan_.pop(shot)) {
+    }
+    busy_ = false;
+    tiles_.clear();
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nCrops Results...\n");
+      fprintf(stderr, "   cut time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_cut_.pct(.5), differ_cut_.pct(.9), differ_cut_.pct(.99), differ_cut_.pct(.999),
+          differ_cut_.high, differ_cut_.avg,
+          differ_cut_.low, differ_cut_.cnt);
+      fprintf(stderr, "         mosaics: %u\n", mosaic_cnt_);
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
@@ -0,0 +1,138 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Per object crop stream.
+ *
+ *  With --crops size[,tiles[,kbps[,fps]]] the tracked objects get a low
+ *  bitrate stream of their own on the rtsp server ('crops', port 18892):
+ *  a mosaic of 'tiles' (default 4) squares of 'size' pixels (default 128,
+ *  a multiple of 16), each following one track.  A track keeps its tile
+ *  while it lives, the window it is cut from follows the box smoothly and
+ *  only ever grows or shrinks a little a frame, so the crop doesn't shake
+ *  with the detector's boxes.  The encoder hands over a frame and its
+ *  tracks at 'fps' (default 5), this thread cuts and scales the windows
+ *  and a second hardware encoder makes the stream at 'kbps' (default
+ *  200).  Which track is in which tile goes with every frame as the sei
+ *  boxes (see encoder.h), the tile's place in the mosaic tagged with the
+ *  track's id.  Tracks beyond the tiles wait for one to come free.
+ */
+
+#ifndef CROPS_H
+#define CROPS_H
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <chrono>
+
+#include "utils.h"
+#include "listener.h"
+#include "channel.h"
+#include "base.h"
+namespace detector {
+
+class Encoder;
+
+class Crops : public Base {
+  public:
+    static std::unique_ptr<Crops> create(unsigned int yield_time, bool quiet,
+        const std::string& spec, unsigned int width, unsigned int height,
+        unsigned int pix_fmt);
+    virtual ~Crops();
+
+  public:
+    // the mosaic the stream's encoder is made for
+    inline unsigned int mosaicWidth()   { return cols_ * size_; }
+    inline unsigned int mosaicHeight()  { return rows_ * size_; }
+    inline unsigned int bitrate()       { return kbps_ * 1000; }
+
+    // where the mosaics go, set before start
+    void setEncoder(Encoder* out);
+
+    // the encoder hands over its next frame while this is true
+    bool wanted();
+
+    // a frame and its tracks in frame pixels
+    bool addMessage(FrameBuf& frame, std::shared_ptr<std::vector<BoxBuf>>& tracks);
+
+    // the metrics endpoint's samples
+    virtual void metrics(Exposition& out, const std::string& labels);
+
+  protected:
+    Crops() = delete;
+    Crops(unsigned int yield_time);
+    bool init(bool quiet, const std::string& spec, unsigned int width,
+        unsigned int height, unsigned int pix_fmt);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    unsigned int width_;
+    unsigned int height_;
+    unsigned int pix_fmt_;
+    unsigned int size_;
+    unsigned int cols_;
+    unsigned int rows_;
+    unsigned int kbps_;
+    unsigned int fps_;
+    Encoder* out_;
+
+    class Shot {
+      public:
+        FrameBuf frame;
+        std::shared_ptr<std::vector<BoxBuf>> tracks;
+    };
+    Channel<Crops::Shot> shot_chan_{1, Channel<Crops::Shot>::Policy::kDropNewest};
+    std::atomic<bool> busy_;
+    std::atomic<int64_t> last_;
+
+    // a track's tile and the window it is cut from, centre and side
+    class Tile {
+      public:
+        bool used;
+        unsigned int id;
+        BoxBuf::Type type;
+        float score;
+        float cx, cy, side;
+        bool seen;
+    };
+    std::vector<Crops::Tile> tiles_;
+    const float follow_ = {0.3f};     // of the way to the box a frame
+    const float grow_ = {0.1f};       // most the side changes a frame
+    const float margin_ = {1.25f};    // the side over the box's longer one
+    void assign(const std::vector<BoxBuf>& tracks);
+    void cut(const FrameBuf& frame, unsigned int t, FrameBuf& mosaic);
+    void blank(unsigned int t, FrameBuf& mosaic);
+
+    std::atomic<bool> crops_on_;
+
+    unsigned int mosaic_cnt_;
+    unsigned int waiting_cnt_;      // tracks without a tile, the last mosaic
+    MicroDiffer<uint32_t> differ_cut_;
+};
+
+} // namespace detector
+
+#endif // CROPS_H
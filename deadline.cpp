@@ -0,0 +1,76 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <algorithm>
+
+#include "utils.h"
+#include "deadline.h"
+
+namespace detector {
+
+std::atomic<unsigned int> Deadline::budget_[Deadline::kNum];
+
+bool Deadline::parse(const std::string& spec) {
+  unsigned int ms[Deadline::kNum] = { 0, 0, 0 };
+  int num = sscanf(spec.c_str(), "%u,%u,%u", &ms[kStream], &ms[kRecord], &ms[kAnalytics]);
+  if (num < 1) {
+    dbgMsg("failed: deadlines %s\n", spec.c_str());
+    return false;
+  }
+  for (unsigned int i = 0; i < Deadline::kNum; i++) {
+    setBudget(static_cast<Deadline::Output>(i), ms[i]);
+  }
+  return true;
+}
+
+void Deadline::setBudget(Deadline::Output out, unsigned int ms) {
+  budget_[out] = ms;
+}
+
+unsigned int Deadline::budget(Deadline::Output out) {
+  return budget_[out];
+}
+
+static std::chrono::steady_clock::time_point after(
+    std::chrono::steady_clock::time_point stamp, unsigned int ms) {
+  if (ms == 0 || stamp.time_since_epoch().count() == 0) {
+    return std::chrono::steady_clock::time_point();
+  }
+  return stamp + std::chrono::milliseconds(ms);
+}
+
+std::chrono::steady_clock::time_point Deadline::forEncoder(
+    std::chrono::steady_clock::time_point stamp) {
+  unsigned int stream = budget_[kStream], record = budget_[kRecord];
+  unsigned int ms = (stream && record) ? std::min(stream, record) : std::max(stream, record);
+  return after(stamp, ms);
+}
+
+std::chrono::steady_clock::time_point Deadline::forTflow(
+    std::chrono::steady_clock::time_point stamp) {
+  return after(stamp, budget_[kAnalytics]);
+}
+
+bool Deadline::late(std::chrono::steady_clock::time_point deadline,
+    std::chrono::steady_clock::time_point now, unsigned int usec) {
+  return deadline.time_since_epoch().count() != 0 &&
+    now + std::chrono::microseconds(usec) > deadline;
+}
+
+} // namespace detector
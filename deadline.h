@@ -0,0 +1,81 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ *
+ * ----------
+ *
+ *  Latency budgets, by output.
+ *
+ *  With --deadlines stream,record,analytics (msec, 0 for none) a frame
+ *  is given a deadline as it is captured, its capture stamp plus the
+ *  budget of the output it is handed to: the tighter of streaming and
+ *  recording for the encoder, analytics for tflow.  Stages with more
+ *  than one frame to choose from take the one due first, and a frame
+ *  that can't make its deadline any more is dropped where it waits
+ *  (see Fate) rather than holding up the ones behind it.  With no
+ *  budgets frames have no deadline and everything stays first in,
+ *  first out.
+ */
+
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstdint>
+
+namespace detector {
+
+class Deadline {
+  public:
+    enum Output : unsigned int {
+      kStream = 0,
+      kRecord,
+      kAnalytics,
+      kNum
+    };
+
+    // stream,record,analytics msec, before start
+    static bool parse(const std::string& spec);
+    static void setBudget(Deadline::Output out, unsigned int ms);
+    static unsigned int budget(Deadline::Output out);
+
+    // 'stamp' plus the budget, zero when there is none
+    static std::chrono::steady_clock::time_point forEncoder(
+        std::chrono::steady_clock::time_point stamp);
+    static std::chrono::steady_clock::time_point forTflow(
+        std::chrono::steady_clock::time_point stamp);
+
+    // 'usec' more work from now misses it, never when there is none
+    static bool late(std::chrono::steady_clock::time_point deadline,
+        std::chrono::steady_clock::time_point now, unsigned int usec);
+
+    // ticks to order by, the ones without a deadline last
+    static inline int64_t order(std::chrono::steady_clock::time_point deadline) {
+      int64_t ticks = deadline.time_since_epoch().count();
+      return ticks ? ticks : INT64_MAX;
+    }
+
+  private:
+    Deadline() = delete;
+    static std::atomic<unsigned int> budget_[Deadline::kNum];
+};
+
+} // namespace detector
+
+#endif // DEADLINE_H
@@ -0,0 +1,535 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <chrono>
+#include <algorithm>
+
+#include "decoder.h"
+#include "base.h"
+
+namespace detector {
+
+Decoder::Decoder(const char* device, unsigned int coded)
+  : device_(device), coded_(coded) {
+}
+
+Decoder::~Decoder() {
+  close();
+}
+
+std::unique_ptr<Decoder> Decoder::create(const char* device, unsigned int coded) {
+  auto obj = std::unique_ptr<Decoder>(new Decoder(device, coded));
+  obj->init();
+  return obj;
+}
+
+bool Decoder::init() {
+  fd_ = -1;
+  width_ = 0;
+  height_ = 0;
+  frame_len_ = 0;
+  decoded_ = 0;
+  return true;
+}
+
+int Decoder::xioctl(int fd, int request, void* arg) {
+  int res;
+  do {
+    res = ioctl(fd, request, arg);
+  } while (res == -1 && errno == EINTR);
+  return res;
+}
+
+bool Decoder::open(unsigned int width, unsigned int height, bool direct) {
+
+  dbgMsg("open %s\n", device_);
+  fd_ = ::open(device_, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd_ < 0) {
+    dbgMsg("failed: open %s (errno: %d)\n", device_, errno);
+    return false;
+  }
+  width_ = width;
+  height_ = height;
+  decoded_ = 0;
+
+  struct v4l2_capability cap;
+  memset(&cap, 0, sizeof(cap));
+  if (xioctl(fd_, VIDIOC_QUERYCAP, &cap) < 0) {
+    dbgMsg("failed: query capabilities (errno: %d)\n", errno);
+    return false;
+  }
+  unsigned int caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ?
+    cap.device_caps : cap.capabilities;
+  if (!(caps & V4L2_CAP_VIDEO_M2M_MPLANE) || !(caps & V4L2_CAP_STREAMING)) {
+    dbgMsg("failed: %s is not a mem2mem device\n", device_);
+    return false;
+  }
+
+  // jpeg or h264 in, sized for the worst a camera sends
+  dbgMsg("set %s format\n", PixelFormatToStr(coded_));
+  struct v4l2_format fmt;
+  memset(&fmt, 0, sizeof(fmt));
+  fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  fmt.fmt.pix_mp.width = width;
+  fmt.fmt.pix_mp.height = height;
+  fmt.fmt.pix_mp.pixelformat = coded_;
+  fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+  fmt.fmt.pix_mp.num_planes = 1;
+  fmt.fmt.pix_mp.plane_fmt[0].sizeimage = std::max(512u * 1024u, width * height);
+  if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0) {
+    dbgMsg("failed: set %s format (errno: %d)\n", PixelFormatToStr(coded_), errno);
+    return false;
+  }
+
+  // i420 out, laid out like a capture frame
+  dbgMsg("set i420 format\n");
+  memset(&fmt, 0, sizeof(fmt));
+  fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  fmt.fmt.pix_mp.width = width;
+  fmt.fmt.pix_mp.height = ALIGN_16B(height);
+  fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_YUV420;
+  fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+  fmt.fmt.pix_mp.num_planes = 1;
+  fmt.fmt.pix_mp.plane_fmt[0].bytesperline = ALIGN_16B(width);
+  if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0) {
+    dbgMsg("failed: set i420 format (errno: %d)\n", errno);
+    return false;
+  }
+  if (!sameFormat()) {
+    return false;
+  }
+
+  struct v4l2_event_subscription sub;
+  memset(&sub, 0, sizeof(sub));
+  sub.type = V4L2_EVENT_SOURCE_CHANGE;
+  if (xioctl(fd_, VIDIOC_SUBSCRIBE_EVENT, &sub) < 0) {
+    dbgMsg("warning: subscribe source change (errno: %d)\n", errno);
+  }
+
+  dbgMsg("allocate buffers\n");
+  struct v4l2_requestbuffers rb;
+  memset(&rb, 0, sizeof(rb));
+  rb.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  rb.memory = V4L2_MEMORY_MMAP;
+  rb.count = (coded_ == V4L2_PIX_FMT_MJPEG) ? in_num_ : stream_in_num_;
+  if (xioctl(fd_, VIDIOC_REQBUFS, &rb) < 0 || rb.count == 0) {
+    dbgMsg("failed: request jpeg buffers (errno: %d)\n", errno);
+    return false;
+  }
+  in_.assign(rb.count, FrameBuf());
+  in_free_.clear();
+  for (unsigned int i = 0; i < in_.size(); i++) {
+    struct v4l2_plane plane;
+    struct v4l2_buffer buf;
+    memset(&plane, 0, sizeof(plane));
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = i;
+    buf.m.planes = &plane;
+    buf.length = 1;
+    if (xioctl(fd_, VIDIOC_QUERYBUF, &buf) < 0) {
+      dbgMsg("failed: query jpeg buffer %u (errno: %d)\n", i, errno);
+      return false;
+    }
+    in_[i].addr = (unsigned char*)mmap(nullptr, plane.length,
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd_, plane.m.mem_offset);
+    if (in_[i].addr == MAP_FAILED) {
+      dbgMsg("failed: map jpeg buffer %u (errno: %d)\n", i, errno);
+      in_[i].addr = nullptr;
+      return false;
+    }
+    in_[i].length = plane.length;
+    in_free_.push_back(i);
+  }
+
+  memset(&rb, 0, sizeof(rb));
+  rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  rb.memory = V4L2_MEMORY_MMAP;
+  rb.count = out_num_;
+  if (xioctl(fd_, VIDIOC_REQBUFS, &rb) < 0 || rb.count == 0) {
+    dbgMsg("failed: request i420 buffers (errno: %d)\n", errno);
+    return false;
+  }
+  out_.assign(rb.count, FrameBuf());
+  for (unsigned int i = 0; i < out_.size(); i++) {
+    struct v4l2_plane plane;
+    struct v4l2_buffer buf;
+    memset(&plane, 0, sizeof(plane));
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = i;
+    buf.m.planes = &plane;
+    buf.length = 1;
+    if (xioctl(fd_, VIDIOC_QUERYBUF, &buf) < 0) {
+      dbgMsg("failed: query i420 buffer %u (errno: %d)\n", i, errno);
+      return false;
+    }
+    out_[i].addr = (unsigned char*)mmap(nullptr, plane.length,
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd_, plane.m.mem_offset);
+    if (out_[i].addr == MAP_FAILED) {
+      dbgMsg("failed: map i420 buffer %u (errno: %d)\n", i, errno);
+      out_[i].addr = nullptr;
+      return false;
+    }
+    out_[i].length = plane.length;
+
+    if (direct) {
+      struct v4l2_exportbuffer expbuf;
+      memset(&expbuf, 0, sizeof(expbuf));
+      expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+      expbuf.index = i;
+      expbuf.flags = O_RDWR | O_CLOEXEC;
+      if (xioctl(fd_, VIDIOC_EXPBUF, &expbuf) < 0) {
+        dbgMsg("warning: export i420 buffer %u (errno: %d)\n", i, errno);
+      } else {
+        out_[i].fd = expbuf.fd;
+      }
+    }
+    if (!queueOutput(i)) {
+      return false;
+    }
+  }
+
+  dbgMsg("stream on\n");
+  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0) {
+    dbgMsg("failed: jpeg stream on (errno: %d)\n", errno);
+    return false;
+  }
+  type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0) {
+    dbgMsg("failed: i420 stream on (errno: %d)\n", errno);
+    return false;
+  }
+  return true;
+}
+
+bool Decoder::close() {
+
+  if (fd_ >= 0) {
+    dbgMsg("stream off\n");
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    xioctl(fd_, VIDIOC_STREAMOFF, &type);
+    type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    xioctl(fd_, VIDIOC_STREAMOFF, &type);
+  }
+
+  for (auto& b : in_) {
+    if (b.addr != nullptr) {
+      munmap(b.addr, b.length);
+    }
+  }
+  in_.clear();
+  in_free_.clear();
+  for (auto& b : out_) {
+    if (b.addr != nullptr) {
+      munmap(b.addr, b.length);
+    }
+    if (b.fd >= 0) {
+      ::close(b.fd);
+    }
+  }
+  out_.clear();
+  {
+    std::unique_lock<std::mutex> lck(release_lock_);
+    release_.clear();
+  }
+
+  if (fd_ >= 0) {
+    struct v4l2_requestbuffers rb;
+    memset(&rb, 0, sizeof(rb));
+    rb.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    rb.memory = V4L2_MEMORY_MMAP;
+    rb.count = 0;
+    xioctl(fd_, VIDIOC_REQBUFS, &rb);
+    rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    xioctl(fd_, VIDIOC_REQBUFS, &rb);
+    ::close(fd_);
+    fd_ = -1;
+  }
+  return true;
+}
+
+bool Decoder::sameFormat() {
+
+  // the pipeline only takes frames it could have captured itself
+  struct v4l2_format fmt;
+  memset(&fmt, 0, sizeof(fmt));
+  fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  if (xioctl(fd_, VIDIOC_G_FMT, &fmt) < 0) {
+    dbgMsg("failed: get i420 format (errno: %d)\n", errno);
+    return false;
+  }
+  if (fmt.fmt.pix_mp.pixelformat != V4L2_PIX_FMT_YUV420 ||
+      fmt.fmt.pix_mp.width != width_ ||
+      fmt.fmt.pix_mp.height < height_ ||
+      fmt.fmt.pix_mp.plane_fmt[0].bytesperline != ALIGN_16B(width_)) {
+    dbgMsg("failed: decoded %ux%u stride %u, not %ux%u stride %u\n",
+        fmt.fmt.pix_mp.width, fmt.fmt.pix_mp.height, 
+        fmt.fmt.pix_mp.plane_fmt[0].bytesperline,
+        width_, height_, ALIGN_16B(width_));
+    return false;
+  }
+  frame_len_ = fmt.fmt.pix_mp.plane_fmt[0].sizeimage;
+  return true;
+}
+
+bool Decoder::queueOutput(unsigned int index) {
+  struct v4l2_plane plane;
+  struct v4l2_buffer buf;
+  memset(&plane, 0, sizeof(plane));
+  memset(&buf, 0, sizeof(buf));
+  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  buf.memory = V4L2_MEMORY_MMAP;
+  buf.index = index;
+  buf.m.planes = &plane;
+  buf.length = 1;
+  if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0) {
+    dbgMsg("failed: queue i420 buffer %u (errno: %d)\n", index, errno);
+    return false;
+  }
+  return true;
+}
+
+void Decoder::release(unsigned int index) {
+  std::unique_lock<std::mutex> lck(release_lock_);
+  release_.push_back(index);
+}
+
+bool Decoder::requeue() {
+
+  std::vector<unsigned int> indices;
+  {
+    std::unique_lock<std::mutex> lck(release_lock_);
+    indices.swap(release_);
+  }
+  for (auto index : indices) {
+    if (!queueOutput(index)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Decoder::takeInput(unsigned int& index) {
+
+  // jpeg buffers the codec has finished with
+  auto limit = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_);
+  while (true) {
+    struct v4l2_plane plane;
+    struct v4l2_buffer buf;
+    memset(&plane, 0, sizeof(plane));
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.m.planes = &plane;
+    buf.length = 1;
+    while (xioctl(fd_, VIDIOC_DQBUF, &buf) == 0) {
+      in_free_.push_back(buf.index);
+    }
+    if (!in_free_.empty()) {
+      index = in_free_.back();
+      in_free_.pop_back();
+      return true;
+    }
+
+    int left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        limit - std::chrono::steady_clock::now()).count();
+    struct pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    if (left <= 0 || ::poll(&pfd, 1, left) <= 0) {
+      dbgMsg("failed: no jpeg buffer\n");
+      return false;
+    }
+  }
+}
+
+bool Decoder::feed(const unsigned char* data, unsigned int len,
+    std::chrono::steady_clock::time_point stamp) {
+
+  if (fd_ < 0 || !requeue()) {
+    return false;
+  }
+
+  unsigned int in;
+  if (!takeInput(in)) {
+    return false;
+  }
+  if (len > in_[in].length) {
+    dbgMsg("failed: %u coded bytes\n", len);
+    in_free_.push_back(in);
+    return false;
+  }
+  memcpy(in_[in].addr, data, len);
+
+  // the stamp comes back on the frame it decodes to
+  auto usec = std::chrono::duration_cast<std::chrono::microseconds>(
+      stamp.time_since_epoch()).count();
+  struct v4l2_plane plane;
+  struct v4l2_buffer buf;
+  memset(&plane, 0, sizeof(plane));
+  memset(&buf, 0, sizeof(buf));
+  buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  buf.memory = V4L2_MEMORY_MMAP;
+  buf.index = in;
+  buf.m.planes = &plane;
+  buf.length = 1;
+  buf.timestamp.tv_sec = usec / 1000000;
+  buf.timestamp.tv_usec = usec % 1000000;
+  plane.bytesused = len;
+  plane.length = in_[in].length;
+  if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0) {
+    dbgMsg("failed: queue coded buffer %u (errno: %d)\n", in, errno);
+    in_free_.push_back(in);
+    return false;
+  }
+  return true;
+}
+
+bool Decoder::take(unsigned int& index, unsigned int& used,
+    std::chrono::steady_clock::time_point& stamp, unsigned int wait) {
+
+  if (fd_ < 0 || !requeue()) {
+    return false;
+  }
+
+  auto limit = std::chrono::steady_clock::now() + std::chrono::milliseconds(wait);
+  while (true) {
+    int left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        limit - std::chrono::steady_clock::now()).count();
+    struct pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = POLLIN | POLLPRI;
+    pfd.revents = 0;
+    if (::poll(&pfd, 1, std::max(left, 0)) <= 0) {
+      return false;
+    }
+
+    if (pfd.revents & POLLPRI) {
+      struct v4l2_event evt;
+      memset(&evt, 0, sizeof(evt));
+      if (xioctl(fd_, VIDIOC_DQEVENT, &evt) == 0 && 
+          evt.type == V4L2_EVENT_SOURCE_CHANGE && !restart()) {
+        return false;
+      }
+    }
+
+    if (pfd.revents & POLLIN) {
+      struct v4l2_plane plane;
+      struct v4l2_buffer buf;
+      memset(&plane, 0, sizeof(plane));
+      memset(&buf, 0, sizeof(buf));
+      buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+      buf.memory = V4L2_MEMORY_MMAP;
+      buf.m.planes = &plane;
+      buf.length = 1;
+      if (xioctl(fd_, VIDIOC_DQBUF, &buf) < 0) {
+        if (errno == EAGAIN) {
+          continue;
+        }
+        dbgMsg("failed: dequeue i420 buffer (errno: %d)\n", errno);
+        return false;
+      }
+
+      // a broken picture still gives its buffer back
+      if ((buf.flags & V4L2_BUF_FLAG_ERROR) || plane.bytesused == 0) {
+        queueOutput(buf.index);
+        return false;
+      }
+      index = buf.index;
+      used = plane.bytesused;
+      stamp = std::chrono::steady_clock::time_point(
+          std::chrono::seconds(buf.timestamp.tv_sec) +
+          std::chrono::microseconds(buf.timestamp.tv_usec));
+      decoded_++;
+      return true;
+    }
+  }
+}
+
+bool Decoder::restart() {
+
+  if (!sameFormat()) {
+    return false;
+  }
+
+  // h264 only finds its size in the stream, once the frames are all
+  // still ours the capture side starts over on the same buffers
+  if (coded_ == V4L2_PIX_FMT_MJPEG) {
+    return true;
+  }
+  if (decoded_ != 0) {
+    dbgMsg("failed: stream changed with frames out\n");
+    return false;
+  }
+  dbgMsg("restart i420 stream\n");
+  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  if (xioctl(fd_, VIDIOC_STREAMOFF, &type) < 0) {
+    dbgMsg("failed: i420 stream off (errno: %d)\n", errno);
+    return false;
+  }
+  for (unsigned int i = 0; i < out_.size(); i++) {
+    if (!queueOutput(i)) {
+      return false;
+    }
+  }
+  if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0) {
+    dbgMsg("failed: i420 stream on (errno: %d)\n", errno);
+    return false;
+  }
+  return true;
+}
+
+bool Decoder::decode(const unsigned char* jpeg, unsigned int len, unsigned int& index,
+    unsigned int& used) {
+
+  // one jpeg in, one frame out
+  std::chrono::steady_clock::time_point stamp = std::chrono::steady_clock::now();
+  if (!feed(jpeg, len, stamp)) {
+    return false;
+  }
+  if (!take(index, used, stamp, timeout_)) {
+    dbgMsg("failed: decode timed out\n");
+    return false;
+  }
+  return true;
+}
+
+void Decoder::footprint(Footprint& out) {
+  size_t bytes = 0;
+  for (auto& b : in_) {
+    bytes += b.length;
+  }
+  for (auto& b : out_) {
+    bytes += b.length;
+  }
+  out.add("v4l2_decode", in_.size() + out_.size(), bytes);
+}
+
+} // namespace detector
@@ -0,0 +1,111 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  V4L2 mem2mem jpeg and h264 decoder (bcm2835-codec, /dev/video10).
+ *
+ *  For cameras that only reach their size and rate in mjpeg, and for ip
+ *  cameras.  The capturer copies each jpeg into one of our 'output'
+ *  buffers and gets back the index of an i420 'capture' buffer, laid out
+ *  like a capture frame of the same size (16 aligned stride and slice),
+ *  so the rest of the pipeline can't tell.  h264 is fed an access unit
+ *  at a time and frames are taken as the codec gets them out, a frame
+ *  or two later, with the stamp they were fed with.  Decoded buffers are held downstream like
+ *  camera buffers and given back with 'release' from any thread; they
+ *  go back to the codec on the next decode.  With 'direct' they are
+ *  exported as dmabufs for the encoder.
+ */
+
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <chrono>
+
+#include "utils.h"
+#include "listener.h"
+
+namespace detector {
+
+class Footprint;
+
+class Decoder {
+  public:
+    static std::unique_ptr<Decoder> create(const char* device = "/dev/video10",
+        unsigned int coded = V4L2_PIX_FMT_MJPEG);
+    ~Decoder();
+
+  public:
+    bool open(unsigned int width, unsigned int height, bool direct);
+    bool close();
+
+    // the i420 frames, 'fd' set when exported, 'length' what is mapped
+    std::vector<FrameBuf>& buffers() { return out_; }
+
+    // the frame 'len' bytes of jpeg decode into and the bytes of it that
+    // were used, false if it didn't
+    bool decode(const unsigned char* jpeg, unsigned int len, unsigned int& index,
+        unsigned int& used);
+
+    // or in two halves, 'take' waits up to 'wait' msec for a frame
+    bool feed(const unsigned char* data, unsigned int len,
+        std::chrono::steady_clock::time_point stamp);
+    bool take(unsigned int& index, unsigned int& used,
+        std::chrono::steady_clock::time_point& stamp, unsigned int wait);
+    void release(unsigned int index);
+
+    void footprint(Footprint& out);
+
+  protected:
+    Decoder() = delete;
+    Decoder(const char* device, unsigned int coded);
+    bool init();
+
+  private:
+    const char* device_;
+    unsigned int coded_;
+    int fd_;
+    unsigned int width_;
+    unsigned int height_;
+    unsigned int frame_len_;
+    unsigned int decoded_;
+
+    const unsigned int in_num_  = {2};
+    const unsigned int stream_in_num_ = {6};
+    const unsigned int out_num_ = {6};
+    const unsigned int timeout_ = {200};   // msec
+    std::vector<FrameBuf> in_;
+    std::vector<unsigned int> in_free_;
+    std::vector<FrameBuf> out_;
+
+    std::mutex release_lock_;
+    std::vector<unsigned int> release_;
+    bool requeue();
+
+    int xioctl(int fd, int request, void* arg);
+    bool queueOutput(unsigned int index);
+    bool takeInput(unsigned int& index);
+    bool sameFormat();
+    bool restart();
+};
+
+} // namespace detector
+
+#endif // DECODER_H
@@ -19,37 +19,58 @@
 #include <iostream>
 #include <algorithm>
 #include <memory>
+#include <sstream>
 #include <chrono>
 #include <cmath>
 #include <signal.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #include "utils.h"
-#include "base.h"
-#include "encoder.h"
-#include "rtsp.h"
-#include "capturer.h"
-#include "tflow.h"
-#include "tracker.h"
+#include "pool.h"
+#include "storage.h"
+#include "reserve.h"
+#include "startup.h"
+#include "kernels.h"
+#include "config.h"
+#include "session.h"
+#include "worker.h"
+#include "sweep.h"
+#include "regress.h"
 
 namespace detector {
 
-std::unique_ptr<Encoder>  enc(nullptr);
-std::unique_ptr<Rtsp>     rtsp(nullptr);
-std::unique_ptr<Capturer> cap(nullptr);
-std::unique_ptr<Tflow>    tfl(nullptr);
-std::unique_ptr<Tracker>  trk(nullptr);
+std::unique_ptr<Session> session(nullptr);
+static const unsigned int stop_grace = 15;   // sec past the drain
 
 void usage() {
-  std::cout << "detector -?qpkrutdfwhbyesml [output]" << std::endl;
+  std::cout << "detector -?qpkrziutdfwhbyenscagjxvmlRFLSEPQHMUJTBCODWNAKIGXVZY [output]" << std::endl;
+  std::cout << "detector --bench-model -R <frames> [-mlwhinate...]" << std::endl;
   std::cout << "version: 1.0"                     << std::endl;
   std::cout                                       << std::endl;
   std::cout << "  where:"                         << std::endl;
   std::cout << "  ?            = this screen"                           << std::endl;
   std::cout << "  (q)uiet      = suppress messages   (default = false)" << std::endl;
   std::cout << "  (r)tsp       = rtsp server         (default = off)"   << std::endl;
+  std::cout << "  (z)ero copy  = encode from capture buffers (default = off)" << std::endl;
+  std::cout << "  (L)atest     = encode the newest frame, skip stale ones (default = off)" << std::endl;
+  std::cout << "  (Q)uality    = spend the bits on the boxes, flatten the rest (default = off)" << std::endl;
+  std::cout << "  (M)2M        = encode with v4l2 mem2mem instead of omx (default = off)" << std::endl;
+  std::cout << "  yuv(i)420    = i420 pipeline instead of rgb24 (default = off)" << std::endl;
+  std::cout << "  (H)alf       = also stream a half size 'sub' session (default = off)" << std::endl;
   std::cout << "  (u)nicast    = rtsp unicast addr   (default = none)"  << std::endl;
   std::cout << "               = multicast if no address specified"     << std::endl;
+  std::cout << "  (U)nicast    = rtsp unicast to any number of clients (default = off)" << std::endl;
+  std::cout << "               = each sets up its own session, -u is ignored" << std::endl;
+  std::cout << "               = clients may ask for rtp over the rtsp tcp link" << std::endl;
+  std::cout << "  (T)unnel     = rtsp over http on this port (default = off)" << std::endl;
+  std::cout << "  (B)uffer     = rtp socket send buffer bytes (default = system)" << std::endl;
+  std::cout << "  pa(C)e       = pace rtp at n times the bitrate (default = off)" << std::endl;
+  std::cout << "               = needs the fq qdisc on the interface"  << std::endl;
+  std::cout << "  (O)nvif      = send the boxes as rtsp metadata (default = off)" << std::endl;
+  std::cout << "  (D)on't draw = leave the boxes off the video (default = off)" << std::endl;
+  std::cout << "  (W)eb        = low latency hls for browsers on this port (default = off)" << std::endl;
+  std::cout << "  (N)ow        = webrtc viewers sign on by whep at this port (default = off)" << std::endl;
   std::cout << "  (t)esttime   = test duration       (default = 30sec)" << std::endl;
   std::cout << "               = 0 to run until ctrl-c"                 << std::endl;
   std::cout << "  (d)device    = video device num    (default = 0)"     << std::endl;
@@ -60,192 +81,1074 @@ void usage() {
   std::cout << "               = negative value means flip"             << std::endl;
   std::cout << "  (b)itrate    = encoder bitrate     (default = 1000000)"  << std::endl;
   std::cout << "  (y)ield time = yield time          (default = 1000usec)" << std::endl;
+  std::cout << "  (A)ffinity   = per thread policy, priority and cpus (default = rr)" << std::endl;
+  std::cout << "               = e.g. cap=fifo:90@0,enc=rr:50@1,tfl=other:5@2-3" << std::endl;
+  std::cout << "  wor(K)ers    = shared pool for resize and drawing, n[@cpus] (default = 0)" << std::endl;
+  std::cout << "               = e.g. 2@2-3, 0 runs it all on the stage's own thread" << std::endl;
+  std::cout << "  (I)nput      = unix socket for live controls (default = none)" << std::endl;
+  std::cout << "  (G)uard      = restart failed threads, exit after a 3n sec stall (default = off)" << std::endl;
+  std::cout << "  e(X)port     = frames and boxes to shared memory /dev/shm/<name> (default = none)" << std::endl;
+  std::cout << "  e(V)ents     = batched detections to mqtt, host[:port][/topic][,ms[,n]] (default = none)" << std::endl;
+  std::cout << "               = a batch goes every ms (1000) or n events (256)" << std::endl;
+  std::cout << "  --events-fb  = -V's batches as detector.fbs flatbuffers instead of cbor (default = off)" << std::endl;
+  std::cout << "  metri(Z)     = prometheus metrics on http port /metrics (default = off)" << std::endl;
+  std::cout << "  --picture    = msec, the latest frame as a jpeg at /snapshot.jpg on -Z's port (default = off)" << std::endl;
+  std::cout << "  --preview    = port[,fps], half size mjpeg with boxes over http, 2 fps (default = off)" << std::endl;
+  std::cout << "  --crops      = size[,tiles[,kbps[,fps]]], mosaic of tracked object crops as rtsp stream 'crops' on 18892, 4 tiles, 200 kbps, 5 fps (default = off)" << std::endl;
+  std::cout << "  --sync-overlay = msec, frames wait up to this for the boxes found on them, not with -g (default = off)" << std::endl;
+  std::cout << "  trace(Y)     = per frame spans to a chrome trace json file at exit (default = none)" << std::endl;
+  std::cout << "  --config     = file[,profile] of options in front of the command line, see config.h (default = none)" << std::endl;
+  std::cout << "               = each letter also has a long name, e.g. --framerate, --tpu, see the README" << std::endl;
+  std::cout << "  --governor   = slo msec[,lite model,labels], back off as the soc heats (default = off)" << std::endl;
+  std::cout << "               = rate, bitrate, threads, camera fps then the model, see governor.h" << std::endl;
+  std::cout << "  --shed       = slo msec[,steps[,lite model,labels]] cut outputs in order when frames wait (default = off)" << std::endl;
+  std::cout << "               = labels+rate+lite+fps+sub, not with --governor, see shed.h" << std::endl;
+  std::cout << "  --idle       = sec[,fps[,cpu governor]] quiet before dropping to fps, see idle.h (default = off, 2)" << std::endl;
+  std::cout << "  --drain      = msec at stop for frames in flight to be detected, encoded and recorded (default = 3000)" << std::endl;
+  std::cout << "  --perf       = hardware counters around copies, prep, eval and overlay, at exit (default = off)" << std::endl;
+  std::cout << "  --fates      = tally how far each frame got and where it was dropped, at exit (default = off)" << std::endl;
+  std::cout << "  --deadlines  = stream,record,analytics msec after capture a frame is due, the one due first goes first and one too late is dropped (default = none)" << std::endl;
+  std::cout << "  --results    = fps, stage p99s, cpu and memory to a file at exit (default = none)" << std::endl;
+  std::cout << "  --baseline   = file[,tolerance %], fail if the results are worse (default = none, 10)" << std::endl;
+  std::cout << "  --privacy    = x,y,w,h[,alpha][:x,y,w,h...] masked before encoding (default = none)" << std::endl;
+  std::cout << "               = black, opaque unless alpha 0-254, snapshots too" << std::endl;
+  std::cout << "  --dedup      = msec a near identical frame reuses the last results (default = 0, never)" << std::endl;
+  std::cout << "  --delegate   = cpu, xnnpack, gpu, edgetpu or auto, the fastest built in (default = auto)" << std::endl;
+  std::cout << "  --peer       = host:port[,ms] another detector's engines for frames ours are too busy for, back here if not answered in ms (default = none, 200)" << std::endl;
+  std::cout << "  --infer-procs = num[,ms[,core]] run the model in num processes, so a tpu or tflite crash doesn't take the pipeline with it, frames not answered in ms go through with nothing found, pinned from core on (default = none, 1000)" << std::endl;
+  std::cout << "  --model-sizes = file,file...[:px] the model at other input sizes, the smallest that keeps tracks px on their short side runs, the biggest with none (default = none, 24)" << std::endl;
+  std::cout << "  --serve-peers = port other detectors send model inputs to, run on our engines between our frames (default = none)" << std::endl;
+  std::cout << "  --rtp-batch  = each frame's rtp packets in one sendmmsg, multicast or -u only (default = off)" << std::endl;
+  std::cout << "  --screen     = lite model[,threshold], only frames it passes are detected (default = none, 0.5)" << std::endl;
+  std::cout << "               = unless there are tracks, a classifier whose class 0 is 'nothing'" << std::endl;
+  std::cout << "  --classify   = lite model[,labels[,threads]] run on the boxes' crops (default = none)" << std::endl;
+  std::cout << "  --reid       = lite model[,threads] appearance embeddings the tracker asks for (default = none)" << std::endl;
+  std::cout << "  --rules      = file of zones and lines checked against the tracks, with -k (default = none)" << std::endl;
+  std::cout << "  --retain     = mb[,pin] of segments written over as a ring, sec a segment with tracks is held (default = 0, all, 86400)" << std::endl;
+  std::cout << "  --reserve    = mb[,huge][,lock] mapped up front for the frame and nal pools, see reserve.h (default = 0, heap)" << std::endl;
+  std::cout << "  --write-behind = mb queued for the storage writer, 0 writes on the stages (default = 16)" << std::endl;
+  std::cout << "  --journal    = dir[,mb[,num]] binary log of every box and track, num mb segments (default = none, 64, 16)" << std::endl;
+  std::cout << "  --flight     = path[,sec] crash-safe ring of the last sec of metrics and trace spans, best on tmpfs (default = none, 60)" << std::endl;
+  std::cout << "  --counts     = sec of each count and occupancy summary sent with -V, with -k (default = 0, none)" << std::endl;
+  std::cout << "  --sei        = send the boxes in the h264 as SEI user data, with -D for a clean picture (default = off)" << std::endl;
+  std::cout << "  --slices     = mb rows an h264 slice, each streamed as soon as it is encoded, omx only (default = 0, whole frames)" << std::endl;
+  std::cout << "  --blobs      = 8x8 cells of the smallest blob against the background that wakes the model, which then looks around the blobs, with -j (default = 0, off)" << std::endl;
+  std::cout << "  --vectors    = the encoder's motion vectors gate -j and start tracks at their speed, omx only (default = off)" << std::endl;
+  std::cout << "  --still-fps  = fps while nothing moves and there are no boxes, with -j (default = 0, full rate)" << std::endl;
+  std::cout << "  --gop        = active[,still] frames a key frame at most while busy and apart when still (default = 0, codec's own)" << std::endl;
+  std::cout << "  --flow       = move the tracks with optical flow on every frame between detections, with -k (default = off)" << std::endl;
+  std::cout << "  --track-time = msec a track is kept unseen, with -k (default = 2000)" << std::endl;
+  std::cout << "  --track-dist = furthest a track moves to a box, of the frame's diagonal, with -k (default = 0.2)" << std::endl;
+  std::cout << "  --track-state = file the tracks are kept in across restarts, with -k (default = none)" << std::endl;
+  std::cout << "  --tiles      = colsxrows[,n] overlapping tiles, n of them a frame with it (default = off, all)" << std::endl;
+  std::cout << "  --dewarp     = lens[,radius]:pan,tilt,fov[:...] fisheye views the model sees with the frame (default = none)" << std::endl;
+  std::cout << "  --gles       = make the model's input on the gpu, with HAVE_GLES (default = off)" << std::endl;
+  std::cout << "  --classes    = name[:threshold],... only these classes, at their own threshold (default = all)" << std::endl;
+  std::cout << "  --max-dets   = boxes a frame at most (default = 0, all the model gives)" << std::endl;
+  std::cout << "  --nms        = iou a box is dropped over with a better one of its class (default = 0, off)" << std::endl;
+  std::cout << "  --mjpeg      = only take mjpeg from the camera, decoded by the codec into i420 (default = off)" << std::endl;
+  std::cout << "  --rotate     = 90, 180 or 270 degrees clockwise, 90 and 270 make -w x -h portrait (default = 0)" << std::endl;
+  std::cout << "  --isp        = device[,wxh] the isp's model sized rgb24 output, for tflow (default = none, 300x300)" << std::endl;
+  std::cout << "  --ingest     = rtsp url of an ip camera's h264 to detect on, at -w x -h (default = none)" << std::endl;
+  std::cout << "  --ingest-tcp = rtp over the rtsp connection (default = udp)" << std::endl;
+  std::cout << "  --ingest-copy = record the camera's own h264 instead of encoding (default = off)" << std::endl;
+  std::cout << "  --archive    = directory or file of recorded fmp4 or h264 at -w x -h to detect on as fast as the model goes, then exit (default = none)" << std::endl;
+  std::cout << "  --libcamera  = camera[,wxh] capture through libcamera, with a scaled rgb24 stream for tflow (default = v4l2)" << std::endl;
+  std::cout << "  --buffers    = v4l2 capture buffers, tflow gives its frame back when they run out (default = 6)" << std::endl;
+  std::cout << "  --capture-mem = mmap, dmabuf (ours, from the dma heap) or userptr capture buffers (default = mmap)" << std::endl;
+  std::cout << "  --crop       = x,y,w,h of the sensor to capture, scaled to the frame size (default = all of it)" << std::endl;
+  std::cout << "  --tflow-every = n[,fps] every nth captured frame to tflow, at most fps (default = 1, all)" << std::endl;
+  std::cout << "  --encode-every = n[,fps] the same for the encoder (default = 1, all)" << std::endl;
   std::cout << "  thr(e)ads    = number of tflow threads (default = 1)"    << std::endl;
+  std::cout << "  e(n)gines    = number of cpu interpreters (default = 1)" << std::endl;
+  std::cout << "               = each uses 'threads' threads"           << std::endl;
   std::cout << "  thre(s)hold  = object detect threshold (default = 0.5)"  << std::endl;
+  std::cout << "  low (c)onf   = low score threshold for tracking (default = off)" << std::endl;
+  std::cout << "               = tracker matches on overlap, high then low"    << std::endl;
+  std::cout << "  (a)spect     = 0 stretch, 1 letterbox, 2 crop (default = 0)" << std::endl;
+  std::cout << "  re(g)ions    = full frame every n detections (default = 0)" << std::endl;
+  std::cout << "               = others only look around the tracks"   << std::endl;
+  std::cout << "  motion (j)   = skip still frames, luma change 1-255 (default = off)" << std::endl;
+  std::cout << "  e(x)tent     = x,y,w,h area watched for motion (default = all)" << std::endl;
+  std::cout << "  (v)elocity   = detections per second (default = 0)" << std::endl;
+  std::cout << "               = 0 runs as fast as possible"          << std::endl;
   std::cout << "  t(p)u        = use Edge TPU        (default = false)" << std::endl;
   std::cout << "  trac(k)ing   = track targets       (default = false)" << std::endl;
   std::cout << "  (m)odel      = path to model       (default = ./models/detect.tflite)"         << std::endl;
   std::cout << "                                     (default = ./models/edgetpu_detect.tflite)" << std::endl;
   std::cout << "  (l)abels     = path to labels      (default = ./models/labels.txt)"            << std::endl;
   std::cout << "                                     (default = ./models/edgetpu_labels.txt)"    << std::endl;
+  std::cout << "  (R)eplay     = raw frame file instead of the camera"  << std::endl;
+  std::cout << "  (F)ast       = replay as fast as the encoder allows (default = off)" << std::endl;
+  std::cout << "  --lockstep   = replay one frame at a time through detection, tracking and encoding on made up capture times, runs compare bit for bit (default = off)" << std::endl;
   std::cout << "  (o)utput     = output file name"                      << std::endl;
   std::cout << "               = no output if testtime is 0"            << std::endl;
+  std::cout << "  (S)egments   = record n sec mp4 segments to output (default = 0)" << std::endl;
+  std::cout << "               = records even if testtime is 0"        << std::endl;
+  std::cout << "  (E)vents     = only record clips, end after n quiet sec (default = 0)" << std::endl;
+  std::cout << "               = segments then split long clips"      << std::endl;
+  std::cout << "  (P)re-roll   = sec kept in front of a clip (default = 5)" << std::endl;
+  std::cout << "  (J)peg       = snapshot dir for new people and vehicles (default = none)" << std::endl;
 }
 
+// the main loop sees it and stops the session the usual way
+static volatile sig_atomic_t quit = 0;
+
 void quitHandler(int s) {
-  if (cap)  { cap->stop(); }
-  if (trk)  { trk->stop(); }
-  if (tfl)  { tfl->stop(); }
-  if (enc)  { enc->stop(); }
-  if (rtsp) { rtsp->stop(); }
-
-  cap.reset(nullptr);
-  trk.reset(nullptr);
-  tfl.reset(nullptr);
-  enc.reset(nullptr);
-  rtsp.reset(nullptr);
-
-  exit(1);
+  if (quit) {
+    _exit(1);   // a second one doesn't wait for the drain
+  }
+  quit = 1;
+}
+
+void stuckHandler(int s) {
+  const char msg[] = "\nstop timed out, exiting\n";
+  ssize_t n = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+  (void)n;
+  _exit(2);
 }
 
 int main(int argc, char** argv) {
 
+  // a model process started by tflow, see worker.h
+  if (argc > 1 && std::string(argv[1]) == "--worker") {
+    return Worker::main(argc, argv);
+  }
+
   // defaults
-  bool quiet = false;
-  bool streaming = false;
-  bool tpu = false;
-  bool tracking = false;
-  std::string  unicast;
-  unsigned int yield_time = 1000;
-  unsigned int testtime = 30;
-  unsigned int device = 0;
-  unsigned int framerate = 20;
-           int wdth = 640;
-           int hght = 480;
-  unsigned int bitrate = 1000000;
-  unsigned int threads = 1;
-  float        threshold = 0.5f;
-  std::string  model;
-  std::string  labels;
-  std::string  output;
-
-  // cmd line options
+  Session::Options opts;
+  bool yuv = false;
+  unsigned int aspect = 0;
+  std::string  sched;
+  std::string  pool;
+  unsigned int write_behind = 16;   // mb
+  std::string  reserve;
+  bool bench_model = false;
+  std::string  results;
+  std::string  baseline;
+  float tolerance = 10.f;
+
+  // cmd line options, the letters ran out
+  const int bench_opt = 256;
+  const int governor_opt = 257;
+  const int perf_opt = 258;
+  const int results_opt = 259;
+  const int baseline_opt = 260;
+  const int privacy_opt = 261;
+  const int dedup_opt = 262;
+  const int delegate_opt = 263;
+  const int screen_opt = 264;
+  const int classify_opt = 265;
+  const int tiles_opt = 266;
+  const int classes_opt = 267;
+  const int max_dets_opt = 268;
+  const int nms_opt = 269;
+  const int mjpeg_opt = 270;
+  const int isp_opt = 271;
+  const int buffers_opt = 272;
+  const int capture_mem_opt = 273;
+  const int crop_opt = 274;
+  const int tflow_every_opt = 275;
+  const int encode_every_opt = 276;
+  const int libcamera_opt = 277;
+  const int ingest_opt = 278;
+  const int ingest_tcp_opt = 279;
+  const int ingest_copy_opt = 280;
+  const int reid_opt = 281;
+  const int rules_opt = 282;
+  const int track_state_opt = 283;
+  const int counts_opt = 284;
+  const int journal_opt = 285;
+  const int write_behind_opt = 286;
+  const int retain_opt = 287;
+  const int sei_opt = 288;
+  const int slices_opt = 289;
+  const int still_fps_opt = 290;
+  const int gop_opt = 291;
+  const int config_opt = 292;
+  const int track_time_opt = 293;
+  const int track_dist_opt = 294;
+  const int reserve_opt = 295;
+  const int idle_opt = 296;
+  const int drain_opt = 297;
+  const int vectors_opt = 298;
+  const int flow_opt = 299;
+  const int blobs_opt = 300;
+  const int archive_opt = 301;
+  const int peer_opt = 302;
+  const int serve_peers_opt = 303;
+  const int rtp_batch_opt = 304;
+  const int shed_opt = 305;
+  const int fates_opt = 306;
+  const int picture_opt = 307;
+  const int preview_opt = 308;
+  const int sync_overlay_opt = 309;
+  const int infer_procs_opt = 310;
+  const int lockstep_opt = 311;
+  const int deadlines_opt = 312;
+  const int crops_opt = 313;
+  const int model_sizes_opt = 314;
+  const int rotate_opt = 315;
+  const int dewarp_opt = 316;
+  const int events_fb_opt = 317;
+  const int gles_opt = 318;
+  const int flight_opt = 319;
+  const struct option long_opts[] = {
+    { "bench-model", no_argument, nullptr, bench_opt },
+    { "governor", required_argument, nullptr, governor_opt },
+    { "shed", required_argument, nullptr, shed_opt },
+    { "idle", required_argument, nullptr, idle_opt },
+    { "drain", required_argument, nullptr, drain_opt },
+    { "perf", no_argument, nullptr, perf_opt },
+    { "fates", no_argument, nullptr, fates_opt },
+    { "deadlines", required_argument, nullptr, deadlines_opt },
+    { "picture", required_argument, nullptr, picture_opt },
+    { "preview", required_argument, nullptr, preview_opt },
+    { "crops", required_argument, nullptr, crops_opt },
+    { "sync-overlay", required_argument, nullptr, sync_overlay_opt },
+    { "results", required_argument, nullptr, results_opt },
+    { "baseline", required_argument, nullptr, baseline_opt },
+    { "privacy", required_argument, nullptr, privacy_opt },
+    { "dedup", required_argument, nullptr, dedup_opt },
+    { "delegate", required_argument, nullptr, delegate_opt },
+    { "screen", required_argument, nullptr, screen_opt },
+    { "classify", required_argument, nullptr, classify_opt },
+    { "reid", required_argument, nullptr, reid_opt },
+    { "rules", required_argument, nullptr, rules_opt },
+    { "config", required_argument, nullptr, config_opt },
+    { "track-time", required_argument, nullptr, track_time_opt },
+    { "track-dist", required_argument, nullptr, track_dist_opt },
+    { "track-state", required_argument, nullptr, track_state_opt },
+    { "counts", required_argument, nullptr, counts_opt },
+    { "journal", required_argument, nullptr, journal_opt },
+    { "write-behind", required_argument, nullptr, write_behind_opt },
+    { "reserve", required_argument, nullptr, reserve_opt },
+    { "retain", required_argument, nullptr, retain_opt },
+    { "sei", no_argument, nullptr, sei_opt },
+    { "slices", required_argument, nullptr, slices_opt },
+    { "vectors", no_argument, nullptr, vectors_opt },
+    { "flow", no_argument, nullptr, flow_opt },
+    { "blobs", required_argument, nullptr, blobs_opt },
+    { "still-fps", required_argument, nullptr, still_fps_opt },
+    { "gop", required_argument, nullptr, gop_opt },
+    { "tiles", required_argument, nullptr, tiles_opt },
+    { "dewarp", required_argument, nullptr, dewarp_opt },
+    { "classes", required_argument, nullptr, classes_opt },
+    { "max-dets", required_argument, nullptr, max_dets_opt },
+    { "nms", required_argument, nullptr, nms_opt },
+    { "mjpeg", no_argument, nullptr, mjpeg_opt },
+    { "isp", required_argument, nullptr, isp_opt },
+    { "libcamera", required_argument, nullptr, libcamera_opt },
+    { "ingest", required_argument, nullptr, ingest_opt },
+    { "ingest-tcp", no_argument, nullptr, ingest_tcp_opt },
+    { "ingest-copy", no_argument, nullptr, ingest_copy_opt },
+    { "archive", required_argument, nullptr, archive_opt },
+    { "peer", required_argument, nullptr, peer_opt },
+    { "serve-peers", required_argument, nullptr, serve_peers_opt },
+    { "infer-procs", required_argument, nullptr, infer_procs_opt },
+    { "model-sizes", required_argument, nullptr, model_sizes_opt },
+    { "lockstep", no_argument, nullptr, lockstep_opt },
+    { "rtp-batch", no_argument, nullptr, rtp_batch_opt },
+    { "events-fb", no_argument, nullptr, events_fb_opt },
+    { "gles", no_argument, nullptr, gles_opt },
+    { "flight", required_argument, nullptr, flight_opt },
+    { "buffers", required_argument, nullptr, buffers_opt },
+    { "capture-mem", required_argument, nullptr, capture_mem_opt },
+    { "crop", required_argument, nullptr, crop_opt },
+    { "rotate", required_argument, nullptr, rotate_opt },
+    { "tflow-every", required_argument, nullptr, tflow_every_opt },
+    { "encode-every", required_argument, nullptr, encode_every_opt },
+
+    // the letters' long names, for config files too
+    { "quiet", no_argument, nullptr, 'q' },
+    { "rtsp", no_argument, nullptr, 'r' },
+    { "tpu", no_argument, nullptr, 'p' },
+    { "tracking", no_argument, nullptr, 'k' },
+    { "zero-copy", no_argument, nullptr, 'z' },
+    { "yuv420", no_argument, nullptr, 'i' },
+    { "fast", no_argument, nullptr, 'F' },
+    { "latest", no_argument, nullptr, 'L' },
+    { "quality", no_argument, nullptr, 'Q' },
+    { "m2m", no_argument, nullptr, 'M' },
+    { "half", no_argument, nullptr, 'H' },
+    { "on-demand", no_argument, nullptr, 'U' },
+    { "onvif", no_argument, nullptr, 'O' },
+    { "no-draw", no_argument, nullptr, 'D' },
+    { "jpeg", required_argument, nullptr, 'J' },
+    { "tunnel", required_argument, nullptr, 'T' },
+    { "send-buffer", required_argument, nullptr, 'B' },
+    { "pace", required_argument, nullptr, 'C' },
+    { "web", required_argument, nullptr, 'W' },
+    { "whep", required_argument, nullptr, 'N' },
+    { "affinity", required_argument, nullptr, 'A' },
+    { "workers", required_argument, nullptr, 'K' },
+    { "input", required_argument, nullptr, 'I' },
+    { "guard", required_argument, nullptr, 'G' },
+    { "export", required_argument, nullptr, 'X' },
+    { "events", required_argument, nullptr, 'V' },
+    { "metrics", required_argument, nullptr, 'Z' },
+    { "trace", required_argument, nullptr, 'Y' },
+    { "unicast", required_argument, nullptr, 'u' },
+    { "testtime", required_argument, nullptr, 't' },
+    { "device", required_argument, nullptr, 'd' },
+    { "framerate", required_argument, nullptr, 'f' },
+    { "width", required_argument, nullptr, 'w' },
+    { "height", required_argument, nullptr, 'h' },
+    { "bitrate", required_argument, nullptr, 'b' },
+    { "yield-time", required_argument, nullptr, 'y' },
+    { "threads", required_argument, nullptr, 'e' },
+    { "engines", required_argument, nullptr, 'n' },
+    { "threshold", required_argument, nullptr, 's' },
+    { "low-threshold", required_argument, nullptr, 'c' },
+    { "aspect", required_argument, nullptr, 'a' },
+    { "regions", required_argument, nullptr, 'g' },
+    { "motion", required_argument, nullptr, 'j' },
+    { "extent", required_argument, nullptr, 'x' },
+    { "velocity", required_argument, nullptr, 'v' },
+    { "model", required_argument, nullptr, 'm' },
+    { "labels", required_argument, nullptr, 'l' },
+    { "replay", required_argument, nullptr, 'R' },
+    { "segments", required_argument, nullptr, 'S' },
+    { "clips", required_argument, nullptr, 'E' },
+    { "pre-roll", required_argument, nullptr, 'P' },
+    { "output", required_argument, nullptr, 'o' },
+    { nullptr, 0, nullptr, 0 }
+  };
+  const char* short_opts = ":qrpkziFLQHMUODJ:T:B:C:W:N:A:K:I:G:X:V:Z:Y:u:t:d:f:w:h:b:y:e:n:s:c:a:g:j:x:v:m:l:R:S:E:P:o:";
+
+  // a config profile goes in front of the command line
+  std::string config;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--config" && i + 1 < argc) {
+      config = argv[i + 1];
+    } else if (arg.compare(0, 9, "--config=") == 0) {
+      config = arg.substr(9);
+    }
+  }
+  std::vector<std::string> conf_args;
+  std::string profile;
+  if (!config.empty()) {
+    size_t comma = config.find(',');
+    if (comma != std::string::npos) {
+      profile = config.substr(comma + 1);
+      config.resize(comma);
+    }
+    auto conf = Config::create(config);
+    if (!conf || !conf->args(profile, long_opts, short_opts, conf_args)) {
+      return -1;
+    }
+  }
+  std::vector<char*> args(argv, argv + argc);
+  for (size_t i = 0; i < conf_args.size(); i++) {
+    args.insert(args.begin() + 1 + i, &conf_args[i][0]);
+  }
+  args.push_back(nullptr);
+
   int c;
-  while((c = getopt(argc, argv, ":qrpku:t:d:f:w:h:b:y:e:s:m:l:o:")) != -1) {
+  while((c = getopt_long(static_cast<int>(args.size() - 1), args.data(), short_opts, long_opts, nullptr)) != -1) {
     switch (c) {
-      case 'q': quiet     = true;               break;
-      case 'r': streaming = true;               break;
-      case 'p': tpu       = true;               break;
-      case 'k': tracking  = true;               break;
-      case 'u': unicast   = optarg;             break;
-      case 't': testtime  = std::stoul(optarg); break;
-      case 'd': device    = std::stoul(optarg); break;
-      case 'f': framerate = std::stoul(optarg); break;
-      case 'w': wdth      = std::stoi(optarg);  break;
-      case 'h': hght      = std::stoi(optarg);  break;
-      case 'b': bitrate   = std::stoul(optarg); break;
-      case 'y': yield_time= std::stoul(optarg); break;
-      case 'e': threads   = std::stoul(optarg); break;
-      case 's': threshold = std::stof(optarg);  break;
-      case 'm': model     = optarg;             break;
-      case 'l': labels    = optarg;             break;
-      case 'o': output    = optarg;             break;
+      case bench_opt: bench_model = true;     break;
+      case governor_opt: opts.governor = optarg; break;
+      case shed_opt: opts.shed = optarg; break;
+      case idle_opt: opts.idle = optarg; break;
+      case drain_opt: opts.drain = std::stoul(optarg); break;
+      case perf_opt: opts.perf = true;        break;
+      case fates_opt: opts.fates = true; break;
+      case deadlines_opt: opts.deadlines = optarg; break;
+      case picture_opt: opts.picture = std::stoul(optarg); break;
+      case preview_opt: opts.preview = optarg; break;
+      case crops_opt: opts.crops = optarg; break;
+      case sync_overlay_opt: opts.sync_overlay = std::min(std::stoul(optarg), 1000ul); break;
+      case results_opt: results = optarg;     break;
+      case baseline_opt: baseline = optarg;   break;
+      case privacy_opt:
+        if (!parse_zones(optarg, opts.privacy)) {
+          usage();
+          return 0;
+        }
+        break;
+      case dedup_opt: opts.dedup = std::stoul(optarg); break;
+      case delegate_opt:
+        {
+          std::string d = optarg;
+          if (d == "edgetpu") {
+            opts.tpu = true;
+          } else if (d == "cpu") {
+            opts.delegate = Tflow::Delegate::kCpu;
+          } else if (d == "xnnpack") {
+            opts.delegate = Tflow::Delegate::kXnnpack;
+          } else if (d == "gpu") {
+            opts.delegate = Tflow::Delegate::kGpu;
+          } else if (d != "auto") {
+            usage();
+            return 0;
+          }
+        }
+        break;
+      case screen_opt:
+        {
+          std::string s = optarg;
+          size_t comma = s.find(',');
+          opts.screen = s.substr(0, comma);
+          if (comma != std::string::npos) {
+            opts.screen_threshold = std::stof(s.substr(comma + 1));
+          }
+        }
+        break;
+      case classify_opt:
+        {
+          std::vector<std::string> parts;
+          std::string s = optarg;
+          size_t at = 0, comma;
+          while ((comma = s.find(',', at)) != std::string::npos) {
+            parts.push_back(s.substr(at, comma - at));
+            at = comma + 1;
+          }
+          parts.push_back(s.substr(at));
+          opts.classify = parts[0];
+          opts.classify_labels = (parts.size() > 1) ? parts[1] : "";
+          opts.classify_threads = (parts.size() > 2) ? std::stoul(parts[2]) : 1;
+        }
+        break;
+      case rules_opt: opts.rules = optarg; break;
+      case config_opt: break;
+      case track_time_opt: opts.track_time = std::stoul(optarg); break;
+      case track_dist_opt: opts.track_dist = std::stof(optarg); break;
+      case track_state_opt: opts.track_state = optarg; break;
+      case counts_opt: opts.counts = std::stoul(optarg); break;
+      case journal_opt: opts.journal = optarg; break;
+      case write_behind_opt: write_behind = std::stoul(optarg); break;
+      case reserve_opt: reserve = optarg; break;
+      case sei_opt: opts.sei = true; break;
+      case slices_opt: opts.slices = std::stoul(optarg); break;
+      case vectors_opt: opts.vectors = true; break;
+      case flow_opt: opts.flow = true; break;
+      case blobs_opt: opts.blobs = std::stoul(optarg); break;
+      case still_fps_opt: opts.still_fps = std::stoul(optarg); break;
+      case gop_opt:
+        if (sscanf(optarg, "%u,%u", &opts.gop, &opts.gop_still) < 1) {
+          usage();
+          return 0;
+        }
+        break;
+      case retain_opt:
+        if (sscanf(optarg, "%u,%u", &opts.retain, &opts.retain_pin) < 1) {
+          usage();
+          return 0;
+        }
+        break;
+      case reid_opt:
+        {
+          std::string s = optarg;
+          size_t comma = s.find(',');
+          opts.embed = s.substr(0, comma);
+          if (comma != std::string::npos) {
+            opts.embed_threads = std::stoul(s.substr(comma + 1));
+          }
+        }
+        break;
+      case tiles_opt:
+        if (sscanf(optarg, "%ux%u,%u", &opts.tile_cols, &opts.tile_rows,
+              &opts.tile_per_frame) < 2) {
+          usage();
+          return 0;
+        }
+        break;
+      case classes_opt: opts.classes = optarg;   break;
+      case max_dets_opt: opts.max_dets = std::stoul(optarg); break;
+      case nms_opt: opts.nms = std::stof(optarg); break;
+      case mjpeg_opt: opts.mjpeg = true; yuv = true; break;
+      case buffers_opt: opts.capture_buffers = std::stoul(optarg); break;
+      case tflow_every_opt:
+        if (sscanf(optarg, "%u,%f", &opts.tflow_every, &opts.tflow_fps) < 1) {
+          usage();
+          return 0;
+        }
+        break;
+      case encode_every_opt:
+        if (sscanf(optarg, "%u,%f", &opts.encode_every, &opts.encode_fps) < 1) {
+          usage();
+          return 0;
+        }
+        break;
+      case crop_opt:
+        if (sscanf(optarg, "%u,%u,%u,%u", &opts.crop.x, &opts.crop.y,
+              &opts.crop.w, &opts.crop.h) != 4) {
+          usage();
+          return 0;
+        }
+        break;
+      case capture_mem_opt:
+        {
+          std::string m = optarg;
+          if (m == "dmabuf") {
+            opts.capture_memory = Capturer::Memory::kDmabuf;
+          } else if (m == "userptr") {
+            opts.capture_memory = Capturer::Memory::kUserptr;
+          } else if (m != "mmap") {
+            usage();
+            return 0;
+          }
+        }
+        break;
+      case ingest_opt: opts.ingest = optarg; break;
+      case ingest_tcp_opt: opts.ingest_tcp = true; break;
+      case ingest_copy_opt: opts.ingest_copy = true; break;
+      case archive_opt: opts.archive = optarg; break;
+      case peer_opt: {
+        std::string arg = optarg;
+        size_t comma = arg.find(',');
+        opts.peer = arg.substr(0, comma);
+        if (comma != std::string::npos) {
+          opts.peer_deadline = std::stoul(arg.substr(comma + 1));
+        }
+        break;
+      }
+      case serve_peers_opt: opts.serve_peers = std::stoul(optarg); break;
+      case model_sizes_opt: opts.model_sizes = optarg; break;
+      case rotate_opt: opts.rotate = std::stoul(optarg); break;
+      case dewarp_opt: opts.dewarp = optarg; break;
+      case infer_procs_opt: {
+        std::istringstream iss(optarg);
+        std::string tok;
+        for (unsigned int i = 0; std::getline(iss, tok, ','); i++) {
+          if (i == 0) {
+            opts.infer_procs = std::min(std::stoul(tok), 4ul);
+          } else if (i == 1) {
+            opts.infer_deadline = std::max(std::stoul(tok), 10ul);
+          } else if (i == 2) {
+            opts.infer_core = std::stoi(tok);
+          }
+        }
+        break;
+      }
+      case rtp_batch_opt: opts.rtp_batch = true; break;
+      case events_fb_opt: opts.events_fb = true; break;
+      case gles_opt: opts.gles = true; break;
+      case flight_opt: opts.flight = optarg; break;
+      case lockstep_opt: opts.lockstep = true; break;
+      case libcamera_opt:
+        if (sscanf(optarg, "%d,%ux%u", &opts.camera, &opts.camera_width,
+              &opts.camera_height) < 1 || opts.camera < 0) {
+          usage();
+          return 0;
+        }
+        break;
+      case isp_opt:
+        if (sscanf(optarg, "%d,%ux%u", &opts.isp_device, &opts.isp_width,
+              &opts.isp_height) < 1) {
+          usage();
+          return 0;
+        }
+        break;
+      case 'q': opts.quiet     = true;               break;
+      case 'r': opts.streaming = true;               break;
+      case 'p': opts.tpu       = true;               break;
+      case 'k': opts.tracking  = true;               break;
+      case 'z': opts.direct    = true;               break;
+      case 'i': yuv       = true;               break;
+      case 'F': opts.fast      = true;               break;
+      case 'L': opts.latest    = true;               break;
+      case 'Q': opts.roi       = true;               break;
+      case 'M': opts.m2m       = true;               break;
+      case 'H': opts.half      = true;               break;
+      case 'U': opts.on_demand = true;               break;
+      case 'O': opts.meta      = true;               break;
+      case 'D': opts.nodraw    = true;               break;
+      case 'u': opts.unicast   = optarg;             break;
+      case 't': opts.testtime  = std::stoul(optarg); break;
+      case 'd': opts.device    = std::stoul(optarg); break;
+      case 'f': opts.framerate = std::stoul(optarg); break;
+      case 'w': opts.width     = std::stoi(optarg);  break;
+      case 'h': opts.height    = std::stoi(optarg);  break;
+      case 'b': opts.bitrate   = std::stoul(optarg); break;
+      case 'y': opts.yield_time= std::stoul(optarg); break;
+      case 'e': opts.threads   = std::stoul(optarg); break;
+      case 'n': opts.engines   = std::stoul(optarg); break;
+      case 's': opts.threshold = std::stof(optarg);  break;
+      case 'c': opts.low_threshold = std::stof(optarg);  break;
+      case 'g': opts.regions   = std::stoul(optarg); break;
+      case 'j': opts.motion    = std::stoul(optarg); break;
+      case 'x': 
+        if (sscanf(optarg, "%u,%u,%u,%u", &opts.motion_mask.x, &opts.motion_mask.y,
+              &opts.motion_mask.w, &opts.motion_mask.h) != 4) {
+          usage(); 
+          return 0;
+        }
+        break;
+      case 'v': opts.rate      = std::stof(optarg);  break;
+      case 'a': aspect    = std::stoul(optarg); break;
+      case 'm': opts.model     = optarg;             break;
+      case 'l': opts.labels    = optarg;             break;
+      case 'R': opts.replay    = optarg;             break;
+      case 'S': opts.segment   = std::stoul(optarg); break;
+      case 'E': opts.event_quiet = std::stoul(optarg); break;
+      case 'P': opts.preroll   = std::stoul(optarg); break;
+      case 'J': opts.snap_dir  = optarg;             break;
+      case 'T': opts.tunnel    = std::stoul(optarg); break;
+      case 'B': opts.send_buf  = std::stoul(optarg); break;
+      case 'C': opts.pace      = std::stoul(optarg); break;
+      case 'W': opts.web       = std::stoul(optarg); break;
+      case 'N': opts.whep      = std::stoul(optarg); break;
+      case 'A': sched     = optarg;             break;
+      case 'K': pool      = optarg;             break;
+      case 'I': opts.ctl_path  = optarg;             break;
+      case 'G': opts.guard     = std::stoul(optarg); break;
+      case 'X': opts.pub_name  = optarg;             break;
+      case 'V': opts.events    = optarg;             break;
+      case 'Z': opts.metrics   = std::stoul(optarg); break;
+      case 'Y': opts.trace     = optarg;             break;
+      case 'o': opts.output    = optarg;             break;
 
       case '?':
       default:  usage(); return 0;
     }
   }
 
-  // pick the model and labels
-  if (model.empty()) {
-    model = tpu ? "./models/edgetpu_detect.tflite" : "./models/detect.tflite";
+  // mb[,huge][,lock]
+  unsigned int reserve_mb = 0;
+  bool reserve_huge = false;
+  bool reserve_lock = false;
+  if (!reserve.empty()) {
+    std::istringstream iss(reserve);
+    std::string tok;
+    std::getline(iss, tok, ',');
+    if (sscanf(tok.c_str(), "%u", &reserve_mb) != 1) {
+      usage();
+      return 0;
+    }
+    while (std::getline(iss, tok, ',')) {
+      if (tok == "huge") {
+        reserve_huge = true;
+      } else if (tok == "lock") {
+        reserve_lock = true;
+      } else {
+        usage();
+        return 0;
+      }
+    }
   }
-  if (labels.empty()) {
-    labels = tpu ? "./models/edgetpu_labels.txt" : "./models/labels.txt";
+
+  // pipeline pixel format
+  opts.pix_fmt = yuv ? V4L2_PIX_FMT_YUV420 : V4L2_PIX_FMT_RGB24;
+
+  // fit of the frame to the model
+  if (aspect == 1) {
+    opts.aspect = Tflow::Aspect::kLetterbox;
+  } else if (aspect == 2) {
+    opts.aspect = Tflow::Aspect::kCrop;
+  }
+
+  // file[,tolerance]
+  size_t comma = baseline.find(',');
+  if (comma != std::string::npos) {
+    if (sscanf(baseline.c_str() + comma + 1, "%f", &tolerance) != 1) {
+      usage();
+      return 0;
+    }
+    baseline.resize(comma);
+  }
+  if (!baseline.empty() && results.empty()) {
+    usage();
+    return 0;
   }
 
-  // ctrl-c handler
+  // the sweep picks a model per run
+  if (bench_model) {
+    return Sweep::run(opts) ? 0 : -1;
+  }
+
+  // pick the model and labels
+  Session::complete(opts);
+
+  // ctrl-c and systemd's stop
   struct sigaction sig_int;
   sig_int.sa_handler = quitHandler;
   sigemptyset(&sig_int.sa_mask);
   sig_int.sa_flags = 0;
   sigaction(SIGINT, &sig_int, NULL);
+  sigaction(SIGTERM, &sig_int, NULL);
 
   // test setup report
-  if (!quiet) {
+  if (!opts.quiet) {
     fprintf(stderr, "\nTest Setup...\n");
-    if (testtime) {
-      fprintf(stderr, "   test time: %d seconds\n", testtime);
+    if (!config.empty()) {
+      fprintf(stderr, "      config: %s%s%s\n", config.c_str(),
+          profile.empty() ? "" : ", profile ", profile.c_str());
+    }
+    if (opts.testtime) {
+      fprintf(stderr, "   test time: %d seconds\n", opts.testtime);
     } else {
       fprintf(stderr, "   test time: run until ctrl-c\n");
     }
-    fprintf(stderr, "      device: /dev/video%d\n", device);
-    fprintf(stderr, "        rtsp: %s\n", streaming ? "yes" : "no");
-    if (streaming) {
-      fprintf(stderr, "rstp address: %s\n", unicast.empty() ? "multicast" : unicast.c_str());
-    }
-    fprintf(stderr, "   framerate: %d fps\n", framerate);
-    fprintf(stderr, "       width: %d pix %s\n", std::abs(wdth), (wdth < 0) ? "(flipped)" : "" );
-    fprintf(stderr, "      height: %d pix %s\n", std::abs(hght), (hght < 0) ? "(flipped)" : "" );
-    fprintf(stderr, "     bitrate: %d bps\n", bitrate);
-    fprintf(stderr, "  yield time: %d usec\n", yield_time);
-    fprintf(stderr, "     threads: %d\n", threads);
-    fprintf(stderr, "   threshold: %f\n", threshold);
-    fprintf(stderr, "     use tpu: %s\n", tpu ? "yes" : "no");
-    fprintf(stderr, "    tracking: %s\n", tracking ? "yes" : "no");
-    fprintf(stderr, "       model: %s\n", model.c_str());
-    fprintf(stderr, "      lables: %s\n", labels.c_str());
-    fprintf(stderr, "      output: %s\n\n", (testtime == 0) ? "none" : output.c_str());
+    if (!opts.ingest.empty()) {
+      fprintf(stderr, "      ingest: %s%s%s\n", opts.ingest.c_str(), opts.ingest_tcp ? " (tcp)" : "",
+          opts.ingest_copy ? ", recorded as sent" : "");
+    } else if (!opts.archive.empty()) {
+      fprintf(stderr, "     archive: %s, until its last frame\n", opts.archive.c_str());
+    } else if (opts.replay.empty()) {
+      fprintf(stderr, "      device: /dev/video%d\n", opts.device);
+    } else {
+      fprintf(stderr, "      replay: %s%s\n", opts.replay.c_str(),
+          opts.lockstep ? " (lockstep)" : opts.fast ? " (fast)" : "");
+    }
+    fprintf(stderr, "        rtsp: %s\n", opts.streaming ? "yes" : "no");
+    if (opts.streaming) {
+      fprintf(stderr, "rstp address: %s\n", opts.on_demand ? "unicast on demand" :
+          opts.unicast.empty() ? "multicast" : opts.unicast.c_str());
+      fprintf(stderr, "   substream: %s\n", opts.half ? "yes" : "no");
+    }
+    if (opts.web) {
+      fprintf(stderr, "         hls: http port %u\n", opts.web);
+    }
+    if (opts.whep) {
+      fprintf(stderr, "      webrtc: whep on http port %u\n", opts.whep);
+    }
+    fprintf(stderr, "   framerate: %d fps\n", opts.framerate);
+    fprintf(stderr, "       width: %d pix %s\n", std::abs(opts.width), (opts.width < 0) ? "(flipped)" : "" );
+    fprintf(stderr, "      height: %d pix %s\n", std::abs(opts.height), (opts.height < 0) ? "(flipped)" : "" );
+    fprintf(stderr, "     bitrate: %d bps\n", opts.bitrate);
+    fprintf(stderr, "  yield time: %d usec\n", opts.yield_time);
+    fprintf(stderr, "         cpu: %s, %s kernels\n", Cpu::describe().c_str(), Kernels::name());
+    if (!sched.empty()) {
+      fprintf(stderr, "  scheduling: %s\n", sched.c_str());
+    }
+    if (!pool.empty()) {
+      fprintf(stderr, "        pool: %s\n", pool.c_str());
+    }
+    fprintf(stderr, "     storage: %s\n", write_behind ?
+        (std::to_string(write_behind) + " mb behind").c_str() : "inline");
+    if (reserve_mb) {
+      fprintf(stderr, "     reserve: %u mb%s%s\n", reserve_mb,
+          reserve_huge ? ", huge pages" : "", reserve_lock ? ", locked" : "");
+    }
+    if (!opts.ctl_path.empty()) {
+      fprintf(stderr, "    controls: %s\n", opts.ctl_path.c_str());
+    }
+    if (opts.guard) {
+      fprintf(stderr, "    watchdog: %u sec stall\n", opts.guard);
+    }
+    if (!opts.shed.empty()) {
+      fprintf(stderr, "        shed: %s%s\n", opts.shed.c_str(),
+          opts.governor.empty() ? "" : ", off with the governor");
+    }
+    if (!opts.idle.empty()) {
+      fprintf(stderr, "        idle: %s\n", opts.idle.c_str());
+    }
+    if (!opts.pub_name.empty()) {
+      fprintf(stderr, "      export: %s\n", opts.pub_name.c_str());
+    }
+    if (!opts.events.empty()) {
+      fprintf(stderr, "      events: %s%s\n", opts.events.c_str(), opts.events_fb ? ", flatbuffers" : "");
+    }
+    if (!opts.rules.empty()) {
+      fprintf(stderr, "       rules: %s\n", opts.rules.c_str());
+    }
+    if (!opts.journal.empty()) {
+      fprintf(stderr, "     journal: %s\n", opts.journal.c_str());
+    }
+    if (opts.counts) {
+      fprintf(stderr, "      counts: every %u sec\n", opts.counts);
+    }
+    if (!opts.track_state.empty()) {
+      fprintf(stderr, " track state: %s\n", opts.track_state.c_str());
+    }
+    if (opts.metrics) {
+      fprintf(stderr, "     metrics: port %u\n", opts.metrics);
+      if (opts.picture) {
+        fprintf(stderr, "     picture: /snapshot.jpg every %u msec at most\n", opts.picture);
+      }
+    }
+    if (!opts.flight.empty()) {
+      fprintf(stderr, "      flight: %s\n", opts.flight.c_str());
+    }
+    if (!opts.preview.empty()) {
+      fprintf(stderr, "     preview: %s\n", opts.preview.c_str());
+    }
+    if (!opts.crops.empty()) {
+      fprintf(stderr, "       crops: %s\n", opts.crops.c_str());
+    }
+    if (opts.sync_overlay != 0) {
+      fprintf(stderr, "sync overlay: %u msec at most%s\n", opts.sync_overlay,
+          opts.tracking ? ", off with tracking" : "");
+    }
+    if (!opts.trace.empty()) {
+      fprintf(stderr, "       trace: %s\n", opts.trace.c_str());
+    }
+    if (opts.perf) {
+      fprintf(stderr, "        perf: on\n");
+    }
+    if (opts.fates) {
+      fprintf(stderr, "       fates: on\n");
+    }
+    if (!opts.deadlines.empty()) {
+      fprintf(stderr, "   deadlines: %s ms\n", opts.deadlines.c_str());
+    }
+    fprintf(stderr, "     threads: %d\n", opts.threads);
+    fprintf(stderr, "     engines: %d\n", opts.engines);
+    fprintf(stderr, "   threshold: %f\n", opts.threshold);
+    if (opts.low_threshold > 0.f && opts.low_threshold < opts.threshold) {
+      fprintf(stderr, "  low thresh: %f\n", opts.low_threshold);
+    }
+    fprintf(stderr, "      aspect: %s\n", 
+        (opts.aspect == Tflow::Aspect::kLetterbox) ? "letterbox" : 
+        (opts.aspect == Tflow::Aspect::kCrop) ? "crop" : "stretch");
+    if (opts.tracking && opts.regions > 1) {
+      fprintf(stderr, "     regions: full frame every %d\n", opts.regions);
+    }
+    if (opts.motion) {
+      fprintf(stderr, "      motion: %d", opts.motion);
+      if (opts.motion_mask.w && opts.motion_mask.h) {
+        fprintf(stderr, " in %d,%d %dx%d", opts.motion_mask.x, opts.motion_mask.y, 
+            opts.motion_mask.w, opts.motion_mask.h);
+      }
+      fprintf(stderr, "\n");
+      if (opts.blobs) {
+        fprintf(stderr, "       blobs: %u cells and up, the model looks around them\n", opts.blobs);
+      }
+      if (opts.still_fps) {
+        fprintf(stderr, "       still: %u fps encoded\n", opts.still_fps);
+      }
+    }
+    if (opts.vectors) {
+      fprintf(stderr, "     vectors: encoder's to the%s tracker\n", opts.motion ? " motion gate and" : "");
+    }
+    if (opts.gop) {
+      fprintf(stderr, "         gop: %u busy, %u still\n", opts.gop, opts.gop_still);
+    }
+    if (opts.dedup) {
+      fprintf(stderr, "       dedup: results reused up to %u ms\n", opts.dedup);
+    }
+    if (!opts.screen.empty()) {
+      fprintf(stderr, "      screen: %s at %.2f\n", opts.screen.c_str(), opts.screen_threshold);
+    }
+    if (!opts.classes.empty()) {
+      fprintf(stderr, "     classes: %s\n", opts.classes.c_str());
+    }
+    if (opts.max_dets || opts.nms > 0.f) {
+      fprintf(stderr, "        post: max %u boxes, nms %.2f\n", opts.max_dets, opts.nms);
+    }
+    if (opts.camera >= 0) {
+      fprintf(stderr, "   libcamera: camera %d", opts.camera);
+      if (opts.camera_width && opts.camera_height) {
+        fprintf(stderr, ", scaled %ux%u", opts.camera_width, opts.camera_height);
+      }
+      fprintf(stderr, "\n");
+    }
+    if (opts.isp_device >= 0) {
+      fprintf(stderr, "         isp: /dev/video%d, %ux%u\n", opts.isp_device,
+          opts.isp_width, opts.isp_height);
+    }
+    if (opts.tile_cols * opts.tile_rows > 1) {
+      fprintf(stderr, "       tiles: %ux%u, ", opts.tile_cols, opts.tile_rows);
+      if (opts.tile_per_frame) {
+        fprintf(stderr, "%u a frame\n", opts.tile_per_frame);
+      } else {
+        fprintf(stderr, "all a frame\n");
+      }
+    }
+    if (!opts.dewarp.empty()) {
+      fprintf(stderr, "      dewarp: %s\n", opts.dewarp.c_str());
+    }
+    if (opts.gles) {
+      fprintf(stderr, "        gles: model input on the gpu\n");
+    }
+    if (!opts.classify.empty()) {
+      fprintf(stderr, "    classify: %s, %u threads\n", opts.classify.c_str(), opts.classify_threads);
+    }
+    if (!opts.embed.empty()) {
+      fprintf(stderr, "        reid: %s, %u threads\n", opts.embed.c_str(), opts.embed_threads);
+    }
+    if (!opts.privacy.empty()) {
+      fprintf(stderr, "     privacy: %zu zones\n", opts.privacy.size());
+    }
+    if (opts.rate > 0.f) {
+      fprintf(stderr, "        rate: %.1f detections/sec\n", opts.rate);
+    }
+    fprintf(stderr, "     use tpu: %s\n", opts.tpu ? "yes" : "no");
+    if (!opts.tpu) {
+      fprintf(stderr, "    delegate: %s\n", Tflow::delegateStr(opts.delegate));
+    }
+    if (!opts.peer.empty()) {
+      fprintf(stderr, "        peer: %s when our engines are busy, %u ms\n", opts.peer.c_str(),
+          opts.peer_deadline);
+    }
+    if (opts.serve_peers) {
+      fprintf(stderr, " serve peers: port %u\n", opts.serve_peers);
+    }
+    if (!opts.model_sizes.empty()) {
+      fprintf(stderr, " model sizes: %s\n", opts.model_sizes.c_str());
+    }
+    if (opts.infer_procs != 0) {
+      fprintf(stderr, " infer procs: %u, %u ms", opts.infer_procs, opts.infer_deadline);
+      if (opts.infer_core >= 0) {
+        fprintf(stderr, ", from core %d", opts.infer_core);
+      }
+      fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "    tracking: %s%s\n", opts.tracking ? "yes" : "no",
+        (opts.tracking && opts.flow) ? ", optical flow between detections" : "");
+    if (opts.tracking && (opts.track_time != 2000 || opts.track_dist != 0.2f)) {
+      fprintf(stderr, "      tracks: %u msec unseen, %.2f of the diagonal\n",
+          opts.track_time, opts.track_dist);
+    }
+    fprintf(stderr, "   zero copy: %s\n", opts.direct ? "yes" : "no");
+    fprintf(stderr, "     capture: %s buffers\n", Capturer::memoryStr(opts.capture_memory));
+    if (opts.tflow_every > 1 || opts.tflow_fps > 0.f) {
+      fprintf(stderr, "  tflow gets: every %u frames, %.1f fps at most\n",
+          std::max(opts.tflow_every, 1u), opts.tflow_fps);
+    }
+    if (opts.encode_every > 1 || opts.encode_fps > 0.f) {
+      fprintf(stderr, "encoder gets: every %u frames, %.1f fps at most\n",
+          std::max(opts.encode_every, 1u), opts.encode_fps);
+    }
+    if (opts.crop.w && opts.crop.h) {
+      fprintf(stderr, "        crop: %u,%u %ux%u of the sensor\n", opts.crop.x, opts.crop.y,
+          opts.crop.w, opts.crop.h);
+    }
+    fprintf(stderr, "latest frame: %s\n", opts.latest ? "yes" : "no");
+    fprintf(stderr, " box quality: %s\n", opts.roi ? "yes" : "no");
+    fprintf(stderr, "       codec: %s\n", opts.m2m ? "v4l2 m2m" : "omx");
+    if (opts.rtp_batch) {
+      fprintf(stderr, "   rtp batch: %s\n", opts.on_demand ? "off, not with -U" : "a sendmmsg a frame");
+    }
+    fprintf(stderr, "      format: %s%s\n", PixelFormatToStr(opts.pix_fmt), opts.mjpeg ? " from mjpeg" : "");
+    if (opts.rotate) {
+      fprintf(stderr, "      rotate: %u degrees\n", opts.rotate);
+    }
+    fprintf(stderr, "       model: %s\n", opts.model.c_str());
+    fprintf(stderr, "      lables: %s\n", opts.labels.c_str());
+    bool recording = (opts.segment != 0 || opts.event_quiet != 0) && !opts.output.empty();
+    fprintf(stderr, "      output: %s\n", (opts.testtime == 0 && !recording) ? "none" : opts.output.c_str());
+    if (recording && opts.segment != 0) {
+      fprintf(stderr, "    segments: %d sec mp4\n", opts.segment);
+    }
+    if (recording && opts.retain != 0) {
+      fprintf(stderr, "   retention: %u mb ring, %u sec pins\n", opts.retain, opts.retain_pin);
+    }
+    if (recording && opts.event_quiet != 0) {
+      fprintf(stderr, "       clips: %d sec pre-roll, %d sec quiet\n", opts.preroll, opts.event_quiet);
+    }
+    fprintf(stderr, "   snapshots: %s\n", opts.snap_dir.empty() ? "none" : opts.snap_dir.c_str());
+    fprintf(stderr, "\n");
     fprintf(stderr, "         pid: top -H -p %d\n\n", getpid());
   }
 
+  // shared workers first, stages stripe their images over them
+  if (!pool.empty()) {
+    unsigned int workers = 0;
+    std::vector<unsigned int> cpus;
+    size_t at = pool.find('@');
+    if (sscanf(pool.c_str(), "%u", &workers) != 1 ||
+        (at != std::string::npos && !parse_cpus(pool.substr(at + 1), cpus))) {
+      usage();
+      return 0;
+    }
+    Pool::start(workers, cpus);
+  }
+
+  // one thread does the stages' file writes
+  Storage::start(static_cast<size_t>(write_behind) << 20);
+
+  // the big buffers are cut from one mapping
+  if (reserve_mb && !Reserve::start(static_cast<size_t>(reserve_mb) << 20,
+        reserve_huge, reserve_lock)) {
+    dbgMsg("failed: reserve\n");
+    return -1;
+  }
+
   // create worker threads
-  if (streaming) { 
-    rtsp = Rtsp::create(yield_time, quiet, bitrate, framerate, unicast); 
+  session = Session::create(opts);
+  if (!session) {
+    dbgMsg("failed: create session\n");
+    return -1;
   }
-  enc = Encoder::create(yield_time, quiet, tracking, rtsp.get(), framerate, 
-      std::abs(wdth), std::abs(hght), bitrate, output, testtime);
-  if (tracking) {
-    double dist = std::sqrt(std::pow(wdth, 2) + std::pow(hght, 2)) / 5.0;
-    trk = Tracker::create(yield_time, quiet, enc.get(), dist, 2000);
+  if (!sched.empty() && !session->pipeline()->schedule(sched)) {
+    usage();
+    return 0;
   }
-  tfl = Tflow::create(2*yield_time, quiet, enc.get(), trk.get(), std::abs(wdth), 
-      std::abs(hght), model.c_str(), labels.c_str(), threads, threshold, tpu);
-  cap = Capturer::create(yield_time, quiet, enc.get(), tfl.get(), 
-      device, framerate, wdth, hght);
 
   // start
   dbgMsg("start\n");
-  if (streaming) { rtsp->start("rtsp", 90); }
-  enc->start("enc", 50);
-  if (tracking) { trk->start("trk", 20); }
-  tfl->start("tfl", 20);
-  cap->start("cap", 90);
+  if (!session->start()) {
+    dbgMsg("failed: start session\n");
+  }
 
   // run
   dbgMsg("run\n");
-  if (streaming) { rtsp->run(); }
-  enc->run();
-  if (tracking) { trk->run(); }
-  tfl->run();
-  cap->run();
+  session->run();
+  Regress::mark();
 
   // run test
-  if (!quiet) { fprintf(stderr, "\n\n"); }
-  if (testtime) {   // run for testtime...
-    for (unsigned int i = 0; i < testtime * 5; i++) {
-      if (!quiet) { fprintf(stderr, "."); fflush(stdout); }
+  if (!opts.quiet) { fprintf(stderr, "\n\n"); }
+  if (opts.testtime) {   // run for testtime...
+    for (unsigned int i = 0; i < opts.testtime * 5 && !quit && !session->done(); i++) {
+      if (!opts.quiet) { fprintf(stderr, "."); fflush(stdout); }
       std::this_thread::sleep_for(std::chrono::milliseconds(200));
     }
   } else {          // run forever...
-    if (!quiet) {
+    if (!opts.quiet) {
       fprintf(stderr, "Hit ctrl-c to terminate...\n\n");
     }
-    while (1) {
-      if (!quiet) { fprintf(stderr, "."); fflush(stdout); }
+    while (!quit && !session->done()) {
+      if (!opts.quiet) { fprintf(stderr, "."); fflush(stdout); }
       std::this_thread::sleep_for(std::chrono::milliseconds(200));
     }
   }
-  if (!quiet) { fprintf(stderr, "\n\n"); }
+  if (!opts.quiet) { fprintf(stderr, "\n\n"); }
 
-  // stop
+  // the run's numbers while the stages still have them
+  bool passed = true;
+  if (!results.empty()) {
+    passed = Regress::write(*session->pipeline(), results) &&
+      (baseline.empty() || Regress::compare(results, baseline, tolerance));
+  }
+
+  // stop and destroy, the drain and the stages' own timeouts bound it
+  // but a stage that hangs anyway doesn't keep a restart waiting
+  struct sigaction sig_alrm;
+  sig_alrm.sa_handler = stuckHandler;
+  sigemptyset(&sig_alrm.sa_mask);
+  sig_alrm.sa_flags = 0;
+  sigaction(SIGALRM, &sig_alrm, NULL);
+  alarm(opts.drain / 1000 + stop_grace);
   dbgMsg("stop\n");
-  cap->stop();
-  tfl->stop();
-  if (tracking) { trk->stop(); }
-  enc->stop();
-  if (streaming) { rtsp->stop(); }
-
-  // destroy
-  cap.reset(nullptr);
-  tfl.reset(nullptr);
-  trk.reset(nullptr);
-  enc.reset(nullptr);
-  rtsp.reset(nullptr);
+  session->stop();
+  Reserve::Stats rs = Reserve::stats();
+  session.reset(nullptr);
+  Pool::stop();
+  Reserve::stop();
+
+  // whatever is still queued goes out
+  Storage::stop();
+  alarm(0);
+  if (!opts.quiet && write_behind) {
+    Storage::Stats st = Storage::stats();
+    fprintf(stderr, "\nStorage Results...\n");
+    fprintf(stderr, "   bytes written: %llu\n", static_cast<unsigned long long>(st.bytes));
+    fprintf(stderr, "  writes/batches: %u/%u\n", st.writes, st.batches);
+    fprintf(stderr, "     waits/drops: %u/%u\n", st.waits, st.drops);
+    fprintf(stderr, "        failures: %u\n", st.fails);
+    fprintf(stderr, "    slowest (us): %u\n", st.high);
+    fprintf(stderr, "\n");
+  }
+  if (!opts.quiet && reserve_mb) {
+    fprintf(stderr, "\nReserve Results...\n");
+    fprintf(stderr, "          mapped: %zu kb%s%s\n", rs.len >> 10,
+        rs.huge ? ", huge pages" : "", rs.locked ? ", locked" : "");
+    fprintf(stderr, "            used: %zu kb\n", rs.used >> 10);
+    fprintf(stderr, "     held/blocks: %zu kb/%u\n", rs.held >> 10, rs.blocks);
+    fprintf(stderr, "    spilled/heap: %zu kb/%u\n", rs.spilled >> 10, rs.spilled_blocks);
+    fprintf(stderr, "\n");
+  }
+  if (!opts.quiet) {
+    Startup::report();
+  }
 
   // done
   dbgMsg("done\n");
-  return 0;
+  return passed ? 0 : 1;
 }
 
 } // namespace detector
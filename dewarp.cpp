@@ -0,0 +1,202 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <cmath>
+#include <sstream>
+#include <algorithm>
+
+#include "dewarp.h"
+
+namespace detector {
+
+static const float kDegree = static_cast<float>(M_PI) / 180.f;
+
+Dewarp::Dewarp() {
+}
+
+Dewarp::~Dewarp() {
+}
+
+std::unique_ptr<Dewarp> Dewarp::create(const std::string& spec,
+    unsigned int width, unsigned int height, unsigned int pix_fmt) {
+  auto obj = std::unique_ptr<Dewarp>(new Dewarp());
+  if (!obj->init(spec, width, height, pix_fmt)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Dewarp::init(const std::string& spec, unsigned int width, unsigned int height,
+    unsigned int pix_fmt) {
+
+  width_ = width;
+  height_ = height;
+  pix_fmt_ = pix_fmt;
+  view_width_ = 0;
+  view_height_ = 0;
+
+  if (pix_fmt_ != V4L2_PIX_FMT_YUV420 && pix_fmt_ != V4L2_PIX_FMT_RGB24) {
+    dbgMsg("failed: dewarp needs i420 or rgb24\n");
+    return false;
+  }
+
+  // the table's 12.4 positions reach 4095 pixels
+  if (width_ < 16 || height_ < 16 || width_ >= 4096 || height_ >= 4096) {
+    dbgMsg("failed: dewarp of %ux%u\n", width_, height_);
+    return false;
+  }
+
+  // lens[,radius]:pan,tilt,fov[:...]
+  std::istringstream iss(spec);
+  std::string tok;
+  if (!std::getline(iss, tok, ':')) {
+    return false;
+  }
+  float lens = 0.f, radius = 1.f;
+  if (sscanf(tok.c_str(), "%f,%f", &lens, &radius) < 1 || lens < 90.f || lens > 360.f ||
+      radius <= 0.f || radius > 2.f) {
+    dbgMsg("failed: dewarp lens %s\n", tok.c_str());
+    return false;
+  }
+  lens_ = lens * kDegree;
+  radius_ = radius * std::min(width_, height_) / 2.f;
+  while (std::getline(iss, tok, ':')) {
+    float pan = 0.f, tilt = 0.f, fov = 0.f;
+    if (sscanf(tok.c_str(), "%f,%f,%f", &pan, &tilt, &fov) != 3 ||
+        fov < 10.f || fov > 150.f || tilt < 0.f || tilt > lens / 2.f) {
+      dbgMsg("failed: dewarp view %s\n", tok.c_str());
+      return false;
+    }
+    Dewarp::View v;
+    v.pan = pan * kDegree;
+    v.tilt = tilt * kDegree;
+    v.fov = fov * kDegree;
+    views_.push_back(v);
+  }
+  if (views_.empty() || views_.size() > views_max_) {
+    dbgMsg("failed: dewarp wants 1 to %u views\n", views_max_);
+    return false;
+  }
+  return true;
+}
+
+void Dewarp::build(unsigned int width, unsigned int height) {
+
+  if (width == view_width_ && height == view_height_) {
+    return;
+  }
+  view_width_ = width;
+  view_height_ = height;
+
+  // the view's ray for a pixel, tilted then panned into the lens's frame,
+  // and the lens's angle off its axis is the distance from the centre
+  float per_radian = radius_ / (lens_ / 2.f);
+  float cx = width_ / 2.f;
+  float cy = height_ / 2.f;
+  float max_x = width_ - 3.f;
+  float max_y = height_ - 3.f;
+  for (auto& v : views_) {
+    float focal = (width / 2.f) / std::tan(v.fov / 2.f);
+    float ct = std::cos(v.tilt), st = std::sin(v.tilt);
+    float cp = std::cos(v.pan), sp = std::sin(v.pan);
+    v.lut.resize(width * height);
+    RemapXY* out = v.lut.data();
+    for (unsigned int j = 0; j < height; j++) {
+      for (unsigned int i = 0; i < width; i++, out++) {
+        float x = i + 0.5f - width / 2.f;
+        float y = j + 0.5f - height / 2.f;
+        float z = focal;
+        float ty = y * ct - z * st;
+        float tz = y * st + z * ct;
+        float px = x * cp - ty * sp;
+        float py = x * sp + ty * cp;
+        float theta = std::atan2(std::sqrt(px * px + py * py), tz);
+        float r = theta * per_radian;
+        if (theta > lens_ / 2.f || r > radius_) {
+          out->x = out->y = remap_none;
+          continue;
+        }
+        float phi = std::atan2(py, px);
+        float sx = std::min(std::max(cx + r * std::cos(phi) - 0.5f, 0.f), max_x);
+        float sy = std::min(std::max(cy + r * std::sin(phi) - 0.5f, 0.f), max_y);
+        out->x = static_cast<uint16_t>(sx * 16.f + 0.5f);
+        out->y = static_cast<uint16_t>(sy * 16.f + 0.5f);
+      }
+    }
+  }
+}
+
+void Dewarp::apply(unsigned int v, const unsigned char* frame, unsigned int stride,
+    unsigned int slice, unsigned char* rgb) {
+  if (v >= views_.size() || views_[v].lut.empty()) {
+    return;
+  }
+  remap_to_rgb24(frame, stride, slice, pix_fmt_, views_[v].lut.data(), rgb,
+      view_width_, view_height_);
+}
+
+bool Dewarp::bound(unsigned int v, float left, float top, float right, float bottom,
+    Rect& out) {
+
+  if (v >= views_.size() || views_[v].lut.empty()) {
+    return false;
+  }
+
+  // a straight edge in the view is a curve in the frame, its samples'
+  // bounds are the box
+  const RemapXY* lut = views_[v].lut.data();
+  float x0 = width_, y0 = height_, x1 = 0.f, y1 = 0.f;
+  auto look = [&](float fx, float fy) {
+    unsigned int i = std::min(static_cast<unsigned int>(fx * view_width_), view_width_ - 1);
+    unsigned int j = std::min(static_cast<unsigned int>(fy * view_height_), view_height_ - 1);
+    const RemapXY& xy = lut[j * view_width_ + i];
+    if (xy.x == remap_none) {
+      return;
+    }
+    x0 = std::min(x0, xy.x / 16.f);
+    y0 = std::min(y0, xy.y / 16.f);
+    x1 = std::max(x1, xy.x / 16.f);
+    y1 = std::max(y1, xy.y / 16.f);
+  };
+  for (unsigned int s = 0; s <= edge_steps_; s++) {
+    float f = static_cast<float>(s) / edge_steps_;
+    look(left + (right - left) * f, top);
+    look(left + (right - left) * f, bottom);
+    look(left, top + (bottom - top) * f);
+    look(right, top + (bottom - top) * f);
+  }
+  if (x1 <= x0 || y1 <= y0) {
+    return false;
+  }
+  out.x = static_cast<unsigned int>(x0);
+  out.y = static_cast<unsigned int>(y0);
+  out.w = std::min(static_cast<unsigned int>(std::ceil(x1)) + 1, width_) - out.x;
+  out.h = std::min(static_cast<unsigned int>(std::ceil(y1)) + 1, height_) - out.y;
+  return true;
+}
+
+size_t Dewarp::footprint() {
+  size_t bytes = 0;
+  for (auto& v : views_) {
+    bytes += v.lut.size() * sizeof(RemapXY);
+  }
+  return bytes;
+}
+
+} // namespace detector
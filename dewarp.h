@@ -0,0 +1,103 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Fisheye views.
+ *
+ *  With --dewarp lens[,radius]:pan,tilt,fov[:...] tflow looks at a
+ *  fisheye frame through virtual cameras as well as at the frame itself.
+ *  The lens is taken as equidistant, 'lens' degrees across an image
+ *  circle centred in the frame, 'radius' of half its short side (default
+ *  1).  Each view is a pinhole camera 'fov' degrees across, turned 'pan'
+ *  degrees clockwise from the top of the circle and tilted 'tilt' degrees
+ *  out from the lens's axis, so on a camera looking down from a ceiling
+ *  three views at 0, 120 and 240 with a tilt of 60 look round the room
+ *  upright.
+ *
+ *  Only the model's input is ever made: a table per view says where in
+ *  the frame each of its pixels comes from, in 16ths of a pixel, and is
+ *  made again only when the model's input size changes.  The views are
+ *  gathered straight from the frame (see remap_to_rgb24), so a view
+ *  costs about what scaling the frame to the model does, whatever the
+ *  camera's resolution.  A view's boxes go back to the frame as the
+ *  bounds of their edges seen through the table, and are merged with the
+ *  frame's own like tiles' are.
+ */
+
+#ifndef DEWARP_H
+#define DEWARP_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+namespace detector {
+
+class Dewarp {
+  public:
+    static std::unique_ptr<Dewarp> create(const std::string& spec,
+        unsigned int width, unsigned int height, unsigned int pix_fmt);
+    ~Dewarp();
+
+  public:
+    inline unsigned int views() { return views_.size(); }
+
+    // the tables for views of width x height, kept if they already are
+    void build(unsigned int width, unsigned int height);
+
+    // view 'v' of a frame as rgb24 of the size built for
+    void apply(unsigned int v, const unsigned char* frame, unsigned int stride,
+        unsigned int slice, unsigned char* rgb);
+
+    // a box in view 'v', in 0..1 of the view, to frame pixels, false if
+    // none of it is in the lens's circle
+    bool bound(unsigned int v, float left, float top, float right, float bottom,
+        Rect& out);
+
+    // bytes of tables
+    size_t footprint();
+
+  protected:
+    Dewarp();
+    bool init(const std::string& spec, unsigned int width, unsigned int height,
+        unsigned int pix_fmt);
+
+  private:
+    unsigned int width_;
+    unsigned int height_;
+    unsigned int pix_fmt_;
+    float lens_;            // radians across the circle
+    float radius_;          // of the circle, pixels
+
+    class View {
+      public:
+        float pan, tilt, fov;     // radians
+        std::vector<RemapXY> lut;
+    };
+    std::vector<Dewarp::View> views_;
+    unsigned int view_width_;
+    unsigned int view_height_;
+    const unsigned int views_max_ = {8};
+    const unsigned int edge_steps_ = {8};   // samples along a box's side
+};
+
+} // namespace detector
+
+#endif // DEWARP_H
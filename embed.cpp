@@ -0,0 +1,204 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "embed.h"
+#include "pyramid.h"
+
+namespace detector {
+
+Embed::Embed() {
+}
+
+Embed::~Embed() {
+}
+
+std::unique_ptr<Embed> Embed::create(unsigned int width, unsigned int height,
+    unsigned int pix_fmt, unsigned int stride, const std::string& model,
+    unsigned int threads) {
+  auto obj = std::unique_ptr<Embed>(new Embed());
+  if (!obj->init(width, height, pix_fmt, stride, model, threads)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Embed::init(unsigned int width, unsigned int height,
+    unsigned int pix_fmt, unsigned int stride, const std::string& model,
+    unsigned int threads) {
+
+  width_ = width;
+  height_ = height;
+  pix_fmt_ = pix_fmt;
+  stride_ = stride;
+  crop_cnt = 0;
+
+  scaler_ = pick_rgb24_scaler(pix_fmt_);
+  if (!scaler_) {
+    dbgMsg("unsupported frame format %s\n", PixelFormatToStr(pix_fmt_));
+    return false;
+  }
+
+  model_ = tflite::FlatBufferModel::BuildFromFile(model.c_str());
+  if (!model_) {
+    dbgMsg("failed: embed model %s\n", model.c_str());
+    return false;
+  }
+  tflite::ops::builtin::BuiltinOpResolver resolver;
+  tflite::InterpreterBuilder(*model_, resolver)(&interpreter_);
+  if (!interpreter_) {
+    dbgMsg("failed: embed interpreter\n");
+    return false;
+  }
+  interpreter_->SetNumThreads(std::max(threads, 1u));
+  if (interpreter_->AllocateTensors() != kTfLiteOk) {
+    dbgMsg("failed: embed tensors\n");
+    return false;
+  }
+
+  TfLiteTensor* in = interpreter_->tensor(interpreter_->inputs()[0]);
+  TfLiteTensor* out = interpreter_->tensor(interpreter_->outputs()[0]);
+  if (in->dims->size != 4 || in->dims->data[3] != 3 ||
+      (in->type != kTfLiteUInt8 && in->type != kTfLiteFloat32) ||
+      (out->type != kTfLiteUInt8 && out->type != kTfLiteFloat32)) {
+    dbgMsg("failed: embed model wants a 3 channel uint8 or float input and output\n");
+    return false;
+  }
+  batch_ = in->dims->data[0];
+  batched_ = true;
+  in_height_ = in->dims->data[1];
+  in_width_ = in->dims->data[2];
+  dims_ = out->bytes / ((out->type == kTfLiteUInt8) ? 1 : sizeof(float)) /
+    std::max(batch_, 1u);
+  if (dims_ == 0) {
+    dbgMsg("failed: embed model has an empty output\n");
+    return false;
+  }
+  rgb_.resize(batch_max_ * in_width_ * in_height_ * 3);
+  return true;
+}
+
+bool Embed::resize(unsigned int batch) {
+  if (batch == batch_) {
+    return true;
+  }
+  if (!batched_) {
+    return false;
+  }
+  int input = interpreter_->inputs()[0];
+  if (interpreter_->ResizeInputTensor(input,
+        { static_cast<int>(batch), static_cast<int>(in_height_),
+          static_cast<int>(in_width_), 3 }) != kTfLiteOk ||
+      interpreter_->AllocateTensors() != kTfLiteOk) {
+    dbgMsg("embed model can't batch, one crop an invoke\n");
+    batched_ = false;
+    interpreter_->ResizeInputTensor(input,
+        { static_cast<int>(batch_), static_cast<int>(in_height_),
+          static_cast<int>(in_width_), 3 });
+    interpreter_->AllocateTensors();
+    return false;
+  }
+  batch_ = batch;
+  return true;
+}
+
+void Embed::crop(const FrameBuf& frame, const BoxBuf& box, unsigned char* dst) {
+
+  Rect src = { box.x & ~1u, box.y & ~1u, 0, 0 };
+  src.w = std::max(std::min(box.w, width_ - src.x) & ~1u, 2u);
+  src.h = std::max(std::min(box.h, height_ - src.y) & ~1u, 2u);
+  Rect out = { 0, 0, in_width_, in_height_ };
+
+  unsigned int k = frame.levels ? frame.levels->find(src, in_width_, in_height_) : 0;
+  const Level* lvl = (k > 0) ? frame.levels->get(k) : nullptr;
+  if (lvl) {
+    Rect s = { (src.x >> k) & ~1u, (src.y >> k) & ~1u,
+      (src.w >> k) & ~1u, (src.h >> k) & ~1u };
+    s.w = std::max(std::min(s.w, lvl->width - s.x), 2u);
+    s.h = std::max(std::min(s.h, lvl->height - s.y), 2u);
+    scaler_(lvl->addr, lvl->stride, lvl->slice, s, dst, in_width_, in_height_, out, 0);
+  } else {
+    scaler_(frame.addr, stride_, ALIGN_16B(height_), src, dst, in_width_, in_height_, out, 0);
+  }
+}
+
+void Embed::invoke(unsigned int num, BoxBuf* boxes) {
+
+  size_t len = in_width_ * in_height_ * 3;
+  TfLiteTensor* in = interpreter_->tensor(interpreter_->inputs()[0]);
+  if (in->type == kTfLiteUInt8) {
+    std::memcpy(in->data.uint8, rgb_.data(), num * len);
+  } else {
+    float scale = (in->params.scale > 0.f) ? in->params.scale : 1.f / 127.5f;
+    float zero = (in->params.scale > 0.f) ? in->params.zero_point : 127.5f;
+    quantise_rgb24(rgb_.data(), in->data.f, num * len, scale, zero);
+  }
+  if (interpreter_->Invoke() != kTfLiteOk) {
+    dbgMsg("failed: embed invoke\n");
+    return;
+  }
+
+  // one row a crop, made unit length
+  TfLiteTensor* out = interpreter_->tensor(interpreter_->outputs()[0]);
+  for (unsigned int b = 0; b < num; b++) {
+    auto emb = std::make_shared<std::vector<float>>(dims_);
+    float* e = emb->data();
+    for (unsigned int i = 0; i < dims_; i++) {
+      unsigned int at = b * dims_ + i;
+      e[i] = (out->type == kTfLiteUInt8) ?
+        (out->data.uint8[at] - out->params.zero_point) * out->params.scale : out->data.f[at];
+    }
+    float norm = std::sqrt(dot_f32(e, e, dims_));
+    if (norm <= 0.f) {
+      continue;
+    }
+    for (unsigned int i = 0; i < dims_; i++) {
+      e[i] /= norm;
+    }
+    boxes[b].emb = emb;
+  }
+}
+
+void Embed::run(const FrameBuf& frame, std::vector<BoxBuf>& boxes) {
+
+  unsigned int num = std::min(static_cast<unsigned int>(boxes.size()), batch_max_);
+  if (frame.addr == nullptr || num == 0) {
+    return;
+  }
+
+  differ_eval.begin();
+  size_t len = in_width_ * in_height_ * 3;
+  for (unsigned int i = 0; i < num; i++) {
+    crop(frame, boxes[i], rgb_.data() + i * len);
+  }
+  if (resize(num)) {
+    invoke(num, boxes.data());
+  } else {
+    for (unsigned int i = 0; i < num; i++) {
+      std::memmove(rgb_.data(), rgb_.data() + i * len, len);
+      invoke(1, boxes.data() + i);
+    }
+  }
+  crop_cnt += num;
+  differ_eval.end();
+}
+
+} // namespace detector
@@ -0,0 +1,93 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Appearance embeddings for re-identification.
+ *
+ *  A small embedding model run on the crops of a frame's boxes, the
+ *  tracker's boxes, after post.  Crops are cut the same way as the
+ *  classifier's (see classify.h) and the model's output row for each
+ *  crop is scaled to unit length and hung on the box as 'emb', so the
+ *  tracker's cosine distance is one minus a dot product.  Tflow only
+ *  runs it when the tracker says the next frame's embeddings would be
+ *  used (see Tracker::wantsEmbeddings).
+ */
+
+#ifndef EMBED_H
+#define EMBED_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+#include "listener.h"
+
+#include <tensorflow/lite/interpreter.h>
+#include <tensorflow/lite/kernels/register.h>
+#include <tensorflow/lite/model.h>
+
+namespace detector {
+
+class Embed {
+  public:
+    static std::unique_ptr<Embed> create(unsigned int width, unsigned int height,
+        unsigned int pix_fmt, unsigned int stride, const std::string& model,
+        unsigned int threads);
+    ~Embed();
+
+  public:
+    // the first 'batch_max_' boxes of 'frame' get their emb
+    void run(const FrameBuf& frame, std::vector<BoxBuf>& boxes);
+
+    unsigned int dims() { return dims_; }
+
+    MicroDiffer<uint32_t> differ_eval;
+    unsigned int crop_cnt;
+
+  protected:
+    Embed();
+    bool init(unsigned int width, unsigned int height,
+        unsigned int pix_fmt, unsigned int stride, const std::string& model,
+        unsigned int threads);
+
+  private:
+    unsigned int width_;
+    unsigned int height_;
+    unsigned int pix_fmt_;
+    unsigned int stride_;
+
+    std::unique_ptr<tflite::FlatBufferModel> model_;
+    std::unique_ptr<tflite::Interpreter> interpreter_;
+    Rgb24Scaler scaler_;
+    unsigned int in_width_;
+    unsigned int in_height_;
+    unsigned int dims_;
+    std::vector<unsigned char> rgb_;
+
+    const unsigned int batch_max_ = {8};
+    unsigned int batch_;        // what the input is sized for
+    bool batched_;              // false once a resize failed
+    bool resize(unsigned int batch);
+    void crop(const FrameBuf& frame, const BoxBuf& box, unsigned char* dst);
+    void invoke(unsigned int num, BoxBuf* boxes);
+};
+
+} // namespace detector
+
+#endif // EMBED_H
@@ -0,0 +1,495 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './encbench -h' for usage.
+ *
+ * ----------
+ *
+ *  Encoder benchmark ('make encbench').
+ *
+ *  Drives an 'Encoder' on its own, no capture and nothing downstream
+ *  but a tap counting what comes out, and sweeps the pixel format, the
+ *  frame size, the bitrate, the frames in flight in the codec and the
+ *  overlay.  Frames come from a small ring of our own, lent to the
+ *  encoder the way capture lends its buffers and taken back when it lets
+ *  go, so with '-z' they are encoded in place and otherwise copied.
+ *
+ *  Each run prints the frames a second it kept up, the capture to
+ *  encoded latency percentiles (the encoder's own, from the moment a
+ *  frame is handed over), Mbit/s and the cpu the process used less
+ *  what feeding it cost, in percent of one core.  With '-f 0' frames go
+ *  in as fast as the encoder takes them, the throughput; at a rate it
+ *  is the latency at that load.
+ *
+ *  Synthetic frames are a moving textured pattern rendered once into
+ *  the ring.  '-R' reads raw frames instead, back to back at the aligned
+ *  frame size in i420 as replay takes them, at the first '-s' size only,
+ *  and rgb24 runs convert them as they go in.
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <linux/dma-heap.h>
+
+#include "utils.h"
+#include "encoder.h"
+
+namespace detector {
+
+class Size {
+  public:
+    unsigned int width;
+    unsigned int height;
+};
+
+class Options {
+  public:
+    std::vector<unsigned int> formats{V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_RGB24};
+    std::vector<Size> sizes{{640, 480}, {1280, 720}, {1920, 1080}};
+    std::vector<unsigned int> bitrates{4000000};
+    std::vector<unsigned int> buffers{2, 3, 4, 6};
+    std::vector<unsigned int> boxes{0, 8};
+    unsigned int frames = 300;
+    unsigned int fps = 0;       // 0 as fast as it goes
+    bool m2m = false;
+    bool direct = false;
+    std::string clip;
+};
+
+class Result {
+  public:
+    unsigned int sent = 0;
+    unsigned int refused = 0;
+    unsigned int out = 0;
+    uint64_t bytes = 0;
+    double sec = 0.0;
+    double cpu = 0.0;           // percent of one core
+    Histogram::Percentiles late;
+};
+
+// counts the frames out, a new stamp is a new frame
+class Tap : public Listener<NalBuf> {
+  public:
+    virtual bool addMessage(NalBuf& nal) {
+      std::unique_lock<std::mutex> lck(lock);
+      if (nal.stamp != last) {
+        last = nal.stamp;
+        frames++;
+      }
+      bytes += nal.length;
+      end = std::chrono::steady_clock::now();
+      return true;
+    }
+  public:
+    std::mutex lock;
+    std::chrono::steady_clock::time_point last;
+    std::chrono::steady_clock::time_point end;
+    unsigned int frames = 0;
+    uint64_t bytes = 0;
+};
+
+// our frames, each back on the free list once the encoder lets go of it
+class Ring {
+  public:
+    ~Ring() {
+      for (auto& fb : bufs) {
+        if (fb.fd >= 0) {
+          munmap(fb.addr, fb.length);
+          close(fb.fd);
+        } else {
+          free(fb.addr);
+        }
+      }
+    }
+
+    // from the dma heap when 'dmabuf', so m2m can import them
+    bool allocate(unsigned int num, unsigned int len, bool dmabuf) {
+      len = (len + 4095) & ~4095;
+      int heap = dmabuf ? open("/dev/dma_heap/linux,cma", O_RDWR | O_CLOEXEC) : -1;
+      for (unsigned int i = 0; i < num; i++) {
+        FrameBuf fb;
+        fb.id = i;
+        fb.length = len;
+        struct dma_heap_allocation_data alloc;
+        memset(&alloc, 0, sizeof(alloc));
+        alloc.len = len;
+        alloc.fd_flags = O_RDWR | O_CLOEXEC;
+        if (heap >= 0 && ioctl(heap, DMA_HEAP_IOCTL_ALLOC, &alloc) == 0) {
+          void* addr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, alloc.fd, 0);
+          if (addr == MAP_FAILED) {
+            close(alloc.fd);
+            break;
+          }
+          fb.fd = alloc.fd;
+          fb.addr = static_cast<unsigned char*>(addr);
+        } else {
+          void* addr = nullptr;
+          if (posix_memalign(&addr, 4096, len) != 0) {
+            break;
+          }
+          fb.addr = static_cast<unsigned char*>(addr);
+        }
+        bufs.push_back(fb);
+        free_.push_back(i);
+      }
+      if (heap >= 0) {
+        close(heap);
+      }
+      return bufs.size() == num;
+    }
+
+    // the next free frame, lent with a reference that brings it back
+    bool lend(FrameBuf& fb, unsigned int msec) {
+      std::unique_lock<std::mutex> lck(lock_);
+      if (!cond_.wait_for(lck, std::chrono::milliseconds(msec),
+            [this]() { return !free_.empty(); })) {
+        return false;
+      }
+      unsigned int i = free_.front();
+      free_.erase(free_.begin());
+      fb = bufs[i];
+      fb.ref = std::shared_ptr<void>(fb.addr, [this, i](void*) {
+          std::unique_lock<std::mutex> lck(lock_);
+          free_.push_back(i);
+          cond_.notify_one();
+        });
+      return true;
+    }
+
+    // every frame back
+    bool settle(unsigned int msec) {
+      std::unique_lock<std::mutex> lck(lock_);
+      return cond_.wait_for(lck, std::chrono::milliseconds(msec),
+          [this]() { return free_.size() == bufs.size(); });
+    }
+
+  public:
+    std::vector<FrameBuf> bufs;
+
+  private:
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::vector<unsigned int> free_;
+};
+
+// the process's or this thread's, user and system
+static double cpuSec(int who) {
+  struct rusage ru;
+  getrusage(who, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// diagonal bands moving 'k' steps, with a little fixed texture on top
+static void render(unsigned char* dst, unsigned int pix_fmt, unsigned int width,
+    unsigned int height, unsigned int k) {
+
+  static std::vector<unsigned char> noise;
+  if (noise.empty()) {
+    std::mt19937 rng(1);
+    noise.resize(4096);
+    for (auto& n : noise) {
+      n = rng() & 0x0f;
+    }
+  }
+  unsigned int stride = ALIGN_16B(width);
+  unsigned int slice = ALIGN_16B(height);
+  if (pix_fmt == V4L2_PIX_FMT_YUV420) {
+    unsigned char* u = dst + stride * slice;
+    unsigned char* v = u + (stride / 2) * (slice / 2);
+    for (unsigned int y = 0; y < height; y++) {
+      for (unsigned int x = 0; x < width; x++) {
+        dst[y * stride + x] = 16 + ((x + y + k * 8) % 200) + noise[(x * 7 + y * 13) & 4095];
+      }
+    }
+    for (unsigned int y = 0; y < height / 2; y++) {
+      for (unsigned int x = 0; x < width / 2; x++) {
+        u[y * (stride / 2) + x] = 64 + ((x + k * 2) & 127);
+        v[y * (stride / 2) + x] = 64 + ((y + k * 2) & 127);
+      }
+    }
+  } else {
+    for (unsigned int y = 0; y < height; y++) {
+      unsigned char* row = dst + y * stride * 3;
+      for (unsigned int x = 0; x < width; x++) {
+        unsigned char n = noise[(x * 7 + y * 13) & 4095];
+        row[x * 3 + 0] = ((x + y + k * 8) % 240) + n;
+        row[x * 3 + 1] = ((x + k * 4) & 0xff) / 2 + n;
+        row[x * 3 + 2] = ((y + k * 4) & 0xff) / 2 + n;
+      }
+    }
+  }
+}
+
+// people walking across, for the overlay to draw
+static std::shared_ptr<std::vector<BoxBuf>> boxes(unsigned int num, unsigned int width,
+    unsigned int height, unsigned int k, std::chrono::steady_clock::time_point stamp) {
+  auto vec = std::make_shared<std::vector<BoxBuf>>();
+  for (unsigned int i = 0; i < num; i++) {
+    unsigned int w = width / 12, h = height / 4;
+    unsigned int x = (i * width / std::max(num, 1u) + k * 4) % (width - w);
+    unsigned int y = (i * 37 + k * 2) % (height - h);
+    vec->push_back(BoxBuf(BoxBuf::Type::kPerson, i + 1, x, y, w, h, stamp, 0.9f));
+  }
+  return vec;
+}
+
+static Result run(const Options& opts, unsigned int pix_fmt, const Size& size,
+    unsigned int bitrate, unsigned int bufs, unsigned int num_boxes,
+    const unsigned char* clip, size_t clip_len) {
+
+  Result res;
+  unsigned int stride = ALIGN_16B(size.width);
+  unsigned int slice = ALIGN_16B(size.height);
+  unsigned int len = (pix_fmt == V4L2_PIX_FMT_YUV420) ?
+    stride * slice * 3 / 2 : stride * slice * 3;
+  unsigned int clip_frame = stride * slice * 3 / 2;
+
+  // the encoder's queue, what the codec has in flight and a few to fill
+  Ring ring;
+  if (!ring.allocate(std::max(8u, bufs + 6), len, opts.direct && opts.m2m)) {
+    fprintf(stderr, "can't allocate %u frames\n", bufs + 6);
+    return res;
+  }
+  if (!clip) {
+    for (auto& fb : ring.bufs) {
+      render(fb.addr, pix_fmt, size.width, size.height, fb.id);
+    }
+  }
+
+  std::string output;
+  Tap tap;
+  auto enc = Encoder::create(5000, true, false, nullptr, nullptr, opts.fps ? opts.fps : 30,
+      size.width, size.height, bitrate, output, 0, pix_fmt, false, false, opts.m2m);
+  enc->setBuffers(bufs);
+  enc->setTap(&tap);
+  enc->setDraw(num_boxes != 0);
+  if (!enc->start("encoder", 50) || !enc->run()) {
+    fprintf(stderr, "encoder didn't start\n");
+    return res;
+  }
+  if (opts.direct) {
+    enc->useBuffers(ring.bufs);
+  }
+
+  using namespace std::chrono;
+  auto period = opts.fps ? duration_cast<steady_clock::duration>(
+      duration<double>(1.0 / opts.fps)) : steady_clock::duration(0);
+  auto start = steady_clock::now();
+  double cpu0 = cpuSec(RUSAGE_SELF);
+  double feed0 = cpuSec(RUSAGE_THREAD);
+  for (unsigned int k = 0; k < opts.frames; k++) {
+    if (period.count()) {
+      std::this_thread::sleep_until(start + period * k);
+    }
+    FrameBuf fb;
+    if (!ring.lend(fb, 2000)) {
+      fprintf(stderr, "encoder stopped taking frames\n");
+      break;
+    }
+    if (clip) {
+      const unsigned char* src = clip + (k % (clip_len / clip_frame)) * clip_frame;
+      if (pix_fmt == V4L2_PIX_FMT_YUV420) {
+        std::memcpy(fb.addr, src, clip_frame);
+      } else {
+        convert_to_rgb24(V4L2_PIX_FMT_YUV420, src, stride, slice, fb.addr, stride * 3,
+            size.width, size.height, false);
+      }
+    }
+
+    // as fast as it goes, a frame waits for room rather than being refused
+    while (!period.count() && enc->credits(fb) == 0 && !enc->failed()) {
+      std::this_thread::sleep_for(microseconds(200));
+    }
+    fb.stamp = steady_clock::now();
+    if (num_boxes) {
+      auto vec = boxes(num_boxes, size.width, size.height, k, fb.stamp);
+      enc->addMessage(vec, fb.stamp);
+    }
+    if (enc->addMessage(fb)) {
+      res.sent++;
+    } else {
+      res.refused++;
+    }
+  }
+  double feed = cpuSec(RUSAGE_THREAD) - feed0;
+
+  // what is still in the codec
+  for (unsigned int i = 0; i < 200 && enc->pending() != 0; i++) {
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+  double cpu = cpuSec(RUSAGE_SELF) - cpu0 - feed;
+  {
+    std::unique_lock<std::mutex> lck(tap.lock);
+    res.out = tap.frames;
+    res.bytes = tap.bytes;
+    res.sec = duration<double>(((tap.frames != 0) ? tap.end : steady_clock::now()) - start).count();
+  }
+  res.cpu = res.sec > 0.0 ? cpu * 100.0 / res.sec : 0.0;
+  res.late = enc->latency();
+  enc->stop();
+  ring.settle(2000);
+  return res;
+}
+
+static const char* formatStr(unsigned int pix_fmt) {
+  return (pix_fmt == V4L2_PIX_FMT_YUV420) ? "i420" : "rgb24";
+}
+
+static void print(unsigned int pix_fmt, const Size& size, unsigned int bitrate,
+    unsigned int bufs, unsigned int num_boxes, const Result& res) {
+  char name[32];
+  snprintf(name, sizeof(name), "%ux%u", size.width, size.height);
+  fprintf(stderr, "%-6s %-10s %5.1f %4u %5u  %7.1f %5u  %6.1f %6.1f %6.1f  %7.2f %6.0f\n",
+      formatStr(pix_fmt), name, bitrate / 1e6, bufs, num_boxes,
+      res.sec > 0.0 ? res.out / res.sec : 0.0, res.refused,
+      res.late.p50 / 1000.0, res.late.p90 / 1000.0, res.late.p99 / 1000.0,
+      res.sec > 0.0 ? res.bytes * 8.0 / res.sec / 1e6 : 0.0, res.cpu);
+}
+
+template<typename T>
+static std::vector<T> list(const char* arg, T (*parse)(const std::string&)) {
+  std::vector<T> vals;
+  std::stringstream ss(arg);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    vals.push_back(parse(item));
+  }
+  return vals;
+}
+
+static unsigned int number(const std::string& str) {
+  return std::stoul(str);
+}
+
+static unsigned int format(const std::string& str) {
+  return (str == "rgb24" || str == "rgb") ? V4L2_PIX_FMT_RGB24 : V4L2_PIX_FMT_YUV420;
+}
+
+static Size size(const std::string& str) {
+  Size sz{0, 0};
+  sscanf(str.c_str(), "%ux%u", &sz.width, &sz.height);
+  return sz;
+}
+
+void usage() {
+  std::cout << "encbench -?cskbnofrmzR"            << std::endl;
+  std::cout                                        << std::endl;
+  std::cout << "  where:"                          << std::endl;
+  std::cout << "  ?            = this screen"      << std::endl;
+  std::cout << "  (c)olour     = 'i420' or 'rgb24', comma separated (default = i420,rgb24)" << std::endl;
+  std::cout << "  (s)izes      = width x height, comma separated (default = 640x480,1280x720,1920x1080)" << std::endl;
+  std::cout << "  (k)bitrate   = bits per second, comma separated (default = 4000000)" << std::endl;
+  std::cout << "  (b)uffers    = frames in flight in the codec, comma separated (default = 2,3,4,6)" << std::endl;
+  std::cout << "  (o)verlay    = boxes drawn on every frame, comma separated (default = 0,8)" << std::endl;
+  std::cout << "  (n)umber     = frames per run (default = 300)" << std::endl;
+  std::cout << "  (f)ps        = frames a second in, 0 as fast as it takes them (default = 0)" << std::endl;
+  std::cout << "  (m)2m        = the v4l2 mem2mem codec instead of omx (default = off)" << std::endl;
+  std::cout << "  (z)ero copy  = encode our frames in place (default = off)" << std::endl;
+  std::cout << "  (R)ecorded   = raw i420 frames at the first size (default = synthetic)" << std::endl;
+}
+
+} // namespace detector
+
+int main(int argc, char** argv) {
+
+  detector::Options opts;
+
+  int c;
+  while ((c = getopt(argc, argv, ":c:s:k:b:o:n:f:mzR:")) != -1) {
+    switch (c) {
+      case 'c': opts.formats = detector::list(optarg, detector::format);  break;
+      case 's': opts.sizes = detector::list(optarg, detector::size);      break;
+      case 'k': opts.bitrates = detector::list(optarg, detector::number); break;
+      case 'b': opts.buffers = detector::list(optarg, detector::number);  break;
+      case 'o': opts.boxes = detector::list(optarg, detector::number);    break;
+      case 'n': opts.frames = std::max(1ul, std::stoul(optarg)); break;
+      case 'f': opts.fps = std::stoul(optarg);       break;
+      case 'm': opts.m2m = true;                     break;
+      case 'z': opts.direct = true;                  break;
+      case 'R': opts.clip = optarg;                  break;
+      default:  detector::usage();                   return -1;
+    }
+  }
+  for (auto& sz : opts.sizes) {
+    if (sz.width < 64 || sz.height < 64) {
+      detector::usage();
+      return -1;
+    }
+  }
+
+  // mapped once, the frames are copied out as they go in
+  unsigned char* clip = nullptr;
+  size_t clip_len = 0;
+  if (!opts.clip.empty()) {
+    opts.sizes.resize(1);
+    auto& sz = opts.sizes[0];
+    size_t frame = ALIGN_16B(sz.width) * ALIGN_16B(sz.height) * 3 / 2;
+    int fd = open(opts.clip.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < frame) {
+      fprintf(stderr, "can't read %s as %ux%u i420\n", opts.clip.c_str(), sz.width, sz.height);
+      return -1;
+    }
+    clip_len = st.st_size;
+    clip = static_cast<unsigned char*>(mmap(nullptr, clip_len, PROT_READ, MAP_PRIVATE, fd, 0));
+    close(fd);
+    if (clip == MAP_FAILED) {
+      fprintf(stderr, "can't map %s\n", opts.clip.c_str());
+      return -1;
+    }
+  }
+
+  fprintf(stderr, "%s codec, %s, %s\n", opts.m2m ? "m2m" : "omx",
+      opts.direct ? "zero copy" : "copied", opts.fps ? "paced" : "as fast as it goes");
+  fprintf(stderr, "%-6s %-10s %5s %4s %5s  %13s  %20s  %7s %6s\n", "", "", "", "", "",
+      "frames", "latency (ms)", "", "");
+  fprintf(stderr, "%-6s %-10s %5s %4s %5s  %7s %5s  %6s %6s %6s  %7s %6s\n",
+      "format", "size", "mbps", "bufs", "boxes", "fps", "refus", "p50", "p90", "p99",
+      "mbit/s", "cpu %");
+  for (auto pix_fmt : opts.formats) {
+    for (auto& sz : opts.sizes) {
+      for (auto bitrate : opts.bitrates) {
+        for (auto bufs : opts.buffers) {
+          for (auto num : opts.boxes) {
+            auto res = detector::run(opts, pix_fmt, sz, bitrate, bufs, num, clip, clip_len);
+            detector::print(pix_fmt, sz, bitrate, bufs, num, res);
+          }
+        }
+      }
+    }
+  }
+  if (clip) {
+    munmap(clip, clip_len);
+  }
+  return 0;
+}
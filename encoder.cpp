@@ -17,22 +17,31 @@
  */
 
 #include <chrono>
+#include <cstdlib>
 #include <cstring>
 #include <algorithm>
 
 #include "encoder.h"
+#include "tracker.h"
+#ifdef HAVE_LIBOPENMAX
+#include "omx.h"
+#else
+#include "nullcodec.h"
+#endif
+#include "m2m.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "fate.h"
+#include "perf.h"
+#include "storage.h"
+#include "pyramid.h"
+#include "frames.h"
+#include "startup.h"
+#include "deadline.h"
 
 namespace detector {
 
-#define OMX_INIT_STRUCTURE(a) \
-  std::memset(&(a), 0, sizeof(a)); \
-  (a).nSize = sizeof(a); \
-  (a).nVersion.nVersion = OMX_VERSION; \
-  (a).nVersion.s.nVersionMajor = OMX_VERSION_MAJOR; \
-  (a).nVersion.s.nVersionMinor = OMX_VERSION_MINOR; \
-  (a).nVersion.s.nRevision = OMX_VERSION_REVISION; \
-  (a).nVersion.s.nStep = OMX_VERSION_STEP
-
 Encoder::Encoder(unsigned int yield_time)
   : Base(yield_time) {
 }
@@ -41,396 +50,861 @@ Encoder::~Encoder() {
 }
 
 std::unique_ptr<Encoder> Encoder::create(unsigned int yield_time, bool quiet, bool tracking, 
-    Rtsp* rtsp, unsigned int framerate, unsigned int width, unsigned int height, 
-    unsigned int bitrate, std::string& output, unsigned int testtime) {
+    LiveStream* rtsp, Recorder* rec, unsigned int framerate, unsigned int width, unsigned int height, 
+    unsigned int bitrate, std::string& output, unsigned int testtime,
+    unsigned int pix_fmt, bool latest, bool roi, bool m2m) {
   auto obj = std::unique_ptr<Encoder>(new Encoder(yield_time));
-  obj->init(quiet, tracking, rtsp, framerate, width, height, bitrate, output, testtime);
+  obj->init(quiet, tracking, rtsp, rec, framerate, width, height, bitrate, output, 
+      testtime, pix_fmt, latest, roi, m2m);
   return obj;
 }
 
-bool Encoder::init(bool quiet, bool tracking, Rtsp* rtsp, unsigned int framerate, 
+bool Encoder::init(bool quiet, bool tracking, LiveStream* rtsp, Recorder* rec, unsigned int framerate, 
     unsigned int width, unsigned int height, unsigned int bitrate, 
-    std::string& output, unsigned int testtime) {
+    std::string& output, unsigned int testtime, unsigned int pix_fmt,
+    bool latest, bool roi, bool m2m) {
 
   quiet_ = quiet;
   tracking_ = tracking;
+  predicted_ = std::make_shared<std::vector<TrackBuf>>();
+  meta_ = false;
+  draw_ = true;
+  meta_sent_ = false;
+  meta_cnt_ = 0;
+  sei_ = false;
+  sei_sent_ = false;
+  sei_cnt_ = 0;
+  vec_cnt_ = 0;
+  last_sei_.reset();
+  shown_.clear();
+  same_cnt_ = 0;
+  label_epoch_ = 0;
+  slices_ = 0;
+  codec_bufs_ = 0;
   rtsp_ = rtsp;
+  rec_ = rec;
+  hls_ = nullptr;
+  tap_ = nullptr;
+  rtc_ = nullptr;
+  pic_ = nullptr;
+  prv_ = nullptr;
+  crp_ = nullptr;
+  sub_ = nullptr;
+  src_width_ = 0;
+  src_height_ = 0;
   framerate_ = framerate;
   width_ = width;
   height_ = height;
-  frame_len_ = ALIGN_16B(width_) * ALIGN_16B(height_) * channels_;
+  pix_fmt_ = pix_fmt;
+  if (pix_fmt_ == V4L2_PIX_FMT_YUV420) {
+    frame_len_ = ALIGN_16B(width_) * ALIGN_16B(height_) * 3 / 2;
+  } else {
+    frame_len_ = ALIGN_16B(width_) * ALIGN_16B(height_) * channels_;
+  }
 
   bitrate_ = bitrate;
+  bitrate_req_ = 0;
+  key_req_ = false;
+  bitrate_cnt_ = 0;
+  credit_scale_ = 100;
+  throttle_cnt_ = 0;
+  throttle_stamp_ = {};
+  key_cnt_ = 0;
+  first_ms_ = -1;
   output_ = output;
   testtime_ = testtime;
 
-  fd_enc_ = nullptr;
+  fd_enc_ = -1;
+
+  m2m_ = m2m;
+  use_pending_ = false;
+  direct_cnt_ = 0;
+  latest_ = latest;
+  roi_ = roi;
+  roi_cols_ = (width_ + 15) / 16;
+  roi_rows_ = (height_ + 15) / 16;
+  roi_keep_.assign(roi_cols_ * roi_rows_, 0);
+  stale_cnt_ = 0;
+  late_cnt_ = 0;
+  coding_ = 0;
+  still_.reset();
+  still_threshold_ = 0;
+  still_mask_ = {};
+  still_gap_ = 0;
+  moved_ = false;
+  gop_active_ = 0;
+  gop_still_ = 0;
+  since_key_ = 0;
+  frame_key_ = false;
+  key_wait_ = false;
+  was_moving_ = false;
+  onset_cnt_ = 0;
+  busy_key_cnt_ = 0;
+  still_last_ = {};
+  still_cnt_ = 0;
+  byte_cnt_ = 0;
+  sync_max_ = 0;
+  sync_hold_ = 0;
+  held_max_ = 0;
+  sync_seen_ = {};
+  sync_lag_idx_ = 0;
+  sync_hit_cnt_ = 0;
+  sync_late_cnt_ = 0;
+  sync_full_cnt_ = 0;
+  sync_copy_cnt_ = 0;
 
   encode_on_ = false;
 
   return true; 
 }
 
-bool Encoder::addMessage(FrameBuf& fbuf) {
-
-  std::unique_lock<std::timed_mutex> lck(frame_lock_, std::defer_lock);
+bool Encoder::setSubEncoder(Encoder* sub) {
 
-  if (!lck.try_lock_for(std::chrono::microseconds(Listener<FrameBuf>::timeout_))) {
-    dbgMsg("encoder frame lock busy\n");
+  if (sub == nullptr || sub->width_ * 2 != width_ || sub->height_ * 2 != height_ ||
+      sub->pix_fmt_ != pix_fmt_) {
+    dbgMsg("substream must be half size\n");
     return false;
   }
+  sub->src_width_ = width_;
+  sub->src_height_ = height_;
+  sub_ = sub;
+  return true;
+}
 
-  if (frame_pool_.size() == 0) {
-    dbgMsg("no encoder buffers available\n");
-    return false;
+void Encoder::setSubOn(bool on) {
+  if (on && !sub_on_.exchange(true) && sub_) {
+    sub_->requestKeyFrame();
+  } else if (!on) {
+    sub_on_ = false;
   }
+}
 
-  if (frame_len_ != fbuf.length) {
-    dbgMsg("encoder buffer size mismatch\n");
-    return false;
+void Encoder::setSei(bool sei) {
+  sei_ = sei;
+}
+
+void Encoder::setMeta(bool meta, bool draw) {
+  meta_ = meta;
+  draw_ = draw;
+}
+
+void Encoder::setStill(unsigned int fps, unsigned int threshold, const Rect& mask) {
+  still_gap_ = fps ? 1000 / fps : 0;
+  still_threshold_ = threshold;
+  still_mask_ = mask;
+}
+
+void Encoder::setGop(unsigned int active, unsigned int still) {
+  gop_active_ = active;
+  gop_still_ = still;
+}
+
+void Encoder::setSync(unsigned int hold) {
+  sync_max_ = hold;
+  sync_hold_ = hold;
+  held_max_ = std::min(hold * framerate_ / 1000 + 2, held_cap_);
+  sync_lags_.assign(32, hold);
+}
+
+void Encoder::setPrivacy(const std::vector<BlendRect>& zones) {
+
+  // in this stream's pixels and colours
+  unsigned int from_w = src_width_ ? src_width_ : width_;
+  unsigned int from_h = src_height_ ? src_height_ : height_;
+  privacy_.clear();
+  for (auto zone : zones) {
+    zone.rect.x = zone.rect.x * width_ / from_w;
+    zone.rect.y = zone.rect.y * height_ / from_h;
+    zone.rect.w = (zone.rect.w * width_ + from_w - 1) / from_w;
+    zone.rect.h = (zone.rect.h * height_ + from_h - 1) / from_h;
+    if (pix_fmt_ == V4L2_PIX_FMT_YUV420) {
+      convert_rgb_to_yuv(zone.c[0], zone.c[1], zone.c[2], zone.c[0], zone.c[1], zone.c[2]);
+    }
+    privacy_.push_back(zone);
+  }
+  if (sub_) {
+    sub_->setPrivacy(zones);
   }
+}
 
-  differ_copy_.begin();
-  auto frame = frame_pool_.front();
-  frame_pool_.pop();
-  frame->id = fbuf.id;
-  frame->length = fbuf.length;
-  std::memcpy(frame->buf.data(), fbuf.addr, fbuf.length);
-  frame_work_.push(frame);
-  differ_copy_.end();
+void Encoder::setHls(Hls* hls) {
+  hls_ = hls;
+}
 
-  return true;
+void Encoder::setWebrtc(Webrtc* rtc) {
+  rtc_ = rtc;
 }
 
-bool Encoder::addMessage(std::shared_ptr<std::vector<BoxBuf>>& targets) {
+void Encoder::setPicture(Picture* pic) {
+  pic_ = pic;
+}
 
-  std::unique_lock<std::timed_mutex> lck(targets_lock_, std::defer_lock);
+void Encoder::setPreview(Preview* prv) {
+  prv_ = prv;
+}
 
-  if (!lck.try_lock_for(
-        std::chrono::microseconds(Listener<std::shared_ptr<std::vector<BoxBuf>>>::timeout_))) {
-    dbgMsg("encoder target lock busy\n");
-    return false;
+void Encoder::setCrops(Crops* crp) {
+  crp_ = crp;
+}
+
+void Encoder::setTap(Listener<NalBuf>* tap) {
+  tap_ = tap;
+}
+
+void Encoder::setVectors(Listener<MotionBuf>* motion, Listener<MotionBuf>* tracks) {
+  vec_to_.clear();
+  for (auto to : { motion, tracks }) {
+    if (to) {
+      vec_to_.push_back(to);
+    }
   }
+}
 
-  targets_ = targets;
+void Encoder::sendVectors(const Codec::Output& out) {
 
-  return true;
+  // a row is a macroblock a column and one more, each an x and y byte
+  // and a 16 bit sum of differences
+  unsigned int cols = (width_ + 15) / 16;
+  unsigned int rows = (height_ + 15) / 16;
+  if (out.length < (cols + 1) * rows * 4) {
+    return;
+  }
+  auto vec = std::make_shared<std::vector<int8_t>>(cols * rows * 2);
+  MotionBuf map;
+  map.stamp = vec_stamp_;
+  map.cols = cols;
+  map.rows = rows;
+  map.fps = framerate_;
+  int8_t* dst = vec->data();
+  for (unsigned int r = 0; r < rows; r++) {
+    const int8_t* src = reinterpret_cast<const int8_t*>(out.data) + r * (cols + 1) * 4;
+    for (unsigned int c = 0; c < cols; c++, src += 4, dst += 2) {
+      dst[0] = src[0];
+      dst[1] = src[1];
+      if (std::abs(src[0]) + std::abs(src[1]) >= vec_threshold_) {
+        map.moving++;
+      }
+    }
+  }
+  map.vec = vec;
+  for (auto to : vec_to_) {
+    to->addMessage(map);
+  }
+  vec_cnt_++;
 }
 
-bool Encoder::addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks) {
+unsigned int Encoder::pending() {
+  return encode_on_ ? frame_chan_.size() + coding_ : 0;
+}
 
-  std::unique_lock<std::timed_mutex> lck(tracks_lock_, std::defer_lock);
+void Encoder::footprint(Footprint& out) {
 
-  if (!lck.try_lock_for(
-        std::chrono::microseconds(Listener<std::shared_ptr<std::vector<TrackBuf>>>::timeout_))) {
-    dbgMsg("encoder track lock busy\n");
-    return false;
+  // its frames are capture's, what it owns is the codec's
+  if (encode_on_ && codec_) {
+    codec_->footprint(out);
   }
+}
 
-  tracks_ = tracks;
+void Encoder::metrics(Exposition& out, const std::string& labels) {
+  out.counter("detector_frames_encoded_total", "frames out of the encoder", labels,
+      differ_encode_.cnt);
+  out.counter("detector_encoded_bytes_total", "h264 bytes out of the encoder", labels,
+      byte_cnt_);
+  out.gauge("detector_encoder_bitrate_bps", "bitrate the encoder is set to", labels,
+      bitrate_);
+  out.gauge("detector_encoder_throttle_pct", "of that bitrate, while the recorder is short of room",
+      labels, credit_scale_);
+  out.counter("detector_frames_stale_total", "frames skipped as too old to encode", labels,
+      stale_cnt_);
+  out.counter("detector_frames_late_total", "frames dropped as past their deadline", labels,
+      late_cnt_);
+  out.counter("detector_frames_still_total", "frames not encoded on a still scene", labels,
+      still_cnt_);
+  out.counter("detector_key_frames_asked_total", "key frames asked for", labels, key_cnt_);
+  if (!vec_to_.empty()) {
+    out.counter("detector_motion_vectors_total", "motion vector maps out of the encoder", labels,
+        vec_cnt_);
+  }
+  out.gauge("detector_queue_depth", "messages waiting for the stage", labels,
+      frame_chan_.size());
+  out.counter("detector_queue_drops_total", "messages the stage's queue dropped", labels,
+      frame_chan_.drops());
+  if (sync_max_ != 0) {
+    out.gauge("detector_overlay_hold_ms", "how long a frame may wait for its boxes", labels, sync_hold_);
+    out.counter("detector_overlay_synced_total", "frames overlaid with the boxes found on them",
+        labels, sync_hit_cnt_);
+    out.counter("detector_overlay_sync_timeouts_total", "frames that went out before their boxes",
+        labels, sync_late_cnt_);
+  }
+  out.counter("detector_overlay_overtaken_total", "box or track sets replaced before they were drawn",
+      labels, targets_cell_.overtaken() + tracks_cell_.overtaken());
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"copy\"", differ_copy_.hist);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"encode\"", differ_encode_.hist);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"capture\"", differ_late_.hist);
+}
 
-  return true;
+unsigned int Encoder::credits(const FrameBuf& next) {
+  // the newest frame takes the place of one waiting, and the substream
+  // wants every frame
+  return (latest_ || (sub_ && sub_on_)) ? credit_any : frame_chan_.room();
 }
 
-#ifdef OUTPUT_VARIOUS_BITS_OF_INFO
-void Encoder::printDef(OMX_PARAM_PORTDEFINITIONTYPE def) {
-  const char* dir;
-  if (def.eDir == OMX_DirInput) {
-    dir = "in";
+bool Encoder::addMessage(FrameBuf& fbuf) {
+
+  // the substream holds the frame until it has scaled it
+  if (sub_ && sub_on_) {
+    sub_->addMessage(fbuf);
+  }
+
+  if (fbuf.length < frame_len_) {
+    dbgMsg("encoder buffer size mismatch\n");
+    Fate::drop(Fate::Site::kEncoderSize, fbuf.stamp);
+    return false;
+  }
+
+  // make room by throwing out the oldest waiting frame
+  if (latest_ && frame_chan_.size() >= frame_chan_.capacity()) {
+    FrameBuf old;
+    if (frame_chan_.pop(old)) {
+      stale_cnt_++;
+      Fate::drop(Fate::Site::kEncoderStale, old.stamp);
+    }
+  }
+
+  bool res = frame_chan_.push(fbuf);
+
+  if (!res) {
+    dbgMsg("no encoder buffers available\n");
+    Fate::drop(Fate::Site::kEncoderFull, fbuf.stamp);
   } else {
-    dir = "out";
-  }
-  dbgMsg("  Port %u: %s %u/%u %u %u %s,%s,%s %ux%u %ux%u @%u %u\n",
-      def.nPortIndex,
-      dir,
-      def.nBufferCountActual,
-      def.nBufferCountMin,
-      def.nBufferSize,
-      def.nBufferAlignment,
-      def.bEnabled ? "enabled" : "disabled",
-      def.bPopulated ? "populated" : "not pop",
-      def.bBuffersContiguous ? "contig" : "not contig",
-      def.format.video.nFrameWidth,
-      def.format.video.nFrameHeight,
-      def.format.video.nStride,
-      def.format.video.nSliceHeight,
-      def.format.video.xFramerate,
-      def.format.video.eColorFormat);
+    wake();
+  }
+
+  return res;
 }
-#endif
 
-OMX_ERRORTYPE Encoder::eventHandler(OMX_HANDLETYPE hnd, OMX_PTR self,
-    OMX_EVENTTYPE evt, OMX_U32 d1, OMX_U32 d2, OMX_PTR data) {
-  Encoder* enc = static_cast<Encoder*>(self);
-  switch (evt) {
-    case OMX_EventCmdComplete:
-      if (d1 == OMX_CommandFlush) {
-        enc->omx_flush_sem_.post();
-      }
-      break;
-    case OMX_EventError:
-      break;
-    default:
-      break;
+bool Encoder::addMessage(std::shared_ptr<std::vector<BoxBuf>>& targets) {
+  auto stamp = (targets && !targets->empty()) ?
+    targets->front().stamp : pipeline_now();
+  return addMessage(targets, stamp);
+}
+
+bool Encoder::addMessage(std::shared_ptr<std::vector<BoxBuf>>& targets,
+    std::chrono::steady_clock::time_point stamp) {
+
+  // detections also start recorder clips
+  if (rec_) {
+    rec_->addMessage(targets);
+  }
+  if (sync_max_ != 0) {
+    Encoder::Result res;
+    res.stamp = stamp;
+    res.boxes = targets;
+    result_chan_.push(res);
+    wake();
+    return true;
+  }
+  targets_cell_.publish(targets);
+  return true;
+}
+
+bool Encoder::addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks) {
+
+  if (rec_) {
+    rec_->addMessage(tracks);
   }
-  return OMX_ErrorNone;
+  tracks_cell_.publish(tracks);
+  return true;
 }
 
-OMX_ERRORTYPE Encoder::emptyHandler(OMX_HANDLETYPE hnd, OMX_PTR self,
-    OMX_BUFFERHEADERTYPE* buf) {
-  Encoder* enc = static_cast<Encoder*>(self);
-  enc->omx_encode_sem_.post();
-  return OMX_ErrorNone;
+void Encoder::setBitrate(unsigned int bitrate) {
+  bitrate_req_ = bitrate;
+  wake();
 }
 
-OMX_ERRORTYPE Encoder::fillHandler(OMX_HANDLETYPE hnd, OMX_PTR self,
-    OMX_BUFFERHEADERTYPE* buf) {
-  Encoder* enc = static_cast<Encoder*>(self);
-  enc->omx_encode_sem_.post();
-  return OMX_ErrorNone;
+void Encoder::requestKeyFrame() {
+  key_req_ = true;
+  wake();
 }
 
-void Encoder::blockOnPortChange(OMX_U32 idx, OMX_BOOL enable) {
-  OMX_PARAM_PORTDEFINITIONTYPE port_def;
-  OMX_INIT_STRUCTURE(port_def);
-  port_def.nPortIndex = idx;
-  unsigned int i = 0;
-  while (i++ == 0 || port_def.bEnabled != enable) {
-    OMX_ERRORTYPE err = OMX_GetParameter(omx_hnd_, 
-        OMX_IndexParamPortDefinition, &port_def);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed block port\n");
+bool Encoder::applyControls() {
+
+  unsigned int bitrate = bitrate_req_.exchange(0);
+  unsigned int scale = throttle();
+  if ((bitrate != 0 && bitrate != bitrate_) || scale != credit_scale_) {
+    unsigned int want = (bitrate != 0) ? bitrate : bitrate_.load();
+    if (!codec_->setBitrate(want / 100 * scale)) {
+      return false;
     }
-    if (port_def.bEnabled != enable) {
-      std::this_thread::sleep_for(std::chrono::microseconds(yield_time_));
+    if (want != bitrate_) {
+      bitrate_ = want;
+      bitrate_cnt_++;
+    }
+    if (scale != credit_scale_) {
+      credit_scale_ = scale;
+      throttle_cnt_++;
     }
   }
-}
 
-void Encoder::blockOnStateChange(OMX_STATETYPE state) {
-  OMX_STATETYPE s;
-  unsigned int i = 0;
-  while (i++ == 0 || s != state) {
-    OMX_GetState(omx_hnd_, &s);
-    if (s != state) {
-      std::this_thread::sleep_for(std::chrono::microseconds(yield_time_));
+  if (key_req_.exchange(false)) {
+    if (!codec_->requestKeyFrame()) {
+      return false;
     }
+    key_cnt_++;
   }
+
+  return true;
 }
 
-bool Encoder::waitingToRun() {
+unsigned int Encoder::throttle() {
 
-  if (!encode_on_) {
+  using namespace std::chrono;
+  auto now = steady_clock::now();
+  if (!rec_ || now - throttle_stamp_ < seconds(1)) {
+    return credit_scale_;
+  }
+  throttle_stamp_ = now;
+  NalBuf next(0, nullptr);
+  unsigned int credits = rec_->credits(next);
+  if (credits < credit_low_ && credit_scale_ > 50) {
+    return credit_scale_ - 25;
+  }
+  if (credits >= credit_high_ && credit_scale_ < 100) {
+    return credit_scale_ + 25;
+  }
+  return credit_scale_;
+}
 
-    // create encoded file
-    if (testtime_ != 0) {
-      dbgMsg("create output file\n");
-      if (!output_.empty()) {
-        fd_enc_ = fopen(output_.c_str(), "wb");
-        if (fd_enc_ == nullptr) {
-          dbgMsg("failed: create outputfile\n");
-          return false;
-        }
-      }
-    }
+bool Encoder::useBuffers(std::vector<FrameBuf>& bufs) {
+  std::unique_lock<std::mutex> lck(use_lock_);
+  use_bufs_ = bufs;
+  use_pending_ = true;
+  return true;
+}
+
+bool Encoder::switchInputBuffers() {
 
-    // create frame pool
-    dbgMsg("create frame pool\n");
-    for (unsigned int i = 0; i < frame_num_; i++) {
-      frame_pool_.push(std::shared_ptr<Encoder::Frame>(new Encoder::Frame(frame_len_)));
+  std::vector<FrameBuf> bufs;
+  {
+    std::unique_lock<std::mutex> lck(use_lock_);
+    bufs.swap(use_bufs_);
+    use_pending_ = false;
+  }
+
+  // every input buffer has to be back before the codec switches
+  if (!waitForInput()) {
+    dbgMsg("input buffers still with the encoder, try again later\n");
+    std::unique_lock<std::mutex> lck(use_lock_);
+    use_bufs_.swap(bufs);
+    use_pending_ = true;
+    return true;
+  }
+
+  return codec_->useBuffers(bufs);
+}
+
+void Encoder::recycleInput() {
+
+  // capture buffers go back to capture once the codec is done with them
+  Codec::Input in;
+  while (codec_->doneInput(in)) {
+    auto it = in_flight_.find(in.index);
+    if (it != in_flight_.end()) {
+      in_flight_.erase(it);
     }
+  }
+}
+
+bool Encoder::waitForInput() {
+  auto limit = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+  recycleInput();
+  while (!in_flight_.empty() && std::chrono::steady_clock::now() < limit) {
+    std::this_thread::sleep_for(std::chrono::microseconds(yield_time_));
+    recycleInput();
+  }
+  return in_flight_.empty();
+}
 
-    // init bcm
-    dbgMsg("int bcm\n");
-    bcm_host_init();
+bool Encoder::drainOutput() {
 
-    // init omx
-    dbgMsg("init omx\n");
-    if (OMX_Init() != OMX_ErrorNone) {
-      return false;
+  Codec::Output out;
+  while (codec_->getOutput(out)) {
+
+    // the vectors of the frame just out, not part of the stream
+    if (out.vectors) {
+      if (!vec_to_.empty()) {
+        sendVectors(out);
+      }
+      if (!codec_->putOutput(out)) {
+        return false;
+      }
+      continue;
     }
 
-    // create omx component handles
-    dbgMsg("create omx component handles\n");
-    OMX_CALLBACKTYPE callbacks;
-    std::memset(&callbacks, 0, sizeof(callbacks));
-    callbacks.EventHandler    = eventHandler;
-    callbacks.EmptyBufferDone = emptyHandler;
-    callbacks.FillBufferDone  = fillHandler;
-    OMX_ERRORTYPE err = OMX_GetHandle(&omx_hnd_, 
-        const_cast<char*>("OMX.broadcom.video_encode"), 
-        this, &callbacks);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: create omx component handles: 0x%x\n", err);
-      return false;
+    // the oldest pending frame owns this output
+    Encoder::Pending pend;
+    if (!pending_.empty()) {
+      pend = pending_.front();
+    } else {
+      pend.stamp = pend.submit = std::chrono::steady_clock::now();
+      pend.id = Trace::no_id;
     }
-    OMX_INDEXTYPE types[] = {
-      OMX_IndexParamAudioInit, OMX_IndexParamVideoInit,
-      OMX_IndexParamImageInit, OMX_IndexParamOtherInit
-    };
-    OMX_PORT_PARAM_TYPE ports;
-    OMX_INIT_STRUCTURE(ports);
-    OMX_GetParameter(omx_hnd_, OMX_IndexParamVideoInit, &ports);
-    for (unsigned int i = 0; i < 4; i++) {
-      if (OMX_GetParameter(omx_hnd_, types[i], &ports) == OMX_ErrorNone) {
-        for (unsigned int idx = ports.nStartPortNumber; 
-            idx < ports.nStartPortNumber + ports.nPorts; idx++) {
-          err = OMX_SendCommand(omx_hnd_, OMX_CommandPortDisable, idx, NULL);
-          if (err != OMX_ErrorNone) {
-            dbgMsg("failed: disable ports\n");
-            return false;
+
+    if (out.length != 0) {
+      if (first_ms_ < 0) {
+        first_ms_ = since_start_ms();
+        Startup::ready(Startup::kEncode);
+      }
+      byte_cnt_ += out.length;
+      PROBE(encode_out, probe_us(pend.stamp), pend.id, out.length, out.key);
+
+      // the frame's sei goes in just before its first slice
+      unsigned int at = out.length;
+      if (pend.sei) {
+        for (unsigned int i = 0; i + 3 < out.length; i++) {
+          if (out.data[i] == 0 && out.data[i + 1] == 0 && out.data[i + 2] == 1) {
+            unsigned int type = out.data[i + 3] & 0x1f;
+            if (type == 1 || type == 5) {
+              at = (i > 0 && out.data[i - 1] == 0) ? i - 1 : i;
+              break;
+            }
           }
-          blockOnPortChange(idx, OMX_FALSE);
         }
       }
+      if (at < out.length) {
+        spliced_.assign(out.data, out.data + at);
+        spliced_.insert(spliced_.end(), pend.sei->begin(), pend.sei->end());
+        spliced_.insert(spliced_.end(), out.data + at, out.data + out.length);
+        forward(spliced_.data(), spliced_.size(), pend.stamp, out.end);
+        pending_.front().sei.reset();
+        sei_cnt_++;
+      } else {
+        forward(out.data, out.length, pend.stamp, out.end);
+      }
     }
 
-    // get video encode settings port 200
-    dbgMsg("get video encode settings port 200\n");
-    OMX_PARAM_PORTDEFINITIONTYPE port_def;
-    OMX_INIT_STRUCTURE(port_def);
-    port_def.nPortIndex = 200;
-    err = OMX_GetParameter(omx_hnd_, OMX_IndexParamPortDefinition, &port_def);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: get omx paramter port 200\n");
-      return false;
+    // key frames counted whoever asked for them
+    frame_key_ = frame_key_ || out.key;
+    if (out.end) {
+      since_key_ = frame_key_ ? 0 : since_key_ + 1;
+      key_wait_ = key_wait_ && !frame_key_;
+      frame_key_ = false;
     }
 
-#ifdef OUTPUT_VARIOUS_BITS_OF_INFO
-    printDef(port_def);
-#endif
+    if (out.end && !pending_.empty()) {
+      differ_encode_.begin(pend.submit);
+      differ_encode_.end();
+      Trace::span(Trace::Hop::kEncode, pend.stamp, pend.id, pend.submit);
+
+      // capture to encoded
+      differ_late_.begin(pend.stamp);
+      differ_late_.end();
+      Fate::reach(Fate::kEncoded, pend.stamp);
+
+      vec_stamp_ = pend.stamp;
+      pending_.pop_front();
+    }
 
-    // set video encode settings port 200
-    dbgMsg("set video encode settings port 200\n");
-    port_def.format.video.nFrameWidth = width_;
-    port_def.format.video.nFrameHeight = height_;
-    port_def.format.video.xFramerate = framerate_ << 16;
-    port_def.format.video.nSliceHeight = ALIGN_16B(port_def.format.video.nFrameHeight);
-    port_def.format.video.nStride = ALIGN_16B(port_def.format.video.nFrameWidth);
-    port_def.format.video.eColorFormat = OMX_COLOR_Format24bitBGR888;
-    err = OMX_SetParameter(omx_hnd_, OMX_IndexParamPortDefinition, &port_def);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: set omx paramter port 200\n");
+    // hand it back for more
+    if (!codec_->putOutput(out)) {
       return false;
     }
+  }
+  return true;
+}
 
-#ifdef OUTPUT_VARIOUS_BITS_OF_INFO
-    printDef(port_def);
-#endif
+bool Encoder::waitingToRun() {
 
-    // set video encode settings for port 201
-    dbgMsg("set video encode settings port 201\n");
-    OMX_VIDEO_PARAM_PORTFORMATTYPE format;
-    OMX_INIT_STRUCTURE(format);
-    format.nPortIndex = 201;
-    format.eColorFormat = OMX_COLOR_FormatUnused;
-    format.eCompressionFormat = OMX_VIDEO_CodingAVC;
-    err = OMX_SetParameter(omx_hnd_, OMX_IndexParamVideoPortFormat, &format);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: set omx parameter to port 201\n");
-      return false;
+  if (!encode_on_) {
+
+    // create encoded file
+    if (testtime_ != 0 && rec_ == nullptr) {
+      dbgMsg("create output file\n");
+      if (!output_.empty()) {
+        fd_enc_ = Storage::open(output_);
+        if (fd_enc_ < 0) {
+          dbgMsg("failed: create outputfile\n");
+          return false;
+        }
+      }
     }
 
-    // set bitrate
-    dbgMsg("set bitrate\n");
-    OMX_VIDEO_PARAM_BITRATETYPE bitrate_type;
-    OMX_INIT_STRUCTURE(bitrate_type);
-    bitrate_type.eControlRate = OMX_Video_ControlRateVariable;
-    bitrate_type.nTargetBitrate = bitrate_;
-    bitrate_type.nPortIndex = 201;
-    err = OMX_SetParameter(omx_hnd_, OMX_IndexParamVideoBitrate, &bitrate_type);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: set bitrate\n");
-      return false;
+    // hardware codec
+    if (m2m_) {
+      codec_ = M2m::create(this, yield_time_);
+    } else {
+#ifdef HAVE_LIBOPENMAX
+      codec_ = Omx::create(this, yield_time_);
+#else
+      codec_ = NullCodec::create(this);
+#endif
     }
-    OMX_INIT_STRUCTURE(bitrate_type);
-    bitrate_type.nPortIndex = 201;
-    err = OMX_GetParameter(omx_hnd_, OMX_IndexParamVideoBitrate, &bitrate_type);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: get bitrate\n");
-      return false;
+    codec_->setSlices(slices_);
+    codec_->setGop(gop_still_);
+    codec_->setVectors(!vec_to_.empty());
+    codec_->setBuffers(codec_bufs_);
+
+    // either of them needs a motion gate
+    still_.reset();
+    if (still_threshold_ != 0 && (still_gap_ != 0 || gop_active_ != 0)) {
+      unsigned int w = src_width_ ? src_width_ : width_;
+      unsigned int h = src_height_ ? src_height_ : height_;
+      still_ = Motion::create(w, h, pix_fmt_, still_threshold_, still_mask_);
     }
-    dbgMsg("current bitrate:%u\n", bitrate_type.nTargetBitrate);
-
-    // idle omx
-    dbgMsg("idle omx\n");
-    err = OMX_SendCommand(omx_hnd_, OMX_CommandStateSet, OMX_StateIdle, NULL);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: change to idle state\n");
+    since_key_ = 0;
+    key_wait_ = true;
+    dbgMsg("open %s codec\n", codec_->name());
+    if (!codec_->open(width_, height_, framerate_, pix_fmt_, bitrate_.load())) {
+      dbgMsg("failed: open %s codec\n", codec_->name());
       return false;
     }
-    blockOnStateChange(OMX_StateIdle);
 
-    // enable ports
-    dbgMsg("enable ports\n");
-    err = OMX_SendCommand(omx_hnd_, OMX_CommandPortEnable, 200, NULL);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: enable port 200x\n");
-      return false;
+    differ_tot_.begin();
+    encode_on_ = true;
+  }
+
+  return true;
+}
+
+void Encoder::forward(unsigned char* data, unsigned int len,
+    std::chrono::steady_clock::time_point stamp, bool end) {
+
+  // record the h264
+  if (rec_) {
+    NalBuf nal(len, data, stamp);
+    if (!rec_->addMessage(nal)) {
+      dbgMsg("warning: recorder is busy\n");
     }
-    blockOnPortChange(200, OMX_TRUE);
-    err = OMX_SendCommand(omx_hnd_, OMX_CommandPortEnable, 201, NULL);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: enable port 201\n");
-      return false;
+  } else if (testtime_ != 0 && fd_enc_ >= 0) {
+    if (!Storage::write(fd_enc_, data, len, false)) {
+      dbgMsg("warning: storage is behind\n");
     }
-    blockOnPortChange(200, OMX_TRUE);
+  }
 
-    // allocate buffers
-    dbgMsg("allocate buffers\n");
-    OMX_INIT_STRUCTURE(port_def);
-    port_def.nPortIndex = 200;
-    err = OMX_GetParameter(omx_hnd_, OMX_IndexParamPortDefinition, &port_def);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: allocate port 200 buffers get param\n");
-      return false;
+  // stream the h264
+  if (rtsp_) {
+    NalBuf nal(len, data, stamp);
+    if (!rtsp_->addMessage(nal)) {
+      dbgMsg("warning: rtsp is busy\n");
     }
-    dbgMsg("port 200 allocate size: %d\n", port_def.nBufferSize);
-    err = OMX_AllocateBuffer(omx_hnd_, &omx_buf_in_, 200, NULL, port_def.nBufferSize);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: allocate port 200 buffers\n");
-      return false;
+  }
+
+  // webrtc first, it's the one in a hurry, but it packs whole frames
+  if (rtc_ && (!end || !rtc_au_.empty())) {
+    rtc_au_.insert(rtc_au_.end(), data, data + len);
+  }
+  if (rtc_ && end) {
+    NalBuf nal(rtc_au_.empty() ? len : rtc_au_.size(),
+        rtc_au_.empty() ? data : rtc_au_.data(), stamp);
+    if (!rtc_->addMessage(nal)) {
+      dbgMsg("warning: webrtc is busy\n");
     }
-    OMX_INIT_STRUCTURE(port_def);
-    port_def.nPortIndex = 201;
-    err = OMX_GetParameter(omx_hnd_, OMX_IndexParamPortDefinition, &port_def);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: allocate port 201 buffers get param\n");
-      return false;
+    rtc_au_.clear();
+  }
+
+  // and to the browsers
+  if (hls_) {
+    NalBuf nal(len, data, stamp);
+    if (!hls_->addMessage(nal)) {
+      dbgMsg("warning: hls is busy\n");
     }
-    dbgMsg("port 201 allocate size: %d\n", port_def.nBufferSize);
-    err = OMX_AllocateBuffer(omx_hnd_, &omx_buf_out_, 201, NULL, port_def.nBufferSize);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: allocate port 201 buffers\n");
-      return false;
+  }
+
+  if (tap_) {
+    NalBuf nal(len, data, stamp);
+    tap_->addMessage(nal);
+  }
+}
+
+// "detector-boxes-1", the uuid of our user data
+static const unsigned char sei_uuid[16] = {
+  0x64, 0x65, 0x74, 0x65, 0x63, 0x74, 0x6f, 0x72,
+  0x2d, 0x62, 0x6f, 0x78, 0x65, 0x73, 0x2d, 0x31
+};
+
+void Encoder::makeSei(bool same) {
+
+  // what went on the last frame, or nothing if nothing did
+  if (same) {
+    next_sei_ = last_sei_;
+    return;
+  }
+  last_sei_.reset();
+
+  std::vector<const BoxBuf*> boxes;
+  if (tracking_) {
+    for (auto& p : *predicted_) {
+      boxes.push_back(&p);
+    }
+  } else if (targets_ != nullptr) {
+    for (auto& b : *targets_) {
+      boxes.push_back(&b);
     }
+  }
+  if (boxes.size() > 255) {
+    boxes.resize(255);
+  }
 
-    // execute omx
-    dbgMsg("execute omx\n");
-    err = OMX_SendCommand(omx_hnd_, OMX_CommandStateSet, OMX_StateExecuting, NULL);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: change to idle state\n");
-      return false;
+  // one empty one says they're gone, after that stay quiet
+  if (boxes.empty() && !sei_sent_) {
+    return;
+  }
+  sei_sent_ = !boxes.empty();
+
+  std::vector<unsigned char> pay(sei_uuid, sei_uuid + sizeof(sei_uuid));
+  auto put16 = [&pay](unsigned int v) {
+    pay.push_back((v >> 8) & 0xff);
+    pay.push_back(v & 0xff);
+  };
+  pay.push_back(1);
+  put16(width_);
+  put16(height_);
+  pay.push_back(boxes.size());
+  for (auto b : boxes) {
+    pay.push_back(static_cast<unsigned char>(b->type));
+    put16(b->id >> 16);
+    put16(b->id);
+    put16(b->x);
+    put16(b->y);
+    put16(b->w);
+    put16(b->h);
+    pay.push_back(static_cast<unsigned char>(std::min(std::max(b->score, 0.f), 1.f) * 100.f));
+  }
+
+  // payload type 5, its size, the payload and the stop bit
+  std::vector<unsigned char> rbsp;
+  rbsp.push_back(5);
+  size_t left = pay.size();
+  for (; left >= 255; left -= 255) {
+    rbsp.push_back(255);
+  }
+  rbsp.push_back(left);
+  rbsp.insert(rbsp.end(), pay.begin(), pay.end());
+  rbsp.push_back(0x80);
+
+  // start code and nal header, then no 00 00 0x in the body
+  auto sei = std::make_shared<std::vector<unsigned char>>();
+  sei->reserve(rbsp.size() + rbsp.size() / 32 + 5);
+  sei->insert(sei->end(), {0, 0, 0, 1, 6});
+  unsigned int zeros = 0;
+  for (auto c : rbsp) {
+    if (zeros == 2 && c <= 3) {
+      sei->push_back(3);
+      zeros = 0;
     }
-    blockOnStateChange(OMX_StateExecuting);
+    sei->push_back(c);
+    zeros = (c == 0) ? zeros + 1 : 0;
+  }
+  next_sei_ = sei;
+  if (sei_sent_) {
+    last_sei_ = sei;
+  }
+}
 
-    differ_tot_.begin();
-    encode_on_ = true;
+void Encoder::sendMeta(std::chrono::steady_clock::time_point stamp) {
+
+  MetaBuf meta;
+  meta.stamp = stamp;
+  meta.width = width_;
+  meta.height = height_;
+  meta.boxes = meta_pool_.get();
+  if (tracking_) {
+    meta.boxes->assign(predicted_->begin(), predicted_->end());
+  } else if (targets_ != nullptr) {
+    *meta.boxes = *targets_;
   }
 
-  return true;
+  // one empty frame says they're gone, after that stay quiet
+  if (meta.boxes->empty() && !meta_sent_) {
+    return;
+  }
+  meta_sent_ = !meta.boxes->empty();
+  if (rtsp_->addMessage(meta)) {
+    meta_cnt_++;
+  }
 }
 
-void Encoder::overlay(std::shared_ptr<Encoder::Frame>& frame) {
+void Encoder::overlay(unsigned char* data, 
+    std::chrono::steady_clock::time_point stamp) {
+
+  Trace::Scope trace(Trace::Hop::kOverlay, stamp, Trace::no_id);
+  PROBE_SCOPE(overlay, probe_us(stamp), tracking_ ? (predicted_ ? predicted_->size() : 0) :
+      (targets_ ? targets_->size() : 0));
+  Perf::Scope perf(Perf::Site::kOverlay);
+
+  // pick up the newest boxes, keep the old ones otherwise
+  targets_cell_.take(targets_);
+  tracks_cell_.take(tracks_);
+
+  // tracks move with the frame between detections
+  if (tracking_) {
+    predicted_->clear();
+    if (tracks_ != nullptr) {
+      for (auto& t : *tracks_) {
+        TrackBuf p;
+        if (Tracker::predict(t, stamp, width_, height_, p) && 
+            p.w > 2 * thickness_ && p.h > 2 * thickness_) {
+          predicted_->push_back(p);
+        }
+      }
+    }
+  }
+
+  bool same = tracking_ ? sameBoxes(predicted_) : sameBoxes(targets_);
+
+  // the same boxes, stamped like the frame they're on
+  if (meta_ && rtsp_) {
+    sendMeta(stamp);
+  }
+  if (sei_) {
+    makeSei(same);
+  }
+
+  // privacy zones go on first and whatever else is set
+  if (!privacy_.empty()) {
+    Planes p(data, Shape(width_, height_, pix_fmt_));
+    if (p.yuv) {
+      blendYUVRects(p.y, p.stride, p.u, p.uv_stride, p.v, p.uv_stride,
+          width_, height_, privacy_.data(), privacy_.size());
+    } else {
+      blendRGBRects(p.y, p.stride, width_, height_,
+          privacy_.data(), privacy_.size());
+    }
+  }
+
+  // flatten the background before the boxes go on
+  if (roi_) {
+    differ_roi_.begin();
+    if (!same) {
+      std::fill(roi_keep_.begin(), roi_keep_.end(), 0);
+      if (tracking_) {
+        keepBoxes(predicted_);
+      } else if (targets_ != nullptr) {
+        keepBoxes(targets_);
+      }
+    }
+    if (pix_fmt_ == V4L2_PIX_FMT_YUV420) {
+      flatten_yuv420(data, ALIGN_16B(width_), ALIGN_16B(height_), 
+          width_, height_, roi_keep_.data());
+    } else {
+      flatten_rgb24(data, ALIGN_16B(width_) * channels_, 
+          width_, height_, roi_keep_.data());
+    }
+    differ_roi_.end();
+  }
+
+  if (!draw_) {
+    draw_list_.clear();
+    return;
+  }
 
   // targets
   {
-    std::unique_lock<std::timed_mutex> lck(targets_lock_);
     if (!tracking_) {
       if (targets_ != nullptr) {
         if (targets_->size() != 0) {
           drawBoxes<std::shared_ptr<std::vector<BoxBuf>>>(
-              false, thickness_, width_, height_, frame->buf.data(), targets_);
+              false, thickness_, width_, height_, data, targets_, same);
         }
       }
     }
@@ -438,78 +912,278 @@ void Encoder::overlay(std::shared_ptr<Encoder::Frame>& frame) {
 
   // tracks
   {
-    std::unique_lock<std::timed_mutex> lck(tracks_lock_);
     if (tracking_) {
-      if (tracks_ != nullptr) {
-        if (tracks_->size() != 0) {
-          drawBoxes<std::shared_ptr<std::vector<TrackBuf>>>(
-              true, thickness_, width_, height_, frame->buf.data(), tracks_);
-        }
+      if (predicted_->size() != 0) {
+        drawBoxes<std::shared_ptr<std::vector<TrackBuf>>>(
+            true, thickness_, width_, height_, data, predicted_, same);
       }
     }
   }
 }
 
+bool Encoder::skipStill(const FrameBuf& frame) {
+
+  targets_cell_.take(targets_);
+  tracks_cell_.take(tracks_);
+  moved_ = still_ && still_->changed(frame);
+  if (!still_ || still_gap_ == 0) {
+    return false;
+  }
+
+  // anything on the frame, or anything moving, goes at the full rate
+  bool boxes = tracking_ ? (tracks_ && !tracks_->empty()) : (targets_ && !targets_->empty());
+  if (boxes || moved_ ||
+      frame.stamp - still_last_ >= std::chrono::milliseconds(still_gap_)) {
+    still_last_ = frame.stamp;
+    return false;
+  }
+  still_cnt_++;
+  Fate::drop(Fate::Site::kEncoderStill, frame.stamp);
+  return true;
+}
+
+void Encoder::holdFrames() {
+
+  using namespace std::chrono;
+  auto now = steady_clock::now();
+  Encoder::Result res;
+  while (result_chan_.pop(res)) {
+    sync_lags_[sync_lag_idx_++ % sync_lags_.size()] =
+      duration_cast<milliseconds>(now - res.stamp).count();
+    sync_seen_ = std::max(sync_seen_, res.stamp);
+    results_.push_back(std::move(res));
+  }
+  while (results_.size() > result_chan_.capacity()) {
+    targets_ = results_.front().boxes;
+    results_.pop_front();
+  }
+
+  // the slowest of late with some to spare, a frame's worth at least
+  uint32_t high = *std::max_element(sync_lags_.begin(), sync_lags_.end());
+  sync_hold_ = std::min(sync_max_, high + high / 4 + 1000 / std::max(framerate_, 1u));
+
+  while (held_.size() < held_max_) {
+    FrameBuf frame;
+    if (!frame_chan_.pop(frame)) {
+      return;
+    }
+    if (held_.size() >= held_direct_) {
+      FrameBuf copy = Frames::take(Shape(width_, height_, pix_fmt_));
+      std::memcpy(copy.addr, frame.addr, frame_len_);
+      copy.id = frame.id;
+      copy.source = frame.source;
+      copy.stamp = frame.stamp;
+      frame = copy;
+      sync_copy_cnt_++;
+    }
+    held_.push_back(std::move(frame));
+  }
+  if (frame_chan_.size() != 0) {
+    sync_full_cnt_++;
+  }
+}
+
+bool Encoder::releaseFrame(FrameBuf& frame) {
+
+  if (held_.empty()) {
+    return false;
+  }
+  using namespace std::chrono;
+  auto stamp = held_.front().stamp;
+  bool seen = sync_seen_ >= stamp;
+  if (!seen && pipeline_now() - stamp < milliseconds(sync_hold_)) {
+    return false;
+  }
+  sync_hit_cnt_ += seen ? 1 : 0;
+  sync_late_cnt_ += seen ? 0 : 1;
+  frame = std::move(held_.front());
+  held_.pop_front();
+
+  // the last boxes found on or before it
+  while (!results_.empty() && results_.front().stamp <= frame.stamp) {
+    targets_ = results_.front().boxes;
+    results_.pop_front();
+  }
+  return true;
+}
+
+bool Encoder::wantKey() {
+
+  if (gop_active_ == 0) {
+    return false;
+  }
+
+  // a detection counts as one id, tracks by theirs
+  ids_.clear();
+  if (tracking_ && tracks_) {
+    for (auto& t : *tracks_) {
+      ids_.push_back(t.id);
+    }
+  } else if (!tracking_ && targets_ && !targets_->empty()) {
+    ids_.push_back(0);
+  }
+  std::sort(ids_.begin(), ids_.end());
+  bool onset = !std::includes(last_ids_.begin(), last_ids_.end(), ids_.begin(), ids_.end());
+  last_ids_.swap(ids_);
+  onset = onset || (moved_ && !was_moving_);
+  was_moving_ = moved_;
+
+  // one on its way or one just out does for the onset
+  if (key_wait_) {
+    return false;
+  }
+  if (onset && since_key_ >= framerate_ / 2) {
+    onset_cnt_++;
+    return true;
+  }
+  if ((moved_ || !last_ids_.empty()) && since_key_ + 1 >= gop_active_) {
+    busy_key_cnt_++;
+    return true;
+  }
+  return false;
+}
+
 bool Encoder::running() {
 
   if (encode_on_) {
-    {
-      std::unique_lock<std::timed_mutex> lck(frame_lock_);
 
-      // a frame is ready
-      if (frame_work_.size() != 0) {
-        auto frame = frame_work_.front();
-
-        // overlay target boxes
-        overlay(frame);
+    // capture has offered its buffers
+    bool pending = false;
+    {
+      std::unique_lock<std::mutex> lck(use_lock_);
+      pending = use_pending_;
+    }
+    if (pending && !switchInputBuffers()) {
+      return false;
+    }
 
-        // fill the input buffer
-        std::memcpy(omx_buf_in_->pBuffer, frame->buf.data(), frame->length);
-        omx_buf_in_->nOffset = 0;
-        omx_buf_in_->nFilledLen = frame->length;
+    // take back what the encoder is done with
+    recycleInput();
+    if (!drainOutput()) {
+      return false;
+    }
 
-        // return the frame to the queue
-        frame_work_.pop();
-        frame_pool_.push(frame);
+    // bitrate and key frame requests land before the next frame
+    applyControls();
+    if (sync_max_ != 0) {
+      holdFrames();
+    }
 
-        // let capture fill another buffer while we wait
-        lck.unlock();
+    // feed frames while there are input buffers
+    while (1) {
+      FrameBuf frame;
+      Codec::Input in;
+      if (!codec_->getInput(in)) {
+        break;
+      }
+      if (sync_max_ != 0 ? !releaseFrame(frame) : !frame_chan_.pop(frame)) {
+        codec_->putInput(in);
+        break;
+      }
+      if (latest_ && sync_max_ == 0) {
+        FrameBuf newer;
+        while (frame_chan_.pop(newer)) {
+          Fate::drop(Fate::Site::kEncoderStale, frame.stamp);
+          frame = newer;
+          stale_cnt_++;
+        }
+      }
 
-        // start encoding...
-        differ_encode_.begin();
-        OMX_ERRORTYPE err = OMX_EmptyThisBuffer(omx_hnd_, omx_buf_in_);
-        if (err != OMX_ErrorNone) {
-          dbgMsg("failed: omx empty buffer\n");
-          return false;
+      // past its deadline already, the next one still has a chance
+      if (Deadline::late(frame.deadline, pipeline_now(), 0)) {
+        Fate::drop(Fate::Site::kEncoderLate, frame.stamp);
+        late_cnt_++;
+        codec_->putInput(in);
+        continue;
+      }
+      bool skip = skipStill(frame);
+
+      // the preview's level is made here, before the overlay can land on the
+      // frame, and it goes on through a still scene
+      if (prv_ && frame.levels && prv_->wanted() && frame.levels->get(1)) {
+        auto boxes = std::make_shared<std::vector<BoxBuf>>();
+        if (tracking_ && tracks_) {
+          boxes->assign(tracks_->begin(), tracks_->end());
+        } else if (!tracking_ && targets_) {
+          *boxes = *targets_;
         }
-        omx_encode_sem_.wait();
+        prv_->addMessage(frame.levels, boxes);
+      }
 
-        // ... wait for result
-        err = OMX_FillThisBuffer(omx_hnd_, omx_buf_out_);
-        if (err != OMX_ErrorNone) {
-          dbgMsg("failed: omx fill buffer\n");
+      // the crops are cut from the full frame, holding it keeps the overlay
+      // off it since the encoder then copies
+      if (crp_ && crp_->wanted()) {
+        auto tracks = std::make_shared<std::vector<BoxBuf>>();
+        if (tracking_ && tracks_) {
+          tracks->assign(tracks_->begin(), tracks_->end());
+        }
+        crp_->addMessage(frame, tracks);
+      }
+      if (skip) {
+        codec_->putInput(in);
+        continue;
+      }
+      if (wantKey()) {
+        if (!codec_->requestKeyFrame()) {
           return false;
         }
-        omx_encode_sem_.wait();
-        differ_encode_.end();
+        key_wait_ = true;
+      }
 
-        // record the h264
-        if (testtime_ != 0 && fd_enc_ != nullptr) {
-          fwrite(omx_buf_out_->pBuffer, 1, omx_buf_out_->nFilledLen, fd_enc_);
+      // encode the capture buffer in place if no one else is reading it,
+      // otherwise copy it so the overlay doesn't show up in tflow's input
+      Codec::Input use;
+      if (frame.ref.use_count() == 1 && codec_->findInput(frame, use)) {
+        codec_->putInput(in);
+        in = use;
+        direct_cnt_++;
+      } else if (src_width_ != 0) {
+        Trace::Scope trace(Trace::Hop::kEncodeCopy, frame.stamp, frame.id);
+        Perf::Scope perf(Perf::Site::kEncodeCopy);
+        differ_scale_.begin();
+        const Level* lvl = frame.levels ? frame.levels->get(1) : nullptr;
+        if (lvl && lvl->width == width_ && lvl->height == height_) {
+          std::memcpy(in.addr, lvl->addr, frame_len_);
+        } else if (pix_fmt_ == V4L2_PIX_FMT_YUV420) {
+          scale_half_yuv420(frame.addr, ALIGN_16B(src_width_), ALIGN_16B(src_height_),
+              in.addr, ALIGN_16B(width_), ALIGN_16B(height_), width_, height_);
+        } else {
+          scale_half_rgb24(frame.addr, ALIGN_16B(src_width_) * channels_,
+              in.addr, ALIGN_16B(width_) * channels_, width_, height_);
         }
+        differ_scale_.end();
+        frame.ref.reset();
+      } else {
+        Trace::Scope trace(Trace::Hop::kEncodeCopy, frame.stamp, frame.id);
+        Perf::Scope perf(Perf::Site::kEncodeCopy);
+        differ_copy_.begin();
+        std::memcpy(in.addr, frame.addr, frame_len_);
+        differ_copy_.end();
+        frame.ref.reset();
+      }
 
-        // stream the h264
-        if (rtsp_) {
-          NalBuf nal(omx_buf_out_->nFilledLen, omx_buf_out_->pBuffer);
-          if (!rtsp_->addMessage(nal)) {
-            dbgMsg("warning: rtsp is busy\n");
-          }
-        }
+      // overlay target boxes
+      overlay(in.addr, frame.stamp);
+      if (pic_ && pic_->wanted()) {
+        FrameBuf copy = Frames::take(Shape(width_, height_, pix_fmt_));
+        std::memcpy(copy.addr, in.addr, frame_len_);
+        copy.stamp = frame.stamp;
+        pic_->addMessage(copy);
+      }
 
-        // omx buffer used;
-        omx_buf_out_->nFilledLen = 0;
+      // capture buffers stay held until the codec hands them back
+      pending_.push_back(Encoder::Pending{
+          frame.stamp, std::chrono::steady_clock::now(), frame.id, std::move(next_sei_)});
+      next_sei_.reset();
+      in_flight_[in.index] = frame;
+      PROBE(encode_in, probe_us(frame.stamp), frame.id, frame_len_);
+      if (!codec_->encode(in, frame_len_)) {
+        in_flight_.erase(in.index);
+        pending_.pop_back();
+        return false;
       }
     }
+    coding_ = pending_.size();
   }
 
   return true;
@@ -525,90 +1199,102 @@ bool Encoder::waitingToHalt() {
     encode_on_ = false;
     differ_tot_.end();
 
-    // flush the port buffers
-    dbgMsg("flush the port buffers\n");
-    OMX_ERRORTYPE err = OMX_SendCommand(omx_hnd_, OMX_CommandFlush, 200, NULL);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: flush port 200 buffers\n");
-      return false;
-    }
-    omx_flush_sem_.wait();
-    err = OMX_SendCommand(omx_hnd_, OMX_CommandFlush, 201, NULL);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: flush port 201 buffers\n");
-      return false;
-    }
-    omx_flush_sem_.wait();
-
-    // disable all ports
-    dbgMsg("disable all ports\n");
-    err = OMX_SendCommand(omx_hnd_, OMX_CommandPortDisable, 200, NULL);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: disable port 200\n");
-      return false;
-    }
-    blockOnPortChange(200, OMX_FALSE);
-    err = OMX_SendCommand(omx_hnd_, OMX_CommandPortDisable, 201, NULL);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: disable port 201\n");
-      return false;
-    }
-    blockOnPortChange(201, OMX_FALSE);
-
-    // free all buffers
-    dbgMsg("free all buffers\n");
-    err = OMX_FreeBuffer(omx_hnd_, 200, omx_buf_in_);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed:  free port 200 buffer\n");
-      return false;
-    }
-    err = OMX_FreeBuffer(omx_hnd_, 201, omx_buf_out_);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed:  free port 201 buffer\n");
-      return false;
-    }
-
-    // transition to idle state
-    dbgMsg("transition to loaded state\n");
-    err = OMX_SendCommand(omx_hnd_, OMX_CommandStateSet, OMX_StateIdle, NULL);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: transition to idle state: 0x%x\n", err);
-      return false;
-    }
-    blockOnStateChange(OMX_StateIdle);
-    err = OMX_SendCommand(omx_hnd_, OMX_CommandStateSet, OMX_StateLoaded, NULL);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: transition to loaded state\n");
-      return false;
+    // release queued frames
+    {
+      FrameBuf frame;
+      while (frame_chan_.pop(frame)) {
+      }
+      targets_cell_.take(targets_);
+      tracks_cell_.take(tracks_);
+      held_.clear();
+      results_.clear();
+      Encoder::Result res;
+      while (result_chan_.pop(res)) {
+      }
     }
-    blockOnStateChange(OMX_StateLoaded);
 
-   // free component handle
-    dbgMsg("free component handle\n");
-    err = OMX_FreeHandle(omx_hnd_);
-    if (err != OMX_ErrorNone) {
-      dbgMsg("failed: free component handle\n");
+    // every buffer comes back when the codec closes
+    if (!codec_->close()) {
+      dbgMsg("failed: close %s codec\n", codec_->name());
       return false;
     }
-
-    OMX_Deinit();
-    bcm_host_deinit();
+    in_flight_.clear();
+    pending_.clear();
+    coding_ = 0;
 
     if (testtime_ != 0) {
-      if (fd_enc_ != nullptr) {
-        fclose(fd_enc_);
+      if (fd_enc_ >= 0) {
+        Storage::close(fd_enc_);
+        fd_enc_ = -1;
       }
     }
 
     // report
     if (!quiet_) {
-      fprintf(stderr, "\nEncoder Results...\n");
-      fprintf(stderr, "  image copy   time (us): high:%u avg:%u low:%u cnt:%u\n", 
+      fprintf(stderr, "\n%sEncoder Results...\n", (src_width_ != 0) ? "Substream " : "");
+      fprintf(stderr, "                   codec: %s\n", codec_->name());
+      fprintf(stderr, "  image copy   time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_copy_.pct(.5), differ_copy_.pct(.9), differ_copy_.pct(.99), differ_copy_.pct(.999),
           differ_copy_.high, differ_copy_.avg, 
           differ_copy_.low,differ_copy_.cnt);
-      fprintf(stderr, "  image encode time (us): high:%u avg:%u low:%u cnt:%u\n", 
+      fprintf(stderr, "  image encode time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_encode_.pct(.5), differ_encode_.pct(.9), differ_encode_.pct(.99), differ_encode_.pct(.999),
           differ_encode_.high, differ_encode_.avg, 
           differ_encode_.low,differ_encode_.cnt);
+      fprintf(stderr, "  image latency     (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_late_.pct(.5), differ_late_.pct(.9), differ_late_.pct(.99), differ_late_.pct(.999),
+          differ_late_.high, differ_late_.avg, 
+          differ_late_.low,differ_late_.cnt);
+      if (src_width_ != 0) {
+        fprintf(stderr, "  image scale  time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+            differ_scale_.pct(.5), differ_scale_.pct(.9), differ_scale_.pct(.99), differ_scale_.pct(.999),
+            differ_scale_.high, differ_scale_.avg, 
+            differ_scale_.low,differ_scale_.cnt);
+      }
+      if (roi_) {
+        fprintf(stderr, "  background   time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+            differ_roi_.pct(.5), differ_roi_.pct(.9), differ_roi_.pct(.99), differ_roi_.pct(.999),
+            differ_roi_.high, differ_roi_.avg, 
+            differ_roi_.low,differ_roi_.cnt);
+      }
+      fprintf(stderr, "          frames encoded: %u\n", differ_encode_.cnt);
+      fprintf(stderr, "  frames encoded in place: %u\n", direct_cnt_);
+      fprintf(stderr, "          frames dropped: %llu\n", 
+          static_cast<unsigned long long>(frame_chan_.drops()));
+      fprintf(stderr, "    stale frames skipped: %u\n", stale_cnt_.load());
+      if (late_cnt_ != 0) {
+        fprintf(stderr, "     late frames dropped: %u\n", late_cnt_.load());
+      }
+      fprintf(stderr, "  overlay sets overtaken: %llu\n",
+          static_cast<unsigned long long>(targets_cell_.overtaken() + tracks_cell_.overtaken()));
+      if (still_ && still_gap_ != 0) {
+        fprintf(stderr, "    still frames skipped: %u\n", still_cnt_.load());
+      }
+      if (sync_max_ != 0) {
+        fprintf(stderr, "   sync overlay (frames): %u on their boxes, %u timed out, %u moved to the pool\n",
+            sync_hit_cnt_, sync_late_cnt_, sync_copy_cnt_);
+        fprintf(stderr, "       sync hold (msec): %u of %u, ring full %u times\n",
+            sync_hold_, sync_max_, sync_full_cnt_);
+      }
+      if (gop_active_ != 0) {
+        fprintf(stderr, "   key frames (activity): %u onset, %u busy\n", onset_cnt_, busy_key_cnt_);
+      }
+      fprintf(stderr, "         bitrate changes: %u (now %u bps)\n", bitrate_cnt_, bitrate_.load());
+      if (throttle_cnt_ != 0) {
+        fprintf(stderr, "      recorder throttling: %u steps (now %u%%)\n", throttle_cnt_, credit_scale_.load());
+      }
+      fprintf(stderr, "        key frames asked: %u\n", key_cnt_);
+      fprintf(stderr, "    first nal (ms start): %d\n", first_ms_);
+      fprintf(stderr, "  frames with boxes as last: %u\n", same_cnt_);
+      if (sei_) {
+        fprintf(stderr, "          sei frames out: %u\n", sei_cnt_);
+      }
+      if (meta_) {
+        fprintf(stderr, "     metadata frames out: %u\n", meta_cnt_);
+      }
+      if (!vec_to_.empty()) {
+        fprintf(stderr, "  motion vector maps out: %u\n", vec_cnt_.load());
+      }
       fprintf(stderr, "         total test time: %f sec\n", 
           differ_tot_.avg / 1000000.f);
       fprintf(stderr, "       frames per second: %f fps\n", 
@@ -20,28 +20,30 @@
 #define ENCODER_H
 
 #include <string>
-#include <queue>
 #include <memory>
 #include <atomic>
 #include <thread>
 #include <mutex>
 #include <vector>
+#include <map>
+#include <deque>
+#include <chrono>
 
 #include "utils.h"
 #include "listener.h"
+#include "channel.h"
+#include "latest.h"
 #include "base.h"
+#include "batch.h"
 #include "rtsp.h"
-
-extern "C" {
-#include <IL/OMX_Core.h>
-#include <IL/OMX_Component.h>
-#include <IL/OMX_Video.h>
-}
-
-extern "C" {
-#include <bcm_host.h>
-#include <IL/OMX_Broadcom.h>
-}
+#include "recorder.h"
+#include "hls.h"
+#include "webrtc.h"
+#include "picture.h"
+#include "preview.h"
+#include "crops.h"
+#include "codec.h"
+#include "motion.h"
 
 namespace detector {
 
@@ -51,22 +53,108 @@ class Encoder : public Base,
   Listener<std::shared_ptr<std::vector<TrackBuf>>> {
   public:
     static std::unique_ptr<Encoder> create(unsigned int yield_time, bool quiet, bool tracking,
-        Rtsp* rtsp, unsigned int framerate, unsigned int width, unsigned int height, 
-        unsigned int bitrate, std::string& output, unsigned int testtime);
+        LiveStream* rtsp, Recorder* rec, unsigned int framerate, unsigned int width, unsigned int height, 
+        unsigned int bitrate, std::string& output, unsigned int testtime,
+        unsigned int pix_fmt, bool latest, bool roi, bool m2m);
     virtual ~Encoder();
 
   public:
     virtual bool addMessage(FrameBuf& fbuf);
+    virtual unsigned int credits(const FrameBuf& next);
     virtual bool addMessage(std::shared_ptr<std::vector<BoxBuf>>& targets);
     virtual bool addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks);
 
+    // tflow's boxes with the stamp of the frame they were found on, which
+    // an empty set can't say for itself
+    bool addMessage(std::shared_ptr<std::vector<BoxBuf>>& targets,
+        std::chrono::steady_clock::time_point stamp);
+
+    // encode straight out of the capture buffers
+    bool useBuffers(std::vector<FrameBuf>& bufs);
+
+    // runtime controls, applied by the encode thread
+    void setBitrate(unsigned int bitrate);
+    void requestKeyFrame();
+    inline unsigned int getBitrate() { return bitrate_; }
+
+    // frames are also handed to a half size encoder for a substream,
+    // unless it is turned off, and it starts on a key frame when back on
+    bool setSubEncoder(Encoder* sub);
+    void setSubOn(bool on);
+
+    // send the boxes to rtsp as metadata, with or without drawing them
+    void setMeta(bool meta, bool draw);
+    inline void setDraw(bool draw)  { draw_ = draw; }
+    inline bool getDraw()           { return draw_; }
+    inline void setLabels(bool on)  { labels_ = on; }
+
+    // the boxes each frame shows also go in band, as a user data
+    // unregistered SEI in front of the frame's first slice, sent while
+    // there are boxes and once more when they are gone (see README)
+    void setSei(bool sei);
+
+    // before it runs, rows of macroblocks a slice and each slice passed on
+    // as the codec finishes it, 0 for whole frames
+    inline void setSlices(unsigned int rows) { slices_ = rows; }
+
+    // before it runs, frames in flight in the codec, 0 for its own
+    inline void setBuffers(unsigned int num) { codec_bufs_ = num; }
+
+    // a still scene with no boxes on it, by a motion gate of its own on
+    // capture's pixels, is encoded at 'fps' until something moves
+    void setStill(unsigned int fps, unsigned int threshold, const Rect& mask);
+
+    // key frames follow the scene, the codec's gop is 'still' frames and,
+    // while it moves or has boxes, one comes at least every 'active'
+    // frames and at once on a new track or when it starts to move
+    void setGop(unsigned int active, unsigned int still);
+
+    // each frame gets the boxes found on it rather than the last ones in,
+    // frames wait up to 'hold' msec for them, 0 is off
+    void setSync(unsigned int hold);
+
+    // zones masked on every frame, drawing or not, in capture pixels
+    void setPrivacy(const std::vector<BlendRect>& zones);
+
+    // capture to encoded, since the last call
+    inline Histogram::Percentiles latency() { return differ_late_.hist.interval(); }
+    inline Histogram::Percentiles latency(std::unique_ptr<uint32_t[]>& last) {
+      return differ_late_.hist.interval(last);
+    }
+
+    // the h264 also goes to the hls server
+    void setHls(Hls* hls);
+
+    // and to the webrtc viewers
+    void setWebrtc(Webrtc* rtc);
+
+    // frames with their overlay to the snapshot picture while it wants one
+    void setPicture(Picture* pic);
+
+    // and its pyramid and boxes to the mjpeg preview
+    void setPreview(Preview* prv);
+
+    // and its raw frame and tracks to the crop mosaic
+    void setCrops(Crops* crp);
+
+    // and to an embedding app, the nal is only lent for the call
+    void setTap(Listener<NalBuf>* tap);
+
+    // macroblock motion vectors out of the encoder to the motion gate and
+    // the tracker, before it runs and only the omx encoder has them
+    void setVectors(Listener<MotionBuf>* motion, Listener<MotionBuf>* tracks);
+
+    // the metrics endpoint's samples
+    virtual void metrics(Exposition& out, const std::string& labels);
+    virtual void footprint(Footprint& out);
+    virtual unsigned int pending();
     
   protected:
     Encoder() = delete;
     Encoder(unsigned int yield_time);
-    bool init(bool quiet, bool tracking, Rtsp* rtsp, unsigned int framerate, unsigned int width,
+    bool init(bool quiet, bool tracking, LiveStream* rtsp, Recorder* rec, unsigned int framerate, unsigned int width,
         unsigned int height, unsigned int bitrate, std::string& output, 
-        unsigned int testtime);
+        unsigned int testtime, unsigned int pix_fmt, bool latest, bool roi, bool m2m);
 
   protected:
     virtual bool waitingToRun();
@@ -77,12 +165,14 @@ class Encoder : public Base,
   private:
     bool quiet_;
     bool tracking_;
-    Rtsp* rtsp_;
+    LiveStream* rtsp_;
+    Recorder* rec_;
     unsigned int framerate_;
     unsigned int width_;
     unsigned int height_;
+    unsigned int pix_fmt_;
     const unsigned int channels_ = {3};
-    unsigned int bitrate_;
+    std::atomic<unsigned int> bitrate_;
     std::string output_;
     unsigned int testtime_;
 
@@ -105,89 +195,291 @@ class Encoder : public Base,
     const Encoder::RGB gray_rgb_ { 128, 128, 128 };
     const Encoder::RGB white_rgb_{ 255, 255, 255 };
 
-    FILE* fd_enc_;
-
-    Semaphore omx_encode_sem_;
-    Semaphore omx_flush_sem_;
-    OMX_HANDLETYPE omx_hnd_;
-    OMX_BUFFERHEADERTYPE* omx_buf_in_;
-    OMX_BUFFERHEADERTYPE* omx_buf_out_;
-    static OMX_ERRORTYPE eventHandler(OMX_HANDLETYPE hnd, OMX_PTR self,
-        OMX_EVENTTYPE evt, OMX_U32 d1, OMX_U32 d2, OMX_PTR data);
-    static OMX_ERRORTYPE emptyHandler(OMX_HANDLETYPE hnd, OMX_PTR self,
-        OMX_BUFFERHEADERTYPE* buf);
-    static OMX_ERRORTYPE fillHandler(OMX_HANDLETYPE hnd, OMX_PTR self,
-        OMX_BUFFERHEADERTYPE* buf);
-    void blockOnPortChange(OMX_U32 idx, OMX_BOOL enable);
-    void blockOnStateChange(OMX_STATETYPE state);
-
-    class Frame {
-      public:
-        Frame() = delete;
-        Frame(unsigned int len) 
-          : id(0), length(len), buf(len) {}
-        ~Frame() {}
+    int fd_enc_;              // a storage file, see storage.h
+
+    // omx or v4l2 mem2mem, several frames in flight either way
+    bool m2m_;
+    std::unique_ptr<Codec> codec_;
+    unsigned int codec_bufs_;
+    std::map<unsigned int, FrameBuf> in_flight_;
+
+    // frames submitted but not fully encoded yet, oldest first
+    class Pending {
       public:
+        std::chrono::steady_clock::time_point stamp;
+        std::chrono::steady_clock::time_point submit;
         unsigned int id;
-        unsigned int length;
-        std::vector<unsigned char> buf;
+        std::shared_ptr<std::vector<unsigned char>> sei;
     };
+    std::deque<Encoder::Pending> pending_;
+    void forward(unsigned char* data, unsigned int len,
+        std::chrono::steady_clock::time_point stamp, bool end);
+
+    void recycleInput();
+    bool drainOutput();
+    bool waitForInput();
+
+    std::mutex use_lock_;
+    bool use_pending_;
+    std::vector<FrameBuf> use_bufs_;
+    bool switchInputBuffers();
 
-    std::timed_mutex frame_lock_;
     const unsigned int frame_num_ = {3};
     unsigned int frame_len_;
-    std::queue<std::shared_ptr<Encoder::Frame>> frame_pool_;
-    std::queue<std::shared_ptr<Encoder::Frame>> frame_work_;
+    Channel<FrameBuf> frame_chan_{frame_num_, Channel<FrameBuf>::Policy::kDropNewest};
+
+    // latest frame wins, waiting frames go back to capture when a newer one arrives
+    bool latest_;
+    alignas(64) std::atomic<unsigned int> stale_cnt_;   // the producers'
+    alignas(64) std::atomic<uint64_t> byte_cnt_;        // the encoder thread's
+    std::atomic<unsigned int> late_cnt_;
+    std::atomic<unsigned int> coding_;                  // pending_'s size
+
+    std::unique_ptr<Motion> still_;
+    unsigned int still_threshold_;
+    Rect still_mask_;
+    unsigned int still_gap_;    // msec
+    bool moved_;
+    std::chrono::steady_clock::time_point still_last_;
+    std::atomic<unsigned int> still_cnt_;
+    bool skipStill(const FrameBuf& frame);
+
+    // frame synchronised overlay, frames wait in 'held_' till a result at or
+    // past their stamp is in, or for as long as inference has lately been
+    // taking.  The first few keep their capture buffer, the rest are moved
+    // to the pipeline's pool so capture doesn't run dry.
+    class Result {
+      public:
+        std::chrono::steady_clock::time_point stamp;
+        std::shared_ptr<std::vector<BoxBuf>> boxes;
+    };
+    unsigned int sync_max_;     // msec, 0 off
+    unsigned int sync_hold_;    // msec
+    Channel<Encoder::Result> result_chan_{16, Channel<Encoder::Result>::Policy::kDropOldest};
+    std::deque<Encoder::Result> results_;
+    std::deque<FrameBuf> held_;
+    unsigned int held_max_;
+    const unsigned int held_cap_ = {16};
+    const unsigned int held_direct_ = {2};
+    std::chrono::steady_clock::time_point sync_seen_;
+    std::vector<uint32_t> sync_lags_;   // msec, of the last few results
+    unsigned int sync_lag_idx_;
+    void holdFrames();
+    bool releaseFrame(FrameBuf& frame);
+    unsigned int sync_hit_cnt_;
+    unsigned int sync_late_cnt_;
+    unsigned int sync_full_cnt_;
+    unsigned int sync_copy_cnt_;
+
+    unsigned int gop_active_;
+    unsigned int gop_still_;
+    unsigned int since_key_;    // frames out since the last key frame
+    bool frame_key_;
+    bool key_wait_;             // asked for one, not out yet
+    bool was_moving_;
+    std::vector<unsigned int> last_ids_;
+    std::vector<unsigned int> ids_;
+    unsigned int onset_cnt_;
+    unsigned int busy_key_cnt_;
+    bool wantKey();
+
+    void overlay(unsigned char* data, std::chrono::steady_clock::time_point stamp);
+
+    // background outside the boxes is flattened so it costs few bits
+    bool roi_;
+    std::vector<unsigned char> roi_keep_;
+    unsigned int roi_cols_;
+    unsigned int roi_rows_;
+    const unsigned int roi_margin_ = {1};   // macroblocks around each box
+    MicroDiffer<uint32_t> differ_roi_;
+
+    template<typename T>
+    void keepBoxes(T& vec) {
+      for (auto& box : *vec) {
+        unsigned int x0 = box.x / 16;
+        unsigned int y0 = box.y / 16;
+        unsigned int x1 = std::min((box.x + box.w + 15) / 16 + roi_margin_, roi_cols_);
+        unsigned int y1 = std::min((box.y + box.h + 15) / 16 + roi_margin_, roi_rows_);
+        x0 = (x0 > roi_margin_) ? x0 - roi_margin_ : 0;
+        y0 = (y0 > roi_margin_) ? y0 - roi_margin_ : 0;
+        for (unsigned int y = y0; y < y1; y++) {
+          std::fill(roi_keep_.begin() + y * roi_cols_ + x0, 
+              roi_keep_.begin() + y * roi_cols_ + x1, 0xff);
+        }
+      }
+    }
 
-    void overlay(std::shared_ptr<Encoder::Frame>& frame);
+    std::atomic<unsigned int> bitrate_req_;
+    std::atomic<bool> key_req_;
+    unsigned int bitrate_cnt_;
+    unsigned int key_cnt_;
+    int first_ms_;
+    bool applyControls();
+
+    // the recorder short of room takes the bitrate down a step a second
+    // to half what was asked, and back up the same way once it has caught up
+    const unsigned int credit_low_ = {8};     // nals
+    const unsigned int credit_high_ = {32};
+    std::atomic<unsigned int> credit_scale_;  // percent of 'bitrate_'
+    unsigned int throttle_cnt_;
+    std::chrono::steady_clock::time_point throttle_stamp_;
+    unsigned int throttle();
 
     std::atomic<bool> encode_on_;
 
+    Hls* hls_;
+    Webrtc* rtc_;
+    Picture* pic_;
+    Preview* prv_;
+    Crops* crp_;
+    Listener<NalBuf>* tap_;
+
+    Encoder* sub_;
+    std::atomic<bool> sub_on_ = {true};
+    unsigned int src_width_;    // non zero when frames come in at twice our size
+    unsigned int src_height_;
+    MicroDiffer<uint32_t> differ_scale_;
+
     MicroDiffer<uint32_t> differ_copy_;
     MicroDiffer<uint32_t> differ_encode_;
+    MicroDiffer<uint32_t> differ_late_;
+    unsigned int direct_cnt_;
     MicroDiffer<uint32_t> differ_tot_;
 
     template<typename T>
     void drawBoxes(bool show_id, unsigned int thickness, 
         unsigned int width, unsigned int height, 
-        unsigned char* data, T& vec) {
-      std::for_each(vec->begin(), vec->end(),
-          [&](const BoxBuf& box) {
-            Encoder::RGB rgb = gray_rgb_;
-            if (box.type == BoxBuf::Type::kPerson) {
-              rgb = red_rgb_;
-            } else if (box.type == BoxBuf::Type::kPet) {
-              rgb = green_rgb_;
-            } else if (box.type == BoxBuf::Type::kVehicle) {
-              rgb = blue_rgb_;
-            }
-            drawRGBBox(thickness, data, 
-                width, height,
-                box.x, box.y, box.w, box.h,
-                rgb.r, rgb.g, rgb.b);
-            if (show_id) {
-              std::string str;
-              str += "ID: " + std::to_string(box.id);
-              drawRGBText(data, width, height,
-                  box.x + thickness, box.y + thickness, str.c_str(),
-                  white_rgb_.r, white_rgb_.g, white_rgb_.b,
-                  rgb.r, rgb.g, rgb.b);
-            }
-          }
-      );  
+        unsigned char* data, T& vec, bool same) {
+      bool yuv = pix_fmt_ == V4L2_PIX_FMT_YUV420;
+      unsigned int stride = yuv ? ALIGN_16B(width) : ALIGN_16B(width) * channels_;
+      unsigned int slice = ALIGN_16B(height);
+
+      // every outline in one pass down the frame, then the labels, the
+      // lists staying from the last frame when its boxes were the same
+      if (!same || draw_list_.size() != vec->size() || label_epoch_ != labelEpoch()) {
+        draw_list_.clear();
+        label_list_.clear();
+        label_epoch_ = labelEpoch();
+      }
+      for (size_t k = draw_list_.size(); k < vec->size(); k++) {
+        const BoxBuf& box = (*vec)[k];
+        Encoder::RGB rgb = gray_rgb_;
+        if (box.type == BoxBuf::Type::kPerson) {
+          rgb = red_rgb_;
+        } else if (box.type == BoxBuf::Type::kPet) {
+          rgb = green_rgb_;
+        } else if (box.type == BoxBuf::Type::kVehicle) {
+          rgb = blue_rgb_;
+        }
+        DrawBox draw = { { box.x, box.y, box.w, box.h }, { rgb.r, rgb.g, rgb.b } };
+        if (yuv) {
+          convert_rgb_to_yuv(rgb.r, rgb.g, rgb.b, draw.c[0], draw.c[1], draw.c[2]);
+        }
+        draw_list_.push_back(draw);
+      }
+      if (yuv) {
+        unsigned char* dst_u = data + stride * slice;
+        unsigned char* dst_v = dst_u + (stride / 2) * (slice / 2);
+        drawYUVBoxes(thickness, data, stride, dst_u, stride / 2, dst_v, stride / 2,
+            width, height, draw_list_.data(), draw_list_.size());
+      } else {
+        drawRGBBoxes(thickness, data, stride, width, height,
+            draw_list_.data(), draw_list_.size());
+      }
+      if (!show_id || !labels_) {
+        return;
+      }
+
+      // on a see through plate of the box's colour
+      unsigned char fg[4] = { white_rgb_.r, white_rgb_.g, white_rgb_.b, 255 };
+      if (yuv) {
+        convert_rgb_to_yuv(fg[0], fg[1], fg[2], fg[0], fg[1], fg[2]);
+      }
+      unsigned int i = 0;
+      for (const BoxBuf& box : *vec) {
+        if (label_list_.size() <= i) {
+          const DrawBox& draw = draw_list_[i];
+          unsigned char bg[4] = { draw.c[0], draw.c[1], draw.c[2], plate_alpha_ };
+          char str[16];
+          snprintf(str, sizeof(str), "ID: %u", box.id);
+          label_list_.push_back(&labelSprite(str, fg, bg));
+        }
+        auto& label = *label_list_[i++];
+        unsigned int label_w = label.size() / (8 * 4);
+        if (yuv) {
+          unsigned char* dst_u = data + stride * slice;
+          unsigned char* dst_v = dst_u + (stride / 2) * (slice / 2);
+          blendYUVSprite(data, stride, dst_u, stride / 2, dst_v, stride / 2, width, height,
+              box.x + thickness, box.y + thickness, label.data(), label_w, 8);
+        } else {
+          blendRGBSprite(data, stride, width, height,
+              box.x + thickness, box.y + thickness, label.data(), label_w, 8);
+        }
+      }
     }
+    std::vector<DrawBox> draw_list_;
+    std::vector<const std::vector<unsigned char>*> label_list_;
+    unsigned int label_epoch_;
 
-    std::timed_mutex targets_lock_;
+    // the boxes on the last frame, what is worked out from them (outlines,
+    // labels, the roi mask and the sei) is kept while they stay the same
+    std::vector<BoxBuf> shown_;
+    unsigned int same_cnt_;
+    template<typename T>
+    bool sameBoxes(T& vec) {
+      size_t num = vec ? vec->size() : 0;
+      bool same = (num == shown_.size());
+      for (size_t i = 0; same && i < num; i++) {
+        const BoxBuf& a = (*vec)[i];
+        const BoxBuf& b = shown_[i];
+        same = a.type == b.type && a.id == b.id && a.x == b.x && a.y == b.y &&
+          a.w == b.w && a.h == b.h && a.score == b.score;
+      }
+      if (!same) {
+        shown_.clear();
+        for (size_t i = 0; i < num; i++) {
+          shown_.push_back((*vec)[i]);
+        }
+      }
+      same_cnt_ += same ? 1 : 0;
+      return same;
+    }
+    std::vector<BlendRect> privacy_;
+    const unsigned char plate_alpha_ = 160;
+
+    Latest<std::shared_ptr<std::vector<BoxBuf>>> targets_cell_;
     std::shared_ptr<std::vector<BoxBuf>> targets_;
 
-    std::timed_mutex tracks_lock_;
+    Latest<std::shared_ptr<std::vector<TrackBuf>>> tracks_cell_;
     std::shared_ptr<std::vector<TrackBuf>> tracks_;
+    std::shared_ptr<std::vector<TrackBuf>> predicted_;
 
-    const unsigned int thickness_ = 2;
+    bool meta_;
+    std::atomic<bool> draw_;
+    std::atomic<bool> labels_ = {true};
+    bool meta_sent_;    // the last frame had boxes
+    BatchPool<BoxBuf> meta_pool_{16, 64};
+    unsigned int meta_cnt_;
+    void sendMeta(std::chrono::steady_clock::time_point stamp);
+
+    bool sei_;
+    bool sei_sent_;     // the last frame had boxes
+    std::shared_ptr<std::vector<unsigned char>> next_sei_;
+    std::shared_ptr<std::vector<unsigned char>> last_sei_;
+    std::vector<unsigned char> spliced_;
 
-#ifdef OUTPUT_VARIOUS_BITS_OF_INFO
-    void printDef(OMX_PARAM_PORTDEFINITIONTYPE def);
-#endif
+    unsigned int slices_;
+    std::vector<unsigned char> rtc_au_;     // webrtc sends whole frames
+    unsigned int sei_cnt_;
+    void makeSei(bool same);
+
+    std::vector<Listener<MotionBuf>*> vec_to_;
+    std::chrono::steady_clock::time_point vec_stamp_;   // the frame they belong to
+    std::atomic<unsigned int> vec_cnt_;
+    const int vec_threshold_ = {2};     // pixels a frame
+    void sendVectors(const Codec::Output& out);
+
+    const unsigned int thickness_ = 2;
 };
 
 } // namespace detector
@@ -0,0 +1,711 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include "events.h"
+
+namespace detector {
+
+// cbor, just unsigned ints, byte strings and arrays
+static void cbor_head(std::vector<uint8_t>& out, uint8_t major, uint64_t val) {
+  major <<= 5;
+  if (val < 24) {
+    out.push_back(major | val);
+    return;
+  }
+  unsigned int bytes = (val < 0x100) ? 1 : (val < 0x10000) ? 2 : (val < 0x100000000ull) ? 4 : 8;
+  out.push_back(major | ((bytes == 1) ? 24 : (bytes == 2) ? 25 : (bytes == 4) ? 26 : 27));
+  for (int i = bytes - 1; i >= 0; i--) {
+    out.push_back((val >> (i * 8)) & 0xff);
+  }
+}
+
+static void cbor_uint(std::vector<uint8_t>& out, uint64_t val) {
+  cbor_head(out, 0, val);
+}
+
+static void cbor_array(std::vector<uint8_t>& out, uint64_t num) {
+  cbor_head(out, 4, num);
+}
+
+static void cbor_bytes(std::vector<uint8_t>& out, const std::vector<uint8_t>& bytes) {
+  cbor_head(out, 2, bytes.size());
+  out.insert(out.end(), bytes.begin(), bytes.end());
+}
+
+// detector.fbs's field slots, 4 + 2 * the field's place in its table
+enum : flatbuffers::voffset_t {
+  kFbKind = 4, kFbMsec = 6, kFbType = 8, kFbId = 10, kFbBox = 12, kFbValue = 14,
+  kFbRule = 16, kFbPath = 18, kFbGovernor = 20, kFbCount = 22
+};
+enum : flatbuffers::voffset_t {
+  kFbLevel = 4, kFbTemp = 6, kFbRate = 8, kFbKbps = 10, kFbThreads = 12, kFbLite = 14,
+  kFbCause = 16
+};
+enum : flatbuffers::voffset_t {
+  kFbScope = 4, kFbEnters = 6, kFbExits = 8, kFbPeak = 10, kFbMean = 12, kFbUniques = 14,
+  kFbWindow = 16
+};
+enum : flatbuffers::voffset_t {
+  kFbVersion = 4, kFbSeq = 6, kFbEvents = 8
+};
+
+// detector.fbs's Box, laid out as flatc would
+struct FbBox {
+  uint16_t x, y, w, h;
+};
+
+// mqtt 3.1.1 framing
+static void mqtt_len(std::vector<uint8_t>& out, size_t len) {
+  do {
+    uint8_t b = len % 128;
+    len /= 128;
+    out.push_back(len ? (b | 0x80) : b);
+  } while (len);
+}
+
+static void mqtt_str(std::vector<uint8_t>& out, const std::string& str) {
+  out.push_back((str.size() >> 8) & 0xff);
+  out.push_back(str.size() & 0xff);
+  out.insert(out.end(), str.begin(), str.end());
+}
+
+Events::Events(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Events::~Events() {
+  if (resolver_.joinable()) {
+    resolver_.join();
+  }
+  drop();
+}
+
+std::unique_ptr<Events> Events::create(unsigned int yield_time, bool quiet,
+    const std::string& spec) {
+  auto obj = std::unique_ptr<Events>(new Events(yield_time));
+  if (!obj->init(quiet, spec)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Events::init(bool quiet, const std::string& spec) {
+
+  quiet_ = quiet;
+
+  // host[:port][/topic][,ms[,n]]
+  port_ = "1883";
+  topic_ = "detector/events";
+  flush_ms_ = 1000;
+  flush_max_ = 256;
+  std::string addr = spec.substr(0, spec.find(','));
+  if (addr.size() < spec.size() &&
+      sscanf(spec.c_str() + addr.size(), ",%u,%u", &flush_ms_, &flush_max_) < 1) {
+    dbgMsg("failed: events flush %s\n", spec.c_str());
+    return false;
+  }
+  size_t slash = addr.find('/');
+  if (slash != std::string::npos) {
+    topic_ = addr.substr(slash + 1);
+    addr = addr.substr(0, slash);
+  }
+  size_t colon = addr.find(':');
+  if (colon != std::string::npos) {
+    port_ = addr.substr(colon + 1);
+    addr = addr.substr(0, colon);
+  }
+  host_ = addr;
+  if (host_.empty() || topic_.empty() || flush_max_ == 0) {
+    dbgMsg("failed: events broker %s\n", spec.c_str());
+    return false;
+  }
+
+  batch_cnt_ = 0;
+  seq_ = 0;
+  fb_ = false;
+  fd_ = -1;
+  link_ = Events::Link::kDown;
+  resolved_ = false;
+  addr_len_ = 0;
+  conn_fd_ = -1;
+
+  events_on_ = false;
+
+  event_cnt_ = 0;
+  batch_out_ = 0;
+  batch_drop_ = 0;
+  connect_cnt_ = 0;
+  byte_cnt_ = 0;
+
+  return true;
+}
+
+void Events::setFlatbuffers(bool on) {
+  fb_ = on;
+}
+
+bool Events::addMessage(std::shared_ptr<std::vector<BoxBuf>>& boxes) {
+  if (!events_on_ || !boxes || boxes->empty() || !box_chan_.push(boxes)) {
+    return false;
+  }
+  wake();
+  return true;
+}
+
+bool Events::addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks) {
+  if (!events_on_ || !tracks || !track_chan_.push(tracks)) {
+    return false;
+  }
+  wake();
+  return true;
+}
+
+bool Events::addMessage(Events::Govern& step) {
+  if (!events_on_ || !govern_chan_.push(step)) {
+    return false;
+  }
+  wake();
+  return true;
+}
+
+bool Events::addMessage(Events::Rule& hit) {
+  if (!events_on_ || !rule_chan_.push(hit)) {
+    return false;
+  }
+  wake();
+  return true;
+}
+
+bool Events::addMessage(Events::Count& count) {
+  if (!events_on_ || !count_chan_.push(count)) {
+    return false;
+  }
+  wake();
+  return true;
+}
+
+bool Events::addMessage(Events::Path& path) {
+  if (!events_on_ || !path_chan_.push(path)) {
+    return false;
+  }
+  wake();
+  return true;
+}
+
+void Events::add(Events::Kind kind, const BoxBuf& box, unsigned int value) {
+  using namespace std::chrono;
+  if (batch_cnt_ == 0) {
+    batch_start_ = steady_clock::now();
+  }
+  uint64_t msec = duration_cast<milliseconds>(box.stamp.time_since_epoch()).count();
+  if (fb_) {
+    FbBox rect = { static_cast<uint16_t>(box.x), static_cast<uint16_t>(box.y),
+      static_cast<uint16_t>(box.w), static_cast<uint16_t>(box.h) };
+    auto start = fbb_.StartTable();
+    fbb_.AddElement<uint64_t>(kFbMsec, msec, 0);
+    fbb_.AddElement<uint32_t>(kFbId, box.id, 0);
+    fbb_.AddElement<uint32_t>(kFbValue, value, 0);
+    fbb_.AddStruct(kFbBox, &rect);
+    fbb_.AddElement<uint8_t>(kFbKind, kind, 0);
+    fbb_.AddElement<uint8_t>(kFbType, static_cast<uint8_t>(box.type), 0);
+    fb_events_.emplace_back(fbb_.EndTable(start));
+  } else {
+    cbor_array(batch_, 9);
+    cbor_uint(batch_, kind);
+    cbor_uint(batch_, msec);
+    cbor_uint(batch_, static_cast<unsigned int>(box.type));
+    cbor_uint(batch_, box.id);
+    cbor_uint(batch_, box.x);
+    cbor_uint(batch_, box.y);
+    cbor_uint(batch_, box.w);
+    cbor_uint(batch_, box.h);
+    cbor_uint(batch_, value);
+  }
+  batch_cnt_++;
+  event_cnt_++;
+}
+
+void Events::add(const Events::Govern& step) {
+  using namespace std::chrono;
+  if (batch_cnt_ == 0) {
+    batch_start_ = steady_clock::now();
+  }
+  uint64_t msec = duration_cast<milliseconds>(step.stamp.time_since_epoch()).count();
+  unsigned int temp = static_cast<unsigned int>(std::max(step.temp, 0.f) * 10.f + .5f);
+  unsigned int rate = static_cast<unsigned int>(step.rate * 10.f + .5f);
+  if (fb_) {
+    auto gov = fbb_.StartTable();
+    fbb_.AddElement<uint32_t>(kFbKbps, step.bitrate / 1000, 0);
+    fbb_.AddElement<uint32_t>(kFbCause, step.cause, 0);
+    fbb_.AddElement<uint16_t>(kFbTemp, temp, 0);
+    fbb_.AddElement<uint16_t>(kFbRate, rate, 0);
+    fbb_.AddElement<uint8_t>(kFbLevel, step.level, 0);
+    fbb_.AddElement<uint8_t>(kFbThreads, step.threads, 0);
+    fbb_.AddElement<uint8_t>(kFbLite, step.lite ? 1 : 0, 0);
+    flatbuffers::Offset<void> governor(fbb_.EndTable(gov));
+    auto start = fbb_.StartTable();
+    fbb_.AddElement<uint64_t>(kFbMsec, msec, 0);
+    fbb_.AddOffset(kFbGovernor, governor);
+    fbb_.AddElement<uint8_t>(kFbKind, Events::kGovern, 0);
+    fb_events_.emplace_back(fbb_.EndTable(start));
+  } else {
+    cbor_array(batch_, 9);
+    cbor_uint(batch_, Events::kGovern);
+    cbor_uint(batch_, msec);
+    cbor_uint(batch_, step.level);
+    cbor_uint(batch_, temp);
+    cbor_uint(batch_, rate);
+    cbor_uint(batch_, step.bitrate / 1000);
+    cbor_uint(batch_, step.threads);
+    cbor_uint(batch_, step.lite ? 1 : 0);
+    cbor_uint(batch_, step.cause);
+  }
+  batch_cnt_++;
+  event_cnt_++;
+}
+
+void Events::add(const Events::Path& path) {
+  using namespace std::chrono;
+  if (batch_cnt_ == 0) {
+    batch_start_ = steady_clock::now();
+  }
+  uint64_t msec = duration_cast<milliseconds>(path.stamp.time_since_epoch()).count();
+  if (fb_) {
+    auto data = fbb_.CreateVector(path.data);
+    auto start = fbb_.StartTable();
+    fbb_.AddElement<uint64_t>(kFbMsec, msec, 0);
+    fbb_.AddElement<uint32_t>(kFbId, path.id, 0);
+    fbb_.AddOffset(kFbPath, data);
+    fbb_.AddElement<uint8_t>(kFbKind, Events::kPath, 0);
+    fbb_.AddElement<uint8_t>(kFbType, static_cast<uint8_t>(path.type), 0);
+    fb_events_.emplace_back(fbb_.EndTable(start));
+  } else {
+    cbor_array(batch_, 5);
+    cbor_uint(batch_, Events::kPath);
+    cbor_uint(batch_, msec);
+    cbor_uint(batch_, static_cast<unsigned int>(path.type));
+    cbor_uint(batch_, path.id);
+    cbor_bytes(batch_, path.data);
+  }
+  batch_cnt_++;
+  event_cnt_++;
+}
+
+void Events::add(const Events::Rule& hit) {
+  using namespace std::chrono;
+  if (batch_cnt_ == 0) {
+    batch_start_ = steady_clock::now();
+  }
+  unsigned int kind = Events::kZoneEnter + static_cast<unsigned int>(hit.what);
+  uint64_t msec = duration_cast<milliseconds>(hit.stamp.time_since_epoch()).count();
+  if (fb_) {
+    auto start = fbb_.StartTable();
+    fbb_.AddElement<uint64_t>(kFbMsec, msec, 0);
+    fbb_.AddElement<uint32_t>(kFbId, hit.id, 0);
+    fbb_.AddElement<uint32_t>(kFbValue, hit.value, 0);
+    fbb_.AddElement<uint32_t>(kFbRule, hit.rule, 0);
+    fbb_.AddElement<uint8_t>(kFbKind, kind, 0);
+    fbb_.AddElement<uint8_t>(kFbType, static_cast<uint8_t>(hit.type), 0);
+    fb_events_.emplace_back(fbb_.EndTable(start));
+  } else {
+    cbor_array(batch_, 6);
+    cbor_uint(batch_, kind);
+    cbor_uint(batch_, msec);
+    cbor_uint(batch_, static_cast<unsigned int>(hit.type));
+    cbor_uint(batch_, hit.id);
+    cbor_uint(batch_, hit.rule);
+    cbor_uint(batch_, hit.value);
+  }
+  batch_cnt_++;
+  event_cnt_++;
+}
+
+void Events::add(const Events::Count& count) {
+  using namespace std::chrono;
+  if (batch_cnt_ == 0) {
+    batch_start_ = steady_clock::now();
+  }
+  uint64_t msec = duration_cast<milliseconds>(count.stamp.time_since_epoch()).count();
+  if (fb_) {
+    auto tally = fbb_.StartTable();
+    fbb_.AddElement<uint32_t>(kFbScope, count.scope, 0);
+    fbb_.AddElement<uint32_t>(kFbEnters, count.enters, 0);
+    fbb_.AddElement<uint32_t>(kFbExits, count.exits, 0);
+    fbb_.AddElement<uint32_t>(kFbPeak, count.peak, 0);
+    fbb_.AddElement<uint32_t>(kFbMean, count.mean, 0);
+    fbb_.AddElement<uint32_t>(kFbUniques, count.uniques, 0);
+    fbb_.AddElement<uint32_t>(kFbWindow, count.window, 0);
+    flatbuffers::Offset<void> counted(fbb_.EndTable(tally));
+    auto start = fbb_.StartTable();
+    fbb_.AddElement<uint64_t>(kFbMsec, msec, 0);
+    fbb_.AddOffset(kFbCount, counted);
+    fbb_.AddElement<uint8_t>(kFbKind, Events::kCount, 0);
+    fbb_.AddElement<uint8_t>(kFbType, static_cast<uint8_t>(count.type), 0);
+    fb_events_.emplace_back(fbb_.EndTable(start));
+  } else {
+    cbor_array(batch_, 10);
+    cbor_uint(batch_, Events::kCount);
+    cbor_uint(batch_, msec);
+    cbor_uint(batch_, count.scope);
+    cbor_uint(batch_, static_cast<unsigned int>(count.type));
+    cbor_uint(batch_, count.enters);
+    cbor_uint(batch_, count.exits);
+    cbor_uint(batch_, count.peak);
+    cbor_uint(batch_, count.mean);
+    cbor_uint(batch_, count.uniques);
+    cbor_uint(batch_, count.window);
+  }
+  batch_cnt_++;
+  event_cnt_++;
+}
+
+void Events::lifecycle(const std::vector<TrackBuf>& tracks) {
+  using namespace std::chrono;
+
+  auto now = steady_clock::now();
+  std::map<unsigned int, Events::Seen> seen;
+  for (auto& track : tracks) {
+    auto stamp = (track.stamp.time_since_epoch().count() != 0) ? track.stamp : now;
+    auto it = seen_.find(track.id);
+    if (it == seen_.end()) {
+      add(Events::kEnter, track, 0);
+      seen[track.id] = { track, stamp, 0 };
+      continue;
+    }
+    Events::Seen s = it->second;
+    s.track = track;
+    unsigned int age = duration_cast<milliseconds>(stamp - s.first).count();
+    if (age >= dwell_ * (s.dwells + 1)) {
+      s.dwells++;
+      add(Events::kDwell, track, age);
+    }
+    seen[track.id] = s;
+    seen_.erase(it);
+  }
+
+  // whatever is left has gone
+  for (auto& it : seen_) {
+    unsigned int age = duration_cast<milliseconds>(now - it.second.first).count();
+    add(Events::kExit, it.second.track, age);
+  }
+  seen_.swap(seen);
+}
+
+void Events::flush() {
+
+  if (batch_cnt_ == 0) {
+    return;
+  }
+
+  std::vector<uint8_t> msg;
+  if (fb_) {
+    auto events = fbb_.CreateVector(fb_events_);
+    auto start = fbb_.StartTable();
+    fbb_.AddOffset(kFbEvents, events);
+    fbb_.AddElement<uint32_t>(kFbSeq, seq_++, 0);
+    fbb_.AddElement<uint16_t>(kFbVersion, 1, 1);
+    fbb_.Finish(flatbuffers::Offset<void>(fbb_.EndTable(start)), "DETE");
+    msg.assign(fbb_.GetBufferPointer(), fbb_.GetBufferPointer() + fbb_.GetSize());
+    fbb_.Clear();
+    fb_events_.clear();
+  } else {
+    msg.reserve(batch_.size() + 16);
+    cbor_array(msg, 3);
+    cbor_uint(msg, 1);
+    cbor_uint(msg, seq_++);
+    cbor_array(msg, batch_cnt_);
+    msg.insert(msg.end(), batch_.begin(), batch_.end());
+    batch_.clear();
+  }
+  batch_cnt_ = 0;
+
+  std::vector<uint8_t> pkt;
+  pkt.reserve(msg.size() + topic_.size() + 8);
+  pkt.push_back(0x30);
+  mqtt_len(pkt, 2 + topic_.size() + msg.size());
+  mqtt_str(pkt, topic_);
+  pkt.insert(pkt.end(), msg.begin(), msg.end());
+
+  pend_.push_back(std::move(pkt));
+  while (pend_.size() > pend_max_) {
+    pend_.pop_front();
+    batch_drop_++;
+  }
+}
+
+// on the helper thread, getaddrinfo can take seconds
+void Events::resolve() {
+  struct addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* res = nullptr;
+  addr_len_ = 0;
+  if (getaddrinfo(host_.c_str(), port_.c_str(), &hints, &res) == 0 && res != nullptr) {
+    std::memcpy(&addr_, res->ai_addr, res->ai_addrlen);
+    addr_len_ = res->ai_addrlen;
+  }
+  if (res != nullptr) {
+    freeaddrinfo(res);
+  }
+  resolved_.store(true, std::memory_order_release);
+}
+
+// a step towards the broker, true once connected
+bool Events::open() {
+
+  using namespace std::chrono;
+  auto now = steady_clock::now();
+
+  if (link_ == Events::Link::kDown) {
+    if (now - last_try_ < milliseconds(retry_)) {
+      return false;
+    }
+    last_try_ = now;
+    resolved_ = false;
+    resolver_ = std::thread(&Events::resolve, this);
+    link_ = Events::Link::kResolving;
+    return false;
+  }
+
+  if (link_ == Events::Link::kResolving) {
+    if (!resolved_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    resolver_.join();
+    if (addr_len_ == 0) {
+      dbgMsg("failed: events resolve %s\n", host_.c_str());
+      link_ = Events::Link::kDown;
+      return false;
+    }
+    conn_fd_ = socket(addr_.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn_fd_ < 0 ||
+        (::connect(conn_fd_, reinterpret_cast<struct sockaddr*>(&addr_), addr_len_) < 0 &&
+         errno != EINPROGRESS)) {
+      dbgMsg("failed: events connect %s:%s\n", host_.c_str(), port_.c_str());
+      drop();
+      return false;
+    }
+    link_ = Events::Link::kConnecting;
+  }
+
+  // connected when it can be written to, without waiting for it
+  struct pollfd pfd = { conn_fd_, POLLOUT, 0 };
+  int res = poll(&pfd, 1, 0);
+  if (res == 0) {
+    if (now - last_try_ >= milliseconds(connect_ms_)) {
+      dbgMsg("failed: events connect %s:%s timed out\n", host_.c_str(), port_.c_str());
+      drop();
+    }
+    return false;
+  }
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (res < 0 || getsockopt(conn_fd_, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+    dbgMsg("failed: events connect %s:%s\n", host_.c_str(), port_.c_str());
+    drop();
+    return false;
+  }
+  int fd = conn_fd_;
+  conn_fd_ = -1;
+  link_ = Events::Link::kDown;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  struct timeval tv = { 0, 500000 };
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  fd_ = fd;
+
+  std::vector<uint8_t> body;
+  mqtt_str(body, "MQTT");
+  body.push_back(4);                        // 3.1.1
+  body.push_back(0x02);                     // clean session
+  body.push_back((keep_alive_ >> 8) & 0xff);
+  body.push_back(keep_alive_ & 0xff);
+  mqtt_str(body, "detector-" + std::to_string(getpid()));
+  std::vector<uint8_t> pkt;
+  pkt.push_back(0x10);
+  mqtt_len(pkt, body.size());
+  pkt.insert(pkt.end(), body.begin(), body.end());
+  if (!send(pkt)) {
+    return false;
+  }
+  connect_cnt_++;
+  return true;
+}
+
+// a connect given up on, tried again after 'retry_'
+void Events::drop() {
+  if (conn_fd_ >= 0) {
+    ::close(conn_fd_);
+    conn_fd_ = -1;
+  }
+  link_ = Events::Link::kDown;
+}
+
+void Events::close() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool Events::send(const std::vector<uint8_t>& pkt) {
+  size_t off = 0;
+  while (off < pkt.size()) {
+    ssize_t n = ::send(fd_, pkt.data() + off, pkt.size() - off, MSG_NOSIGNAL);
+    if (n <= 0) {
+      dbgMsg("failed: events send\n");
+      close();
+      return false;
+    }
+    off += n;
+  }
+  byte_cnt_ += pkt.size();
+  last_send_ = std::chrono::steady_clock::now();
+  return true;
+}
+
+bool Events::waitingToRun() {
+
+  if (!events_on_) {
+    seen_.clear();
+    batch_.clear();
+    fbb_.Clear();
+    fb_events_.clear();
+    batch_cnt_ = 0;
+    open();
+    events_on_ = true;
+  }
+
+  return true;
+}
+
+bool Events::running() {
+  using namespace std::chrono;
+
+  if (events_on_) {
+
+    std::shared_ptr<std::vector<BoxBuf>> boxes;
+    while (box_chan_.pop(boxes)) {
+      for (auto& box : *boxes) {
+        add(Events::kDetect, box, static_cast<unsigned int>(box.score * 100.f));
+      }
+      boxes.reset();
+    }
+    std::shared_ptr<std::vector<TrackBuf>> tracks;
+    while (track_chan_.pop(tracks)) {
+      lifecycle(*tracks);
+      tracks.reset();
+    }
+    Events::Govern step;
+    while (govern_chan_.pop(step)) {
+      add(step);
+    }
+    Events::Path path;
+    while (path_chan_.pop(path)) {
+      add(path);
+    }
+    Events::Rule hit;
+    while (rule_chan_.pop(hit)) {
+      add(hit);
+    }
+    Events::Count count;
+    while (count_chan_.pop(count)) {
+      add(count);
+    }
+
+    auto now = steady_clock::now();
+    if (batch_cnt_ != 0 && (batch_cnt_ >= flush_max_ ||
+          now - batch_start_ >= milliseconds(flush_ms_))) {
+      flush();
+    }
+
+    if (fd_ < 0) {
+      open();
+    }
+    if (fd_ >= 0) {
+
+      // connack and ping responses, or the broker hanging up
+      uint8_t buf[64];
+      ssize_t n;
+      while ((n = recv(fd_, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {}
+      if (n == 0) {
+        close();
+      }
+    }
+    while (fd_ >= 0 && !pend_.empty() && send(pend_.front())) {
+      pend_.pop_front();
+      batch_out_++;
+    }
+    if (fd_ >= 0 && now - last_send_ >= seconds(keep_alive_ / 2)) {
+      send({ 0xc0, 0x00 });
+    }
+  }
+  return true;
+}
+
+bool Events::paused() {
+  return true;
+}
+
+bool Events::waitingToHalt() {
+
+  if (events_on_) {
+    events_on_ = false;
+
+    // the last batch goes if it can
+    flush();
+    while (fd_ >= 0 && !pend_.empty() && send(pend_.front())) {
+      pend_.pop_front();
+      batch_out_++;
+    }
+    if (fd_ >= 0) {
+      send({ 0xe0, 0x00 });
+    }
+    close();
+    if (resolver_.joinable()) {
+      resolver_.join();
+    }
+    drop();
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nEvents Results...\n");
+      fprintf(stderr, "          broker: %s:%s/%s\n", host_.c_str(), port_.c_str(), topic_.c_str());
+      fprintf(stderr, "          events: %u\n", event_cnt_);
+      fprintf(stderr, "     batches out: %u\n", batch_out_);
+      fprintf(stderr, " batches dropped: %u (%zu waiting)\n", batch_drop_, pend_.size());
+      fprintf(stderr, "     connections: %u\n", connect_cnt_);
+      fprintf(stderr, "      bytes sent: %llu\n", static_cast<unsigned long long>(byte_cnt_));
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
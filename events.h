@@ -0,0 +1,266 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Batched detection events over MQTT.
+ *
+ *  With -V host[:port][/topic][,ms[,n]] detections, and with tracking
+ *  the tracks coming and going, are gathered into batches and published
+ *  to an MQTT broker as one CBOR message per batch.  A batch goes out
+ *  when it is 'ms' old or holds 'n' events, whichever comes first.
+ *
+ *  A batch is [version, seq, [event, ...]] and an event is
+ *
+ *    [kind, msec, type, id, x, y, w, h, score%]
+ *
+ *  where kind is 0 detect, 1 enter, 2 exit and 3 dwell, msec is the
+ *  capture time on the steady clock, type is BoxBuf::Type and for an
+ *  exit or dwell 'score%' is instead how long the track has been seen in
+ *  msec.  A track dwells once for every 'dwell' it stays.
+ *
+ *  A track's path goes out when the track does, as
+ *
+ *    [5, msec, type, id, path]
+ *
+ *  where msec is its first sighting and path a byte string: the number
+ *  of sightings, then for each its (msec, x, y, w, h) less the one
+ *  before's, the first less zeros, as zigzag LEB128 varints.  Sightings
+ *  are at least 100 msec apart and only the last 128 are kept.
+ *
+ *  The rules' zone and line events (see rules.h) are
+ *
+ *    [kind, msec, type, id, rule, value]
+ *
+ *  with kind 6 zone enter, 7 zone exit, 8 cross and 9 zone dwell.
+ *
+ *  The count summaries (see counts.h) are
+ *
+ *    [10, msec, scope, type, enters, exits, peak, mean, uniques, window]
+ *
+ *  The governor's steps (see governor.h) go in the same batches as
+ *
+ *    [4, msec, level, temp, rate, kbps, threads, lite, cause]
+ *
+ *  with the temperature in tenths of a degree, the detection rate in
+ *  tenths per second (0 unlimited), lite 1 on the lite model and cause
+ *  the Governor::Cause bits.
+ *
+ *  With --events-fb the batches are FlatBuffers instead, a Batch of
+ *  Events as in detector.fbs, the same fields by name, so a consumer
+ *  reads them in place with flatc's code for its language.
+ *
+ *  The client is just enough MQTT 3.1.1 for this: QoS 0 publish and
+ *  keep alive pings.  When the broker is away batches wait, the oldest
+ *  dropped past 'pend_max', and the broker is tried again every few secs.
+ *  Its name is looked up on a helper thread and the connect is a step
+ *  each turn, so a broker that's slow to answer never holds this thread.
+ */
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <map>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include <sys/socket.h>
+
+#include <flatbuffers/flatbuffers.h>
+
+#include "utils.h"
+#include "listener.h"
+#include "channel.h"
+#include "base.h"
+
+namespace detector {
+
+class Events : public Base {
+  public:
+    static std::unique_ptr<Events> create(unsigned int yield_time, bool quiet,
+        const std::string& spec);
+    virtual ~Events();
+
+  public:
+    // batches as detector.fbs's FlatBuffers instead of cbor, before start
+    void setFlatbuffers(bool on);
+
+    bool addMessage(std::shared_ptr<std::vector<BoxBuf>>& boxes);
+    bool addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks);
+
+    class Govern {
+      public:
+        std::chrono::steady_clock::time_point stamp;
+        unsigned int level;
+        float temp;
+        float rate;
+        unsigned int bitrate;
+        unsigned int threads;
+        bool lite;
+        unsigned int cause;
+    };
+    bool addMessage(Events::Govern& step);
+
+    class Path {
+      public:
+        unsigned int id;
+        BoxBuf::Type type;
+        std::chrono::steady_clock::time_point stamp;
+        std::vector<uint8_t> data;    // see above
+    };
+    bool addMessage(Events::Path& path);
+
+    class Rule {
+      public:
+        enum class What {
+          kEnter,
+          kExit,
+          kCross,
+          kDwell
+        };
+        What what;
+        std::chrono::steady_clock::time_point stamp;
+        BoxBuf::Type type;
+        unsigned int id;
+        unsigned int rule;
+        unsigned int value;
+    };
+    bool addMessage(Events::Rule& hit);
+
+    class Count {
+      public:
+        std::chrono::steady_clock::time_point stamp;
+        unsigned int scope;
+        BoxBuf::Type type;
+        unsigned int enters, exits;
+        unsigned int peak, mean;      // mean in tenths
+        unsigned int uniques, window;
+    };
+    bool addMessage(Events::Count& count);
+
+  protected:
+    Events() = delete;
+    Events(unsigned int yield_time);
+    bool init(bool quiet, const std::string& spec);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    std::string host_;
+    std::string port_;
+    std::string topic_;
+    unsigned int flush_ms_;
+    unsigned int flush_max_;
+
+    Channel<std::shared_ptr<std::vector<BoxBuf>>> box_chan_{8,
+      Channel<std::shared_ptr<std::vector<BoxBuf>>>::Policy::kDropOldest};
+    Channel<std::shared_ptr<std::vector<TrackBuf>>> track_chan_{8,
+      Channel<std::shared_ptr<std::vector<TrackBuf>>>::Policy::kDropOldest};
+    Channel<Events::Govern> govern_chan_{8, Channel<Events::Govern>::Policy::kDropOldest};
+    Channel<Events::Path> path_chan_{32, Channel<Events::Path>::Policy::kDropOldest};
+    Channel<Events::Rule> rule_chan_{64, Channel<Events::Rule>::Policy::kDropOldest};
+    Channel<Events::Count> count_chan_{64, Channel<Events::Count>::Policy::kDropOldest};
+
+    enum Kind {
+      kDetect = 0,
+      kEnter,
+      kExit,
+      kDwell,
+      kGovern,
+      kPath,
+      kZoneEnter,
+      kZoneExit,
+      kCross,
+      kZoneDwell,
+      kCount
+    };
+    void add(Events::Kind kind, const BoxBuf& box, unsigned int value);
+    void add(const Events::Govern& step);
+    void add(const Events::Path& path);
+    void add(const Events::Rule& hit);
+    void add(const Events::Count& count);
+
+    // tracks seen on the last pass, by id
+    class Seen {
+      public:
+        TrackBuf track;
+        std::chrono::steady_clock::time_point first;
+        unsigned int dwells;
+    };
+    std::map<unsigned int, Events::Seen> seen_;
+    const unsigned int dwell_ = {10000};    // msec
+    void lifecycle(const std::vector<TrackBuf>& tracks);
+
+    // the batch being filled, cbor events or the flatbuffers' tables
+    std::vector<uint8_t> batch_;
+    bool fb_;
+    flatbuffers::FlatBufferBuilder fbb_;
+    std::vector<flatbuffers::Offset<void>> fb_events_;
+    unsigned int batch_cnt_;
+    std::chrono::steady_clock::time_point batch_start_;
+    uint32_t seq_;
+    void flush();
+
+    // batches waiting for the broker, mqtt packets ready to go
+    std::deque<std::vector<uint8_t>> pend_;
+    const unsigned int pend_max_ = {64};
+
+    int fd_;                                  // -1 until connected
+    std::chrono::steady_clock::time_point last_try_;
+    std::chrono::steady_clock::time_point last_send_;
+    const unsigned int retry_ = {5000};       // msec
+    const unsigned int connect_ms_ = {3000};
+    const unsigned int keep_alive_ = {60};    // sec
+    enum class Link {
+      kDown,
+      kResolving,
+      kConnecting
+    };
+    Events::Link link_;
+    std::thread resolver_;
+    std::atomic<bool> resolved_;
+    struct sockaddr_storage addr_;            // the resolver's, once 'resolved_'
+    socklen_t addr_len_;                      // 0 if it found nothing
+    int conn_fd_;
+    void resolve();
+    bool open();
+    void drop();
+    void close();
+    bool send(const std::vector<uint8_t>& pkt);
+
+    std::atomic<bool> events_on_;
+
+    unsigned int event_cnt_;
+    unsigned int batch_out_;
+    unsigned int batch_drop_;
+    unsigned int connect_cnt_;
+    uint64_t byte_cnt_;
+};
+
+} // namespace detector
+
+#endif // EVENTS_H
@@ -0,0 +1,176 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "utils.h"
+#include "fate.h"
+#include "metrics.h"
+
+namespace detector {
+
+std::unique_ptr<std::atomic<uint64_t>[]> Fate::recs_;
+std::atomic<uint64_t> Fate::drops_[static_cast<unsigned int>(Fate::Site::kNum)];
+std::atomic<uint64_t> Fate::fates_[Fate::fate_num_];
+std::atomic<uint64_t> Fate::gone_ = {0};
+std::atomic<bool> Fate::on_ = {false};
+
+static const char* site_names[] = {
+  "tflow size", "tflow overtaken", "tflow stale", "tflow rate", "tflow still",
+  "tflow screened", "encoder size", "encoder stale", "encoder full", "encoder still",
+  "rtsp late", "hls pool", "tflow late", "encoder late"
+};
+static const char* site_labels[] = {
+  "tflow_size", "tflow_overtaken", "tflow_stale", "tflow_rate", "tflow_still",
+  "tflow_screened", "encoder_size", "encoder_stale", "encoder_full", "encoder_still",
+  "rtsp_late", "hls_pool", "tflow_late", "encoder_late"
+};
+
+bool Fate::start() {
+  if (!recs_) {
+    recs_.reset(new std::atomic<uint64_t>[len_]);
+  }
+  for (unsigned int i = 0; i < len_; i++) {
+    recs_[i].store(0, std::memory_order_relaxed);
+  }
+  for (auto& f : fates_) {
+    f = 0;
+  }
+  gone_ = 0;
+  on_ = true;
+  return true;
+}
+
+void Fate::stop() {
+  on_ = false;
+}
+
+void Fate::drop(Fate::Site site, std::chrono::steady_clock::time_point stamp) {
+  drops_[static_cast<unsigned int>(site)].fetch_add(1, std::memory_order_relaxed);
+  if (on()) {
+    mark(stamp, static_cast<uint64_t>(static_cast<unsigned int>(site) + 1) << site_shift_);
+  }
+}
+
+void Fate::reach(Fate::Reach reach, std::chrono::steady_clock::time_point stamp) {
+  if (on()) {
+    mark(stamp, reach);
+  }
+}
+
+void Fate::mark(std::chrono::steady_clock::time_point stamp, uint64_t bits) {
+
+  uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      stamp.time_since_epoch()).count();
+  if (ms == 0) {
+    return;
+  }
+
+  // the record is the stamp over the bits, a newer frame retires it
+  auto& rec = recs_[ms & (len_ - 1)];
+  uint64_t word = rec.load(std::memory_order_relaxed);
+  while (true) {
+    uint64_t key = word >> 16;
+    uint64_t next;
+    if (key == ms) {
+      if ((bits & site_mask_) && (word & site_mask_)) {
+        bits &= ~site_mask_;      // the first site that dropped it
+      }
+      next = word | bits;
+    } else if (key < ms) {
+      next = (ms << 16) | bits;
+    } else {
+      gone_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    if (next == word) {
+      return;
+    }
+    if (rec.compare_exchange_weak(word, next, std::memory_order_relaxed)) {
+      if (key != ms && key != 0) {
+        fates_[word & (fate_num_ - 1)].fetch_add(1, std::memory_order_relaxed);
+      }
+      return;
+    }
+  }
+}
+
+void Fate::report() {
+
+  fprintf(stderr, "\nDrop Results...\n");
+  unsigned int rows = 0;
+  for (unsigned int i = 0; i < static_cast<unsigned int>(Fate::Site::kNum); i++) {
+    uint64_t n = drops_[i];
+    if (n != 0) {
+      fprintf(stderr, "  %16s: %llu\n", site_names[i], static_cast<unsigned long long>(n));
+      rows++;
+    }
+  }
+  if (rows == 0) {
+    fprintf(stderr, "  nothing dropped\n");
+  }
+
+  if (recs_) {
+
+    // what is still in the ring counts too
+    for (unsigned int i = 0; i < len_; i++) {
+      uint64_t word = recs_[i].exchange(0);
+      if (word != 0) {
+        fates_[word & (fate_num_ - 1)]++;
+      }
+    }
+    std::vector<std::pair<uint64_t, unsigned int>> order;
+    for (unsigned int i = 0; i < fate_num_; i++) {
+      if (fates_[i] != 0) {
+        order.push_back(std::make_pair(fates_[i].load(), i));
+      }
+    }
+    std::sort(order.rbegin(), order.rend());
+    fprintf(stderr, "  frame fates:\n");
+    for (auto& o : order) {
+      std::string str;
+      str += (o.second & Fate::kCaptured) ? " captured" : "";
+      str += (o.second & Fate::kInferred) ? " inferred" : "";
+      str += (o.second & Fate::kEncoded) ? " encoded" : "";
+      str += (o.second & Fate::kStreamed) ? " streamed" : "";
+      unsigned int site = (o.second & site_mask_) >> site_shift_;
+      if (site != 0 && site <= static_cast<unsigned int>(Fate::Site::kNum)) {
+        str += std::string(", dropped at ") + site_names[site - 1];
+      }
+      fprintf(stderr, "    %10llu %s\n", static_cast<unsigned long long>(o.first),
+          str.empty() ? "nothing" : str.c_str() + 1);
+    }
+    if (gone_ != 0) {
+      fprintf(stderr, "    %10llu marks after the record had gone\n",
+          static_cast<unsigned long long>(gone_.load()));
+    }
+  }
+  fprintf(stderr, "\n");
+}
+
+void Fate::metrics(Exposition& out) {
+  for (unsigned int i = 0; i < static_cast<unsigned int>(Fate::Site::kNum); i++) {
+    std::string labels = std::string("site=\"") + site_labels[i] + "\"";
+    out.counter("detector_frame_drops_total", "frames left behind, by where", labels, drops_[i]);
+  }
+}
+
+} // namespace detector
@@ -0,0 +1,107 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Where frames go.
+ *
+ *  Every place a frame can be left behind counts it against its site,
+ *  whether by design (the detection rate, the motion gate) or for want
+ *  of capacity (a newer frame overtook it, a queue was full), and the
+ *  counts are always on the metrics endpoint and in the report at exit.
+ *
+ *  With --fates each frame also gets a record, keyed by its capture
+ *  stamp to the msec in a ring of 'len_' msec, that picks up how far it
+ *  got (captured, inferred, encoded, streamed by rtsp) and the first
+ *  site that dropped it.  A record is one word, updated with a compare
+ *  and swap, and when a newer frame takes its place it is added to the
+ *  tally of its combination.  The tally, biggest first, says where
+ *  frames stop and so where capacity is missing.  Frames captured in
+ *  the same msec on two cameras share a record.
+ */
+
+#ifndef FATE_H
+#define FATE_H
+
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+
+namespace detector {
+
+class Exposition;
+
+class Fate {
+  public:
+    enum class Site : uint8_t {
+      kTflowSize = 0,     // smaller than the model's frame
+      kTflowOvertaken,    // a newer frame came before a slot was free
+      kTflowStale,        // prepped, but a newer one was evaluated
+      kTflowRate,         // held back by the detection rate
+      kTflowStill,        // the motion gate saw nothing new
+      kTflowScreened,     // the screening model passed on it
+      kEncoderSize,
+      kEncoderStale,      // a newer frame was waiting
+      kEncoderFull,       // no room in the queue
+      kEncoderStill,      // a still scene, encoded at the still rate
+      kRtspLate,          // a nal queued too long for a reader
+      kHlsPool,           // no hls buffer free for a nal
+      kTflowLate,         // couldn't be detected by its deadline
+      kEncoderLate,       // couldn't be encoded by its deadline
+      kNum
+    };
+    enum Reach : uint32_t {
+      kCaptured = 1,
+      kInferred = 2,
+      kEncoded  = 4,
+      kStreamed = 8
+    };
+
+    static bool start();
+    static void stop();
+    static inline bool on() { return on_.load(std::memory_order_relaxed); }
+
+    static void drop(Fate::Site site, std::chrono::steady_clock::time_point stamp);
+    static void reach(Fate::Reach reach, std::chrono::steady_clock::time_point stamp);
+    static inline uint64_t drops(Fate::Site site) {
+      return drops_[static_cast<unsigned int>(site)].load(std::memory_order_relaxed);
+    }
+
+    // the table at exit and the metrics endpoint's samples
+    static void report();
+    static void metrics(Exposition& out);
+
+  private:
+    Fate() = delete;
+
+    static const unsigned int len_ = 8192;          // msec, a power of two
+    static const unsigned int site_shift_ = 4;
+    static const uint64_t site_mask_ = 0x1f0;
+    static const unsigned int fate_num_ = 512;
+    static std::unique_ptr<std::atomic<uint64_t>[]> recs_;
+    static std::atomic<uint64_t> drops_[static_cast<unsigned int>(Fate::Site::kNum)];
+    static std::atomic<uint64_t> fates_[fate_num_];
+    static std::atomic<uint64_t> gone_;             // marked after their record went
+    static std::atomic<bool> on_;
+
+    static void mark(std::chrono::steady_clock::time_point stamp, uint64_t bits);
+};
+
+} // namespace detector
+
+#endif // FATE_H
@@ -0,0 +1,448 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "flight.h"
+#include "metrics.h"
+#include "trace.h"
+
+namespace detector {
+
+Flight::Flight(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Flight::~Flight() {
+  close();
+}
+
+std::unique_ptr<Flight> Flight::create(unsigned int yield_time, bool quiet,
+    const std::string& spec, Pipeline* pipe) {
+  auto obj = std::unique_ptr<Flight>(new Flight(yield_time));
+  if (!obj->init(quiet, spec, pipe)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Flight::init(bool quiet, const std::string& spec, Pipeline* pipe) {
+
+  quiet_ = quiet;
+  pipe_ = pipe;
+
+  // path[,sec]
+  slot_num_ = 60;
+  path_ = spec.substr(0, spec.find(','));
+  if (path_.size() < spec.size() &&
+      sscanf(spec.c_str() + path_.size(), ",%u", &slot_num_) != 1) {
+    dbgMsg("failed: flight recorder seconds %s\n", spec.c_str());
+    return false;
+  }
+  if (path_.empty() || slot_num_ == 0 || slot_num_ > 3600) {
+    dbgMsg("failed: flight recorder %s\n", spec.c_str());
+    return false;
+  }
+
+  fd_ = -1;
+  map_ = nullptr;
+  map_len_ = 0;
+  flight_on_ = false;
+  seq_ = 0;
+  trace_pos_ = 0;
+  traced_ = false;
+  sample_cnt_ = 0;
+  trunc_cnt_ = 0;
+
+  // what the last run left, if it didn't stop
+  int fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= header_len_) {
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+      auto hdr = static_cast<const FlightHeader*>(map);
+      bool crashed = hdr->magic == flight_magic && hdr->clean.load() == 0;
+      if (crashed) {
+        summary(static_cast<const unsigned char*>(map), st.st_size,
+            "the last run ended without stopping");
+      }
+      munmap(map, st.st_size);
+      if (crashed) {
+        rename(path_.c_str(), (path_ + ".last").c_str());
+      }
+    }
+  }
+  if (fd >= 0) {
+    ::close(fd);
+  }
+
+  return open();
+}
+
+bool Flight::open() {
+
+  map_len_ = header_len_ + static_cast<size_t>(slot_num_) * slot_len_;
+  fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    dbgMsg("failed: open %s (errno: %d)\n", path_.c_str(), errno);
+    return false;
+  }
+  if (ftruncate(fd_, map_len_) < 0) {
+    dbgMsg("failed: size %s (errno: %d)\n", path_.c_str(), errno);
+    return false;
+  }
+  void* map = mmap(nullptr, map_len_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (map == MAP_FAILED) {
+    dbgMsg("failed: map %s (errno: %d)\n", path_.c_str(), errno);
+    return false;
+  }
+  map_ = static_cast<unsigned char*>(map);
+
+  // a new file reads as zeros, every slot unwritten
+  auto hdr = reinterpret_cast<FlightHeader*>(map_);
+  hdr->version = flight_version;
+  hdr->slot_num = slot_num_;
+  hdr->slot_len = slot_len_;
+  hdr->pid = getpid();
+  hdr->clean.store(0);
+  hdr->start_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  std::atomic_thread_fence(std::memory_order_release);
+  hdr->magic = flight_magic;
+  return true;
+}
+
+void Flight::close() {
+  if (map_) {
+    munmap(map_, map_len_);
+    map_ = nullptr;
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+void Flight::dump(const char* why) {
+  if (map_) {
+    summary(map_, map_len_, why);
+  }
+}
+
+void Flight::sample() {
+
+  differ_sample_.begin();
+
+  // each summary over the second since the last sample
+  Exposition out;
+  out.setWindows(&lasts_);
+  pipe_->metrics(out);
+  Metrics::host(out);
+  std::string text = out.str();
+
+  // and the spans, slowest first so what doesn't fit is what matters least
+  size_t room = slot_len_ - sizeof(FlightSlot);
+  if (text.size() > room) {
+    text.resize(text.rfind('\n', room - 1) + 1);
+    trunc_cnt_++;
+  }
+  std::vector<Trace::Span> spans;
+  Trace::take(trace_pos_, spans);
+  std::sort(spans.begin(), spans.end(), [](const Trace::Span& a, const Trace::Span& b) {
+      return a.end - a.begin > b.end - b.begin; });
+  char line[96];
+  for (auto& s : spans) {
+    int len = snprintf(line, sizeof(line), "# span %u %u %lld %lld\n",
+        static_cast<unsigned int>(s.hop), s.id, static_cast<long long>(s.begin / 1000000),
+        static_cast<long long>((s.end - s.begin) / 1000));
+    if (text.size() + len > room) {
+      trunc_cnt_++;
+      break;
+    }
+    text.append(line, len);
+  }
+
+  auto slot = reinterpret_cast<FlightSlot*>(map_ + header_len_ +
+      (seq_ % slot_num_) * static_cast<size_t>(slot_len_));
+  uint64_t seq = 2 * seq_ + 1;
+  slot->seq.store(seq, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->wall_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  slot->steady_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  slot->len = text.size();
+  std::memcpy(reinterpret_cast<unsigned char*>(slot) + sizeof(FlightSlot), text.data(),
+      text.size());
+  slot->seq.store(seq + 1, std::memory_order_release);
+  seq_++;
+  sample_cnt_++;
+
+  differ_sample_.end();
+}
+
+void Flight::summary(const unsigned char* map, size_t len, const char* why) {
+
+  auto hdr = reinterpret_cast<const FlightHeader*>(map);
+  if (hdr->magic != flight_magic || hdr->version != flight_version || hdr->slot_len == 0 ||
+      len < header_len_ + static_cast<size_t>(hdr->slot_num) * hdr->slot_len) {
+    fprintf(stderr, "\nflight recorder: %s, the file is no use\n", why);
+    return;
+  }
+
+  // copy out every whole slot, oldest first
+  class Sample {
+    public:
+      uint64_t seq;
+      int64_t wall_ms;
+      int64_t steady_ms;
+      std::string text;
+  };
+  std::vector<Sample> samples;
+  for (unsigned int i = 0; i < hdr->slot_num; i++) {
+    auto slot = reinterpret_cast<const FlightSlot*>(map + header_len_ +
+        static_cast<size_t>(i) * hdr->slot_len);
+    uint64_t seq = slot->seq.load(std::memory_order_acquire);
+    if (seq == 0 || (seq & 1) || slot->len > hdr->slot_len - sizeof(FlightSlot)) {
+      continue;
+    }
+    Sample s = { seq, slot->wall_ms, slot->steady_ms,
+      std::string(reinterpret_cast<const char*>(slot) + sizeof(FlightSlot), slot->len) };
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->seq.load(std::memory_order_relaxed) == seq) {
+      samples.push_back(std::move(s));
+    }
+  }
+  std::sort(samples.begin(), samples.end(),
+      [](const Sample& a, const Sample& b) { return a.seq < b.seq; });
+  if (samples.empty()) {
+    fprintf(stderr, "\nflight recorder: %s, nothing recorded\n", why);
+    return;
+  }
+
+  // every sample's value of each series, and the spans with their age
+  class Series {
+    public:
+      double first, last, min, max;
+      unsigned int at;            // the sample with the max
+      bool seen = false;
+  };
+  class Span {
+    public:
+      unsigned int hop, id;
+      int64_t age_ms;             // before the last sample
+      int64_t dur_us;
+  };
+  std::map<std::string, std::string> types;
+  std::map<std::string, Series> series;
+  std::vector<Span> spans;
+  const Sample& end = samples.back();
+  for (unsigned int k = 0; k < samples.size(); k++) {
+    const std::string& text = samples[k].text;
+    size_t pos = 0;
+    while (pos < text.size()) {
+      size_t eol = text.find('\n', pos);
+      std::string line = text.substr(pos, (eol == std::string::npos) ? std::string::npos : eol - pos);
+      pos = (eol == std::string::npos) ? text.size() : eol + 1;
+      char name[128], type[16];
+      unsigned int hop, id;
+      long long begin, dur;
+      if (line.compare(0, 7, "# TYPE ") == 0) {
+        if (sscanf(line.c_str(), "# TYPE %127s %15s", name, type) == 2) {
+          types[name] = type;
+        }
+      } else if (line.compare(0, 7, "# span ") == 0) {
+        if (sscanf(line.c_str(), "# span %u %u %lld %lld", &hop, &id, &begin, &dur) == 4) {
+          spans.push_back(Span{hop, id, end.steady_ms - begin, dur});
+        }
+      } else if (!line.empty() && line[0] != '#') {
+        size_t sp = line.rfind(' ');
+        if (sp == std::string::npos) {
+          continue;
+        }
+        double val = strtod(line.c_str() + sp + 1, nullptr);
+        auto& s = series[line.substr(0, sp)];
+        if (!s.seen) {
+          s.first = s.min = s.max = val;
+          s.at = k;
+          s.seen = true;
+        }
+        if (val > s.max) {
+          s.max = val;
+          s.at = k;
+        }
+        s.min = std::min(s.min, val);
+        s.last = val;
+      }
+    }
+  }
+
+  char when[32];
+  time_t secs = end.wall_ms / 1000;
+  struct tm tm;
+  strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&secs, &tm));
+  fprintf(stderr, "\nflight recorder: %s\n", why);
+  fprintf(stderr, "  pid %d, %zu seconds to %s\n", hdr->pid, samples.size(), when);
+
+  auto typeOf = [&types](const std::string& key) {
+    std::string fam = key.substr(0, key.find('{'));
+    auto it = types.find(fam);
+    if (it == types.end() && fam.size() > 6 && fam.compare(fam.size() - 6, 6, "_count") == 0) {
+      it = types.find(fam.substr(0, fam.size() - 6));
+    }
+    return (it == types.end()) ? std::string() : it->second;
+  };
+
+  fprintf(stderr, "  counters that moved:\n");
+  for (auto& kv : series) {
+    if (typeOf(kv.first) == "counter" && kv.second.last != kv.second.first) {
+      double delta = kv.second.last - kv.second.first;
+      fprintf(stderr, "    %-72s %+.6g\n", kv.first.c_str(),
+          (delta < 0.0) ? kv.second.last : delta);    // reset in between
+    }
+  }
+  fprintf(stderr, "  worst p99 a second:\n");
+  for (auto& kv : series) {
+    if (kv.first.find("quantile=\"0.99\"") != std::string::npos && kv.second.max > 0.0) {
+      fprintf(stderr, "    %-72s %.6g at -%llds, last %.6g\n", kv.first.c_str(), kv.second.max,
+          static_cast<long long>((end.wall_ms - samples[kv.second.at].wall_ms) / 1000),
+          kv.second.last);
+    }
+  }
+  fprintf(stderr, "  gauges that changed:\n");
+  for (auto& kv : series) {
+    if (typeOf(kv.first) == "gauge" && kv.second.max != kv.second.min) {
+      fprintf(stderr, "    %-72s %.6g to %.6g, last %.6g\n", kv.first.c_str(),
+          kv.second.min, kv.second.max, kv.second.last);
+    }
+  }
+
+  if (!spans.empty()) {
+    std::map<unsigned int, std::vector<int64_t>> hops;
+    for (auto& s : spans) {
+      hops[s.hop].push_back(s.dur_us);
+    }
+    fprintf(stderr, "  trace spans (us):\n");
+    for (auto& kv : hops) {
+      auto& durs = kv.second;
+      std::sort(durs.begin(), durs.end());
+      fprintf(stderr, "    %-12s %7zu  p50 %8lld  max %8lld\n",
+          Trace::hopStr(static_cast<Trace::Hop>(kv.first)), durs.size(),
+          static_cast<long long>(durs[durs.size() / 2]), static_cast<long long>(durs.back()));
+    }
+    std::sort(spans.begin(), spans.end(),
+        [](const Span& a, const Span& b) { return a.dur_us > b.dur_us; });
+    fprintf(stderr, "  slowest:\n");
+    for (unsigned int i = 0; i < std::min<size_t>(spans.size(), 8); i++) {
+      auto& s = spans[i];
+      char id[16] = "-";
+      if (s.id != Trace::no_id) {
+        snprintf(id, sizeof(id), "%u", s.id);
+      }
+      fprintf(stderr, "    %-12s frame %-8s %8lld us at -%llds\n",
+          Trace::hopStr(static_cast<Trace::Hop>(s.hop)), id,
+          static_cast<long long>(s.dur_us), static_cast<long long>(s.age_ms / 1000));
+    }
+  }
+  fprintf(stderr, "\n");
+}
+
+bool Flight::waitingToRun() {
+
+  if (!flight_on_) {
+
+    // spans from now on, ours if no one asked for them
+    if (!Trace::on()) {
+      traced_ = Trace::start(trace_events_);
+    }
+    std::vector<Trace::Span> before;
+    Trace::take(trace_pos_, before);
+    next_ = std::chrono::steady_clock::now();
+    flight_on_ = true;
+
+    // running again after a halt, a crash from here isn't a clean stop
+    if (map_) {
+      reinterpret_cast<FlightHeader*>(map_)->clean.store(0, std::memory_order_release);
+    }
+  }
+
+  return true;
+}
+
+bool Flight::running() {
+
+  if (flight_on_) {
+    auto now = std::chrono::steady_clock::now();
+    if (now >= next_) {
+      sample();
+      next_ += std::chrono::seconds(1);
+      if (next_ <= now) {
+        next_ = now + std::chrono::seconds(1);
+      }
+    }
+  }
+
+  return true;
+}
+
+bool Flight::paused() {
+  return true;
+}
+
+bool Flight::waitingToHalt() {
+
+  if (flight_on_) {
+    flight_on_ = false;
+
+    if (traced_) {
+      Trace::stop();
+      traced_ = false;
+    }
+    if (map_) {
+      reinterpret_cast<FlightHeader*>(map_)->clean.store(1, std::memory_order_release);
+      msync(map_, map_len_, MS_ASYNC);
+    }
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nFlight Recorder Results...\n");
+      fprintf(stderr, "              file: %s (%u sec)\n", path_.c_str(), slot_num_);
+      fprintf(stderr, "           samples: %u\n", sample_cnt_);
+      fprintf(stderr, "         truncated: %u\n", trunc_cnt_);
+      fprintf(stderr, "  sample time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_sample_.pct(.5), differ_sample_.pct(.9), differ_sample_.pct(.99), differ_sample_.pct(.999),
+          differ_sample_.high, differ_sample_.avg,
+          differ_sample_.low, differ_sample_.cnt);
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
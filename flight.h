@@ -0,0 +1,137 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Flight recorder.
+ *
+ *  With --flight path[,sec] the last 'sec' seconds of what the metrics
+ *  endpoint would say are kept in a file, one sample a second: every
+ *  stage's latency summaries over just that second, queue depths, drop
+ *  counters and the host's cpu and throttle flags, in the Prometheus
+ *  text format, and then the second's trace spans (tracing is turned on
+ *  for it) as '# span hop id begin_ms dur_us' lines.  The file is a
+ *  FlightHeader and 'slot_num' slots of 'slot_len' bytes, a FlightSlot
+ *  and its text, mapped shared and written in place, so whatever was
+ *  written is in the page cache the moment the process dies, however it
+ *  dies.  Put it on tmpfs (/run, /dev/shm) to spare the sd card, which
+ *  keeps it across crashes and restarts but not a reboot.
+ *
+ *  A slot's 'seq' is odd while it is written, so a slot cut off half way
+ *  is skipped.  'clean' is set when the recorder stops, so a file found
+ *  at start without it is from a run that didn't get that far: its
+ *  summary goes to stderr and the file is kept as 'path.last'.  The
+ *  watchdog prints one too when it restarts a stage or gives up.
+ *
+ *  The summary covers the seconds the file holds: counters that moved
+ *  and by how much, the worst p99 of each latency and when, gauges that
+ *  changed with their range and last value, and per trace hop the span
+ *  count, p50 and slowest, with the slowest frames.
+ */
+
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <string>
+#include <memory>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "utils.h"
+#include "base.h"
+#include "pipeline.h"
+
+namespace detector {
+
+const uint32_t flight_magic = 0x44464c31;    // "DFL1"
+const uint32_t flight_version = 1;
+
+class FlightHeader {
+  public:
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_num, slot_len;
+    int32_t pid;
+    std::atomic<uint32_t> clean;
+    int64_t start_ms;           // wall clock
+};
+
+class FlightSlot {
+  public:
+    std::atomic<uint64_t> seq;  // 0 never written, odd while it is
+    int64_t wall_ms;
+    int64_t steady_ms;
+    uint32_t len;               // of the text after it
+};
+
+class Flight : public Base {
+  public:
+    // nullptr when the file can't be made
+    static std::unique_ptr<Flight> create(unsigned int yield_time, bool quiet,
+        const std::string& spec, Pipeline* pipe);
+    virtual ~Flight();
+
+    // the summary of the seconds so far to stderr, headed by 'why'; from
+    // any thread
+    void dump(const char* why);
+
+  protected:
+    Flight() = delete;
+    Flight(unsigned int yield_time);
+    bool init(bool quiet, const std::string& spec, Pipeline* pipe);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    Pipeline* pipe_;
+    std::string path_;
+    unsigned int slot_num_;
+    const unsigned int slot_len_ = {64 * 1024};
+    static const unsigned int header_len_ = 4096;
+    const unsigned int trace_events_ = {8192};
+
+    int fd_;
+    unsigned char* map_;
+    size_t map_len_;
+    bool open();
+    void close();
+
+    bool flight_on_;
+    uint64_t seq_;
+    uint64_t trace_pos_;
+    bool traced_;               // we turned tracing on
+    std::map<std::string, std::unique_ptr<uint32_t[]>> lasts_;
+    std::chrono::steady_clock::time_point next_;
+    void sample();
+
+    unsigned int sample_cnt_;
+    unsigned int trunc_cnt_;
+    MicroDiffer<uint32_t> differ_sample_;
+
+    static void summary(const unsigned char* map, size_t len, const char* why);
+};
+
+} // namespace detector
+
+#endif // FLIGHT_H
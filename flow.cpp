@@ -0,0 +1,214 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "flow.h"
+#include "pyramid.h"
+
+namespace detector {
+
+Flow::Flow() {
+}
+
+Flow::~Flow() {
+}
+
+std::unique_ptr<Flow> Flow::create(unsigned int width, unsigned int height,
+    unsigned int pix_fmt) {
+  auto obj = std::unique_ptr<Flow>(new Flow());
+  obj->init(width, height, pix_fmt);
+  return obj;
+}
+
+bool Flow::init(unsigned int width, unsigned int height, unsigned int pix_fmt) {
+
+  pix_fmt_ = pix_fmt;
+  num_ = 0;
+
+  // the same sizes as the frame's pyramid, halved from there
+  unsigned int w = width / 2 / 2, h = height / 2 / 2;
+  prev_.clear();
+  for (unsigned int k = 0; k < levels_; k++, w /= 2, h /= 2) {
+    Flow::Plane p;
+    p.width = w;
+    p.height = h;
+    p.pix.resize(w * h);
+    prev_.push_back(p);
+  }
+  cur_ = prev_;
+
+  unsigned int n = 2 * radius_ + 1;
+  patch_.resize((n + 2) * (n + 2));
+  i_.resize(n * n);
+  ix_.resize(n * n);
+  iy_.resize(n * n);
+  j_.resize(n * n);
+  e_.resize(n * n);
+  return true;
+}
+
+bool Flow::add(const FrameBuf& frame) {
+
+  const Level* lvl = frame.levels ? frame.levels->get(2) : nullptr;
+  if (!lvl || lvl->width != cur_[0].width || lvl->height != cur_[0].height ||
+      (pix_fmt_ != V4L2_PIX_FMT_YUV420 && pix_fmt_ != V4L2_PIX_FMT_RGB24)) {
+    num_ = 0;
+    return false;
+  }
+  prev_.swap(cur_);
+
+  Flow::Plane& base = cur_[0];
+  for (unsigned int r = 0; r < base.height; r++) {
+    const unsigned char* src = lvl->addr + r * lvl->stride;
+    unsigned char* dst = base.pix.data() + r * base.width;
+    if (pix_fmt_ == V4L2_PIX_FMT_YUV420) {
+      std::memcpy(dst, src, base.width);
+    } else {
+      for (unsigned int c = 0; c < base.width; c++, src += 3) {
+        dst[c] = (src[0] + 2 * src[1] + src[2] + 2) >> 2;
+      }
+    }
+  }
+  for (unsigned int k = 1; k < levels_; k++) {
+    scale_half_plane(cur_[k - 1].pix.data(), cur_[k - 1].width,
+        cur_[k].pix.data(), cur_[k].width, cur_[k].width, cur_[k].height);
+  }
+
+  num_ = std::min(num_ + 1, 2u);
+  return num_ == 2;
+}
+
+bool Flow::point(float x, float y, float& dx, float& dy) {
+
+  const unsigned int n = 2 * radius_ + 1;
+  const unsigned int m = n + 2;     // a border for the gradients
+  const unsigned int len = n * n;
+  const int edge = radius_ + 2;
+
+  // the guess at each level is twice the one found on the level above
+  float gx = 0.f, gy = 0.f;
+  for (int k = levels_ - 1; k >= 0; k--) {
+    const Flow::Plane& a = prev_[k];
+    const Flow::Plane& b = cur_[k];
+    float px = x / (1 << k);
+    float py = y / (1 << k);
+    bool inside = px >= edge && py >= edge &&
+      px + edge < a.width && py + edge < a.height;
+    float vx = 0.f, vy = 0.f;
+    float gxx = 0.f, gxy = 0.f, gyy = 0.f, det = 0.f;
+    if (inside) {
+      sample_patch(a.pix.data(), a.width, px - radius_ - 1, py - radius_ - 1, m, m,
+          patch_.data());
+      for (unsigned int r = 0; r < n; r++) {
+        const float* row = patch_.data() + (r + 1) * m + 1;
+        for (unsigned int c = 0; c < n; c++) {
+          i_[r * n + c] = row[c];
+          ix_[r * n + c] = (row[c + 1] - row[c - 1]) * .5f;
+          iy_[r * n + c] = (row[c + m] - row[c - m]) * .5f;
+        }
+      }
+      gxx = dot_f32(ix_.data(), ix_.data(), len);
+      gxy = dot_f32(ix_.data(), iy_.data(), len);
+      gyy = dot_f32(iy_.data(), iy_.data(), len);
+      det = gxx * gyy - gxy * gxy;
+      float eig = (gxx + gyy - std::sqrt((gxx - gyy) * (gxx - gyy) + 4.f * gxy * gxy)) / 2.f;
+      inside = eig / len >= min_eig_ && det > 0.f;
+    }
+
+    // a coarse level without texture just passes its guess on
+    if (!inside) {
+      if (k == 0) {
+        return false;
+      }
+      gx *= 2.f;
+      gy *= 2.f;
+      continue;
+    }
+
+    for (unsigned int it = 0; it < iters_; it++) {
+      float qx = px + gx + vx;
+      float qy = py + gy + vy;
+      if (qx < edge || qy < edge || qx + edge >= b.width || qy + edge >= b.height) {
+        return false;
+      }
+      sample_patch(b.pix.data(), b.width, qx - radius_, qy - radius_, n, n, j_.data());
+      for (unsigned int i = 0; i < len; i++) {
+        e_[i] = i_[i] - j_[i];
+      }
+      float bx = dot_f32(e_.data(), ix_.data(), len);
+      float by = dot_f32(e_.data(), iy_.data(), len);
+      float ux = (gyy * bx - gxy * by) / det;
+      float uy = (gxx * by - gxy * bx) / det;
+      vx += ux;
+      vy += uy;
+      if (ux * ux + uy * uy < min_step_ * min_step_) {
+        break;
+      }
+    }
+    gx = (k > 0) ? 2.f * (gx + vx) : gx + vx;
+    gy = (k > 0) ? 2.f * (gy + vy) : gy + vy;
+  }
+
+  // a patch unlike the one it left is something else in front
+  float err = 0.f;
+  for (unsigned int i = 0; i < len; i++) {
+    err += std::fabs(e_[i]);
+  }
+  if (err / len > max_error_) {
+    return false;
+  }
+  dx = gx;
+  dy = gy;
+  return true;
+}
+
+bool Flow::follow(float x, float y, float w, float h, float& dx, float& dy) {
+
+  if (num_ < 2) {
+    return false;
+  }
+
+  // a grid in from the box's edges, at level 0
+  mx_.clear();
+  my_.clear();
+  for (unsigned int r = 0; r < grid_; r++) {
+    for (unsigned int c = 0; c < grid_; c++) {
+      float px = (x + w * (c + 1) / (grid_ + 1)) / scale_;
+      float py = (y + h * (r + 1) / (grid_ + 1)) / scale_;
+      float u, v;
+      if (point(px, py, u, v)) {
+        mx_.push_back(u);
+        my_.push_back(v);
+      }
+    }
+  }
+  if (mx_.size() < min_points_) {
+    return false;
+  }
+  auto mid = mx_.size() / 2;
+  std::nth_element(mx_.begin(), mx_.begin() + mid, mx_.end());
+  std::nth_element(my_.begin(), my_.begin() + mid, my_.end());
+  dx = mx_[mid] * scale_;
+  dy = my_[mid] * scale_;
+  return true;
+}
+
+} // namespace detector
@@ -0,0 +1,91 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Sparse optical flow for the tracker.
+ *
+ *  Each frame's 1/4 pyramid level, as luma, is the base of a small
+ *  pyramid of its own, three levels deep.  'follow' puts a 3x3 grid of
+ *  points inside a box and tracks each from the image before to the new
+ *  one with pyramidal Lucas-Kanade on 9x9 windows, coarse to fine.
+ *  Points without enough texture, that run off the image or that end on
+ *  a patch unlike the one they left are dropped, and the box moves by
+ *  the median of the rest.  The window samples and sums go through the
+ *  neon kernels (see kernels.h).
+ */
+
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <memory>
+#include <vector>
+
+#include "utils.h"
+#include "listener.h"
+
+namespace detector {
+
+class Flow {
+  public:
+    static std::unique_ptr<Flow> create(unsigned int width, unsigned int height,
+        unsigned int pix_fmt);
+    ~Flow();
+
+  public:
+    // the frame becomes the new image, false until there are two in a row
+    bool add(const FrameBuf& frame);
+
+    // how far the inside of a box, in frame pixels, moved from the image
+    // before to the new one, false when too few of its points made it
+    bool follow(float x, float y, float w, float h, float& dx, float& dy);
+
+  protected:
+    Flow();
+    bool init(unsigned int width, unsigned int height, unsigned int pix_fmt);
+
+  private:
+    class Plane {
+      public:
+        unsigned int width;
+        unsigned int height;
+        std::vector<unsigned char> pix;
+    };
+
+    unsigned int pix_fmt_;
+    std::vector<Flow::Plane> prev_;
+    std::vector<Flow::Plane> cur_;
+    unsigned int num_;    // images in a row
+
+    static constexpr unsigned int levels_{3};
+    static constexpr unsigned int scale_{4};      // level 0 is 1/4 of the frame
+    static constexpr int radius_{4};              // 9x9 windows
+    static constexpr unsigned int grid_{3};
+    static constexpr unsigned int min_points_{3};
+    static constexpr unsigned int iters_{8};
+    static constexpr float min_step_{0.03f};      // pixels
+    static constexpr float min_eig_{4.f};         // of the mean gradient matrix
+    static constexpr float max_error_{24.f};      // mean abs luma difference
+
+    std::vector<float> patch_, i_, ix_, iy_, j_, e_;
+    std::vector<float> mx_, my_;
+    bool point(float x, float y, float& dx, float& dy);
+};
+
+} // namespace detector
+
+#endif // FLOW_H
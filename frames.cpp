@@ -0,0 +1,93 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include "frames.h"
+
+namespace detector {
+
+std::mutex Frames::lock_;
+std::map<size_t, Frames::Class> Frames::classes_;
+
+Shape::Shape(unsigned int width, unsigned int height, unsigned int pix_fmt)
+  : width(width), height(height), pix_fmt(pix_fmt) {
+  slice = ALIGN_16B(height);
+  stride = (pix_fmt == V4L2_PIX_FMT_YUV420) ? ALIGN_16B(width) : ALIGN_16B(width) * 3;
+}
+
+size_t Shape::length() const {
+  size_t len = static_cast<size_t>(stride) * slice;
+  return (pix_fmt == V4L2_PIX_FMT_YUV420) ? len * 3 / 2 : len;
+}
+
+Planes::Planes(unsigned char* addr, const Shape& shape)
+  : y(addr), stride(shape.stride), width(shape.width), height(shape.height) {
+  yuv = (shape.pix_fmt == V4L2_PIX_FMT_YUV420);
+  if (yuv) {
+    u = addr + static_cast<size_t>(shape.stride) * shape.slice;
+    v = u + static_cast<size_t>(shape.stride / 2) * (shape.slice / 2);
+    uv_stride = shape.stride / 2;
+  } else {
+    u = nullptr;
+    v = nullptr;
+    uv_stride = 0;
+  }
+}
+
+FrameBuf Frames::take(const Shape& shape) {
+
+  size_t len = shape.length();
+  Bytes buf;
+  {
+    std::unique_lock<std::mutex> lck(lock_);
+    Frames::Class& cls = classes_[len];
+    if (!cls.free.empty()) {
+      buf = std::move(cls.free.back());
+      cls.free.pop_back();
+    } else {
+      cls.num++;
+    }
+  }
+  if (buf.empty()) {
+    buf.resize(len);
+  }
+
+  // the handle owns the buffer and gives it back
+  auto held = std::make_shared<Bytes>(std::move(buf));
+  FrameBuf fbuf;
+  fbuf.length = len;
+  fbuf.addr = held->data();
+  fbuf.ref = std::shared_ptr<void>(fbuf.addr, [held, len](void*) {
+    std::unique_lock<std::mutex> lck(lock_);
+    classes_[len].free.push_back(std::move(*held));
+  });
+  return fbuf;
+}
+
+void Frames::wrap(FrameBuf& fbuf, std::function<void()> done) {
+  fbuf.ref = std::shared_ptr<void>(fbuf.addr, [done](void*) { done(); });
+}
+
+void Frames::footprint(const Shape& shape, size_t& num, size_t& bytes) {
+  std::unique_lock<std::mutex> lck(lock_);
+  size_t len = shape.length();
+  auto it = classes_.find(len);
+  num = (it == classes_.end()) ? 0 : it->second.num;
+  bytes = num * len;
+}
+
+} // namespace detector
@@ -0,0 +1,104 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Frame buffers shared by the pipeline.
+ *
+ *  The buffers a stage makes for frames of its own (the pyramid levels,
+ *  a snapshot's masked copy) are taken here, by size class, instead of
+ *  each stage keeping its own: a Shape is the width, height and format
+ *  laid out like a captured frame (16 aligned strides and rows), and
+ *  every Shape of the same length shares a free list.  'take' hands out
+ *  a FrameBuf whose reference puts the buffer back on its list when the
+ *  last copy is dropped, and 'wrap' makes the same kind of handle for a
+ *  buffer someone else owns, a v4l2 or decoder buffer, with 'done' doing
+ *  the requeue.  So every frame in the pipeline is a FrameBuf, copies
+ *  share it and nobody needs to know where it goes back to.
+ *
+ *  Planes is the typed view of a frame: the y, u and v planes and their
+ *  strides of an i420 frame, or the one rgb24 plane.  The buffers come
+ *  from the reserve (see reserve.h) when there is one.
+ */
+
+#ifndef FRAMES_H
+#define FRAMES_H
+
+#include <map>
+#include <mutex>
+#include <vector>
+#include <functional>
+
+#include "listener.h"
+#include "reserve.h"
+
+namespace detector {
+
+class Shape {
+  public:
+    Shape() : width(0), height(0), pix_fmt(0), stride(0), slice(0) {}
+    Shape(unsigned int width, unsigned int height, unsigned int pix_fmt);
+  public:
+    unsigned int width;
+    unsigned int height;
+    unsigned int pix_fmt;
+    unsigned int stride;    // bytes, of the y plane for i420
+    unsigned int slice;     // rows
+    size_t length() const;
+};
+
+class Planes {
+  public:
+    Planes(unsigned char* addr, const Shape& shape);
+  public:
+    unsigned char* y;       // or the rgb24 plane
+    unsigned char* u;       // null for rgb24
+    unsigned char* v;
+    unsigned int stride;
+    unsigned int uv_stride;
+    unsigned int width;
+    unsigned int height;
+    bool yuv;
+};
+
+class Frames {
+  public:
+    // a frame of 'shape', its buffer goes back to its size class with
+    // the last copy
+    static FrameBuf take(const Shape& shape);
+
+    // 'fbuf' is someone else's buffer, 'done' runs when its last copy goes
+    static void wrap(FrameBuf& fbuf, std::function<void()> done);
+
+    // buffers made of 'shape's size class, out or free
+    static void footprint(const Shape& shape, size_t& num, size_t& bytes);
+
+  private:
+    Frames() = delete;
+
+    class Class {
+      public:
+        std::vector<Bytes> free;
+        size_t num = 0;
+    };
+    static std::mutex lock_;
+    static std::map<size_t, Frames::Class> classes_;
+};
+
+} // namespace detector
+
+#endif // FRAMES_H
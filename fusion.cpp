@@ -0,0 +1,439 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+#include "fusion.h"
+#include "metrics.h"
+
+namespace detector {
+
+bool Fusion::Input::addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks) {
+  Fusion::Post post{camera, tracks};
+  bool res = fusion->post_chan_.push(post);
+  fusion->wake();
+  return res;
+}
+
+Fusion::Fusion(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Fusion::~Fusion() {
+}
+
+std::unique_ptr<Fusion> Fusion::create(unsigned int yield_time, bool quiet,
+    float gate, unsigned int linger) {
+  auto obj = std::unique_ptr<Fusion>(new Fusion(yield_time));
+  obj->init(quiet, gate, linger);
+  return obj;
+}
+
+bool Fusion::init(bool quiet, float gate, unsigned int linger) {
+
+  quiet_ = quiet;
+  gate_ = (gate > 0.f) ? gate : 1.f;
+  linger_ = linger;
+  fusion_on_ = false;
+  tap_ = nullptr;
+
+  for (unsigned int c = 0; c < kCameras; c++) {
+    inputs_[c].fusion = this;
+    inputs_[c].camera = c;
+    inputs_[c].mapped = false;
+  }
+
+  global_cnt_ = 0;
+  handoff_cnt_ = 0;
+  post_cnt_ = 0;
+  return true;
+}
+
+bool Fusion::setHomography(unsigned int camera, const double h[9]) {
+
+  if (camera >= kCameras) {
+    return false;
+  }
+  double det = h[0] * (h[4] * h[8] - h[5] * h[7]) -
+    h[1] * (h[3] * h[8] - h[5] * h[6]) +
+    h[2] * (h[3] * h[7] - h[4] * h[6]);
+  if (std::fabs(det) < 1e-12) {
+    dbgMsg("camera %u homography is singular\n", camera);
+    return false;
+  }
+  std::copy(h, h + 9, inputs_[camera].h);
+  inputs_[camera].mapped = true;
+  return true;
+}
+
+bool Fusion::loadHomographies(const std::string& path) {
+
+  std::ifstream ifs(path.c_str(), std::ifstream::in);
+  if (!ifs) {
+    dbgMsg("could not open homographies %s\n", path.c_str());
+    return false;
+  }
+  std::string line;
+  while (std::getline(ifs, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream iss(line);
+    unsigned int camera;
+    double h[9];
+    if (!(iss >> camera >> h[0] >> h[1] >> h[2] >> h[3] >> h[4] >> h[5] >> h[6] >> h[7] >> h[8])) {
+      dbgMsg("bad homography line: %s\n", line.c_str());
+      return false;
+    }
+    if (!setHomography(camera, h)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Listener<std::shared_ptr<std::vector<TrackBuf>>>* Fusion::input(unsigned int camera) {
+  return (camera < kCameras) ? &inputs_[camera] : nullptr;
+}
+
+void Fusion::setTap(Listener<std::shared_ptr<std::vector<Fusion::Track>>>* tap) {
+  tap_ = tap;
+}
+
+std::shared_ptr<std::vector<Fusion::Track>> Fusion::getTracks() {
+  std::unique_lock<std::mutex> lck(posted_lock_);
+  return posted_;
+}
+
+void Fusion::metrics(Exposition& out, const std::string& labels) {
+  out.counter("detector_fusion_tracks_total", "global tracks started", labels, global_cnt_);
+  out.counter("detector_fusion_joins_total",
+      "local tracks that took an existing global track", labels, handoff_cnt_);
+  out.gauge("detector_fusion_tracks", "global tracks held or lingering", labels, global_num_);
+  out.gauge("detector_queue_depth", "messages waiting for the stage", labels,
+      post_chan_.size());
+  out.counter("detector_queue_drops_total", "messages the stage's queue dropped", labels,
+      post_chan_.drops());
+}
+
+bool Fusion::project(const Fusion::Input& in, const TrackBuf& t, float& x, float& y) {
+
+  // the foot point, where the track stands on the ground
+  if (!in.mapped) {
+    return false;
+  }
+  const double* h = in.h;
+  double u = t.x + t.w / 2.0;
+  double v = t.y + t.h;
+  double w = h[6] * u + h[7] * v + h[8];
+  if (std::fabs(w) < 1e-9) {
+    return false;
+  }
+  x = static_cast<float>((h[0] * u + h[1] * v + h[2]) / w);
+  y = static_cast<float>((h[3] * u + h[4] * v + h[5]) / w);
+  return std::isfinite(x) && std::isfinite(y);
+}
+
+int64_t Fusion::cellKey(float x, float y) {
+  int64_t cx = static_cast<int64_t>(std::floor(x / gate_));
+  int64_t cy = static_cast<int64_t>(std::floor(y / gate_));
+  // shifted unsigned, a cell left of or above the origin is negative
+  return static_cast<int64_t>((static_cast<uint64_t>(cy) << 32) ^
+      (static_cast<uint64_t>(cx) & 0xffffffff));
+}
+
+void Fusion::place(Fusion::Global& g) {
+
+  int64_t cell = cellKey(g.track.x, g.track.y);
+  if (cell == g.cell) {
+    return;
+  }
+  auto range = grid_.equal_range(g.cell);
+  for (auto it = range.first; it != range.second; it++) {
+    if (it->second == g.track.id) {
+      grid_.erase(it);
+      break;
+    }
+  }
+  g.cell = cell;
+  grid_.emplace(cell, g.track.id);
+}
+
+unsigned int Fusion::nearest(unsigned int camera, BoxBuf::Type type, float x, float y) {
+
+  unsigned int best = 0;
+  float best_dist = gate_;
+  for (int dy = -1; dy <= 1; dy++) {
+    for (int dx = -1; dx <= 1; dx++) {
+      auto range = grid_.equal_range(cellKey(x + dx * gate_, y + dy * gate_));
+      for (auto it = range.first; it != range.second; it++) {
+        const Fusion::Track& t = globals_[slot_[it->second]].track;
+        if (t.type != type || (t.cameras & (1u << camera))) {
+          continue;
+        }
+        float dist = std::hypot(t.x - x, t.y - y);
+        if (dist < best_dist) {
+          best = t.id;
+          best_dist = dist;
+        }
+      }
+    }
+  }
+  return best;
+}
+
+unsigned int Fusion::startGlobal(unsigned int camera, const TrackBuf& t, float x, float y) {
+
+  Fusion::Global g;
+  g.track.id = ++global_cnt_;
+  g.track.type = t.type;
+  g.track.x = x;
+  g.track.y = y;
+  g.track.vx = 0.f;
+  g.track.vy = 0.f;
+  g.track.stamp = {};
+  g.track.cameras = 0;
+  g.cell = cellKey(x, y);
+  slot_[g.track.id] = globals_.size();
+  grid_.emplace(g.cell, g.track.id);
+  globals_.push_back(g);
+  return g.track.id;
+}
+
+void Fusion::update(Fusion::Global& g, unsigned int camera, float x, float y,
+    std::chrono::steady_clock::time_point stamp) {
+
+  // velocity from this camera's own last sighting, cameras don't agree exactly
+  unsigned int bit = 1u << camera;
+  Fusion::Seen& s = g.seen[camera];
+  if ((g.track.cameras & bit) && stamp > s.stamp) {
+    float dt = std::chrono::duration_cast<std::chrono::duration<float>>(stamp - s.stamp).count();
+    g.track.vx += ((x - s.x) / dt - g.track.vx) / 4.f;
+    g.track.vy += ((y - s.y) / dt - g.track.vy) / 4.f;
+  }
+  s.x = x;
+  s.y = y;
+  s.stamp = stamp;
+  g.track.cameras |= bit;
+
+  // the mean of every camera holding it
+  float sx = 0.f, sy = 0.f;
+  unsigned int num = 0;
+  for (unsigned int c = 0; c < kCameras; c++) {
+    if (g.track.cameras & (1u << c)) {
+      sx += g.seen[c].x;
+      sy += g.seen[c].y;
+      num++;
+    }
+  }
+  g.track.x = sx / num;
+  g.track.y = sy / num;
+  g.track.stamp = std::max(g.track.stamp, stamp);
+  g.held = g.track.stamp;
+  place(g);
+}
+
+void Fusion::release(unsigned int camera, unsigned int local_id) {
+
+  uint64_t key = (static_cast<uint64_t>(camera) << 32) | local_id;
+  auto it = bound_.find(key);
+  if (it == bound_.end()) {
+    return;
+  }
+  auto at = slot_.find(it->second);
+  bound_.erase(it);
+  if (at == slot_.end()) {
+    return;
+  }
+
+  // what the other cameras still see, or where it was last
+  Fusion::Global& g = globals_[at->second];
+  g.track.cameras &= ~(1u << camera);
+  if (g.track.cameras) {
+    float sx = 0.f, sy = 0.f;
+    unsigned int num = 0;
+    for (unsigned int c = 0; c < kCameras; c++) {
+      if (g.track.cameras & (1u << c)) {
+        sx += g.seen[c].x;
+        sy += g.seen[c].y;
+        num++;
+      }
+    }
+    g.track.x = sx / num;
+    g.track.y = sy / num;
+    place(g);
+  }
+}
+
+void Fusion::fuse(unsigned int camera, const std::vector<TrackBuf>& tracks) {
+
+  now_live_.clear();
+  for (auto& t : tracks) {
+    float x, y;
+    if (!project(inputs_[camera], t, x, y)) {
+      continue;
+    }
+    now_live_.push_back(t.id);
+
+    uint64_t key = (static_cast<uint64_t>(camera) << 32) | t.id;
+    auto it = bound_.find(key);
+    unsigned int gid = (it != bound_.end()) ? it->second : 0;
+    if (gid == 0) {
+      gid = nearest(camera, t.type, x, y);
+      if (gid) {
+        handoff_cnt_++;
+      } else {
+        gid = startGlobal(camera, t, x, y);
+      }
+      bound_[key] = gid;
+    }
+    auto at = slot_.find(gid);
+    if (at != slot_.end()) {
+      update(globals_[at->second], camera, x, y,
+          (t.stamp.time_since_epoch().count() != 0) ? t.stamp : std::chrono::steady_clock::now());
+    }
+  }
+
+  // local tracks the camera no longer posts let go of theirs
+  std::sort(now_live_.begin(), now_live_.end());
+  for (auto id : live_[camera]) {
+    if (!std::binary_search(now_live_.begin(), now_live_.end(), id)) {
+      release(camera, id);
+    }
+  }
+  live_[camera].swap(now_live_);
+}
+
+bool Fusion::expire(std::chrono::steady_clock::time_point now) {
+
+  bool gone = false;
+  for (unsigned int i = 0; i < globals_.size(); ) {
+    Fusion::Global& g = globals_[i];
+    if (g.track.cameras || now - g.held <= std::chrono::milliseconds(linger_)) {
+      i++;
+      continue;
+    }
+    auto range = grid_.equal_range(g.cell);
+    for (auto it = range.first; it != range.second; it++) {
+      if (it->second == g.track.id) {
+        grid_.erase(it);
+        break;
+      }
+    }
+    slot_.erase(g.track.id);
+    if (i != globals_.size() - 1) {
+      globals_[i] = globals_.back();
+      slot_[globals_[i].track.id] = i;
+    }
+    globals_.pop_back();
+    gone = true;
+  }
+  return gone;
+}
+
+void Fusion::post() {
+
+  auto tracks = std::make_shared<std::vector<Fusion::Track>>();
+  tracks->reserve(globals_.size());
+  for (auto& g : globals_) {
+    if (g.track.cameras) {
+      tracks->push_back(g.track);
+    }
+  }
+  {
+    std::unique_lock<std::mutex> lck(posted_lock_);
+    posted_ = tracks;
+  }
+  if (tap_) {
+    tap_->addMessage(tracks);
+  }
+  post_cnt_++;
+}
+
+bool Fusion::waitingToRun() {
+
+  if (!fusion_on_) {
+    globals_.clear();
+    slot_.clear();
+    bound_.clear();
+    grid_.clear();
+    for (unsigned int c = 0; c < kCameras; c++) {
+      live_[c].clear();
+    }
+    expire_at_ = std::chrono::steady_clock::now();
+    fusion_on_ = true;
+  }
+  return true;
+}
+
+bool Fusion::running() {
+
+  if (fusion_on_) {
+    bool changed = false;
+    Fusion::Post post_in;
+    while (post_chan_.pop(post_in)) {
+      if (post_in.tracks) {
+        differ_fuse_.begin();
+        fuse(post_in.camera, *post_in.tracks);
+        differ_fuse_.end();
+        changed = true;
+      }
+    }
+
+    // lingering tracks only need a look now and then
+    auto now = std::chrono::steady_clock::now();
+    if (now >= expire_at_) {
+      expire(now);
+      expire_at_ = now + std::chrono::milliseconds(expire_period_);
+    }
+    if (changed) {
+      post();
+    }
+    global_num_ = globals_.size();
+  }
+  return true;
+}
+
+bool Fusion::paused() {
+  return true;
+}
+
+bool Fusion::waitingToHalt() {
+
+  if (fusion_on_) {
+    fusion_on_ = false;
+
+    if (!quiet_) {
+      fprintf(stderr, "\nFusion Results...\n");
+      fprintf(stderr, "        global tracks: %u\n", global_cnt_);
+      fprintf(stderr, "  joined local tracks: %u\n", handoff_cnt_);
+      fprintf(stderr, "          track posts: %u\n", post_cnt_);
+      fprintf(stderr, "       fuse time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_fuse_.pct(.5), differ_fuse_.pct(.9), differ_fuse_.pct(.99), differ_fuse_.pct(.999),
+          differ_fuse_.high, differ_fuse_.avg, 
+          differ_fuse_.low,  differ_fuse_.cnt);
+      fprintf(stderr, "\n");
+    }
+  }
+  return true;
+}
+
+} // namespace detector
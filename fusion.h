@@ -0,0 +1,181 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Cross camera track fusion.
+ *
+ *  Cameras that overlap on one device each run a session and a tracker.
+ *  Each session with 'fusion' set hands its posted tracks to one Fusion
+ *  stage, tagged with its camera.  A track's foot point (the middle of
+ *  its bottom edge) goes through its camera's homography to a shared
+ *  ground plane, and the stage keeps global tracks there:
+ *
+ *    - a local track stays bound to the global track it got first
+ *    - a new local track takes the nearest global track of its type
+ *      within 'gate' that its camera isn't already holding, so a person
+ *      walking from one camera into the next keeps one global id
+ *    - a new local track that finds none starts a global track
+ *    - a global track no camera holds lingers 'linger' msec for the one
+ *      it walked towards to pick it up, then is dropped
+ *
+ *  The global position is the mean of the cameras' latest foot points,
+ *  with a smoothed velocity.  The ground positions are bucketed in
+ *  'gate' sized cells, so a lookup only reads the 3x3 cells around it
+ *  and hundreds of tracks stay cheap.  Homographies are row-major 3x3,
+ *  image pixels to ground units (say metres), from 'setHomography' or a
+ *  file with "camera h00 h01 ... h22" per line.  The fused tracks go to
+ *  the tap on every change.  Create it, start and run it before the
+ *  sessions that feed it and stop it after them.
+ */
+
+#ifndef FUSION_H
+#define FUSION_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <atomic>
+#include <cstdint>
+
+#include "utils.h"
+#include "listener.h"
+#include "channel.h"
+#include "base.h"
+
+namespace detector {
+
+class Fusion : public Base {
+  public:
+    static std::unique_ptr<Fusion> create(unsigned int yield_time, bool quiet,
+        float gate, unsigned int linger);
+    virtual ~Fusion();
+
+  public:
+    // a track on the ground plane and the local tracks it fuses
+    class Track {
+      public:
+        unsigned int id;
+        BoxBuf::Type type;
+        float x, y;             // ground units
+        float vx, vy;           // ground units per second
+        std::chrono::steady_clock::time_point stamp;
+        unsigned int cameras;   // bit per camera holding it
+    };
+
+    // set before start, false for a singular matrix
+    bool setHomography(unsigned int camera, const double h[9]);
+    bool loadHomographies(const std::string& path);
+
+    // where camera 'camera''s tracker posts, see Tracker::setFusion
+    Listener<std::shared_ptr<std::vector<TrackBuf>>>* input(unsigned int camera);
+
+    // the fused tracks also go here, set before start
+    void setTap(Listener<std::shared_ptr<std::vector<Fusion::Track>>>* tap);
+
+    // the fused tracks last posted, may be null
+    std::shared_ptr<std::vector<Fusion::Track>> getTracks();
+
+    virtual void metrics(Exposition& out, const std::string& labels);
+
+    static constexpr unsigned int kCameras = 32;
+
+  protected:
+    Fusion() = delete;
+    Fusion(unsigned int yield_time);
+    bool init(bool quiet, float gate, unsigned int linger);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    float gate_;
+    unsigned int linger_;
+    std::atomic<bool> fusion_on_;
+    std::chrono::steady_clock::time_point expire_at_;
+    static constexpr unsigned int expire_period_{100};  // msec
+
+    class Input : public Listener<std::shared_ptr<std::vector<TrackBuf>>> {
+      public:
+        Fusion* fusion;
+        unsigned int camera;
+        double h[9];
+        bool mapped;
+        virtual bool addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks);
+    };
+    Fusion::Input inputs_[kCameras];
+
+    class Post {
+      public:
+        unsigned int camera;
+        std::shared_ptr<std::vector<TrackBuf>> tracks;
+    };
+    Channel<Fusion::Post> post_chan_{2 * kCameras, Channel<Fusion::Post>::Policy::kDropOldest};
+
+    // a camera's latest sighting of a global track
+    class Seen {
+      public:
+        float x, y;
+        std::chrono::steady_clock::time_point stamp;
+    };
+    class Global {
+      public:
+        Fusion::Track track;
+        Fusion::Seen seen[kCameras];
+        std::chrono::steady_clock::time_point held;   // last held by a camera
+        int64_t cell;
+    };
+    std::vector<Fusion::Global> globals_;
+    std::unordered_map<unsigned int, unsigned int> slot_;     // global id to index
+    std::unordered_map<uint64_t, unsigned int> bound_;        // camera, local id to global id
+    std::unordered_multimap<int64_t, unsigned int> grid_;     // cell to global id
+    std::vector<unsigned int> live_[kCameras];                // local ids on the last post
+    std::vector<unsigned int> now_live_;
+
+    unsigned int global_cnt_;
+    unsigned int handoff_cnt_;
+    unsigned int post_cnt_;
+    std::atomic<unsigned int> global_num_{0};
+
+    Listener<std::shared_ptr<std::vector<Fusion::Track>>>* tap_;
+    std::mutex posted_lock_;
+    std::shared_ptr<std::vector<Fusion::Track>> posted_;
+
+    MicroDiffer<uint32_t> differ_fuse_;
+
+    bool project(const Fusion::Input& in, const TrackBuf& t, float& x, float& y);
+    int64_t cellKey(float x, float y);
+    void place(Fusion::Global& g);
+    unsigned int nearest(unsigned int camera, BoxBuf::Type type, float x, float y);
+    unsigned int startGlobal(unsigned int camera, const TrackBuf& t, float x, float y);
+    void update(Fusion::Global& g, unsigned int camera, float x, float y,
+        std::chrono::steady_clock::time_point stamp);
+    void release(unsigned int camera, unsigned int local_id);
+    void fuse(unsigned int camera, const std::vector<TrackBuf>& tracks);
+    bool expire(std::chrono::steady_clock::time_point now);
+    void post();
+};
+
+} // namespace detector
+
+#endif // FUSION_H
@@ -0,0 +1,490 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include "gles.h"
+
+#ifdef HAVE_GLES
+
+#include <string.h>
+#include <mutex>
+#include <atomic>
+#include <map>
+#include <array>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#ifdef HAVE_LIBBCM_HOST
+#include <bcm_host.h>
+#endif
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+
+// the Broadcom headers predate dmabuf import, Mesa's have it
+#ifndef EGL_LINUX_DMA_BUF_EXT
+#define EGL_LINUX_DMA_BUF_EXT           0x3270
+#define EGL_LINUX_DRM_FOURCC_EXT        0x3271
+#define EGL_DMA_BUF_PLANE0_FD_EXT       0x3272
+#define EGL_DMA_BUF_PLANE0_OFFSET_EXT   0x3273
+#define EGL_DMA_BUF_PLANE0_PITCH_EXT    0x3274
+#endif
+
+namespace detector {
+
+// drm fourccs, without pulling in libdrm
+static constexpr uint32_t fourcc(char a, char b, char c, char d) {
+  return static_cast<uint32_t>(a) | (static_cast<uint32_t>(b) << 8) |
+    (static_cast<uint32_t>(c) << 16) | (static_cast<uint32_t>(d) << 24);
+}
+static const uint32_t kDrmR8 = fourcc('R', '8', ' ', ' ');
+static const uint32_t kDrmBgr888 = fourcc('B', 'G', '2', '4');   // r, g, b in memory
+
+static const char* kVertex =
+  "attribute vec2 pos;\n"
+  "attribute vec2 coord;\n"
+  "varying vec2 tc;\n"
+  "void main() {\n"
+  "  tc = coord;\n"
+  "  gl_Position = vec4(pos, 0.0, 1.0);\n"
+  "}\n";
+
+// yuv2rgb's 6 bit fixed point, as floats
+static const char* kYuv =
+  "precision mediump float;\n"
+  "varying vec2 tc;\n"
+  "uniform sampler2D ty;\n"
+  "uniform sampler2D tu;\n"
+  "uniform sampler2D tv;\n"
+  "void main() {\n"
+  "  float l = (texture2D(ty, tc).r * 255.0 - 16.0) * 1.15625;\n"
+  "  float u = texture2D(tu, tc).r * 255.0 - 128.0;\n"
+  "  float v = texture2D(tv, tc).r * 255.0 - 128.0;\n"
+  "  gl_FragColor = vec4(vec3(l + 1.59375 * v, l - 0.8125 * v - 0.390625 * u,\n"
+  "      l + 2.015625 * u) / 255.0, 1.0);\n"
+  "}\n";
+
+static const char* kRgb =
+  "precision mediump float;\n"
+  "varying vec2 tc;\n"
+  "uniform sampler2D ty;\n"
+  "void main() {\n"
+  "  gl_FragColor = vec4(texture2D(ty, tc).rgb, 1.0);\n"
+  "}\n";
+
+typedef EGLImageKHR (*CreateImage)(EGLDisplay, EGLContext, EGLenum, EGLClientBuffer, const EGLint*);
+typedef EGLBoolean (*DestroyImage)(EGLDisplay, EGLImageKHR);
+typedef void (*TargetTexture)(GLenum, void*);
+
+class Gles::Impl {
+  public:
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int pix_fmt = 0;
+    unsigned int planes = 1;
+
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLConfig config = nullptr;
+    EGLContext context = EGL_NO_CONTEXT;
+    EGLSurface surface = EGL_NO_SURFACE;
+    unsigned int surface_width = 0;
+    unsigned int surface_height = 0;
+
+    GLuint program = 0;
+    GLint loc_pos = -1;
+    GLint loc_coord = -1;
+    GLuint tex[3] = { 0, 0, 0 };
+    unsigned int tex_width = 0;     // as uploaded, 0 after an import
+    unsigned int tex_height = 0;
+
+    // a frame's planes as EGLImages, by its mapping and dmabuf
+    CreateImage create_image = nullptr;
+    DestroyImage destroy_image = nullptr;
+    TargetTexture target_texture = nullptr;
+    std::map<std::pair<const unsigned char*, int>, std::array<EGLImageKHR, 3>> images;
+    const size_t images_max = {32};
+    bool dmabuf = false;
+
+    std::vector<unsigned char> rgba;
+
+    // the counts are bumped without 'lock', a busy scale never holds it
+    std::mutex lock;
+    std::atomic<unsigned int> scaled_cnt = {0};
+    std::atomic<unsigned int> imported_cnt = {0};
+    std::atomic<unsigned int> busy_cnt = {0};
+
+    ~Impl() {
+      if (display == EGL_NO_DISPLAY) {
+        return;
+      }
+      if (context != EGL_NO_CONTEXT) {
+        eglMakeCurrent(display, surface, surface, context);
+        forget();
+        glDeleteTextures(3, tex);
+        if (program) {
+          glDeleteProgram(program);
+        }
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(display, context);
+      }
+      if (surface != EGL_NO_SURFACE) {
+        eglDestroySurface(display, surface);
+      }
+      eglTerminate(display);
+    }
+
+    void forget() {
+      for (auto& i : images) {
+        for (unsigned int p = 0; p < planes; p++) {
+          destroy_image(display, i.second[p]);
+        }
+      }
+      images.clear();
+    }
+
+    // the read back is the size of the surface
+    bool resize(unsigned int w, unsigned int h) {
+      if (w == surface_width && h == surface_height) {
+        return true;
+      }
+      EGLint attribs[] = { EGL_WIDTH, static_cast<EGLint>(w), EGL_HEIGHT, static_cast<EGLint>(h), EGL_NONE };
+      EGLSurface next = eglCreatePbufferSurface(display, config, attribs);
+      if (next == EGL_NO_SURFACE) {
+        dbgMsg("failed: gles surface %ux%u (egl: 0x%x)\n", w, h, eglGetError());
+        return false;
+      }
+      eglMakeCurrent(display, next, next, context);
+      if (surface != EGL_NO_SURFACE) {
+        eglDestroySurface(display, surface);
+      }
+      surface = next;
+      surface_width = w;
+      surface_height = h;
+      rgba.resize(w * h * 4);
+      return true;
+    }
+
+    GLuint compile(GLenum type, const char* src) {
+      GLuint s = glCreateShader(type);
+      glShaderSource(s, 1, &src, nullptr);
+      glCompileShader(s);
+      GLint ok = 0;
+      glGetShaderiv(s, GL_COMPILE_STATUS, &ok);
+      if (!ok) {
+        char log[512] = "";
+        glGetShaderInfoLog(s, sizeof(log), nullptr, log);
+        dbgMsg("failed: gles shader: %s\n", log);
+        glDeleteShader(s);
+        return 0;
+      }
+      return s;
+    }
+
+    // the frame's planes as imported images, made the first time a
+    // buffer is seen; false when the driver won't
+    bool import(const FrameBuf& frame, unsigned int stride, unsigned int slice) {
+      auto key = std::make_pair(frame.addr, frame.fd);
+      auto it = images.find(key);
+      if (it == images.end()) {
+        if (images.size() >= images_max) {
+          forget();
+        }
+        std::array<EGLImageKHR, 3> img = { EGL_NO_IMAGE_KHR, EGL_NO_IMAGE_KHR, EGL_NO_IMAGE_KHR };
+        unsigned int offset = 0;
+        for (unsigned int p = 0; p < planes; p++) {
+          unsigned int w = p ? width / 2 : width;
+          unsigned int h = p ? height / 2 : height;
+          unsigned int pitch = p ? stride / 2 : stride;
+          EGLint attribs[] = {
+            EGL_WIDTH, static_cast<EGLint>(w),
+            EGL_HEIGHT, static_cast<EGLint>(h),
+            EGL_LINUX_DRM_FOURCC_EXT, static_cast<EGLint>(planes == 3 ? kDrmR8 : kDrmBgr888),
+            EGL_DMA_BUF_PLANE0_FD_EXT, frame.fd,
+            EGL_DMA_BUF_PLANE0_OFFSET_EXT, static_cast<EGLint>(offset),
+            EGL_DMA_BUF_PLANE0_PITCH_EXT, static_cast<EGLint>(pitch),
+            EGL_NONE };
+          img[p] = create_image(display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, nullptr, attribs);
+          if (img[p] == EGL_NO_IMAGE_KHR) {
+            dbgMsg("warning: gles can't import dmabufs (egl: 0x%x), uploading\n", eglGetError());
+            for (unsigned int q = 0; q < p; q++) {
+              destroy_image(display, img[q]);
+            }
+            dmabuf = false;
+            return false;
+          }
+          offset += (p ? (stride / 2) * (slice / 2) : stride * slice);
+        }
+        it = images.emplace(key, img).first;
+      }
+      for (unsigned int p = 0; p < planes; p++) {
+        glActiveTexture(GL_TEXTURE0 + p);
+        glBindTexture(GL_TEXTURE_2D, tex[p]);
+        target_texture(GL_TEXTURE_2D, it->second[p]);
+      }
+      tex_width = 0;
+      tex_height = 0;
+      return true;
+    }
+
+    // the rows 'src' covers, whole, as textures of their own
+    void upload(const FrameBuf& frame, unsigned int stride, unsigned int slice,
+        unsigned int top, unsigned int rows) {
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+      unsigned int w = (planes == 3) ? stride : stride / 3;
+      bool fresh = (w != tex_width || rows != tex_height);
+      const unsigned char* u = frame.addr + stride * slice;
+      const unsigned char* v = u + (stride / 2) * (slice / 2);
+      for (unsigned int p = 0; p < planes; p++) {
+        glActiveTexture(GL_TEXTURE0 + p);
+        glBindTexture(GL_TEXTURE_2D, tex[p]);
+        unsigned int pw = p ? w / 2 : w;
+        unsigned int ph = p ? rows / 2 : rows;
+        const unsigned char* at = (p == 0) ? frame.addr + top * stride :
+          ((p == 1) ? u : v) + (top / 2) * (stride / 2);
+        GLenum fmt = (planes == 3) ? GL_LUMINANCE : GL_RGB;
+        if (fresh) {
+          glTexImage2D(GL_TEXTURE_2D, 0, fmt, pw, ph, 0, fmt, GL_UNSIGNED_BYTE, at);
+        } else {
+          glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, pw, ph, fmt, GL_UNSIGNED_BYTE, at);
+        }
+      }
+      tex_width = w;
+      tex_height = rows;
+    }
+};
+
+Gles::Gles() {
+}
+
+Gles::~Gles() {
+}
+
+std::unique_ptr<Gles> Gles::create(unsigned int width, unsigned int height,
+    unsigned int pix_fmt) {
+  auto obj = std::unique_ptr<Gles>(new Gles());
+  if (!obj->init(width, height, pix_fmt)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Gles::available() {
+  return true;
+}
+
+bool Gles::init(unsigned int width, unsigned int height, unsigned int pix_fmt) {
+
+  impl_ = std::unique_ptr<Impl>(new Impl());
+  Impl& im = *impl_;
+  im.width = width;
+  im.height = height;
+  im.pix_fmt = pix_fmt;
+  if (pix_fmt != V4L2_PIX_FMT_YUV420 && pix_fmt != V4L2_PIX_FMT_RGB24) {
+    dbgMsg("failed: gles takes i420 or rgb24, not %s\n", PixelFormatToStr(pix_fmt));
+    return false;
+  }
+  im.planes = (pix_fmt == V4L2_PIX_FMT_YUV420) ? 3 : 1;
+
+#ifdef HAVE_LIBBCM_HOST
+  bcm_host_init();
+#endif
+  im.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (im.display == EGL_NO_DISPLAY || !eglInitialize(im.display, nullptr, nullptr)) {
+    dbgMsg("failed: egl display\n");
+    im.display = EGL_NO_DISPLAY;
+    return false;
+  }
+  EGLint attribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+    EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+    EGL_NONE };
+  EGLint num = 0;
+  if (!eglChooseConfig(im.display, attribs, &im.config, 1, &num) || num < 1 ||
+      !eglBindAPI(EGL_OPENGL_ES_API)) {
+    dbgMsg("failed: egl config\n");
+    return false;
+  }
+  EGLint ctx[] = { EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE };
+  im.context = eglCreateContext(im.display, im.config, EGL_NO_CONTEXT, ctx);
+  if (im.context == EGL_NO_CONTEXT || !im.resize(16, 16)) {
+    dbgMsg("failed: egl context (egl: 0x%x)\n", eglGetError());
+    return false;
+  }
+
+  const char* ext = eglQueryString(im.display, EGL_EXTENSIONS);
+  im.create_image = reinterpret_cast<CreateImage>(eglGetProcAddress("eglCreateImageKHR"));
+  im.destroy_image = reinterpret_cast<DestroyImage>(eglGetProcAddress("eglDestroyImageKHR"));
+  im.target_texture = reinterpret_cast<TargetTexture>(eglGetProcAddress("glEGLImageTargetTexture2DOES"));
+  im.dmabuf = ext && strstr(ext, "EGL_EXT_image_dma_buf_import") &&
+    im.create_image && im.destroy_image && im.target_texture;
+
+  GLuint vs = im.compile(GL_VERTEX_SHADER, kVertex);
+  GLuint fs = im.compile(GL_FRAGMENT_SHADER, im.planes == 3 ? kYuv : kRgb);
+  if (!vs || !fs) {
+    return false;
+  }
+  im.program = glCreateProgram();
+  glAttachShader(im.program, vs);
+  glAttachShader(im.program, fs);
+  glLinkProgram(im.program);
+  glDeleteShader(vs);
+  glDeleteShader(fs);
+  GLint ok = 0;
+  glGetProgramiv(im.program, GL_LINK_STATUS, &ok);
+  if (!ok) {
+    dbgMsg("failed: gles link\n");
+    return false;
+  }
+  glUseProgram(im.program);
+  im.loc_pos = glGetAttribLocation(im.program, "pos");
+  im.loc_coord = glGetAttribLocation(im.program, "coord");
+  const char* samplers[] = { "ty", "tu", "tv" };
+  glGenTextures(3, im.tex);
+  for (unsigned int p = 0; p < im.planes; p++) {
+    glUniform1i(glGetUniformLocation(im.program, samplers[p]), p);
+    glActiveTexture(GL_TEXTURE0 + p);
+    glBindTexture(GL_TEXTURE_2D, im.tex[p]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  }
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+  dbgMsg("gles: %s, %s\n", glGetString(GL_RENDERER) ?
+      reinterpret_cast<const char*>(glGetString(GL_RENDERER)) : "unknown",
+      im.dmabuf ? "dmabuf import" : "uploads");
+  eglMakeCurrent(im.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  return true;
+}
+
+bool Gles::scale(const FrameBuf& frame, unsigned int stride, unsigned int slice,
+    const Rect& src, unsigned char* dst, unsigned int dst_width,
+    unsigned int dst_height, const Rect& dst_rect, unsigned char fill) {
+
+  Impl& im = *impl_;
+  if (!frame.addr || src.w == 0 || src.h == 0 || dst_rect.w == 0 || dst_rect.h == 0) {
+    return false;
+  }
+  std::unique_lock<std::mutex> lck(im.lock, std::try_to_lock);
+  if (!lck.owns_lock()) {
+    im.busy_cnt.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  if (!eglMakeCurrent(im.display, im.surface, im.surface, im.context)) {
+    return false;
+  }
+  if (!im.resize(dst_width, dst_height)) {
+    eglMakeCurrent(im.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    return false;
+  }
+
+  // where 'src' is in the textures, 0..1
+  float u0, u1, v0, v1;
+  if (im.dmabuf && frame.fd >= 0 && im.import(frame, stride, slice)) {
+    u0 = static_cast<float>(src.x) / im.width;
+    u1 = static_cast<float>(src.x + src.w) / im.width;
+    v0 = static_cast<float>(src.y) / im.height;
+    v1 = static_cast<float>(src.y + src.h) / im.height;
+    im.imported_cnt.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    unsigned int top = src.y & ~1u;
+    unsigned int rows = std::min((src.y + src.h - top + 1) & ~1u, im.height - top);
+    im.upload(frame, stride, slice, top, rows);
+    u0 = static_cast<float>(src.x) / im.tex_width;
+    u1 = static_cast<float>(src.x + src.w) / im.tex_width;
+    v0 = static_cast<float>(src.y - top) / rows;
+    v1 = static_cast<float>(src.y + src.h - top) / rows;
+  }
+
+  // gl's rows go up, so the frame's top goes at the bottom and the read
+  // back comes out top first
+  const GLfloat pos[] = { -1.f, -1.f, 1.f, -1.f, -1.f, 1.f, 1.f, 1.f };
+  const GLfloat coord[] = { u0, v0, u1, v0, u0, v1, u1, v1 };
+  glViewport(0, 0, dst_width, dst_height);
+  glClearColor(fill / 255.f, fill / 255.f, fill / 255.f, 1.f);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glViewport(dst_rect.x, dst_rect.y, dst_rect.w, dst_rect.h);
+  glUseProgram(im.program);
+  glVertexAttribPointer(im.loc_pos, 2, GL_FLOAT, GL_FALSE, 0, pos);
+  glVertexAttribPointer(im.loc_coord, 2, GL_FLOAT, GL_FALSE, 0, coord);
+  glEnableVertexAttribArray(im.loc_pos);
+  glEnableVertexAttribArray(im.loc_coord);
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+  glReadPixels(0, 0, dst_width, dst_height, GL_RGBA, GL_UNSIGNED_BYTE, im.rgba.data());
+  bool ok = glGetError() == GL_NO_ERROR;
+  eglMakeCurrent(im.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  if (!ok) {
+    dbgMsg("failed: gles scale\n");
+    return false;
+  }
+
+  const unsigned char* in = im.rgba.data();
+  for (unsigned int i = 0, n = dst_width * dst_height; i < n; i++, in += 4, dst += 3) {
+    dst[0] = in[0];
+    dst[1] = in[1];
+    dst[2] = in[2];
+  }
+  im.scaled_cnt.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+unsigned int Gles::scaled() {
+  return impl_->scaled_cnt.load(std::memory_order_relaxed);
+}
+
+unsigned int Gles::imported() {
+  return impl_->imported_cnt.load(std::memory_order_relaxed);
+}
+
+unsigned int Gles::busy() {
+  return impl_->busy_cnt.load(std::memory_order_relaxed);
+}
+
+} // namespace detector
+
+#else
+
+namespace detector {
+
+class Gles::Impl {
+};
+
+Gles::Gles() {
+}
+
+Gles::~Gles() {
+}
+
+std::unique_ptr<Gles> Gles::create(unsigned int width, unsigned int height,
+    unsigned int pix_fmt) {
+  dbgMsg("failed: built without gles\n");
+  return nullptr;
+}
+
+bool Gles::available() { return false; }
+bool Gles::init(unsigned int, unsigned int, unsigned int) { return false; }
+bool Gles::scale(const FrameBuf&, unsigned int, unsigned int, const Rect&, unsigned char*,
+    unsigned int, unsigned int, const Rect&, unsigned char) { return false; }
+unsigned int Gles::scaled() { return 0; }
+unsigned int Gles::imported() { return 0; }
+unsigned int Gles::busy() { return 0; }
+
+} // namespace detector
+
+#endif // HAVE_GLES
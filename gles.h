@@ -0,0 +1,84 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Model input on the gpu.
+ *
+ *  With --gles the model's input is made by the VideoCore instead of the
+ *  arm cores: the part of the frame the model looks at goes up as
+ *  textures, a shader converts it to rgb (the same bt.601 studio swing
+ *  as yuv2rgb) and scales it bilinearly into the letterboxed model
+ *  input, and that is read back.  A frame in a dmabuf is imported as an
+ *  EGLImage rather than uploaded where the driver can (Mesa's
+ *  EGL_EXT_image_dma_buf_import), so it is shared with capture and the
+ *  encoder as it is; the Broadcom driver only takes uploads, of the rows
+ *  the crop needs.  Scaling is the gpu's filtering, so the scaler's
+ *  output and this one's agree to a level or so.
+ *
+ *  A context is only current on one thread at a time, so one prep thread
+ *  has the gpu and any other prep thread that finds it busy scales on
+ *  its core as before, neither waits on the other.
+ *
+ *  Without HAVE_GLES (see the Makefile) 'create' gives nullptr.
+ */
+
+#ifndef GLES_H
+#define GLES_H
+
+#include <memory>
+
+#include "utils.h"
+#include "listener.h"
+
+namespace detector {
+
+class Gles {
+  public:
+    // frames of width x height in pix_fmt, i420 or rgb24
+    static std::unique_ptr<Gles> create(unsigned int width, unsigned int height,
+        unsigned int pix_fmt);
+    ~Gles();
+
+    // false when built without it
+    static bool available();
+
+  public:
+    // 'src' of the frame into 'dst' of an rgb24 image of dst_width x
+    // dst_height, 'fill' around it; false when another thread has the
+    // gpu or it failed, and the caller scales it itself
+    bool scale(const FrameBuf& frame, unsigned int stride, unsigned int slice,
+        const Rect& src, unsigned char* dst, unsigned int dst_width,
+        unsigned int dst_height, const Rect& dst_rect, unsigned char fill);
+
+    // frames done, frames imported without a copy, frames left to the cpu
+    unsigned int scaled();
+    unsigned int imported();
+    unsigned int busy();
+
+  protected:
+    Gles();
+    bool init(unsigned int width, unsigned int height, unsigned int pix_fmt);
+
+  private:
+    class Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+} // namespace detector
+
+#endif // GLES_H
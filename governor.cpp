@@ -0,0 +1,308 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <cstdlib>
+#include <algorithm>
+
+#include "governor.h"
+#include "tflow.h"
+#include "encoder.h"
+#include "capturer.h"
+#include "events.h"
+#include "metrics.h"
+
+namespace detector {
+
+const Governor::Level Governor::levels_[] = {
+  {  0.f, 1.00f, 1.00f, 1.00f, false, false },
+  { 60.f, 0.75f, 0.75f, 1.00f, false, false },
+  { 70.f, 0.50f, 0.50f, 0.75f, true,  false },
+  { 75.f, 0.25f, 0.50f, 0.50f, true,  true  },
+};
+const unsigned int Governor::level_num_ = sizeof(Governor::levels_) / sizeof(Governor::levels_[0]);
+
+Governor::Governor(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Governor::~Governor() {
+}
+
+std::unique_ptr<Governor> Governor::create(unsigned int yield_time, bool quiet,
+    const std::string& spec, Pipeline* pipe) {
+  auto obj = std::unique_ptr<Governor>(new Governor(yield_time));
+  if (!obj->init(quiet, spec, pipe)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Governor::init(bool quiet, const std::string& spec, Pipeline* pipe) {
+
+  quiet_ = quiet;
+  pipe_ = pipe;
+
+  // slo[,model,labels]
+  slo_ms_ = 0;
+  size_t comma = spec.find(',');
+  if (sscanf(spec.c_str(), "%u", &slo_ms_) != 1) {
+    dbgMsg("failed: governor slo %s\n", spec.c_str());
+    return false;
+  }
+  if (comma != std::string::npos) {
+    std::string rest = spec.substr(comma + 1);
+    size_t next = rest.find(',');
+    if (next == std::string::npos || next == 0 || next + 1 == rest.size()) {
+      dbgMsg("failed: governor lite model %s\n", spec.c_str());
+      return false;
+    }
+    lite_model_ = rest.substr(0, next);
+    lite_labels_ = rest.substr(next + 1);
+  }
+
+  based_ = false;
+  base_rate_ = 0.f;
+  free_rate_ = 0.f;
+  base_bitrate_ = 0;
+  base_fps_ = 0;
+  base_threads_ = 1;
+
+  level_ = 0;
+  cause_ = 0;
+  temp_ = 0.f;
+  flags_ = 0;
+  cooling_ = false;
+
+  gov_on_ = false;
+  up_cnt_ = 0;
+  down_cnt_ = 0;
+  peak_level_ = 0;
+  peak_temp_ = 0.f;
+
+  return true;
+}
+
+bool Governor::read() {
+
+  bool ok = false;
+  FILE* fd = fopen("/sys/class/thermal/thermal_zone0/temp", "r");
+  if (fd) {
+    long milli;
+    if (fscanf(fd, "%ld", &milli) == 1) {
+      temp_ = milli / 1000.f;
+      peak_temp_ = std::max(peak_temp_, temp_);
+      ok = true;
+    }
+    fclose(fd);
+  }
+
+  // the firmware's flags, what 'vcgencmd get_throttled' shows
+  fd = fopen("/sys/devices/platform/soc/soc:firmware/get_throttled", "r");
+  if (fd) {
+    if (fscanf(fd, "%lx", &flags_) != 1) {
+      flags_ = 0;
+    }
+    fclose(fd);
+  }
+  return ok;
+}
+
+unsigned int Governor::demand(float temp, bool slow) {
+
+  unsigned int want = 0;
+  for (unsigned int i = 1; i < level_num_; i++) {
+    if (temp >= levels_[i].temp) {
+      want = i;
+    }
+  }
+
+  // capped or at the soft limit now, or throttled now
+  if (flags_ & 0x2 || flags_ & 0x8) {
+    want = std::max(want, 2u);
+  }
+  if (flags_ & 0x4) {
+    want = level_num_ - 1;
+  }
+  if (slow) {
+    want = std::max(want, std::min(level_ + 1, level_num_ - 1));
+  }
+  return want;
+}
+
+void Governor::apply(unsigned int level) {
+
+  auto tfl = pipe_->get<Tflow>("tfl");
+  auto enc = pipe_->get<Encoder>("enc");
+  if (!tfl) {
+    return;
+  }
+  const Governor::Level& lvl = levels_[level];
+
+  // no rate set cuts from what it managed unlimited
+  float from = (base_rate_ > 0.f) ? base_rate_ : free_rate_;
+  float rate = (level == 0) ? base_rate_ : from * lvl.rate;
+  tfl->setRate(rate);
+  unsigned int bitrate = base_bitrate_ * lvl.bitrate;
+  if (enc && base_bitrate_) {
+    enc->setBitrate(bitrate);
+  }
+  auto cap = pipe_->get<Capturer>("cap");
+  unsigned int fps = std::max(static_cast<unsigned int>(base_fps_ * lvl.fps + 0.5f), 1u);
+  if (cap && base_fps_) {
+    cap->setFramerate(fps);
+  }
+
+  // these build new engines, swapped in once they are ready
+  unsigned int threads = lvl.one_thread ? 1 : base_threads_;
+  bool lite = lvl.lite && !lite_model_.empty();
+  const std::string& model = lite ? lite_model_ : base_model_;
+  const std::string& labels = lite ? lite_labels_ : base_labels_;
+  if (!tfl->swapModel(model, labels, threads)) {
+    dbgMsg("failed: governor model %s\n", model.c_str());
+  }
+
+  level_ = level;
+  peak_level_ = std::max(peak_level_, level_);
+
+  if (!quiet_) {
+    fprintf(stderr, "\ngovernor: level %u at %.1f C%s%s%s, rate %.1f, bitrate %u, fps %u, threads %u%s\n",
+        level_, temp_,
+        (cause_ & Governor::kHeat) ? ", hot" : "",
+        (cause_ & Governor::kThrottle) ? ", throttled" : "",
+        (cause_ & Governor::kLatency) ? ", slow" : "",
+        rate, bitrate, fps, threads, lite ? ", lite model" : "");
+  }
+  auto evt = pipe_->get<Events>("evt");
+  if (evt) {
+    Events::Govern step;
+    step.stamp = std::chrono::steady_clock::now();
+    step.level = level_;
+    step.temp = temp_;
+    step.rate = rate;
+    step.bitrate = bitrate;
+    step.threads = threads;
+    step.lite = lite;
+    step.cause = cause_;
+    evt->addMessage(step);
+  }
+}
+
+void Governor::metrics(Exposition& out, const std::string& labels) {
+  out.gauge("detector_governor_level", "thermal governor level, 0 as configured", labels, level_);
+  out.counter("detector_governor_steps_total", "governor steps", labels + ",dir=\"up\"", up_cnt_);
+  out.counter("detector_governor_steps_total", "governor steps", labels + ",dir=\"down\"", down_cnt_);
+}
+
+bool Governor::waitingToRun() {
+
+  if (!gov_on_) {
+    last_read_ = std::chrono::steady_clock::now();
+    cooling_ = false;
+    gov_on_ = true;
+  }
+
+  return true;
+}
+
+bool Governor::running() {
+
+  if (gov_on_) {
+    auto tfl = pipe_->get<Tflow>("tfl");
+    if (!tfl || tfl->getState() != Base::State::kRunning) {
+      return true;
+    }
+
+    using namespace std::chrono;
+    auto now = steady_clock::now();
+    float secs = duration_cast<duration<float>>(now - last_read_).count();
+    last_read_ = now;
+
+    if (!based_) {
+      auto enc = pipe_->get<Encoder>("enc");
+      base_rate_ = tfl->getRate();
+      base_bitrate_ = enc ? enc->getBitrate() : 0;
+      auto cap = pipe_->get<Capturer>("cap");
+      base_fps_ = cap ? cap->getFramerate() : 0;
+      base_threads_ = tfl->getThreads();
+      base_model_ = tfl->getModel();
+      base_labels_ = tfl->getLabels();
+      tfl->latency(late_mark_);
+      based_ = true;
+      return true;
+    }
+
+    read();
+    auto late = tfl->latency(late_mark_);
+    if (level_ == 0 && secs > 0.f && late.cnt) {
+      float rate = late.cnt / secs;
+      free_rate_ = (free_rate_ > 0.f) ? free_rate_ + (rate - free_rate_) / 8.f : rate;
+    }
+    bool slow = slo_ms_ && late.cnt && late.p99 > slo_ms_ * 1000;
+
+    // up a level at once, down only after it has stayed calm
+    unsigned int want = demand(temp_, slow);
+    if (want > level_) {
+      cause_ = (want > demand(temp_, false) ? Governor::kLatency : 0) |
+        ((flags_ & 0xe) ? Governor::kThrottle : 0) |
+        (temp_ >= levels_[level_ + 1].temp ? Governor::kHeat : 0);
+      apply(level_ + 1);
+      up_cnt_++;
+      cooling_ = false;
+    } else if (level_ > 0 && demand(temp_ + hyst_, slow) < level_) {
+      if (!cooling_) {
+        cooling_ = true;
+        cool_since_ = now;
+      } else if (now - cool_since_ >= milliseconds(hold_)) {
+        cause_ = 0;
+        apply(level_ - 1);
+        down_cnt_++;
+        cool_since_ = now;
+      }
+    } else {
+      cooling_ = false;
+    }
+  }
+
+  return true;
+}
+
+bool Governor::paused() {
+  return true;
+}
+
+bool Governor::waitingToHalt() {
+
+  if (gov_on_) {
+    gov_on_ = false;
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nGovernor Results...\n");
+      fprintf(stderr, "      peak temperature: %.1f C\n", peak_temp_);
+      fprintf(stderr, "            peak level: %u\n", peak_level_);
+      fprintf(stderr, "            last level: %u\n", level_);
+      fprintf(stderr, "        steps up, down: %u, %u\n", up_cnt_, down_cnt_);
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
@@ -0,0 +1,140 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Thermal governor.
+ *
+ *  With --governor slo[,model,labels] it reads the soc temperature and
+ *  the firmware's throttle flags once a second and walks the pipeline
+ *  down a few levels before the firmware does it for us:
+ *
+ *    0  as configured
+ *    1  3/4 the detection rate and bitrate                 60 C
+ *    2  1/2 of both, one thread per engine, 3/4 the fps    soft limit 70 C
+ *    3  1/4 the rate and the lite model, 1/2 the fps       75 C, throttled
+ *
+ *  When capture to detection p99 goes over 'slo' msec (0 for heat only)
+ *  it also steps up.  Going up is one level a second, coming down waits
+ *  until it has been 'hyst_' degrees cooler and under the slo for
+ *  'hold_' msec.  With no rate set the rate it cuts from is the one tflow
+ *  managed at level 0.  A thread or model change builds new engines that
+ *  tflow swaps in when they are ready, the rest is picked up with the
+ *  next frame.  The camera's own frame rate comes down last, so frames
+ *  that wouldn't be used are never captured, if the driver lets it be
+ *  changed while streaming.
+ *
+ *  Every step is printed and goes to the event broker if there is one.
+ *  While it runs the governor owns the rate, bitrate, fps, threads and model,
+ *  live controls of those are undone at its next step.
+ */
+
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <string>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+
+#include "utils.h"
+#include "base.h"
+#include "pipeline.h"
+
+namespace detector {
+
+class Governor : public Base {
+  public:
+    // why the last step up was taken
+    enum Cause {
+      kHeat = 1,
+      kThrottle = 2,
+      kLatency = 4
+    };
+
+  public:
+    static std::unique_ptr<Governor> create(unsigned int yield_time, bool quiet,
+        const std::string& spec, Pipeline* pipe);
+    virtual ~Governor();
+
+    virtual void metrics(Exposition& out, const std::string& labels);
+
+  protected:
+    Governor() = delete;
+    Governor(unsigned int yield_time);
+    bool init(bool quiet, const std::string& spec, Pipeline* pipe);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    unsigned int slo_ms_;
+    std::string lite_model_;
+    std::string lite_labels_;
+    Pipeline* pipe_;
+
+    class Level {
+      public:
+        float temp;       // degrees that bring it on
+        float rate;       // of the base rate
+        float bitrate;    // of the base bitrate
+        float fps;        // of the base capture frame rate
+        bool one_thread;
+        bool lite;
+    };
+    static const Governor::Level levels_[];
+    static const unsigned int level_num_;
+    const float hyst_ = {5.f};
+    const unsigned int hold_ = {30000};   // msec
+
+    // what was configured, taken the first time tflow is seen
+    bool based_;
+    float base_rate_;
+    float free_rate_;
+    unsigned int base_bitrate_;
+    unsigned int base_fps_;
+    unsigned int base_threads_;
+    std::string base_model_;
+    std::string base_labels_;
+
+    unsigned int level_;
+    unsigned int cause_;
+    float temp_;
+    unsigned long flags_;
+    std::unique_ptr<uint32_t[]> late_mark_;
+    std::chrono::steady_clock::time_point last_read_;
+    std::chrono::steady_clock::time_point cool_since_;
+    bool cooling_;
+
+    bool read();
+    unsigned int demand(float temp, bool slow);
+    void apply(unsigned int level);
+
+    bool gov_on_;
+    unsigned int up_cnt_;
+    unsigned int down_cnt_;
+    unsigned int peak_level_;
+    float peak_temp_;
+};
+
+} // namespace detector
+
+#endif // GOVERNOR_H
@@ -0,0 +1,168 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Log bucketed latency histogram.
+ *
+ *  HDR style: every power of two is cut into 32 linear buckets, so any
+ *  value lands in a bucket no more than about 3% wide and the whole
+ *  32 bit range fits in a fixed 3.5KB of counters.  'record' is one
+ *  relaxed atomic add, from any thread.  Percentiles come from the
+ *  totals since start, or from an 'interval' since the last interval,
+ *  which only one thread should ask for.  A percentile reports the top
+ *  of its bucket.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+namespace detector {
+
+class Histogram {
+  public:
+    class Percentiles {
+      public:
+        uint64_t cnt;
+        uint32_t p50, p90, p99, p999;
+    };
+
+  public:
+    Histogram() {
+      for (auto& c : counts_) {
+        c.store(0, std::memory_order_relaxed);
+      }
+    }
+    Histogram(Histogram const &) = delete;
+    ~Histogram() {}
+
+    inline void record(uint64_t val) {
+      counts_[index(val)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // one percentile over everything so far, 'p' is 0 to 1
+    uint32_t percentile(double p) {
+      uint32_t counts[bucket_num_];
+      uint64_t num = read(counts);
+      return value(counts, num, p);
+    }
+
+    Histogram::Percentiles percentiles() {
+      uint32_t counts[bucket_num_];
+      return summary(counts, read(counts));
+    }
+
+    // adds in everything 'other' has recorded
+    void merge(Histogram& other) {
+      for (unsigned int i = 0; i < bucket_num_; i++) {
+        counts_[i].fetch_add(other.counts_[i].load(std::memory_order_relaxed),
+            std::memory_order_relaxed);
+      }
+    }
+
+    // just what was recorded since the last call
+    Histogram::Percentiles interval() {
+      return interval(last_);
+    }
+
+    // the same for a reader that keeps its own 'last'
+    Histogram::Percentiles interval(std::unique_ptr<uint32_t[]>& last) {
+      if (!last) {
+        last = std::unique_ptr<uint32_t[]>(new uint32_t[bucket_num_]());
+      }
+      uint32_t counts[bucket_num_];
+      read(counts);
+      uint64_t num = 0;
+      for (unsigned int i = 0; i < bucket_num_; i++) {
+        uint32_t now = counts[i];
+        counts[i] = now - last[i];
+        last[i] = now;
+        num += counts[i];
+      }
+      return summary(counts, num);
+    }
+
+  private:
+    static const unsigned int sub_bits_ = 5;
+    static const unsigned int sub_num_ = 1 << sub_bits_;
+    static const unsigned int bucket_num_ = (32 - sub_bits_ + 1) * sub_num_;
+
+    std::atomic<uint32_t> counts_[bucket_num_];
+    std::unique_ptr<uint32_t[]> last_;
+
+    static inline unsigned int index(uint64_t val) {
+      uint32_t v = (val > UINT32_MAX) ? UINT32_MAX : static_cast<uint32_t>(val);
+      if (v < sub_num_) {
+        return v;
+      }
+      unsigned int shift = (31 - __builtin_clz(v)) - sub_bits_;
+      return (shift + 1) * sub_num_ + ((v >> shift) - sub_num_);
+    }
+
+    static inline uint32_t top(unsigned int idx) {
+      if (idx < sub_num_) {
+        return idx;
+      }
+      unsigned int shift = idx / sub_num_ - 1;
+      uint64_t sub = idx % sub_num_ + sub_num_;
+      uint64_t hi = ((sub + 1) << shift) - 1;
+      return (hi > UINT32_MAX) ? UINT32_MAX : static_cast<uint32_t>(hi);
+    }
+
+    uint64_t read(uint32_t* counts) {
+      uint64_t num = 0;
+      for (unsigned int i = 0; i < bucket_num_; i++) {
+        counts[i] = counts_[i].load(std::memory_order_relaxed);
+        num += counts[i];
+      }
+      return num;
+    }
+
+    static uint32_t value(const uint32_t* counts, uint64_t num, double p) {
+      if (num == 0) {
+        return 0;
+      }
+      uint64_t want = static_cast<uint64_t>(p * num + 0.999999);
+      want = (want == 0) ? 1 : want;
+      uint64_t sum = 0;
+      for (unsigned int i = 0; i < bucket_num_; i++) {
+        sum += counts[i];
+        if (sum >= want) {
+          return top(i);
+        }
+      }
+      return top(bucket_num_ - 1);
+    }
+
+    static Histogram::Percentiles summary(const uint32_t* counts, uint64_t num) {
+      Histogram::Percentiles pct;
+      pct.cnt = num;
+      pct.p50 = value(counts, num, 0.5);
+      pct.p90 = value(counts, num, 0.9);
+      pct.p99 = value(counts, num, 0.99);
+      pct.p999 = value(counts, num, 0.999);
+      return pct;
+    }
+};
+
+} // namespace detector
+
+#endif // HISTOGRAM_H
@@ -0,0 +1,785 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#include "hls.h"
+#include "fate.h"
+
+namespace detector {
+
+static void append(std::string& s, const char* fmt, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  if (n > 0) {
+    s.append(buf, std::min(static_cast<size_t>(n), sizeof(buf) - 1));
+  }
+}
+
+static const char* index_html =
+  "<!DOCTYPE html>\n"
+  "<html><head><title>detector</title></head>\n"
+  "<body style=\"margin:0;background:#000\">\n"
+  "<video src=\"live.m3u8\" autoplay muted playsinline controls\n"
+  "  style=\"width:100%;height:100vh\"></video>\n"
+  "</body></html>\n";
+
+Hls::Hls(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Hls::~Hls() {
+}
+
+std::unique_ptr<Hls> Hls::create(unsigned int yield_time, bool quiet,
+    unsigned short port, unsigned int framerate, unsigned int width,
+    unsigned int height) {
+  auto obj = std::unique_ptr<Hls>(new Hls(yield_time));
+  obj->init(quiet, port, framerate, width, height);
+  return obj;
+}
+
+bool Hls::init(bool quiet, unsigned short port, unsigned int framerate,
+    unsigned int width, unsigned int height) {
+
+  quiet_ = quiet;
+  port_ = port;
+  framerate_ = framerate ? framerate : 1;
+  width_ = width;
+  height_ = height;
+
+  nal_gap_ = false;
+  nal_drops_ = 0;
+  wait_key_ = true;
+  frag_seq_ = 1;
+  media_time_ = 0;
+  seg_open_ = false;
+  next_msn_ = 0;
+
+  serve_on_ = false;
+  listen_fd_ = -1;
+  wake_fd_[0] = -1;
+  wake_fd_[1] = -1;
+
+  seg_cnt_ = 0;
+  part_cnt_ = 0;
+  req_cnt_ = 0;
+  held_cnt_ = 0;
+  miss_cnt_ = 0;
+  turned_away_cnt_ = 0;
+  byte_cnt_ = 0;
+
+  hls_on_ = false;
+
+  return true;
+}
+
+void Hls::footprint(Footprint& out) {
+  out.add("nal_pool", nal_bytes_ ? nal_num_ : 0, nal_bytes_);
+
+  // the segments and parts kept for the playlist
+  std::unique_lock<std::mutex> lck(lock_);
+  size_t num = 0, bytes = init_sec_ ? init_sec_->capacity() : 0;
+  for (auto& seg : segs_) {
+    for (auto& part : seg.parts) {
+      num++;
+      bytes += part.data ? part.data->capacity() : 0;
+    }
+  }
+  out.add("hls_parts", num, bytes);
+}
+
+bool Hls::addMessage(NalBuf& nal) {
+
+  // the encoder never waits on us, a lost nal means resync on the next key frame
+  std::shared_ptr<Hls::HlsNal> hls_nal;
+  if (!nal_pool_.pop(hls_nal)) {
+    nal_drops_++;
+    Fate::drop(Fate::Site::kHlsPool, nal.stamp);
+    nal_gap_ = true;
+    return false;
+  }
+
+  if (nal.length > hls_nal->nal.size()) {
+    nal_bytes_ += nal.length - hls_nal->nal.size();
+    hls_nal->nal.resize(nal.length, 0);
+  }
+  std::memcpy(hls_nal->nal.data(), nal.addr, nal.length);
+  hls_nal->length = nal.length;
+  hls_nal->stamp = nal.stamp;
+  hls_nal->gap = nal_gap_.exchange(false);
+
+  nal_work_.push(hls_nal);
+  wake();
+
+  return true;
+}
+
+void Hls::parse(const unsigned char* data, unsigned int len,
+    std::chrono::steady_clock::time_point stamp) {
+  annexb_.parse(data, len, stamp,
+      [this](std::vector<unsigned char>& nal, std::chrono::steady_clock::time_point at) {
+        handleNal(nal, at);
+      });
+}
+
+void Hls::handleNal(std::vector<unsigned char>& nal,
+    std::chrono::steady_clock::time_point stamp) {
+
+  unsigned int type = nal[0] & 0x1f;
+  if (type == 7) {
+    sps_ = nal;
+  } else if (type == 8) {
+    pps_ = nal;
+  } else if (type == 6) {
+    sei_ = nal;
+  } else if (type == 1 || type == 5) {
+    bool key = (type == 5);
+
+    // first_mb_in_slice is zero on the first slice of a picture
+    if (nal.size() > 1 && (nal[1] & 0x80)) {
+      std::vector<unsigned char> sei;
+      sei.swap(sei_);
+      if ((wait_key_ && !key) || sps_.size() < 4 || pps_.empty()) {
+        return;
+      }
+
+      if (!init_sec_) {
+        auto b = std::make_shared<std::vector<unsigned char>>();
+        b->reserve(1024);
+        mp4Init(*b, width_, height_, timescale_, sps_, pps_);
+        std::lock_guard<std::mutex> lk(lock_);
+        init_sec_ = b;
+      }
+
+      // segments start on the first key frame after 'seg_time_'
+      using namespace std::chrono;
+      if (key && (!seg_open_ || stamp - seg_start_ >= milliseconds(seg_time_))) {
+        closePart(stamp, true);
+        std::lock_guard<std::mutex> lk(lock_);
+        segs_.push_back(Hls::Segment{next_msn_++, {}, 0.0, false});
+        while (segs_.size() > seg_keep_) {
+          segs_.pop_front();
+        }
+        seg_start_ = stamp;
+        seg_open_ = true;
+        seg_cnt_++;
+      } else if (!samples_.empty() && stamp - samples_.front().stamp +
+          microseconds(500000 / framerate_) >= milliseconds(part_time_)) {
+        closePart(stamp, false);
+      }
+      wait_key_ = false;
+      samples_.push_back(Mp4Sample{stamp, 0, 0, key});
+      if (!sei.empty()) {
+        put32(mdat_, sei.size());
+        mdat_.insert(mdat_.end(), sei.begin(), sei.end());
+        samples_.back().size += 4 + sei.size();
+      }
+    }
+
+    if (!samples_.empty()) {
+      put32(mdat_, nal.size());
+      mdat_.insert(mdat_.end(), nal.begin(), nal.end());
+      samples_.back().size += 4 + nal.size();
+    }
+  }
+}
+
+void Hls::closePart(std::chrono::steady_clock::time_point next, bool last) {
+
+  if (samples_.empty()) {
+    mdat_.clear();
+    if (last && seg_open_) {
+      std::lock_guard<std::mutex> lk(lock_);
+      segs_.back().done = !segs_.back().parts.empty();
+      if (segs_.back().parts.empty()) {
+        next_msn_--;
+        segs_.pop_back();
+      }
+      seg_open_ = false;
+    }
+    return;
+  }
+
+  mp4Durations(samples_, next, timescale_, framerate_);
+  uint64_t total = 0;
+  for (auto& s : samples_) {
+    total += s.duration;
+  }
+
+  auto b = std::make_shared<std::vector<unsigned char>>();
+  b->reserve(128 + samples_.size() * 12 + mdat_.size());
+  mp4Fragment(*b, frag_seq_, media_time_, samples_, mdat_.size());
+  b->insert(b->end(), mdat_.begin(), mdat_.end());
+  frag_seq_++;
+  media_time_ += total;
+
+  {
+    std::lock_guard<std::mutex> lk(lock_);
+    double dur = static_cast<double>(total) / timescale_;
+    segs_.back().parts.push_back(Hls::Part{b, dur, samples_.front().key});
+    segs_.back().duration += dur;
+    if (last) {
+      segs_.back().done = true;
+      seg_open_ = false;
+    }
+  }
+  part_cnt_++;
+  wakeServer();
+
+  // capture to servable
+  differ_late_.begin(samples_.back().stamp);
+  differ_late_.end();
+
+  samples_.clear();
+  mdat_.clear();
+}
+
+double Hls::partTarget() {
+  return (part_time_ + 1000.0 / framerate_) / 1000.0;
+}
+
+std::string Hls::playlist() {
+
+  // only called with 'lock_' held and at least one segment
+  double target = std::ceil(seg_time_ / 1000.0);
+  for (auto& seg : segs_) {
+    if (seg.done) {
+      target = std::max(target, std::ceil(seg.duration));
+    }
+  }
+
+  std::string s;
+  s.reserve(4096);
+  s += "#EXTM3U\n";
+  s += "#EXT-X-VERSION:9\n";
+  s += "#EXT-X-INDEPENDENT-SEGMENTS\n";
+  append(s, "#EXT-X-TARGETDURATION:%u\n", static_cast<unsigned int>(target));
+  append(s, "#EXT-X-PART-INF:PART-TARGET=%.3f\n", partTarget());
+  append(s, "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n",
+      3.0 * partTarget());
+  append(s, "#EXT-X-MEDIA-SEQUENCE:%u\n", segs_.front().msn);
+  s += "#EXT-X-MAP:URI=\"init.mp4\"\n";
+
+  // parts only for the last few segments, whole segments before that
+  for (size_t i = 0; i < segs_.size(); i++) {
+    auto& seg = segs_[i];
+    if (i + part_keep_ >= segs_.size()) {
+      for (size_t p = 0; p < seg.parts.size(); p++) {
+        append(s, "#EXT-X-PART:DURATION=%.5f,URI=\"part%u.%u.mp4\"%s\n",
+            seg.parts[p].duration, seg.msn, static_cast<unsigned int>(p),
+            seg.parts[p].independent ? ",INDEPENDENT=YES" : "");
+      }
+    }
+    if (seg.done) {
+      append(s, "#EXTINF:%.5f,\n", seg.duration);
+      append(s, "seg%u.mp4\n", seg.msn);
+    }
+  }
+
+  auto& back = segs_.back();
+  if (back.done) {
+    append(s, "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"part%u.0.mp4\"\n", back.msn + 1);
+  } else {
+    append(s, "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"part%u.%u.mp4\"\n",
+        back.msn, static_cast<unsigned int>(back.parts.size()));
+  }
+  return s;
+}
+
+bool Hls::ready(unsigned int msn, unsigned int part, bool whole) {
+
+  // only called with 'lock_' held, anything past what was asked for will do
+  for (auto& seg : segs_) {
+    if (whole) {
+      if (seg.msn >= msn && seg.done) {
+        return true;
+      }
+    } else if ((seg.msn == msn && seg.parts.size() > part) ||
+        (seg.msn > msn && !seg.parts.empty())) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Hls::wakeServer() {
+  if (wake_fd_[1] >= 0) {
+    char c = 1;
+    if (write(wake_fd_[1], &c, 1) < 0) {
+      // already pending
+    }
+  }
+}
+
+bool Hls::request(Hls::Client& cl) {
+
+  size_t end = cl.req.find("\r\n\r\n");
+  if (end == std::string::npos) {
+    return cl.req.size() < req_max_;
+  }
+  std::string line = cl.req.substr(0, cl.req.find("\r\n"));
+  cl.req.erase(0, end + 4);
+  req_cnt_++;
+
+  size_t sp1 = line.find(' ');
+  size_t sp2 = (sp1 == std::string::npos) ? sp1 : line.find(' ', sp1 + 1);
+  if (sp2 == std::string::npos) {
+    return false;
+  }
+  std::string method = line.substr(0, sp1);
+  std::string target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+
+  size_t q = target.find('?');
+  cl.path = target.substr(0, q);
+  std::string query = (q == std::string::npos) ? "" : target.substr(q + 1);
+  cl.head_only = (method == "HEAD");
+  cl.held = false;
+
+  if (method == "OPTIONS") {
+    respond(cl, "204 No Content", "text/plain", "no-cache", {});
+    return true;
+  }
+  if (method != "GET" && method != "HEAD") {
+    respond(cl, "405 Method Not Allowed", "text/plain", "no-cache", {});
+    return true;
+  }
+
+  // blocking playlist reload
+  cl.msn = 0;
+  cl.part = 0;
+  cl.block = false;
+  cl.whole = true;
+  size_t m = query.find("_HLS_msn=");
+  if (m != std::string::npos) {
+    cl.block = true;
+    cl.msn = strtoul(query.c_str() + m + 9, nullptr, 10);
+    size_t p = query.find("_HLS_part=");
+    if (p != std::string::npos) {
+      cl.whole = false;
+      cl.part = strtoul(query.c_str() + p + 10, nullptr, 10);
+    }
+  }
+
+  answer(cl);
+  return true;
+}
+
+void Hls::answer(Hls::Client& cl) {
+
+  using Body = std::vector<std::shared_ptr<std::vector<unsigned char>>>;
+  auto now = std::chrono::steady_clock::now();
+  bool expired = cl.held && now >= cl.limit;
+
+  std::unique_lock<std::mutex> lk(lock_);
+  auto hold = [&]() {
+    if (!cl.held) {
+      cl.held = true;
+      cl.limit = now + std::chrono::milliseconds(
+          static_cast<unsigned int>(3000.0 * partTarget()) + seg_time_);
+      held_cnt_++;
+    }
+  };
+  auto text = [](const std::string& s) {
+    return std::make_shared<std::vector<unsigned char>>(s.begin(), s.end());
+  };
+
+  unsigned int msn = 0;
+  unsigned int part = 0;
+  if (cl.path == "/live.m3u8") {
+    if (!init_sec_ || segs_.empty()) {
+      lk.unlock();
+      respond(cl, "503 Service Unavailable", "text/plain", "no-cache", {});
+      return;
+    }
+    if (cl.block) {
+      if (cl.msn > next_msn_ + 1) {
+        lk.unlock();
+        respond(cl, "400 Bad Request", "text/plain", "no-cache", {});
+        return;
+      }
+      if (!ready(cl.msn, cl.part, cl.whole) && !expired) {
+        hold();
+        return;
+      }
+    }
+    auto body = text(playlist());
+    lk.unlock();
+    cl.held = false;
+    respond(cl, "200 OK", "application/vnd.apple.mpegurl", "no-cache", Body{body});
+    return;
+  }
+
+  if (cl.path == "/init.mp4") {
+    auto body = init_sec_;
+    lk.unlock();
+    if (body) {
+      respond(cl, "200 OK", "video/mp4", "max-age=60", Body{body});
+    } else {
+      respond(cl, "503 Service Unavailable", "text/plain", "no-cache", {});
+    }
+    return;
+  }
+
+  if (sscanf(cl.path.c_str(), "/seg%u.mp4", &msn) == 1) {
+    Body body;
+    for (auto& seg : segs_) {
+      if (seg.msn == msn && seg.done) {
+        for (auto& p : seg.parts) {
+          body.push_back(p.data);
+        }
+      }
+    }
+    lk.unlock();
+    if (!body.empty()) {
+      respond(cl, "200 OK", "video/mp4", "max-age=60", body);
+    } else {
+      miss_cnt_++;
+      respond(cl, "404 Not Found", "text/plain", "no-cache", {});
+    }
+    return;
+  }
+
+  if (sscanf(cl.path.c_str(), "/part%u.%u.mp4", &msn, &part) == 2) {
+    Body body;
+    for (auto& seg : segs_) {
+      if (seg.msn == msn && seg.parts.size() > part) {
+        body.push_back(seg.parts[part].data);
+      }
+    }
+
+    // a preload hint asks for the next part before it exists
+    if (body.empty() && !expired && !segs_.empty() &&
+        msn >= segs_.back().msn && msn <= segs_.back().msn + 1) {
+      hold();
+      return;
+    }
+    lk.unlock();
+    cl.held = false;
+    if (!body.empty()) {
+      respond(cl, "200 OK", "video/mp4", "max-age=60", body);
+    } else {
+      miss_cnt_++;
+      respond(cl, "404 Not Found", "text/plain", "no-cache", {});
+    }
+    return;
+  }
+
+  lk.unlock();
+  if (cl.path == "/" || cl.path == "/index.html") {
+    respond(cl, "200 OK", "text/html", "no-cache", Body{text(index_html)});
+  } else {
+    miss_cnt_++;
+    respond(cl, "404 Not Found", "text/plain", "no-cache", {});
+  }
+}
+
+void Hls::respond(Hls::Client& cl, const char* status, const char* type,
+    const char* cache, std::vector<std::shared_ptr<std::vector<unsigned char>>> body) {
+
+  size_t len = 0;
+  for (auto& b : body) {
+    len += b->size();
+  }
+
+  // browsers on other origins are welcome
+  cl.head.clear();
+  append(cl.head, "HTTP/1.1 %s\r\n", status);
+  append(cl.head, "Content-Type: %s\r\n", type);
+  append(cl.head, "Content-Length: %zu\r\n", len);
+  append(cl.head, "Cache-Control: %s\r\n", cache);
+  cl.head += "Access-Control-Allow-Origin: *\r\n";
+  cl.head += "Access-Control-Allow-Methods: GET, HEAD, OPTIONS\r\n";
+  cl.head += "Access-Control-Allow-Headers: *\r\n";
+  cl.head += "Connection: keep-alive\r\n\r\n";
+  cl.head_off = 0;
+  cl.body = cl.head_only ? std::vector<std::shared_ptr<std::vector<unsigned char>>>() : body;
+  cl.body_idx = 0;
+  cl.body_off = 0;
+}
+
+bool Hls::drain(Hls::Client& cl) {
+
+  while (cl.head_off < cl.head.size()) {
+    ssize_t n = ::send(cl.fd, cl.head.data() + cl.head_off,
+        cl.head.size() - cl.head_off, MSG_NOSIGNAL);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    cl.head_off += n;
+    byte_cnt_ += n;
+  }
+  while (cl.body_idx < cl.body.size()) {
+    auto& b = *cl.body[cl.body_idx];
+    if (cl.body_off >= b.size()) {
+      cl.body_idx++;
+      cl.body_off = 0;
+      continue;
+    }
+    ssize_t n = ::send(cl.fd, b.data() + cl.body_off, b.size() - cl.body_off, MSG_NOSIGNAL);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    cl.body_off += n;
+    byte_cnt_ += n;
+  }
+
+  // all out, ready for the next request on this connection
+  cl.head.clear();
+  cl.head_off = 0;
+  cl.body.clear();
+  return true;
+}
+
+void Hls::serveLoop() {
+
+  std::vector<struct pollfd> fds;
+  while (serve_on_) {
+
+    fds.clear();
+    fds.push_back({listen_fd_, POLLIN, 0});
+    fds.push_back({wake_fd_[0], POLLIN, 0});
+    for (auto& cl : clients_) {
+      short ev = 0;
+      if (!cl.head.empty()) {
+        ev = POLLOUT;
+      } else if (!cl.held) {
+        ev = POLLIN;
+      }
+      fds.push_back({cl.fd, ev, 0});
+    }
+
+    int res = poll(fds.data(), fds.size(), poll_timeout_);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      dbgMsg("failed: hls poll\n");
+      break;
+    }
+
+    bool woken = false;
+    if (fds[1].revents & POLLIN) {
+      char buf[64];
+      while (read(wake_fd_[0], buf, sizeof(buf)) > 0) {
+      }
+      woken = true;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < clients_.size(); i++) {
+      auto& cl = clients_[i];
+      short rev = fds[i + 2].revents;
+      bool ok = true;
+
+      if (rev & (POLLERR | POLLHUP | POLLNVAL)) {
+        ok = false;
+      } else if (rev & POLLIN) {
+        char buf[1024];
+        ssize_t n = recv(cl.fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+          ok = (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+        } else {
+          cl.req.append(buf, n);
+        }
+      }
+
+      if (ok && cl.held && (woken || now >= cl.limit)) {
+        answer(cl);
+      }
+      if (ok && !cl.held && cl.head.empty() && !cl.req.empty()) {
+        ok = request(cl);
+      }
+      if (ok && !cl.head.empty()) {
+        ok = drain(cl);
+      }
+      if (!ok) {
+        close(cl.fd);
+        cl.fd = -1;
+      }
+    }
+    clients_.erase(std::remove_if(clients_.begin(), clients_.end(),
+          [](const Hls::Client& cl) { return cl.fd < 0; }), clients_.end());
+
+    if (fds[0].revents & POLLIN) {
+      int fd;
+      while ((fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK)) >= 0) {
+        if (clients_.size() >= client_max_) {
+          close(fd);
+          turned_away_cnt_++;
+          continue;
+        }
+        Hls::Client cl;
+        cl.fd = fd;
+        cl.head_off = 0;
+        cl.body_idx = 0;
+        cl.body_off = 0;
+        cl.head_only = false;
+        cl.held = false;
+        cl.block = false;
+        cl.whole = true;
+        cl.msn = 0;
+        cl.part = 0;
+        clients_.push_back(cl);
+      }
+    }
+  }
+
+  for (auto& cl : clients_) {
+    close(cl.fd);
+  }
+  clients_.clear();
+}
+
+bool Hls::waitingToRun() {
+
+  if (!hls_on_) {
+
+    // create nal pool
+    dbgMsg("create nal pool\n");
+    for (unsigned int i = 0; i < nal_num_; i++) {
+      auto hls_nal = std::shared_ptr<Hls::HlsNal>(new HlsNal(nal_len_));
+      nal_pool_.push(hls_nal);
+    }
+    nal_bytes_ = nal_num_ * nal_len_;
+
+    dbgMsg("open hls port %u\n", port_);
+    listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd_ < 0) {
+      dbgMsg("failed: hls socket\n");
+      return false;
+    }
+    int on = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port_);
+    if (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(listen_fd_, client_max_) < 0) {
+      dbgMsg("failed: hls bind port %u\n", port_);
+      close(listen_fd_);
+      listen_fd_ = -1;
+      return false;
+    }
+    if (pipe2(wake_fd_, O_NONBLOCK) < 0) {
+      dbgMsg("failed: hls wake pipe\n");
+      close(listen_fd_);
+      listen_fd_ = -1;
+      return false;
+    }
+
+    annexb_.reset();
+    wait_key_ = true;
+
+    serve_on_ = true;
+    serve_thread_ = std::thread(&Hls::serveLoop, this);
+
+    hls_on_ = true;
+  }
+
+  return true;
+}
+
+bool Hls::running() {
+
+  if (hls_on_) {
+    std::shared_ptr<Hls::HlsNal> hls_nal;
+    while (nal_work_.pop(hls_nal)) {
+      if (hls_nal->gap) {
+        annexb_.reset();
+        closePart(hls_nal->stamp, true);
+        wait_key_ = true;
+      }
+      parse(hls_nal->nal.data(), hls_nal->length, hls_nal->stamp);
+      nal_pool_.push(hls_nal);
+    }
+  }
+  return true;
+}
+
+bool Hls::paused() {
+  return true;
+}
+
+bool Hls::waitingToHalt() {
+
+  if (hls_on_) {
+    hls_on_ = false;
+
+    std::shared_ptr<Hls::HlsNal> hls_nal;
+    while (nal_work_.pop(hls_nal)) {
+    }
+    while (nal_pool_.pop(hls_nal)) {
+    }
+    nal_bytes_ = 0;
+
+    serve_on_ = false;
+    wakeServer();
+    if (serve_thread_.joinable()) {
+      serve_thread_.join();
+    }
+    close(listen_fd_);
+    close(wake_fd_[0]);
+    close(wake_fd_[1]);
+    listen_fd_ = -1;
+    wake_fd_[0] = -1;
+    wake_fd_[1] = -1;
+
+    segs_.clear();
+    init_sec_.reset();
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nHls Results...\n");
+      fprintf(stderr, "  part latency (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_late_.pct(.5), differ_late_.pct(.9), differ_late_.pct(.99), differ_late_.pct(.999),
+          differ_late_.high, differ_late_.avg,
+          differ_late_.low, differ_late_.cnt);
+      fprintf(stderr, "      segments: %u\n", seg_cnt_);
+      fprintf(stderr, "         parts: %u\n", part_cnt_);
+      fprintf(stderr, "      requests: %u\n", req_cnt_.load());
+      fprintf(stderr, "  held requests: %u\n", held_cnt_.load());
+      fprintf(stderr, "     not found: %u\n", miss_cnt_.load());
+      fprintf(stderr, "   turned away: %u\n", turned_away_cnt_.load());
+      fprintf(stderr, "   bytes served: %llu\n",
+          static_cast<unsigned long long>(byte_cnt_.load()));
+      fprintf(stderr, "  nals dropped: %u\n", nal_drops_.load());
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
@@ -0,0 +1,202 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Low latency HLS server.
+ *
+ *  The encoder hands over its NALs like it does to the recorder.  This
+ *  thread cuts them into CMAF parts (a 'moof' and 'mdat' every quarter
+ *  second) and groups the parts into segments that start on a key
+ *  frame.  The last few segments stay in memory and a small HTTP thread
+ *  serves them, the init section and an LL-HLS playlist straight to
+ *  browsers.  Playlist and preload hint requests for parts that don't
+ *  exist yet are held until the part is ready.
+ */
+
+#ifndef HLS_H
+#define HLS_H
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "utils.h"
+#include "listener.h"
+#include "channel.h"
+#include "base.h"
+#include "reserve.h"
+#include "mp4.h"
+
+namespace detector {
+
+class Hls : public Base, Listener<NalBuf> {
+  public:
+    static std::unique_ptr<Hls> create(unsigned int yield_time, bool quiet,
+        unsigned short port, unsigned int framerate, unsigned int width,
+        unsigned int height);
+    virtual ~Hls();
+
+  public:
+    virtual bool addMessage(NalBuf& nal);
+
+    // the nal pool and what it holds on to
+    virtual void footprint(Footprint& out);
+
+  protected:
+    Hls() = delete;
+    Hls(unsigned int yield_time);
+    bool init(bool quiet, unsigned short port, unsigned int framerate,
+        unsigned int width, unsigned int height);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    unsigned short port_;
+    unsigned int framerate_;
+    unsigned int width_;
+    unsigned int height_;
+
+    class HlsNal {
+      public:
+        HlsNal() = delete;
+        HlsNal(unsigned int len)
+          : length(len), nal(len), gap(false) {}
+        ~HlsNal() {}
+      public:
+        unsigned int length;
+        Bytes nal;
+        std::chrono::steady_clock::time_point stamp;
+        bool gap;   // nals were lost in front of this one
+    };
+    const unsigned int nal_num_ = {64};
+    const unsigned int nal_len_ = {64 * 1024};
+    Channel<std::shared_ptr<Hls::HlsNal>> nal_pool_{nal_num_,
+      Channel<std::shared_ptr<Hls::HlsNal>>::Policy::kDropNewest};
+    Channel<std::shared_ptr<Hls::HlsNal>> nal_work_{nal_num_,
+      Channel<std::shared_ptr<Hls::HlsNal>>::Policy::kDropNewest};
+    std::atomic<size_t> nal_bytes_{0};   // the pool's, grown nals included
+    std::atomic<bool> nal_gap_;
+    std::atomic<unsigned int> nal_drops_;
+
+    AnnexB annexb_;
+    void parse(const unsigned char* data, unsigned int len,
+        std::chrono::steady_clock::time_point stamp);
+    void handleNal(std::vector<unsigned char>& nal,
+        std::chrono::steady_clock::time_point stamp);
+
+    std::vector<unsigned char> sps_;
+    std::vector<unsigned char> pps_;
+    std::vector<unsigned char> sei_;    // goes in with the next picture
+
+    // samples of the open part, length prefixed in 'mdat_'
+    std::vector<Mp4Sample> samples_;
+    std::vector<unsigned char> mdat_;
+    bool wait_key_;
+    const unsigned int timescale_ = {90000};
+    const unsigned int part_time_ = {250};   // msec
+    const unsigned int seg_time_ = {2000};   // msec, the next key frame after this
+    uint32_t frag_seq_;
+    uint64_t media_time_;   // timescale units
+    std::chrono::steady_clock::time_point seg_start_;
+    bool seg_open_;
+    void closePart(std::chrono::steady_clock::time_point next, bool last);
+
+    // what the server hands out, guarded by 'lock_'
+    class Part {
+      public:
+        std::shared_ptr<std::vector<unsigned char>> data;
+        double duration;   // sec
+        bool independent;
+    };
+    class Segment {
+      public:
+        unsigned int msn;
+        std::vector<Hls::Part> parts;
+        double duration;   // sec
+        bool done;
+    };
+    std::mutex lock_;
+    std::shared_ptr<std::vector<unsigned char>> init_sec_;
+    std::deque<Hls::Segment> segs_;
+    unsigned int next_msn_;
+    const unsigned int seg_keep_ = {6};
+    const unsigned int part_keep_ = {3};   // segments listed part by part
+    double partTarget();
+    std::string playlist();
+    bool ready(unsigned int msn, unsigned int part, bool whole);
+
+    // http
+    class Client {
+      public:
+        int fd;
+        std::string req;
+        std::string path;
+        bool head_only;
+        std::string head;
+        size_t head_off;
+        std::vector<std::shared_ptr<std::vector<unsigned char>>> body;
+        size_t body_idx;
+        size_t body_off;
+        bool held;           // waiting for a part that isn't there yet
+        bool block;          // playlist reload that waits for 'msn' and 'part'
+        unsigned int msn;
+        unsigned int part;
+        bool whole;          // held for a whole segment, no part asked for
+        std::chrono::steady_clock::time_point limit;
+    };
+    std::thread serve_thread_;
+    std::atomic<bool> serve_on_;
+    int listen_fd_;
+    int wake_fd_[2];
+    std::vector<Hls::Client> clients_;
+    const unsigned int client_max_ = {16};
+    const unsigned int poll_timeout_ = {100};   // msec
+    const size_t req_max_ = {4096};
+    void serveLoop();
+    void wakeServer();
+    bool request(Hls::Client& cl);
+    void answer(Hls::Client& cl);
+    void respond(Hls::Client& cl, const char* status, const char* type,
+        const char* cache, std::vector<std::shared_ptr<std::vector<unsigned char>>> body);
+    bool drain(Hls::Client& cl);
+
+    std::atomic<bool> hls_on_;
+
+    unsigned int seg_cnt_;
+    unsigned int part_cnt_;
+    std::atomic<unsigned int> req_cnt_;
+    std::atomic<unsigned int> held_cnt_;
+    std::atomic<unsigned int> miss_cnt_;
+    std::atomic<unsigned int> turned_away_cnt_;
+    std::atomic<uint64_t> byte_cnt_;
+    MicroDiffer<uint32_t> differ_late_;
+};
+
+} // namespace detector
+
+#endif // HLS_H
@@ -0,0 +1,273 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <dirent.h>
+#include <algorithm>
+
+#include "idle.h"
+#include "tflow.h"
+#include "tracker.h"
+#include "encoder.h"
+#include "capturer.h"
+#include "rtsp.h"
+#include "metrics.h"
+
+namespace detector {
+
+static const char* cpufreq_dir = "/sys/devices/system/cpu/cpufreq";
+
+Idle::Idle(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Idle::~Idle() {
+}
+
+std::unique_ptr<Idle> Idle::create(unsigned int yield_time, bool quiet,
+    const std::string& spec, Pipeline* pipe) {
+  auto obj = std::unique_ptr<Idle>(new Idle(yield_time));
+  if (!obj->init(quiet, spec, pipe)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Idle::init(bool quiet, const std::string& spec, Pipeline* pipe) {
+
+  quiet_ = quiet;
+  pipe_ = pipe;
+
+  // sec[,fps[,cpugov]]
+  unsigned int secs = 0;
+  fps_ = 2;
+  char gov[64] = "";
+  if (sscanf(spec.c_str(), "%u,%u,%63s", &secs, &fps_, gov) < 1 || !secs || !fps_) {
+    dbgMsg("failed: idle %s\n", spec.c_str());
+    return false;
+  }
+  after_ms_ = secs * 1000;
+  cpu_gov_ = gov;
+
+  base_rate_ = 0.f;
+  base_bitrate_ = 0;
+  base_fps_ = 0;
+  base_govs_.clear();
+
+  idle_ = false;
+  quiet_since_ = 0;
+
+  idle_on_ = false;
+  enter_cnt_ = 0;
+  idle_secs_ = 0.f;
+
+  return true;
+}
+
+bool Idle::busy() {
+
+  unsigned int now = since_start_ms();
+  auto tfl = pipe_->get<Tflow>("tfl");
+  if (tfl && now - tfl->lastActive() < recent_ms_) {
+    return true;
+  }
+  auto trk = pipe_->get<Tracker>("trk");
+  if (trk) {
+    auto tracks = trk->getTracks();
+    if (tracks && !tracks->empty()) {
+      return true;
+    }
+  }
+  auto rtsp = pipe_->get<Rtsp>("rtsp");
+  if (rtsp && rtsp->clients()) {
+    return true;
+  }
+  return false;
+}
+
+void Idle::setGovernor(bool idle) {
+
+  if (cpu_gov_.empty()) {
+    return;
+  }
+  if (idle) {
+    base_govs_.clear();
+    DIR* d = opendir(cpufreq_dir);
+    if (!d) {
+      return;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(d)) != nullptr) {
+      std::string name = ent->d_name;
+      if (name.compare(0, 6, "policy") != 0) {
+        continue;
+      }
+      std::string path = std::string(cpufreq_dir) + "/" + name + "/scaling_governor";
+      FILE* fd = fopen(path.c_str(), "r");
+      char was[64] = "";
+      if (!fd) {
+        continue;
+      }
+      bool ok = fscanf(fd, "%63s", was) == 1;
+      fclose(fd);
+      if (ok) {
+        base_govs_.push_back(std::make_pair(path, std::string(was)));
+      }
+    }
+    closedir(d);
+  }
+
+  // needs root or a writable sysfs, otherwise it only costs a try
+  for (auto& pg : base_govs_) {
+    FILE* fd = fopen(pg.first.c_str(), "w");
+    if (!fd) {
+      dbgMsg("failed: idle cpu governor %s\n", pg.first.c_str());
+      continue;
+    }
+    fprintf(fd, "%s\n", idle ? cpu_gov_.c_str() : pg.second.c_str());
+    fclose(fd);
+  }
+  if (!idle) {
+    base_govs_.clear();
+  }
+}
+
+void Idle::enter() {
+
+  auto tfl = pipe_->get<Tflow>("tfl");
+  auto enc = pipe_->get<Encoder>("enc");
+  auto cap = pipe_->get<Capturer>("cap");
+
+  base_rate_ = tfl ? tfl->getRate() : 0.f;
+  base_bitrate_ = enc ? enc->getBitrate() : 0;
+  base_fps_ = cap ? cap->getFramerate() : 0;
+
+  if (tfl) {
+    tfl->setRate(base_rate_ > 0.f ? std::min(base_rate_, static_cast<float>(fps_)) : fps_);
+  }
+  if (enc && base_bitrate_) {
+    enc->setBitrate(base_bitrate_ / 4);
+  }
+  if (cap && base_fps_) {
+    cap->setFramerate(std::min(base_fps_, fps_));
+  }
+  pipe_->setSleep(sleep_, "idle");
+  setGovernor(true);
+
+  idle_ = true;
+  idle_since_ = std::chrono::steady_clock::now();
+  enter_cnt_++;
+
+  if (!quiet_) {
+    fprintf(stderr, "\nidle: nothing for %u sec, fps %u, bitrate %u%s%s\n",
+        after_ms_ / 1000, fps_, base_bitrate_ / 4,
+        cpu_gov_.empty() ? "" : ", cpu ", cpu_gov_.c_str());
+  }
+}
+
+void Idle::leave() {
+
+  auto tfl = pipe_->get<Tflow>("tfl");
+  auto enc = pipe_->get<Encoder>("enc");
+  auto cap = pipe_->get<Capturer>("cap");
+
+  setGovernor(false);
+  pipe_->setSleep(0, "idle");
+  if (cap && base_fps_) {
+    cap->setFramerate(base_fps_);
+  }
+  if (enc && base_bitrate_) {
+    enc->setBitrate(base_bitrate_);
+  }
+  if (tfl) {
+    tfl->setRate(base_rate_);
+  }
+
+  using namespace std::chrono;
+  float secs = duration_cast<duration<float>>(steady_clock::now() - idle_since_).count();
+  idle_secs_ += secs;
+  idle_ = false;
+
+  if (!quiet_) {
+    fprintf(stderr, "\nidle: woken after %.1f sec\n", secs);
+  }
+}
+
+void Idle::metrics(Exposition& out, const std::string& labels) {
+  out.gauge("detector_idle", "1 while the pipeline idles", labels, idle_ ? 1 : 0);
+  out.counter("detector_idle_entries_total", "times it went idle", labels, enter_cnt_);
+}
+
+bool Idle::waitingToRun() {
+
+  if (!idle_on_) {
+    quiet_since_ = since_start_ms();
+    idle_on_ = true;
+  }
+
+  return true;
+}
+
+bool Idle::running() {
+
+  if (idle_on_) {
+    auto tfl = pipe_->get<Tflow>("tfl");
+    if (!tfl || tfl->getState() != Base::State::kRunning) {
+      return true;
+    }
+
+    unsigned int now = since_start_ms();
+    if (busy()) {
+      quiet_since_ = now;
+      if (idle_) {
+        leave();
+      }
+    } else if (!idle_ && now - quiet_since_ >= after_ms_) {
+      enter();
+    }
+  }
+
+  return true;
+}
+
+bool Idle::paused() {
+  return true;
+}
+
+bool Idle::waitingToHalt() {
+
+  if (idle_on_) {
+    idle_on_ = false;
+
+    if (idle_) {
+      leave();
+    }
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nIdle Results...\n");
+      fprintf(stderr, "      times idle: %u\n", enter_cnt_);
+      fprintf(stderr, "       idle time: %.1f sec\n", idle_secs_);
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
@@ -0,0 +1,98 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Idle mode.
+ *
+ *  With --idle sec[,fps[,cpugov]] it looks once a second for anything
+ *  going on: motion or detections from tflow, a track, or a unicast
+ *  viewer on the rtsp server.  After 'sec' seconds of none of those it
+ *  drops the camera and detection rate to 'fps' (2 by default), the
+ *  bitrate to a quarter, lets every stage but the capturers sleep longer
+ *  between loops with no work, and with 'cpugov' (powersave say) puts
+ *  the cpufreq policies on that governor.  The first motion puts it all
+ *  back, the capturers still run so that is at most a frame or two late.
+ *
+ *  With --governor running too, the governor's next step wins.
+ */
+
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <chrono>
+
+#include "utils.h"
+#include "base.h"
+#include "pipeline.h"
+
+namespace detector {
+
+class Idle : public Base {
+  public:
+    static std::unique_ptr<Idle> create(unsigned int yield_time, bool quiet,
+        const std::string& spec, Pipeline* pipe);
+    virtual ~Idle();
+
+    virtual void metrics(Exposition& out, const std::string& labels);
+
+  protected:
+    Idle() = delete;
+    Idle(unsigned int yield_time);
+    bool init(bool quiet, const std::string& spec, Pipeline* pipe);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    unsigned int after_ms_;
+    unsigned int fps_;
+    std::string cpu_gov_;
+    Pipeline* pipe_;
+    const unsigned int sleep_ = {100000};   // usec
+    const unsigned int recent_ms_ = {2000};   // tflow's motion or boxes
+
+    bool busy();
+    void enter();
+    void leave();
+    void setGovernor(bool idle);
+
+    // what it was when it went idle
+    float base_rate_;
+    unsigned int base_bitrate_;
+    unsigned int base_fps_;
+    std::vector<std::pair<std::string, std::string>> base_govs_;
+
+    bool idle_;
+    unsigned int quiet_since_;
+    std::chrono::steady_clock::time_point idle_since_;
+
+    bool idle_on_;
+    unsigned int enter_cnt_;
+    float idle_secs_;
+};
+
+} // namespace detector
+
+#endif // IDLE_H
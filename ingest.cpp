@@ -0,0 +1,515 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "liveMedia.hh"
+#include "BasicUsageEnvironment.hh"
+#include "GroupsockHelper.hh"
+
+#include "ingest.h"
+#include "frames.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "fate.h"
+#include "startup.h"
+#include "deadline.h"
+
+namespace detector {
+
+static const unsigned char start_code[] = { 0x00, 0x00, 0x00, 0x01 };
+
+class Ingest::Client : public RTSPClient {
+  public:
+    static Client* createNew(UsageEnvironment& env, const char* url, Ingest* owner) {
+      return new Client(env, url, owner);
+    }
+
+    Ingest* owner;
+    MediaSession* session = nullptr;
+    MediaSubsession* video = nullptr;
+    bool playing = false;
+
+    static void afterDescribe(RTSPClient* rc, int code, char* result);
+    static void afterSetup(RTSPClient* rc, int code, char* result);
+    static void afterPlay(RTSPClient* rc, int code, char* result);
+    static void afterPlaying(void* data);
+
+  protected:
+    Client(UsageEnvironment& env, const char* url, Ingest* owner)
+      : RTSPClient(env, url, 0, "detector", 0, -1), owner(owner) {}
+    virtual ~Client() {}
+};
+
+class Ingest::Sink : public MediaSink {
+  public:
+    static Sink* createNew(UsageEnvironment& env, Ingest* owner, MediaSubsession* sub) {
+      return new Sink(env, owner, sub);
+    }
+
+  protected:
+    Sink(UsageEnvironment& env, Ingest* owner, MediaSubsession* sub)
+      : MediaSink(env), owner_(owner), sub_(sub), buf_(buf_len_) {}
+    virtual ~Sink() {}
+
+    virtual Boolean continuePlaying() {
+      if (fSource == nullptr) {
+        return False;
+      }
+      fSource->getNextFrame(buf_.data(), buf_.size(), afterGettingFrame, this,
+          onSourceClosure, this);
+      return True;
+    }
+
+  private:
+    Ingest* owner_;
+    MediaSubsession* sub_;
+    const unsigned int buf_len_ = {1024 * 1024};
+    std::vector<unsigned char> buf_;
+
+    static void afterGettingFrame(void* data, unsigned size, unsigned truncated,
+        struct timeval pts, unsigned duration) {
+      Sink* self = static_cast<Sink*>(data);
+      if (truncated != 0) {
+        dbgMsg("warning: ingest nal truncated by %u bytes\n", truncated);
+        self->owner_->au_.clear();
+      } else {
+        self->owner_->nal(self->buf_.data(), size, self->sub_->rtpSource()->curPacketMarkerBit());
+      }
+      self->continuePlaying();
+    }
+};
+
+void Ingest::Client::afterDescribe(RTSPClient* rc, int code, char* result) {
+
+  Client* self = static_cast<Client*>(rc);
+  Ingest* owner = self->owner;
+  std::unique_ptr<char[]> sdp(result);
+  if (code != 0 || !sdp) {
+    dbgMsg("failed: describe %s (%d)\n", owner->url_.c_str(), code);
+    owner->retry();
+    return;
+  }
+
+  // the first h264 video the camera has
+  self->session = MediaSession::createNew(self->envir(), sdp.get());
+  if (self->session == nullptr) {
+    dbgMsg("failed: ingest sdp %s\n", self->envir().getResultMsg());
+    owner->retry();
+    return;
+  }
+  MediaSubsessionIterator iter(*self->session);
+  MediaSubsession* sub;
+  while ((sub = iter.next()) != nullptr) {
+    if (strcmp(sub->mediumName(), "video") == 0 && strcmp(sub->codecName(), "H264") == 0) {
+      break;
+    }
+  }
+  if (sub == nullptr || !sub->initiate()) {
+    dbgMsg("failed: no h264 video at %s\n", owner->url_.c_str());
+    owner->retry();
+    return;
+  }
+  self->video = sub;
+  if (sub->rtpSource() != nullptr) {
+    increaseReceiveBufferTo(self->envir(), sub->rtpSource()->RTPgs()->socketNum(), 2 * 1024 * 1024);
+  }
+
+  // the parameter sets go in front of key frames that come without them
+  owner->params_.clear();
+  unsigned int num = 0;
+  SPropRecord* recs = parseSPropParameterSets(sub->fmtp_spropparametersets(), num);
+  for (unsigned int i = 0; i < num; i++) {
+    owner->params_.insert(owner->params_.end(), start_code, start_code + sizeof(start_code));
+    owner->params_.insert(owner->params_.end(), recs[i].sPropBytes,
+        recs[i].sPropBytes + recs[i].sPropLength);
+  }
+  delete[] recs;
+
+  self->sendSetupCommand(*sub, afterSetup, False, owner->tcp_ ? True : False);
+}
+
+void Ingest::Client::afterSetup(RTSPClient* rc, int code, char* result) {
+
+  Client* self = static_cast<Client*>(rc);
+  Ingest* owner = self->owner;
+  delete[] result;
+  if (code != 0) {
+    dbgMsg("failed: setup %s (%d)\n", owner->url_.c_str(), code);
+    owner->retry();
+    return;
+  }
+  self->video->sink = Sink::createNew(self->envir(), owner, self->video);
+  self->video->sink->startPlaying(*self->video->readSource(), afterPlaying, self);
+  self->sendPlayCommand(*self->session, afterPlay);
+}
+
+void Ingest::Client::afterPlay(RTSPClient* rc, int code, char* result) {
+
+  Client* self = static_cast<Client*>(rc);
+  Ingest* owner = self->owner;
+  delete[] result;
+  if (code != 0) {
+    dbgMsg("failed: play %s (%d)\n", owner->url_.c_str(), code);
+    owner->retry();
+    return;
+  }
+  self->playing = true;
+  owner->connect_cnt_++;
+  if (!owner->quiet_) {
+    fprintf(stderr, "\ningest: playing %s\n", owner->url_.c_str());
+  }
+}
+
+void Ingest::Client::afterPlaying(void* data) {
+
+  // the camera went away
+  Client* self = static_cast<Client*>(data);
+  dbgMsg("ingest stream closed\n");
+  self->owner->retry();
+}
+
+Ingest::Ingest(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Ingest::~Ingest() {
+}
+
+std::unique_ptr<Ingest> Ingest::create(unsigned int yield_time, bool quiet,
+    Encoder* enc, Tflow* tfl, const std::string& url, unsigned int width,
+    unsigned int height, bool direct, bool tcp) {
+  auto obj = std::unique_ptr<Ingest>(new Ingest(yield_time));
+  obj->init(quiet, enc, tfl, url, width, height, direct, tcp);
+  return obj;
+}
+
+void Ingest::setPublisher(Publisher* pub) {
+  pub_ = pub;
+}
+
+void Ingest::setPassthrough(Recorder* rec) {
+  pass_ = rec;
+}
+
+void Ingest::metrics(Exposition& out, const std::string& labels) {
+  out.counter("detector_frames_total", "frames captured", labels, frame_cnt_);
+  out.counter("detector_ingest_access_units_total", "access units from the ip camera", labels, au_cnt_);
+  out.counter("detector_ingest_connects_total", "times the ip camera's stream started playing",
+      labels, connect_cnt_);
+  out.counter("detector_decode_errors_total", "access units that didn't go to the decoder",
+      labels, decode_err_cnt_);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"h264_decode\"", differ_dec_.hist);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"tflow_copy\"", differ_tfl_.hist);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"encode_copy\"", differ_enc_.hist);
+}
+
+void Ingest::footprint(Footprint& out) {
+  if (dec_) {
+    dec_->footprint(out);
+  }
+  size_t num, bytes;
+  pyr_->footprint(num, bytes);
+  out.add("pyramid", num, bytes);
+}
+
+bool Ingest::init(bool quiet, Encoder* enc, Tflow* tfl, const std::string& url,
+    unsigned int width, unsigned int height, bool direct, bool tcp) {
+
+  quiet_ = quiet;
+  enc_ = enc;
+  tfl_ = tfl;
+  pub_ = nullptr;
+  pass_ = nullptr;
+  url_ = url;
+  width_ = width;
+  height_ = height;
+  direct_ = direct;
+  tcp_ = tcp;
+
+  schd_ = nullptr;
+  env_ = nullptr;
+  client_ = nullptr;
+  watch_ = 0;
+  retry_task_ = nullptr;
+
+  pyr_ = Pyramid::create(width_, height_, V4L2_PIX_FMT_YUV420);
+  held_ = 0;
+  ingest_on_ = false;
+
+  frame_cnt_ = 0;
+  au_cnt_ = 0;
+  decode_err_cnt_ = 0;
+  connect_cnt_ = 0;
+  first_ms_ = -1;
+
+  return true;
+}
+
+bool Ingest::connect() {
+
+  retry_task_ = nullptr;
+  dbgMsg("ingest describe %s\n", url_.c_str());
+  client_ = Client::createNew(*env_, url_.c_str(), this);
+  if (client_ == nullptr) {
+    dbgMsg("failed: ingest client %s\n", env_->getResultMsg());
+    return false;
+  }
+  client_->sendDescribeCommand(Client::afterDescribe);
+  return true;
+}
+
+void Ingest::disconnect() {
+
+  if (client_ != nullptr) {
+    if (client_->video != nullptr && client_->video->sink != nullptr) {
+      client_->video->sink->stopPlaying();
+      Medium::close(client_->video->sink);
+      client_->video->sink = nullptr;
+    }
+    if (client_->session != nullptr) {
+      if (client_->playing) {
+        client_->sendTeardownCommand(*client_->session, nullptr);
+      }
+      Medium::close(client_->session);
+    }
+    Medium::close(client_);
+    client_ = nullptr;
+  }
+  au_.clear();
+}
+
+void Ingest::retry() {
+  disconnect();
+  if (retry_task_ == nullptr) {
+    retry_task_ = env_->taskScheduler().scheduleDelayedTask(retry_, reconnect, this);
+  }
+}
+
+void Ingest::reconnect(void* data) {
+  Ingest* self = static_cast<Ingest*>(data);
+  if (!self->connect()) {
+    self->retry();
+  }
+}
+
+void Ingest::slice(void* data) {
+  static_cast<Ingest*>(data)->watch_ = 1;
+}
+
+void Ingest::nal(const unsigned char* data, unsigned int len, bool last) {
+
+  if (len != 0) {
+    unsigned int type = data[0] & 0x1f;
+    bool has_sps = false;
+    for (size_t i = 0; i + 4 < au_.size() && !has_sps; i++) {
+      has_sps = au_[i] == 0 && au_[i + 1] == 0 && au_[i + 2] == 1 && (au_[i + 3] & 0x1f) == 7;
+    }
+    if (type == 5 && !has_sps) {
+      au_.insert(au_.begin(), params_.begin(), params_.end());
+    }
+    au_.insert(au_.end(), start_code, start_code + sizeof(start_code));
+    au_.insert(au_.end(), data, data + len);
+  }
+  if (last && !au_.empty()) {
+    accessUnit();
+  }
+}
+
+void Ingest::accessUnit() {
+
+  au_cnt_++;
+  auto stamp = std::chrono::steady_clock::now();
+
+  // the camera's own encode, for the recorder
+  if (pass_) {
+    NalBuf nb(au_.size(), au_.data(), stamp);
+    pass_->addMessage(nb);
+  }
+
+  // frames come out of the codec a frame or two after they go in
+  if (dec_) {
+    differ_dec_.begin();
+    if (!dec_->feed(au_.data(), au_.size(), stamp)) {
+      decode_err_cnt_++;
+    }
+    unsigned int index, used;
+    std::chrono::steady_clock::time_point at;
+    while (dec_->take(index, used, at, 0)) {
+      frame(index, used, at);
+    }
+    differ_dec_.end();
+  }
+  au_.clear();
+}
+
+void Ingest::frame(unsigned int index, unsigned int used,
+    std::chrono::steady_clock::time_point stamp) {
+
+  FrameBuf fbuf = dec_->buffers()[index];
+  fbuf.length = used;
+  fbuf.id = frame_cnt_++;
+  fbuf.stamp = stamp;
+  if (first_ms_ < 0) {
+    first_ms_ = since_start_ms();
+    Startup::ready(Startup::kFrame);
+  }
+  Trace::span(Trace::Hop::kDqbuf, fbuf.stamp, fbuf.id, fbuf.stamp);
+  PROBE(dequeue, probe_us(fbuf.stamp), fbuf.id, fbuf.length, width_, height_);
+  Fate::reach(Fate::kCaptured, fbuf.stamp);
+  Decoder* dec = dec_.get();
+  held_++;
+  Frames::wrap(fbuf, [this, index, dec]() { dec->release(index); held_--; });
+  fbuf.levels = pyr_->make(fbuf.addr);
+
+  if (tfl_) {
+    differ_tfl_.begin();
+    fbuf.deadline = Deadline::forTflow(fbuf.stamp);
+    tfl_->addMessage(fbuf);
+    differ_tfl_.end();
+  }
+  if (enc_ && !pass_) {
+    differ_enc_.begin();
+    fbuf.deadline = Deadline::forEncoder(fbuf.stamp);
+    enc_->addMessage(fbuf);
+    differ_enc_.end();
+  }
+  if (pub_) {
+    pub_->addMessage(fbuf);
+  }
+}
+
+bool Ingest::waitingToRun() {
+
+  if (!ingest_on_) {
+
+    // only decode when someone looks at the frames
+    if (tfl_ || pub_ || (enc_ && !pass_)) {
+      dbgMsg("open h264 decoder\n");
+      dec_ = Decoder::create("/dev/video10", V4L2_PIX_FMT_H264);
+      if (!dec_->open(width_, height_, direct_)) {
+        if (!quiet_) {
+          fprintf(stderr, "  no h264 decoder for %ux%u\n", width_, height_);
+        }
+        dec_.reset();
+        return false;
+      }
+      if (direct_ && enc_ && !pass_) {
+        enc_->useBuffers(dec_->buffers());
+      }
+    }
+
+    dbgMsg("create ingest scheduler and environment\n");
+    schd_ = BasicTaskScheduler::createNew();
+    env_ = BasicUsageEnvironment::createNew(*schd_);
+    if (!connect()) {
+      return false;
+    }
+
+    differ_tot_.begin();
+    ingest_on_ = true;
+  }
+
+  return true;
+}
+
+bool Ingest::running() {
+
+  if (ingest_on_) {
+
+    // the client's handlers run in here
+    watch_ = 0;
+    TaskToken tok = env_->taskScheduler().scheduleDelayedTask(slice_, slice, this);
+    env_->taskScheduler().doEventLoop(&watch_);
+    env_->taskScheduler().unscheduleDelayedTask(tok);
+  }
+  return true;
+}
+
+bool Ingest::paused() {
+  return true;
+}
+
+bool Ingest::waitingToHalt() {
+
+  if (ingest_on_) {
+
+    ingest_on_ = false;
+    differ_tot_.end();
+
+    dbgMsg("ingest teardown\n");
+    disconnect();
+    if (retry_task_ != nullptr) {
+      env_->taskScheduler().unscheduleDelayedTask(retry_task_);
+    }
+    env_->reclaim();
+    env_ = nullptr;
+    delete schd_;
+    schd_ = nullptr;
+
+    // wait for consumers to release their frames
+    dbgMsg("wait for held frames\n");
+    auto limit = std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(release_timeout_);
+    while (held_ != 0 && std::chrono::steady_clock::now() < limit) {
+      std::this_thread::sleep_for(std::chrono::microseconds(yield_time_));
+    }
+    if (held_ != 0) {
+      dbgMsg("warning: %u frames still held, leaving the decoder open\n",
+          static_cast<unsigned int>(held_));
+      dec_.release();
+    } else {
+      dec_.reset();
+    }
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\n\nIngest Results...\n");
+      fprintf(stderr, "         frames decoded: %u\n", frame_cnt_);
+      fprintf(stderr, "  access units (errors): %u (%u)\n", au_cnt_, decode_err_cnt_);
+      fprintf(stderr, "         times connected: %u\n", connect_cnt_);
+      fprintf(stderr, " first frame (ms start): %d\n", first_ms_);
+      fprintf(stderr, "       decode time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_dec_.pct(.5), differ_dec_.pct(.9), differ_dec_.pct(.99), differ_dec_.pct(.999),
+          differ_dec_.high, differ_dec_.avg,
+          differ_dec_.low,  differ_dec_.cnt);
+      fprintf(stderr, "   tflow copy time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_tfl_.pct(.5), differ_tfl_.pct(.9), differ_tfl_.pct(.99), differ_tfl_.pct(.999),
+          differ_tfl_.high, differ_tfl_.avg,
+          differ_tfl_.low,  differ_tfl_.cnt);
+      fprintf(stderr, "  encode copy time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_enc_.pct(.5), differ_enc_.pct(.9), differ_enc_.pct(.99), differ_enc_.pct(.999),
+          differ_enc_.high, differ_enc_.avg,
+          differ_enc_.low,  differ_enc_.cnt);
+      fprintf(stderr, "        total test time: %f sec\n",
+          differ_tot_.avg / 1000000.f);
+      fprintf(stderr, "      frames per second: %f fps\n",
+          frame_cnt_ * 1000000.f / differ_tot_.avg);
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
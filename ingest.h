@@ -0,0 +1,144 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Stand-in for the Capturer that pulls an ip camera's rtsp stream.
+ *
+ *  A live555 client on this stage's thread asks for the camera's h264
+ *  video and gathers each access unit from its nals (the sps and pps
+ *  from the sdp go in front of the first).  Access units are decoded on
+ *  the VideoCore by the same mem2mem decoder mjpeg cameras use, into
+ *  i420 frames laid out like captured ones, which go to tflow, the
+ *  encoder and the publisher with a pyramid like any other frame.  The
+ *  stream has to be the pipeline's size.
+ *
+ *  With pass-through the camera's own nals go straight to the recorder
+ *  and the encoder gets no frames, so nothing is encoded twice.  A lost stream is set up again every few seconds.
+ */
+
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <string>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <chrono>
+
+#include "utils.h"
+#include "listener.h"
+#include "base.h"
+#include "encoder.h"
+#include "tflow.h"
+#include "publish.h"
+#include "pyramid.h"
+#include "decoder.h"
+#include "recorder.h"
+
+class UsageEnvironment;
+class TaskScheduler;
+
+namespace detector {
+
+class Ingest : public Base {
+  public:
+    static std::unique_ptr<Ingest> create(unsigned int yield_time, bool quiet,
+        Encoder* enc, Tflow* tfl, const std::string& url, unsigned int width,
+        unsigned int height, bool direct, bool tcp);
+    virtual ~Ingest();
+
+    // frames also go to the shared memory publisher
+    void setPublisher(Publisher* pub);
+
+    // the camera's nals go to the recorder as they are, instead of
+    // frames to the encoder; before start
+    void setPassthrough(Recorder* rec);
+
+    // the metrics endpoint's samples
+    virtual void metrics(Exposition& out, const std::string& labels);
+    virtual void footprint(Footprint& out);
+
+  protected:
+    Ingest() = delete;
+    Ingest(unsigned int yield_time);
+    bool init(bool quiet, Encoder* enc, Tflow* tfl, const std::string& url,
+        unsigned int width, unsigned int height, bool direct, bool tcp);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    Encoder* enc_;
+    Tflow* tfl_;
+    Publisher* pub_;
+    Recorder* pass_;
+    std::string url_;
+    unsigned int width_;
+    unsigned int height_;
+    bool direct_;
+    bool tcp_;
+
+    // live555, on our own thread a slice at a time
+    class Client;
+    class Sink;
+    TaskScheduler* schd_;
+    UsageEnvironment* env_;
+    Client* client_;
+    char watch_;
+    const unsigned int slice_ = {100000};     // usec
+    const unsigned int retry_ = {3000000};    // usec
+    void* retry_task_;
+    bool connect();
+    void disconnect();
+    void retry();
+    static void slice(void* data);
+    static void reconnect(void* data);
+
+    // an access unit, start codes included
+    std::vector<unsigned char> au_;
+    std::vector<unsigned char> params_;
+    void nal(const unsigned char* data, unsigned int len, bool last);
+    void accessUnit();
+
+    std::unique_ptr<Decoder> dec_;
+    std::unique_ptr<Pyramid> pyr_;
+    std::atomic<unsigned int> held_;
+    const unsigned int release_timeout_ = {2000};  // msec
+    void frame(unsigned int index, unsigned int used,
+        std::chrono::steady_clock::time_point stamp);
+
+    std::atomic<bool> ingest_on_;
+
+    unsigned int frame_cnt_;
+    unsigned int au_cnt_;
+    unsigned int decode_err_cnt_;
+    unsigned int connect_cnt_;
+    int first_ms_;
+    MicroDiffer<uint32_t> differ_dec_;
+    MicroDiffer<uint32_t> differ_tfl_;
+    MicroDiffer<uint32_t> differ_enc_;
+    MicroDiffer<uint32_t> differ_tot_;
+};
+
+} // namespace detector
+
+#endif // INGEST_H
@@ -0,0 +1,393 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "storage.h"
+#include "metrics.h"
+
+namespace detector {
+
+// the segments under 'dir' as 'dir/det-<msec>', oldest first
+static std::vector<std::string> segments(const std::string& dir) {
+  std::vector<std::pair<int64_t, std::string>> found;
+  DIR* d = opendir(dir.c_str());
+  if (d != nullptr) {
+    struct dirent* ent;
+    while ((ent = readdir(d)) != nullptr) {
+      long long ms;
+      char tail[8];
+      if (sscanf(ent->d_name, "det-%lld.%7s", &ms, tail) == 2 && strcmp(tail, "jnl") == 0) {
+        found.push_back({ms, dir + "/det-" + std::to_string(ms)});
+      }
+    }
+    closedir(d);
+  }
+  std::sort(found.begin(), found.end());
+  std::vector<std::string> segs;
+  for (auto& f : found) {
+    segs.push_back(f.second);
+  }
+  return segs;
+}
+
+static void set_velocity(JnlRecord& rec, const BoxBuf& box) {
+  rec.vx = 0;
+  rec.vy = 0;
+}
+
+static void set_velocity(JnlRecord& rec, const TrackBuf& track) {
+  rec.vx = static_cast<int16_t>(std::min(std::max(track.vx, -32767.f), 32767.f));
+  rec.vy = static_cast<int16_t>(std::min(std::max(track.vy, -32767.f), 32767.f));
+}
+
+Journal::Journal(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Journal::~Journal() {
+  close();
+}
+
+std::unique_ptr<Journal> Journal::create(unsigned int yield_time, bool quiet,
+    const std::string& spec) {
+  auto obj = std::unique_ptr<Journal>(new Journal(yield_time));
+  if (!obj->init(quiet, spec)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Journal::init(bool quiet, const std::string& spec) {
+
+  quiet_ = quiet;
+
+  // dir[,mb[,num]]
+  unsigned int mb = 64;
+  seg_max_ = 16;
+  dir_ = spec.substr(0, spec.find(','));
+  if (dir_.size() < spec.size() &&
+      sscanf(spec.c_str() + dir_.size(), ",%u,%u", &mb, &seg_max_) < 1) {
+    dbgMsg("failed: journal size %s\n", spec.c_str());
+    return false;
+  }
+  if (dir_.empty() || mb == 0 || seg_max_ == 0) {
+    dbgMsg("failed: journal %s\n", spec.c_str());
+    return false;
+  }
+  seg_len_ = static_cast<uint64_t>(mb) << 20;
+  mkdir(dir_.c_str(), 0755);
+  segs_ = segments(dir_);
+
+  fd_ = -1;
+  idx_fd_ = -1;
+  records_ = 0;
+  indexed_ = 0;
+  offset_ms_ = 0;
+  journal_on_ = false;
+  record_cnt_ = 0;
+  byte_cnt_ = 0;
+  seg_cnt_ = 0;
+  fail_cnt_ = 0;
+  return true;
+}
+
+bool Journal::addMessage(std::shared_ptr<std::vector<BoxBuf>>& boxes) {
+  if (!journal_on_ || !boxes || !box_chan_.push(boxes)) {
+    return false;
+  }
+  wake();
+  return true;
+}
+
+bool Journal::addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks) {
+  if (!journal_on_ || !tracks || !track_chan_.push(tracks)) {
+    return false;
+  }
+  wake();
+  return true;
+}
+
+void Journal::metrics(Exposition& out, const std::string& labels) {
+  out.counter("detector_journal_records_total", "boxes and tracks logged", labels, record_cnt_);
+  out.counter("detector_journal_bytes_total", "bytes logged", labels, byte_cnt_);
+  out.gauge("detector_queue_depth", "messages waiting for the stage", labels,
+      box_chan_.size() + track_chan_.size());
+  out.counter("detector_queue_drops_total", "messages the stage's queue dropped", labels,
+      box_chan_.drops() + track_chan_.drops());
+}
+
+int64_t Journal::wall(std::chrono::steady_clock::time_point stamp) {
+  using namespace std::chrono;
+  if (stamp.time_since_epoch().count() == 0) {
+    stamp = steady_clock::now();
+  }
+  int64_t ms = duration_cast<milliseconds>(stamp.time_since_epoch()).count();
+  std::unique_lock<std::mutex> lck(rebase_lock_);
+  for (auto r = rebases_.rbegin(); r != rebases_.rend(); ++r) {
+    if (r->first <= ms) {
+      return ms + r->second;
+    }
+  }
+  return ms + offset_ms_;
+}
+
+void Journal::rebase(std::chrono::steady_clock::time_point from, int64_t wall_ms) {
+  using namespace std::chrono;
+  int64_t ms = duration_cast<milliseconds>(from.time_since_epoch()).count();
+  std::unique_lock<std::mutex> lck(rebase_lock_);
+  rebases_.push_back({ms, wall_ms - ms});
+}
+
+bool Journal::write(int fd, const void* data, size_t len) {
+  return Storage::write(fd, data, len, true);
+}
+
+bool Journal::open(int64_t start) {
+
+  std::string name = dir_ + "/det-" + std::to_string(start);
+  fd_ = Storage::open(name + ".jnl", seg_chunk_);
+  idx_fd_ = Storage::open(name + ".idx");
+  if (fd_ < 0 || idx_fd_ < 0) {
+    dbgMsg("failed: open journal %s\n", name.c_str());
+    close();
+    return false;
+  }
+  JnlHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = jnl_magic;
+  hdr.version = jnl_version;
+  hdr.record_len = sizeof(JnlRecord);
+  hdr.start = start;
+  if (!write(fd_, &hdr, sizeof(hdr))) {
+    close();
+    return false;
+  }
+  byte_cnt_ += sizeof(hdr);
+  records_ = 0;
+  indexed_ = INT64_MIN;
+  segs_.push_back(name);
+  seg_cnt_++;
+  prune();
+  return true;
+}
+
+void Journal::close() {
+  if (fd_ >= 0) {
+    Storage::close(fd_);
+    fd_ = -1;
+  }
+  if (idx_fd_ >= 0) {
+    Storage::close(idx_fd_);
+    idx_fd_ = -1;
+  }
+}
+
+void Journal::prune() {
+  while (segs_.size() > seg_max_) {
+    unlink((segs_.front() + ".jnl").c_str());
+    unlink((segs_.front() + ".idx").c_str());
+    segs_.erase(segs_.begin());
+  }
+}
+
+template<typename T>
+void Journal::append(JnlRecord::Kind kind, const std::vector<T>& boxes) {
+
+  if (boxes.empty()) {
+    return;
+  }
+  differ_write_.begin();
+  int64_t stamp = wall(boxes.front().stamp);
+  if (fd_ >= 0 && sizeof(JnlHeader) + (records_ + boxes.size()) * sizeof(JnlRecord) > seg_len_) {
+    close();
+  }
+  if (fd_ < 0 && !open(stamp)) {
+    fail_cnt_++;
+    differ_write_.end();
+    return;
+  }
+
+  // the index points at the first record a second or more after the last
+  if (stamp >= indexed_ + index_step_) {
+    JnlIndex ent{stamp, records_};
+    if (write(idx_fd_, &ent, sizeof(ent))) {
+      indexed_ = stamp;
+    }
+  }
+
+  batch_.resize(boxes.size());
+  for (unsigned int k = 0; k < boxes.size(); k++) {
+    const T& b = boxes[k];
+    JnlRecord& rec = batch_[k];
+    rec.stamp = stamp;
+    rec.frame = (kind == JnlRecord::kBox) ? b.id : 0;
+    rec.id = (kind == JnlRecord::kTrack) ? b.id : 0;
+    rec.x = std::min(b.x, 65535u);
+    rec.y = std::min(b.y, 65535u);
+    rec.w = std::min(b.w, 65535u);
+    rec.h = std::min(b.h, 65535u);
+    rec.kind = kind;
+    rec.type = static_cast<uint8_t>(b.type);
+    rec.score = static_cast<uint16_t>(std::min(std::max(b.score, 0.f), 1.f) * 10000.f);
+    set_velocity(rec, b);
+  }
+  size_t len = batch_.size() * sizeof(JnlRecord);
+  if (!write(fd_, batch_.data(), len)) {
+    dbgMsg("failed: write journal\n");
+    fail_cnt_++;
+    close();
+  } else {
+    records_ += batch_.size();
+    record_cnt_ += batch_.size();
+    byte_cnt_ += len;
+  }
+  differ_write_.end();
+}
+
+bool Journal::query(const std::string& dir, int64_t from, int64_t to,
+    const std::function<bool(const JnlRecord&)>& fn) {
+
+  std::vector<std::string> segs = segments(dir);
+  for (unsigned int n = 0; n < segs.size(); n++) {
+
+    // only the segments that can hold part of the range
+    long long start = 0, next = INT64_MAX;
+    sscanf(segs[n].c_str() + dir.size(), "/det-%lld", &start);
+    if (n + 1 < segs.size()) {
+      sscanf(segs[n + 1].c_str() + dir.size(), "/det-%lld", &next);
+    }
+    if (start >= to || next <= from) {
+      continue;
+    }
+
+    // the last index entry at or before 'from'
+    uint64_t first = 0;
+    FILE* idx = fopen((segs[n] + ".idx").c_str(), "rb");
+    if (idx != nullptr) {
+      JnlIndex ent;
+      while (fread(&ent, sizeof(ent), 1, idx) == 1 && ent.stamp <= from) {
+        first = ent.record;
+      }
+      fclose(idx);
+    }
+
+    int fd = ::open((segs[n] + ".jnl").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(JnlHeader)) {
+      ::close(fd);
+      continue;
+    }
+    size_t len = st.st_size;
+    void* map = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+      continue;
+    }
+    auto hdr = static_cast<const JnlHeader*>(map);
+    bool more = true;
+    if (hdr->magic == jnl_magic && hdr->record_len == sizeof(JnlRecord)) {
+      auto recs = reinterpret_cast<const JnlRecord*>(hdr + 1);
+      uint64_t num = (len - sizeof(JnlHeader)) / sizeof(JnlRecord);
+      for (uint64_t k = first; k < num && more; k++) {
+        if (recs[k].stamp >= to) {
+          break;
+        }
+        if (recs[k].stamp >= from) {
+          more = fn(recs[k]);
+        }
+      }
+    }
+    munmap(map, len);
+    if (!more) {
+      break;
+    }
+  }
+  return true;
+}
+
+bool Journal::waitingToRun() {
+
+  if (!journal_on_) {
+    using namespace std::chrono;
+    offset_ms_ = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count() -
+      duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+    journal_on_ = true;
+  }
+  return true;
+}
+
+bool Journal::running() {
+
+  if (journal_on_) {
+    std::shared_ptr<std::vector<BoxBuf>> boxes;
+    while (box_chan_.pop(boxes)) {
+      append(JnlRecord::kBox, *boxes);
+      boxes.reset();
+    }
+    std::shared_ptr<std::vector<TrackBuf>> tracks;
+    while (track_chan_.pop(tracks)) {
+      append(JnlRecord::kTrack, *tracks);
+      tracks.reset();
+    }
+  }
+  return true;
+}
+
+bool Journal::paused() {
+  return true;
+}
+
+bool Journal::waitingToHalt() {
+
+  if (journal_on_) {
+    journal_on_ = false;
+    close();
+
+    if (!quiet_) {
+      fprintf(stderr, "\nJournal Results...\n");
+      fprintf(stderr, "           records: %llu\n",
+          static_cast<unsigned long long>(record_cnt_.load()));
+      fprintf(stderr, "             bytes: %llu\n",
+          static_cast<unsigned long long>(byte_cnt_.load()));
+      fprintf(stderr, "          segments: %u (kept %zu)\n", seg_cnt_, segs_.size());
+      fprintf(stderr, "    write failures: %u\n", fail_cnt_);
+      fprintf(stderr, "   write time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_write_.pct(.5), differ_write_.pct(.9), differ_write_.pct(.99), differ_write_.pct(.999),
+          differ_write_.high, differ_write_.avg, 
+          differ_write_.low,  differ_write_.cnt);
+      fprintf(stderr, "\n");
+    }
+  }
+  return true;
+}
+
+} // namespace detector
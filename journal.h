@@ -0,0 +1,171 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Binary detection log.
+ *
+ *  With --journal dir[,mb[,num]] every batch of boxes and of tracks is
+ *  appended to segment files 'dir/det-<msec>.jnl', named for the wall
+ *  clock msec of their first record, a new one every 'mb' megabytes and
+ *  only the last 'num' kept.  A segment is a JnlRecord sized JnlHeader
+ *  and then JnlRecords, one a box, in time order, so it can be mapped
+ *  and searched as an array.
+ *
+ *  Next to each segment 'det-<msec>.idx' holds a JnlIndex every second
+ *  or so of records, the first record at or after its time, so a reader
+ *  finds the start of a time range with a search of the index and reads
+ *  only the records in it.  'query' does just that.
+ *
+ *  Records are on the wall clock, not the steady one, for asking about
+ *  a time of day.  A detection's 'frame' is its frame's id and 'id' 0, a
+ *  track's 'id' the track id and 'frame' 0.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+
+#include "utils.h"
+#include "listener.h"
+#include "channel.h"
+#include "base.h"
+
+namespace detector {
+
+const uint32_t jnl_magic = 0x444a4e31;    // "DJN1"
+const uint32_t jnl_version = 1;
+
+class JnlRecord {
+  public:
+    enum Kind : uint8_t {
+      kBox = 0,
+      kTrack
+    };
+  public:
+    int64_t stamp;            // wall clock msec at capture
+    uint32_t frame;
+    uint32_t id;
+    uint16_t x, y, w, h;
+    uint8_t kind;
+    uint8_t type;             // BoxBuf::Type
+    uint16_t score;           // 1/10000
+    int16_t vx, vy;           // tracks only, pixels per second
+};
+
+class JnlHeader {
+  public:
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_len;
+    uint32_t pad;
+    int64_t start;            // wall clock msec of the first record
+    int64_t reserved;
+};
+
+class JnlIndex {
+  public:
+    int64_t stamp;
+    uint64_t record;          // its number in the segment
+};
+
+class Journal : public Base {
+  public:
+    static std::unique_ptr<Journal> create(unsigned int yield_time, bool quiet,
+        const std::string& spec);
+    virtual ~Journal();
+
+  public:
+    bool addMessage(std::shared_ptr<std::vector<BoxBuf>>& boxes);
+    bool addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks);
+
+    // the records in [from, to) wall clock msec under 'dir', in order,
+    // until 'fn' returns false
+    static bool query(const std::string& dir, int64_t from, int64_t to,
+        const std::function<bool(const JnlRecord&)>& fn);
+
+    // stamps from 'from' on were recorded at 'wall_ms' then, for footage
+    // that wasn't captured now (see archive.h)
+    void rebase(std::chrono::steady_clock::time_point from, int64_t wall_ms);
+
+    virtual void metrics(Exposition& out, const std::string& labels);
+
+  protected:
+    Journal() = delete;
+    Journal(unsigned int yield_time);
+    bool init(bool quiet, const std::string& spec);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    std::string dir_;
+    uint64_t seg_len_;        // bytes
+    unsigned int seg_max_;
+
+    static constexpr unsigned int index_step_{1000};  // msec
+
+    Channel<std::shared_ptr<std::vector<BoxBuf>>> box_chan_{8,
+      Channel<std::shared_ptr<std::vector<BoxBuf>>>::Policy::kDropOldest};
+    Channel<std::shared_ptr<std::vector<TrackBuf>>> track_chan_{8,
+      Channel<std::shared_ptr<std::vector<TrackBuf>>>::Policy::kDropOldest};
+
+    // the open segment, storage files (see storage.h)
+    static constexpr uint64_t seg_chunk_{1024 * 1024};   // reserved at a time
+    int fd_;
+    int idx_fd_;
+    uint64_t records_;
+    int64_t indexed_;         // msec of the last index entry
+    std::vector<std::string> segs_;     // oldest first, without the suffix
+    bool open(int64_t start);
+    void close();
+    void prune();
+
+    // steady clock to wall clock
+    int64_t offset_ms_;
+    std::mutex rebase_lock_;
+    std::vector<std::pair<int64_t, int64_t>> rebases_;  // steady msec, offset
+    int64_t wall(std::chrono::steady_clock::time_point stamp);
+
+    std::vector<JnlRecord> batch_;
+    template<typename T>
+    void append(JnlRecord::Kind kind, const std::vector<T>& boxes);
+    bool write(int fd, const void* data, size_t len);
+
+    std::atomic<bool> journal_on_;
+    std::atomic<uint64_t> record_cnt_;
+    std::atomic<uint64_t> byte_cnt_;
+    unsigned int seg_cnt_;
+    unsigned int fail_cnt_;
+    MicroDiffer<uint32_t> differ_write_;
+};
+
+} // namespace detector
+
+#endif // JOURNAL_H
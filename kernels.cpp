@@ -0,0 +1,102 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <atomic>
+#include <sys/auxv.h>
+
+#include "kernels.h"
+
+namespace detector {
+
+// the hwcap bits, from the kernel's asm/hwcap.h
+#if defined(__aarch64__)
+static const unsigned long hwcap_asimd   = 1ul << 1;
+static const unsigned long hwcap_crc32   = 1ul << 7;
+static const unsigned long hwcap_asimddp = 1ul << 20;
+#elif defined(__arm__)
+static const unsigned long hwcap_neon    = 1ul << 12;
+static const unsigned long hwcap_vfpv4   = 1ul << 16;
+static const unsigned long hwcap2_crc32  = 1ul << 4;
+#endif
+
+unsigned int Cpu::features() {
+
+  static const unsigned int found = []() {
+    unsigned int f = 0;
+#if defined(__aarch64__)
+    unsigned long hw = getauxval(AT_HWCAP);
+    f |= (hw & hwcap_asimd) ? (kNeon | kVfpv4) : 0;
+    f |= (hw & hwcap_crc32) ? kCrc32 : 0;
+    f |= (hw & hwcap_asimddp) ? kDotprod : 0;
+#elif defined(__arm__)
+    unsigned long hw = getauxval(AT_HWCAP);
+    unsigned long hw2 = getauxval(AT_HWCAP2);
+    f |= (hw & hwcap_neon) ? kNeon : 0;
+    f |= (hw & hwcap_vfpv4) ? kVfpv4 : 0;
+    f |= (hw2 & hwcap2_crc32) ? kCrc32 : 0;
+#endif
+    return f;
+  }();
+  return found;
+}
+
+std::string Cpu::describe() {
+  unsigned int f = features();
+  std::string str;
+  str += (f & kNeon) ? " neon" : "";
+  str += (f & kVfpv4) ? " vfpv4" : "";
+  str += (f & kCrc32) ? " crc32" : "";
+  str += (f & kDotprod) ? " dotprod" : "";
+  return str.empty() ? "none" : str.substr(1);
+}
+
+static const Kernels scalar_kernels = {};
+static std::atomic<const Kernels*> current{nullptr};
+
+static const Kernels* pick() {
+  const Kernels* neon = neonKernels();
+  return (neon && (Cpu::features() & Cpu::kNeon)) ? neon : &scalar_kernels;
+}
+
+const Kernels& Kernels::get() {
+  const Kernels* k = current.load(std::memory_order_acquire);
+  if (!k) {
+    k = pick();
+    current.store(k, std::memory_order_release);
+  }
+  return *k;
+}
+
+const char* Kernels::name() {
+  return (&get() == &scalar_kernels) ? "scalar" : "neon";
+}
+
+bool Kernels::use(const std::string& name) {
+  if (name == "auto") {
+    current = pick();
+  } else if (name == "scalar") {
+    current = &scalar_kernels;
+  } else if (name == "neon" && neonKernels() && (Cpu::features() & Cpu::kNeon)) {
+    current = neonKernels();
+  } else {
+    return false;
+  }
+  return true;
+}
+
+} // namespace detector
@@ -0,0 +1,140 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Cpu features and the kernel table.
+ *
+ *  The pixel kernels in utils.cpp are plain C++ rows.  The vector part of
+ *  each hot row (colour conversion, resize, flips and turns, remap, the motion
+ *  thumbnails and diff, flow patches, scaling, box fills and blending)
+ *  lives in neon.cpp, which is
+ *  always built for neon, and is reached through a table picked once from
+ *  getauxval's hwcaps.  Each entry does what it can of the row with
+ *  vectors and returns how far it got, the caller's scalar loop does the
+ *  rest, and a table entry that is null leaves the whole row to it.  So
+ *  a build with a baseline without neon (ARCH in the Makefile) still
+ *  runs the neon rows on a cpu that has them, and nothing else changes.
+ */
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <string>
+#include <cstdint>
+
+namespace detector {
+
+class Cpu {
+  public:
+    enum Feature : unsigned int {
+      kNeon    = 1 << 0,
+      kVfpv4   = 1 << 1,
+      kCrc32   = 1 << 2,
+      kDotprod = 1 << 3
+    };
+    static unsigned int features();
+    static std::string describe();
+};
+
+class Kernels {
+  public:
+    // colour conversion
+    unsigned int (*yuyv_to_yuv420)(const unsigned char* src, unsigned char* y,
+        unsigned char* u, unsigned char* v, unsigned int width);
+    unsigned int (*uv_to_planes)(const unsigned char* src, unsigned char* u,
+        unsigned char* v, unsigned int num);
+    unsigned int (*yuv_to_rgb24)(const unsigned char* y, const unsigned char* u,
+        const unsigned char* v, unsigned char* dst, unsigned int width,
+        unsigned int step, bool bgr);
+    unsigned int (*yuyv_to_rgb24)(const unsigned char* src, unsigned char* dst,
+        unsigned int width, bool flip, bool bgr);
+    unsigned int (*yuv444_to_rgb24)(const unsigned char* y, const unsigned char* u,
+        const unsigned char* v, unsigned char* dst, unsigned int width);
+    unsigned int (*rgb24_to_yuv420)(const unsigned char* src0, const unsigned char* src1,
+        unsigned char* y0, unsigned char* y1, unsigned char* u, unsigned char* v,
+        unsigned int width, bool bgr);
+    unsigned int (*quantise)(const unsigned char* src, float* dst, unsigned int len,
+        float scale, float zero);
+
+    // resize and scale
+    unsigned int (*blend_rows)(const unsigned char* row0, const unsigned char* row1,
+        unsigned int wy, unsigned char* out, unsigned int len);
+    unsigned int (*half_row)(const unsigned char* s0, const unsigned char* s1,
+        unsigned char* dst, unsigned int num);
+    unsigned int (*half_row_rgb24)(const unsigned char* s0, const unsigned char* s1,
+        unsigned char* dst, unsigned int num);
+
+    // orientation, a row of 'bpp' byte pixels backwards, and the first
+    // 'num' columns of 8 rows of a plane as 8 bytes of 'num' rows, the
+    // strides negative to go up
+    unsigned int (*mirror_row)(const unsigned char* src, unsigned char* dst,
+        unsigned int num, unsigned int bpp);
+    unsigned int (*transpose8)(const unsigned char* src, int src_stride,
+        unsigned char* dst, int dst_stride, unsigned int num);
+
+    // remap, bilinear samples of a plane of bytes at a table's x,y pairs in
+    // 16ths of a pixel, halved 'shift' times for chroma, a pair of 0xffff
+    // getting 'fill'
+    unsigned int (*remap_row)(const unsigned char* plane, unsigned int stride,
+        const uint16_t* lut, unsigned int shift, unsigned char fill,
+        unsigned char* dst, unsigned int num);
+
+    // motion
+    unsigned int (*luma8_yuv420)(const unsigned char* row, unsigned int stride,
+        unsigned char* dst, unsigned int num);
+    unsigned int (*luma8_rgb24)(const unsigned char* row, unsigned int stride,
+        unsigned char* dst, unsigned int num);
+    unsigned int (*count_changed)(const unsigned char* a, const unsigned char* b,
+        const unsigned char* mask, unsigned int len, unsigned char threshold,
+        unsigned int& cnt);
+    unsigned int (*update_background)(const unsigned char* cur, int16_t* bg,
+        const unsigned char* mask, unsigned char* fg, unsigned int len,
+        unsigned char threshold, unsigned int shift);
+
+    // optical flow, bilinear samples at 'wx','wy' of 256 between a pixel and
+    // the next, reading one past 'num'
+    unsigned int (*sample_row)(const unsigned char* row0, const unsigned char* row1,
+        unsigned int wx, unsigned int wy, float* dst, unsigned int num);
+
+    // drawing, 'bpp' 1 or 3 and sprites 4 bytes a pixel
+    unsigned int (*fill_rgb24)(unsigned char* dst, unsigned int len, const unsigned char* c);
+    unsigned int (*blend_span)(unsigned char* row, unsigned int len, const unsigned char* c,
+        unsigned char a, unsigned int bpp);
+    unsigned int (*blend_rgba)(unsigned char* row, const unsigned char* src, unsigned int num);
+    unsigned int (*blend_luma)(unsigned char* row, const unsigned char* src, unsigned int num);
+    unsigned int (*blend_chroma)(unsigned char* u, unsigned char* v, const unsigned char* src,
+        unsigned int num);
+
+    // vectors, the partial sum of the entries done goes in 'sum'
+    unsigned int (*dot_f32)(const float* a, const float* b, unsigned int len, float& sum);
+
+  public:
+    // the table in use, 'auto' until 'use' says otherwise
+    static const Kernels& get();
+    static const char* name();
+
+    // "auto", "neon" or "scalar", false for neon on a cpu or build without it
+    static bool use(const std::string& name);
+};
+
+// the neon rows, null when neon.cpp was built without neon
+const Kernels* neonKernels();
+
+} // namespace detector
+
+#endif // KERNELS_H
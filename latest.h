@@ -0,0 +1,112 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Latest value cell between pipeline threads.
+ *
+ *  For state where only the newest copy matters, like the boxes and
+ *  tracks the encoder draws.  A publisher writes into a free slot of its
+ *  own and swaps it in as the value, freeing the one it replaces.  The
+ *  reader swaps the value out with one exchange and never waits.  Nobody
+ *  blocks and no publish is lost, only overtaken by a newer one, which is
+ *  counted.  A slot is free or it belongs to one thread, so no one reads
+ *  a half written value.  The slots are allocated up front, so publishing
+ *  costs no allocation.
+ */
+
+#ifndef LATEST_H
+#define LATEST_H
+
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <cstdint>
+
+namespace detector {
+
+template<typename T>
+class Latest {
+  public:
+    // more publishers at once than 'slots' - 2 take turns
+    Latest(unsigned int slots = 4)
+      : slots_(slots < 3 ? 3 : slots), value_(kNone), overtaken_(0) {
+      for (auto& slot : slots_) {
+        slot.used.store(false, std::memory_order_relaxed);
+      }
+    }
+    Latest(Latest const &) = delete;
+    ~Latest() {}
+
+    void publish(const T& item) {
+      unsigned int idx = claim();
+      slots_[idx].data = item;
+      unsigned int old = value_.exchange(idx, std::memory_order_acq_rel);
+      if (old != kNone) {
+        release(old);
+        overtaken_.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+
+    // the newest value, false and 'item' left alone if nothing new
+    bool take(T& item) {
+      unsigned int idx = value_.exchange(kNone, std::memory_order_acq_rel);
+      if (idx == kNone) {
+        return false;
+      }
+      item = std::move(slots_[idx].data);
+      release(idx);
+      return true;
+    }
+
+    inline uint64_t overtaken() { return overtaken_.load(std::memory_order_relaxed); }
+    inline size_t bytes()       { return slots_.size() * sizeof(Slot); }
+
+  private:
+    class alignas(64) Slot {
+      public:
+        std::atomic<bool> used;
+        T data;
+    };
+
+    static const unsigned int kNone = ~0u;
+    std::vector<Slot> slots_;
+    alignas(64) std::atomic<unsigned int> value_;
+    std::atomic<uint64_t> overtaken_;
+
+    unsigned int claim() {
+      while (1) {
+        for (unsigned int i = 0; i < slots_.size(); i++) {
+          bool used = false;
+          if (!slots_[i].used.load(std::memory_order_relaxed) &&
+              slots_[i].used.compare_exchange_strong(used, true, std::memory_order_acquire)) {
+            return i;
+          }
+        }
+        std::this_thread::yield();
+      }
+    }
+
+    void release(unsigned int idx) {
+      slots_[idx].data = T();
+      slots_[idx].used.store(false, std::memory_order_release);
+    }
+};
+
+} // namespace detector
+
+#endif // LATEST_H
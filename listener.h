@@ -26,20 +26,41 @@
 #include <pthread.h>
 #include <vector>
 #include <atomic>
+#include <memory>
+#include <chrono>
 
 #include "utils.h"
 
 namespace detector {
 
+class Levels;
+class Level;
+
 // encapsulate a frame buffer
+//
+// 'ref' keeps the underlying buffer alive.  Copies of a FrameBuf share the 
+// reference and the buffer is handed back to its owner when the last copy 
+// is released.  Consumers hold on to the FrameBuf instead of copying 'addr'.
+// 'fd' is the exported dmabuf of the buffer or -1 if there isn't one.
+// 'stamp' is when the frame was captured and follows it through every stage.
+// 'levels' are its scaled down copies, see pyramid.h, or null.
+// 'scaled' is the whole frame at the model's input size, scaled by the isp
+// on a second capture stream, or null.
 class FrameBuf {
   public:
-    FrameBuf() : id(0), length(0), addr(nullptr) {}
+    FrameBuf() : id(0), length(0), addr(nullptr), fd(-1), source(0) {}
     ~FrameBuf() {}
   public:
     unsigned int id;
     unsigned int length;
     unsigned char* addr;
+    int fd;
+    unsigned int source;    // capture device
+    std::chrono::steady_clock::time_point stamp;
+    std::chrono::steady_clock::time_point deadline;   // zero for none, see deadline.h
+    std::shared_ptr<void> ref;
+    std::shared_ptr<Levels> levels;
+    std::shared_ptr<Level> scaled;
 };
 
 // encapsulate box
@@ -54,13 +75,21 @@ class BoxBuf {
   public:
     BoxBuf() = default;
     BoxBuf(BoxBuf::Type type, unsigned int id, unsigned int left, 
-        unsigned int top, unsigned int width, unsigned int height) 
-      : type(type), id(id), x(left), y(top), w(width), h(height) {}
+        unsigned int top, unsigned int width, unsigned int height,
+        std::chrono::steady_clock::time_point stamp = {}, float score = 1.f) 
+      : type(type), id(id), x(left), y(top), w(width), h(height), stamp(stamp),
+        score(score) {}
     ~BoxBuf() {}
   public:
     BoxBuf::Type type;
     unsigned int id;
     unsigned int x, y, w, h;
+    std::chrono::steady_clock::time_point stamp;
+    float score;
+    int cls{-1};              // the model's class, interned, see names.h
+    int attr{-1};             // the crop classifier's class, interned, -1 none
+    float attr_score{0.f};
+    std::shared_ptr<const std::vector<float>> emb;   // unit length appearance, or null
 };
 
 // encapsulate track
@@ -68,26 +97,63 @@ class TrackBuf : public BoxBuf {
   public:
     TrackBuf() = default;
     TrackBuf(BoxBuf::Type type, unsigned int id, unsigned int left, 
-        unsigned int top, unsigned int width, unsigned int height) 
-      : BoxBuf(type, id, left, top, width, height) {}
+        unsigned int top, unsigned int width, unsigned int height,
+        std::chrono::steady_clock::time_point stamp = {}) 
+      : BoxBuf(type, id, left, top, width, height, stamp) {}
     ~TrackBuf() {}
+  public:
+    float vx{0.f}, vy{0.f};   // pixels per second
+};
+
+// encapsulate the boxes shown on one frame, for the metadata stream
+class MetaBuf {
+  public:
+    MetaBuf() = default;
+    ~MetaBuf() {}
+  public:
+    std::chrono::steady_clock::time_point stamp;
+    unsigned int width, height;
+    std::shared_ptr<std::vector<BoxBuf>> boxes;
+};
+
+// coarse motion of one encoded frame, a vector a macroblock
+class MotionBuf {
+  public:
+    MotionBuf() = default;
+    ~MotionBuf() {}
+  public:
+    std::chrono::steady_clock::time_point stamp;
+    unsigned int cols{0}, rows{0};    // macroblocks, 16x16 pixels
+    unsigned int fps{0};              // the vectors are pixels a frame
+    unsigned int moving{0};           // cells whose vector is long enough
+    std::shared_ptr<const std::vector<int8_t>> vec;   // x,y a cell, row by row
 };
 
 // encapsulate NAL
 class NalBuf {
   public:
     NalBuf() = delete;
-    NalBuf(unsigned int l, unsigned char* a) 
-      : length(l), addr(a) {}
+    NalBuf(unsigned int l, unsigned char* a,
+        std::chrono::steady_clock::time_point s = {}) 
+      : length(l), addr(a), stamp(s) {}
     NalBuf(NalBuf const & n) = delete;
     ~NalBuf() {}
   public:
     unsigned int length;
     unsigned char* addr;
+    std::chrono::steady_clock::time_point stamp;
 };
 
 
+// no limit, from a listener that takes whatever it is sent
+const unsigned int credit_any = ~0u;
+
 // listen for a message
+//
+// 'credits' is how many more messages like 'next' it would take now
+// without dropping one or holding it back.  A producer asks before the
+// work of making a message that would go nowhere, and slows down while
+// there are none.
 template<typename T>
 class Listener {
   public:
@@ -95,8 +161,8 @@ class Listener {
     virtual ~Listener() {}
 
   public:
-    const unsigned int timeout_{1000};
     virtual bool addMessage(T& data) = 0;
+    virtual unsigned int credits(const T& next) { return credit_any; }
 };
 
 } // namespace detector
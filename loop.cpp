@@ -0,0 +1,183 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "loop.h"
+
+namespace detector {
+
+// an fd in the low half of epoll's data, its watch's generation above it
+static uint64_t watch_data(int fd, uint32_t gen) {
+  return (static_cast<uint64_t>(gen) << 32) | static_cast<uint32_t>(fd);
+}
+
+Loop::~Loop() {
+  if (wake_fd_ >= 0) {
+    close(wake_fd_);
+  }
+  if (epoll_fd_ >= 0) {
+    close(epoll_fd_);
+  }
+}
+
+std::unique_ptr<Loop> Loop::create() {
+  auto obj = std::unique_ptr<Loop>(new Loop());
+  if (!obj->init()) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Loop::init() {
+
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll_fd_ < 0 || wake_fd_ < 0) {
+    dbgMsg("failed: loop epoll\n");
+    return false;
+  }
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.u64 = watch_data(wake_fd_, 0);
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev) < 0) {
+    dbgMsg("failed: loop eventfd\n");
+    return false;
+  }
+  return true;
+}
+
+bool Loop::watch(int fd, uint32_t events, std::function<void(uint32_t)> fn) {
+  uint32_t gen = ++watch_gen_;
+  struct epoll_event ev = {};
+  ev.events = events;
+  ev.data.u64 = watch_data(fd, gen);
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    dbgMsg("failed: loop watch %d\n", fd);
+    return false;
+  }
+  Loop::Watch& w = watches_[fd];
+  w.gen = gen;
+  w.fn = std::move(fn);
+  return true;
+}
+
+bool Loop::modify(int fd, uint32_t events) {
+  auto it = watches_.find(fd);
+  if (it == watches_.end()) {
+    return false;
+  }
+  struct epoll_event ev = {};
+  ev.events = events;
+  ev.data.u64 = watch_data(fd, it->second.gen);
+  return epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void Loop::unwatch(int fd) {
+  if (watches_.erase(fd) != 0) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  }
+}
+
+uint64_t Loop::after(unsigned int ms, std::function<void()> fn) {
+  uint64_t id = ++timer_id_;
+  Loop::Timer& t = timers_[id];
+  t.due = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+  t.fn = std::move(fn);
+  return id;
+}
+
+void Loop::cancel(uint64_t id) {
+  timers_.erase(id);
+}
+
+void Loop::wake() {
+  uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof(one)) < 0) {
+    dbgMsg("failed: loop wake\n");
+  }
+}
+
+void Loop::post(std::function<void()> fn) {
+  {
+    std::unique_lock<std::mutex> lck(post_lock_);
+    posted_.push_back(std::move(fn));
+  }
+  wake();
+}
+
+bool Loop::turn(unsigned int usec) {
+
+  // no longer than the next timer
+  using namespace std::chrono;
+  auto now = steady_clock::now();
+  int ms = (usec + 999) / 1000;
+  for (auto& t : timers_) {
+    int left = duration_cast<milliseconds>(t.second.due - now).count();
+    ms = std::max(0, std::min(ms, left + 1));
+  }
+
+  struct epoll_event ready[ready_max_];
+  int n = epoll_wait(epoll_fd_, ready, ready_max_, ms);
+  bool any = n > 0;
+
+  std::vector<std::function<void()>> posted;
+  {
+    std::unique_lock<std::mutex> lck(post_lock_);
+    posted.swap(posted_);
+  }
+  for (auto& fn : posted) {
+    fn();
+  }
+
+  // a handler may unwatch any descriptor, so each is looked up as it comes
+  // and dropped if it has been watched again since
+  for (int i = 0; i < n; i++) {
+    int fd = static_cast<int>(ready[i].data.u64 & 0xffffffff);
+    uint32_t gen = ready[i].data.u64 >> 32;
+    if (fd == wake_fd_) {
+      uint64_t cnt;
+      if (read(wake_fd_, &cnt, sizeof(cnt)) < 0) {
+        dbgMsg("failed: loop wake read\n");
+      }
+      continue;
+    }
+    auto it = watches_.find(fd);
+    if (it != watches_.end() && it->second.gen == gen) {
+      auto fn = it->second.fn;
+      fn(ready[i].events);
+    }
+  }
+
+  now = steady_clock::now();
+  for (auto it = timers_.begin(); it != timers_.end(); ) {
+    if (it->second.due > now) {
+      ++it;
+      continue;
+    }
+    auto fn = std::move(it->second.fn);
+    it = timers_.erase(it);
+    fn();
+    any = true;
+  }
+  return any;
+}
+
+} // namespace detector
@@ -0,0 +1,109 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Event loop for stages that wait on file descriptors.
+ *
+ *  One epoll set with an eventfd in it.  A stage that asks Base for a
+ *  loop (useLoop, see base.h) sleeps in 'turn' between its callbacks
+ *  instead of on its work event, so a socket that becomes readable or
+ *  writable, a timer coming due or a 'wake' from another thread (a
+ *  producer with a message, a codec's poll thread with a finished
+ *  buffer) runs the stage's handlers and then its next callback, without
+ *  polling and without a thread of its own per connection.
+ *
+ *  Handlers run on the stage's thread, in 'turn', and may watch, modify
+ *  and unwatch descriptors (their own included) and add or cancel timers.
+ *  Only 'wake' and 'post' may be called from other threads.
+ */
+
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <memory>
+#include <functional>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+
+#include "utils.h"
+
+namespace detector {
+
+class Loop {
+  public:
+    static std::unique_ptr<Loop> create();
+    ~Loop();
+
+  public:
+    // 'fn' gets the epoll events of 'fd' whenever it is ready for 'events'
+    bool watch(int fd, uint32_t events, std::function<void(uint32_t)> fn);
+    bool modify(int fd, uint32_t events);
+    void unwatch(int fd);
+
+    // 'fn' once, 'ms' from now, unless cancelled by its id first
+    uint64_t after(unsigned int ms, std::function<void()> fn);
+    void cancel(uint64_t id);
+
+    // from any thread, the next turn returns at once, and runs 'fn' first
+    void wake();
+    void post(std::function<void()> fn);
+
+    // wait up to 'usec' or the next timer for something to happen and run
+    // its handlers, true if anything happened
+    bool turn(unsigned int usec);
+
+    inline unsigned int watched() { return watches_.size(); }
+
+  protected:
+    Loop() = default;
+    bool init();
+
+  private:
+    int epoll_fd_ = {-1};
+    int wake_fd_ = {-1};
+    const unsigned int ready_max_ = {32};
+
+    // each watch's generation rides in its epoll data beside the fd, so an
+    // event for a descriptor closed and watched again in the same batch
+    // doesn't reach the new handler
+    class Watch {
+      public:
+        uint32_t gen;
+        std::function<void(uint32_t)> fn;
+    };
+    uint32_t watch_gen_ = {0};
+    std::map<int, Loop::Watch> watches_;
+
+    class Timer {
+      public:
+        std::chrono::steady_clock::time_point due;
+        std::function<void()> fn;
+    };
+    uint64_t timer_id_ = {0};
+    std::map<uint64_t, Loop::Timer> timers_;
+
+    std::mutex post_lock_;
+    std::vector<std::function<void()>> posted_;
+};
+
+} // namespace detector
+
+#endif // LOOP_H
@@ -0,0 +1,609 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+#include <chrono>
+#include <algorithm>
+
+#include "m2m.h"
+#include "startup.h"
+
+namespace detector {
+
+M2m::M2m(Base* owner, unsigned int yield_time, const char* device, unsigned int coded)
+  : owner_(owner), yield_time_(yield_time), device_(device), coded_(coded) {
+}
+
+M2m::~M2m() {
+}
+
+std::unique_ptr<M2m> M2m::create(Base* owner, unsigned int yield_time,
+    const char* device, unsigned int coded) {
+  auto obj = std::unique_ptr<M2m>(new M2m(owner, yield_time, device, coded));
+  obj->init();
+  return obj;
+}
+
+bool M2m::init() {
+  fd_ = -1;
+  frame_len_ = 0;
+  gop_ = 0;
+  dmabuf_ = false;
+  poll_on_ = false;
+  poll_wait_ = false;
+  return true;
+}
+
+int M2m::xioctl(int fd, int request, void* arg) {
+  int res;
+  do {
+    res = ioctl(fd, request, arg);
+  } while (res == -1 && errno == EINTR);
+  return res;
+}
+
+bool M2m::setControl(unsigned int id, int value) {
+  struct v4l2_control ctrl;
+  memset(&ctrl, 0, sizeof(ctrl));
+  ctrl.id = id;
+  ctrl.value = value;
+  if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0) {
+    dbgMsg("failed: set control 0x%x (errno: %d)\n", id, errno);
+    return false;
+  }
+  return true;
+}
+
+void M2m::syncInput(unsigned int index, bool start) {
+
+  // the cpu writes overlays into dmabufs the codec reads
+  if (index >= in_.size() || in_[index].fd < 0) {
+    return;
+  }
+  struct dma_buf_sync sync;
+  memset(&sync, 0, sizeof(sync));
+  sync.flags = (start ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END) | DMA_BUF_SYNC_RW;
+  if (xioctl(in_[index].fd, DMA_BUF_IOCTL_SYNC, &sync) < 0) {
+    dbgMsg("warning: dmabuf sync %u (errno: %d)\n", index, errno);
+  }
+}
+
+bool M2m::allocateInput() {
+
+  // our own copy buffers come from the dma heap if there is one
+  unsigned int len = (frame_len_ + 4095) & ~4095;
+  int heap = ::open(heap_, O_RDWR | O_CLOEXEC);
+  dmabuf_ = (heap >= 0);
+
+  struct v4l2_requestbuffers rb;
+  memset(&rb, 0, sizeof(rb));
+  rb.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  rb.memory = dmabuf_ ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
+  rb.count = dmabuf_ ? in_max_ : in_num_;
+  Startup::Scope step("v4l2 input buffers");
+  if (xioctl(fd_, VIDIOC_REQBUFS, &rb) < 0 || rb.count < in_num_) {
+    dbgMsg("failed: request input buffers (errno: %d)\n", errno);
+    if (heap >= 0) {
+      ::close(heap);
+    }
+    return false;
+  }
+
+  in_.assign(in_num_, M2m::Slot());
+  in_free_.clear();
+  for (unsigned int i = 0; i < in_num_; i++) {
+    in_[i].own = true;
+    if (dmabuf_) {
+      struct dma_heap_allocation_data alloc;
+      memset(&alloc, 0, sizeof(alloc));
+      alloc.len = len;
+      alloc.fd_flags = O_RDWR | O_CLOEXEC;
+      if (xioctl(heap, DMA_HEAP_IOCTL_ALLOC, &alloc) < 0) {
+        dbgMsg("failed: dma heap alloc %u (errno: %d)\n", i, errno);
+        ::close(heap);
+        return false;
+      }
+      in_[i].fd = alloc.fd;
+      in_[i].length = len;
+      in_[i].addr = (unsigned char*)mmap(nullptr, len,
+          PROT_READ | PROT_WRITE, MAP_SHARED, alloc.fd, 0);
+    } else {
+      struct v4l2_plane plane;
+      struct v4l2_buffer buf;
+      memset(&plane, 0, sizeof(plane));
+      memset(&buf, 0, sizeof(buf));
+      buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+      buf.memory = V4L2_MEMORY_MMAP;
+      buf.index = i;
+      buf.m.planes = &plane;
+      buf.length = 1;
+      if (xioctl(fd_, VIDIOC_QUERYBUF, &buf) < 0) {
+        dbgMsg("failed: query input buffer %u (errno: %d)\n", i, errno);
+        return false;
+      }
+      in_[i].length = plane.length;
+      in_[i].addr = (unsigned char*)mmap(nullptr, plane.length,
+          PROT_READ | PROT_WRITE, MAP_SHARED, fd_, plane.m.mem_offset);
+    }
+    if (in_[i].addr == MAP_FAILED) {
+      dbgMsg("failed: map input buffer %u (errno: %d)\n", i, errno);
+      in_[i].addr = nullptr;
+      if (heap >= 0) {
+        ::close(heap);
+      }
+      return false;
+    }
+    in_free_.push_back(i);
+  }
+  if (heap >= 0) {
+    ::close(heap);
+  }
+
+  dbgMsg("input buffers: %u %s\n", in_num_, dmabuf_ ? "dmabuf" : "mmap");
+  return true;
+}
+
+bool M2m::allocateOutput() {
+
+  struct v4l2_requestbuffers rb;
+  memset(&rb, 0, sizeof(rb));
+  rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  rb.memory = V4L2_MEMORY_MMAP;
+  rb.count = out_num_;
+  if (xioctl(fd_, VIDIOC_REQBUFS, &rb) < 0 || rb.count == 0) {
+    dbgMsg("failed: request output buffers (errno: %d)\n", errno);
+    return false;
+  }
+
+  out_.assign(rb.count, M2m::Slot());
+  for (unsigned int i = 0; i < rb.count; i++) {
+    struct v4l2_plane plane;
+    struct v4l2_buffer buf;
+    memset(&plane, 0, sizeof(plane));
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = i;
+    buf.m.planes = &plane;
+    buf.length = 1;
+    if (xioctl(fd_, VIDIOC_QUERYBUF, &buf) < 0) {
+      dbgMsg("failed: query output buffer %u (errno: %d)\n", i, errno);
+      return false;
+    }
+    out_[i].own = true;
+    out_[i].length = plane.length;
+    out_[i].addr = (unsigned char*)mmap(nullptr, plane.length,
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd_, plane.m.mem_offset);
+    if (out_[i].addr == MAP_FAILED) {
+      dbgMsg("failed: map output buffer %u (errno: %d)\n", i, errno);
+      out_[i].addr = nullptr;
+      return false;
+    }
+    if (!queueOutput(i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool M2m::queueOutput(unsigned int index) {
+  struct v4l2_plane plane;
+  struct v4l2_buffer buf;
+  memset(&plane, 0, sizeof(plane));
+  memset(&buf, 0, sizeof(buf));
+  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  buf.memory = V4L2_MEMORY_MMAP;
+  buf.index = index;
+  buf.m.planes = &plane;
+  buf.length = 1;
+  if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0) {
+    dbgMsg("failed: queue output buffer %u (errno: %d)\n", index, errno);
+    return false;
+  }
+  return true;
+}
+
+bool M2m::open(unsigned int width, unsigned int height, unsigned int framerate,
+    unsigned int pix_fmt, unsigned int bitrate) {
+
+  dbgMsg("open %s\n", device_);
+  fd_ = ::open(device_, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd_ < 0) {
+    dbgMsg("failed: open %s (errno: %d)\n", device_, errno);
+    return false;
+  }
+
+  struct v4l2_capability cap;
+  memset(&cap, 0, sizeof(cap));
+  if (xioctl(fd_, VIDIOC_QUERYCAP, &cap) < 0) {
+    dbgMsg("failed: query capabilities (errno: %d)\n", errno);
+    return false;
+  }
+  unsigned int caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ?
+    cap.device_caps : cap.capabilities;
+  if (!(caps & V4L2_CAP_VIDEO_M2M_MPLANE) || !(caps & V4L2_CAP_STREAMING)) {
+    dbgMsg("failed: %s is not a mem2mem device\n", device_);
+    return false;
+  }
+
+  // coded format first, then the raw frames
+  dbgMsg("set coded format\n");
+  struct v4l2_format fmt;
+  memset(&fmt, 0, sizeof(fmt));
+  fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  fmt.fmt.pix_mp.width = width;
+  fmt.fmt.pix_mp.height = height;
+  fmt.fmt.pix_mp.pixelformat = coded_;
+  fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+  fmt.fmt.pix_mp.num_planes = 1;
+  fmt.fmt.pix_mp.plane_fmt[0].sizeimage = std::max(out_len_, width * height / 2);
+  if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0) {
+    dbgMsg("failed: set coded format (errno: %d)\n", errno);
+    return false;
+  }
+
+  // frames are laid out like the omx input, 16 aligned stride and slice
+  dbgMsg("set raw format\n");
+  unsigned int stride = ALIGN_16B(width);
+  unsigned int slice = ALIGN_16B(height);
+  memset(&fmt, 0, sizeof(fmt));
+  fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  fmt.fmt.pix_mp.width = width;
+  fmt.fmt.pix_mp.height = slice;
+  fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+  fmt.fmt.pix_mp.num_planes = 1;
+  if (pix_fmt == V4L2_PIX_FMT_YUV420) {
+    fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_YUV420;
+    fmt.fmt.pix_mp.plane_fmt[0].bytesperline = stride;
+    frame_len_ = stride * slice * 3 / 2;
+  } else {
+    fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_RGB24;
+    fmt.fmt.pix_mp.plane_fmt[0].bytesperline = stride * 3;
+    frame_len_ = stride * slice * 3;
+  }
+  fmt.fmt.pix_mp.plane_fmt[0].sizeimage = frame_len_;
+  if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0) {
+    dbgMsg("failed: set raw format (errno: %d)\n", errno);
+    return false;
+  }
+  frame_len_ = fmt.fmt.pix_mp.plane_fmt[0].sizeimage;
+
+  // only the visible part gets encoded
+  struct v4l2_selection sel;
+  memset(&sel, 0, sizeof(sel));
+  sel.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+  sel.target = V4L2_SEL_TGT_CROP;
+  sel.r.width = width;
+  sel.r.height = height;
+  if (xioctl(fd_, VIDIOC_S_SELECTION, &sel) < 0) {
+    dbgMsg("warning: set crop (errno: %d)\n", errno);
+  }
+
+  // match the omx setup, variable bitrate and headers on every key frame
+  if (coded_ == V4L2_PIX_FMT_H264) {
+    struct v4l2_streamparm parm;
+    memset(&parm, 0, sizeof(parm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    parm.parm.output.timeperframe.numerator = 1;
+    parm.parm.output.timeperframe.denominator = framerate;
+    if (xioctl(fd_, VIDIOC_S_PARM, &parm) < 0) {
+      dbgMsg("warning: set framerate (errno: %d)\n", errno);
+    }
+
+    dbgMsg("set bitrate\n");
+    setControl(V4L2_CID_MPEG_VIDEO_BITRATE_MODE, V4L2_MPEG_VIDEO_BITRATE_MODE_VBR);
+    if (!setControl(V4L2_CID_MPEG_VIDEO_BITRATE, bitrate)) {
+      return false;
+    }
+    setControl(V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER, 1);
+    if (gop_ != 0) {
+      setControl(V4L2_CID_MPEG_VIDEO_H264_I_PERIOD, gop_);
+    }
+  }
+
+  dbgMsg("allocate buffers\n");
+  if (!allocateInput() || !allocateOutput()) {
+    return false;
+  }
+
+  dbgMsg("stream on\n");
+  Startup::Scope step("v4l2 streamon");
+  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0) {
+    dbgMsg("failed: input stream on (errno: %d)\n", errno);
+    return false;
+  }
+  type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0) {
+    dbgMsg("failed: output stream on (errno: %d)\n", errno);
+    return false;
+  }
+
+  poll_on_ = true;
+  poll_thread_ = std::thread(&M2m::pollLoop, this);
+
+  return true;
+}
+
+bool M2m::close() {
+
+  if (poll_thread_.joinable()) {
+    poll_on_ = false;
+    poll_sem_.post();
+    poll_thread_.join();
+  }
+
+  // stream off gives every buffer back
+  if (fd_ >= 0) {
+    dbgMsg("stream off\n");
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    xioctl(fd_, VIDIOC_STREAMOFF, &type);
+    type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    xioctl(fd_, VIDIOC_STREAMOFF, &type);
+  }
+
+  dbgMsg("free all buffers\n");
+  for (auto& s : in_) {
+    if (s.own) {
+      if (s.addr != nullptr) {
+        munmap(s.addr, s.length);
+      }
+      if (s.fd >= 0) {
+        ::close(s.fd);
+      }
+    }
+  }
+  in_.clear();
+  in_free_.clear();
+  for (auto& s : out_) {
+    if (s.addr != nullptr) {
+      munmap(s.addr, s.length);
+    }
+  }
+  out_.clear();
+
+  if (fd_ >= 0) {
+    struct v4l2_requestbuffers rb;
+    memset(&rb, 0, sizeof(rb));
+    rb.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    rb.memory = dmabuf_ ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
+    rb.count = 0;
+    xioctl(fd_, VIDIOC_REQBUFS, &rb);
+    rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    rb.memory = V4L2_MEMORY_MMAP;
+    xioctl(fd_, VIDIOC_REQBUFS, &rb);
+    ::close(fd_);
+    fd_ = -1;
+  }
+  return true;
+}
+
+bool M2m::useBuffers(std::vector<FrameBuf>& bufs) {
+
+  if (!dmabuf_) {
+    dbgMsg("no dma heap, frames are copied\n");
+    return true;
+  }
+  if (bufs.size() + in_num_ > in_max_) {
+    dbgMsg("too many capture buffers for direct encode\n");
+    return true;
+  }
+  for (auto& b : bufs) {
+    if (b.addr == nullptr || b.fd < 0 || b.length < frame_len_) {
+      dbgMsg("capture buffers can't be imported for direct encode\n");
+      return true;
+    }
+  }
+
+  in_.resize(in_num_);
+  for (auto& b : bufs) {
+    M2m::Slot s;
+    s.addr = b.addr;
+    s.length = b.length;
+    s.fd = b.fd;
+    s.own = false;
+    in_.push_back(s);
+  }
+
+  dbgMsg("encoding from %zu capture buffers\n", bufs.size());
+  return true;
+}
+
+bool M2m::getInput(Codec::Input& in) {
+  if (in_free_.empty()) {
+    return false;
+  }
+  in.index = in_free_.back();
+  in_free_.pop_back();
+  in.addr = in_[in.index].addr;
+  in.length = in_[in.index].length;
+  syncInput(in.index, true);
+  return true;
+}
+
+bool M2m::findInput(const FrameBuf& frame, Codec::Input& in) {
+  for (unsigned int i = in_num_; i < in_.size(); i++) {
+    if (in_[i].addr == frame.addr) {
+      in.index = i;
+      in.addr = in_[i].addr;
+      in.length = in_[i].length;
+      syncInput(i, true);
+      return true;
+    }
+  }
+  return false;
+}
+
+void M2m::setBuffers(unsigned int num) {
+  // half the queue, the rest for imported capture buffers
+  if (num != 0) {
+    in_num_ = std::min(num, in_max_ / 2);
+    out_num_ = in_num_ + 1;
+  }
+}
+
+void M2m::putInput(Codec::Input& in) {
+  syncInput(in.index, false);
+  if (in.index < in_num_) {
+    in_free_.push_back(in.index);
+  }
+}
+
+bool M2m::encode(Codec::Input& in, unsigned int len) {
+  if (in.index >= in_.size()) {
+    dbgMsg("unknown m2m input buffer\n");
+    return false;
+  }
+  syncInput(in.index, false);
+
+  struct v4l2_plane plane;
+  struct v4l2_buffer buf;
+  memset(&plane, 0, sizeof(plane));
+  memset(&buf, 0, sizeof(buf));
+  plane.bytesused = len;
+  plane.length = in_[in.index].length;
+  if (dmabuf_) {
+    plane.m.fd = in_[in.index].fd;
+  }
+  buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  buf.memory = dmabuf_ ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
+  buf.index = in.index;
+  buf.field = V4L2_FIELD_NONE;
+  buf.m.planes = &plane;
+  buf.length = 1;
+  if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0) {
+    dbgMsg("failed: queue input buffer %u (errno: %d)\n", in.index, errno);
+    return false;
+  }
+  return true;
+}
+
+bool M2m::doneInput(Codec::Input& in) {
+  struct v4l2_plane plane;
+  struct v4l2_buffer buf;
+  memset(&plane, 0, sizeof(plane));
+  memset(&buf, 0, sizeof(buf));
+  buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  buf.memory = dmabuf_ ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
+  buf.m.planes = &plane;
+  buf.length = 1;
+  if (xioctl(fd_, VIDIOC_DQBUF, &buf) < 0 || buf.index >= in_.size()) {
+    return false;
+  }
+  in.index = buf.index;
+  in.addr = in_[buf.index].addr;
+  in.length = in_[buf.index].length;
+  if (in.index < in_num_) {
+    in_free_.push_back(in.index);
+  }
+  return true;
+}
+
+bool M2m::getOutput(Codec::Output& out) {
+  struct v4l2_plane plane;
+  struct v4l2_buffer buf;
+  memset(&plane, 0, sizeof(plane));
+  memset(&buf, 0, sizeof(buf));
+  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  buf.memory = V4L2_MEMORY_MMAP;
+  buf.m.planes = &plane;
+  buf.length = 1;
+  if (xioctl(fd_, VIDIOC_DQBUF, &buf) < 0 || buf.index >= out_.size()) {
+    if (poll_wait_.exchange(false)) {
+      poll_sem_.post();
+    }
+    return false;
+  }
+
+  // one whole frame per buffer
+  out.index = buf.index;
+  out.data = out_[buf.index].addr + plane.data_offset;
+  out.length = (plane.bytesused > plane.data_offset && !(buf.flags & V4L2_BUF_FLAG_ERROR)) ?
+    plane.bytesused - plane.data_offset : 0;
+  out.end = true;
+  out.key = (buf.flags & V4L2_BUF_FLAG_KEYFRAME) != 0;
+  return true;
+}
+
+bool M2m::putOutput(Codec::Output& out) {
+  if (out.index >= out_.size()) {
+    dbgMsg("unknown m2m output buffer\n");
+    return false;
+  }
+  return queueOutput(out.index);
+}
+
+void M2m::footprint(Footprint& out) {
+  size_t num = 0, bytes = 0;
+  for (auto& s : in_) {
+    if (s.own && s.addr != nullptr) {
+      num++;
+      bytes += s.length;
+    }
+  }
+  out.add("m2m_in", num, bytes);
+  num = 0, bytes = 0;
+  for (auto& s : out_) {
+    if (s.addr != nullptr) {
+      num++;
+      bytes += s.length;
+    }
+  }
+  out.add("m2m_out", num, bytes);
+}
+
+bool M2m::setBitrate(unsigned int bitrate) {
+  return setControl(V4L2_CID_MPEG_VIDEO_BITRATE, bitrate);
+}
+
+bool M2m::requestKeyFrame() {
+  return setControl(V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME, 1);
+}
+
+bool M2m::setQuality(unsigned int quality) {
+  return setControl(V4L2_CID_JPEG_COMPRESSION_QUALITY, quality);
+}
+
+void M2m::pollLoop() {
+  while (poll_on_) {
+    struct pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int res = ::poll(&pfd, 1, poll_timeout_);
+    if (res > 0 && (pfd.revents & POLLIN)) {
+
+      // wait for the encoder to take it so a ready buffer doesn't spin us
+      poll_wait_ = true;
+      owner_->wake();
+      poll_sem_.wait_for(poll_timeout_ * 1000);
+    } else if (res < 0 || (pfd.revents & (POLLERR | POLLHUP))) {
+      std::this_thread::sleep_for(std::chrono::microseconds(yield_time_));
+    }
+  }
+}
+
+} // namespace detector
@@ -0,0 +1,135 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  V4L2 mem2mem encoder (bcm2835-codec, H264 on /dev/video11 and JPEG
+ *  on /dev/video31).
+ *
+ *  Raw frames go in on the 'output' queue and H264 or JPEG comes out on
+ *  the 'capture' queue.  When the kernel has a dma heap every raw frame is a
+ *  dmabuf, our own copy buffers come from the heap and capture buffers
+ *  are imported as they are, so nothing is copied on the way to the
+ *  codec.  Without one the output queue falls back to mmap buffers and
+ *  frames are copied.  A small thread polls the device and wakes the
+ *  owner when the output is ready.
+ */
+
+#ifndef M2M_H
+#define M2M_H
+
+#include <memory>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#include "utils.h"
+#include "base.h"
+#include "codec.h"
+
+namespace detector {
+
+class M2m : public Codec {
+  public:
+    static std::unique_ptr<M2m> create(Base* owner, unsigned int yield_time,
+        const char* device = "/dev/video11", unsigned int coded = V4L2_PIX_FMT_H264);
+    virtual ~M2m();
+
+  public:
+    virtual const char* name() { return (coded_ == V4L2_PIX_FMT_JPEG) ? "v4l2 m2m jpeg" : "v4l2 m2m"; }
+
+    virtual bool open(unsigned int width, unsigned int height, unsigned int framerate,
+        unsigned int pix_fmt, unsigned int bitrate);
+    virtual bool close();
+
+    virtual bool useBuffers(std::vector<FrameBuf>& bufs);
+
+    virtual bool getInput(Codec::Input& in);
+    virtual bool findInput(const FrameBuf& frame, Codec::Input& in);
+    virtual void putInput(Codec::Input& in);
+    virtual bool encode(Codec::Input& in, unsigned int len);
+    virtual bool doneInput(Codec::Input& in);
+
+    virtual bool getOutput(Codec::Output& out);
+    virtual bool putOutput(Codec::Output& out);
+
+    virtual bool setBitrate(unsigned int bitrate);
+    virtual bool requestKeyFrame();
+    virtual void setGop(unsigned int frames) { gop_ = frames; }
+    virtual void setBuffers(unsigned int num);
+
+    virtual void footprint(Footprint& out);
+
+    // jpeg only, 1 to 100
+    bool setQuality(unsigned int quality);
+
+  protected:
+    M2m() = delete;
+    M2m(Base* owner, unsigned int yield_time, const char* device, unsigned int coded);
+    bool init();
+
+  private:
+    Base* owner_;
+    unsigned int yield_time_;
+
+    const char* device_;
+    unsigned int coded_;
+    const char* heap_ = {"/dev/dma_heap/linux,cma"};
+    int fd_;
+    unsigned int frame_len_;
+    unsigned int gop_;
+
+    class Slot {
+      public:
+        Slot() : addr(nullptr), length(0), fd(-1), own(false) {}
+        ~Slot() {}
+      public:
+        unsigned char* addr;
+        unsigned int length;
+        int fd;       // dmabuf, -1 on the mmap queue
+        bool own;
+    };
+
+    // our own buffers come first, imported capture buffers after them
+    unsigned int in_num_  = {3};
+    const unsigned int in_max_  = {16};
+    unsigned int out_num_ = {4};
+    const unsigned int out_len_ = {512 * 1024};
+    bool dmabuf_;
+    std::vector<M2m::Slot> in_;
+    std::vector<unsigned int> in_free_;
+    std::vector<M2m::Slot> out_;
+
+    int xioctl(int fd, int request, void* arg);
+    bool setControl(unsigned int id, int value);
+    bool allocateInput();
+    bool allocateOutput();
+    bool queueOutput(unsigned int index);
+    void syncInput(unsigned int index, bool start);
+
+    // wakes the encoder when the codec has something for it
+    std::thread poll_thread_;
+    std::atomic<bool> poll_on_;
+    std::atomic<bool> poll_wait_;   // until the encoder has emptied the queue
+    Semaphore poll_sem_;
+    const unsigned int poll_timeout_ = {100};   // msec
+    void pollLoop();
+};
+
+} // namespace detector
+
+#endif // M2M_H
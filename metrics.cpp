@@ -0,0 +1,428 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "trace.h"
+#include "perf.h"
+#include "fate.h"
+#include "startup.h"
+#include "picture.h"
+#include "tpushare.h"
+
+namespace detector {
+
+Exposition::Family& Exposition::family(const char* name, const char* help,
+    const char* type) {
+  auto it = index_.find(name);
+  if (it != index_.end()) {
+    return families_[it->second];
+  }
+  index_[name] = families_.size();
+  Exposition::Family fam;
+  fam.help = std::string("# HELP ") + name + " " + help + "\n";
+  fam.type = std::string("# TYPE ") + name + " " + type + "\n";
+  families_.push_back(std::move(fam));
+  return families_.back();
+}
+
+void Exposition::sample(std::string& out, const char* name, const char* suffix,
+    const std::string& labels, const char* extra, double val) {
+  out += name;
+  out += suffix;
+  if (!labels.empty() || extra) {
+    out += "{" + labels;
+    if (extra) {
+      out += labels.empty() ? "" : ",";
+      out += extra;
+    }
+    out += "}";
+  }
+  char num[32];
+  snprintf(num, sizeof(num), " %.15g\n", val);
+  out += num;
+}
+
+void Exposition::gauge(const char* name, const char* help,
+    const std::string& labels, double val) {
+  sample(family(name, help, "gauge").samples, name, "", labels, nullptr, val);
+}
+
+void Exposition::counter(const char* name, const char* help,
+    const std::string& labels, double val) {
+  sample(family(name, help, "counter").samples, name, "", labels, nullptr, val);
+}
+
+void Exposition::summary(const char* name, const char* help,
+    const std::string& labels, Histogram& hist) {
+  auto& out = family(name, help, "summary").samples;
+  auto pct = lasts_ ? hist.interval((*lasts_)[std::string(name) + "{" + labels + "}"]) :
+    hist.percentiles();
+  sample(out, name, "", labels, "quantile=\"0.5\"", pct.p50);
+  sample(out, name, "", labels, "quantile=\"0.9\"", pct.p90);
+  sample(out, name, "", labels, "quantile=\"0.99\"", pct.p99);
+  sample(out, name, "", labels, "quantile=\"0.999\"", pct.p999);
+  sample(out, name, "_count", labels, nullptr, pct.cnt);
+}
+
+std::string Exposition::str() const {
+  std::string out;
+  for (auto& fam : families_) {
+    out += fam.help + fam.type + fam.samples;
+  }
+  return out;
+}
+
+Metrics::Metrics(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Metrics::~Metrics() {
+}
+
+std::unique_ptr<Metrics> Metrics::create(unsigned int yield_time, bool quiet,
+    unsigned short port, Pipeline* pipe) {
+  auto obj = std::unique_ptr<Metrics>(new Metrics(yield_time));
+  obj->init(quiet, port, pipe);
+  return obj;
+}
+
+bool Metrics::init(bool quiet, unsigned short port, Pipeline* pipe) {
+
+  quiet_ = quiet;
+  port_ = port;
+  pipe_ = pipe;
+
+  listen_fd_ = -1;
+
+  metrics_on_ = false;
+  scrape_cnt_ = 0;
+  bad_cnt_ = 0;
+
+  return true;
+}
+
+static bool readFile(const char* path, std::string& val) {
+  FILE* fd = fopen(path, "r");
+  if (!fd) {
+    return false;
+  }
+  char buf[512];
+  bool ok = fgets(buf, sizeof(buf), fd) != nullptr;
+  fclose(fd);
+  if (ok) {
+    val = buf;
+  }
+  return ok;
+}
+
+void Metrics::system(Exposition& out) {
+  host(out);
+  out.counter("detector_metrics_scrapes_total", "metrics requests answered", "",
+      scrape_cnt_);
+}
+
+void Metrics::host(Exposition& out) {
+
+  out.gauge("detector_uptime_seconds", "seconds since the process started", "",
+      since_start_ms() / 1000.0);
+
+  std::string val;
+  if (readFile("/sys/class/thermal/thermal_zone0/temp", val)) {
+    out.gauge("detector_cpu_temperature_celsius", "soc temperature", "",
+        strtol(val.c_str(), nullptr, 10) / 1000.0);
+  }
+
+  // the firmware's flags, low bits are now and high bits since boot
+  if (readFile("/sys/devices/platform/soc/soc:firmware/get_throttled", val)) {
+    unsigned long flags = strtoul(val.c_str(), nullptr, 16);
+    const char* names[] = { "under_voltage", "freq_capped", "throttled", "soft_temp_limit" };
+    for (unsigned int i = 0; i < 4; i++) {
+      std::string labels = std::string("flag=\"") + names[i] + "\"";
+      out.gauge("detector_throttle_now", "soc is held back right now", labels,
+          (flags >> i) & 1);
+      out.gauge("detector_throttle_seen", "soc was held back since boot", labels,
+          (flags >> (16 + i)) & 1);
+    }
+  }
+
+  // our cpu and the host's, utime and stime follow the name in parentheses,
+  // the first line of /proc/stat is user nice system idle iowait irq
+  // softirq steal in ticks
+  double tick = sysconf(_SC_CLK_TCK);
+  if (readFile("/proc/self/stat", val)) {
+    unsigned long utime = 0, stime = 0;
+    size_t at = val.rfind(')');
+    if (at != std::string::npos && sscanf(val.c_str() + at + 2,
+          "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2) {
+      out.counter("detector_process_cpu_seconds_total", "cpu time used by the detector", "",
+          (utime + stime) / tick);
+    }
+  }
+  if (readFile("/proc/stat", val)) {
+    unsigned long long t[8] = { 0 };
+    if (sscanf(val.c_str(), "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+          &t[0], &t[1], &t[2], &t[3], &t[4], &t[5], &t[6], &t[7]) >= 4) {
+      unsigned long long idle = t[3] + t[4];
+      unsigned long long busy = t[0] + t[1] + t[2] + t[5] + t[6] + t[7];
+      out.counter("detector_host_cpu_seconds_total", "cpu time of all the host's cores",
+          "mode=\"busy\"", busy / tick);
+      out.counter("detector_host_cpu_seconds_total", "cpu time of all the host's cores",
+          "mode=\"idle\"", idle / tick);
+    }
+  }
+
+  if (Perf::on()) {
+    Perf::metrics(out);
+  }
+  Fate::metrics(out);
+  TpuShare::metrics(out);
+}
+
+void Metrics::reply(int fd, const char* status, const char* type,
+    const std::string& body) {
+
+  std::string head = std::string("HTTP/1.1 ") + status + "\r\n";
+  head += std::string("Content-Type: ") + type + "\r\n";
+  head += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+  head += "Connection: close\r\n\r\n";
+  head += body;
+
+  size_t done = 0;
+  while (done < head.size()) {
+    ssize_t n = ::send(fd, head.data() + done, head.size() - done, MSG_NOSIGNAL);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    done += n;
+  }
+}
+
+void Metrics::picture(int fd, const std::string& req) {
+
+  Picture* pic = pipe_->get<Picture>("pic");
+  auto img = pic ? pic->get() : nullptr;
+  if (!img) {
+    reply(fd, "503 Service Unavailable", "text/plain", "no picture yet\n");
+    return;
+  }
+
+  // headers are case blind, the tag is ours so it's compared as is
+  std::string lower(req);
+  std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+  size_t at = lower.find("\r\nif-none-match:");
+  bool same = false;
+  if (at != std::string::npos) {
+    size_t end = req.find("\r\n", at + 2);
+    same = req.find(img->etag, at) < end;
+  }
+
+  std::string head = std::string("HTTP/1.1 ") + (same ? "304 Not Modified" : "200 OK") + "\r\n";
+  head += "ETag: " + img->etag + "\r\n";
+  head += "Cache-Control: no-cache\r\n";
+  if (!same) {
+    head += "Content-Type: image/jpeg\r\n";
+    head += "Content-Length: " + std::to_string(img->data.size()) + "\r\n";
+  }
+  head += "Connection: close\r\n\r\n";
+  pic->served(!same);
+
+  // the picture goes straight from the shared image behind the header
+  struct iovec iov[2];
+  iov[0].iov_base = const_cast<char*>(head.data());
+  iov[0].iov_len = head.size();
+  iov[1].iov_base = const_cast<unsigned char*>(img->data.data());
+  iov[1].iov_len = same ? 0 : img->data.size();
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  while (iov[0].iov_len + iov[1].iov_len != 0) {
+    ssize_t n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    for (auto& v : iov) {
+      size_t k = std::min(static_cast<size_t>(n), v.iov_len);
+      v.iov_base = static_cast<char*>(v.iov_base) + k;
+      v.iov_len -= k;
+      n -= k;
+    }
+  }
+}
+
+void Metrics::handle(int fd) {
+
+  struct timeval tv;
+  tv.tv_sec = req_timeout_ / 1000;
+  tv.tv_usec = (req_timeout_ % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  // just the request line and headers, there is no body to a get
+  std::string req;
+  char buf[1024];
+  while (req.size() < req_max_ && req.find("\r\n\r\n") == std::string::npos) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    req.append(buf, n);
+  }
+
+  std::string line = req.substr(0, req.find("\r\n"));
+  size_t sp1 = line.find(' ');
+  size_t sp2 = (sp1 == std::string::npos) ? sp1 : line.find(' ', sp1 + 1);
+  if (sp2 == std::string::npos) {
+    bad_cnt_++;
+    reply(fd, "400 Bad Request", "text/plain", "bad request\n");
+    return;
+  }
+  std::string method = line.substr(0, sp1);
+  std::string path = line.substr(sp1 + 1, sp2 - sp1 - 1);
+  path = path.substr(0, path.find('?'));
+
+  if (method != "GET") {
+    bad_cnt_++;
+    reply(fd, "405 Method Not Allowed", "text/plain", "get only\n");
+    return;
+  }
+  if (path == "/trace" && Trace::on()) {
+    scrape_cnt_++;
+    reply(fd, "200 OK", "application/json", Trace::json());
+    return;
+  }
+  if (path == "/snapshot.jpg" && pipe_->get<Picture>("pic")) {
+    scrape_cnt_++;
+    picture(fd, req);
+    return;
+  }
+  if (path == "/ready") {
+    bool ready = Startup::isReady();
+    reply(fd, ready ? "200 OK" : "503 Service Unavailable", "text/plain",
+        ready ? "ready\n" : "starting\n");
+    return;
+  }
+  if (path != "/metrics") {
+    bad_cnt_++;
+    reply(fd, "404 Not Found", "text/plain", "try /metrics\n");
+    return;
+  }
+
+  differ_scrape_.begin();
+  Exposition out;
+  pipe_->metrics(out);
+  system(out);
+  Startup::metrics(out);
+  scrape_cnt_++;
+  reply(fd, "200 OK", "text/plain; version=0.0.4; charset=utf-8", out.str());
+  differ_scrape_.end();
+}
+
+bool Metrics::waitingToRun() {
+
+  if (!metrics_on_) {
+
+    dbgMsg("open metrics port %u\n", port_);
+    listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd_ < 0) {
+      dbgMsg("failed: metrics socket\n");
+      return false;
+    }
+    int on = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port_);
+    if (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(listen_fd_, client_max_) < 0) {
+      dbgMsg("failed: metrics bind port %u\n", port_);
+      close(listen_fd_);
+      listen_fd_ = -1;
+      return false;
+    }
+
+    metrics_on_ = true;
+  }
+
+  return true;
+}
+
+bool Metrics::running() {
+
+  if (metrics_on_) {
+    int fd;
+    while ((fd = accept(listen_fd_, nullptr, nullptr)) >= 0) {
+      handle(fd);
+      close(fd);
+    }
+  }
+  return true;
+}
+
+bool Metrics::paused() {
+  return true;
+}
+
+bool Metrics::waitingToHalt() {
+
+  if (metrics_on_) {
+    metrics_on_ = false;
+
+    close(listen_fd_);
+    listen_fd_ = -1;
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nMetrics Results...\n");
+      fprintf(stderr, "       scrapes: %u\n", scrape_cnt_);
+      fprintf(stderr, "      rejected: %u\n", bad_cnt_);
+      fprintf(stderr, "  scrape time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_scrape_.pct(.5), differ_scrape_.pct(.9), differ_scrape_.pct(.99), differ_scrape_.pct(.999),
+          differ_scrape_.high, differ_scrape_.avg,
+          differ_scrape_.low,  differ_scrape_.cnt);
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
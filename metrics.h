@@ -0,0 +1,125 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Prometheus metrics.
+ *
+ *  With -Z port 'GET /metrics' answers in the Prometheus text format
+ *  with what the stages report as they run: whether each is up and
+ *  beating, their latency percentiles as summaries, queue depths and
+ *  drops, detections, encoded bytes, rtsp viewers, and the soc's
+ *  temperature and throttle flags.  Nothing is gathered until someone
+ *  asks, a scrape just reads the counters the stages already keep.
+ *
+ *  Each stage adds its own samples through 'Base::metrics', labelled
+ *  with its stage name.  An 'Exposition' groups the samples by family
+ *  so every metric gets one HELP and TYPE line whichever stage adds it.
+ *
+ *  With tracing on 'GET /trace' hands back the frame spans, see trace.h,
+ *  and with --picture 'GET /snapshot.jpg' the latest frame, see picture.h.
+ *  'GET /ready' is 200 once the pipeline is up and 503 until then, and
+ *  the startup steps are in the samples, see startup.h.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <map>
+
+#include "utils.h"
+#include "base.h"
+#include "pipeline.h"
+
+namespace detector {
+
+class Exposition {
+  public:
+    void gauge(const char* name, const char* help, const std::string& labels, double val);
+    void counter(const char* name, const char* help, const std::string& labels, double val);
+    void summary(const char* name, const char* help, const std::string& labels, Histogram& hist);
+
+    // summaries over what was recorded since the last exposition given the
+    // same 'lasts', for a reader sampling on its own, rather than since start
+    inline void setWindows(std::map<std::string, std::unique_ptr<uint32_t[]>>* lasts) {
+      lasts_ = lasts;
+    }
+
+    std::string str() const;
+
+  private:
+    class Family {
+      public:
+        std::string help;
+        std::string type;
+        std::string samples;
+    };
+    std::vector<Exposition::Family> families_;
+    std::map<std::string, unsigned int> index_;
+    std::map<std::string, std::unique_ptr<uint32_t[]>>* lasts_ = {nullptr};
+
+    Exposition::Family& family(const char* name, const char* help, const char* type);
+    static void sample(std::string& out, const char* name, const char* suffix,
+        const std::string& labels, const char* extra, double val);
+};
+
+class Metrics : public Base {
+  public:
+    static std::unique_ptr<Metrics> create(unsigned int yield_time, bool quiet,
+        unsigned short port, Pipeline* pipe);
+    virtual ~Metrics();
+
+    // the host's and the process's own samples, no stage's
+    static void host(Exposition& out);
+
+  protected:
+    Metrics() = delete;
+    Metrics(unsigned int yield_time);
+    bool init(bool quiet, unsigned short port, Pipeline* pipe);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    unsigned short port_;
+    Pipeline* pipe_;
+
+    int listen_fd_;
+    const unsigned int client_max_ = {4};
+    const unsigned int req_timeout_ = {500};   // msec
+    const size_t req_max_ = {4096};
+    void handle(int fd);
+    void reply(int fd, const char* status, const char* type, const std::string& body);
+    void picture(int fd, const std::string& req);
+    void system(Exposition& out);
+
+    bool metrics_on_;
+    unsigned int scrape_cnt_;
+    unsigned int bad_cnt_;
+    MicroDiffer<uint32_t> differ_scrape_;
+};
+
+} // namespace detector
+
+#endif // METRICS_H
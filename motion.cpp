@@ -0,0 +1,282 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "motion.h"
+#include "pyramid.h"
+
+namespace detector {
+
+Motion::Motion() {
+}
+
+Motion::~Motion() {
+}
+
+std::unique_ptr<Motion> Motion::create(unsigned int width, unsigned int height,
+    unsigned int pix_fmt, unsigned int threshold, const Rect& mask) {
+  auto obj = std::unique_ptr<Motion>(new Motion());
+  obj->init(width, height, pix_fmt, threshold, mask);
+  return obj;
+}
+
+bool Motion::init(unsigned int width, unsigned int height,
+    unsigned int pix_fmt, unsigned int threshold, const Rect& mask) {
+
+  width_ = width;
+  height_ = height;
+  pix_fmt_ = pix_fmt;
+  threshold_ = std::min(threshold, 255u);
+
+  cell_width_ = width_ / 8;
+  cell_height_ = height_ / 8;
+  thumb_.resize(cell_width_ * cell_height_);
+  ref_.resize(cell_width_ * cell_height_);
+  ref_valid_ = false;
+
+  // cells under the mask are watched, an empty mask watches everything
+  mask_.assign(cell_width_ * cell_height_, 0);
+  Rect m = mask;
+  if (m.w == 0 || m.h == 0) {
+    m = { 0, 0, width_, height_ };
+  }
+  unsigned int x0 = std::min(m.x / 8, cell_width_);
+  unsigned int y0 = std::min(m.y / 8, cell_height_);
+  unsigned int x1 = std::min((m.x + m.w + 7) / 8, cell_width_);
+  unsigned int y1 = std::min((m.y + m.h + 7) / 8, cell_height_);
+  unsigned int watched = 0;
+  for (unsigned int y = y0; y < y1; y++) {
+    for (unsigned int x = x0; x < x1; x++) {
+      mask_[y * cell_width_ + x] = 0xff;
+      watched++;
+    }
+  }
+
+  // about half a percent of the watched area has to change
+  min_cells_ = std::max(watched / 200, 1u);
+
+  last_pass_ = {};
+  last_motion_ = {};
+  map_ = MotionBuf();
+
+  blob_min_ = 0;
+  bg_valid_ = false;
+  blobs_.clear();
+
+  return true;
+}
+
+void Motion::vectors(const MotionBuf& map) {
+  map_ = map;
+}
+
+void Motion::setBlobs(unsigned int cells) {
+  blob_min_ = cells;
+  bg_.assign(thumb_.size(), 0);
+  fg_.assign(thumb_.size(), 0);
+  bg_valid_ = false;
+}
+
+unsigned int Motion::findBlobs() {
+
+  // flood each foreground cell's blob, clearing it on the way
+  blobs_.clear();
+  std::vector<unsigned int> area;
+  const unsigned int w = cell_width_, h = cell_height_;
+  for (unsigned int start = 0; start < fg_.size(); start++) {
+    if (!fg_[start]) {
+      continue;
+    }
+    unsigned int x0 = w, y0 = h, x1 = 0, y1 = 0, num = 0;
+    stack_.clear();
+    stack_.push_back(start);
+    fg_[start] = 0;
+    while (!stack_.empty()) {
+      unsigned int at = stack_.back();
+      stack_.pop_back();
+      unsigned int x = at % w, y = at / w;
+      x0 = std::min(x0, x);
+      y0 = std::min(y0, y);
+      x1 = std::max(x1, x);
+      y1 = std::max(y1, y);
+      num++;
+      if (x > 0 && fg_[at - 1]) {
+        fg_[at - 1] = 0;
+        stack_.push_back(at - 1);
+      }
+      if (x + 1 < w && fg_[at + 1]) {
+        fg_[at + 1] = 0;
+        stack_.push_back(at + 1);
+      }
+      if (y > 0 && fg_[at - w]) {
+        fg_[at - w] = 0;
+        stack_.push_back(at - w);
+      }
+      if (y + 1 < h && fg_[at + w]) {
+        fg_[at + w] = 0;
+        stack_.push_back(at + w);
+      }
+    }
+    if (num < blob_min_) {
+      continue;
+    }
+
+    // biggest first, the smallest goes when there are too many
+    Rect r = { x0 * 8, y0 * 8, (x1 - x0 + 1) * 8, (y1 - y0 + 1) * 8 };
+    unsigned int k = 0;
+    while (k < area.size() && area[k] >= num) {
+      k++;
+    }
+    if (k < blob_max_) {
+      area.insert(area.begin() + k, num);
+      blobs_.insert(blobs_.begin() + k, r);
+      if (blobs_.size() > blob_max_) {
+        area.pop_back();
+        blobs_.pop_back();
+      }
+    }
+  }
+  return blobs_.size();
+}
+
+unsigned int Motion::countMoving() {
+
+  // a macroblock is 2x2 cells, it counts when its corner cell is watched
+  unsigned int cnt = 0;
+  const int8_t* v = map_.vec->data();
+  for (unsigned int r = 0; r < map_.rows; r++) {
+    for (unsigned int c = 0; c < map_.cols; c++, v += 2) {
+      unsigned int x = c * 2, y = r * 2;
+      if (x >= cell_width_ || y >= cell_height_ || !mask_[y * cell_width_ + x]) {
+        continue;
+      }
+      if (std::abs(v[0]) + std::abs(v[1]) >= 2) {
+        cnt++;
+      }
+    }
+  }
+  return cnt;
+}
+
+bool Motion::changed(const FrameBuf& frame) {
+
+  if (frame.addr == nullptr || cell_width_ == 0 || cell_height_ == 0) {
+    return true;
+  }
+
+  using namespace std::chrono;
+  auto now = (frame.stamp.time_since_epoch().count() != 0) ?
+    frame.stamp : steady_clock::now();
+
+  // the encoder already measured the motion
+  if (map_.vec && map_.vec->size() >= map_.cols * map_.rows * 2 &&
+      now - map_.stamp < milliseconds(map_fresh_)) {
+    bool pass = false;
+    if (countMoving() >= std::max(min_cells_ / 4, 1u)) {
+      last_motion_ = now;
+      pass = true;
+    } else if (now - last_motion_ < milliseconds(hold_time_)) {
+      pass = true;
+    } else if (now - last_pass_ >= milliseconds(idle_time_)) {
+      pass = true;
+    }
+    ref_valid_ = false;
+    bg_valid_ = false;
+    blobs_.clear();
+    if (pass) {
+      last_pass_ = now;
+    }
+    return pass;
+  }
+
+  // the 1/8 level is the thumbnail, if the frame has one
+  const Level* lvl = frame.levels ? frame.levels->get(3) : nullptr;
+  if (lvl && lvl->width == cell_width_ && lvl->height == cell_height_) {
+    unsigned char* dst = thumb_.data();
+    for (unsigned int r = 0; r < cell_height_; r++, dst += cell_width_) {
+      const unsigned char* src = lvl->addr + r * lvl->stride;
+      if (pix_fmt_ == V4L2_PIX_FMT_YUV420) {
+        std::memcpy(dst, src, cell_width_);
+      } else {
+        for (unsigned int c = 0; c < cell_width_; c++, src += 3) {
+          dst[c] = (src[0] + 2 * src[1] + src[2] + 2) >> 2;
+        }
+      }
+    }
+  } else if (pix_fmt_ == V4L2_PIX_FMT_YUV420) {
+    scale_luma_yuv420(frame.addr, ALIGN_16B(width_),
+        width_, height_, thumb_.data());
+  } else {
+    scale_luma_rgb24(frame.addr, ALIGN_16B(width_) * 3,
+        width_, height_, thumb_.data());
+  }
+
+  // against the background, its blobs decide
+  if (blob_min_) {
+    bool pass = !bg_valid_;
+    if (!bg_valid_) {
+      for (unsigned int i = 0; i < thumb_.size(); i++) {
+        bg_[i] = thumb_[i] << 4;
+      }
+      bg_valid_ = true;
+      blobs_.clear();
+    } else {
+      update_background(thumb_.data(), bg_.data(), mask_.data(), fg_.data(),
+          thumb_.size(), threshold_, learn_shift_);
+      if (findBlobs() != 0) {
+        last_motion_ = now;
+        pass = true;
+      } else if (now - last_motion_ < milliseconds(hold_time_)) {
+        pass = true;
+      } else if (now - last_pass_ >= milliseconds(idle_time_)) {
+        pass = true;
+      }
+    }
+    if (pass) {
+      last_pass_ = now;
+    }
+    return pass;
+  }
+
+  bool pass = !ref_valid_;
+  if (!pass) {
+    unsigned int cnt = count_changed(thumb_.data(), ref_.data(),
+        mask_.data(), thumb_.size(), threshold_);
+    if (cnt >= min_cells_) {
+      last_motion_ = now;
+      pass = true;
+    } else if (now - last_motion_ < milliseconds(hold_time_)) {
+      pass = true;
+    } else if (now - last_pass_ >= milliseconds(idle_time_)) {
+      pass = true;
+    }
+  }
+
+  // compare against the last frame let through so slow changes add up
+  if (pass) {
+    thumb_.swap(ref_);
+    ref_valid_ = true;
+    last_pass_ = now;
+  }
+  return pass;
+}
+
+} // namespace detector
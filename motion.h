@@ -0,0 +1,108 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Motion gate in front of inference.
+ *
+ *  Each frame is reduced to a 1/8 scale luma thumbnail and compared with
+ *  the thumbnail of the last frame that was let through.  A frame passes
+ *  when enough cells inside the mask changed by more than the threshold,
+ *  for a hold time after that, or when the idle time runs out.  The
+ *  thumbnail is the frame's 1/8 pyramid level when it has one.  While
+ *  the encoder hands in its macroblock vectors (see 'vectors') they take
+ *  the place of the thumbnails, a cell moving when its vector is long
+ *  enough, and the thumbnails only come back when the vectors go stale.
+ *
+ *  With blobs (see 'setBlobs') the reference is a running average of
+ *  the thumbnails instead, the cells that differ from it are grouped
+ *  into 4-connected blobs, and a frame passes when one is big enough.
+ *  The blobs' boxes are kept for whoever wants to look only there.
+ */
+
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <memory>
+#include <vector>
+#include <chrono>
+
+#include "utils.h"
+#include "listener.h"
+
+namespace detector {
+
+class Motion {
+  public:
+    static std::unique_ptr<Motion> create(unsigned int width, unsigned int height,
+        unsigned int pix_fmt, unsigned int threshold, const Rect& mask);
+    ~Motion();
+
+  public:
+    bool changed(const FrameBuf& frame);
+
+    // the latest macroblock vectors, used instead of the thumbnails while fresh
+    void vectors(const MotionBuf& map);
+
+    // blobs of at least 'cells' 8x8 cells against the background pass, 0 for off
+    void setBlobs(unsigned int cells);
+
+    // the last frame's blobs big enough, in frame pixels, biggest first
+    inline const std::vector<Rect>& blobs() { return blobs_; }
+
+  protected:
+    Motion();
+    bool init(unsigned int width, unsigned int height,
+        unsigned int pix_fmt, unsigned int threshold, const Rect& mask);
+
+  private:
+    unsigned int width_;
+    unsigned int height_;
+    unsigned int pix_fmt_;
+    unsigned char threshold_;
+
+    unsigned int cell_width_;
+    unsigned int cell_height_;
+    unsigned int min_cells_;
+    std::vector<unsigned char> mask_;
+    std::vector<unsigned char> thumb_;
+    std::vector<unsigned char> ref_;
+    bool ref_valid_;
+
+    const unsigned int hold_time_ = {1000};  // msec
+    const unsigned int idle_time_ = {5000};  // msec
+    std::chrono::steady_clock::time_point last_pass_;
+    std::chrono::steady_clock::time_point last_motion_;
+
+    MotionBuf map_;
+    const unsigned int map_fresh_ = {500};   // msec
+    unsigned int countMoving();
+
+    unsigned int blob_min_;
+    std::vector<int16_t> bg_;     // 8.4 fixed point
+    bool bg_valid_;
+    std::vector<unsigned char> fg_;
+    std::vector<unsigned int> stack_;
+    std::vector<Rect> blobs_;
+    const unsigned int learn_shift_ = {5};   // 1/32 of the way a frame
+    const unsigned int blob_max_ = {16};
+    unsigned int findBlobs();
+};
+
+} // namespace detector
+
+#endif // MOTION_H
@@ -0,0 +1,474 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <algorithm>
+#include <functional>
+
+#include "mp4.h"
+
+namespace detector {
+
+// big endian box writing
+void put8(std::vector<unsigned char>& b, uint32_t v) {
+  b.push_back(v & 0xff);
+}
+
+void put16(std::vector<unsigned char>& b, uint32_t v) {
+  put8(b, v >> 8);
+  put8(b, v);
+}
+
+void put32(std::vector<unsigned char>& b, uint32_t v) {
+  put16(b, v >> 16);
+  put16(b, v);
+}
+
+void put64(std::vector<unsigned char>& b, uint64_t v) {
+  put32(b, v >> 32);
+  put32(b, v & 0xffffffff);
+}
+
+void putTag(std::vector<unsigned char>& b, const char* tag) {
+  b.insert(b.end(), tag, tag + 4);
+}
+
+void patch32(std::vector<unsigned char>& b, size_t pos, uint32_t v) {
+  b[pos + 0] = (v >> 24) & 0xff;
+  b[pos + 1] = (v >> 16) & 0xff;
+  b[pos + 2] = (v >>  8) & 0xff;
+  b[pos + 3] = (v >>  0) & 0xff;
+}
+
+size_t openBox(std::vector<unsigned char>& b, const char* tag) {
+  size_t pos = b.size();
+  put32(b, 0);
+  putTag(b, tag);
+  return pos;
+}
+
+size_t openFullBox(std::vector<unsigned char>& b, const char* tag,
+    uint32_t version, uint32_t flags) {
+  size_t pos = openBox(b, tag);
+  put32(b, (version << 24) | (flags & 0xffffff));
+  return pos;
+}
+
+void closeBox(std::vector<unsigned char>& b, size_t pos) {
+  patch32(b, pos, b.size() - pos);
+}
+
+static void putMatrix(std::vector<unsigned char>& b) {
+  const uint32_t unity[9] = { 0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000 };
+  for (auto v : unity) {
+    put32(b, v);
+  }
+}
+
+void mp4Init(std::vector<unsigned char>& b, unsigned int width, unsigned int height,
+    unsigned int timescale, std::vector<unsigned char>& sps,
+    std::vector<unsigned char>& pps) {
+
+  size_t ftyp = openBox(b, "ftyp");
+  putTag(b, "iso5");
+  put32(b, 512);
+  putTag(b, "iso5");
+  putTag(b, "iso6");
+  putTag(b, "avc1");
+  putTag(b, "mp41");
+  closeBox(b, ftyp);
+
+  size_t moov = openBox(b, "moov");
+  size_t mvhd = openFullBox(b, "mvhd", 0, 0);
+  put32(b, 0);
+  put32(b, 0);
+  put32(b, timescale);
+  put32(b, 0);
+  put32(b, 0x00010000);
+  put16(b, 0x0100);
+  put16(b, 0);
+  put32(b, 0);
+  put32(b, 0);
+  putMatrix(b);
+  for (int i = 0; i < 6; i++) {
+    put32(b, 0);
+  }
+  put32(b, 2);
+  closeBox(b, mvhd);
+
+  size_t trak = openBox(b, "trak");
+  size_t tkhd = openFullBox(b, "tkhd", 0, 0x000003);   // enabled, in movie
+  put32(b, 0);
+  put32(b, 0);
+  put32(b, 1);
+  put32(b, 0);
+  put32(b, 0);
+  put32(b, 0);
+  put32(b, 0);
+  put16(b, 0);
+  put16(b, 0);
+  put16(b, 0);
+  put16(b, 0);
+  putMatrix(b);
+  put32(b, width << 16);
+  put32(b, height << 16);
+  closeBox(b, tkhd);
+
+  size_t mdia = openBox(b, "mdia");
+  size_t mdhd = openFullBox(b, "mdhd", 0, 0);
+  put32(b, 0);
+  put32(b, 0);
+  put32(b, timescale);
+  put32(b, 0);
+  put16(b, 0x55c4);   // 'und'
+  put16(b, 0);
+  closeBox(b, mdhd);
+  size_t hdlr = openFullBox(b, "hdlr", 0, 0);
+  put32(b, 0);
+  putTag(b, "vide");
+  put32(b, 0);
+  put32(b, 0);
+  put32(b, 0);
+  const char handler[] = "VideoHandler";
+  b.insert(b.end(), handler, handler + sizeof(handler));
+  closeBox(b, hdlr);
+
+  size_t minf = openBox(b, "minf");
+  size_t vmhd = openFullBox(b, "vmhd", 0, 1);
+  put16(b, 0);
+  put16(b, 0);
+  put16(b, 0);
+  put16(b, 0);
+  closeBox(b, vmhd);
+  size_t dinf = openBox(b, "dinf");
+  size_t dref = openFullBox(b, "dref", 0, 0);
+  put32(b, 1);
+  size_t url = openFullBox(b, "url ", 0, 1);   // data is in this file
+  closeBox(b, url);
+  closeBox(b, dref);
+  closeBox(b, dinf);
+
+  size_t stbl = openBox(b, "stbl");
+  size_t stsd = openFullBox(b, "stsd", 0, 0);
+  put32(b, 1);
+  size_t avc1 = openBox(b, "avc1");
+  for (int i = 0; i < 6; i++) {
+    put8(b, 0);
+  }
+  put16(b, 1);
+  put16(b, 0);
+  put16(b, 0);
+  put32(b, 0);
+  put32(b, 0);
+  put32(b, 0);
+  put16(b, width);
+  put16(b, height);
+  put32(b, 0x00480000);
+  put32(b, 0x00480000);
+  put32(b, 0);
+  put16(b, 1);
+  for (int i = 0; i < 32; i++) {
+    put8(b, 0);
+  }
+  put16(b, 0x0018);
+  put16(b, 0xffff);
+  size_t avcc = openBox(b, "avcC");
+  put8(b, 1);
+  put8(b, sps[1]);
+  put8(b, sps[2]);
+  put8(b, sps[3]);
+  put8(b, 0xff);   // 4 byte lengths
+  put8(b, 0xe1);
+  put16(b, sps.size());
+  b.insert(b.end(), sps.begin(), sps.end());
+  put8(b, 1);
+  put16(b, pps.size());
+  b.insert(b.end(), pps.begin(), pps.end());
+  if (sps[1] == 100 || sps[1] == 110 || sps[1] == 122 || sps[1] == 144) {
+    put8(b, 0xfd);   // 4:2:0
+    put8(b, 0xf8);   // 8 bit
+    put8(b, 0xf8);
+    put8(b, 0);
+  }
+  closeBox(b, avcc);
+  closeBox(b, avc1);
+  closeBox(b, stsd);
+  const char* empty[] = { "stts", "stsc", "stco" };
+  for (auto tag : empty) {
+    size_t box = openFullBox(b, tag, 0, 0);
+    put32(b, 0);
+    closeBox(b, box);
+  }
+  size_t stsz = openFullBox(b, "stsz", 0, 0);
+  put32(b, 0);
+  put32(b, 0);
+  closeBox(b, stsz);
+  closeBox(b, stbl);
+  closeBox(b, minf);
+  closeBox(b, mdia);
+  closeBox(b, trak);
+
+  size_t mvex = openBox(b, "mvex");
+  size_t trex = openFullBox(b, "trex", 0, 0);
+  put32(b, 1);
+  put32(b, 1);
+  put32(b, 0);
+  put32(b, 0);
+  put32(b, 0);
+  closeBox(b, trex);
+  closeBox(b, mvex);
+  closeBox(b, moov);
+}
+
+void mp4Durations(std::vector<Mp4Sample>& samples,
+    std::chrono::steady_clock::time_point next, unsigned int timescale,
+    unsigned int framerate) {
+
+  using namespace std::chrono;
+  for (size_t i = 0; i < samples.size(); i++) {
+    auto end = (i + 1 < samples.size()) ? samples[i + 1].stamp : next;
+    int64_t usec = duration_cast<microseconds>(end - samples[i].stamp).count();
+    int64_t ticks = usec * timescale / 1000000;
+    if (end.time_since_epoch().count() == 0 || ticks <= 0) {
+      ticks = timescale / framerate;
+    }
+    samples[i].duration = ticks;
+  }
+}
+
+void mp4Fragment(std::vector<unsigned char>& b, uint32_t seq, uint64_t time,
+    std::vector<Mp4Sample>& samples, size_t mdat_len) {
+
+  size_t moof = openBox(b, "moof");
+  size_t mfhd = openFullBox(b, "mfhd", 0, 0);
+  put32(b, seq);
+  closeBox(b, mfhd);
+  size_t traf = openBox(b, "traf");
+  size_t tfhd = openFullBox(b, "tfhd", 0, 0x020000);   // default base is moof
+  put32(b, 1);
+  closeBox(b, tfhd);
+  size_t tfdt = openFullBox(b, "tfdt", 1, 0);
+  put64(b, time);
+  closeBox(b, tfdt);
+  size_t trun = openFullBox(b, "trun", 0, 0x000701);   // offset, duration, size, flags
+  put32(b, samples.size());
+  size_t data_offset = b.size();
+  put32(b, 0);
+  for (auto& s : samples) {
+    put32(b, s.duration);
+    put32(b, s.size);
+    put32(b, s.key ? 0x02000000 : 0x01010000);
+  }
+  closeBox(b, trun);
+  closeBox(b, traf);
+  closeBox(b, moof);
+  patch32(b, data_offset, b.size() - moof + 8);
+  put32(b, mdat_len + 8);
+  putTag(b, "mdat");
+}
+
+// big endian box reading, the caller checks the length
+static uint32_t get16(const unsigned char* p) {
+  return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const unsigned char* p) {
+  return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint64_t get64(const unsigned char* p) {
+  return (static_cast<uint64_t>(get32(p)) << 32) | get32(p + 4);
+}
+
+// 'box(tag, start, body, end)' on each box in [at, end), false on a
+// box that runs past the end
+template<typename F>
+static bool boxes(const unsigned char* data, size_t at, size_t end, F box) {
+  while (at + 8 <= end) {
+    uint64_t size = get32(data + at);
+    size_t head = 8;
+    if (size == 1) {
+      if (at + 16 > end) {
+        return false;
+      }
+      size = get64(data + at + 8);
+      head = 16;
+    } else if (size == 0) {
+      size = end - at;
+    }
+    if (size < head || at + size > end) {
+      return false;
+    }
+    if (!box(reinterpret_cast<const char*>(data + at + 4), at, at + head, at + size)) {
+      return false;
+    }
+    at += size;
+  }
+  return true;
+}
+
+static bool isTag(const char* tag, const char* want) {
+  return tag[0] == want[0] && tag[1] == want[1] && tag[2] == want[2] && tag[3] == want[3];
+}
+
+bool mp4Read(const unsigned char* data, size_t len, unsigned int& timescale,
+    unsigned int& nal_len, std::vector<unsigned char>& params,
+    std::vector<Mp4Entry>& samples) {
+
+  static const unsigned char start_code[] = { 0, 0, 0, 1 };
+  timescale = 0;
+  nal_len = 4;
+  params.clear();
+  samples.clear();
+  uint32_t trex_duration = 0, trex_size = 0, trex_flags = 0;
+  uint64_t next_time = 0;
+
+  // the avc sample entry's config, its sps and pps
+  auto avcc = [&](size_t at, size_t end) {
+    if (end - at < 7) {
+      return false;
+    }
+    nal_len = (data[at + 4] & 3) + 1;
+    size_t p = at + 5;
+    for (unsigned int set = 0; set < 2; set++) {
+      if (p >= end) {
+        return false;
+      }
+      unsigned int num = data[p++] & ((set == 0) ? 0x1f : 0xff);
+      for (unsigned int k = 0; k < num; k++) {
+        if (p + 2 > end || p + 2 + get16(data + p) > end) {
+          return false;
+        }
+        unsigned int n = get16(data + p);
+        params.insert(params.end(), start_code, start_code + sizeof(start_code));
+        params.insert(params.end(), data + p + 2, data + p + 2 + n);
+        p += 2 + n;
+      }
+    }
+    return true;
+  };
+
+  std::function<bool(const char*, size_t, size_t, size_t)> moov;
+  moov = [&](const char* tag, size_t start, size_t at, size_t end) {
+    if (isTag(tag, "trak") || isTag(tag, "mdia") || isTag(tag, "minf") ||
+        isTag(tag, "stbl") || isTag(tag, "mvex")) {
+      return boxes(data, at, end, moov);
+    }
+    if (isTag(tag, "mdhd") && end - at >= 24) {
+      timescale = get32(data + at + ((data[at] == 1) ? 20 : 12));
+    } else if (isTag(tag, "trex") && end - at >= 24) {
+      trex_duration = get32(data + at + 12);
+      trex_size = get32(data + at + 16);
+      trex_flags = get32(data + at + 20);
+    } else if (isTag(tag, "stsd") && end - at >= 8 + 86) {
+      // one avc1 entry, its boxes after the 78 bytes of visual sample entry
+      size_t entry = at + 8;
+      if (!isTag(reinterpret_cast<const char*>(data + entry + 4), "avc1") &&
+          !isTag(reinterpret_cast<const char*>(data + entry + 4), "avc3")) {
+        return false;
+      }
+      size_t entry_end = std::min(static_cast<size_t>(entry + get32(data + entry)), end);
+      return boxes(data, entry + 86, entry_end,
+          [&](const char* t, size_t, size_t a, size_t e) {
+            return !isTag(t, "avcC") || avcc(a, e);
+          });
+    }
+    return true;
+  };
+
+  // each fragment's run of samples, offsets from the start of its 'moof'
+  auto traf = [&](size_t moof, size_t at, size_t end) {
+    uint64_t base = moof;
+    uint32_t duration = trex_duration, size = trex_size, flags = trex_flags;
+    uint64_t time = next_time;
+    return boxes(data, at, end, [&](const char* tag, size_t, size_t a, size_t e) {
+      if (e - a < 4) {
+        return true;
+      }
+      uint32_t fl = get32(data + a) & 0xffffff;
+      size_t p = a + 8;   // past the track id
+      if (isTag(tag, "tfhd")) {
+        if ((fl & 0x01) && p + 8 <= e) { base = get64(data + p); p += 8; }
+        if (fl & 0x02) { p += 4; }
+        if ((fl & 0x08) && p + 4 <= e) { duration = get32(data + p); p += 4; }
+        if ((fl & 0x10) && p + 4 <= e) { size = get32(data + p); p += 4; }
+        if ((fl & 0x20) && p + 4 <= e) { flags = get32(data + p); p += 4; }
+      } else if (isTag(tag, "tfdt")) {
+        time = (data[a] == 1 && e - a >= 12) ? get64(data + a + 4) : get32(data + a + 4);
+      } else if (isTag(tag, "trun")) {
+        if (e - a < 8) {
+          return false;
+        }
+        uint32_t num = get32(data + a + 4);
+        p = a + 8;
+        uint64_t offset = base;
+        if (fl & 0x01) {
+          offset = base + static_cast<int32_t>(get32(data + p));
+          p += 4;
+        }
+        uint32_t first = flags;
+        bool has_first = (fl & 0x04) != 0;
+        if (has_first) {
+          first = get32(data + p);
+          p += 4;
+        }
+        unsigned int per = ((fl & 0x100) ? 4 : 0) + ((fl & 0x200) ? 4 : 0) +
+          ((fl & 0x400) ? 4 : 0) + ((fl & 0x800) ? 4 : 0);
+        if (p + static_cast<uint64_t>(num) * per > e) {
+          return false;
+        }
+        for (uint32_t k = 0; k < num; k++) {
+          Mp4Entry s;
+          uint32_t d = duration, f = (k == 0 && has_first) ? first : flags;
+          s.size = size;
+          if (fl & 0x100) { d = get32(data + p); p += 4; }
+          if (fl & 0x200) { s.size = get32(data + p); p += 4; }
+          if (fl & 0x400) { f = get32(data + p); p += 4; }
+          if (fl & 0x800) { p += 4; }
+          s.offset = offset;
+          s.time = time;
+          s.key = (f & 0x00010000) == 0;
+          if (s.offset + s.size > len) {
+            return false;
+          }
+          samples.push_back(s);
+          offset += s.size;
+          time += d;
+        }
+        next_time = time;
+      }
+      return true;
+    });
+  };
+
+  bool ok = boxes(data, 0, len, [&](const char* tag, size_t start, size_t at, size_t end) {
+    if (isTag(tag, "moov")) {
+      return boxes(data, at, end, moov);
+    }
+    if (isTag(tag, "moof")) {
+      return boxes(data, at, end, [&](const char* t, size_t, size_t a, size_t e) {
+        return !isTag(t, "traf") || traf(start, a, e);
+      });
+    }
+    return true;
+  });
+
+  // a segment cut short still has its whole fragments
+  return (ok || !samples.empty()) && timescale != 0 && !params.empty();
+}
+
+} // namespace detector
@@ -0,0 +1,154 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Fragmented MP4 pieces shared by the recorder and the hls server.
+ *
+ *  One H264 track, 90kHz.  Samples are length prefixed NALs in an
+ *  'mdat' and every fragment is a 'moof' that points into the 'mdat'
+ *  right behind it.  'mp4Read' finds the samples of such a file again,
+ *  for the archive.
+ */
+
+#ifndef MP4_H
+#define MP4_H
+
+#include <cstdint>
+#include <vector>
+#include <chrono>
+
+namespace detector {
+
+// big endian box writing
+void put8(std::vector<unsigned char>& b, uint32_t v);
+void put16(std::vector<unsigned char>& b, uint32_t v);
+void put32(std::vector<unsigned char>& b, uint32_t v);
+void put64(std::vector<unsigned char>& b, uint64_t v);
+void putTag(std::vector<unsigned char>& b, const char* tag);
+void patch32(std::vector<unsigned char>& b, size_t pos, uint32_t v);
+size_t openBox(std::vector<unsigned char>& b, const char* tag);
+size_t openFullBox(std::vector<unsigned char>& b, const char* tag,
+    uint32_t version, uint32_t flags);
+void closeBox(std::vector<unsigned char>& b, size_t pos);
+
+class Mp4Sample {
+  public:
+    std::chrono::steady_clock::time_point stamp;
+    uint32_t size;
+    uint32_t duration;
+    bool key;
+};
+
+// 'ftyp' and 'moov' for one avc track
+void mp4Init(std::vector<unsigned char>& b, unsigned int width, unsigned int height,
+    unsigned int timescale, std::vector<unsigned char>& sps,
+    std::vector<unsigned char>& pps);
+
+// each sample lasts until the next one, the last falls back to the framerate
+void mp4Durations(std::vector<Mp4Sample>& samples,
+    std::chrono::steady_clock::time_point next, unsigned int timescale,
+    unsigned int framerate);
+
+// 'moof' and the 'mdat' header, the samples' data goes right after
+void mp4Fragment(std::vector<unsigned char>& b, uint32_t seq, uint64_t time,
+    std::vector<Mp4Sample>& samples, size_t mdat_len);
+
+// a sample of a file read back, its length prefixed nals at 'offset'
+class Mp4Entry {
+  public:
+    uint64_t offset;
+    uint32_t size;
+    uint64_t time;      // decode time in the track's timescale
+    bool key;
+};
+
+// the fragments' samples, the track's timescale, nal length size and its
+// sps and pps as annex b, false if it isn't an avc file this can follow
+bool mp4Read(const unsigned char* data, size_t len, unsigned int& timescale,
+    unsigned int& nal_len, std::vector<unsigned char>& params,
+    std::vector<Mp4Entry>& samples);
+
+// splits annex b into nals, the last one stays open until the next start code
+class AnnexB {
+  public:
+    AnnexB() : open_(false) {}
+    ~AnnexB() {}
+
+  public:
+    void reset() {
+      nal_.clear();
+      open_ = false;
+    }
+
+    // 'done(nal, stamp)' sees every finished nal
+    template<typename F>
+    void parse(const unsigned char* data, unsigned int len,
+        std::chrono::steady_clock::time_point stamp, F done) {
+
+      unsigned int i = 0;
+      while (i < len) {
+
+        // next start code, anything in front of it belongs to the open nal
+        unsigned int sc = len;
+        for (unsigned int j = i; j + 2 < len; j++) {
+          if (data[j] == 0 && data[j + 1] == 0 && data[j + 2] == 1) {
+            sc = j;
+            break;
+          }
+        }
+        unsigned int end = sc;
+        if (sc < len && sc > i && data[sc - 1] == 0) {
+          end = sc - 1;
+        }
+        if (open_) {
+          nal_.insert(nal_.end(), data + i, data + end);
+        }
+        if (sc == len) {
+          break;
+        }
+
+        finish(done);
+        open_ = true;
+        stamp_ = stamp;
+        i = sc + 3;
+      }
+    }
+
+    template<typename F>
+    void flush(F done) {
+      finish(done);
+      open_ = false;
+    }
+
+  private:
+    std::vector<unsigned char> nal_;
+    bool open_;
+    std::chrono::steady_clock::time_point stamp_;
+
+    template<typename F>
+    void finish(F& done) {
+      if (!nal_.empty()) {
+        done(nal_, stamp_);
+      }
+      nal_.clear();
+    }
+};
+
+} // namespace detector
+
+#endif // MP4_H
@@ -0,0 +1,54 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include "names.h"
+#include "utils.h"
+
+namespace detector {
+
+std::string Names::names_[Names::max_];
+std::atomic<unsigned int> Names::num_{0};
+std::mutex Names::lock_;
+
+int Names::intern(const std::string& name) {
+
+  // a model's worth of names a load, a scan is plenty
+  std::unique_lock<std::mutex> lck(lock_);
+  unsigned int num = num_.load(std::memory_order_relaxed);
+  for (unsigned int i = 0; i < num; i++) {
+    if (names_[i] == name) {
+      return i;
+    }
+  }
+  if (num == max_) {
+    dbgMsg("failed: names full, %s\n", name.c_str());
+    return -1;
+  }
+  names_[num] = name;
+  num_.store(num + 1, std::memory_order_release);
+  return num;
+}
+
+const char* Names::get(int id) {
+  if (id < 0 || static_cast<unsigned int>(id) >= size()) {
+    return "";
+  }
+  return names_[id].c_str();
+}
+
+} // namespace detector
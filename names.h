@@ -0,0 +1,61 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Interned class names.
+ *
+ *  One table of names for the whole process, the detector's labels and
+ *  the crop classifier's.  'intern' hands back a small id, the same one
+ *  for the same name whichever model or swap it came from, and that id
+ *  is what goes in a BoxBuf's 'cls' and 'attr'.  Boxes and tracks carry
+ *  no strings from stage to stage, a stage that shows or exports one
+ *  asks 'get' for it.  Names are only ever added, and once there never
+ *  change, so 'get' takes no lock.
+ */
+
+#ifndef NAMES_H
+#define NAMES_H
+
+#include <string>
+#include <mutex>
+#include <atomic>
+
+namespace detector {
+
+class Names {
+  public:
+    // the id of 'name', added if it is new, -1 once the table is full
+    static int intern(const std::string& name);
+
+    // the name of 'id', "" for -1 or an id it never gave out
+    static const char* get(int id);
+
+    static unsigned int size() { return num_.load(std::memory_order_acquire); }
+
+  private:
+    Names() = delete;
+
+    static const unsigned int max_ = {1024};
+    static std::string names_[max_];
+    static std::atomic<unsigned int> num_;
+    static std::mutex lock_;
+};
+
+} // namespace detector
+
+#endif // NAMES_H
@@ -0,0 +1,584 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <algorithm>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "kernels.h"
+
+namespace detector {
+
+#if defined(__ARM_NEON)
+
+// packed 4:2:2 to planar, 'u' null on the odd rows
+static unsigned int yuyv_to_yuv420(const unsigned char* src, unsigned char* dst_y,
+    unsigned char* dst_u, unsigned char* dst_v, unsigned int width) {
+
+  unsigned int i = 0;
+  for (; i + 32 <= width; i += 32) {
+    uint8x16x4_t px = vld4q_u8(src + i * 2);
+    uint8x16x2_t luma = { { px.val[0], px.val[2] } };
+    vst2q_u8(dst_y + i, luma);
+    if (dst_u) {
+      vst1q_u8(dst_u + i / 2, px.val[1]);
+      vst1q_u8(dst_v + i / 2, px.val[3]);
+    }
+  }
+  return i;
+}
+
+static unsigned int uv_to_planes(const unsigned char* src, unsigned char* dst_u,
+    unsigned char* dst_v, unsigned int num) {
+
+  unsigned int i = 0;
+  for (; i + 16 <= num; i += 16) {
+    uint8x16x2_t uv = vld2q_u8(src + i * 2);
+    vst1q_u8(dst_u + i, uv.val[0]);
+    vst1q_u8(dst_v + i, uv.val[1]);
+  }
+  return i;
+}
+
+// the 6 bit bt.601 of yuv2rgb() in utils.cpp, byte for byte
+static inline void yuv8_to_rgb(uint8x8_t y, uint8x8_t u, uint8x8_t v,
+    uint8x8_t& r, uint8x8_t& g, uint8x8_t& b) {
+  int16x8_t l = vmulq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(y)), vdupq_n_s16(16)), 74);
+  int16x8_t cu = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u)), vdupq_n_s16(128));
+  int16x8_t cv = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v)), vdupq_n_s16(128));
+  r = vqrshrun_n_s16(vaddq_s16(l, vmulq_n_s16(cv, 102)), 6);
+  g = vqrshrun_n_s16(vsubq_s16(vsubq_s16(l, vmulq_n_s16(cv, 52)), vmulq_n_s16(cu, 25)), 6);
+  b = vqrshrun_n_s16(vqaddq_s16(l, vmulq_n_s16(cu, 129)), 6);
+}
+
+// 16 pixels, each chroma sample covering two of them
+static inline void yuv16_to_rgb24(uint8x16_t y, uint8x8_t u, uint8x8_t v,
+    unsigned char* dst, bool bgr) {
+  uint8x8x2_t uu = vzip_u8(u, u);
+  uint8x8x2_t vv = vzip_u8(v, v);
+  uint8x8_t r0, g0, b0, r1, g1, b1;
+  yuv8_to_rgb(vget_low_u8(y), uu.val[0], vv.val[0], r0, g0, b0);
+  yuv8_to_rgb(vget_high_u8(y), uu.val[1], vv.val[1], r1, g1, b1);
+  uint8x16x3_t px;
+  px.val[0] = bgr ? vcombine_u8(b0, b1) : vcombine_u8(r0, r1);
+  px.val[1] = vcombine_u8(g0, g1);
+  px.val[2] = bgr ? vcombine_u8(r0, r1) : vcombine_u8(b0, b1);
+  vst3q_u8(dst, px);
+}
+
+// half width chroma, planar ('step' 1) or interleaved (2)
+static unsigned int yuv_to_rgb24(const unsigned char* y, const unsigned char* u,
+    const unsigned char* v, unsigned char* dst, unsigned int width,
+    unsigned int step, bool bgr) {
+
+  unsigned int i = 0;
+  for (; i + 16 <= width; i += 16) {
+    uint8x8_t cu, cv;
+    if (step == 2) {
+      uint8x8x2_t uv = vld2_u8(std::min(u, v) + i);   // u and v a byte apart
+      cu = (u < v) ? uv.val[0] : uv.val[1];
+      cv = (u < v) ? uv.val[1] : uv.val[0];
+    } else {
+      cu = vld1_u8(u + i / 2);
+      cv = vld1_u8(v + i / 2);
+    }
+    yuv16_to_rgb24(vld1q_u8(y + i), cu, cv, dst + i * 3, bgr);
+  }
+  return i;
+}
+
+// 'flip' when v comes before u
+static unsigned int yuyv_to_rgb24(const unsigned char* src, unsigned char* dst,
+    unsigned int width, bool flip, bool bgr) {
+
+  unsigned int i = 0;
+  for (; i + 16 <= width; i += 16) {
+    uint8x8x4_t px = vld4_u8(src + i * 2);
+    uint8x8x2_t luma = vzip_u8(px.val[0], px.val[2]);
+    yuv16_to_rgb24(vcombine_u8(luma.val[0], luma.val[1]),
+        flip ? px.val[3] : px.val[1], flip ? px.val[1] : px.val[3], dst + i * 3, bgr);
+  }
+  return i;
+}
+
+static unsigned int yuv444_to_rgb24(const unsigned char* y, const unsigned char* u,
+    const unsigned char* v, unsigned char* dst, unsigned int width) {
+
+  unsigned int i = 0;
+  for (; i + 8 <= width; i += 8) {
+    uint8x8x3_t px;
+    yuv8_to_rgb(vld1_u8(y + i), vld1_u8(u + i), vld1_u8(v + i),
+        px.val[0], px.val[1], px.val[2]);
+    vst3_u8(dst + i * 3, px);
+  }
+  return i;
+}
+
+static inline uint8x8_t rgb8_to_y(uint8x8_t r, uint8x8_t g, uint8x8_t b) {
+  uint16x8_t t = vmull_u8(r, vdup_n_u8(66));
+  t = vmlal_u8(t, g, vdup_n_u8(129));
+  t = vmlal_u8(t, b, vdup_n_u8(25));
+  return vadd_u8(vrshrn_n_u16(t, 8), vdup_n_u8(16));
+}
+
+// two rows, 'src1' under 'src0'
+static unsigned int rgb24_to_yuv420(const unsigned char* src0, const unsigned char* src1,
+    unsigned char* y0, unsigned char* y1, unsigned char* u, unsigned char* v,
+    unsigned int width, bool bgr) {
+
+  unsigned int i = 0;
+  for (; i + 16 <= width; i += 16) {
+    uint8x16x3_t a = vld3q_u8(src0 + i * 3);
+    uint8x16x3_t b = vld3q_u8(src1 + i * 3);
+    uint8x16_t ar = bgr ? a.val[2] : a.val[0], ab = bgr ? a.val[0] : a.val[2];
+    uint8x16_t br = bgr ? b.val[2] : b.val[0], bb = bgr ? b.val[0] : b.val[2];
+    vst1q_u8(y0 + i, vcombine_u8(
+          rgb8_to_y(vget_low_u8(ar), vget_low_u8(a.val[1]), vget_low_u8(ab)),
+          rgb8_to_y(vget_high_u8(ar), vget_high_u8(a.val[1]), vget_high_u8(ab))));
+    vst1q_u8(y1 + i, vcombine_u8(
+          rgb8_to_y(vget_low_u8(br), vget_low_u8(b.val[1]), vget_low_u8(bb)),
+          rgb8_to_y(vget_high_u8(br), vget_high_u8(b.val[1]), vget_high_u8(bb))));
+
+    uint8x8_t r = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(ar), vpaddlq_u8(br)), 2);
+    uint8x8_t g = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(a.val[1]), vpaddlq_u8(b.val[1])), 2);
+    uint8x8_t bl = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(ab), vpaddlq_u8(bb)), 2);
+
+    // wraps through the subtractions, the offset brings it back in range
+    uint16x8_t cu = vmull_u8(bl, vdup_n_u8(112));
+    cu = vmlsl_u8(cu, r, vdup_n_u8(38));
+    cu = vmlsl_u8(cu, g, vdup_n_u8(74));
+    uint16x8_t cv = vmull_u8(r, vdup_n_u8(112));
+    cv = vmlsl_u8(cv, g, vdup_n_u8(94));
+    cv = vmlsl_u8(cv, bl, vdup_n_u8(18));
+    vst1_u8(u + i / 2, vshrn_n_u16(vaddq_u16(cu, vdupq_n_u16(32896)), 8));
+    vst1_u8(v + i / 2, vshrn_n_u16(vaddq_u16(cv, vdupq_n_u16(32896)), 8));
+  }
+  return i;
+}
+
+static unsigned int quantise(const unsigned char* src, float* dst, unsigned int len,
+    float scale, float zero) {
+
+  unsigned int i = 0;
+  float32x4_t vs = vdupq_n_f32(scale);
+  float32x4_t vz = vdupq_n_f32(-zero * scale);
+  for (; i + 8 <= len; i += 8) {
+    uint16x8_t px = vmovl_u8(vld1_u8(src + i));
+    float32x4_t lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(px)));
+    float32x4_t hi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(px)));
+    vst1q_f32(dst + i, vmlaq_f32(vz, lo, vs));
+    vst1q_f32(dst + i + 4, vmlaq_f32(vz, hi, vs));
+  }
+  return i;
+}
+
+// 7 bit weights so the products fit in 16 bits
+static unsigned int blend_rows(const unsigned char* row0, const unsigned char* row1,
+    unsigned int wy, unsigned char* out, unsigned int len) {
+
+  unsigned int i = 0;
+  uint8x8_t w0 = vdup_n_u8(128 - wy);
+  uint8x8_t w1 = vdup_n_u8(wy);
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t a = vld1q_u8(row0 + i);
+    uint8x16_t b = vld1q_u8(row1 + i);
+    uint16x8_t lo = vmull_u8(vget_low_u8(a), w0);
+    uint16x8_t hi = vmull_u8(vget_high_u8(a), w0);
+    lo = vmlal_u8(lo, vget_low_u8(b), w1);
+    hi = vmlal_u8(hi, vget_high_u8(b), w1);
+    vst1q_u8(out + i, vcombine_u8(vrshrn_n_u16(lo, 7), vrshrn_n_u16(hi, 7)));
+  }
+  return i;
+}
+
+// 2x2 averages of two rows of one plane
+static unsigned int half_row(const unsigned char* s0, const unsigned char* s1,
+    unsigned char* d, unsigned int num) {
+
+  unsigned int c = 0;
+  for (; c + 8 <= num; c += 8) {
+    uint16x8_t sum = vpaddlq_u8(vld1q_u8(s0 + 2 * c));
+    sum = vpadalq_u8(sum, vld1q_u8(s1 + 2 * c));
+    vst1_u8(d + c, vrshrn_n_u16(sum, 2));
+  }
+  return c;
+}
+
+static unsigned int half_row_rgb24(const unsigned char* s0, const unsigned char* s1,
+    unsigned char* d, unsigned int num) {
+
+  unsigned int c = 0;
+  for (; c + 8 <= num; c += 8) {
+    uint8x16x3_t p0 = vld3q_u8(s0 + 6 * c);
+    uint8x16x3_t p1 = vld3q_u8(s1 + 6 * c);
+    uint8x8x3_t out;
+    for (unsigned int k = 0; k < 3; k++) {
+      uint16x8_t sum = vpadalq_u8(vpaddlq_u8(p0.val[k]), p1.val[k]);
+      out.val[k] = vrshrn_n_u16(sum, 2);
+    }
+    vst3_u8(d + 3 * c, out);
+  }
+  return c;
+}
+
+// a row backwards, 16 pixels at a time from its end
+static unsigned int mirror_row(const unsigned char* src, unsigned char* dst,
+    unsigned int num, unsigned int bpp) {
+
+  unsigned int i = 0;
+  if (bpp == 1) {
+    for (; i + 16 <= num; i += 16) {
+      uint8x16_t px = vrev64q_u8(vld1q_u8(src + num - i - 16));
+      vst1q_u8(dst + i, vcombine_u8(vget_high_u8(px), vget_low_u8(px)));
+    }
+  } else if (bpp == 3) {
+    for (; i + 16 <= num; i += 16) {
+      uint8x16x3_t px = vld3q_u8(src + (num - i - 16) * 3);
+      for (unsigned int k = 0; k < 3; k++) {
+        uint8x16_t r = vrev64q_u8(px.val[k]);
+        px.val[k] = vcombine_u8(vget_high_u8(r), vget_low_u8(r));
+      }
+      vst3q_u8(dst + i * 3, px);
+    }
+  }
+  return i;
+}
+
+// 8x8 blocks turned over their diagonal, bytes then pairs then quads
+static unsigned int transpose8(const unsigned char* src, int src_stride,
+    unsigned char* dst, int dst_stride, unsigned int num) {
+
+  unsigned int c = 0;
+  for (; c + 8 <= num; c += 8) {
+    uint8x8_t r[8];
+    for (int k = 0; k < 8; k++) {
+      r[k] = vld1_u8(src + k * src_stride + c);
+    }
+    uint8x8x2_t b0 = vtrn_u8(r[0], r[1]);
+    uint8x8x2_t b1 = vtrn_u8(r[2], r[3]);
+    uint8x8x2_t b2 = vtrn_u8(r[4], r[5]);
+    uint8x8x2_t b3 = vtrn_u8(r[6], r[7]);
+    uint16x4x2_t h0 = vtrn_u16(vreinterpret_u16_u8(b0.val[0]), vreinterpret_u16_u8(b1.val[0]));
+    uint16x4x2_t h1 = vtrn_u16(vreinterpret_u16_u8(b0.val[1]), vreinterpret_u16_u8(b1.val[1]));
+    uint16x4x2_t h2 = vtrn_u16(vreinterpret_u16_u8(b2.val[0]), vreinterpret_u16_u8(b3.val[0]));
+    uint16x4x2_t h3 = vtrn_u16(vreinterpret_u16_u8(b2.val[1]), vreinterpret_u16_u8(b3.val[1]));
+    uint32x2x2_t q0 = vtrn_u32(vreinterpret_u32_u16(h0.val[0]), vreinterpret_u32_u16(h2.val[0]));
+    uint32x2x2_t q1 = vtrn_u32(vreinterpret_u32_u16(h1.val[0]), vreinterpret_u32_u16(h3.val[0]));
+    uint32x2x2_t q2 = vtrn_u32(vreinterpret_u32_u16(h0.val[1]), vreinterpret_u32_u16(h2.val[1]));
+    uint32x2x2_t q3 = vtrn_u32(vreinterpret_u32_u16(h1.val[1]), vreinterpret_u32_u16(h3.val[1]));
+    unsigned char* d = dst + static_cast<int>(c) * dst_stride;
+    vst1_u8(d + 0 * dst_stride, vreinterpret_u8_u32(q0.val[0]));
+    vst1_u8(d + 1 * dst_stride, vreinterpret_u8_u32(q1.val[0]));
+    vst1_u8(d + 2 * dst_stride, vreinterpret_u8_u32(q2.val[0]));
+    vst1_u8(d + 3 * dst_stride, vreinterpret_u8_u32(q3.val[0]));
+    vst1_u8(d + 4 * dst_stride, vreinterpret_u8_u32(q0.val[1]));
+    vst1_u8(d + 5 * dst_stride, vreinterpret_u8_u32(q1.val[1]));
+    vst1_u8(d + 6 * dst_stride, vreinterpret_u8_u32(q2.val[1]));
+    vst1_u8(d + 7 * dst_stride, vreinterpret_u8_u32(q3.val[1]));
+  }
+  return c;
+}
+
+// 8 samples at a time, the 2x2 around each gathered a byte at a time and
+// the weights and blends in vectors
+static unsigned int remap_row(const unsigned char* plane, unsigned int stride,
+    const uint16_t* lut, unsigned int shift, unsigned char fill,
+    unsigned char* dst, unsigned int num) {
+
+  const int16x8_t down = vdupq_n_s16(-static_cast<int16_t>(shift));
+  const uint16x8_t none = vdupq_n_u16(0xffff);
+  const uint16x8_t frac = vdupq_n_u16(15);
+  const uint8x8_t sixteen = vdup_n_u8(16);
+  unsigned int i = 0;
+  for (; i + 8 <= num; i += 8) {
+    uint16x8x2_t xy = vld2q_u16(lut + i * 2);
+    uint8x8_t nowhere = vmovn_u16(vceqq_u16(xy.val[0], none));
+    uint16x8_t x = vshlq_u16(xy.val[0], down);
+    uint16x8_t y = vshlq_u16(xy.val[1], down);
+    uint8x8_t wx = vmovn_u16(vandq_u16(x, frac));
+    uint8x8_t wy = vmovn_u16(vandq_u16(y, frac));
+    uint16_t xs[8], ys[8];
+    vst1q_u16(xs, vshrq_n_u16(x, 4));
+    vst1q_u16(ys, vshrq_n_u16(y, 4));
+    uint8_t a[8], b[8], c[8], d[8];
+    for (unsigned int k = 0; k < 8; k++) {
+      const unsigned char* p = (lut[(i + k) * 2] == 0xffff) ? plane :
+        plane + ys[k] * stride + xs[k];
+      a[k] = p[0];
+      b[k] = p[1];
+      c[k] = p[stride];
+      d[k] = p[stride + 1];
+    }
+    uint8x8_t ix = vsub_u8(sixteen, wx);
+    uint16x8_t top = vmlal_u8(vmull_u8(vld1_u8(a), ix), vld1_u8(b), wx);
+    uint16x8_t bot = vmlal_u8(vmull_u8(vld1_u8(c), ix), vld1_u8(d), wx);
+    uint16x8_t iy = vmovl_u8(vsub_u8(sixteen, wy));
+    uint16x8_t sum = vmlaq_u16(vmulq_u16(top, iy), bot, vmovl_u8(wy));
+    vst1_u8(dst + i, vbsl_u8(nowhere, vdup_n_u8(fill), vrshrn_n_u16(sum, 8)));
+  }
+  return i;
+}
+
+// 8x8 luma means along a row of blocks
+static unsigned int luma8_yuv420(const unsigned char* row, unsigned int stride,
+    unsigned char* dst, unsigned int num) {
+
+  unsigned int c = 0;
+  for (; c + 2 <= num; c += 2) {
+    uint16x8_t acc = vdupq_n_u16(0);
+    for (unsigned int k = 0; k < 8; k++) {
+      acc = vpadalq_u8(acc, vld1q_u8(row + k * stride + c * 8));
+    }
+    uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(acc));
+    dst[c]     = (vgetq_lane_u64(sum, 0) + 32) >> 6;
+    dst[c + 1] = (vgetq_lane_u64(sum, 1) + 32) >> 6;
+  }
+  return c;
+}
+
+static unsigned int luma8_rgb24(const unsigned char* row, unsigned int stride,
+    unsigned char* dst, unsigned int num) {
+
+  unsigned int c = 0;
+  for (; c < num; c++) {
+    uint16x8_t acc = vdupq_n_u16(0);
+    for (unsigned int k = 0; k < 8; k++) {
+      uint8x8x3_t px = vld3_u8(row + k * stride + c * 24);
+      acc = vaddq_u16(acc, vaddl_u8(px.val[0], px.val[2]));
+      acc = vaddq_u16(acc, vshll_n_u8(px.val[1], 1));
+    }
+    uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(acc));
+    dst[c] = (vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1) + 128) >> 8;
+  }
+  return c;
+}
+
+static unsigned int count_changed(const unsigned char* a, const unsigned char* b,
+    const unsigned char* mask, unsigned int len, unsigned char threshold,
+    unsigned int& cnt) {
+
+  unsigned int i = 0;
+  uint8x16_t thr = vdupq_n_u8(threshold);
+  uint16x8_t acc = vdupq_n_u16(0);
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t d = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+    uint8x16_t hit = vandq_u8(vcgtq_u8(d, thr), vld1q_u8(mask + i));
+    acc = vpadalq_u8(acc, vshrq_n_u8(hit, 7));
+  }
+  uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(acc));
+  cnt = vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+  return i;
+}
+
+// the background is 8.4 fixed point, moved 1 / 2^shift of the way to
+// the frame, and the cells that differ from it by more than the
+// threshold are foreground
+static unsigned int update_background(const unsigned char* cur, int16_t* bg,
+    const unsigned char* mask, unsigned char* fg, unsigned int len,
+    unsigned char threshold, unsigned int shift) {
+
+  unsigned int i = 0;
+  uint8x8_t thr = vdup_n_u8(threshold);
+  int16x8_t rate = vdupq_n_s16(-static_cast<int16_t>(shift));
+  for (; i + 8 <= len; i += 8) {
+    uint8x8_t c = vld1_u8(cur + i);
+    int16x8_t b = vld1q_s16(bg + i);
+    uint8x8_t d = vabd_u8(c, vqshrun_n_s16(b, 4));
+    vst1_u8(fg + i, vand_u8(vcgt_u8(d, thr), vld1_u8(mask + i)));
+    int16x8_t diff = vsubq_s16(vreinterpretq_s16_u16(vshll_n_u8(c, 4)), b);
+    vst1q_s16(bg + i, vaddq_s16(b, vshlq_s16(diff, rate)));
+  }
+  return i;
+}
+
+static inline float32x4_t sample4(uint16x4_t a, uint16x4_t b, uint16x4_t c,
+    uint16x4_t d, float32x4_t f00, float32x4_t f01, float32x4_t f10, float32x4_t f11) {
+  float32x4_t s = vmulq_f32(vcvtq_f32_u32(vmovl_u16(a)), f00);
+  s = vmlaq_f32(s, vcvtq_f32_u32(vmovl_u16(b)), f01);
+  s = vmlaq_f32(s, vcvtq_f32_u32(vmovl_u16(c)), f10);
+  return vmlaq_f32(s, vcvtq_f32_u32(vmovl_u16(d)), f11);
+}
+
+static unsigned int sample_row(const unsigned char* row0, const unsigned char* row1,
+    unsigned int wx, unsigned int wy, float* dst, unsigned int num) {
+
+  unsigned int i = 0;
+  float32x4_t f00 = vdupq_n_f32((256 - wx) * (256 - wy) / 65536.f);
+  float32x4_t f01 = vdupq_n_f32(wx * (256 - wy) / 65536.f);
+  float32x4_t f10 = vdupq_n_f32((256 - wx) * wy / 65536.f);
+  float32x4_t f11 = vdupq_n_f32(wx * wy / 65536.f);
+  for (; i + 8 <= num; i += 8) {
+    uint16x8_t a = vmovl_u8(vld1_u8(row0 + i));
+    uint16x8_t b = vmovl_u8(vld1_u8(row0 + i + 1));
+    uint16x8_t c = vmovl_u8(vld1_u8(row1 + i));
+    uint16x8_t d = vmovl_u8(vld1_u8(row1 + i + 1));
+    vst1q_f32(dst + i, sample4(vget_low_u16(a), vget_low_u16(b),
+          vget_low_u16(c), vget_low_u16(d), f00, f01, f10, f11));
+    vst1q_f32(dst + i + 4, sample4(vget_high_u16(a), vget_high_u16(b),
+          vget_high_u16(c), vget_high_u16(d), f00, f01, f10, f11));
+  }
+  return i;
+}
+
+static unsigned int fill_rgb24(unsigned char* dst, unsigned int len, const unsigned char* c) {
+
+  unsigned int i = 0;
+  uint8x16x3_t px;
+  px.val[0] = vdupq_n_u8(c[0]);
+  px.val[1] = vdupq_n_u8(c[1]);
+  px.val[2] = vdupq_n_u8(c[2]);
+  for (; i + 16 <= len; i += 16) {
+    vst3q_u8(dst + i * 3, px);
+  }
+  return i;
+}
+
+// the exact / 255 of blend() in utils.cpp
+static inline uint8x8_t blend8(uint8x8_t p, uint8x8_t c, uint8x8_t a) {
+  uint16x8_t t = vmlal_u8(vmull_u8(c, a), p, vmvn_u8(a));
+  return vraddhn_u16(t, vrshrq_n_u16(t, 8));
+}
+
+static inline uint8x16_t blend16(uint8x16_t p, uint8x16_t c, uint8x16_t a) {
+  return vcombine_u8(blend8(vget_low_u8(p), vget_low_u8(c), vget_low_u8(a)),
+      blend8(vget_high_u8(p), vget_high_u8(c), vget_high_u8(a)));
+}
+
+static unsigned int blend_span(unsigned char* row, unsigned int len, const unsigned char* c,
+    unsigned char a, unsigned int bpp) {
+
+  unsigned int i = 0;
+  uint8x16_t va = vdupq_n_u8(a);
+  if (bpp == 1) {
+    uint8x16_t vc = vdupq_n_u8(c[0]);
+    for (; i + 16 <= len; i += 16) {
+      vst1q_u8(row + i, blend16(vld1q_u8(row + i), vc, va));
+    }
+  } else {
+    uint8x16_t c0 = vdupq_n_u8(c[0]), c1 = vdupq_n_u8(c[1]), c2 = vdupq_n_u8(c[2]);
+    for (; i + 16 <= len; i += 16) {
+      uint8x16x3_t px = vld3q_u8(row + i * 3);
+      px.val[0] = blend16(px.val[0], c0, va);
+      px.val[1] = blend16(px.val[1], c1, va);
+      px.val[2] = blend16(px.val[2], c2, va);
+      vst3q_u8(row + i * 3, px);
+    }
+  }
+  return i;
+}
+
+// rgba over rgb24
+static unsigned int blend_rgba(unsigned char* row, const unsigned char* src, unsigned int num) {
+
+  unsigned int i = 0;
+  for (; i + 16 <= num; i += 16) {
+    uint8x16x4_t s = vld4q_u8(src + i * 4);
+    uint8x16x3_t px = vld3q_u8(row + i * 3);
+    px.val[0] = blend16(px.val[0], s.val[0], s.val[3]);
+    px.val[1] = blend16(px.val[1], s.val[1], s.val[3]);
+    px.val[2] = blend16(px.val[2], s.val[2], s.val[3]);
+    vst3q_u8(row + i * 3, px);
+  }
+  return i;
+}
+
+// yuva's luma over a luma row
+static unsigned int blend_luma(unsigned char* row, const unsigned char* src, unsigned int num) {
+
+  unsigned int i = 0;
+  for (; i + 16 <= num; i += 16) {
+    uint8x16x4_t s = vld4q_u8(src + i * 4);
+    vst1q_u8(row + i, blend16(vld1q_u8(row + i), s.val[0], s.val[3]));
+  }
+  return i;
+}
+
+// yuva's chroma from the even pixels over half width chroma rows
+static unsigned int blend_chroma(unsigned char* row_u, unsigned char* row_v,
+    const unsigned char* src, unsigned int num) {
+
+  unsigned int i = 0;
+  for (; i + 32 <= num; i += 32) {
+    uint8x16x4_t s0 = vld4q_u8(src + i * 4);
+    uint8x16x4_t s1 = vld4q_u8(src + i * 4 + 64);
+    uint8x16_t u = vuzpq_u8(s0.val[1], s1.val[1]).val[0];
+    uint8x16_t v = vuzpq_u8(s0.val[2], s1.val[2]).val[0];
+    uint8x16_t a = vuzpq_u8(s0.val[3], s1.val[3]).val[0];
+    vst1q_u8(row_u + i / 2, blend16(vld1q_u8(row_u + i / 2), u, a));
+    vst1q_u8(row_v + i / 2, blend16(vld1q_u8(row_v + i / 2), v, a));
+  }
+  return i;
+}
+
+static unsigned int dot_f32(const float* a, const float* b, unsigned int len,
+    float& sum) {
+
+  unsigned int i = 0;
+  float32x4_t acc0 = vdupq_n_f32(0.f);
+  float32x4_t acc1 = vdupq_n_f32(0.f);
+  for (; i + 8 <= len; i += 8) {
+    acc0 = vmlaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+    acc1 = vmlaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+  }
+  float lanes[4];
+  vst1q_f32(lanes, vaddq_f32(acc0, acc1));
+  sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  return i;
+}
+
+const Kernels* neonKernels() {
+  static const Kernels neon = {
+    yuyv_to_yuv420,
+    uv_to_planes,
+    yuv_to_rgb24,
+    yuyv_to_rgb24,
+    yuv444_to_rgb24,
+    rgb24_to_yuv420,
+    quantise,
+    blend_rows,
+    half_row,
+    half_row_rgb24,
+    mirror_row,
+    transpose8,
+    remap_row,
+    luma8_yuv420,
+    luma8_rgb24,
+    count_changed,
+    update_background,
+    sample_row,
+    fill_rgb24,
+    blend_span,
+    blend_rgba,
+    blend_luma,
+    blend_chroma,
+    dot_f32
+  };
+  return &neon;
+}
+
+#else
+
+const Kernels* neonKernels() {
+  return nullptr;
+}
+
+#endif
+
+} // namespace detector
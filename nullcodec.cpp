@@ -0,0 +1,140 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include "nullcodec.h"
+#include "base.h"
+
+namespace detector {
+
+NullCodec::NullCodec(Base* owner)
+  : owner_(owner) {
+}
+
+NullCodec::~NullCodec() {
+}
+
+std::unique_ptr<NullCodec> NullCodec::create(Base* owner) {
+  auto obj = std::unique_ptr<NullCodec>(new NullCodec(owner));
+  obj->init();
+  return obj;
+}
+
+bool NullCodec::init() {
+  len_ = 0;
+  gop_ = 0;
+  since_key_ = 0;
+  key_req_ = false;
+
+  // aud, then an I or P slice header with nothing after it
+  key_au_ = { 0, 0, 0, 1, 0x09, 0xf0, 0, 0, 1, 0x65, 0x88, 0xc0 };
+  delta_au_ = { 0, 0, 0, 1, 0x09, 0xf0, 0, 0, 1, 0x41, 0x9b };
+  return true;
+}
+
+bool NullCodec::open(unsigned int width, unsigned int height, unsigned int framerate,
+    unsigned int pix_fmt, unsigned int bitrate) {
+
+  // laid out like the omx input, 16 aligned stride and slice
+  unsigned int stride = ALIGN_16B(width);
+  unsigned int slice = ALIGN_16B(height);
+  len_ = (pix_fmt == V4L2_PIX_FMT_YUV420) ? stride * slice * 3 / 2 : stride * slice * 3;
+  if (gop_ == 0) {
+    gop_ = framerate * 2;
+  }
+  bufs_.assign(in_num_, std::vector<unsigned char>(len_));
+  free_.clear();
+  for (unsigned int i = 0; i < in_num_; i++) {
+    free_.push_back(i);
+  }
+  done_.clear();
+  out_.clear();
+  since_key_ = 0;
+  key_req_ = true;
+  return true;
+}
+
+bool NullCodec::close() {
+  bufs_.clear();
+  free_.clear();
+  done_.clear();
+  out_.clear();
+  return true;
+}
+
+bool NullCodec::getInput(Codec::Input& in) {
+  if (free_.empty()) {
+    return false;
+  }
+  in.index = free_.back();
+  free_.pop_back();
+  in.addr = bufs_[in.index].data();
+  in.length = len_;
+  return true;
+}
+
+void NullCodec::putInput(Codec::Input& in) {
+  if (in.index < bufs_.size()) {
+    free_.push_back(in.index);
+  }
+}
+
+bool NullCodec::encode(Codec::Input& in, unsigned int len) {
+  if (in.index >= bufs_.size()) {
+    dbgMsg("unknown null input buffer\n");
+    return false;
+  }
+  bool key = key_req_ || since_key_ + 1 >= gop_;
+  since_key_ = key ? 0 : since_key_ + 1;
+  key_req_ = false;
+  done_.push_back(in.index);
+  out_.push_back(key);
+  owner_->wake();
+  return true;
+}
+
+bool NullCodec::doneInput(Codec::Input& in) {
+  if (done_.empty()) {
+    return false;
+  }
+  in.index = done_.front();
+  done_.pop_front();
+  in.addr = bufs_[in.index].data();
+  in.length = len_;
+  free_.push_back(in.index);
+  return true;
+}
+
+bool NullCodec::getOutput(Codec::Output& out) {
+  if (out_.empty()) {
+    return false;
+  }
+  auto& au = out_.front() ? key_au_ : delta_au_;
+  out.index = 0;
+  out.data = au.data();
+  out.length = au.size();
+  out.end = true;
+  out.key = out_.front();
+  out_.pop_front();
+  return true;
+}
+
+void NullCodec::footprint(Footprint& out) {
+  out.add("null_in", bufs_.size(), static_cast<size_t>(len_) * bufs_.size());
+}
+
+} // namespace detector
@@ -0,0 +1,98 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Null H264 codec, for the host build (make sim).
+ *
+ *  It takes frames like the hardware ones do and hands each back at
+ *  once as a stub Annex B access unit, an AUD and a slice NAL of type 5
+ *  every 'gop' frames or when asked and type 1 otherwise, so the
+ *  encoder's timing, overlay, sei splice, key frame logic and the fan
+ *  out to rtsp, the recorder and hls all run without a VideoCore.  The
+ *  slices carry no picture and there is no sps or pps, so nothing
+ *  decodes it.  It is what the encoder uses when built without OMX.
+ */
+
+#ifndef NULLCODEC_H
+#define NULLCODEC_H
+
+#include <memory>
+#include <vector>
+#include <deque>
+
+#include "utils.h"
+#include "base.h"
+#include "codec.h"
+
+namespace detector {
+
+class NullCodec : public Codec {
+  public:
+    static std::unique_ptr<NullCodec> create(Base* owner);
+    virtual ~NullCodec();
+
+  public:
+    virtual const char* name() { return "null"; }
+
+    virtual bool open(unsigned int width, unsigned int height, unsigned int framerate,
+        unsigned int pix_fmt, unsigned int bitrate);
+    virtual bool close();
+
+    virtual bool useBuffers(std::vector<FrameBuf>& bufs) { return true; }
+
+    virtual bool getInput(Codec::Input& in);
+    virtual bool findInput(const FrameBuf& frame, Codec::Input& in) { return false; }
+    virtual void putInput(Codec::Input& in);
+    virtual bool encode(Codec::Input& in, unsigned int len);
+    virtual bool doneInput(Codec::Input& in);
+
+    virtual bool getOutput(Codec::Output& out);
+    virtual bool putOutput(Codec::Output& out) { return true; }
+
+    virtual bool setBitrate(unsigned int bitrate) { return true; }
+    virtual bool requestKeyFrame() { key_req_ = true; return true; }
+    virtual void setGop(unsigned int frames) { gop_ = frames; }
+    virtual void setBuffers(unsigned int num) { in_num_ = num ? num : in_num_; }
+
+    virtual void footprint(Footprint& out);
+
+  protected:
+    NullCodec() = delete;
+    NullCodec(Base* owner);
+    bool init();
+
+  private:
+    Base* owner_;
+    unsigned int len_;
+    unsigned int gop_;
+    unsigned int since_key_;
+    bool key_req_;
+
+    unsigned int in_num_ = {3};
+    std::vector<std::vector<unsigned char>> bufs_;
+    std::vector<unsigned int> free_;
+    std::deque<unsigned int> done_;
+    std::deque<bool> out_;    // a frame each, if it is a key frame
+
+    std::vector<unsigned char> key_au_;
+    std::vector<unsigned char> delta_au_;
+};
+
+} // namespace detector
+
+#endif // NULLCODEC_H
@@ -0,0 +1,782 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <algorithm>
+
+#include "omx.h"
+#include "startup.h"
+
+namespace detector {
+
+#define OMX_INIT_STRUCTURE(a) \
+  std::memset(&(a), 0, sizeof(a)); \
+  (a).nSize = sizeof(a); \
+  (a).nVersion.nVersion = OMX_VERSION; \
+  (a).nVersion.s.nVersionMajor = OMX_VERSION_MAJOR; \
+  (a).nVersion.s.nVersionMinor = OMX_VERSION_MINOR; \
+  (a).nVersion.s.nRevision = OMX_VERSION_REVISION; \
+  (a).nVersion.s.nStep = OMX_VERSION_STEP
+
+Omx::Omx(Base* owner, unsigned int yield_time)
+  : owner_(owner), yield_time_(yield_time) {
+}
+
+Omx::~Omx() {
+}
+
+std::unique_ptr<Omx> Omx::create(Base* owner, unsigned int yield_time) {
+  auto obj = std::unique_ptr<Omx>(new Omx(owner, yield_time));
+  obj->init();
+  return obj;
+}
+
+bool Omx::init() {
+  omx_hnd_ = nullptr;
+  omx_buf_in_size_ = 0;
+  slices_ = 0;
+  vectors_ = false;
+  gop_ = 0;
+  return true;
+}
+
+OMX_BUFFERHEADERTYPE* Omx::inputHeader(unsigned int index) {
+  if (index < omx_buf_in_.size()) {
+    return omx_buf_in_[index];
+  }
+  index -= omx_buf_in_.size();
+  return (index < omx_buf_use_.size()) ? omx_buf_use_[index] : nullptr;
+}
+
+unsigned int Omx::inputIndex(OMX_BUFFERHEADERTYPE* hdr) {
+  auto it = std::find(omx_buf_in_.begin(), omx_buf_in_.end(), hdr);
+  if (it != omx_buf_in_.end()) {
+    return it - omx_buf_in_.begin();
+  }
+  it = std::find(omx_buf_use_.begin(), omx_buf_use_.end(), hdr);
+  return omx_buf_in_.size() + (it - omx_buf_use_.begin());
+}
+
+bool Omx::getInput(Codec::Input& in) {
+  OMX_BUFFERHEADERTYPE* hdr = nullptr;
+  if (!omx_in_free_.pop(hdr)) {
+    return false;
+  }
+  in.index = inputIndex(hdr);
+  in.addr = hdr->pBuffer;
+  in.length = hdr->nAllocLen;
+  return true;
+}
+
+bool Omx::findInput(const FrameBuf& frame, Codec::Input& in) {
+  auto it = std::find_if(omx_buf_use_.begin(), omx_buf_use_.end(),
+      [&](OMX_BUFFERHEADERTYPE* hdr) { return hdr->pBuffer == frame.addr; });
+  if (it == omx_buf_use_.end()) {
+    return false;
+  }
+  in.index = inputIndex(*it);
+  in.addr = (*it)->pBuffer;
+  in.length = (*it)->nAllocLen;
+  return true;
+}
+
+void Omx::setBuffers(unsigned int num) {
+  if (num != 0) {
+    omx_in_num_ = std::min(num, omx_buf_max_ / 2);
+    omx_out_num_ = omx_in_num_ + 1;
+  }
+}
+
+void Omx::putInput(Codec::Input& in) {
+  if (in.index < omx_buf_in_.size()) {
+    omx_in_free_.push(omx_buf_in_[in.index]);
+  }
+}
+
+bool Omx::encode(Codec::Input& in, unsigned int len) {
+  OMX_BUFFERHEADERTYPE* hdr = inputHeader(in.index);
+  if (hdr == nullptr) {
+    dbgMsg("unknown omx input buffer\n");
+    return false;
+  }
+  hdr->nOffset = 0;
+  hdr->nFilledLen = len;
+  hdr->nFlags = OMX_BUFFERFLAG_ENDOFFRAME;
+  OMX_ERRORTYPE err = OMX_EmptyThisBuffer(omx_hnd_, hdr);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: omx empty buffer\n");
+    return false;
+  }
+  return true;
+}
+
+bool Omx::doneInput(Codec::Input& in) {
+
+  // our buffers go straight back on the free list
+  OMX_BUFFERHEADERTYPE* hdr = nullptr;
+  if (!omx_in_done_.pop(hdr)) {
+    return false;
+  }
+  in.index = inputIndex(hdr);
+  in.addr = hdr->pBuffer;
+  in.length = hdr->nAllocLen;
+  if (in.index < omx_buf_in_.size()) {
+    omx_in_free_.push(hdr);
+  }
+  return true;
+}
+
+bool Omx::getOutput(Codec::Output& out) {
+  OMX_BUFFERHEADERTYPE* hdr = nullptr;
+  if (!omx_out_done_.pop(hdr)) {
+    return false;
+  }
+  auto it = std::find(omx_buf_out_.begin(), omx_buf_out_.end(), hdr);
+  out.index = it - omx_buf_out_.begin();
+  out.data = hdr->pBuffer + hdr->nOffset;
+  out.length = hdr->nFilledLen;
+  out.end = (hdr->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) != 0 &&
+    (hdr->nFlags & OMX_BUFFERFLAG_CODECCONFIG) == 0;
+  out.key = (hdr->nFlags & OMX_BUFFERFLAG_SYNCFRAME) != 0;
+  out.vectors = (hdr->nFlags & OMX_BUFFERFLAG_CODECSIDEINFO) != 0;
+  return true;
+}
+
+bool Omx::putOutput(Codec::Output& out) {
+  if (out.index >= omx_buf_out_.size()) {
+    dbgMsg("unknown omx output buffer\n");
+    return false;
+  }
+
+  // hand it back for more
+  OMX_BUFFERHEADERTYPE* hdr = omx_buf_out_[out.index];
+  hdr->nFilledLen = 0;
+  hdr->nOffset = 0;
+  hdr->nFlags = 0;
+  OMX_ERRORTYPE err = OMX_FillThisBuffer(omx_hnd_, hdr);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: omx fill buffer\n");
+    return false;
+  }
+  return true;
+}
+
+void Omx::footprint(Footprint& out) {
+  size_t bytes = 0;
+  for (auto hdr : omx_buf_in_) {
+    bytes += hdr->nAllocLen;
+  }
+  out.add("omx_in", omx_buf_in_.size(), bytes);
+  bytes = 0;
+  for (auto hdr : omx_buf_out_) {
+    bytes += hdr->nAllocLen;
+  }
+  out.add("omx_out", omx_buf_out_.size(), bytes);
+}
+
+bool Omx::setBitrate(unsigned int bitrate) {
+  OMX_VIDEO_CONFIG_BITRATETYPE bitrate_cfg;
+  OMX_INIT_STRUCTURE(bitrate_cfg);
+  bitrate_cfg.nPortIndex = 201;
+  bitrate_cfg.nEncodeBitrate = bitrate;
+  OMX_ERRORTYPE err = OMX_SetConfig(omx_hnd_, OMX_IndexConfigVideoBitrate, &bitrate_cfg);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: set config bitrate\n");
+    return false;
+  }
+  return true;
+}
+
+bool Omx::requestKeyFrame() {
+  OMX_CONFIG_PORTBOOLEANTYPE key_cfg;
+  OMX_INIT_STRUCTURE(key_cfg);
+  key_cfg.nPortIndex = 201;
+  key_cfg.bEnabled = OMX_TRUE;
+  OMX_ERRORTYPE err = OMX_SetConfig(omx_hnd_,
+      OMX_IndexConfigBrcmVideoRequestIFrame, &key_cfg);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: request key frame\n");
+    return false;
+  }
+  return true;
+}
+
+bool Omx::useBuffers(std::vector<FrameBuf>& bufs) {
+
+  // capture buffers must hold a full encoder input frame
+  for (auto& b : bufs) {
+    if (b.addr == nullptr || b.length < omx_buf_in_size_) {
+      dbgMsg("capture buffers too small for direct encode\n");
+      return true;
+    }
+  }
+
+  // disable input port
+  dbgMsg("disable port 200 for capture buffers\n");
+  OMX_ERRORTYPE err = OMX_SendCommand(omx_hnd_, OMX_CommandPortDisable, 200, NULL);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: disable port 200\n");
+    return false;
+  }
+  if (!freeBuffers(200, omx_buf_in_)) {
+    return false;
+  }
+  if (!freeBuffers(200, omx_buf_use_)) {
+    return false;
+  }
+  blockOnPortChange(200, OMX_FALSE);
+
+  // one header per capture buffer plus our own for overlay copies
+  OMX_PARAM_PORTDEFINITIONTYPE port_def;
+  OMX_INIT_STRUCTURE(port_def);
+  port_def.nPortIndex = 200;
+  err = OMX_GetParameter(omx_hnd_, OMX_IndexParamPortDefinition, &port_def);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: get port 200 definition\n");
+    return false;
+  }
+  port_def.nBufferCountActual = bufs.size() + omx_in_num_;
+  err = OMX_SetParameter(omx_hnd_, OMX_IndexParamPortDefinition, &port_def);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: set port 200 buffer count\n");
+    return false;
+  }
+
+  // enable input port
+  err = OMX_SendCommand(omx_hnd_, OMX_CommandPortEnable, 200, NULL);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: enable port 200\n");
+    return false;
+  }
+  for (auto& b : bufs) {
+    OMX_BUFFERHEADERTYPE* hdr = nullptr;
+    err = OMX_UseBuffer(omx_hnd_, &hdr, 200, NULL, port_def.nBufferSize, b.addr);
+    if (err != OMX_ErrorNone) {
+      dbgMsg("failed: use capture buffer\n");
+      return false;
+    }
+    omx_buf_use_.push_back(hdr);
+  }
+  if (!allocateBuffers(200, omx_in_num_, omx_buf_in_)) {
+    return false;
+  }
+  blockOnPortChange(200, OMX_TRUE);
+
+  dbgMsg("encoding from %zu capture buffers\n", omx_buf_use_.size());
+  return true;
+}
+
+bool Omx::allocateBuffers(OMX_U32 port, unsigned int num,
+    std::vector<OMX_BUFFERHEADERTYPE*>& bufs) {
+
+  OMX_PARAM_PORTDEFINITIONTYPE port_def;
+  OMX_INIT_STRUCTURE(port_def);
+  port_def.nPortIndex = port;
+  OMX_ERRORTYPE err = OMX_GetParameter(omx_hnd_, OMX_IndexParamPortDefinition, &port_def);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: allocate port %u buffers get param\n", port);
+    return false;
+  }
+  dbgMsg("port %u allocate %u x size: %d\n", port, num, port_def.nBufferSize);
+  for (unsigned int i = 0; i < num; i++) {
+    OMX_BUFFERHEADERTYPE* hdr = nullptr;
+    err = OMX_AllocateBuffer(omx_hnd_, &hdr, port, NULL, port_def.nBufferSize);
+    if (err != OMX_ErrorNone) {
+      dbgMsg("failed: allocate port %u buffers\n", port);
+      return false;
+    }
+    bufs.push_back(hdr);
+    if (port == 200) {
+      omx_in_free_.push(hdr);
+    }
+  }
+  return true;
+}
+
+bool Omx::freeBuffers(OMX_U32 port, std::vector<OMX_BUFFERHEADERTYPE*>& bufs) {
+
+  OMX_BUFFERHEADERTYPE* hdr;
+  if (port == 200) {
+    while (omx_in_free_.pop(hdr)) {
+    }
+  }
+  for (auto b : bufs) {
+    OMX_ERRORTYPE err = OMX_FreeBuffer(omx_hnd_, port, b);
+    if (err != OMX_ErrorNone) {
+      dbgMsg("failed: free port %u buffer\n", port);
+      return false;
+    }
+  }
+  bufs.clear();
+  return true;
+}
+
+#ifdef OUTPUT_VARIOUS_BITS_OF_INFO
+void Omx::printDef(OMX_PARAM_PORTDEFINITIONTYPE def) {
+  const char* dir;
+  if (def.eDir == OMX_DirInput) {
+    dir = "in";
+  } else {
+    dir = "out";
+  }
+  dbgMsg("  Port %u: %s %u/%u %u %u %s,%s,%s %ux%u %ux%u @%u %u\n",
+      def.nPortIndex,
+      dir,
+      def.nBufferCountActual,
+      def.nBufferCountMin,
+      def.nBufferSize,
+      def.nBufferAlignment,
+      def.bEnabled ? "enabled" : "disabled",
+      def.bPopulated ? "populated" : "not pop",
+      def.bBuffersContiguous ? "contig" : "not contig",
+      def.format.video.nFrameWidth,
+      def.format.video.nFrameHeight,
+      def.format.video.nStride,
+      def.format.video.nSliceHeight,
+      def.format.video.xFramerate,
+      def.format.video.eColorFormat);
+}
+#endif
+
+OMX_ERRORTYPE Omx::eventHandler(OMX_HANDLETYPE hnd, OMX_PTR self,
+    OMX_EVENTTYPE evt, OMX_U32 d1, OMX_U32 d2, OMX_PTR data) {
+  Omx* omx = static_cast<Omx*>(self);
+  switch (evt) {
+    case OMX_EventCmdComplete:
+      if (d1 == OMX_CommandFlush) {
+        omx->omx_flush_sem_.post();
+      } else {
+        omx->omx_cmd_sem_.post();
+      }
+      break;
+    case OMX_EventError:
+      // a refused command never completes, let the waiter look again
+      omx->omx_cmd_sem_.post();
+      break;
+    default:
+      break;
+  }
+  return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE Omx::emptyHandler(OMX_HANDLETYPE hnd, OMX_PTR self,
+    OMX_BUFFERHEADERTYPE* buf) {
+  Omx* omx = static_cast<Omx*>(self);
+  omx->omx_in_done_.push(buf);
+  omx->owner_->wake();
+  return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE Omx::fillHandler(OMX_HANDLETYPE hnd, OMX_PTR self,
+    OMX_BUFFERHEADERTYPE* buf) {
+  Omx* omx = static_cast<Omx*>(self);
+  omx->omx_out_done_.push(buf);
+  omx->owner_->wake();
+  return OMX_ErrorNone;
+}
+
+bool Omx::blockOnPortChange(OMX_U32 idx, OMX_BOOL enable) {
+  OMX_PARAM_PORTDEFINITIONTYPE port_def;
+  OMX_INIT_STRUCTURE(port_def);
+  port_def.nPortIndex = idx;
+  auto limit = std::chrono::steady_clock::now() + std::chrono::milliseconds(block_timeout_);
+  unsigned int i = 0;
+  while (i++ == 0 || port_def.bEnabled != enable) {
+    OMX_ERRORTYPE err = OMX_GetParameter(omx_hnd_,
+        OMX_IndexParamPortDefinition, &port_def);
+    if (err != OMX_ErrorNone) {
+      dbgMsg("failed block port\n");
+    }
+    if (port_def.bEnabled != enable) {
+      if (std::chrono::steady_clock::now() >= limit) {
+        dbgMsg("failed: port %u change timed out\n", static_cast<unsigned int>(idx));
+        return false;
+      }
+      omx_cmd_sem_.wait_for(cmd_timeout_);
+    }
+  }
+  return true;
+}
+
+bool Omx::blockOnStateChange(OMX_STATETYPE state) {
+  OMX_STATETYPE s;
+  auto limit = std::chrono::steady_clock::now() + std::chrono::milliseconds(block_timeout_);
+  unsigned int i = 0;
+  while (i++ == 0 || s != state) {
+    OMX_GetState(omx_hnd_, &s);
+    if (s != state) {
+      if (std::chrono::steady_clock::now() >= limit) {
+        dbgMsg("failed: state change timed out\n");
+        return false;
+      }
+      omx_cmd_sem_.wait_for(cmd_timeout_);
+    }
+  }
+  return true;
+}
+
+bool Omx::open(unsigned int width, unsigned int height, unsigned int framerate,
+    unsigned int pix_fmt, unsigned int bitrate) {
+
+  // init bcm
+  dbgMsg("int bcm\n");
+  bcm_host_init();
+
+  // init omx
+  dbgMsg("init omx\n");
+  if (OMX_Init() != OMX_ErrorNone) {
+    return false;
+  }
+
+  // create omx component handles
+  dbgMsg("create omx component handles\n");
+  OMX_CALLBACKTYPE callbacks;
+  std::memset(&callbacks, 0, sizeof(callbacks));
+  callbacks.EventHandler    = eventHandler;
+  callbacks.EmptyBufferDone = emptyHandler;
+  callbacks.FillBufferDone  = fillHandler;
+  OMX_ERRORTYPE err = OMX_GetHandle(&omx_hnd_,
+      const_cast<char*>("OMX.broadcom.video_encode"),
+      this, &callbacks);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: create omx component handles: 0x%x\n", err);
+    return false;
+  }
+  OMX_INDEXTYPE types[] = {
+    OMX_IndexParamAudioInit, OMX_IndexParamVideoInit,
+    OMX_IndexParamImageInit, OMX_IndexParamOtherInit
+  };
+  OMX_PORT_PARAM_TYPE ports;
+  OMX_INIT_STRUCTURE(ports);
+  OMX_GetParameter(omx_hnd_, OMX_IndexParamVideoInit, &ports);
+  for (unsigned int i = 0; i < 4; i++) {
+    if (OMX_GetParameter(omx_hnd_, types[i], &ports) == OMX_ErrorNone) {
+      for (unsigned int idx = ports.nStartPortNumber;
+          idx < ports.nStartPortNumber + ports.nPorts; idx++) {
+        err = OMX_SendCommand(omx_hnd_, OMX_CommandPortDisable, idx, NULL);
+        if (err != OMX_ErrorNone) {
+          dbgMsg("failed: disable ports\n");
+          return false;
+        }
+        blockOnPortChange(idx, OMX_FALSE);
+      }
+    }
+  }
+
+  // get video encode settings port 200
+  dbgMsg("get video encode settings port 200\n");
+  OMX_PARAM_PORTDEFINITIONTYPE port_def;
+  OMX_INIT_STRUCTURE(port_def);
+  port_def.nPortIndex = 200;
+  err = OMX_GetParameter(omx_hnd_, OMX_IndexParamPortDefinition, &port_def);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: get omx paramter port 200\n");
+    return false;
+  }
+
+#ifdef OUTPUT_VARIOUS_BITS_OF_INFO
+  printDef(port_def);
+#endif
+
+  // set video encode settings port 200
+  dbgMsg("set video encode settings port 200\n");
+  port_def.format.video.nFrameWidth = width;
+  port_def.format.video.nFrameHeight = height;
+  port_def.format.video.xFramerate = framerate << 16;
+  port_def.format.video.nSliceHeight = ALIGN_16B(port_def.format.video.nFrameHeight);
+  port_def.format.video.nStride = ALIGN_16B(port_def.format.video.nFrameWidth);
+  if (pix_fmt == V4L2_PIX_FMT_YUV420) {
+    port_def.format.video.eColorFormat = OMX_COLOR_FormatYUV420PackedPlanar;
+  } else {
+    port_def.format.video.eColorFormat = OMX_COLOR_Format24bitBGR888;
+  }
+  port_def.nBufferCountActual = std::max(port_def.nBufferCountMin, omx_in_num_);
+  err = OMX_SetParameter(omx_hnd_, OMX_IndexParamPortDefinition, &port_def);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: set omx paramter port 200\n");
+    return false;
+  }
+
+#ifdef OUTPUT_VARIOUS_BITS_OF_INFO
+  printDef(port_def);
+#endif
+
+  // set video encode settings for port 201
+  dbgMsg("set video encode settings port 201\n");
+  OMX_VIDEO_PARAM_PORTFORMATTYPE format;
+  OMX_INIT_STRUCTURE(format);
+  format.nPortIndex = 201;
+  format.eColorFormat = OMX_COLOR_FormatUnused;
+  format.eCompressionFormat = OMX_VIDEO_CodingAVC;
+  err = OMX_SetParameter(omx_hnd_, OMX_IndexParamVideoPortFormat, &format);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: set omx parameter to port 201\n");
+    return false;
+  }
+
+  // set bitrate
+  dbgMsg("set bitrate\n");
+  OMX_VIDEO_PARAM_BITRATETYPE bitrate_type;
+  OMX_INIT_STRUCTURE(bitrate_type);
+  bitrate_type.eControlRate = OMX_Video_ControlRateVariable;
+  bitrate_type.nTargetBitrate = bitrate;
+  bitrate_type.nPortIndex = 201;
+  err = OMX_SetParameter(omx_hnd_, OMX_IndexParamVideoBitrate, &bitrate_type);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: set bitrate\n");
+    return false;
+  }
+  OMX_INIT_STRUCTURE(bitrate_type);
+  bitrate_type.nPortIndex = 201;
+  err = OMX_GetParameter(omx_hnd_, OMX_IndexParamVideoBitrate, &bitrate_type);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: get bitrate\n");
+    return false;
+  }
+  dbgMsg("current bitrate:%u\n", bitrate_type.nTargetBitrate);
+
+  // key frame interval
+  if (gop_ != 0) {
+    dbgMsg("set gop %u\n", gop_);
+    OMX_VIDEO_PARAM_AVCTYPE avc;
+    OMX_INIT_STRUCTURE(avc);
+    avc.nPortIndex = 201;
+    if (OMX_GetParameter(omx_hnd_, OMX_IndexParamVideoAvc, &avc) == OMX_ErrorNone) {
+      avc.nPFrames = gop_ - 1;
+      avc.nBFrames = 0;
+      if (OMX_SetParameter(omx_hnd_, OMX_IndexParamVideoAvc, &avc) != OMX_ErrorNone) {
+        dbgMsg("warning: set gop\n");
+      }
+    }
+  }
+
+  // slices come out a NAL a buffer as the encoder finishes them, so
+  // streaming starts on a frame before the bottom of it is encoded
+  if (slices_ != 0) {
+    dbgMsg("set %u mb rows a slice\n", slices_);
+    OMX_PARAM_U32TYPE rows;
+    OMX_INIT_STRUCTURE(rows);
+    rows.nPortIndex = 201;
+    rows.nU32 = slices_;
+    OMX_CONFIG_PORTBOOLEANTYPE separate;
+    OMX_INIT_STRUCTURE(separate);
+    separate.nPortIndex = 201;
+    separate.bEnabled = OMX_TRUE;
+    if (OMX_SetParameter(omx_hnd_, OMX_IndexConfigBrcmVideoEncoderMBRowsPerSlice, &rows) != OMX_ErrorNone ||
+        OMX_SetParameter(omx_hnd_, OMX_IndexParamBrcmNALSSeparate, &separate) != OMX_ErrorNone) {
+      dbgMsg("warning: no slices, whole frames\n");
+    }
+  }
+
+  // the macroblock vectors come in a buffer of their own after each frame
+  if (vectors_) {
+    dbgMsg("set inline vectors\n");
+    OMX_CONFIG_PORTBOOLEANTYPE inline_vectors;
+    OMX_INIT_STRUCTURE(inline_vectors);
+    inline_vectors.nPortIndex = 201;
+    inline_vectors.bEnabled = OMX_TRUE;
+    if (OMX_SetParameter(omx_hnd_, OMX_IndexParamBrcmVideoAVCInlineVectorsEnable, &inline_vectors) != OMX_ErrorNone) {
+      dbgMsg("warning: no inline vectors\n");
+    }
+  }
+
+  // output buffers to keep the encoder busy
+  OMX_INIT_STRUCTURE(port_def);
+  port_def.nPortIndex = 201;
+  err = OMX_GetParameter(omx_hnd_, OMX_IndexParamPortDefinition, &port_def);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: get omx paramter port 201\n");
+    return false;
+  }
+  port_def.nBufferCountActual = std::max(port_def.nBufferCountMin, omx_out_num_);
+  err = OMX_SetParameter(omx_hnd_, OMX_IndexParamPortDefinition, &port_def);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: set omx paramter port 201\n");
+    return false;
+  }
+
+  // idle omx
+  dbgMsg("idle omx\n");
+  err = OMX_SendCommand(omx_hnd_, OMX_CommandStateSet, OMX_StateIdle, NULL);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: change to idle state\n");
+    return false;
+  }
+  {
+    Startup::Scope step("omx idle");
+    blockOnStateChange(OMX_StateIdle);
+  }
+
+  // enable ports
+  dbgMsg("enable ports\n");
+  err = OMX_SendCommand(omx_hnd_, OMX_CommandPortEnable, 200, NULL);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: enable port 200x\n");
+    return false;
+  }
+  {
+    Startup::Scope step("omx port enable");
+    blockOnPortChange(200, OMX_TRUE);
+  }
+  err = OMX_SendCommand(omx_hnd_, OMX_CommandPortEnable, 201, NULL);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: enable port 201\n");
+    return false;
+  }
+  {
+    Startup::Scope step("omx port enable");
+    blockOnPortChange(200, OMX_TRUE);
+  }
+
+  // allocate buffers
+  dbgMsg("allocate buffers\n");
+  OMX_INIT_STRUCTURE(port_def);
+  port_def.nPortIndex = 200;
+  err = OMX_GetParameter(omx_hnd_, OMX_IndexParamPortDefinition, &port_def);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: allocate port 200 buffers get param\n");
+    return false;
+  }
+  omx_buf_in_size_ = port_def.nBufferSize;
+  if (!allocateBuffers(200, port_def.nBufferCountActual, omx_buf_in_)) {
+    return false;
+  }
+  OMX_INIT_STRUCTURE(port_def);
+  port_def.nPortIndex = 201;
+  err = OMX_GetParameter(omx_hnd_, OMX_IndexParamPortDefinition, &port_def);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: allocate port 201 buffers get param\n");
+    return false;
+  }
+  if (!allocateBuffers(201, port_def.nBufferCountActual, omx_buf_out_)) {
+    return false;
+  }
+
+  // execute omx
+  dbgMsg("execute omx\n");
+  err = OMX_SendCommand(omx_hnd_, OMX_CommandStateSet, OMX_StateExecuting, NULL);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: change to idle state\n");
+    return false;
+  }
+  {
+    Startup::Scope step("omx executing");
+    blockOnStateChange(OMX_StateExecuting);
+  }
+
+  // all output buffers wait on the encoder
+  for (auto hdr : omx_buf_out_) {
+    hdr->nFilledLen = 0;
+    err = OMX_FillThisBuffer(omx_hnd_, hdr);
+    if (err != OMX_ErrorNone) {
+      dbgMsg("failed: omx fill buffer\n");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool Omx::close() {
+
+  // flush the port buffers, the callbacks give every buffer back
+  dbgMsg("flush the port buffers\n");
+  OMX_ERRORTYPE err = OMX_SendCommand(omx_hnd_, OMX_CommandFlush, 200, NULL);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: flush port 200 buffers\n");
+    return false;
+  }
+  if (!omx_flush_sem_.wait_for(block_timeout_ * 1000)) {
+    dbgMsg("failed: flush port 200 timed out\n");
+  }
+  err = OMX_SendCommand(omx_hnd_, OMX_CommandFlush, 201, NULL);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: flush port 201 buffers\n");
+    return false;
+  }
+  if (!omx_flush_sem_.wait_for(block_timeout_ * 1000)) {
+    dbgMsg("failed: flush port 201 timed out\n");
+  }
+  {
+    OMX_BUFFERHEADERTYPE* hdr;
+    while (omx_in_done_.pop(hdr)) {
+    }
+    while (omx_out_done_.pop(hdr)) {
+    }
+  }
+
+  // disable all ports
+  dbgMsg("disable all ports\n");
+  err = OMX_SendCommand(omx_hnd_, OMX_CommandPortDisable, 200, NULL);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: disable port 200\n");
+    return false;
+  }
+  blockOnPortChange(200, OMX_FALSE);
+  err = OMX_SendCommand(omx_hnd_, OMX_CommandPortDisable, 201, NULL);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: disable port 201\n");
+    return false;
+  }
+  blockOnPortChange(201, OMX_FALSE);
+
+  // free all buffers
+  dbgMsg("free all buffers\n");
+  if (!freeBuffers(200, omx_buf_in_)) {
+    return false;
+  }
+  if (!freeBuffers(200, omx_buf_use_)) {
+    return false;
+  }
+  if (!freeBuffers(201, omx_buf_out_)) {
+    return false;
+  }
+
+  // transition to idle state
+  dbgMsg("transition to loaded state\n");
+  err = OMX_SendCommand(omx_hnd_, OMX_CommandStateSet, OMX_StateIdle, NULL);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: transition to idle state: 0x%x\n", err);
+    return false;
+  }
+  blockOnStateChange(OMX_StateIdle);
+  err = OMX_SendCommand(omx_hnd_, OMX_CommandStateSet, OMX_StateLoaded, NULL);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: transition to loaded state\n");
+    return false;
+  }
+  blockOnStateChange(OMX_StateLoaded);
+
+ // free component handle
+  dbgMsg("free component handle\n");
+  err = OMX_FreeHandle(omx_hnd_);
+  if (err != OMX_ErrorNone) {
+    dbgMsg("failed: free component handle\n");
+    return false;
+  }
+  omx_hnd_ = nullptr;
+
+  OMX_Deinit();
+  bcm_host_deinit();
+
+  return true;
+}
+
+} // namespace detector
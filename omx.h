@@ -0,0 +1,134 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#ifndef OMX_H
+#define OMX_H
+
+#include <memory>
+#include <vector>
+
+#include "utils.h"
+#include "channel.h"
+#include "base.h"
+#include "codec.h"
+
+extern "C" {
+#include <IL/OMX_Core.h>
+#include <IL/OMX_Component.h>
+#include <IL/OMX_Video.h>
+}
+
+extern "C" {
+#include <bcm_host.h>
+#include <IL/OMX_Broadcom.h>
+}
+
+namespace detector {
+
+class Omx : public Codec {
+  public:
+    static std::unique_ptr<Omx> create(Base* owner, unsigned int yield_time);
+    virtual ~Omx();
+
+  public:
+    virtual const char* name() { return "omx"; }
+
+    virtual bool open(unsigned int width, unsigned int height, unsigned int framerate,
+        unsigned int pix_fmt, unsigned int bitrate);
+    virtual bool close();
+
+    virtual bool useBuffers(std::vector<FrameBuf>& bufs);
+
+    virtual bool getInput(Codec::Input& in);
+    virtual bool findInput(const FrameBuf& frame, Codec::Input& in);
+    virtual void putInput(Codec::Input& in);
+    virtual bool encode(Codec::Input& in, unsigned int len);
+    virtual bool doneInput(Codec::Input& in);
+
+    virtual bool getOutput(Codec::Output& out);
+    virtual bool putOutput(Codec::Output& out);
+
+    virtual bool setBitrate(unsigned int bitrate);
+    virtual bool requestKeyFrame();
+    virtual void setSlices(unsigned int rows) { slices_ = rows; }
+    virtual void setGop(unsigned int frames) { gop_ = frames; }
+    virtual void setVectors(bool on) { vectors_ = on; }
+    virtual void setBuffers(unsigned int num);
+
+    virtual void footprint(Footprint& out);
+
+  protected:
+    Omx() = delete;
+    Omx(Base* owner, unsigned int yield_time);
+    bool init();
+
+  private:
+    Base* owner_;
+    unsigned int yield_time_;
+
+    Semaphore omx_flush_sem_;
+    Semaphore omx_cmd_sem_;
+    OMX_HANDLETYPE omx_hnd_;
+    unsigned int omx_buf_in_size_;
+    unsigned int slices_;
+    unsigned int gop_;
+    bool vectors_;
+
+    // several frames in flight, the omx callbacks hand buffers back
+    unsigned int omx_in_num_  = {3};   // our own input buffers for copies
+    unsigned int omx_out_num_ = {4};
+    const unsigned int omx_buf_max_ = {32};
+    std::vector<OMX_BUFFERHEADERTYPE*> omx_buf_in_;
+    std::vector<OMX_BUFFERHEADERTYPE*> omx_buf_use_;
+    std::vector<OMX_BUFFERHEADERTYPE*> omx_buf_out_;
+    Channel<OMX_BUFFERHEADERTYPE*> omx_in_free_{omx_buf_max_,
+      Channel<OMX_BUFFERHEADERTYPE*>::Policy::kDropNewest};
+    Channel<OMX_BUFFERHEADERTYPE*> omx_in_done_{omx_buf_max_,
+      Channel<OMX_BUFFERHEADERTYPE*>::Policy::kDropNewest};
+    Channel<OMX_BUFFERHEADERTYPE*> omx_out_done_{omx_buf_max_,
+      Channel<OMX_BUFFERHEADERTYPE*>::Policy::kDropNewest};
+
+    // inputs are numbered our own buffers first, then the capture buffers
+    OMX_BUFFERHEADERTYPE* inputHeader(unsigned int index);
+    unsigned int inputIndex(OMX_BUFFERHEADERTYPE* hdr);
+
+    bool allocateBuffers(OMX_U32 port, unsigned int num,
+        std::vector<OMX_BUFFERHEADERTYPE*>& bufs);
+    bool freeBuffers(OMX_U32 port, std::vector<OMX_BUFFERHEADERTYPE*>& bufs);
+
+    static OMX_ERRORTYPE eventHandler(OMX_HANDLETYPE hnd, OMX_PTR self,
+        OMX_EVENTTYPE evt, OMX_U32 d1, OMX_U32 d2, OMX_PTR data);
+    static OMX_ERRORTYPE emptyHandler(OMX_HANDLETYPE hnd, OMX_PTR self,
+        OMX_BUFFERHEADERTYPE* buf);
+    static OMX_ERRORTYPE fillHandler(OMX_HANDLETYPE hnd, OMX_PTR self,
+        OMX_BUFFERHEADERTYPE* buf);
+
+    // woken by each completed command, a stale wake just looks again
+    const unsigned int cmd_timeout_ = {10000};   // usec
+    const unsigned int block_timeout_ = {2000};  // msec, then it gives up
+    bool blockOnPortChange(OMX_U32 idx, OMX_BOOL enable);
+    bool blockOnStateChange(OMX_STATETYPE state);
+
+#ifdef OUTPUT_VARIOUS_BITS_OF_INFO
+    void printDef(OMX_PARAM_PORTDEFINITIONTYPE def);
+#endif
+};
+
+} // namespace detector
+
+#endif // OMX_H
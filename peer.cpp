@@ -0,0 +1,381 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "peer.h"
+#include "tflow.h"
+#include "metrics.h"
+
+namespace detector {
+
+// all of 'len' in or out by 'limit', on a non blocking socket
+static bool peer_io(int fd, void* data, size_t len, bool out,
+    std::chrono::steady_clock::time_point limit) {
+  char* p = static_cast<char*>(data);
+  while (len != 0) {
+    ssize_t n = out ? send(fd, p, len, MSG_NOSIGNAL) : recv(fd, p, len, 0);
+    if (n > 0) {
+      p += n;
+      len -= n;
+      continue;
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+      return false;
+    }
+    int left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        limit - std::chrono::steady_clock::now()).count();
+    struct pollfd pfd = { fd, static_cast<short>(out ? POLLOUT : POLLIN), 0 };
+    if (left <= 0 || poll(&pfd, 1, left) <= 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::unique_ptr<PeerLink> PeerLink::create(const std::string& addr) {
+  auto obj = std::unique_ptr<PeerLink>(new PeerLink());
+  if (!obj->init(addr)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+PeerLink::~PeerLink() {
+  drop();
+}
+
+bool PeerLink::init(const std::string& addr) {
+  size_t colon = addr.rfind(':');
+  if (colon == std::string::npos || colon == 0 || colon + 1 == addr.size()) {
+    dbgMsg("failed: peer %s isn't host:port\n", addr.c_str());
+    return false;
+  }
+  host_ = addr.substr(0, colon);
+  port_ = addr.substr(colon + 1);
+  fd_ = -1;
+  seq_ = 0;
+  retry_at_ = {};
+  return true;
+}
+
+bool PeerLink::ready() {
+  return fd_ >= 0 || std::chrono::steady_clock::now() >= retry_at_;
+}
+
+bool PeerLink::open() {
+
+  struct addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* res = nullptr;
+  if (getaddrinfo(host_.c_str(), port_.c_str(), &hints, &res) != 0 || res == nullptr) {
+    dbgMsg("failed: peer resolve %s\n", host_.c_str());
+    return false;
+  }
+  int fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  bool ok = fd >= 0;
+  if (ok && ::connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    int err = 0;
+    socklen_t len = sizeof(err);
+    ok = errno == EINPROGRESS && poll(&pfd, 1, connect_timeout_) > 0 &&
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+  }
+  freeaddrinfo(res);
+  if (!ok) {
+    dbgMsg("failed: peer connect %s:%s\n", host_.c_str(), port_.c_str());
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return false;
+  }
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  fd_ = fd;
+  return true;
+}
+
+void PeerLink::drop() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+  retry_at_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(backoff_);
+}
+
+bool PeerLink::infer(const unsigned char* rgb, size_t len, unsigned int width,
+    unsigned int height, unsigned int channels, std::vector<float>& locs,
+    std::vector<float>& clas, std::vector<float>& scor, float& total,
+    unsigned int deadline) {
+
+  auto limit = std::chrono::steady_clock::now() + std::chrono::milliseconds(deadline);
+  if (fd_ < 0 && !open()) {
+    drop();
+    return false;
+  }
+
+  // an answer that comes late was for a connection we have dropped
+  PeerRequest req;
+  req.magic = peer_magic;
+  req.seq = ++seq_;
+  req.width = width;
+  req.height = height;
+  req.channels = channels;
+  req.pad = 0;
+  req.len = len;
+  PeerReply rep;
+  unsigned int max = std::min(clas.size(), scor.size());
+  if (!peer_io(fd_, &req, sizeof(req), true, limit) ||
+      !peer_io(fd_, const_cast<unsigned char*>(rgb), len, true, limit) ||
+      !peer_io(fd_, &rep, sizeof(rep), false, limit) ||
+      rep.magic != peer_magic || rep.seq != req.seq || !rep.ok || rep.num > max ||
+      locs.size() < max * 4) {
+    dbgMsg("peer %s:%s missed\n", host_.c_str(), port_.c_str());
+    drop();
+    return false;
+  }
+  reply_.resize(rep.num * 6);
+  if (!peer_io(fd_, reply_.data(), reply_.size() * sizeof(float), false, limit)) {
+    drop();
+    return false;
+  }
+  std::fill(locs.begin(), locs.end(), 0.f);
+  std::fill(clas.begin(), clas.end(), 0.f);
+  std::fill(scor.begin(), scor.end(), 0.f);
+  std::copy(reply_.begin(), reply_.begin() + rep.num * 4, locs.begin());
+  std::copy(reply_.begin() + rep.num * 4, reply_.begin() + rep.num * 5, clas.begin());
+  std::copy(reply_.begin() + rep.num * 5, reply_.end(), scor.begin());
+  total = std::min(rep.total, static_cast<float>(rep.num));
+  return true;
+}
+
+PeerServer::PeerServer(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+PeerServer::~PeerServer() {
+}
+
+std::unique_ptr<PeerServer> PeerServer::create(unsigned int yield_time, bool quiet,
+    Tflow* tfl, unsigned short port) {
+  auto obj = std::unique_ptr<PeerServer>(new PeerServer(yield_time));
+  obj->init(quiet, tfl, port);
+  return obj;
+}
+
+void PeerServer::metrics(Exposition& out, const std::string& labels) {
+  out.counter("detector_peer_requests_total", "peers' inputs answered", labels, served_cnt_);
+  out.counter("detector_peer_rejects_total", "peers' inputs that weren't for our model or found no room",
+      labels, reject_cnt_);
+  out.gauge("detector_peer_clients", "peers connected", labels, clients_.size());
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"serve\"", differ_serve_.hist);
+}
+
+bool PeerServer::init(bool quiet, Tflow* tfl, unsigned short port) {
+
+  quiet_ = quiet;
+  tfl_ = tfl;
+  port_ = port;
+  listen_fd_ = -1;
+  serve_on_ = false;
+  served_cnt_ = 0;
+  reject_cnt_ = 0;
+  client_cnt_ = 0;
+  return true;
+}
+
+bool PeerServer::read(PeerServer::Client& c) {
+
+  auto limit = std::chrono::steady_clock::now() + std::chrono::milliseconds(req_timeout_);
+  PeerRequest req;
+  if (!peer_io(c.fd, &req, sizeof(req), false, limit) || req.magic != peer_magic ||
+      req.len > input_max_) {
+    return false;
+  }
+  auto job = std::make_shared<PeerJob>();
+  job->rgb.resize(req.len);
+  job->width = req.width;
+  job->height = req.height;
+  job->channels = req.channels;
+  if (!peer_io(c.fd, job->rgb.data(), job->rgb.size(), false, limit)) {
+    return false;
+  }
+  c.seq = req.seq;
+  c.job = job;
+  if (!tfl_->serve(job)) {
+    reject_cnt_++;
+    job->done.post();
+  }
+  return true;
+}
+
+bool PeerServer::reply(PeerServer::Client& c) {
+
+  auto limit = std::chrono::steady_clock::now() + std::chrono::milliseconds(req_timeout_);
+  PeerJob& job = *c.job;
+  PeerReply rep;
+  rep.magic = peer_magic;
+  rep.seq = c.seq;
+  rep.ok = job.ok ? 1 : 0;
+  rep.num = job.ok ? job.clas.size() : 0;
+  rep.total = job.total;
+  std::vector<float> body;
+  if (job.ok) {
+    body.reserve(rep.num * 6);
+    body.insert(body.end(), job.locs.begin(), job.locs.end());
+    body.insert(body.end(), job.clas.begin(), job.clas.end());
+    body.insert(body.end(), job.scor.begin(), job.scor.end());
+  }
+  c.job.reset();
+  return peer_io(c.fd, &rep, sizeof(rep), true, limit) &&
+    peer_io(c.fd, body.data(), body.size() * sizeof(float), true, limit);
+}
+
+void PeerServer::drop(unsigned int i) {
+  ::close(clients_[i].fd);
+  clients_.erase(clients_.begin() + i);
+}
+
+bool PeerServer::waitingToRun() {
+
+  if (!serve_on_) {
+
+    dbgMsg("open peer port %u\n", port_);
+    listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd_ < 0) {
+      dbgMsg("failed: peer socket\n");
+      return false;
+    }
+    int on = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port_);
+    if (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(listen_fd_, client_max_) < 0) {
+      dbgMsg("failed: peer bind port %u\n", port_);
+      close(listen_fd_);
+      listen_fd_ = -1;
+      return false;
+    }
+
+    serve_on_ = true;
+  }
+
+  return true;
+}
+
+bool PeerServer::running() {
+
+  if (serve_on_) {
+
+    int fd;
+    while ((fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK)) >= 0) {
+      if (clients_.size() >= client_max_) {
+        close(fd);
+        continue;
+      }
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      PeerServer::Client c;
+      c.fd = fd;
+      c.seq = 0;
+      clients_.push_back(c);
+      client_cnt_++;
+    }
+    if (clients_.empty()) {
+      return true;
+    }
+
+    // every peer with a request gets it on our engines, then the answers
+    std::vector<struct pollfd> fds;
+    for (auto& c : clients_) {
+      fds.push_back({ c.fd, POLLIN, 0 });
+    }
+    if (poll(fds.data(), fds.size(), poll_timeout_) <= 0) {
+      return true;
+    }
+    differ_serve_.begin();
+    for (unsigned int i = fds.size(); i-- > 0; ) {
+      if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && !read(clients_[i])) {
+        drop(i);
+      }
+    }
+    for (unsigned int i = clients_.size(); i-- > 0; ) {
+      if (!clients_[i].job) {
+        continue;
+      }
+      clients_[i].job->done.wait_for(req_timeout_ * 1000);
+      if (!reply(clients_[i])) {
+        drop(i);
+        continue;
+      }
+      served_cnt_++;
+    }
+    differ_serve_.end();
+  }
+  return true;
+}
+
+bool PeerServer::paused() {
+  return true;
+}
+
+bool PeerServer::waitingToHalt() {
+
+  if (serve_on_) {
+    serve_on_ = false;
+
+    while (!clients_.empty()) {
+      drop(clients_.size() - 1);
+    }
+    close(listen_fd_);
+    listen_fd_ = -1;
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nPeer Server Results...\n");
+      fprintf(stderr, "       peers connected: %u\n", client_cnt_.load());
+      fprintf(stderr, "     requests answered: %u\n", served_cnt_.load());
+      fprintf(stderr, "     requests rejected: %u\n", reject_cnt_.load());
+      fprintf(stderr, "       serve time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_serve_.pct(.5), differ_serve_.pct(.9), differ_serve_.pct(.99), differ_serve_.pct(.999),
+          differ_serve_.high, differ_serve_.avg,
+          differ_serve_.low,  differ_serve_.cnt);
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
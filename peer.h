@@ -0,0 +1,168 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Inference offload between detectors on a lan.
+ *
+ *  A detector with --serve-peers port takes model inputs from others
+ *  and runs them on its own engines, in between its own frames.  One
+ *  with --peer host:port[,ms] sends a frame's model input there when
+ *  every local engine is busy, instead of leaving it to wait or be
+ *  dropped for a newer one.  An answer that doesn't come within 'ms'
+ *  puts the frame back at the head of the local queue, in its place, and
+ *  the peer isn't asked again for a while.  Both ends run the same model.
+ *
+ *  Over one tcp connection a request is a PeerRequest and the input's
+ *  bytes, rgb at the model's size; the answer a PeerReply and the
+ *  model's 'num' boxes as floats, locations then classes then scores.
+ *  Numbers are little endian, as on every Pi.
+ */
+
+#ifndef PEER_H
+#define PEER_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "utils.h"
+#include "base.h"
+
+namespace detector {
+
+const uint32_t peer_magic = 0x44505231;   // "DPR1"
+
+class PeerRequest {
+  public:
+    uint32_t magic;
+    uint32_t seq;
+    uint16_t width, height, channels, pad;
+    uint32_t len;             // input bytes after this
+};
+
+class PeerReply {
+  public:
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t ok;              // 0 for an input that isn't the model's
+    uint32_t num;             // boxes after this
+    float total;
+};
+
+// a model input and its results, shared by whoever waits for it and the
+// engine that runs it
+class PeerJob {
+  public:
+    std::vector<unsigned char> rgb;
+    unsigned int width, height, channels;
+    std::vector<float> locs, clas, scor;
+    float total = {0.f};
+    std::atomic<bool> ok{false};
+    Semaphore done;
+};
+
+class PeerLink {
+  public:
+    static std::unique_ptr<PeerLink> create(const std::string& addr);
+    ~PeerLink();
+
+  public:
+    // worth asking: up, or gone long enough to try again
+    bool ready();
+
+    // the model's results for 'rgb' by the deadline, sized 'locs' and
+    // the rest filled, false on a miss, which also takes the peer out
+    // for a while
+    bool infer(const unsigned char* rgb, size_t len, unsigned int width,
+        unsigned int height, unsigned int channels, std::vector<float>& locs,
+        std::vector<float>& clas, std::vector<float>& scor, float& total,
+        unsigned int deadline);
+
+  protected:
+    PeerLink() = default;
+    bool init(const std::string& addr);
+
+  private:
+    std::string host_;
+    std::string port_;
+    int fd_;
+    uint32_t seq_;
+    const unsigned int connect_timeout_ = {200};  // msec
+    const unsigned int backoff_ = {2000};         // msec
+    std::chrono::steady_clock::time_point retry_at_;
+    std::vector<float> reply_;
+    bool open();
+    void drop();
+};
+
+class Tflow;
+
+class PeerServer : public Base {
+  public:
+    static std::unique_ptr<PeerServer> create(unsigned int yield_time, bool quiet,
+        Tflow* tfl, unsigned short port);
+    virtual ~PeerServer();
+
+    // the metrics endpoint's samples
+    virtual void metrics(Exposition& out, const std::string& labels);
+
+  protected:
+    PeerServer() = delete;
+    PeerServer(unsigned int yield_time);
+    bool init(bool quiet, Tflow* tfl, unsigned short port);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    Tflow* tfl_;
+    unsigned short port_;
+
+    int listen_fd_;
+    const unsigned int client_max_ = {8};
+    const unsigned int poll_timeout_ = {10};    // msec
+    const unsigned int req_timeout_ = {500};    // msec
+    const size_t input_max_ = {4 * 1024 * 1024};
+    class Client {
+      public:
+        int fd;
+        uint32_t seq;
+        std::shared_ptr<PeerJob> job;
+    };
+    std::vector<PeerServer::Client> clients_;
+    bool read(PeerServer::Client& c);
+    bool reply(PeerServer::Client& c);
+    void drop(unsigned int i);
+
+    std::atomic<bool> serve_on_;
+    std::atomic<unsigned int> served_cnt_;
+    std::atomic<unsigned int> reject_cnt_;
+    std::atomic<unsigned int> client_cnt_;
+    MicroDiffer<uint32_t> differ_serve_;
+};
+
+} // namespace detector
+
+#endif // PEER_H
@@ -0,0 +1,191 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <string>
+
+#include "utils.h"
+#include "perf.h"
+#include "metrics.h"
+
+namespace detector {
+
+Perf::Totals Perf::totals_[static_cast<unsigned int>(Perf::Site::kNum)];
+std::atomic<bool> Perf::on_ = {false};
+
+static const char* site_names[] = {
+  "tflow copy", "prep", "eval", "encode copy", "overlay"
+};
+static const char* site_labels[] = {
+  "tflow_copy", "prep", "eval", "encode_copy", "overlay"
+};
+
+// one counter group per thread, closed when the thread goes
+class PerfGroup {
+  public:
+    PerfGroup() : tried(false), num(0) {
+      for (auto& fd : fds) {
+        fd = -1;
+      }
+    }
+    ~PerfGroup() {
+      for (auto fd : fds) {
+        if (fd >= 0) {
+          close(fd);
+        }
+      }
+    }
+
+    bool open() {
+      tried = true;
+      const uint64_t configs[Perf::kCounterNum] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_STALLED_CYCLES_BACKEND,
+      };
+      for (unsigned int i = 0; i < Perf::kCounterNum; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[i];
+        attr.disabled = (i == 0) ? 1 : 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, (i == 0) ? -1 : fds[0], 0);
+        if (fd < 0) {
+          if (i == 0) {
+            dbgMsg("failed: perf_event_open cycles (errno: %d)\n", errno);
+            return false;
+          }
+          continue;
+        }
+        fds[i] = fd;
+        slot[num++] = i;
+      }
+      ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+      return true;
+    }
+
+  public:
+    bool tried;
+    int fds[Perf::kCounterNum];
+    unsigned int num;                     // opened, in the group's read order
+    unsigned int slot[Perf::kCounterNum];
+};
+static thread_local PerfGroup group;
+
+bool Perf::start() {
+  for (auto& t : totals_) {
+    t.calls = 0;
+    for (auto& c : t.counts) {
+      c = 0;
+    }
+  }
+  on_ = true;
+  return true;
+}
+
+void Perf::stop() {
+  on_ = false;
+}
+
+bool Perf::read(uint64_t (&vals)[Perf::kCounterNum]) {
+  if (!group.tried) {
+    group.open();
+  }
+  if (group.fds[0] < 0) {
+    return false;
+  }
+  uint64_t buf[1 + Perf::kCounterNum];
+  ssize_t len = ::read(group.fds[0], buf, sizeof(uint64_t) * (1 + group.num));
+  if (len != static_cast<ssize_t>(sizeof(uint64_t) * (1 + group.num))) {
+    return false;
+  }
+  for (unsigned int i = 0; i < Perf::kCounterNum; i++) {
+    vals[i] = 0;
+  }
+  for (unsigned int i = 0; i < group.num; i++) {
+    vals[group.slot[i]] = buf[1 + i];
+  }
+  return true;
+}
+
+void Perf::add(Perf::Site site, const uint64_t (&begin)[Perf::kCounterNum]) {
+  uint64_t end[Perf::kCounterNum];
+  if (!read(end)) {
+    return;
+  }
+  auto& t = totals_[static_cast<unsigned int>(site)];
+  t.calls.fetch_add(1, std::memory_order_relaxed);
+  for (unsigned int i = 0; i < Perf::kCounterNum; i++) {
+    t.counts[i].fetch_add(end[i] - begin[i], std::memory_order_relaxed);
+  }
+}
+
+void Perf::report() {
+  fprintf(stderr, "\nPerf Results...\n");
+  fprintf(stderr, "  %-12s %8s %12s %12s %6s %6s %7s\n", "", "calls", "cycles/call",
+      "instrs/call", "ipc", "mpki", "stalled");
+  unsigned int rows = 0;
+  for (unsigned int i = 0; i < static_cast<unsigned int>(Perf::Site::kNum); i++) {
+    auto& t = totals_[i];
+    uint64_t calls = t.calls;
+    if (calls == 0) {
+      continue;
+    }
+    rows++;
+    double cyc = t.counts[Perf::kCycles];
+    double ins = t.counts[Perf::kInstructions];
+    double mis = t.counts[Perf::kCacheMisses];
+    double stl = t.counts[Perf::kStalls];
+    fprintf(stderr, "  %-12s %8llu %12.0f %12.0f %6.2f %6.1f %6.1f%%\n", site_names[i],
+        static_cast<unsigned long long>(calls), cyc / calls, ins / calls,
+        cyc > 0 ? ins / cyc : 0.0, ins > 0 ? mis * 1000.0 / ins : 0.0,
+        cyc > 0 ? stl * 100.0 / cyc : 0.0);
+  }
+  if (rows == 0) {
+    fprintf(stderr, "  nothing counted, no pmu or kernel.perf_event_paranoid too high\n");
+  }
+  fprintf(stderr, "\n");
+}
+
+void Perf::metrics(Exposition& out) {
+  const char* names[Perf::kCounterNum] = {
+    "cycles", "instructions", "cache_misses", "stall_cycles"
+  };
+  for (unsigned int i = 0; i < static_cast<unsigned int>(Perf::Site::kNum); i++) {
+    auto& t = totals_[i];
+    std::string labels = std::string("site=\"") + site_labels[i] + "\"";
+    out.counter("detector_perf_calls_total", "counted calls of the site", labels, t.calls);
+    for (unsigned int c = 0; c < Perf::kCounterNum; c++) {
+      out.counter("detector_perf_events_total", "hardware counter totals of the site",
+          labels + ",event=\"" + names[c] + "\"", t.counts[c]);
+    }
+  }
+}
+
+} // namespace detector
@@ -0,0 +1,112 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Hardware counters around the hot stages.
+ *
+ *  With --perf each thread that enters a site opens one perf_event_open
+ *  group for itself: cycles, instructions, cache misses and backend
+ *  (mostly memory) stall cycles, user space only.  A Scope reads the
+ *  group going in and coming out and adds the difference to its site.
+ *  The sites are the frame copies and the pixel work:
+ *
+ *    tflow copy, prep, eval, encode copy, overlay
+ *
+ *  Low instructions per cycle with most cycles stalled means the site
+ *  waits on memory and wants fewer copies, high means it computes and
+ *  wants better kernels.  A counter the core or kernel doesn't have
+ *  reads as 0.  Only the thread in the scope is counted, so eval leaves
+ *  out tflite's own workers with more than one thread, and on the tpu
+ *  it only counts the cpu waiting on it.
+ *
+ *  Off until 'start', and then a scope is two read() calls.
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <atomic>
+#include <cstdint>
+
+namespace detector {
+
+class Exposition;
+
+class Perf {
+  public:
+    enum class Site : uint8_t {
+      kTflowCopy = 0,
+      kPrep,
+      kEval,
+      kEncodeCopy,
+      kOverlay,
+      kNum
+    };
+    enum Counter {
+      kCycles = 0,
+      kInstructions,
+      kCacheMisses,
+      kStalls,
+      kCounterNum
+    };
+
+    static bool start();
+    static void stop();
+    static inline bool on() { return on_.load(std::memory_order_relaxed); }
+
+    // the table at exit and the metrics endpoint's samples
+    static void report();
+    static void metrics(Exposition& out);
+
+    // counts its own scope on this thread
+    class Scope {
+      public:
+        Scope(Perf::Site site) : site_(site), on_(Perf::on()) {
+          if (on_) {
+            on_ = Perf::read(begin_);
+          }
+        }
+        ~Scope() {
+          if (on_) {
+            Perf::add(site_, begin_);
+          }
+        }
+      private:
+        Perf::Site site_;
+        bool on_;
+        uint64_t begin_[Perf::kCounterNum];
+    };
+
+  private:
+    Perf() = delete;
+
+    static bool read(uint64_t (&vals)[Perf::kCounterNum]);
+    static void add(Perf::Site site, const uint64_t (&begin)[Perf::kCounterNum]);
+
+    class Totals {
+      public:
+        std::atomic<uint64_t> calls;
+        std::atomic<uint64_t> counts[Perf::kCounterNum];
+    };
+    static Perf::Totals totals_[static_cast<unsigned int>(Perf::Site::kNum)];
+    static std::atomic<bool> on_;
+};
+
+} // namespace detector
+
+#endif // PERF_H
@@ -0,0 +1,248 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <algorithm>
+
+#include "picture.h"
+#include "metrics.h"
+
+namespace detector {
+
+Picture::Picture(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Picture::~Picture() {
+}
+
+std::unique_ptr<Picture> Picture::create(unsigned int yield_time, bool quiet,
+    unsigned int refresh, unsigned int width, unsigned int height,
+    unsigned int pix_fmt) {
+  auto obj = std::unique_ptr<Picture>(new Picture(yield_time));
+  obj->init(quiet, refresh, width, height, pix_fmt);
+  return obj;
+}
+
+bool Picture::init(bool quiet, unsigned int refresh, unsigned int width,
+    unsigned int height, unsigned int pix_fmt) {
+
+  quiet_ = quiet;
+  refresh_ = refresh;
+  width_ = width;
+  height_ = height;
+  pix_fmt_ = pix_fmt;
+  if (pix_fmt_ == V4L2_PIX_FMT_YUV420) {
+    frame_len_ = ALIGN_16B(width_) * ALIGN_16B(height_) * 3 / 2;
+  } else {
+    frame_len_ = ALIGN_16B(width_) * ALIGN_16B(height_) * 3;
+  }
+
+  busy_ = false;
+  asked_ = 0;
+  made_ = 0;
+  seq_ = 0;
+
+  picture_on_ = false;
+
+  made_cnt_ = 0;
+  sent_cnt_ = 0;
+  same_cnt_ = 0;
+  none_cnt_ = 0;
+  byte_cnt_ = 0;
+
+  return true;
+}
+
+bool Picture::wanted() {
+  using namespace std::chrono;
+  auto now = steady_clock::now().time_since_epoch().count();
+  return picture_on_ && !busy_ &&
+    steady_clock::duration(now - asked_.load()) < milliseconds(idle_) &&
+    steady_clock::duration(now - made_.load()) >= milliseconds(refresh_);
+}
+
+bool Picture::addMessage(FrameBuf& frame) {
+  busy_ = true;
+  if (!frame_chan_.push(frame)) {
+    busy_ = false;
+    return false;
+  }
+  wake();
+  return true;
+}
+
+std::shared_ptr<const Picture::Image> Picture::get() {
+  using namespace std::chrono;
+  auto now = steady_clock::now().time_since_epoch().count();
+  asked_ = now;
+
+  // a poll after a quiet spell waits for the frame it just asked for
+  std::unique_lock<std::mutex> lck(lock_);
+  if (!image_ || steady_clock::duration(now - made_.load()) >= milliseconds(refresh_)) {
+    unsigned int seq = seq_;
+    fresh_.wait_for(lck, milliseconds(wait_),
+        [&]() { return seq_ != seq || !picture_on_; });
+  }
+  if (!image_) {
+    none_cnt_++;
+  }
+  return image_;
+}
+
+void Picture::served(bool modified) {
+  if (modified) {
+    sent_cnt_++;
+  } else {
+    same_cnt_++;
+  }
+}
+
+void Picture::metrics(Exposition& out, const std::string& labels) {
+  out.counter("detector_picture_made_total", "snapshot pictures encoded", labels, made_cnt_);
+  out.counter("detector_picture_sent_total", "snapshot pictures sent", labels, sent_cnt_);
+  out.counter("detector_picture_not_modified_total", "snapshot polls answered 304",
+      labels, same_cnt_);
+  out.summary("detector_latency_us", "stage latency percentiles",
+      labels + ",step=\"jpeg\"", differ_jpeg_.hist);
+}
+
+bool Picture::encode(const unsigned char* data, unsigned int len,
+    std::vector<unsigned char>& pic) {
+
+  differ_jpeg_.begin();
+  Codec::Input in;
+  while (jpeg_->doneInput(in)) {
+  }
+  if (!jpeg_->getInput(in)) {
+    dbgMsg("no jpeg input buffer\n");
+    return false;
+  }
+  std::memcpy(in.addr, data, std::min(len, in.length));
+  if (!jpeg_->encode(in, len)) {
+    return false;
+  }
+
+  auto limit = std::chrono::steady_clock::now() + std::chrono::milliseconds(jpeg_timeout_);
+  Codec::Output out;
+  while (!jpeg_->getOutput(out)) {
+    if (std::chrono::steady_clock::now() > limit) {
+      dbgMsg("failed: jpeg timeout\n");
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(yield_time_));
+  }
+  differ_jpeg_.end();
+  pic.assign(out.data, out.data + out.length);
+  jpeg_->putOutput(out);
+  return !pic.empty();
+}
+
+bool Picture::waitingToRun() {
+
+  if (!picture_on_) {
+
+    dbgMsg("open picture jpeg encoder\n");
+    jpeg_ = M2m::create(this, yield_time_, device_, V4L2_PIX_FMT_JPEG);
+    if (!jpeg_->open(width_, height_, 1, pix_fmt_, 0) || !jpeg_->setQuality(quality_)) {
+      dbgMsg("failed: open picture jpeg encoder\n");
+      return false;
+    }
+
+    picture_on_ = true;
+  }
+  return true;
+}
+
+bool Picture::running() {
+
+  if (picture_on_) {
+
+    FrameBuf frame;
+    if (!frame_chan_.pop(frame)) {
+      return true;
+    }
+
+    // named by the wall clock as well so a restart can't repeat a tag
+    auto img = std::make_shared<Picture::Image>();
+    bool ok = encode(frame.addr, frame_len_, img->data);
+    frame.ref.reset();
+    frame.addr = nullptr;
+    if (ok) {
+      auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count();
+      std::unique_lock<std::mutex> lck(lock_);
+      img->etag = "\"" + std::to_string(ms) + "-" + std::to_string(seq_ + 1) + "\"";
+      byte_cnt_ += img->data.size();
+      image_ = img;
+      seq_++;
+      made_cnt_++;
+    }
+    made_ = std::chrono::steady_clock::now().time_since_epoch().count();
+    fresh_.notify_all();
+    busy_ = false;
+  }
+  return true;
+}
+
+bool Picture::paused() {
+  return true;
+}
+
+bool Picture::waitingToHalt() {
+
+  if (picture_on_) {
+    {
+      std::unique_lock<std::mutex> lck(lock_);
+      picture_on_ = false;
+    }
+    fresh_.notify_all();
+
+    FrameBuf frame;
+    while (frame_chan_.pop(frame)) {
+    }
+    frame.ref.reset();
+    busy_ = false;
+
+    jpeg_->close();
+    jpeg_.reset();
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nPicture Results...\n");
+      fprintf(stderr, "  jpeg time    (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_jpeg_.pct(.5), differ_jpeg_.pct(.9), differ_jpeg_.pct(.99), differ_jpeg_.pct(.999),
+          differ_jpeg_.high, differ_jpeg_.avg,
+          differ_jpeg_.low, differ_jpeg_.cnt);
+      fprintf(stderr, "       pictures: %u\n", made_cnt_);
+      fprintf(stderr, "           sent: %u\n", sent_cnt_.load());
+      fprintf(stderr, "   not modified: %u\n", same_cnt_.load());
+      fprintf(stderr, "    none at all: %u\n", none_cnt_.load());
+      fprintf(stderr, "  bytes encoded: %llu\n",
+          static_cast<unsigned long long>(byte_cnt_));
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
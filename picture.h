@@ -0,0 +1,134 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  The latest frame as a JPEG, for dashboards that poll a still.
+ *
+ *  With --picture msec the metrics server also answers 'GET
+ *  /snapshot.jpg'.  A poll marks the picture wanted and the encoder then
+ *  hands over its next frame, boxes and all, which this thread turns into
+ *  a JPEG with the hardware encoder.  A picture is made at most every
+ *  'msec' and only while polls keep coming, so no one asking costs
+ *  nothing.  Polls share the one refcounted image and it goes out from
+ *  there with the header, and a poll that sends back the picture's ETag
+ *  in If-None-Match gets a 304 until there is a newer one.
+ */
+
+#ifndef PICTURE_H
+#define PICTURE_H
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <chrono>
+
+#include "utils.h"
+#include "listener.h"
+#include "channel.h"
+#include "base.h"
+#include "m2m.h"
+
+namespace detector {
+
+class Picture : public Base {
+  public:
+    static std::unique_ptr<Picture> create(unsigned int yield_time, bool quiet,
+        unsigned int refresh, unsigned int width, unsigned int height,
+        unsigned int pix_fmt);
+    virtual ~Picture();
+
+  public:
+    class Image {
+      public:
+        std::vector<unsigned char> data;
+        std::string etag;
+    };
+
+    // the encoder copies its next frame over while this is true
+    bool wanted();
+
+    // a frame of ours, taken from the pipeline's pool
+    bool addMessage(FrameBuf& frame);
+
+    // the newest picture, waiting a little for a fresh one if it is older
+    // than 'refresh', nullptr if there has never been one
+    std::shared_ptr<const Picture::Image> get();
+
+    // what the http server did with it
+    void served(bool modified);
+
+    // the metrics endpoint's samples
+    virtual void metrics(Exposition& out, const std::string& labels);
+
+  protected:
+    Picture() = delete;
+    Picture(unsigned int yield_time);
+    bool init(bool quiet, unsigned int refresh, unsigned int width,
+        unsigned int height, unsigned int pix_fmt);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    unsigned int refresh_;    // msec
+    unsigned int width_;
+    unsigned int height_;
+    unsigned int pix_fmt_;
+    unsigned int frame_len_;
+
+    Channel<FrameBuf> frame_chan_{1, Channel<FrameBuf>::Policy::kDropNewest};
+    std::atomic<bool> busy_;
+
+    // polls keep pictures coming for 'idle' after the last one
+    const unsigned int idle_ = {5000};   // msec
+    const unsigned int wait_ = {500};    // msec
+    std::atomic<int64_t> asked_;
+    std::atomic<int64_t> made_;
+
+    std::mutex lock_;
+    std::condition_variable fresh_;
+    std::shared_ptr<const Picture::Image> image_;
+    unsigned int seq_;
+
+    const char* device_ = {"/dev/video31"};
+    const unsigned int quality_ = {80};
+    const unsigned int jpeg_timeout_ = {1000};   // msec
+    std::unique_ptr<M2m> jpeg_;
+    bool encode(const unsigned char* data, unsigned int len,
+        std::vector<unsigned char>& out);
+
+    std::atomic<bool> picture_on_;
+
+    unsigned int made_cnt_;
+    std::atomic<unsigned int> sent_cnt_;
+    std::atomic<unsigned int> same_cnt_;
+    std::atomic<unsigned int> none_cnt_;
+    uint64_t byte_cnt_;
+    MicroDiffer<uint32_t> differ_jpeg_;
+};
+
+} // namespace detector
+
+#endif // PICTURE_H
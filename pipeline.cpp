@@ -0,0 +1,358 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <algorithm>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include <chrono>
+#include <thread>
+
+#include "pipeline.h"
+#include "metrics.h"
+
+namespace detector {
+
+Pipeline::Pipeline()
+  : quiet_(true),
+    started_(false) {
+}
+
+Pipeline::~Pipeline() {
+  stop();
+}
+
+std::unique_ptr<Pipeline> Pipeline::create(bool quiet) {
+  auto obj = std::unique_ptr<Pipeline>(new Pipeline());
+  obj->init(quiet);
+  return obj;
+}
+
+bool Pipeline::init(bool quiet) {
+  quiet_ = quiet;
+  return true;
+}
+
+int Pipeline::find(const char* name) {
+  for (unsigned int i = 0; i < stages_.size(); i++) {
+    if (stages_[i].name == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool Pipeline::connect(const char* from, const char* to) {
+
+  // a stage that wasn't asked for is fine, there's just no edge
+  int src = find(from);
+  int dst = find(to);
+  if (src < 0 || dst < 0) {
+    return false;
+  }
+  auto& edges = stages_[src].to;
+  if (std::find(edges.begin(), edges.end(), dst) == edges.end()) {
+    edges.push_back(dst);
+  }
+  return true;
+}
+
+bool Pipeline::schedule(const std::string& spec) {
+
+  if (started_) {
+    return false;
+  }
+  std::istringstream iss(spec);
+  std::string item;
+  while (std::getline(iss, item, ',')) {
+
+    // name=policy[:priority][@cpus]
+    size_t eq = item.find('=');
+    int idx = (eq == std::string::npos) ? -1 : find(item.substr(0, eq).c_str());
+    if (idx < 0) {
+      dbgMsg("failed: no stage for %s\n", item.c_str());
+      return false;
+    }
+    auto& st = stages_[idx];
+    std::string rest = item.substr(eq + 1);
+    std::string cpus;
+    size_t at = rest.find('@');
+    if (at != std::string::npos) {
+      cpus = rest.substr(at + 1);
+      rest = rest.substr(0, at);
+    }
+    std::string policy = rest;
+    size_t colon = rest.find(':');
+    if (colon != std::string::npos) {
+      policy = rest.substr(0, colon);
+    }
+    if (policy == "fifo") {
+      st.policy = Base::Policy::kFifo;
+    } else if (policy == "rr") {
+      st.policy = Base::Policy::kRr;
+    } else if (policy == "other") {
+      st.policy = Base::Policy::kOther;
+      st.priority = 0;
+    } else {
+      dbgMsg("failed: policy %s\n", policy.c_str());
+      return false;
+    }
+    if (colon != std::string::npos) {
+      st.priority = std::atoi(rest.substr(colon + 1).c_str());
+    }
+
+    if (!parse_cpus(cpus, st.cpus)) {
+      dbgMsg("failed: cpus %s\n", cpus.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Pipeline::sort() {
+
+  // kahn's, ties go in the order the stages were added
+  std::vector<unsigned int> in(stages_.size(), 0);
+  for (auto& st : stages_) {
+    for (int dst : st.to) {
+      in[dst]++;
+    }
+  }
+  order_.clear();
+  std::vector<bool> done(stages_.size(), false);
+  while (order_.size() < stages_.size()) {
+    int next = -1;
+    for (unsigned int i = 0; i < stages_.size(); i++) {
+      if (!done[i] && in[i] == 0) {
+        next = i;
+        break;
+      }
+    }
+    if (next < 0) {
+      dbgMsg("failed: pipeline has a loop\n");
+      order_.clear();
+      return false;
+    }
+    done[next] = true;
+    order_.push_back(next);
+    for (int dst : stages_[next].to) {
+      in[dst]--;
+    }
+  }
+  return true;
+}
+
+bool Pipeline::start() {
+
+  if (!sort()) {
+    return false;
+  }
+
+  // downstream first
+  bool res = true;
+  std::string refused;
+  for (auto it = order_.rbegin(); it != order_.rend(); ++it) {
+    auto& st = stages_[*it];
+    st.obj->setPolicy(st.policy, st.priority);
+    st.obj->setAffinity(st.cpus);
+    if (!st.obj->start(st.name.c_str(), st.priority)) {
+      dbgMsg("failed: start %s\n", st.name.c_str());
+      res = false;
+    }
+    if (!st.obj->schedOk()) {
+      refused += " " + st.name;
+    }
+  }
+  started_ = true;
+
+  // usually not root, the stages still run but on default scheduling
+  if (!quiet_ && !refused.empty()) {
+    fprintf(stderr, "scheduling not applied to:%s\n", refused.c_str());
+  }
+  return res;
+}
+
+bool Pipeline::run() {
+
+  // every stage opens its devices at once, the slowest sets the pace.
+  // anything sent to a stage still opening waits in its queue.
+  unsigned int begin = since_start_ms();
+  bool res = true;
+  for (auto it = order_.rbegin(); it != order_.rend(); ++it) {
+    auto& st = stages_[*it];
+    if (!st.obj->run(false)) {
+      dbgMsg("failed: run %s\n", st.name.c_str());
+      res = false;
+    }
+  }
+  for (auto it = order_.rbegin(); it != order_.rend(); ++it) {
+    auto& st = stages_[*it];
+    if (!st.obj->wait(Base::State::kRunning)) {
+      dbgMsg("failed: run %s\n", st.name.c_str());
+      res = false;
+    }
+  }
+
+  if (!quiet_) {
+    fprintf(stderr, "running in %u ms (%u ms from start)\n",
+        since_start_ms() - begin, since_start_ms());
+    footprint();
+  }
+  return res;
+}
+
+static size_t rssBytes() {
+  FILE* fd = fopen("/proc/self/status", "r");
+  if (!fd) {
+    return 0;
+  }
+  char line[128];
+  size_t kb = 0;
+  while (fgets(line, sizeof(line), fd)) {
+    if (sscanf(line, "VmRSS: %zu kB", &kb) == 1) {
+      break;
+    }
+  }
+  fclose(fd);
+  return kb * 1024;
+}
+
+void Pipeline::footprint() {
+  size_t total = 0;
+  fprintf(stderr, "\nbuffers held:\n");
+  for (auto& st : stages_) {
+    Footprint fp;
+    st.obj->footprint(fp);
+    for (auto& p : fp.pools) {
+      fprintf(stderr, "  %-5s %-16s %5zu x %9.1f KB = %8.2f MB\n", st.name.c_str(),
+          p.name.c_str(), p.num, p.num ? p.bytes / 1024.0 / p.num : 0.0,
+          p.bytes / 1048576.0);
+    }
+    total += fp.total();
+  }
+  fprintf(stderr, "  total %.2f MB, rss %.2f MB\n\n", total / 1048576.0,
+      rssBytes() / 1048576.0);
+}
+
+unsigned int Pipeline::recover() {
+
+  // downstream first, like start
+  unsigned int cnt = 0;
+  if (!started_) {
+    return cnt;
+  }
+  for (auto it = order_.rbegin(); it != order_.rend(); ++it) {
+    auto& st = stages_[*it];
+    if (!st.obj->failed()) {
+      continue;
+    }
+    bool ok = st.obj->start(st.name.c_str(), st.priority) && st.obj->run();
+    if (!quiet_) {
+      fprintf(stderr, "\n%s failed, %s\n", st.name.c_str(), 
+          ok ? "restarted" : "restart failed");
+    }
+    cnt++;
+  }
+  return cnt;
+}
+
+std::string Pipeline::stalled(unsigned int msec) {
+  std::string names;
+  if (!started_) {
+    return names;
+  }
+  for (auto& st : stages_) {
+    if (st.obj->sinceBeat() > msec) {
+      names += names.empty() ? st.name : " " + st.name;
+    }
+  }
+  return names;
+}
+
+void Pipeline::setSleep(unsigned int usec, const char* keep) {
+  for (auto& st : stages_) {
+    if (st.name.compare(0, 3, "cap") == 0 || st.name == keep) {
+      continue;
+    }
+    if (usec) {
+      if (!st.own_sleep) {
+        st.own_sleep = st.obj->getSleepTime();
+      }
+      st.obj->setSleepTime(std::max(st.own_sleep, usec));
+    } else if (st.own_sleep) {
+      st.obj->setSleepTime(st.own_sleep);
+      st.own_sleep = 0;
+    }
+  }
+}
+
+void Pipeline::metrics(Exposition& out) {
+  for (auto& st : stages_) {
+    std::string labels = "stage=\"" + st.name + "\"";
+    bool up = started_ && st.obj->getState() == Base::State::kRunning;
+    out.gauge("detector_stage_up", "stage is running", labels, up ? 1 : 0);
+    out.gauge("detector_stage_failed", "stage gave up and stopped", labels,
+        st.obj->failed() ? 1 : 0);
+    out.gauge("detector_stage_heartbeat_ms", "msec since the stage loop went round",
+        labels, st.obj->sinceBeat());
+    st.obj->metrics(out, labels);
+
+    Footprint fp;
+    st.obj->footprint(fp);
+    for (auto& p : fp.pools) {
+      std::string lbl = labels + ",pool=\"" + p.name + "\"";
+      out.gauge("detector_memory_bytes", "bytes in the stage's own buffers", lbl, p.bytes);
+      out.gauge("detector_memory_buffers", "buffers in the pool", lbl, p.num);
+    }
+  }
+  out.gauge("detector_memory_rss_bytes", "process resident set", "", rssBytes());
+}
+
+bool Pipeline::stop(unsigned int drain) {
+
+  // upstream first, and nothing goes until everything has stopped.  the
+  // drain is one deadline for the lot, whatever is left then is dropped
+  bool res = true;
+  if (started_) {
+    auto limit = std::chrono::steady_clock::now() + std::chrono::milliseconds(drain);
+    unsigned int left = 0;
+    for (int idx : order_) {
+      auto& st = stages_[idx];
+      while (st.obj->pending() != 0 && std::chrono::steady_clock::now() < limit) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      left += st.obj->pending();
+      if (!st.obj->stop()) {
+        dbgMsg("failed: stop %s\n", st.name.c_str());
+        res = false;
+      }
+    }
+    started_ = false;
+    if (!quiet_ && drain && left) {
+      fprintf(stderr, "drain: %u frames dropped after %u ms\n", left, drain);
+    }
+  }
+  for (int idx : order_) {
+    stages_[idx].obj.reset();
+  }
+  stages_.clear();
+  order_.clear();
+  return res;
+}
+
+} // namespace detector
@@ -0,0 +1,134 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Pipeline graph.
+ *
+ *  Owns every stage and the edges between them.  A stage is added with
+ *  its thread name and priority and handed back for wiring, then
+ *  'connect' records that one stage's output goes to another.  Stages
+ *  start and run downstream first, so nothing is handed a message before
+ *  whoever takes it is up, and stop upstream first, so nothing is left
+ *  pushing into a stopped stage.  Any shape will do as long as it has no
+ *  loops: several capturers into one tflow, one encoder to many sinks.
+ *  Control that flows back up (bitrate, key frames) isn't an edge.
+ *
+ *  'schedule' takes a policy, priority and cpus per stage, e.g.
+ *  "cap=fifo:90@0,enc=rr:50@1,tfl=other:5@2-3".  Policy is fifo, rr or
+ *  other (priority is then a nice value), cpus are a list like 2-3 or 0+2.
+ *  Stages left out keep round robin at their own priority on any cpu.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <atomic>
+
+#include "utils.h"
+#include "base.h"
+
+namespace detector {
+
+class Pipeline {
+  public:
+    static std::unique_ptr<Pipeline> create(bool quiet);
+    ~Pipeline();
+
+  public:
+    // takes the stage and hands it back for wiring, null if it can't
+    template<typename T>
+    T* add(const char* name, int priority, std::unique_ptr<T> stage) {
+      if (!stage || find(name) >= 0) {
+        dbgMsg("failed: add stage %s\n", name);
+        return nullptr;
+      }
+      T* obj = stage.get();
+      Pipeline::Stage st;
+      st.name = name;
+      st.priority = priority;
+      st.policy = Base::Policy::kRr;
+      st.obj = std::shared_ptr<T>(std::move(stage));
+      stages_.push_back(std::move(st));
+      return obj;
+    }
+
+    template<typename T>
+    T* get(const char* name) {
+      int idx = find(name);
+      return (idx < 0) ? nullptr : dynamic_cast<T*>(stages_[idx].obj.get());
+    }
+
+    // 'from' hands its output to 'to'
+    bool connect(const char* from, const char* to);
+
+    // before start, see above
+    bool schedule(const std::string& spec);
+
+    bool start();
+    bool run();
+    // and destroys the stages.  with 'drain' msec each stage, once the ones
+    // in front of it have stopped, first gets to finish what it still has
+    bool stop(unsigned int drain = 0);
+
+    // start and run again any stage that failed, returns how many
+    unsigned int recover();
+
+    // stages whose loop hasn't gone round for 'msec', space separated
+    std::string stalled(unsigned int msec);
+
+    // every stage but the capturers and 'keep' sleeps at least 'usec'
+    // between loops with no work, 0 puts their own times back
+    void setSleep(unsigned int usec, const char* keep);
+
+    // every stage's state and its own metrics
+    void metrics(Exposition& out);
+
+    // the buffers each stage holds, and the process rss
+    void footprint();
+
+  protected:
+    Pipeline();
+    bool init(bool quiet);
+
+  private:
+    bool quiet_;
+
+    class Stage {
+      public:
+        std::string name;
+        int priority;
+        Base::Policy policy;
+        std::vector<unsigned int> cpus;
+        std::shared_ptr<Base> obj;    // keeps the stage's own deleter
+        std::vector<int> to;
+        unsigned int own_sleep = 0;   // while setSleep has it
+    };
+    std::vector<Pipeline::Stage> stages_;
+    std::vector<int> order_;          // upstream first
+    std::atomic<bool> started_;
+
+    int find(const char* name);
+    bool sort();
+};
+
+} // namespace detector
+
+#endif // PIPELINE_H
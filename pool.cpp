@@ -0,0 +1,199 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+
+#include "pool.h"
+#include "deadline.h"
+
+namespace detector {
+
+std::vector<std::unique_ptr<Pool::Worker>> Pool::workers_;
+std::atomic<bool> Pool::on_(false);
+std::atomic<unsigned int> Pool::next_(0);
+thread_local int64_t Pool::due_ = INT64_MAX;
+
+Pool::Due::Due(std::chrono::steady_clock::time_point deadline) : prev_(due_) {
+  due_ = Deadline::order(deadline);
+}
+
+Pool::Due::~Due() {
+  due_ = prev_;
+}
+
+bool Pool::start(unsigned int workers, const std::vector<unsigned int>& cpus) {
+
+  if (on_ || workers == 0) {
+    return !on_;
+  }
+  on_ = true;
+  for (unsigned int i = 0; i < workers; i++) {
+    workers_.push_back(std::make_unique<Pool::Worker>());
+  }
+  for (unsigned int i = 0; i < workers; i++) {
+    int cpu = cpus.empty() ? -1 : static_cast<int>(cpus[i % cpus.size()]);
+    workers_[i]->thread = std::thread(workerProc, i, cpu);
+  }
+  return true;
+}
+
+void Pool::stop() {
+
+  if (!on_) {
+    return;
+  }
+  on_ = false;
+  for (auto& w : workers_) {
+    w->work.post();
+  }
+  for (auto& w : workers_) {
+    w->thread.join();
+  }
+  workers_.clear();
+}
+
+unsigned int Pool::workers() {
+  return on_ ? workers_.size() : 0;
+}
+
+// the piece due first, of those due together the newest or the oldest
+bool Pool::earliest(std::deque<Pool::Piece>& queue, bool newest, Pool::Piece& piece) {
+  if (queue.empty()) {
+    return false;
+  }
+  size_t best = newest ? queue.size() - 1 : 0;
+  for (size_t i = 0; i < queue.size(); i++) {
+    size_t k = newest ? queue.size() - 1 - i : i;
+    if (queue[k].batch->order < queue[best].batch->order) {
+      best = k;
+    }
+  }
+  piece = queue[best];
+  queue.erase(queue.begin() + best);
+  return true;
+}
+
+bool Pool::take(unsigned int self, Pool::Piece& piece) {
+
+  // the first due of our own, the newest of those is most likely in cache
+  unsigned int num = workers_.size();
+  if (self < num) {
+    auto& w = *workers_[self];
+    std::lock_guard<std::mutex> lck(w.lock);
+    if (earliest(w.queue, true, piece)) {
+      return true;
+    }
+  }
+
+  // then the first due of someone else's, the oldest of those
+  for (unsigned int i = 1; i <= num; i++) {
+    auto& w = *workers_[(self + i) % num];
+    std::lock_guard<std::mutex> lck(w.lock);
+    if (earliest(w.queue, false, piece)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Pool::runPiece(Pool::Piece& piece) {
+  // the caller may return and drop the batch the moment 'left' hits 0,
+  // the wake only needs the word's address
+  auto left = &piece.batch->left;
+  (*piece.batch->fn)(piece.begin, piece.end);
+  if (left->fetch_sub(1) == (kSleeping | 1)) {
+    futex_wake(*left, 1);
+  }
+}
+
+void Pool::workerProc(unsigned int self, int cpu) {
+
+  if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+      dbgMsg("failed: pin pool worker %u to cpu %d\n", self, cpu);
+    }
+  }
+  char name[16];
+  snprintf(name, sizeof(name), "pool%u", self);
+  pthread_setname_np(pthread_self(), name);
+
+  Pool::Piece piece;
+  while (on_) {
+    while (take(self, piece)) {
+      runPiece(piece);
+    }
+    workers_[self]->work.wait_for(100000);
+  }
+}
+
+void Pool::stripes(unsigned int rows, unsigned int grain,
+    const std::function<void(unsigned int, unsigned int)>& fn) {
+
+  // a couple of pieces per thread evens out uneven rows
+  unsigned int num = workers();
+  grain = std::max(grain, 1u);
+  unsigned int pieces = std::min((num + 1) * 2, (rows + grain - 1) / grain);
+  if (num == 0 || pieces < 2) {
+    fn(0, rows);
+    return;
+  }
+
+  unsigned int step = (rows + pieces - 1) / pieces;
+  pieces = (rows + step - 1) / step;
+
+  Pool::Batch batch;
+  batch.fn = &fn;
+  batch.left = pieces;
+  batch.order = due_;
+
+  // deal them out starting somewhere new each time
+  unsigned int first = next_++;
+  for (unsigned int i = 0; i < pieces; i++) {
+    auto& w = *workers_[(first + i) % num];
+    {
+      std::lock_guard<std::mutex> lck(w.lock);
+      w.queue.push_back({ &batch, i * step, std::min((i + 1) * step, rows) });
+    }
+    w.work.post();
+  }
+
+  // help out until it's all taken, then wait for whoever has the last
+  // piece on 'left' itself, nothing looks at the batch after it hits 0
+  Pool::Piece piece;
+  while (batch.left.load() != 0 && take(num, piece)) {
+    runPiece(piece);
+  }
+  int left = batch.left.load();
+  while ((left & ~kSleeping) != 0) {
+    if (!(left & kSleeping)) {
+      if (!batch.left.compare_exchange_weak(left, left | kSleeping)) {
+        continue;
+      }
+      left |= kSleeping;
+    }
+    futex_wait(batch.left, left, 0);
+    left = batch.left.load();
+  }
+}
+
+} // namespace detector
@@ -0,0 +1,110 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Shared worker pool.
+ *
+ *  One small set of pinned workers that every stage can hand row stripes
+ *  to, instead of each stage growing its own threads.  'stripes' cuts
+ *  the rows into pieces and deals them out to the workers' queues.  A
+ *  worker takes from the back of its own queue and steals from the front
+ *  of the others when it runs dry, and the caller works through pieces
+ *  too until its batch is done, so a pool busy with another stage's work
+ *  never leaves the caller just waiting.  With no workers started every
+ *  call runs inline on the caller, as if there were no pool.
+ *
+ *  A stage working on a frame with a deadline (see deadline.h) says so
+ *  with a 'Due' around the work, and the pieces of its stripes are taken
+ *  ahead of those of a frame due later or of work with no deadline.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <chrono>
+
+#include "utils.h"
+
+namespace detector {
+
+class Pool {
+  public:
+    // 'cpus' are dealt to the workers in turn, empty leaves them unpinned
+    static bool start(unsigned int workers, const std::vector<unsigned int>& cpus);
+    static void stop();
+    static unsigned int workers();
+
+    // calls fn(begin, end) over [0, rows), at least 'grain' rows at a time
+    static void stripes(unsigned int rows, unsigned int grain,
+        const std::function<void(unsigned int, unsigned int)>& fn);
+
+    // the stripes this thread hands out while it lives are due by 'deadline'
+    class Due {
+      public:
+        Due(std::chrono::steady_clock::time_point deadline);
+        ~Due();
+      private:
+        int64_t prev_;
+    };
+
+  private:
+    Pool() = delete;
+
+    class Batch {
+      public:
+        const std::function<void(unsigned int, unsigned int)>* fn;
+        // pieces not yet run, and kSleeping once the caller waits on it as
+        // a futex, so the last piece's decrement is its last touch
+        std::atomic<int> left;
+        int64_t order;            // see Deadline::order
+    };
+    static const int kSleeping = 1 << 30;
+    class Piece {
+      public:
+        Pool::Batch* batch;
+        unsigned int begin;
+        unsigned int end;
+    };
+    class Worker {
+      public:
+        std::mutex lock;
+        std::deque<Pool::Piece> queue;
+        Semaphore work;
+        std::thread thread;
+    };
+    static std::vector<std::unique_ptr<Pool::Worker>> workers_;
+    static std::atomic<bool> on_;
+    static std::atomic<unsigned int> next_;
+
+    static thread_local int64_t due_;
+    static bool take(unsigned int self, Pool::Piece& piece);
+    static bool earliest(std::deque<Pool::Piece>& queue, bool newest, Pool::Piece& piece);
+    static void runPiece(Pool::Piece& piece);
+    static void workerProc(unsigned int self, int cpu);
+};
+
+} // namespace detector
+
+#endif // POOL_H
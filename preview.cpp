@@ -0,0 +1,469 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <algorithm>
+
+#include "preview.h"
+#include "metrics.h"
+#include "frames.h"
+#include "loop.h"
+
+namespace detector {
+
+Preview::Preview(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Preview::~Preview() {
+}
+
+std::unique_ptr<Preview> Preview::create(unsigned int yield_time, bool quiet,
+    const std::string& spec, unsigned int width, unsigned int height,
+    unsigned int pix_fmt) {
+  auto obj = std::unique_ptr<Preview>(new Preview(yield_time));
+  if (!obj->init(quiet, spec, width, height, pix_fmt)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Preview::init(bool quiet, const std::string& spec, unsigned int width,
+    unsigned int height, unsigned int pix_fmt) {
+
+  quiet_ = quiet;
+
+  // port[,fps]
+  unsigned int port = 0;
+  fps_ = 2;
+  int num = sscanf(spec.c_str(), "%u,%u", &port, &fps_);
+  if (num < 1 || port == 0 || port > 65535 || fps_ == 0) {
+    dbgMsg("failed: preview spec %s\n", spec.c_str());
+    return false;
+  }
+  port_ = port;
+
+  // the level's size, see pyramid.cpp
+  width_ = width >> level_;
+  height_ = height >> level_;
+  pix_fmt_ = pix_fmt;
+  if (pix_fmt_ != V4L2_PIX_FMT_YUV420 && pix_fmt_ != V4L2_PIX_FMT_RGB24) {
+    dbgMsg("failed: preview needs i420 or rgb24\n");
+    return false;
+  }
+
+  busy_ = false;
+  last_ = 0;
+  watching_ = 0;
+  listen_fd_ = -1;
+
+  preview_on_ = false;
+
+  pic_cnt_ = 0;
+  skip_cnt_ = 0;
+  turned_away_cnt_ = 0;
+  byte_cnt_ = 0;
+
+  if (!useLoop()) {
+    dbgMsg("failed: preview loop\n");
+    return false;
+  }
+
+  return true;
+}
+
+bool Preview::wanted() {
+  using namespace std::chrono;
+  auto now = steady_clock::now().time_since_epoch().count();
+  return preview_on_ && watching_ != 0 && !busy_ &&
+    steady_clock::duration(now - last_.load()) >= milliseconds(1000 / fps_);
+}
+
+bool Preview::addMessage(std::shared_ptr<Levels>& levels,
+    std::shared_ptr<std::vector<BoxBuf>>& boxes) {
+
+  Preview::Shot shot;
+  shot.levels = levels;
+  shot.boxes = boxes;
+  busy_ = true;
+  last_ = std::chrono::steady_clock::now().time_since_epoch().count();
+  if (!shot_chan_.push(shot)) {
+    busy_ = false;
+    return false;
+  }
+  wake();
+  return true;
+}
+
+void Preview::metrics(Exposition& out, const std::string& labels) {
+  out.gauge("detector_preview_watchers", "mjpeg preview watchers", labels, watching_);
+  out.counter("detector_preview_pictures_total", "mjpeg preview pictures encoded",
+      labels, pic_cnt_);
+  out.counter("detector_preview_skipped_total", "mjpeg preview pictures a busy watcher missed",
+      labels, skip_cnt_);
+  out.counter("detector_preview_bytes_total", "mjpeg preview bytes sent", labels, byte_cnt_);
+  out.summary("detector_latency_us", "stage latency percentiles",
+      labels + ",step=\"jpeg\"", differ_jpeg_.hist);
+}
+
+bool Preview::encode(Preview::Shot& shot, std::vector<unsigned char>& pic) {
+
+  const Level* lvl = shot.levels->get(level_);
+  if (!lvl || lvl->width != width_ || lvl->height != height_) {
+    return false;
+  }
+
+  differ_jpeg_.begin();
+  Codec::Input in;
+  while (jpeg_->doneInput(in)) {
+  }
+  if (!jpeg_->getInput(in)) {
+    dbgMsg("no jpeg input buffer\n");
+    return false;
+  }
+  Shape shape(width_, height_, pix_fmt_);
+  unsigned int len = shape.length();
+  std::memcpy(in.addr, lvl->addr, std::min(len, in.length));
+  shot.levels.reset();
+
+  // the outlines go on the encoder's copy, the level is shared
+  draw_list_.clear();
+  for (auto& box : *shot.boxes) {
+    unsigned char c[3] = { 128, 128, 128 };
+    if (box.type == BoxBuf::Type::kPerson) {
+      c[0] = 255; c[1] = 0; c[2] = 0;
+    } else if (box.type == BoxBuf::Type::kPet) {
+      c[0] = 0; c[1] = 255; c[2] = 0;
+    } else if (box.type == BoxBuf::Type::kVehicle) {
+      c[0] = 0; c[1] = 0; c[2] = 255;
+    }
+    DrawBox draw = { { box.x >> level_, box.y >> level_, box.w >> level_, box.h >> level_ },
+      { c[0], c[1], c[2] } };
+    if (pix_fmt_ == V4L2_PIX_FMT_YUV420) {
+      convert_rgb_to_yuv(c[0], c[1], c[2], draw.c[0], draw.c[1], draw.c[2]);
+    }
+    draw_list_.push_back(draw);
+  }
+  Planes p(in.addr, shape);
+  if (p.yuv) {
+    drawYUVBoxes(thickness_, p.y, p.stride, p.u, p.uv_stride, p.v, p.uv_stride,
+        width_, height_, draw_list_.data(), draw_list_.size());
+  } else {
+    drawRGBBoxes(thickness_, p.y, p.stride, width_, height_,
+        draw_list_.data(), draw_list_.size());
+  }
+  if (!jpeg_->encode(in, len)) {
+    return false;
+  }
+
+  auto limit = std::chrono::steady_clock::now() + std::chrono::milliseconds(jpeg_timeout_);
+  Codec::Output out;
+  while (!jpeg_->getOutput(out)) {
+    if (std::chrono::steady_clock::now() > limit) {
+      dbgMsg("failed: jpeg timeout\n");
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(yield_time_));
+  }
+  differ_jpeg_.end();
+  pic.assign(out.data, out.data + out.length);
+  jpeg_->putOutput(out);
+  return !pic.empty();
+}
+
+bool Preview::request(Preview::Client& cl) {
+
+  size_t end = cl.req.find("\r\n\r\n");
+  if (end == std::string::npos) {
+    return cl.req.size() < req_max_;
+  }
+  std::string line = cl.req.substr(0, cl.req.find("\r\n"));
+  cl.req.clear();
+
+  size_t sp1 = line.find(' ');
+  size_t sp2 = (sp1 == std::string::npos) ? sp1 : line.find(' ', sp1 + 1);
+  if (sp2 == std::string::npos) {
+    return false;
+  }
+  std::string method = line.substr(0, sp1);
+  std::string path = line.substr(sp1 + 1, sp2 - sp1 - 1);
+  path = path.substr(0, path.find('?'));
+
+  cl.head_off = 0;
+  if (method != "GET" || path != "/") {
+    cl.head = "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\n"
+      "Content-Length: 6\r\nConnection: close\r\n\r\ntry /\n";
+    cl.closing = true;
+    return true;
+  }
+
+  // each part is a whole jpeg, the next one's boundary ends it
+  cl.head = "HTTP/1.1 200 OK\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "Connection: close\r\n\r\n";
+  cl.watching = true;
+  watching_++;
+  return true;
+}
+
+bool Preview::drain(Preview::Client& cl) {
+
+  while (cl.head_off < cl.head.size()) {
+    ssize_t n = ::send(cl.fd, cl.head.data() + cl.head_off,
+        cl.head.size() - cl.head_off, MSG_NOSIGNAL);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    cl.head_off += n;
+    byte_cnt_ += n;
+  }
+  while (cl.body && cl.body_off < cl.body->size()) {
+    ssize_t n = ::send(cl.fd, cl.body->data() + cl.body_off,
+        cl.body->size() - cl.body_off, MSG_NOSIGNAL);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    cl.body_off += n;
+    byte_cnt_ += n;
+  }
+  cl.head.clear();
+  cl.head_off = 0;
+  cl.body.reset();
+  cl.body_off = 0;
+  return !cl.closing;
+}
+
+void Preview::serve(std::shared_ptr<std::vector<unsigned char>>& pic) {
+
+  // everyone shares the one jpeg, who is still sending the last skips it
+  for (auto& cl : clients_) {
+    if (!cl.watching || cl.fd < 0) {
+      continue;
+    }
+    if (!cl.head.empty()) {
+      skip_cnt_++;
+      continue;
+    }
+    cl.head = "\r\n--frame\r\nContent-Type: image/jpeg\r\nContent-Length: " +
+      std::to_string(pic->size()) + "\r\n\r\n";
+    cl.head_off = 0;
+    cl.body = pic;
+    cl.body_off = 0;
+    flush(cl);
+  }
+  reap();
+}
+
+void Preview::accepting() {
+  int fd;
+  while ((fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK)) >= 0) {
+    if (clients_.size() >= client_max_) {
+      close(fd);
+      turned_away_cnt_++;
+      continue;
+    }
+    if (!loop()->watch(fd, EPOLLIN, [this, fd](uint32_t events) { ready(fd, events); })) {
+      close(fd);
+      continue;
+    }
+    Preview::Client cl;
+    cl.fd = fd;
+    cl.watching = false;
+    cl.closing = false;
+    cl.head_off = 0;
+    cl.body_off = 0;
+    clients_.push_back(cl);
+  }
+}
+
+void Preview::ready(int fd, uint32_t events) {
+
+  auto it = std::find_if(clients_.begin(), clients_.end(),
+      [fd](const Preview::Client& cl) { return cl.fd == fd; });
+  if (it == clients_.end()) {
+    return;
+  }
+  Preview::Client& cl = *it;
+
+  // watchers only ever send the request, a hang up shows as a read of 0
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    bool ok = true;
+    char buf[1024];
+    ssize_t n = recv(cl.fd, buf, sizeof(buf), 0);
+    if (n == 0) {
+      ok = false;
+    } else if (n < 0) {
+      ok = (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+    } else if (!cl.watching && !cl.closing) {
+      cl.req.append(buf, n);
+      ok = request(cl);
+    }
+    if (!ok) {
+      hangup(cl);
+      reap();
+      return;
+    }
+  }
+  flush(cl);
+  reap();
+}
+
+void Preview::flush(Preview::Client& cl) {
+
+  // only ask to hear about room while there is something left to send
+  if (!cl.head.empty() && !drain(cl)) {
+    hangup(cl);
+    return;
+  }
+  loop()->modify(cl.fd, cl.head.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT);
+}
+
+void Preview::hangup(Preview::Client& cl) {
+  if (cl.fd < 0) {
+    return;
+  }
+  if (cl.watching) {
+    watching_--;
+  }
+  loop()->unwatch(cl.fd);
+  close(cl.fd);
+  cl.fd = -1;
+}
+
+void Preview::reap() {
+  clients_.erase(std::remove_if(clients_.begin(), clients_.end(),
+        [](const Preview::Client& cl) { return cl.fd < 0; }), clients_.end());
+}
+
+bool Preview::waitingToRun() {
+
+  if (!preview_on_) {
+
+    dbgMsg("open preview jpeg encoder\n");
+    jpeg_ = M2m::create(this, yield_time_, device_, V4L2_PIX_FMT_JPEG);
+    if (!jpeg_->open(width_, height_, 1, pix_fmt_, 0) || !jpeg_->setQuality(quality_)) {
+      dbgMsg("failed: open preview jpeg encoder\n");
+      return false;
+    }
+
+    dbgMsg("open preview port %u\n", port_);
+    listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd_ < 0) {
+      dbgMsg("failed: preview socket\n");
+      return false;
+    }
+    int on = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port_);
+    if (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(listen_fd_, client_max_) < 0) {
+      dbgMsg("failed: preview bind port %u\n", port_);
+      close(listen_fd_);
+      listen_fd_ = -1;
+      return false;
+    }
+    if (!loop()->watch(listen_fd_, EPOLLIN, [this](uint32_t) { accepting(); })) {
+      close(listen_fd_);
+      listen_fd_ = -1;
+      return false;
+    }
+
+    preview_on_ = true;
+  }
+  return true;
+}
+
+bool Preview::running() {
+
+  // the sockets are looked after by the loop between callbacks
+  if (preview_on_) {
+    Preview::Shot shot;
+    if (shot_chan_.pop(shot)) {
+      auto pic = std::make_shared<std::vector<unsigned char>>();
+      if (encode(shot, *pic)) {
+        pic_cnt_++;
+        serve(pic);
+      }
+      shot.levels.reset();
+      busy_ = false;
+    }
+  }
+  return true;
+}
+
+bool Preview::paused() {
+  return true;
+}
+
+bool Preview::waitingToHalt() {
+
+  if (preview_on_) {
+    preview_on_ = false;
+
+    Preview::Shot shot;
+    while (shot_chan_.pop(shot)) {
+    }
+    shot.levels.reset();
+    busy_ = false;
+
+    for (auto& cl : clients_) {
+      hangup(cl);
+    }
+    clients_.clear();
+    watching_ = 0;
+    loop()->unwatch(listen_fd_);
+    close(listen_fd_);
+    listen_fd_ = -1;
+
+    jpeg_->close();
+    jpeg_.reset();
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nPreview Results...\n");
+      fprintf(stderr, "  jpeg time    (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_jpeg_.pct(.5), differ_jpeg_.pct(.9), differ_jpeg_.pct(.99), differ_jpeg_.pct(.999),
+          differ_jpeg_.high, differ_jpeg_.avg,
+          differ_jpeg_.low, differ_jpeg_.cnt);
+      fprintf(stderr, "       pictures: %u\n", pic_cnt_);
+      fprintf(stderr, "        skipped: %u\n", skip_cnt_);
+      fprintf(stderr, "    turned away: %u\n", turned_away_cnt_);
+      fprintf(stderr, "     bytes sent: %llu\n",
+          static_cast<unsigned long long>(byte_cnt_));
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
@@ -0,0 +1,147 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  MJPEG preview over http.
+ *
+ *  With --preview port[,fps] browsers and thin clients that can't decode
+ *  h264 cheaply get 'GET /' on that port as multipart/x-mixed-replace
+ *  jpegs, 2 a second unless 'fps' says otherwise.  While anyone is
+ *  watching the encoder hands over a frame's pyramid (see pyramid.h) and
+ *  the boxes it would draw, this thread outlines them on the half size
+ *  level and the hardware encoder makes the jpeg.  Each watcher gets the
+ *  newest jpeg once it is done with the last, a slow one just sees fewer.
+ *
+ *  The sockets are watched by the stage's loop (see loop.h), a watcher
+ *  is only written to when it can take more and the thread sleeps while
+ *  nobody is asking and no frame is waiting.
+ */
+
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <chrono>
+
+#include "utils.h"
+#include "listener.h"
+#include "channel.h"
+#include "base.h"
+#include "pyramid.h"
+#include "m2m.h"
+
+namespace detector {
+
+class Preview : public Base {
+  public:
+    static std::unique_ptr<Preview> create(unsigned int yield_time, bool quiet,
+        const std::string& spec, unsigned int width, unsigned int height,
+        unsigned int pix_fmt);
+    virtual ~Preview();
+
+  public:
+    // the encoder hands over its next frame while this is true
+    bool wanted();
+
+    // a frame's levels, the half size one already made, and its boxes in
+    // frame pixels
+    bool addMessage(std::shared_ptr<Levels>& levels,
+        std::shared_ptr<std::vector<BoxBuf>>& boxes);
+
+    // the metrics endpoint's samples
+    virtual void metrics(Exposition& out, const std::string& labels);
+
+  protected:
+    Preview() = delete;
+    Preview(unsigned int yield_time);
+    bool init(bool quiet, const std::string& spec, unsigned int width,
+        unsigned int height, unsigned int pix_fmt);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    unsigned short port_;
+    unsigned int fps_;
+    unsigned int width_;      // of the level
+    unsigned int height_;
+    unsigned int pix_fmt_;
+    const unsigned int level_ = {1};
+
+    class Shot {
+      public:
+        std::shared_ptr<Levels> levels;
+        std::shared_ptr<std::vector<BoxBuf>> boxes;
+    };
+    Channel<Preview::Shot> shot_chan_{1, Channel<Preview::Shot>::Policy::kDropNewest};
+    std::atomic<bool> busy_;
+    std::atomic<int64_t> last_;
+    std::atomic<unsigned int> watching_;
+
+    const char* device_ = {"/dev/video31"};
+    const unsigned int quality_ = {70};
+    const unsigned int jpeg_timeout_ = {1000};   // msec
+    const unsigned int thickness_ = {1};
+    std::unique_ptr<M2m> jpeg_;
+    std::vector<DrawBox> draw_list_;
+    bool encode(Preview::Shot& shot, std::vector<unsigned char>& pic);
+
+    // http
+    class Client {
+      public:
+        int fd;
+        std::string req;
+        bool watching;
+        bool closing;        // once the answer is out
+        std::string head;
+        size_t head_off;
+        std::shared_ptr<std::vector<unsigned char>> body;
+        size_t body_off;
+    };
+    int listen_fd_;
+    std::vector<Preview::Client> clients_;
+    const unsigned int client_max_ = {8};
+    const size_t req_max_ = {4096};
+    void serve(std::shared_ptr<std::vector<unsigned char>>& pic);
+    bool request(Preview::Client& cl);
+    bool drain(Preview::Client& cl);
+    void accepting();
+    void ready(int fd, uint32_t events);
+    void flush(Preview::Client& cl);
+    void hangup(Preview::Client& cl);
+    void reap();
+
+    std::atomic<bool> preview_on_;
+
+    unsigned int pic_cnt_;
+    unsigned int skip_cnt_;
+    unsigned int turned_away_cnt_;
+    uint64_t byte_cnt_;
+    MicroDiffer<uint32_t> differ_jpeg_;
+};
+
+} // namespace detector
+
+#endif // PREVIEW_H
@@ -0,0 +1,100 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Static tracepoints.
+ *
+ *  Built with 'HAVE_SDT' (see the Makefile) the hot paths carry usdt
+ *  probes under the provider 'detector', and bpftrace or perf can attach
+ *  to a running camera without a rebuild or --trace.  A probe nobody is
+ *  attached to is a nop and a note in the elf, its arguments are already
+ *  in registers.  Every probe's first arguments are the frame's capture
+ *  stamp in usec, which joins the hops of one frame, and its id where the
+ *  hop knows it:
+ *
+ *    dequeue          stamp, id, bytes, width, height
+ *    tflow_add        stamp, id, bytes
+ *    prep_begin/end   stamp, id, width, height (of the model's input)
+ *    eval_begin/end   stamp, id, lane (of the engine)
+ *    post_begin/end   stamp, id, results (the model's, before the threshold)
+ *    track_begin/end  stamp, id, detections, tracks
+ *    overlay_begin/end  stamp, boxes
+ *    encode_in        stamp, id, bytes
+ *    encode_out       stamp, id, bytes, key
+ *    rtsp_queue       stamp, bytes, readers
+ *    rtsp_deliver     stamp, bytes
+ *
+ *  The _begin/_end pairs come from a scope, every return ends it, so
+ *  for example
+ *
+ *    bpftrace -e 'usdt:./detector:detector:eval_begin { @s[arg1] = nsecs; }
+ *      usdt:./detector:detector:eval_end /@s[arg1]/ {
+ *        @eval_us = hist((nsecs - @s[arg1]) / 1000); delete(@s[arg1]); }'
+ *
+ *  Without 'HAVE_SDT' the macros are empty.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <chrono>
+#include <cstdint>
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#endif
+
+namespace detector {
+
+// the stamp as a probe argument
+inline int64_t probe_us(std::chrono::steady_clock::time_point stamp) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      stamp.time_since_epoch()).count();
+}
+
+// runs 'end' when the scope does
+template<typename F>
+class ProbeEnd {
+  public:
+    explicit ProbeEnd(F end) : end_(end) {}
+    ~ProbeEnd() { end_(); }
+  private:
+    F end_;
+};
+
+} // namespace detector
+
+#ifdef HAVE_SDT
+
+#define PROBE(name, ...) STAP_PROBEV(detector, name, __VA_ARGS__)
+
+// a begin probe now and an end probe on the way out of the scope, the end
+// one sees the arguments as they are then
+#define PROBE_SCOPE(name, ...) \
+  STAP_PROBEV(detector, name##_begin, __VA_ARGS__); \
+  detector::ProbeEnd probe_end_##name( \
+      [&]() { STAP_PROBEV(detector, name##_end, __VA_ARGS__); })
+
+#else
+
+#define PROBE(name, ...) do {} while (0)
+#define PROBE_SCOPE(name, ...) do {} while (0)
+
+#endif // HAVE_SDT
+
+#endif // PROBES_H
@@ -0,0 +1,304 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <climits>
+#include <cstring>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "publish.h"
+
+namespace detector {
+
+Publisher::Publisher(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Publisher::~Publisher() {
+}
+
+std::unique_ptr<Publisher> Publisher::create(unsigned int yield_time, bool quiet,
+    const std::string& name, unsigned int width, unsigned int height,
+    unsigned int pix_fmt) {
+  auto obj = std::unique_ptr<Publisher>(new Publisher(yield_time));
+  obj->init(quiet, name, width, height, pix_fmt);
+  return obj;
+}
+
+bool Publisher::init(bool quiet, const std::string& name, unsigned int width,
+    unsigned int height, unsigned int pix_fmt) {
+
+  quiet_ = quiet;
+  name_ = (name.empty() || name[0] != '/') ? "/" + name : name;
+  width_ = width;
+  height_ = height;
+  pix_fmt_ = pix_fmt;
+  if (pix_fmt_ == V4L2_PIX_FMT_YUV420) {
+    frame_len_ = ALIGN_16B(width_) * ALIGN_16B(height_) * 3 / 2;
+  } else {
+    frame_len_ = ALIGN_16B(width_) * ALIGN_16B(height_) * channels_;
+  }
+
+  fd_ = -1;
+  map_ = nullptr;
+  map_len_ = 0;
+  header_ = nullptr;
+  frames_ = nullptr;
+  entries_ = nullptr;
+  next_frame_ = 0;
+
+  pub_on_ = false;
+
+  frame_cnt_ = 0;
+  box_cnt_ = 0;
+  track_cnt_ = 0;
+
+  return true;
+}
+
+void Publisher::footprint(Footprint& out) {
+  out.add("shm", map_ ? frame_num_ : 0, map_ ? map_len_ : 0);
+}
+
+bool Publisher::addMessage(FrameBuf& frame) {
+  if (!pub_on_ || !frame_chan_.push(frame)) {
+    return false;
+  }
+  wake();
+  return true;
+}
+
+bool Publisher::addMessage(std::shared_ptr<std::vector<BoxBuf>>& boxes) {
+  if (!pub_on_ || !box_chan_.push(boxes)) {
+    return false;
+  }
+  wake();
+  return true;
+}
+
+bool Publisher::addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks) {
+  if (!pub_on_ || !track_chan_.push(tracks)) {
+    return false;
+  }
+  wake();
+  return true;
+}
+
+PubEntry& Publisher::begin() {
+  auto& entry = entries_[header_->head.load(std::memory_order_relaxed) % slot_num_];
+  entry.seq.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  return entry;
+}
+
+void Publisher::end(PubEntry& entry) {
+  entry.seq.fetch_add(1, std::memory_order_release);
+  header_->head.fetch_add(1);
+
+  // ring the doorbell for every reader waiting on 'head', if there are any
+  if (header_->waiters.load() != 0) {
+    syscall(SYS_futex, &header_->head, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+  }
+}
+
+static void fill(PubBox& out, const BoxBuf& box) {
+  out.type = static_cast<uint32_t>(box.type);
+  out.id = box.id;
+  out.x = box.x;
+  out.y = box.y;
+  out.w = box.w;
+  out.h = box.h;
+  out.score = box.score;
+  out.vx = out.vy = 0.f;
+}
+
+static void fill(PubBox& out, const TrackBuf& track) {
+  fill(out, static_cast<const BoxBuf&>(track));
+  out.vx = track.vx;
+  out.vy = track.vy;
+}
+
+template<typename T>
+void Publisher::publish(PubEntry::Kind kind, const std::vector<T>& boxes) {
+  auto& entry = begin();
+  entry.kind = kind;
+  entry.frame = 0;
+  entry.frame_seq = 0;
+  entry.stamp = boxes.empty() ? 0 : boxes[0].stamp.time_since_epoch().count();
+  entry.count = std::min(static_cast<uint32_t>(boxes.size()), pub_box_max);
+  for (unsigned int i = 0; i < entry.count; i++) {
+    fill(entry.boxes[i], boxes[i]);
+  }
+  end(entry);
+}
+
+bool Publisher::waitingToRun() {
+
+  if (!pub_on_) {
+
+    dbgMsg("open shared memory %s\n", name_.c_str());
+    size_t off = sizeof(PubHeader) + frame_num_ * sizeof(PubFrame) +
+      slot_num_ * sizeof(PubEntry);
+    off = (off + 4095) & ~static_cast<size_t>(4095);
+    map_len_ = off + static_cast<size_t>(frame_num_) * frame_len_;
+
+    fd_ = shm_open(name_.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd_ < 0) {
+      dbgMsg("failed: shm_open %s\n", name_.c_str());
+      return false;
+    }
+    if (ftruncate(fd_, map_len_) < 0) {
+      dbgMsg("failed: size %s\n", name_.c_str());
+      close(fd_);
+      fd_ = -1;
+      return false;
+    }
+    void* map = mmap(nullptr, map_len_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (map == MAP_FAILED) {
+      dbgMsg("failed: map %s\n", name_.c_str());
+      close(fd_);
+      fd_ = -1;
+      return false;
+    }
+    map_ = static_cast<unsigned char*>(map);
+    std::memset(map_, 0, off);
+
+    header_ = reinterpret_cast<PubHeader*>(map_);
+    frames_ = reinterpret_cast<PubFrame*>(map_ + sizeof(PubHeader));
+    entries_ = reinterpret_cast<PubEntry*>(map_ + sizeof(PubHeader) +
+        frame_num_ * sizeof(PubFrame));
+    header_->width = width_;
+    header_->height = height_;
+    header_->pix_fmt = pix_fmt_;
+    header_->frame_num = frame_num_;
+    header_->frame_len = frame_len_;
+    header_->frame_off = off;
+    header_->slot_num = slot_num_;
+    header_->box_max = pub_box_max;
+    header_->head = 0;
+    header_->waiters = 0;
+
+    // readers check the magic last
+    std::atomic_thread_fence(std::memory_order_release);
+    header_->magic = pub_magic;
+
+    pub_on_ = true;
+  }
+
+  return true;
+}
+
+bool Publisher::running() {
+
+  if (pub_on_) {
+
+    FrameBuf frame;
+    while (frame_chan_.pop(frame)) {
+      differ_copy_.begin();
+      unsigned int idx = next_frame_;
+      next_frame_ = (next_frame_ + 1) % frame_num_;
+
+      auto& pf = frames_[idx];
+      pf.seq.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      unsigned int len = std::min(frame.length, frame_len_);
+      std::memcpy(map_ + header_->frame_off + static_cast<size_t>(idx) * frame_len_,
+          frame.addr, len);
+      pf.id = frame.id;
+      pf.length = len;
+      pf.stamp = frame.stamp.time_since_epoch().count();
+      uint32_t seq = pf.seq.fetch_add(1, std::memory_order_release) + 1;
+      frame.ref.reset();
+
+      auto& entry = begin();
+      entry.kind = PubEntry::kFrame;
+      entry.frame = idx;
+      entry.frame_seq = seq;
+      entry.stamp = pf.stamp;
+      entry.count = 0;
+      end(entry);
+      frame_cnt_++;
+      differ_copy_.end();
+    }
+
+    std::shared_ptr<std::vector<BoxBuf>> boxes;
+    while (box_chan_.pop(boxes)) {
+      publish(PubEntry::kBoxes, *boxes);
+      boxes.reset();
+      box_cnt_++;
+    }
+
+    std::shared_ptr<std::vector<TrackBuf>> tracks;
+    while (track_chan_.pop(tracks)) {
+      publish(PubEntry::kTracks, *tracks);
+      tracks.reset();
+      track_cnt_++;
+    }
+  }
+  return true;
+}
+
+bool Publisher::paused() {
+  return true;
+}
+
+bool Publisher::waitingToHalt() {
+
+  if (pub_on_) {
+    pub_on_ = false;
+
+    FrameBuf frame;
+    while (frame_chan_.pop(frame)) {}
+    std::shared_ptr<std::vector<BoxBuf>> boxes;
+    while (box_chan_.pop(boxes)) {}
+    std::shared_ptr<std::vector<TrackBuf>> tracks;
+    while (track_chan_.pop(tracks)) {}
+
+    // readers that still have it mapped keep it until they let go
+    munmap(map_, map_len_);
+    map_ = nullptr;
+    close(fd_);
+    fd_ = -1;
+    shm_unlink(name_.c_str());
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nPublisher Results...\n");
+      fprintf(stderr, "           segment: /dev/shm%s\n", name_.c_str());
+      fprintf(stderr, "  frames published: %u\n", frame_cnt_);
+      fprintf(stderr, "   box batches out: %u\n", box_cnt_);
+      fprintf(stderr, " track batches out: %u\n", track_cnt_);
+      fprintf(stderr, "    frames dropped: %llu\n",
+          static_cast<unsigned long long>(frame_chan_.drops()));
+      fprintf(stderr, "    copy time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_copy_.pct(.5), differ_copy_.pct(.9), differ_copy_.pct(.99), differ_copy_.pct(.999),
+          differ_copy_.high, differ_copy_.avg,
+          differ_copy_.low,  differ_copy_.cnt);
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
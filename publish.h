@@ -0,0 +1,176 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Shared memory publisher.
+ *
+ *  Frames, boxes and tracks for other processes on the Pi, so they don't
+ *  have to open the camera or decode the stream.  With -X the segment
+ *  /dev/shm/<name> holds a header, a table of frames and a ring of
+ *  entries, laid out as PubHeader, PubFrame[frame_num], PubEntry[slot_num]
+ *  and then frame_num frames of frame_len bytes at 'frame_off'.
+ *
+ *  Each entry is a frame, a batch of boxes or a batch of tracks.  A
+ *  frame entry names the frame table index and the 'seq' it was written
+ *  with.  Every 'seq' is odd while its entry or frame is being written.
+ *  A reader notes 'seq', reads, and keeps what it read only if 'seq' is
+ *  still the same, so a reader never holds anything up.
+ *
+ *  'head' counts the entries written, entry n is slot n % slot_num.  It
+ *  is also the doorbell: a reader sleeps with FUTEX_WAIT on 'head' (a
+ *  shared futex, the segment is mapped in both) and is woken each time
+ *  an entry is added.  A reader adds one to 'waiters' before it looks at
+ *  'head' for the last time and sleeps, and takes it off once awake; the
+ *  wake is skipped while no one is waiting.  Both are seq_cst, so a reader
+ *  either sees the new head or is counted when it is added.
+ *
+ *  Frames are copied once into the segment.  A dmabuf fd can't be handed
+ *  to another process without a socket, and the readers only want the
+ *  pixels.
+ */
+
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+#include "utils.h"
+#include "listener.h"
+#include "channel.h"
+#include "base.h"
+
+namespace detector {
+
+const uint32_t pub_magic = 0x44455432;    // "DET2", with 'waiters'
+const uint32_t pub_box_max = 64;
+
+class PubHeader {
+  public:
+    uint32_t magic;
+    uint32_t width, height, pix_fmt;
+    uint32_t frame_num, frame_len, frame_off;
+    uint32_t slot_num, box_max;
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> waiters;    // readers asleep on 'head'
+};
+
+class PubFrame {
+  public:
+    std::atomic<uint32_t> seq;
+    uint32_t id;
+    uint32_t length;
+    int64_t stamp;            // steady clock nsec at capture
+};
+
+class PubBox {
+  public:
+    uint32_t type, id;
+    uint32_t x, y, w, h;
+    float score;
+    float vx, vy;             // tracks only
+};
+
+class PubEntry {
+  public:
+    enum Kind : uint32_t {
+      kFrame = 1,
+      kBoxes,
+      kTracks
+    };
+  public:
+    std::atomic<uint32_t> seq;
+    uint32_t kind;
+    uint32_t frame;           // kFrame: table index
+    uint32_t frame_seq;       // kFrame: its seq when written
+    int64_t stamp;
+    uint32_t count;
+    PubBox boxes[pub_box_max];
+};
+
+class Publisher : public Base {
+  public:
+    static std::unique_ptr<Publisher> create(unsigned int yield_time, bool quiet,
+        const std::string& name, unsigned int width, unsigned int height,
+        unsigned int pix_fmt);
+    virtual ~Publisher();
+
+  public:
+    bool addMessage(FrameBuf& frame);
+    bool addMessage(std::shared_ptr<std::vector<BoxBuf>>& boxes);
+    bool addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks);
+
+    virtual void footprint(Footprint& out);
+
+  protected:
+    Publisher() = delete;
+    Publisher(unsigned int yield_time);
+    bool init(bool quiet, const std::string& name, unsigned int width,
+        unsigned int height, unsigned int pix_fmt);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    std::string name_;
+    unsigned int width_;
+    unsigned int height_;
+    unsigned int pix_fmt_;
+    unsigned int frame_len_;
+    const unsigned int channels_ = {3};
+
+    const unsigned int frame_num_ = {4};
+    const unsigned int slot_num_ = {32};
+
+    Channel<FrameBuf> frame_chan_{2, Channel<FrameBuf>::Policy::kDropOldest};
+    Channel<std::shared_ptr<std::vector<BoxBuf>>> box_chan_{4,
+      Channel<std::shared_ptr<std::vector<BoxBuf>>>::Policy::kDropOldest};
+    Channel<std::shared_ptr<std::vector<TrackBuf>>> track_chan_{4,
+      Channel<std::shared_ptr<std::vector<TrackBuf>>>::Policy::kDropOldest};
+
+    int fd_;
+    unsigned char* map_;
+    size_t map_len_;
+    PubHeader* header_;
+    PubFrame* frames_;
+    PubEntry* entries_;
+    unsigned int next_frame_;
+
+    PubEntry& begin();
+    void end(PubEntry& entry);
+    template<typename T>
+    void publish(PubEntry::Kind kind, const std::vector<T>& boxes);
+
+    std::atomic<bool> pub_on_;
+
+    unsigned int frame_cnt_;
+    unsigned int box_cnt_;
+    unsigned int track_cnt_;
+    MicroDiffer<uint32_t> differ_copy_;
+};
+
+} // namespace detector
+
+#endif // PUBLISH_H
@@ -0,0 +1,119 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include "pyramid.h"
+
+namespace detector {
+
+const Level* Levels::get(unsigned int k) {
+
+  if (k >= levels_.size()) {
+    return nullptr;
+  }
+  std::unique_lock<std::mutex> lck(lock_);
+  for (; made_ <= k; made_++) {
+    const Level& src = levels_[made_ - 1];
+    Level& dst = levels_[made_];
+    bufs_[made_] = Frames::take(Shape(dst.width, dst.height, pix_fmt_));
+    dst.addr = bufs_[made_].addr;
+    if (pix_fmt_ == V4L2_PIX_FMT_YUV420) {
+      scale_half_yuv420(src.addr, src.stride, src.slice,
+          dst.addr, dst.stride, dst.slice, dst.width, dst.height);
+    } else {
+      scale_half_rgb24(src.addr, src.stride,
+          dst.addr, dst.stride, dst.width, dst.height);
+    }
+  }
+  return &levels_[k];
+}
+
+unsigned int Levels::find(const Rect& rect, unsigned int w, unsigned int h) {
+
+  std::unique_lock<std::mutex> lck(lock_);
+  unsigned int k = 0;
+  while (k + 1 < made_ && (rect.w >> (k + 1)) >= w && (rect.h >> (k + 1)) >= h) {
+    k++;
+  }
+  return k;
+}
+
+Pyramid::Pyramid() {
+}
+
+Pyramid::~Pyramid() {
+}
+
+std::unique_ptr<Pyramid> Pyramid::create(unsigned int width, unsigned int height,
+    unsigned int pix_fmt, unsigned int num) {
+  auto obj = std::unique_ptr<Pyramid>(new Pyramid());
+  obj->init(width, height, pix_fmt, num);
+  return obj;
+}
+
+bool Pyramid::init(unsigned int width, unsigned int height,
+    unsigned int pix_fmt, unsigned int num) {
+
+  pix_fmt_ = pix_fmt;
+  shape_.clear();
+  shapes_.clear();
+  if (pix_fmt_ != V4L2_PIX_FMT_YUV420 && pix_fmt_ != V4L2_PIX_FMT_RGB24) {
+    return false;
+  }
+
+  // each level is laid out like a frame of its size
+  unsigned int w = width, h = height;
+  for (unsigned int k = 0; k <= num && w >= 2 && h >= 2; k++, w /= 2, h /= 2) {
+    Shape s(w, h, pix_fmt_);
+    Level lvl;
+    lvl.addr = nullptr;
+    lvl.width = w;
+    lvl.height = h;
+    lvl.stride = s.stride;
+    lvl.slice = s.slice;
+    shape_.push_back(lvl);
+    shapes_.push_back(s);
+  }
+  return true;
+}
+
+std::shared_ptr<Levels> Pyramid::make(unsigned char* addr) {
+
+  if (shape_.empty()) {
+    return nullptr;
+  }
+  auto lvls = std::shared_ptr<Levels>(new Levels());
+  lvls->pix_fmt_ = pix_fmt_;
+  lvls->made_ = 1;
+  lvls->levels_ = shape_;
+  lvls->levels_[0].addr = addr;
+  lvls->bufs_.resize(shape_.size());
+  return lvls;
+}
+
+void Pyramid::footprint(size_t& num, size_t& bytes) {
+  num = 0;
+  bytes = 0;
+  for (unsigned int k = 1; k < shapes_.size(); k++) {
+    size_t n, b;
+    Frames::footprint(shapes_[k], n, b);
+    num += n;
+    bytes += b;
+  }
+}
+
+} // namespace detector
@@ -0,0 +1,103 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Shared image pyramid.
+ *
+ *  Capture and replay hang a Levels on every i420 or rgb24 frame they
+ *  hand out.  Level 0 is the frame itself and level k is a 2x2 box
+ *  filter of level k-1, 1/2, 1/4 and 1/8 of the frame, in the frame's
+ *  format and laid out like a frame of that size.  Levels are only made
+ *  when someone asks for one, once per frame whoever asks first, so the
+ *  motion gate (1/8), the substream (1/2), the model input and the
+ *  snapshot thumbnails share the work instead of each going over the
+ *  full frame.  'find' only looks at what is already made, for users
+ *  that can just as well read the frame.  The buffers are the pipeline's
+ *  (see frames.h) and go back to it with the frame.
+ */
+
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include <memory>
+#include <vector>
+#include <mutex>
+
+#include "utils.h"
+#include "frames.h"
+
+namespace detector {
+
+class Level {
+  public:
+    unsigned char* addr;
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;    // bytes
+    unsigned int slice;     // rows
+};
+
+class Levels {
+  public:
+    ~Levels() {}
+
+  public:
+    // level k, made on the way if need be, nullptr past the last one
+    const Level* get(unsigned int k);
+
+    // the smallest level already made that is at least w x h at 'rect'
+    unsigned int find(const Rect& rect, unsigned int w, unsigned int h);
+
+  private:
+    friend class Pyramid;
+    Levels() = default;
+
+    unsigned int pix_fmt_;
+    std::mutex lock_;
+    unsigned int made_;
+    std::vector<Level> levels_;
+    std::vector<FrameBuf> bufs_;
+};
+
+class Pyramid {
+  public:
+    static std::unique_ptr<Pyramid> create(unsigned int width, unsigned int height,
+        unsigned int pix_fmt, unsigned int num = 3);
+    ~Pyramid();
+
+  public:
+    // the levels of a frame at 'addr', nullptr for formats it can't scale
+    std::shared_ptr<Levels> make(unsigned char* addr);
+
+    // buffers of its levels' sizes in the pipeline's pool, made levels included
+    void footprint(size_t& num, size_t& bytes);
+
+  protected:
+    Pyramid();
+    bool init(unsigned int width, unsigned int height,
+        unsigned int pix_fmt, unsigned int num);
+
+  private:
+    unsigned int pix_fmt_;
+    std::vector<Level> shape_;
+    std::vector<Shape> shapes_;
+};
+
+} // namespace detector
+
+#endif // PYRAMID_H
@@ -0,0 +1,767 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <algorithm>
+
+#include "recorder.h"
+#include "storage.h"
+
+namespace detector {
+
+Recorder::Recorder(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Recorder::~Recorder() {
+}
+
+std::unique_ptr<Recorder> Recorder::create(unsigned int yield_time, bool quiet,
+    std::string& output, unsigned int framerate, unsigned int width,
+    unsigned int height, unsigned int segment, unsigned int event_quiet,
+    unsigned int preroll) {
+  auto obj = std::unique_ptr<Recorder>(new Recorder(yield_time));
+  obj->init(quiet, output, framerate, width, height, segment, event_quiet, preroll);
+  return obj;
+}
+
+bool Recorder::init(bool quiet, std::string& output, unsigned int framerate,
+    unsigned int width, unsigned int height, unsigned int segment,
+    unsigned int event_quiet, unsigned int preroll) {
+
+  quiet_ = quiet;
+  output_ = output;
+  if (output_.size() > 4 && output_.compare(output_.size() - 4, 4, ".mp4") == 0) {
+    output_.resize(output_.size() - 4);
+  }
+  framerate_ = framerate ? framerate : 1;
+  width_ = width;
+  height_ = height;
+  event_quiet_ = event_quiet;
+  preroll_ = preroll;
+  segment_ = (segment || event_quiet_) ? segment : 1;
+  pre_bytes_ = 0;
+  pre_num_ = 0;
+  event_ = 0;
+
+  nal_gap_ = false;
+  nal_drops_ = 0;
+  wait_key_ = true;
+
+  fd_ = -1;
+  seg_num_ = 0;
+  seg_cur_ = 0;
+  seg_tracks_ = 0;
+  seg_chunk_ = 4 * 1024 * 1024;
+  slots_ = 0;
+  pin_ = 0;
+  ring_seq_ = 0;
+  frag_seq_ = 1;
+  seg_time_ = 0;
+  seg_offset_ = 0;
+  evx_ = nullptr;
+  init_len_ = 0;
+  offset_ms_ = 0;
+
+  out_buf_ = nullptr;
+  out_len_ = 0;
+
+  seg_cnt_ = 0;
+  clip_cnt_ = 0;
+  frag_cnt_ = 0;
+  event_cnt_ = 0;
+  byte_cnt_ = 0;
+
+  record_on_ = false;
+
+  return true;
+}
+
+void Recorder::footprint(Footprint& out) {
+  out.add("nal_pool", nal_bytes_ ? nal_num_ : 0, nal_bytes_);
+  out.add("preroll", pre_num_, pre_bytes_);
+  out.add("write_buf", record_on_ ? 1 : 0, record_on_ ? out_size_ : 0);
+}
+
+bool Recorder::addMessage(NalBuf& nal) {
+
+  // the encoder never waits on us, a lost nal means resync on the next key frame
+  std::shared_ptr<Recorder::RecNal> rec_nal;
+  if (!nal_pool_.pop(rec_nal)) {
+    nal_drops_++;
+    nal_gap_ = true;
+    return false;
+  }
+
+  if (nal.length > rec_nal->nal.size()) {
+    nal_bytes_ += nal.length - rec_nal->nal.size();
+    rec_nal->nal.resize(nal.length, 0);
+  }
+  std::memcpy(rec_nal->nal.data(), nal.addr, nal.length);
+  rec_nal->length = nal.length;
+  rec_nal->stamp = nal.stamp;
+  rec_nal->gap = nal_gap_.exchange(false);
+
+  nal_work_.push(rec_nal);
+  wake();
+
+  return true;
+}
+
+bool Recorder::addMessage(std::shared_ptr<std::vector<BoxBuf>>& targets) {
+  if (targets) {
+    bool seen = false;
+    for (auto& box : *targets) {
+      if (box.type != BoxBuf::Type::kUnknown) {
+        seen = true;
+
+        // a detection a second of each class is enough to find it by
+        unsigned int t = static_cast<unsigned int>(box.type) % 4;
+        if (record_on_ && box.stamp - box_at_[t] >= std::chrono::seconds(1)) {
+          box_at_[t] = box.stamp;
+          Recorder::Seen s{box.stamp, box.id, RecEvent::kDetect, box.type};
+          seen_chan_.push(s);
+        }
+      }
+    }
+    if (seen) {
+      trigger();
+    }
+  }
+  return true;
+}
+
+bool Recorder::addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks) {
+  if (tracks) {
+    bool seen = false;
+    next_ids_.clear();
+    for (auto& track : *tracks) {
+      if (track.type != BoxBuf::Type::kUnknown) {
+        seen = true;
+      }
+
+      // only the tracks that weren't in the last post
+      next_ids_.push_back(track.id);
+      if (record_on_ &&
+          std::find(last_ids_.begin(), last_ids_.end(), track.id) == last_ids_.end() &&
+          track.type != BoxBuf::Type::kUnknown) {
+        Recorder::Seen s{track.stamp, track.id, RecEvent::kTrack, track.type};
+        seen_chan_.push(s);
+      }
+    }
+    last_ids_.swap(next_ids_);
+    if (seen) {
+      trigger();
+    }
+  }
+  return true;
+}
+
+void Recorder::setRetention(unsigned int slots, unsigned int pin, uint64_t len) {
+  slots_ = slots;
+  pin_ = pin;
+  seg_chunk_ = len;
+  ring_.assign(slots_, Recorder::Slot{0, 0, 0, 0});
+  ring_seq_ = 0;
+  if (slots_ && !loadRing()) {
+    dbgMsg("new retention ring %s.ring, %u slots\n", output_.c_str(), slots_);
+  }
+}
+
+unsigned int Recorder::pickSlot(int64_t now) {
+
+  // the oldest slot that isn't pinned, pins only count up to half the ring
+  unsigned int pinned = 0;
+  for (auto& s : ring_) {
+    pinned += (s.pinned > now);
+  }
+  bool any = pinned > slots_ / 2;
+  unsigned int best = 0;
+  for (unsigned int n = 1; n < slots_; n++) {
+    bool ok = any || ring_[n].pinned <= now;
+    bool best_ok = any || ring_[best].pinned <= now;
+    if ((ok && !best_ok) || (ok == best_ok && ring_[n].seq < ring_[best].seq)) {
+      best = n;
+    }
+  }
+  return best;
+}
+
+static const uint32_t ring_magic = 0x44524e47;    // "DRNG"
+
+bool Recorder::loadRing() {
+
+  FILE* fd = fopen((output_ + ".ring").c_str(), "rb");
+  if (fd == nullptr) {
+    return false;
+  }
+  uint32_t hdr[4];
+  bool res = fread(hdr, sizeof(hdr), 1, fd) == 1 && hdr[0] == ring_magic &&
+    hdr[1] == slots_ && fread(ring_.data(), sizeof(Recorder::Slot), slots_, fd) == slots_;
+  fclose(fd);
+  if (!res) {
+    ring_.assign(slots_, Recorder::Slot{0, 0, 0, 0});
+    return false;
+  }
+  ring_seq_ = hdr[2];
+  return true;
+}
+
+void Recorder::saveRing() {
+  std::vector<unsigned char> buf(16 + slots_ * sizeof(Recorder::Slot));
+  uint32_t hdr[4] = { ring_magic, slots_, ring_seq_, 0 };
+  memcpy(buf.data(), hdr, sizeof(hdr));
+  memcpy(buf.data() + sizeof(hdr), ring_.data(), slots_ * sizeof(Recorder::Slot));
+  Storage::save(output_ + ".ring", buf.data(), buf.size(), true);
+}
+
+int64_t Recorder::wall(std::chrono::steady_clock::time_point stamp) {
+  using namespace std::chrono;
+  return duration_cast<milliseconds>(stamp.time_since_epoch()).count() + offset_ms_;
+}
+
+void Recorder::indexEvents(const Recorder::Fragment& frag, uint64_t time, uint64_t offset) {
+
+  // what was seen during the fragment, anything before it wasn't recorded
+  auto start = frag.samples.front().stamp;
+  while (!seen_.empty() && seen_.front().stamp < frag.end) {
+    Recorder::Seen s = seen_.front();
+    seen_.pop_front();
+    if (s.stamp < start || evx_ == nullptr || index_.empty()) {
+      continue;
+    }
+    RecEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.stamp = wall(s.stamp);
+    ev.id = s.id;
+    ev.kind = s.kind;
+    ev.type = static_cast<uint8_t>(s.type);
+    ev.key_offset = index_.back().offset;
+    ev.key_time = index_.back().time;
+    ev.event_time = time + std::chrono::duration_cast<std::chrono::microseconds>(
+        s.stamp - start).count() * timescale_ / 1000000;
+    if (fwrite(&ev, sizeof(ev), 1, evx_) == 1) {
+      event_cnt_++;
+    }
+    seg_tracks_ += (s.kind == RecEvent::kTrack);
+  }
+  if (evx_) {
+    fflush(evx_);
+  }
+}
+
+bool Recorder::events(const std::string& output, int64_t from, int64_t to,
+    const std::function<bool(const std::string& path, const RecEvents& seg,
+      const RecEvent& event)>& fn) {
+
+  std::string base = output;
+  if (base.size() > 4 && base.compare(base.size() - 4, 4, ".mp4") == 0) {
+    base.resize(base.size() - 4);
+  }
+
+  // segments are numbered from 0 each run
+  for (unsigned int n = 0; ; n++) {
+    char name[32];
+    snprintf(name, sizeof(name), "-%05u.evx", n);
+    FILE* fd = fopen((base + name).c_str(), "rb");
+    if (fd == nullptr) {
+      break;
+    }
+    snprintf(name, sizeof(name), "-%05u.mp4", n);
+    std::string path = base + name;
+    RecEvents seg;
+    RecEvent ev;
+    bool more = true;
+    if (fread(&seg, sizeof(seg), 1, fd) == 1 && seg.magic == rec_magic &&
+        seg.version == rec_version) {
+      while (more && fread(&ev, sizeof(ev), 1, fd) == 1) {
+        if (ev.stamp >= from && ev.stamp < to) {
+          more = fn(path, seg, ev);
+        }
+      }
+    }
+    fclose(fd);
+    if (!more) {
+      break;
+    }
+  }
+  return true;
+}
+
+void Recorder::parse(const unsigned char* data, unsigned int len,
+    std::chrono::steady_clock::time_point stamp) {
+  annexb_.parse(data, len, stamp,
+      [this](std::vector<unsigned char>& nal, std::chrono::steady_clock::time_point at) {
+        handleNal(nal, at);
+      });
+}
+
+void Recorder::handleNal(std::vector<unsigned char>& nal,
+    std::chrono::steady_clock::time_point stamp) {
+
+  unsigned int type = nal[0] & 0x1f;
+  if (type == 7) {
+    sps_ = nal;
+  } else if (type == 8) {
+    pps_ = nal;
+  } else if (type == 6) {
+    sei_ = nal;
+  } else if (type == 1 || type == 5) {
+    bool key = (type == 5);
+
+    // first_mb_in_slice is zero on the first slice of a picture
+    if (nal.size() > 1 && (nal[1] & 0x80)) {
+      std::vector<unsigned char> sei;
+      sei.swap(sei_);
+      if ((wait_key_ && !key) || sps_.size() < 4 || pps_.empty()) {
+        return;
+      }
+
+      using namespace std::chrono;
+      if (!samples_.empty() && (key ||
+            stamp - samples_.front().stamp >= milliseconds(frag_time_))) {
+        closeFragment(stamp);
+      }
+      if (key && fd_ >= 0 && segment_ != 0 &&
+          stamp - seg_start_ >= seconds(segment_)) {
+        closeSegment();
+        if (event_quiet_ != 0) {
+          openSegment(stamp);
+        }
+      }
+      if (fd_ < 0 && event_quiet_ == 0) {
+        if (!key || !openSegment(stamp)) {
+          wait_key_ = true;
+          return;
+        }
+      }
+      wait_key_ = false;
+      samples_.push_back(Mp4Sample{stamp, 0, 0, key});
+      if (!sei.empty()) {
+        put32(mdat_, sei.size());
+        mdat_.insert(mdat_.end(), sei.begin(), sei.end());
+        samples_.back().size += 4 + sei.size();
+      }
+    }
+
+    if (!samples_.empty()) {
+      put32(mdat_, nal.size());
+      mdat_.insert(mdat_.end(), nal.begin(), nal.end());
+      samples_.back().size += 4 + nal.size();
+    }
+  }
+}
+
+void Recorder::closeFragment(std::chrono::steady_clock::time_point next) {
+
+  if (samples_.empty()) {
+    mdat_.clear();
+    return;
+  }
+
+  mp4Durations(samples_, next, timescale_, framerate_);
+
+  using namespace std::chrono;
+  Recorder::Fragment frag;
+  frag.samples.swap(samples_);
+  frag.mdat.swap(mdat_);
+  frag.end = frag.samples.back().stamp + 
+    microseconds(frag.samples.back().duration * 1000000ull / timescale_);
+  mdat_.reserve(frag.mdat.capacity());
+
+  if (event_quiet_ == 0) {
+    writeFragment(frag);
+    return;
+  }
+
+  // clip running, end it at a fragment boundary once things go quiet
+  if (fd_ >= 0) {
+    writeFragment(frag);
+    if (!eventActive()) {
+      closeSegment();
+    }
+    return;
+  }
+
+  pre_bytes_ += frag.mdat.size();
+  pre_.push_back(std::move(frag));
+  trimPreroll();
+  pre_num_ = pre_.size();
+
+  // a new clip starts with the pre-roll
+  if (eventActive() && !pre_.empty() && pre_.front().samples.front().key) {
+    if (openSegment(pre_.front().samples.front().stamp)) {
+      clip_cnt_++;
+      for (auto& f : pre_) {
+        writeFragment(f);
+      }
+    }
+    pre_.clear();
+    pre_bytes_ = 0;
+    pre_num_ = 0;
+  }
+}
+
+bool Recorder::writeFragment(Recorder::Fragment& frag) {
+
+  if (fd_ < 0 || frag.samples.empty()) {
+    return false;
+  }
+
+  uint64_t total = 0;
+  for (auto& s : frag.samples) {
+    total += s.duration;
+  }
+
+  std::vector<unsigned char> b;
+  b.reserve(128 + frag.samples.size() * 12);
+  mp4Fragment(b, frag_seq_, seg_time_, frag.samples, frag.mdat.size());
+
+  if (frag.samples.front().key) {
+    index_.push_back(Recorder::Index{seg_time_, seg_offset_});
+  }
+  indexEvents(frag, seg_time_, seg_offset_);
+
+  bool res = put(b.data(), b.size()) && put(frag.mdat.data(), frag.mdat.size());
+
+  // capture to buffered
+  differ_late_.begin(frag.samples.back().stamp);
+  differ_late_.end();
+
+  seg_offset_ += b.size() + frag.mdat.size();
+  seg_time_ += total;
+  frag_seq_++;
+  frag_cnt_++;
+
+  return res;
+}
+
+void Recorder::trimPreroll() {
+
+  // drop whole GOPs from the front while the rest still covers the pre-roll
+  using namespace std::chrono;
+  while (1) {
+    size_t next = 1;
+    while (next < pre_.size() && !pre_[next].samples.front().key) {
+      next++;
+    }
+    if (next >= pre_.size()) {
+      break;
+    }
+    if (pre_.back().end - pre_[next].samples.front().stamp < seconds(preroll_) &&
+        pre_bytes_ <= pre_max_) {
+      break;
+    }
+    for (size_t i = 0; i < next; i++) {
+      pre_bytes_ -= pre_.front().mdat.size();
+      pre_.pop_front();
+    }
+  }
+
+  // one gop that outgrew the limit can't be kept
+  if (pre_bytes_ > pre_max_) {
+    dbgMsg("pre-roll overflow\n");
+    pre_.clear();
+    pre_bytes_ = 0;
+    pre_num_ = 0;
+    wait_key_ = true;
+  }
+}
+
+bool Recorder::eventActive() {
+  using namespace std::chrono;
+  int64_t last = event_.load(std::memory_order_relaxed);
+  if (last == 0) {
+    return false;
+  }
+  auto since = steady_clock::now() - steady_clock::time_point(steady_clock::duration(last));
+  return since < seconds(event_quiet_);
+}
+
+void Recorder::trigger() {
+  event_.store(std::chrono::steady_clock::now().time_since_epoch().count(),
+      std::memory_order_relaxed);
+}
+
+bool Recorder::openSegment(std::chrono::steady_clock::time_point stamp) {
+
+  // the next number, or the slot to write over
+  seg_cur_ = slots_ ? pickSlot(wall(stamp)) : seg_num_++;
+  seg_tracks_ = 0;
+  char name[32];
+  snprintf(name, sizeof(name), "-%05u.mp4", seg_cur_);
+  std::string path = output_ + name;
+  fd_ = Storage::open(path, seg_chunk_, slots_ != 0);
+  if (fd_ < 0) {
+    dbgMsg("failed: open segment %s\n", path.c_str());
+    return false;
+  }
+
+  seg_start_ = stamp;
+  seg_time_ = 0;
+  seg_offset_ = 0;
+  frag_seq_ = 1;
+  index_.clear();
+  out_len_ = 0;
+
+  // init section
+  std::vector<unsigned char> b;
+  b.reserve(1024);
+  mp4Init(b, width_, height_, timescale_, sps_, pps_);
+
+  put(b.data(), b.size());
+  seg_offset_ = b.size();
+  seg_cnt_++;
+
+  // the event index of the segment
+  init_len_ = b.size();
+  path.replace(path.size() - 4, 4, ".evx");
+  evx_ = fopen(path.c_str(), "wb");
+  if (evx_ == nullptr) {
+    dbgMsg("failed: open event index %s\n", path.c_str());
+  } else {
+    RecEvents seg;
+    memset(&seg, 0, sizeof(seg));
+    seg.magic = rec_magic;
+    seg.version = rec_version;
+    seg.seg = seg_cur_;
+    seg.init_len = init_len_;
+    seg.timescale = timescale_;
+    seg.start = wall(stamp);
+    fwrite(&seg, sizeof(seg), 1, evx_);
+  }
+
+  return true;
+}
+
+bool Recorder::closeSegment() {
+
+  if (fd_ < 0) {
+    return true;
+  }
+
+  // key frame index, 'mfro' at the very end lets players find it
+  std::vector<unsigned char> b;
+  b.reserve(64 + index_.size() * 19);
+  size_t mfra = openBox(b, "mfra");
+  size_t tfra = openFullBox(b, "tfra", 1, 0);
+  put32(b, 1);
+  put32(b, 0);   // one byte traf, trun and sample numbers
+  put32(b, index_.size());
+  for (auto& idx : index_) {
+    put64(b, idx.time);
+    put64(b, idx.offset);
+    put8(b, 1);
+    put8(b, 1);
+    put8(b, 1);
+  }
+  closeBox(b, tfra);
+  size_t mfro = openFullBox(b, "mfro", 0, 0);
+  size_t mfra_size = b.size();
+  put32(b, 0);
+  closeBox(b, mfro);
+  closeBox(b, mfra);
+  patch32(b, mfra_size, b.size() - mfra);
+
+  bool res = put(b.data(), b.size()) && flush();
+  Storage::close(fd_);
+  fd_ = -1;
+  index_.clear();
+  if (evx_) {
+    fclose(evx_);
+    evx_ = nullptr;
+  }
+
+  if (slots_) {
+    Recorder::Slot& s = ring_[seg_cur_];
+    s.seq = ++ring_seq_;
+    s.start = wall(seg_start_);
+    s.pinned = seg_tracks_ ? wall(std::chrono::steady_clock::now()) + pin_ * 1000ll : 0;
+    saveRing();
+  }
+
+  return res;
+}
+
+bool Recorder::put(const unsigned char* data, size_t len) {
+
+  while (len > 0) {
+    size_t n = std::min(len, out_size_ - out_len_);
+    std::memcpy(out_buf_ + out_len_, data, n);
+    out_len_ += n;
+    data += n;
+    len -= n;
+    if (out_len_ == out_size_ && !flush()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Recorder::flush() {
+
+  if (fd_ < 0 || out_len_ == 0) {
+    out_len_ = 0;
+    return true;
+  }
+
+  // the writer copies it, past its cap this thread waits for the card
+  differ_write_.begin();
+  bool res = Storage::write(fd_, out_buf_, out_len_, true);
+  differ_write_.end();
+  if (!res) {
+    dbgMsg("failed: write segment\n");
+  } else {
+    byte_cnt_ += out_len_;
+  }
+  out_len_ = 0;
+  return res;
+}
+
+bool Recorder::waitingToRun() {
+
+  if (!record_on_) {
+
+    // create nal pool
+    dbgMsg("create nal pool\n");
+    for (unsigned int i = 0; i < nal_num_; i++) {
+      auto rec_nal = std::shared_ptr<Recorder::RecNal>(new RecNal(nal_len_));
+      nal_pool_.push(rec_nal);
+    }
+    nal_bytes_ = nal_num_ * nal_len_;
+
+    // aligned so every full chunk goes out in one piece
+    dbgMsg("create write buffer\n");
+    void* buf = nullptr;
+    if (posix_memalign(&buf, out_align_, out_size_) != 0) {
+      dbgMsg("failed: create write buffer\n");
+      return false;
+    }
+    out_buf_ = static_cast<unsigned char*>(buf);
+    out_len_ = 0;
+
+    annexb_.reset();
+    wait_key_ = true;
+
+    using namespace std::chrono;
+    offset_ms_ = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count() -
+      duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+    seen_.clear();
+
+    record_on_ = true;
+  }
+
+  return true;
+}
+
+bool Recorder::running() {
+
+  if (record_on_) {
+    Recorder::Seen s;
+    bool fresh = false;
+    while (seen_chan_.pop(s)) {
+      seen_.push_back(s);
+      fresh = true;
+    }
+
+    // boxes and tracks come from different threads
+    if (fresh) {
+      std::stable_sort(seen_.begin(), seen_.end(),
+          [](const Recorder::Seen& a, const Recorder::Seen& b) { return a.stamp < b.stamp; });
+    }
+    while (seen_.size() > seen_max_) {
+      seen_.pop_front();
+    }
+
+    std::shared_ptr<Recorder::RecNal> rec_nal;
+    while (nal_work_.pop(rec_nal)) {
+      if (rec_nal->gap) {
+        annexb_.reset();
+        closeFragment(rec_nal->stamp);
+        wait_key_ = true;
+      }
+      parse(rec_nal->nal.data(), rec_nal->length, rec_nal->stamp);
+      nal_pool_.push(rec_nal);
+    }
+  }
+  return true;
+}
+
+bool Recorder::paused() {
+  return true;
+}
+
+bool Recorder::waitingToHalt() {
+
+  if (record_on_) {
+    record_on_ = false;
+
+    // finish what the encoder already handed over
+    std::shared_ptr<Recorder::RecNal> rec_nal;
+    while (nal_work_.pop(rec_nal)) {
+      parse(rec_nal->nal.data(), rec_nal->length, rec_nal->stamp);
+    }
+    annexb_.flush(
+        [this](std::vector<unsigned char>& nal, std::chrono::steady_clock::time_point at) {
+          handleNal(nal, at);
+        });
+    closeFragment({});
+    closeSegment();
+    pre_.clear();
+    pre_bytes_ = 0;
+    pre_num_ = 0;
+
+    while (nal_pool_.pop(rec_nal)) {
+    }
+    nal_bytes_ = 0;
+    free(out_buf_);
+    out_buf_ = nullptr;
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nRecorder Results...\n");
+      fprintf(stderr, "  write time   (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_write_.pct(.5), differ_write_.pct(.9), differ_write_.pct(.99), differ_write_.pct(.999),
+          differ_write_.high, differ_write_.avg,
+          differ_write_.low, differ_write_.cnt);
+      fprintf(stderr, "  fragment latency (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_late_.pct(.5), differ_late_.pct(.9), differ_late_.pct(.99), differ_late_.pct(.999),
+          differ_late_.high, differ_late_.avg,
+          differ_late_.low, differ_late_.cnt);
+      if (event_quiet_ != 0) {
+        fprintf(stderr, "         clips: %u\n", clip_cnt_);
+      }
+      fprintf(stderr, "      segments: %u\n", seg_cnt_);
+      fprintf(stderr, "     fragments: %u\n", frag_cnt_);
+      fprintf(stderr, "  events indexed: %u\n", event_cnt_);
+      fprintf(stderr, "  bytes written: %llu\n",
+          static_cast<unsigned long long>(byte_cnt_));
+      fprintf(stderr, "  nals dropped: %u\n", nal_drops_.load());
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
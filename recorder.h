@@ -0,0 +1,293 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Fragmented MP4 recorder.
+ *
+ *  The encoder hands over its NALs and goes back to work.  This thread
+ *  muxes them into rolling segment files ('<output>-00000.mp4', ...) that
+ *  each start on a key frame.  Every segment is an init section followed
+ *  by one fragment per GOP (or per second if the GOP is longer) and ends
+ *  with an 'mfra' key frame index so players can seek.  Writes go to the
+ *  storage writer (see storage.h) in large chunks so a slow card only
+ *  ever stalls this thread.
+ *
+ *  With a quiet time set only clips around detections are recorded.  The
+ *  finished fragments of the last few GOPs wait in memory as pre-roll.  A
+ *  detection opens a clip that starts with the pre-roll and the clip is
+ *  closed once nothing has been seen for the quiet time.
+ *
+ *  Next to each segment '<output>-00000.evx' indexes what was seen in
+ *  it: a RecEvents header and then a RecEvent for each track that
+ *  starts and, at most once a second for each class, a detection, with
+ *  the byte offset and time of the key frame fragment in front of it.
+ *  A client fetches the init section, bytes [0, init_len), and the
+ *  fragments from 'key_offset' on, and plays from 'event_time', without
+ *  scanning the segment.  'events' reads them back.
+ *
+ *  With a retention set the segments are a fixed ring of 'slots' files
+ *  on the card, each new segment written over the oldest in place, so a
+ *  full card never needs a directory scan or a burst of unlinks.  A
+ *  segment that had tracks in it is pinned for 'pin' sec and skipped
+ *  while the others go round, as long as no more than half the ring is
+ *  pinned.  The ring, each slot's age and pin, is kept in '<output>.ring'
+ *  so it carries on across runs.
+ */
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <cstdint>
+
+#include "utils.h"
+#include "listener.h"
+#include "channel.h"
+#include "base.h"
+#include "reserve.h"
+#include "mp4.h"
+
+namespace detector {
+
+const uint32_t rec_magic = 0x44455658;    // "DEVX"
+const uint32_t rec_version = 1;
+
+class RecEvents {
+  public:
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seg;
+    uint32_t init_len;        // bytes
+    uint32_t timescale;
+    uint32_t pad;
+    int64_t start;            // wall clock msec of the segment's first frame
+};
+
+class RecEvent {
+  public:
+    enum Kind : uint8_t {
+      kDetect = 0,
+      kTrack
+    };
+  public:
+    int64_t stamp;            // wall clock msec at capture
+    uint32_t id;              // the frame's or the track's
+    uint8_t kind;
+    uint8_t type;             // BoxBuf::Type
+    uint16_t pad;
+    uint64_t key_offset;      // bytes
+    uint64_t key_time;        // timescale units into the segment
+    uint64_t event_time;
+};
+
+class Recorder : public Base, 
+  Listener<NalBuf>,
+  Listener<std::shared_ptr<std::vector<BoxBuf>>>,
+  Listener<std::shared_ptr<std::vector<TrackBuf>>> {
+  public:
+    static std::unique_ptr<Recorder> create(unsigned int yield_time, bool quiet,
+        std::string& output, unsigned int framerate, unsigned int width,
+        unsigned int height, unsigned int segment, unsigned int event_quiet,
+        unsigned int preroll);
+    virtual ~Recorder();
+
+  public:
+    virtual bool addMessage(NalBuf& nal);
+    virtual unsigned int credits(const NalBuf& next) { return nal_pool_.size(); }
+
+    // the nal pool and what it holds on to
+    virtual void footprint(Footprint& out);
+    virtual bool addMessage(std::shared_ptr<std::vector<BoxBuf>>& targets);
+    virtual bool addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks);
+
+    // a ring of 'slots' segments 'len' bytes or so each, set before start
+    void setRetention(unsigned int slots, unsigned int pin, uint64_t len);
+
+    // the indexed events of the segments of 'output' in [from, to) wall
+    // clock msec, segment by segment, with the segment's file, until 'fn'
+    // returns false
+    static bool events(const std::string& output, int64_t from, int64_t to,
+        const std::function<bool(const std::string& path, const RecEvents& seg,
+          const RecEvent& event)>& fn);
+
+  protected:
+    Recorder() = delete;
+    Recorder(unsigned int yield_time);
+    bool init(bool quiet, std::string& output, unsigned int framerate,
+        unsigned int width, unsigned int height, unsigned int segment,
+        unsigned int event_quiet, unsigned int preroll);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    std::string output_;
+    unsigned int framerate_;
+    unsigned int width_;
+    unsigned int height_;
+    unsigned int segment_;       // sec, 0 never splits a clip
+    unsigned int event_quiet_;   // sec, 0 records all the time
+    unsigned int preroll_;       // sec
+
+    class RecNal {
+      public:
+        RecNal() = delete;
+        RecNal(unsigned int len)
+          : length(len), nal(len), gap(false) {}
+        ~RecNal() {}
+      public:
+        unsigned int length;
+        Bytes nal;
+        std::chrono::steady_clock::time_point stamp;
+        bool gap;   // nals were lost in front of this one
+    };
+    const unsigned int nal_num_ = {64};
+    const unsigned int nal_len_ = {64 * 1024};
+    Channel<std::shared_ptr<Recorder::RecNal>> nal_pool_{nal_num_,
+      Channel<std::shared_ptr<Recorder::RecNal>>::Policy::kDropNewest};
+    Channel<std::shared_ptr<Recorder::RecNal>> nal_work_{nal_num_,
+      Channel<std::shared_ptr<Recorder::RecNal>>::Policy::kDropNewest};
+    std::atomic<size_t> nal_bytes_{0};   // the pool's, grown nals included
+    std::atomic<bool> nal_gap_;
+    std::atomic<unsigned int> nal_drops_;
+
+    AnnexB annexb_;
+    void parse(const unsigned char* data, unsigned int len,
+        std::chrono::steady_clock::time_point stamp);
+    void handleNal(std::vector<unsigned char>& nal,
+        std::chrono::steady_clock::time_point stamp);
+
+    std::vector<unsigned char> sps_;
+    std::vector<unsigned char> pps_;
+    std::vector<unsigned char> sei_;    // goes in with the next picture
+
+    // samples of the open fragment, length prefixed in 'mdat_'
+    std::vector<Mp4Sample> samples_;
+    std::vector<unsigned char> mdat_;
+    bool wait_key_;
+    const unsigned int timescale_ = {90000};
+    const unsigned int frag_time_ = {1000};   // msec
+    void closeFragment(std::chrono::steady_clock::time_point next);
+
+    class Fragment {
+      public:
+        std::vector<Mp4Sample> samples;
+        std::vector<unsigned char> mdat;
+        std::chrono::steady_clock::time_point end;
+    };
+    bool writeFragment(Recorder::Fragment& frag);
+
+    // finished fragments waiting for a detection, always starts on a key frame
+    std::deque<Recorder::Fragment> pre_;
+    std::atomic<unsigned int> pre_num_;
+    std::atomic<size_t> pre_bytes_;
+    const size_t pre_max_ = {32 * 1024 * 1024};
+    void trimPreroll();
+
+    // last detection, steady clock ticks
+    std::atomic<int64_t> event_;
+    bool eventActive();
+    void trigger();
+
+    // key frame index of the open segment
+    class Index {
+      public:
+        uint64_t time;
+        uint64_t offset;
+    };
+    std::vector<Recorder::Index> index_;
+
+    // what was seen, waiting for the fragment it falls in
+    class Seen {
+      public:
+        std::chrono::steady_clock::time_point stamp;
+        unsigned int id;
+        RecEvent::Kind kind;
+        BoxBuf::Type type;
+    };
+    Channel<Recorder::Seen> seen_chan_{256, Channel<Recorder::Seen>::Policy::kDropOldest};
+    std::deque<Recorder::Seen> seen_;
+    const unsigned int seen_max_ = {1024};
+    std::chrono::steady_clock::time_point box_at_[4];    // on the posting thread
+    std::vector<unsigned int> last_ids_, next_ids_;        // the same
+    FILE* evx_;
+    uint32_t init_len_;
+    int64_t offset_ms_;       // steady clock to wall clock
+    int64_t wall(std::chrono::steady_clock::time_point stamp);
+    void indexEvents(const Recorder::Fragment& frag, uint64_t time, uint64_t offset);
+
+    int fd_;                  // a storage file
+    uint64_t seg_chunk_;     // reserved at a time
+    unsigned int seg_num_;
+    unsigned int seg_cur_;
+    unsigned int seg_tracks_;   // track starts in the open segment
+    uint32_t frag_seq_;
+    uint64_t seg_time_;       // timescale units
+    uint64_t seg_offset_;     // bytes
+    std::chrono::steady_clock::time_point seg_start_;
+    bool openSegment(std::chrono::steady_clock::time_point stamp);
+    bool closeSegment();
+
+    // the retention ring, slot by slot
+    class Slot {
+      public:
+        uint32_t seq;           // 0 never written
+        uint32_t pad;
+        int64_t start;          // wall clock msec
+        int64_t pinned;         // wall clock msec, 0 not pinned
+    };
+    unsigned int slots_;        // 0 numbers segments on from 0
+    unsigned int pin_;          // sec
+    uint32_t ring_seq_;
+    std::vector<Recorder::Slot> ring_;
+    unsigned int pickSlot(int64_t now);
+    bool loadRing();
+    void saveRing();
+
+    // aligned write buffer
+    const size_t out_align_ = {4096};
+    const size_t out_size_ = {1024 * 1024};
+    unsigned char* out_buf_;
+    size_t out_len_;
+    bool put(const unsigned char* data, size_t len);
+    bool flush();
+
+    std::atomic<bool> record_on_;
+
+    unsigned int seg_cnt_;
+    unsigned int clip_cnt_;
+    unsigned int frag_cnt_;
+    unsigned int event_cnt_;
+    uint64_t byte_cnt_;
+    MicroDiffer<uint32_t> differ_write_;
+    MicroDiffer<uint32_t> differ_late_;
+};
+
+} // namespace detector
+
+#endif // RECORDER_H
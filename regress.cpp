@@ -0,0 +1,167 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <cstdlib>
+#include <sstream>
+
+#include "regress.h"
+#include "metrics.h"
+
+namespace detector {
+
+std::chrono::steady_clock::time_point Regress::start_;
+struct rusage Regress::usage_;
+
+static double cpuSecs(const struct rusage& ru) {
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+void Regress::mark() {
+  start_ = std::chrono::steady_clock::now();
+  getrusage(RUSAGE_SELF, &usage_);
+}
+
+std::string Regress::label(const std::string& labels, const char* key) {
+  std::string pat = std::string(key) + "=\"";
+  size_t at = labels.find(pat);
+  if (at == std::string::npos) {
+    return "";
+  }
+  at += pat.size();
+  size_t end = labels.find('"', at);
+  return (end == std::string::npos) ? "" : labels.substr(at, end - at);
+}
+
+bool Regress::write(Pipeline& pipe, const std::string& path) {
+
+  using namespace std::chrono;
+  double secs = duration_cast<duration<double>>(steady_clock::now() - start_).count();
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+
+  std::map<std::string, double> vals;
+  vals["secs"] = secs;
+  vals["cpu_pct"] = secs > 0.0 ? (cpuSecs(ru) - cpuSecs(usage_)) * 100.0 / secs : 0.0;
+  vals["rss_mb"] = ru.ru_maxrss / 1024.0;
+
+  // the samples the metrics endpoint would hand out right now
+  Exposition exp;
+  pipe.metrics(exp);
+  std::istringstream lines(exp.str());
+  std::string line;
+  double buffers = 0.0;
+  while (std::getline(lines, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    size_t open = line.find('{');
+    size_t close = line.rfind('}');
+    size_t space = line.rfind(' ');
+    if (open == std::string::npos || close == std::string::npos || space < close) {
+      continue;
+    }
+    std::string name = line.substr(0, open);
+    std::string labels = line.substr(open + 1, close - open - 1);
+    double val = strtod(line.c_str() + space + 1, nullptr);
+    std::string stage = label(labels, "stage");
+
+    if (name == "detector_frames_total" || name == "detector_inferences_total" ||
+        name == "detector_frames_encoded_total") {
+      vals["fps." + stage] = secs > 0.0 ? val / secs : 0.0;
+    } else if (name == "detector_latency_us" && label(labels, "quantile") == "0.99") {
+      std::string step = label(labels, "step");
+      std::string stream = label(labels, "stream");
+      vals["p99_us." + stage + (stream.empty() ? "" : "." + stream) + "." + step] = val;
+    } else if (name == "detector_memory_bytes") {
+      buffers += val;
+    }
+  }
+  vals["buffers_mb"] = buffers / 1048576.0;
+
+  FILE* fd = fopen(path.c_str(), "w");
+  if (!fd) {
+    fprintf(stderr, "can't write %s\n", path.c_str());
+    return false;
+  }
+  for (auto& v : vals) {
+    fprintf(fd, "%s %.3f\n", v.first.c_str(), v.second);
+  }
+  fclose(fd);
+  return true;
+}
+
+bool Regress::load(const std::string& path, std::map<std::string, double>& vals) {
+  FILE* fd = fopen(path.c_str(), "r");
+  if (!fd) {
+    return false;
+  }
+  char key[256];
+  double val;
+  while (fscanf(fd, "%255s %lf", key, &val) == 2) {
+    vals[key] = val;
+  }
+  fclose(fd);
+  return true;
+}
+
+bool Regress::compare(const std::string& path, const std::string& base, float tol) {
+
+  std::map<std::string, double> now, was;
+  if (!load(path, now)) {
+    fprintf(stderr, "can't read %s\n", path.c_str());
+    return false;
+  }
+  if (!load(base, was)) {
+    fprintf(stderr, "no baseline %s, 'make regress-baseline' stores one\n", base.c_str());
+    return false;
+  }
+
+  fprintf(stderr, "\n%-36s %12s %12s %8s\n", base.c_str(), "baseline", "now", "change");
+  unsigned int fails = 0;
+  for (auto& w : was) {
+    const std::string& key = w.first;
+    if (key == "secs") {
+      continue;
+    }
+    auto it = now.find(key);
+    if (it == now.end()) {
+      fprintf(stderr, "%-36s %12.1f %12s %8s  MISSING\n", key.c_str(), w.second, "-", "");
+      fails++;
+      continue;
+    }
+
+    // rates have to hold up, the rest must not grow past the noise
+    double floor = (key.compare(0, 4, "fps.") == 0) ? 0.5 :
+      (key.compare(0, 7, "p99_us.") == 0) ? 1000.0 :
+      (key == "cpu_pct") ? 5.0 : 4.0;
+    double diff = it->second - w.second;
+    bool fail = (key.compare(0, 4, "fps.") == 0) ?
+      (-diff > w.second * tol / 100.0 && -diff > floor) :
+      (diff > w.second * tol / 100.0 && diff > floor);
+    fprintf(stderr, "%-36s %12.1f %12.1f %7.1f%%%s\n", key.c_str(), w.second, it->second,
+        w.second != 0.0 ? diff * 100.0 / w.second : 0.0, fail ? "  REGRESSED" : "");
+    fails += fail ? 1 : 0;
+  }
+  fprintf(stderr, "%s: %u of %zu worse than %.0f%%\n\n", fails ? "failed" : "passed",
+      fails, was.size() - (was.count("secs") ? 1 : 0), tol);
+  return fails == 0;
+}
+
+} // namespace detector
@@ -0,0 +1,72 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Performance regression results (make regress).
+ *
+ *  With --results the run's numbers are written just before the stages
+ *  stop, one 'key value' per line, taken from the same samples as the
+ *  metrics endpoint:
+ *
+ *    secs              since the pipeline was running
+ *    fps.<stage>       frames captured, inferred or encoded per second
+ *    p99_us.<stage>.<step>   every latency summary the stages keep
+ *    cpu_pct           user and system time over the run, 100 a core
+ *    rss_mb            peak resident set
+ *    buffers_mb        what the stages' pools hold, see Base::footprint
+ *
+ *  With --baseline file[,tol] they are compared with a stored run.  A
+ *  rate more than 'tol' percent (10) lower, or anything else more than
+ *  'tol' higher and past a small floor for noise, fails the run, and so
+ *  does a key the baseline has and this run doesn't.
+ */
+
+#ifndef REGRESS_H
+#define REGRESS_H
+
+#include <string>
+#include <map>
+#include <chrono>
+#include <sys/resource.h>
+
+#include "utils.h"
+#include "pipeline.h"
+
+namespace detector {
+
+class Regress {
+  public:
+    // the run starts here, once the pipeline is running
+    static void mark();
+
+    static bool write(Pipeline& pipe, const std::string& path);
+    static bool compare(const std::string& path, const std::string& base, float tol);
+
+  private:
+    Regress() = delete;
+
+    static bool load(const std::string& path, std::map<std::string, double>& vals);
+    static std::string label(const std::string& labels, const char* key);
+
+    static std::chrono::steady_clock::time_point start_;
+    static struct rusage usage_;
+};
+
+} // namespace detector
+
+#endif // REGRESS_H
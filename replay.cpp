@@ -0,0 +1,358 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "replay.h"
+#include "frames.h"
+#include "metrics.h"
+#include "startup.h"
+#include "deadline.h"
+
+namespace detector {
+
+Replay::Replay(unsigned int yield_time) 
+  : Base(yield_time) {
+}
+
+Replay::~Replay() {
+}
+
+std::unique_ptr<Replay> Replay::create(unsigned int yield_time, bool quiet, 
+    Encoder* enc, Tflow* tfl, const char* path, unsigned int framerate, 
+    unsigned int width, unsigned int height, unsigned int pix_fmt, bool fast) {
+  auto obj = std::unique_ptr<Replay>(new Replay(yield_time));
+  obj->init(quiet, enc, tfl, path, framerate, width, height, pix_fmt, fast);
+  return obj;
+}
+
+void Replay::setPublisher(Publisher* pub) {
+  pub_ = pub;
+}
+
+void Replay::setLockstep(const std::vector<Base*>& stages) {
+  lockstep_ = true;
+  lock_stages_.clear();
+  for (auto stage : stages) {
+    if (stage) {
+      lock_stages_.push_back(stage);
+    }
+  }
+}
+
+void Replay::metrics(Exposition& out, const std::string& labels) {
+  out.counter("detector_frames_total", "frames captured", labels, frame_cnt_);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"tflow_copy\"", differ_tfl_.hist);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"encode_copy\"", differ_enc_.hist);
+}
+
+void Replay::footprint(Footprint& out) {
+
+  // the file's pages, the kernel can drop them again
+  out.add("replay_mmap", map_ ? frame_num_ : 0, map_ ? map_len_ : 0);
+  {
+    std::unique_lock<std::mutex> lck(copy_lock_);
+    out.add("replay_copies", copies_.size(), copies_.size() * static_cast<size_t>(frame_len_));
+  }
+  size_t num, bytes;
+  pyr_->footprint(num, bytes);
+  out.add("pyramid", num, bytes);
+}
+
+bool Replay::init(bool quiet, Encoder* enc, Tflow* tfl, const char* path, 
+    unsigned int framerate, unsigned int width, unsigned int height, 
+    unsigned int pix_fmt, bool fast) {
+
+  quiet_ = quiet;
+  enc_ = enc;
+  tfl_ = tfl;
+  pub_ = nullptr;
+  path_ = path;
+  framerate_ = framerate ? framerate : 1;
+  width_ = width;
+  height_ = height;
+  pix_fmt_ = pix_fmt;
+  fast_ = fast;
+
+  if (pix_fmt_ == V4L2_PIX_FMT_YUV420) {
+    frame_len_ = ALIGN_16B(width_) * ALIGN_16B(height_) * 3 / 2;
+  } else {
+    frame_len_ = ALIGN_16B(width_) * ALIGN_16B(height_) * 3;
+  }
+
+  pyr_ = Pyramid::create(width_, height_, pix_fmt_);
+
+  fd_ = -1;
+  map_ = nullptr;
+  map_len_ = 0;
+  frame_num_ = 0;
+  frame_idx_ = 0;
+  frame_cnt_ = 0;
+  first_ms_ = -1;
+  held_ = 0;
+  copies_.reserve(copy_max_);
+  lockstep_ = false;
+  lock_waiting_ = false;
+  stall_cnt_ = 0;
+  replay_on_ = false;
+
+  return true;
+}
+
+bool Replay::waitingToRun() {
+
+  if (!replay_on_) {
+
+    // map the whole file, read only, the consumers get copies
+    dbgMsg("open replay file\n");
+    fd_ = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ == -1) {
+      dbgMsg("failed: open replay file %s\n", path_.c_str());
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd_, &st) < 0) {
+      dbgMsg("failed: stat replay file (errno: %d)\n", errno);
+      close(fd_);
+      fd_ = -1;
+      return false;
+    }
+    frame_num_ = st.st_size / frame_len_;
+    if (frame_num_ == 0) {
+      dbgMsg("replay file holds no whole frames\n");
+      close(fd_);
+      fd_ = -1;
+      return false;
+    }
+    map_len_ = static_cast<size_t>(frame_num_) * frame_len_;
+    void* addr = mmap(NULL, map_len_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (addr == MAP_FAILED) {
+      dbgMsg("failed: map replay file (errno: %d)\n", errno);
+      close(fd_);
+      fd_ = -1;
+      return false;
+    }
+    map_ = static_cast<unsigned char*>(addr);
+    madvise(map_, map_len_, MADV_SEQUENTIAL);
+
+    frame_idx_ = 0;
+    due_ = std::chrono::steady_clock::now();
+
+    differ_tot_.begin();
+    replay_on_ = true;
+  }
+
+  return true;
+}
+
+// a free copy, or a new one while there are fewer than 'copy_max_'
+bool Replay::takeCopy(unsigned int& copy) {
+  std::unique_lock<std::mutex> lck(copy_lock_);
+  if (!copy_free_.empty()) {
+    copy = copy_free_.back();
+    copy_free_.pop_back();
+    return true;
+  }
+  if (copies_.size() < copy_max_) {
+    copy = copies_.size();
+    copies_.emplace_back(frame_len_);
+    return true;
+  }
+  return false;
+}
+
+void Replay::release(unsigned int copy) {
+  {
+    std::unique_lock<std::mutex> lck(copy_lock_);
+    copy_free_.push_back(copy);
+  }
+  held_--;
+  wake();
+}
+
+// the last frame is let go of and nothing it made is still on its way
+bool Replay::settled() {
+
+  bool idle = held_ == 0;
+  for (auto stage : lock_stages_) {
+    idle = idle && stage->pending() == 0;
+  }
+  if (idle) {
+    lock_waiting_ = false;
+    return true;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  if (!lock_waiting_) {
+    lock_waiting_ = true;
+    lock_wait_ = now;
+  } else if (now - lock_wait_ > std::chrono::milliseconds(release_timeout_)) {
+    dbgMsg("lockstep stall at frame %u\n", frame_cnt_);
+    lock_waiting_ = false;
+    stall_cnt_++;
+    return true;
+  }
+  return false;
+}
+
+bool Replay::running() {
+
+  if (replay_on_) {
+
+    using namespace std::chrono;
+    auto now = steady_clock::now();
+    if (lockstep_) {
+      if (!settled()) {
+        return true;
+      }
+      now = lock_epoch_ + duration_cast<steady_clock::duration>(
+          duration<double>(static_cast<double>(frame_cnt_) / framerate_));
+      pipeline_step(now);
+    } else if (!fast_ && now < due_) {
+      return true;
+    }
+
+    // every copy still out, the frame waits for one to come back
+    unsigned int copy;
+    if (!takeCopy(copy)) {
+      return true;
+    }
+    unsigned char* addr = copies_[copy].data();
+    std::memcpy(addr, map_ + static_cast<size_t>(frame_idx_) * frame_len_, frame_len_);
+
+    FrameBuf fbuf;
+    fbuf.id = frame_cnt_;
+    fbuf.length = frame_len_;
+    fbuf.addr = addr;
+    fbuf.fd = -1;
+    fbuf.stamp = now;
+    held_++;
+    Frames::wrap(fbuf, [this, copy]() { release(copy); });
+    fbuf.levels = pyr_->make(fbuf.addr);
+
+    // fast mode is paced by the encoder, the frame waits until it fits
+    if (enc_) {
+      differ_enc_.begin();
+      fbuf.deadline = Deadline::forEncoder(fbuf.stamp);
+      bool res = enc_->addMessage(fbuf);
+      differ_enc_.end();
+      if ((fast_ || lockstep_) && !res) {
+        fbuf.ref.reset();
+        return true;
+      }
+    }
+
+    if (tfl_) {
+      differ_tfl_.begin();
+      fbuf.deadline = Deadline::forTflow(fbuf.stamp);
+      tfl_->addMessage(fbuf);
+      differ_tfl_.end();
+    }
+
+    if (pub_) {
+      pub_->addMessage(fbuf);
+    }
+
+    fbuf.ref.reset();
+
+    if (first_ms_ < 0) {
+      first_ms_ = since_start_ms();
+      Startup::ready(Startup::kFrame);
+    }
+    frame_cnt_++;
+    frame_idx_ = (frame_idx_ + 1) % frame_num_;
+    due_ += duration_cast<steady_clock::duration>(
+        duration<double>(1.0 / framerate_));
+    if (due_ < now) {
+      due_ = now;
+    }
+  }
+  return true;
+}
+
+bool Replay::paused() {
+  return true;
+}
+
+bool Replay::waitingToHalt() {
+
+  if (replay_on_) {
+
+    replay_on_ = false;
+    differ_tot_.end();
+
+    // wait for consumers to let go, a copy still held comes back whenever
+    dbgMsg("wait for held frames\n");
+    auto limit = std::chrono::steady_clock::now() + 
+      std::chrono::milliseconds(release_timeout_);
+    while (held_ != 0 && std::chrono::steady_clock::now() < limit) {
+      std::this_thread::sleep_for(std::chrono::microseconds(yield_time_));
+    }
+    if (held_ != 0) {
+      dbgMsg("warning: %u frames still held\n", static_cast<unsigned int>(held_));
+    }
+    if (map_ != nullptr) {
+      munmap(map_, map_len_);
+      map_ = nullptr;
+    }
+    if (fd_ != -1) {
+      close(fd_);
+      fd_ = -1;
+    }
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\n\nReplay Results...\n");
+      fprintf(stderr, "        frames replayed: %d\n", frame_cnt_); 
+      fprintf(stderr, "         frames in file: %d\n", frame_num_); 
+      if (lockstep_) {
+        fprintf(stderr, "        lockstep stalls: %u%s\n", stall_cnt_,
+            stall_cnt_ ? " (not comparable)" : "");
+      }
+      fprintf(stderr, " first frame (ms start): %d\n", first_ms_);
+      fprintf(stderr, "   tflow copy time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_tfl_.pct(.5), differ_tfl_.pct(.9), differ_tfl_.pct(.99), differ_tfl_.pct(.999),
+          differ_tfl_.high, differ_tfl_.avg, 
+          differ_tfl_.low,  differ_tfl_.cnt);
+      fprintf(stderr, "  encode copy time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_enc_.pct(.5), differ_enc_.pct(.9), differ_enc_.pct(.99), differ_enc_.pct(.999),
+          differ_enc_.high, differ_enc_.avg, 
+          differ_enc_.low,  differ_enc_.cnt);
+      fprintf(stderr, "        total test time: %f sec\n", 
+          differ_tot_.avg / 1000000.f);
+      fprintf(stderr, "      frames per second: %f fps\n", 
+          frame_cnt_ * 1000000.f / differ_tot_.avg);
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
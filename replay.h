@@ -0,0 +1,142 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Stand-in for the Capturer that plays back a file of raw frames.
+ *
+ *  Frames are back to back at the pipeline's aligned frame size in the
+ *  pipeline's pixel format (what CAPTURE_ONE_RAW_FRAME writes).  The file
+ *  is mapped copy-on-write and frames are handed out in place, looping at
+ *  the end.  They go out at the framerate, or in fast mode as quickly as
+ *  the encoder takes them.
+ *
+ *  In lockstep a frame goes out only once the last one has been let go of
+ *  and the stages given with 'setLockstep' have nothing pending, so each
+ *  frame's results are applied to that frame and the stages take their
+ *  turns in the same order every run.  Capture times are made up from
+ *  the frame count and the framerate and the pipeline's clock is stepped
+ *  to them (see pipeline_now), so two runs of the same clip give the same
+ *  detections, tracks and bitstream.  That wants every frame detected:
+ *  no detection rate and no motion gate.  A frame not let go of in time
+ *  is a stall, counted and reported, and the run after it can't be
+ *  compared.
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <string>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <vector>
+
+#include "utils.h"
+#include "listener.h"
+#include "base.h"
+#include "encoder.h"
+#include "tflow.h"
+#include "publish.h"
+#include "pyramid.h"
+
+namespace detector {
+
+class Replay : public Base {
+  public:
+    static std::unique_ptr<Replay> create(unsigned int yield_time, bool quiet, 
+        Encoder* enc, Tflow* tfl, const char* path, unsigned int framerate, 
+        unsigned int width, unsigned int height, unsigned int pix_fmt, bool fast);
+    virtual ~Replay();
+
+    // frames also go to the shared memory publisher
+    void setPublisher(Publisher* pub);
+
+    // one frame at a time through these, see above, set before start
+    void setLockstep(const std::vector<Base*>& stages);
+
+    // the metrics endpoint's samples
+    virtual void metrics(Exposition& out, const std::string& labels);
+    virtual void footprint(Footprint& out);
+
+  protected:
+    Replay() = delete;
+    Replay(unsigned int yield_time);
+    bool init(bool quiet, Encoder* enc, Tflow* tfl, const char* path, 
+        unsigned int framerate, unsigned int width, unsigned int height, 
+        unsigned int pix_fmt, bool fast);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    Encoder* enc_;
+    Tflow* tfl_;
+    Publisher* pub_;
+    std::string path_;
+    unsigned int framerate_;
+    unsigned int width_;
+    unsigned int height_;
+    unsigned int pix_fmt_;
+    bool fast_;
+
+    int fd_;
+    unsigned char* map_;
+    size_t map_len_;
+    unsigned int frame_len_;
+    unsigned int frame_num_;
+    unsigned int frame_idx_;
+    unsigned int frame_cnt_;
+    int first_ms_;
+    std::chrono::steady_clock::time_point due_;
+    std::unique_ptr<Pyramid> pyr_;
+
+    std::atomic<unsigned int> held_;
+    const unsigned int release_timeout_ = {2000};  // msec
+
+    // consumers draw on the frames, so each gets a copy of the file's.
+    // they are made as needed up to 'copy_max_' and kept for the next run.
+    const unsigned int copy_max_ = {8};
+    std::mutex copy_lock_;
+    std::vector<std::vector<unsigned char>> copies_;
+    std::vector<unsigned int> copy_free_;
+    bool takeCopy(unsigned int& copy);
+    void release(unsigned int copy);
+
+    bool lockstep_;
+    std::vector<Base*> lock_stages_;
+    const std::chrono::steady_clock::time_point lock_epoch_{std::chrono::seconds(1)};
+    std::chrono::steady_clock::time_point lock_wait_;
+    bool lock_waiting_;
+    unsigned int stall_cnt_;
+    bool settled();
+
+    std::atomic<bool> replay_on_;
+
+    MicroDiffer<uint32_t> differ_enc_;
+    MicroDiffer<uint32_t> differ_tfl_;
+    MicroDiffer<uint32_t> differ_tot_;
+};
+
+} // namespace detector
+
+#endif // REPLAY_H
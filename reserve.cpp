@@ -0,0 +1,162 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdlib.h>
+#include <new>
+#include <sys/mman.h>
+
+#include "utils.h"
+#include "reserve.h"
+
+namespace detector {
+
+std::mutex Reserve::lock_;
+unsigned char* Reserve::map_(nullptr);
+size_t Reserve::next_(0);
+std::map<size_t, std::vector<void*>> Reserve::free_;
+Reserve::Stats Reserve::stats_{};
+
+static const size_t huge_len = 2 << 20;
+
+bool Reserve::start(size_t len, bool huge, bool lock) {
+
+  std::unique_lock<std::mutex> lck(lock_);
+  if (map_ || len == 0) {
+    return !map_;
+  }
+
+  // populated now, not on first touch
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+  void* map = MAP_FAILED;
+  stats_.huge = false;
+  if (huge) {
+    len = (len + huge_len - 1) & ~(huge_len - 1);
+    map = mmap(nullptr, len, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    stats_.huge = (map != MAP_FAILED);
+  } else {
+    len = (len + kAlign - 1) & ~(kAlign - 1);
+  }
+  if (map == MAP_FAILED) {
+    map = mmap(nullptr, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (map == MAP_FAILED) {
+      dbgMsg("could not map %zu bytes\n", len);
+      return false;
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge) {
+      madvise(map, len, MADV_HUGEPAGE);
+    }
+#endif
+  }
+
+  // a failed lock leaves it mapped, just not pinned
+  stats_.locked = false;
+  if (lock) {
+    stats_.locked = (mlock(map, len) == 0);
+    if (!stats_.locked) {
+      dbgMsg("could not lock %zu bytes, see ulimit -l\n", len);
+    }
+  }
+
+  map_ = static_cast<unsigned char*>(map);
+  next_ = 0;
+  stats_.len = len;
+  stats_.used = 0;
+  return true;
+}
+
+void Reserve::stop() {
+
+  std::unique_lock<std::mutex> lck(lock_);
+  if (!map_) {
+    return;
+  }
+
+  // blocks still out keep it mapped
+  if (stats_.blocks != stats_.spilled_blocks) {
+    dbgMsg("%u blocks still held, left mapped\n", stats_.blocks - stats_.spilled_blocks);
+    return;
+  }
+  free_.clear();
+  if (stats_.locked) {
+    munlock(map_, stats_.len);
+  }
+  munmap(map_, stats_.len);
+  map_ = nullptr;
+  next_ = 0;
+  stats_.len = 0;
+  stats_.locked = false;
+  stats_.huge = false;
+}
+
+void* Reserve::alloc(size_t len) {
+
+  len = (len + kAlign - 1) & ~(kAlign - 1);
+  if (len == 0) {
+    len = kAlign;
+  }
+  std::unique_lock<std::mutex> lck(lock_);
+  void* ptr = nullptr;
+  auto it = free_.find(len);
+  if (it != free_.end() && !it->second.empty()) {
+    ptr = it->second.back();
+    it->second.pop_back();
+  } else if (map_ && next_ + len <= stats_.len) {
+    ptr = map_ + next_;
+    next_ += len;
+    stats_.used += len;
+  } else {
+    if (posix_memalign(&ptr, kAlign, len) != 0) {
+      throw std::bad_alloc();
+    }
+    stats_.spilled += len;
+    stats_.spilled_blocks++;
+  }
+  stats_.held += len;
+  stats_.blocks++;
+  return ptr;
+}
+
+void Reserve::release(void* ptr, size_t len) {
+
+  if (!ptr) {
+    return;
+  }
+  len = (len + kAlign - 1) & ~(kAlign - 1);
+  if (len == 0) {
+    len = kAlign;
+  }
+  std::unique_lock<std::mutex> lck(lock_);
+  auto at = static_cast<unsigned char*>(ptr);
+  if (map_ && at >= map_ && at < map_ + stats_.len) {
+    free_[len].push_back(ptr);
+  } else {
+    free(ptr);
+    stats_.spilled -= len;
+    stats_.spilled_blocks--;
+  }
+  stats_.held -= len;
+  stats_.blocks--;
+}
+
+Reserve::Stats Reserve::stats() {
+  std::unique_lock<std::mutex> lck(lock_);
+  return stats_;
+}
+
+} // namespace detector
@@ -0,0 +1,105 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Reserved memory for the big buffers.
+ *
+ *  The frame sized and nal sized buffers the stages hold for the whole
+ *  run (the rtsp rings, the recorder, hls and webrtc nal pools, the
+ *  pyramid levels and tflow's slots) come from here instead of the
+ *  heap.  With --reserve mb[,huge][,lock] they are cut from one mapping
+ *  made before the session, populated up front, on huge pages if the
+ *  kernel has some (MAP_HUGETLB, else a transparent huge page hint) and
+ *  mlocked if asked, so a stage that wakes after an idle spell doesn't
+ *  fault its buffers back in and the total is known in one place.
+ *
+ *  Blocks are cache line aligned.  A block that is given back goes on a
+ *  free list of its size and the next ask for that size takes it, the
+ *  pools ask for the same sizes each time they are made.  Past the end
+ *  of the mapping, or with it not started, blocks come from the heap,
+ *  still aligned, and are counted as spilled.
+ */
+
+#ifndef RESERVE_H
+#define RESERVE_H
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cstddef>
+
+namespace detector {
+
+class Reserve {
+  public:
+    // 'len' bytes mapped now, 'huge' pages if it can, 'lock'ed if asked
+    static bool start(size_t len, bool huge, bool lock);
+    // after everything cut from it is given back
+    static void stop();
+
+    static void* alloc(size_t len);
+    static void release(void* ptr, size_t len);
+
+    class Stats {
+      public:
+        size_t len;           // mapped
+        size_t used;          // cut from it so far, given back or not
+        size_t held;          // out now, the heap's included
+        size_t spilled;       // out now from the heap
+        unsigned int blocks;  // out now
+        unsigned int spilled_blocks;
+        bool huge;
+        bool locked;
+    };
+    static Reserve::Stats stats();
+
+    // so a std::vector can live in it
+    template <typename T>
+    class Allocator {
+      public:
+        typedef T value_type;
+        Allocator() = default;
+        template <typename U> Allocator(const Allocator<U>&) {}
+        T* allocate(size_t n) {
+          return static_cast<T*>(Reserve::alloc(n * sizeof(T)));
+        }
+        void deallocate(T* p, size_t n) {
+          Reserve::release(p, n * sizeof(T));
+        }
+        template <typename U> bool operator==(const Allocator<U>&) const { return true; }
+        template <typename U> bool operator!=(const Allocator<U>&) const { return false; }
+    };
+
+  private:
+    Reserve() = delete;
+
+    static constexpr size_t kAlign = 64;
+
+    static std::mutex lock_;
+    static unsigned char* map_;
+    static size_t next_;
+    static std::map<size_t, std::vector<void*>> free_;
+    static Reserve::Stats stats_;
+};
+
+// bytes that live in the reserve
+typedef std::vector<unsigned char, Reserve::Allocator<unsigned char>> Bytes;
+
+} // namespace detector
+
+#endif // RESERVE_H
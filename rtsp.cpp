@@ -17,30 +17,45 @@
  */
 
 #include <chrono>
+#include <ctime>
 #include <cstring>
 #include <algorithm>
 
+#include <sys/socket.h>
+
 #include "rtsp.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "fate.h"
+#include "startup.h"
+#include "encoder.h"
 
 namespace detector {
 
-LiveSource::LiveSource(UsageEnvironment* env, Rtsp* owner) 
-  : FramedSource(*env), env_(env), owner_(owner) {
-
-  if (evt_id_ == 0) {
-    evt_id_ = env_->taskScheduler().createEventTrigger(deliverFrame0);
+LiveSource* LiveSource::createNew(UsageEnvironment* env, LiveStream* owner) {
+  LiveSource* src = new LiveSource(env, owner);
+  if (src->reader_ < 0) {
+    Medium::close(src);
+    return nullptr;
   }
+  return src;
+}
+
+LiveSource::LiveSource(UsageEnvironment* env, LiveStream* owner) 
+  : FramedSource(*env), owner_(owner), reader_(-1) {
+  reader_ = owner_->claimReader(this);
 }
 
 LiveSource::~LiveSource() {
-  if (evt_id_ != 0) {
-    env_->taskScheduler().deleteEventTrigger(evt_id_);
-    evt_id_ = 0;
+  if (reader_ >= 0) {
+    owner_->releaseReader(reader_);
+    reader_ = -1;
   }
 }
 
 void LiveSource::doGetNextFrame() {
-  if (owner_->live_watch_) {
+  if (owner_->closing()) {
     dbgMsg("doGetNextFrame: shutting down\n");
     handleClosure();
     return;
@@ -48,128 +63,1070 @@ void LiveSource::doGetNextFrame() {
   deliverFrame();
 }
 
-void LiveSource::deliverFrame0(void* data) {
-  LiveSource* self = static_cast<LiveSource*>(data);
-  self->deliverFrame();
-}
-
 void LiveSource::deliverFrame() {
   if (isCurrentlyAwaitingData()) {
-    if (owner_->deliverFrame0(owner_, fMaxSize, fFrameSize, fNumTruncatedBytes, 
+    if (owner_->deliverFrame(reader_, fMaxSize, fFrameSize, fNumTruncatedBytes, 
           fPresentationTime, fDurationInMicroseconds, fTo)) {
       FramedSource::afterGetting(this);
     }
   }
 }
 
+LiveMeta::LiveMeta(UsageEnvironment* env, LiveStream* owner) 
+  : FramedSource(*env), owner_(owner), claimed_(false) {
+  claimed_ = owner_->claimMeta(this);
+}
 
-Rtsp::Rtsp(unsigned int yield_time)
-  : Base(yield_time) {
+LiveMeta::~LiveMeta() {
+  if (claimed_) {
+    owner_->releaseMeta();
+    claimed_ = false;
+  }
 }
 
-Rtsp::~Rtsp() {
+void LiveMeta::doGetNextFrame() {
+  if (owner_->closing()) {
+    dbgMsg("doGetNextFrame: shutting down\n");
+    handleClosure();
+    return;
+  }
+  deliverFrame();
 }
 
-std::unique_ptr<Rtsp> Rtsp::create(unsigned int yield_time, bool quiet, 
-    unsigned int bitrate, unsigned int framerate, std::string& unicast) {
-  auto obj = std::unique_ptr<Rtsp>(new Rtsp(yield_time));
-  obj->init(quiet, bitrate, framerate, unicast);
-  return obj;
+void LiveMeta::deliverFrame() {
+  if (claimed_ && isCurrentlyAwaitingData()) {
+    if (owner_->deliverMeta(fMaxSize, fFrameSize, fNumTruncatedBytes, 
+          fPresentationTime, fTo)) {
+      fDurationInMicroseconds = 0;
+      FramedSource::afterGetting(this);
+    }
+  }
 }
 
-bool Rtsp::init(bool quiet, unsigned int bitrate, unsigned int framerate, 
-    std::string& unicast) {
+LiveSubsession::LiveSubsession(RTPSink& snk, RTCPInstance* rtcp, LiveStream* owner)
+  : PassiveServerMediaSubsession(snk, rtcp), owner_(owner) {
+}
 
-  quiet_ = quiet;
-  bitrate_ = bitrate;
-  framerate_ = framerate;
-  unicast_ = unicast;
-  rtsp_on_ = false;
+LiveSubsession::~LiveSubsession() {
+}
 
-  return true; 
+void LiveSubsession::startStream(unsigned client_id, void* token, 
+    TaskFunc* rr_handler, void* rr_data, unsigned short& seq_num, 
+    unsigned& timestamp, ServerRequestAlternativeByteHandler* alt_handler,
+    void* alt_data) {
+  PassiveServerMediaSubsession::startStream(client_id, token, rr_handler, rr_data,
+      seq_num, timestamp, alt_handler, alt_data);
+  owner_->clientJoined(true);
 }
 
-bool Rtsp::addMessage(NalBuf& nal) {
 
-  std::unique_lock<std::timed_mutex> lck(nal_lock_, std::defer_lock);
+LiveOnDemand::LiveOnDemand(UsageEnvironment& env, LiveStream* owner)
+  : OnDemandServerMediaSubsession(env, False), owner_(owner),
+    aux_sdp_(nullptr), aux_done_(0), aux_tries_(0), aux_snk_(nullptr) {
+}
 
-  if (!lck.try_lock_for(std::chrono::microseconds(Listener::timeout_))) {
-    dbgMsg("rtsp nal lock busy\n");
-    return false;
+LiveOnDemand::~LiveOnDemand() {
+  delete[] aux_sdp_;
+}
+
+FramedSource* LiveOnDemand::createNewStreamSource(unsigned client_id, unsigned& bitrate) {
+  bitrate = owner_->bitrate_ / 1000;
+  LiveSource* src = LiveSource::createNew(&envir(), owner_);
+  if (src == nullptr) {
+    dbgMsg("no reader left for client %u\n", client_id);
+    return nullptr;
+  }
+  return H264VideoStreamDiscreteFramer::createNew(envir(), src, False);
+}
+
+RTPSink* LiveOnDemand::createNewRTPSink(Groupsock* sock, unsigned char type,
+    FramedSource* src) {
+  owner_->owner_->tuneSocket(sock->socketNum(), owner_->bitrate_);
+  RTPSink* snk = H264VideoRTPSink::createNew(envir(), sock, type);
+  auto framer = static_cast<H264VideoStreamDiscreteFramer*>(src);
+  owner_->bindSink(static_cast<LiveSource*>(framer->inputSource())->reader(), snk);
+  return snk;
+}
+
+RTCPInstance* LiveOnDemand::createRTCP(Groupsock* sock, unsigned bandwidth,
+    unsigned char const* cname, RTPSink* snk) {
+  RTCPInstance* rtcp = RTCPInstance::createNew(envir(), sock, bandwidth, cname,
+      snk, NULL, False);
+  if (rtcp) {
+    rtcp->setRRHandler(LiveStream::rrHandler0, owner_);
+  }
+  return rtcp;
+}
+
+void LiveOnDemand::startStream(unsigned client_id, void* token, 
+    TaskFunc* rr_handler, void* rr_data, unsigned short& seq_num, 
+    unsigned& timestamp, ServerRequestAlternativeByteHandler* alt_handler,
+    void* alt_data) {
+  OnDemandServerMediaSubsession::startStream(client_id, token, rr_handler, rr_data,
+      seq_num, timestamp, alt_handler, alt_data);
+  owner_->clientJoined(false);
+}
+
+char const* LiveOnDemand::getAuxSDPLine(RTPSink* snk, FramedSource* src) {
+  if (aux_sdp_ != nullptr) {
+    return aux_sdp_;
+  }
+
+  // spin a nested event loop until the framer has seen sps and pps
+  aux_snk_ = snk;
+  aux_done_ = 0;
+  aux_tries_ = 0;
+  aux_snk_->startPlaying(*src, afterAux, this);
+  checkAuxSDP();
+  envir().taskScheduler().doEventLoop(&aux_done_);
+  return aux_sdp_;
+}
+
+void LiveOnDemand::checkAuxSDP0(void* data) {
+  static_cast<LiveOnDemand*>(data)->checkAuxSDP();
+}
+
+void LiveOnDemand::checkAuxSDP() {
+  char const* line = aux_snk_->auxSDPLine();
+  if (line != nullptr) {
+    aux_sdp_ = strDup(line);
+    aux_done_ = 1;
+  } else if (++aux_tries_ >= aux_max_ || owner_->closing()) {
+    dbgMsg("failed: no sps/pps for the sdp\n");
+    aux_done_ = 1;
+  } else {
+    nextTask() = envir().taskScheduler().scheduleDelayedTask(aux_wait_,
+        checkAuxSDP0, this);
   }
+}
+
+void LiveOnDemand::afterAux(void* data) {
+  LiveOnDemand* self = static_cast<LiveOnDemand*>(data);
+  self->envir().taskScheduler().unscheduleDelayedTask(self->nextTask());
+  self->aux_done_ = 1;
+}
+
+
+LiveMetaOnDemand::LiveMetaOnDemand(UsageEnvironment& env, LiveStream* owner)
+  : OnDemandServerMediaSubsession(env, True), owner_(owner) {
+}
+
+LiveMetaOnDemand::~LiveMetaOnDemand() {
+}
+
+FramedSource* LiveMetaOnDemand::createNewStreamSource(unsigned client_id,
+    unsigned& bitrate) {
+  bitrate = 16;
+  return LiveMeta::createNew(&envir(), owner_);
+}
+
+RTPSink* LiveMetaOnDemand::createNewRTPSink(Groupsock* sock, unsigned char type,
+    FramedSource* src) {
+  return SimpleRTPSink::createNew(envir(), sock, type, 90000,
+      "application", "VND.ONVIF.METADATA", 1, False);
+}
+
 
-  // drop a queued frame if the pool is empty
-  std::shared_ptr<Rtsp::RtspNal> rtsp_nal;
-  if (nal_pool_.size() == 0) {
-    dbgMsg("dropping back.  queue size: %d\n", nal_work_.size());
-    rtsp_nal = nal_work_.back();
-    nal_work_.pop_back();
+LiveBatchSink::LiveBatchSink(UsageEnvironment& env, Groupsock* sock,
+    unsigned char type, struct in_addr dst, unsigned short port, Stats& stats)
+  : RTPSink(env, sock, type, 90000, "H264", 1), unit_ts_(0), stats_(stats) {
+  memset(&dst_, 0, sizeof(dst_));
+  dst_.sin_family = AF_INET;
+  dst_.sin_addr = dst;
+  dst_.sin_port = htons(port);
+  nal_.resize(OutPacketBuffer::maxSize);
+  pkts_.reserve(packet_max_ * send_max_);
+  lens_.reserve(send_max_);
+}
+
+LiveBatchSink::~LiveBatchSink() {
+}
+
+char const* LiveBatchSink::auxSDPLine() {
+  if (sps_.size() < 4 || pps_.empty()) {
+    return nullptr;
+  }
+  if (fmtp_.empty()) {
+    char* sps = base64Encode((char const*)sps_.data(), sps_.size());
+    char* pps = base64Encode((char const*)pps_.data(), pps_.size());
+    char buf[64];
+    snprintf(buf, sizeof(buf), "a=fmtp:%d packetization-mode=1;profile-level-id=%06X",
+        rtpPayloadType(), (sps_[1] << 16) | (sps_[2] << 8) | sps_[3]);
+    fmtp_ = std::string(buf) + ";sprop-parameter-sets=" + sps + "," + pps + "\r\n";
+    delete[] sps;
+    delete[] pps;
+  }
+  return fmtp_.c_str();
+}
+
+Boolean LiveBatchSink::continuePlaying() {
+  if (fSource == nullptr) {
+    return False;
+  }
+  fSource->getNextFrame(nal_.data(), nal_.size(), afterNal0, this,
+      onSourceClosure, this);
+  return True;
+}
+
+void LiveBatchSink::afterNal0(void* data, unsigned size, unsigned trunc,
+    struct timeval pts, unsigned duration) {
+  static_cast<LiveBatchSink*>(data)->afterNal(size, trunc, pts);
+}
+
+void LiveBatchSink::next0(void* data) {
+  static_cast<LiveBatchSink*>(data)->continuePlaying();
+}
+
+void LiveBatchSink::afterNal(unsigned size, unsigned trunc, struct timeval pts) {
+
+  // the framer sets the time once per picture, a new one ends the last
+  uint32_t ts = convertToRTPTimestamp(pts);
+  if (!lens_.empty() && ts != unit_ts_) {
+    flush(true);
+  }
+  unit_ts_ = ts;
+  fCurrentTimestamp = ts;
+
+  if (trunc != 0 || size == 0) {
+    stats_.drops++;
   } else {
-    rtsp_nal = nal_pool_.front();
-    nal_pool_.pop_front();
+    unsigned int type = nal_[0] & 0x1f;
+    if (type == 7 || type == 8) {
+      std::vector<unsigned char>& ps = (type == 7) ? sps_ : pps_;
+      if (ps.size() != size || memcmp(ps.data(), nal_.data(), size) != 0) {
+        ps.assign(nal_.data(), nal_.data() + size);
+        fmtp_.clear();
+      }
+    }
+    packetize(nal_.data(), size);
   }
 
-  if (nal.length > rtsp_nal->nal.size()) {
-    dbgMsg("--------------------------resize nal: sz=%d\n", nal.length);
-    rtsp_nal->nal.resize(nal.length, 0);
+  auto framer = static_cast<H264VideoStreamDiscreteFramer*>(fSource);
+  if (framer->pictureEndMarker()) {
+    framer->pictureEndMarker() = False;
+    flush(true);
+  } else if (lens_.size() >= unit_max_) {
+    flush(false);
   }
-  std::memcpy(rtsp_nal->nal.data(), nal.addr, nal.length);
-  rtsp_nal->length = nal.length;
+  nextTask() = envir().taskScheduler().scheduleDelayedTask(0, next0, this);
+}
 
-  nal_work_.push_back(rtsp_nal);
+// rfc 6184 non-interleaved, a nal to a packet or fu-a fragments
+void LiveBatchSink::packetize(const unsigned char* nal, unsigned int len) {
+  const unsigned int room = packet_max_ - 12;
+  if (len <= room) {
+    addPacket(nullptr, 0, nal, len);
+    return;
+  }
+  unsigned char fu[2];
+  fu[0] = (nal[0] & 0xe0) | 28;
+  fu[1] = 0x80 | (nal[0] & 0x1f);
+  for (unsigned int off = 1; off < len; ) {
+    unsigned int num = std::min(len - off, room - 2);
+    if (off + num == len) {
+      fu[1] |= 0x40;
+    }
+    addPacket(fu, 2, nal + off, num);
+    fu[1] &= ~0x80;
+    off += num;
+  }
+}
+
+void LiveBatchSink::addPacket(const unsigned char* head, unsigned int head_len,
+    const unsigned char* data, unsigned int len) {
+  size_t at = lens_.size() * packet_max_;
+  pkts_.resize(at + packet_max_);
+  unsigned char* p = pkts_.data() + at;
+  uint32_t ssrc = SSRC();
+  p[0] = 0x80;
+  p[1] = rtpPayloadType();
+  p[2] = fSeqNo >> 8;
+  p[3] = fSeqNo & 0xff;
+  p[4] = unit_ts_ >> 24;
+  p[5] = (unit_ts_ >> 16) & 0xff;
+  p[6] = (unit_ts_ >> 8) & 0xff;
+  p[7] = unit_ts_ & 0xff;
+  p[8] = ssrc >> 24;
+  p[9] = (ssrc >> 16) & 0xff;
+  p[10] = (ssrc >> 8) & 0xff;
+  p[11] = ssrc & 0xff;
+  if (head_len) {
+    memcpy(p + 12, head, head_len);
+  }
+  memcpy(p + 12 + head_len, data, len);
+  lens_.push_back(12 + head_len + len);
+  fSeqNo++;
+}
 
-// moved to rtsp::running loop
-//  env_->taskScheduler().triggerEvent(live_src_->evt_id_, live_src_);
+void LiveBatchSink::flush(bool end) {
+
+  unsigned int num = lens_.size();
+  if (num == 0) {
+    return;
+  }
+
+  // marker on the unit's last packet
+  if (end) {
+    pkts_[(num - 1) * packet_max_ + 1] |= 0x80;
+  }
+
+  msgs_.resize(num);
+  iovs_.resize(num);
+  unsigned int bytes = 0;
+  for (unsigned int i = 0; i < num; i++) {
+    iovs_[i].iov_base = pkts_.data() + i * packet_max_;
+    iovs_[i].iov_len = lens_[i];
+    memset(&msgs_[i], 0, sizeof(msgs_[i]));
+    msgs_[i].msg_hdr.msg_name = &dst_;
+    msgs_[i].msg_hdr.msg_namelen = sizeof(dst_);
+    msgs_[i].msg_hdr.msg_iov = &iovs_[i];
+    msgs_[i].msg_hdr.msg_iovlen = 1;
+    bytes += lens_[i];
+  }
+
+  // the socket doesn't block, what a full send buffer won't take is lost
+  // just as it would be with live555's sendto
+  int fd = fRTPInterface.gs()->socketNum();
+  unsigned int sent = 0;
+  while (sent < num) {
+    int res = sendmmsg(fd, &msgs_[sent], std::min(num - sent, send_max_), 0);
+    if (res <= 0) {
+      stats_.drops += num - sent;
+      break;
+    }
+    stats_.sends++;
+    sent += res;
+  }
+
+  // rtcp sender reports count everything we meant to send
+  fPacketCount += num;
+  fOctetCount += bytes - 12 * num;
+  fTotalOctetCount += bytes;
+  stats_.units += end ? 1 : 0;
+  stats_.packets += sent;
+  pkts_.clear();
+  lens_.clear();
+}
+
+
+LiveStream::LiveStream(Rtsp* owner, const char* name, unsigned int bitrate,
+    unsigned short port)
+  : owner_(owner), name_(name), bitrate_(bitrate), port_(port),
+    video_snk_(nullptr), schd_(nullptr), turned_away_cnt_(0), meta_(false), enc_(nullptr),
+    join_cnt_(0), rate_down_cnt_(0), rate_delay_cnt_(0), rate_up_cnt_(0) {
+  for (unsigned int i = 0; i < reader_max_; i++) {
+    readers_.push_back(std::unique_ptr<LiveStream::Reader>(
+          new LiveStream::Reader(nal_num_)));
+  }
+}
+
+LiveStream::~LiveStream() {
+}
+
+void LiveStream::reset() {
+  ring_.assign(ring_len_, 0);
+  head_ = 0;
+  gop_.clear();
+  gop_.reserve(gop_max_);
+  gop_ok_ = false;
+  gop_key_ = false;
+  for (auto& rd : readers_) {
+    rd->used = false;
+    rd->join = LiveStream::Join::kLagging;
+    rd->armed = false;
+    rd->tail = 0;
+    rd->src = nullptr;
+    rd->snk = nullptr;
+    rd->cur_open = false;
+    rd->replay_end = 0;
+    rd->wait_key = false;
+    LiveStream::RtspNal rtsp_nal;
+    while (rd->work.pop(rtsp_nal)) {
+    }
+  }
+  meta_used_ = false;
+  meta_armed_ = false;
+  meta_src_ = nullptr;
+  receivers_.clear();
+  rr_cnt_ = 0;
+  MetaBuf meta;
+  while (meta_work_.pop(meta)) {
+  }
+}
+
+int LiveStream::claimReader(LiveSource* src) {
+  for (unsigned int i = 0; i < readers_.size(); i++) {
+    auto& rd = *readers_[i];
+    if (!rd.used) {
+      schd_ = &src->envir().taskScheduler();
+      if (rd.evt_id == 0) {
+        rd.evt_id = schd_->createEventTrigger(deliverFrame0);
+      }
+      rd.src = src;
+      rd.join = LiveStream::Join::kLagging;    // joins on its first read
+      rd.used = true;
+      return i;
+    }
+  }
+  turned_away_cnt_++;
+  return -1;
+}
+
+unsigned int LiveStream::readers() {
+  unsigned int num = 0;
+  for (auto& rd : readers_) {
+    num += rd->used ? 1 : 0;
+  }
+  return num;
+}
+
+void LiveStream::releaseReader(int idx) {
+  auto& rd = *readers_[idx];
+  rd.used = false;
+  rd.src = nullptr;
+  rd.snk = nullptr;
+}
+
+void LiveStream::bindSink(int idx, RTPSink* snk) {
+  if (idx >= 0) {
+    readers_[idx]->snk = snk;
+  }
+}
+
+LiveStream::Kind LiveStream::kindOf(const unsigned char* data, unsigned int len) {
+
+  // headers and idr lead the buffer, so stop at the first other slice
+  for (unsigned int i = 0; i + 3 < len; i++) {
+    if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+      unsigned int type = data[i + 3] & 0x1f;
+      if (type == 5 || type == 7 || type == 8) {
+        return LiveStream::Kind::kKey;
+      } else if (type == 1) {
+        return (data[i + 3] & 0x60) ? LiveStream::Kind::kRef : LiveStream::Kind::kDrop;
+      }
+      i += 3;
+    }
+  }
+
+  // sei and the like on their own
+  return LiveStream::Kind::kDrop;
+}
+
+bool LiveStream::move(LiveStream::Reader& rd, LiveStream::Join from, LiveStream::Join to) {
+  return rd.join.compare_exchange_strong(from, to);
+}
+
+bool LiveStream::rejoin(LiveStream::Reader& rd, LiveStream::RtspNal& rtsp_nal) {
+
+  // the reader has emptied its queue and isn't looking at it until we're
+  // done.  anything that doesn't fit leaves it lagging, to empty it again.
+  bool ok = true;
+  if (gop_ok_ && gop_.size() < rd.work.capacity()) {
+    rd.tail = gop_.front().start;
+    rd.replay_end = gop_.back().start;
+    rd.replay_last = gop_.back().stamp;
+    rd.replay_prev = gop_.front().stamp;
+    rd.replay_left = 0;
+    for (auto& gop_nal : gop_) {
+      rd.replay_left += (gop_nal.stamp != rd.replay_prev) ? 1 : 0;
+      rd.replay_prev = gop_nal.stamp;
+      ok = ok && rd.work.push(gop_nal);
+    }
+    rd.replay_prev = gop_.front().stamp;
+    replay_cnt_++;
+  } else {
+    rd.tail = rtsp_nal.start;
+    rd.replay_end = rtsp_nal.start;
+    rd.replay_last = rtsp_nal.stamp;
+    rd.replay_prev = rtsp_nal.stamp;
+    rd.replay_left = 0;
+    ok = rd.work.push(rtsp_nal);
+    if (enc_) {
+      enc_->requestKeyFrame();
+    }
+    key_cnt_++;
+  }
+  return move(rd, LiveStream::Join::kRejoining,
+      ok ? LiveStream::Join::kLive : LiveStream::Join::kLagging) && ok;
+}
+
+void LiveStream::trigger(LiveStream::Reader& rd) {
+
+  // the only scheduler call that is safe from another thread.  one
+  // outstanding trigger is enough, the sink pulls the rest itself.
+  if (!rd.armed.exchange(true)) {
+    schd_->triggerEvent(rd.evt_id, &rd);
+  }
+}
+
+void LiveStream::deliverFrame0(void* data) {
+  LiveStream::Reader* rd = static_cast<LiveStream::Reader*>(data);
+  rd->armed = false;
+  if (rd->src) {
+    rd->src->deliverFrame();
+  }
+}
+
+bool LiveStream::addMessage(NalBuf& nal) {
+
+  if (ring_.empty() || nal.length == 0 || nal.length > ring_len_) {
+    return false;
+  }
+
+  unsigned int pos = head_ % ring_len_;
+  unsigned int pad = (pos + nal.length > ring_len_) ? ring_len_ - pos : 0;
+  LiveStream::RtspNal rtsp_nal;
+  rtsp_nal.start = head_ + pad;
+  rtsp_nal.length = nal.length;
+  rtsp_nal.kind = kindOf(nal.addr, nal.length);
+  rtsp_nal.stamp = nal.stamp;
+  rtsp_nal.queued = std::chrono::steady_clock::now();
+  uint64_t end = rtsp_nal.start + rtsp_nal.length;
+
+  // whoever still needs what we are about to overwrite starts over
+  // rather than hold everyone else up
+  for (auto& rd : readers_) {
+    if (rd->used && end - rd->tail.load() > ring_len_ &&
+        move(*rd, LiveStream::Join::kLive, LiveStream::Join::kLagging)) {
+      lap_cnt_++;
+    }
+  }
+  if (gop_ok_ && end - gop_.front().start > ring_len_) {
+    gop_ok_ = false;
+  }
+  std::memcpy(ring_.data() + rtsp_nal.start % ring_len_, nal.addr, nal.length);
+  head_ = end;
+  PROBE(rtsp_queue, probe_us(nal.stamp), nal.length, readers_.size());
+
+  // a run of header and idr buffers opens the next gop
+  bool key = (rtsp_nal.kind == LiveStream::Kind::kKey);
+  if (key && !gop_key_) {
+    gop_.clear();
+    gop_ok_ = true;
+  }
+  gop_key_ = key;
+  if (gop_ok_) {
+    if (gop_.size() < gop_max_) {
+      gop_.push_back(rtsp_nal);
+    } else {
+      gop_ok_ = false;
+    }
+  }
+
+  for (auto& rd : readers_) {
+    if (!rd->used) {
+      continue;
+    }
+    auto join = rd->join.load();
+    if (join == LiveStream::Join::kRejoining) {
+      rejoin(*rd, rtsp_nal);
+    } else if (join == LiveStream::Join::kLive && !rd->work.push(rtsp_nal) &&
+        move(*rd, LiveStream::Join::kLive, LiveStream::Join::kLagging)) {
+      lap_cnt_++;
+    }
+    trigger(*rd);
+  }
   return true;
 }
 
-bool Rtsp::deliverFrame(unsigned int& max_size, unsigned int& frame_size, 
-    unsigned int& trunc, struct timeval& pts, unsigned int& duration, unsigned char* to) {
+bool LiveStream::addMessage(MetaBuf& meta) {
 
-  std::unique_lock<std::timed_mutex> lck(nal_lock_, std::defer_lock);
+  if (!meta_used_) {
+    return false;
+  }
+  meta_work_.push(meta);
+  if (!meta_armed_.exchange(true)) {
+    schd_->triggerEvent(meta_evt_, this);
+  }
+  return true;
+}
 
-  if (!lck.try_lock_for(std::chrono::microseconds(nal_timeout_))) {
-    dbgMsg("deliver frame nal lock busy\n");
+bool LiveStream::claimMeta(LiveMeta* src) {
+  if (meta_used_) {
     return false;
   }
+  schd_ = &src->envir().taskScheduler();
+  if (meta_evt_ == 0) {
+    meta_evt_ = schd_->createEventTrigger(deliverMeta0);
+  }
+  MetaBuf meta;
+  while (meta_work_.pop(meta)) {
+  }
+  meta_src_ = src;
+  meta_used_ = true;
+  return true;
+}
+
+void LiveStream::releaseMeta() {
+  meta_used_ = false;
+  meta_src_ = nullptr;
+}
+
+void LiveStream::deliverMeta0(void* data) {
+  LiveStream* self = static_cast<LiveStream*>(data);
+  self->meta_armed_ = false;
+  if (self->meta_src_) {
+    self->meta_src_->deliverFrame();
+  }
+}
+
+void LiveStream::formatMeta(MetaBuf& meta) {
 
-  if (nal_work_.size() != 0) {
+  struct timeval pts;
+  wallClock(meta.stamp, pts);
+  struct tm utc;
+  time_t sec = pts.tv_sec;
+  gmtime_r(&sec, &utc);
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%03uZ",
+      utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
+      utc.tm_hour, utc.tm_min, utc.tm_sec,
+      static_cast<unsigned int>(pts.tv_usec / 1000));
 
-    auto rtsp_nal = nal_work_.front();
-    nal_work_.pop_front();
+  meta_xml_ = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+    "<tt:MetadataStream xmlns:tt=\"http://www.onvif.org/ver10/schema\">"
+    "<tt:VideoAnalytics><tt:Frame UtcTime=\"";
+  meta_xml_ += buf;
+  meta_xml_ += "\">";
 
-    if (rtsp_nal->length > max_size) {
-      frame_size = max_size;
-      trunc = rtsp_nal->length - max_size;
-      if (overflow_.size() < trunc + overflow_len_) {
-        overflow_.resize(trunc + overflow_len_);
+  // onvif coordinates run -1 to 1, y up
+  float sx = 2.f / std::max(meta.width, 1u);
+  float sy = 2.f / std::max(meta.height, 1u);
+  for (auto& box : *meta.boxes) {
+    const char* type = "Other";
+    if (box.type == BoxBuf::Type::kPerson) {
+      type = "Human";
+    } else if (box.type == BoxBuf::Type::kPet) {
+      type = "Animal";
+    } else if (box.type == BoxBuf::Type::kVehicle) {
+      type = "Vehicle";
+    }
+    snprintf(buf, sizeof(buf), "<tt:Object ObjectId=\"%u\"><tt:Appearance><tt:Shape>"
+        "<tt:BoundingBox left=\"%.3f\" top=\"%.3f\" right=\"%.3f\" bottom=\"%.3f\"/>"
+        "</tt:Shape>", box.id,
+        box.x * sx - 1.f, 1.f - box.y * sy,
+        (box.x + box.w) * sx - 1.f, 1.f - (box.y + box.h) * sy);
+    meta_xml_ += buf;
+    snprintf(buf, sizeof(buf), "<tt:Class><tt:Type Likelihood=\"%.2f\">%s</tt:Type>"
+        "</tt:Class></tt:Appearance></tt:Object>", box.score, type);
+    meta_xml_ += buf;
+  }
+  meta_xml_ += "</tt:Frame></tt:VideoAnalytics></tt:MetadataStream>";
+}
+
+bool LiveStream::deliverMeta(unsigned int& max_size, unsigned int& frame_size, 
+    unsigned int& trunc, struct timeval& pts, unsigned char* to) {
+
+  MetaBuf meta;
+  if (!meta_work_.pop(meta) || !meta.boxes) {
+    return false;
+  }
+  formatMeta(meta);
+  frame_size = std::min(static_cast<unsigned int>(meta_xml_.size()), max_size);
+  trunc = meta_xml_.size() - frame_size;
+  std::memcpy(to, meta_xml_.data(), frame_size);
+  wallClock(meta.stamp, pts);
+  meta_cnt_++;
+  return true;
+}
+
+void LiveStream::setEncoder(Encoder* enc) {
+  enc_ = enc;
+}
+
+void LiveStream::clientJoined(bool key) {
+
+  // don't make the new viewer wait for the next natural key frame
+  join_cnt_++;
+  if (key && enc_) {
+    enc_->requestKeyFrame();
+  }
+}
+
+bool LiveStream::closing() {
+  return owner_->live_watch_ != 0;
+}
+
+void LiveStream::rrHandler0(void* data) {
+  static_cast<LiveStream*>(data)->rrHandler();
+}
+
+void LiveStream::readReports(RTPSink* snk) {
+
+  RTPTransmissionStatsDB::Iterator it(snk->transmissionStatsDB());
+  RTPTransmissionStats* stats;
+  while ((stats = it.next()) != NULL) {
+
+    // every receiver is in the db, only count the ones that just reported
+    auto found = receivers_.find(stats->SSRC());
+    if (found == receivers_.end()) {
+      if (receivers_.size() >= receiver_max_) {
+        continue;
       }
-      memcpy(overflow_.data() + overflow_len_, rtsp_nal->nal.data() + frame_size, trunc);
-      overflow_len_ += trunc;
+      found = receivers_.emplace(stats->SSRC(), LiveStream::Receiver()).first;
+    }
+    auto& rcv = found->second;
+    auto& last = stats->lastTimeReceived();
+    if (last.tv_sec == rcv.last.tv_sec && last.tv_usec == rcv.last.tv_usec) {
+      continue;
+    }
+    rcv.last = last;
+    rcv.seen = std::chrono::steady_clock::now();
+    rcv.reports++;
+    rr_cnt_++;
+
+    // jitter is in 90kHz ticks, rtt in 1/65536 sec and zero until an sr comes back
+    rcv.loss = stats->packetLossRatio();
+    rcv.loss_max = std::max(rcv.loss_max, rcv.loss);
+    rcv.lost = stats->totNumPacketsLost();
+    rcv.jitter = stats->jitter() / 90;
+    rcv.jitter_max = std::max(rcv.jitter_max, rcv.jitter);
+    if (stats->roundTripDelay() != 0) {
+      rcv.rtt = static_cast<uint64_t>(stats->roundTripDelay()) * 1000 / 65536;
+      rcv.rtt_min = (rcv.rtt_min == 0) ? rcv.rtt : std::min(rcv.rtt_min, rcv.rtt);
+      rcv.rtt_max = std::max(rcv.rtt_max, rcv.rtt);
+    }
+  }
+}
+
+void LiveStream::rrHandler() {
+
+  if (video_snk_) {
+    readReports(video_snk_);
+  }
+  for (auto& rd : readers_) {
+    if (rd->used && rd->snk) {
+      readReports(rd->snk);
+    }
+  }
+  if (enc_ == nullptr) {
+    return;
+  }
+
+  // the worst receiver that's still around decides
+  using namespace std::chrono;
+  auto now = steady_clock::now();
+  unsigned int loss = 0;
+  unsigned int delay = 0;
+  for (auto& it : receivers_) {
+    auto& rcv = it.second;
+    if (rcv.reports == 0 || now - rcv.seen > milliseconds(receiver_stale_)) {
+      continue;
+    }
+    loss = std::max(loss, rcv.loss);
+    delay = std::max(delay, rcv.rtt - rcv.rtt_min);
+  }
+
+  // back off fast, probe back up slowly
+  unsigned int rate = enc_->getBitrate();
+  unsigned int next = rate;
+  bool lossy = loss > loss_high_;
+  bool queued = delay > delay_high_;
+  if ((lossy || queued) && now - rate_stamp_ >= milliseconds(rate_hold_)) {
+    next = std::max(rate * 3 / 4, bitrate_ / 8);
+  } else if (loss < loss_low_ && delay < delay_low_ &&
+      now - rate_stamp_ >= milliseconds(rate_probe_)) {
+    next = std::min(rate + bitrate_ / 20, bitrate_);
+  }
+  if (next != rate) {
+    if (next > rate) {
+      rate_up_cnt_++;
+    } else if (lossy) {
+      rate_down_cnt_++;
     } else {
-      frame_size = rtsp_nal->length;
-      if (overflow_len_) {
-        auto it = rtsp_nal->nal.begin();
-        rtsp_nal->nal.insert(it, overflow_len_, 0);
-        memcpy(rtsp_nal->nal.data(), overflow_.data(), overflow_len_);
-        frame_size += overflow_len_;
-        overflow_len_ = 0;
-      }
+      rate_delay_cnt_++;
     }
-    gettimeofday(&pts, NULL);
-    duration = 0;
-//    duration = 1000000 / framerate_;
-    memcpy(to, rtsp_nal->nal.data(), frame_size);
-    nal_pool_.push_back(rtsp_nal);
-    return true;
+    enc_->setBitrate(next);
+    rate_stamp_ = now;
   }
+}
 
-  return false;
+void LiveStream::wallClock(std::chrono::steady_clock::time_point stamp,
+    struct timeval& pts) {
+
+  // present at capture time, mapped onto the wall clock rtcp uses
+  auto now = std::chrono::steady_clock::now();
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  int64_t off = static_cast<int64_t>(tv.tv_sec) * 1000000 + tv.tv_usec -
+    std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count();
+  if (!wall_set_ || std::abs(off - wall_off_) > wall_step_) {
+    wall_off_ = off;
+    wall_set_ = true;
+  }
+  if (stamp.time_since_epoch().count() == 0) {
+    stamp = now;
+  }
+  int64_t usec = wall_off_ +
+    std::chrono::duration_cast<std::chrono::microseconds>(stamp.time_since_epoch()).count();
+  pts.tv_sec = usec / 1000000;
+  pts.tv_usec = usec % 1000000;
 }
 
-bool Rtsp::deliverFrame0(Rtsp* self, unsigned int& max_size, unsigned int& frame_size, 
+// where the next 00 00 01 is at or after 'from', 'len' if there isn't one
+static unsigned int nextStart(const unsigned char* buf, unsigned int from,
+    unsigned int len) {
+  for (unsigned int i = from + 2; i < len; i++) {
+    auto one = static_cast<const unsigned char*>(std::memchr(buf + i, 1, len - i));
+    if (one == nullptr) {
+      break;
+    }
+    i = one - buf;
+    if (buf[i - 1] == 0 && buf[i - 2] == 0) {
+      return i - 2;
+    }
+  }
+  return len;
+}
+
+unsigned int LiveStream::nextNal(LiveStream::Reader& rd, unsigned int& from) {
+
+  // a buffer without a start code is one nal, trailing zeros are the
+  // next one's four byte start code
+  const unsigned char* buf = ring_.data() + rd.cur.start % ring_len_;
+  unsigned int len = rd.cur.length;
+  unsigned int at = nextStart(buf, rd.cur_off, len);
+  from = (at < len) ? at + 3 : rd.cur_off;
+  unsigned int end = nextStart(buf, from, len);
+  unsigned int last = end;
+  while (last > from && buf[last - 1] == 0) {
+    last--;
+  }
+  rd.cur_off = end;
+  if (last == from && end >= len) {
+    rd.tail = rd.cur.start + rd.cur.length;
+    rd.cur_open = false;
+  }
+  return last - from;
+}
+
+bool LiveStream::deliverFrame(int idx, unsigned int& max_size, unsigned int& frame_size, 
     unsigned int& trunc, struct timeval& pts, unsigned int& duration, unsigned char* to) {
-  return self->deliverFrame(max_size, frame_size, trunc, pts, duration, to);
+
+  if (idx < 0) {
+    return false;
+  }
+  auto& rd = *readers_[idx];
+  auto join = rd.join.load();
+  if (join != LiveStream::Join::kLive) {
+    if (join == LiveStream::Join::kLagging) {
+      LiveStream::RtspNal rtsp_nal;
+      while (rd.work.pop(rtsp_nal)) {
+      }
+      rd.cur_open = false;
+      rd.wait_key = false;
+      move(rd, LiveStream::Join::kLagging, LiveStream::Join::kRejoining);
+    }
+    return false;
+  }
+
+  // the discrete framer takes one nal at a time without its start code,
+  // and passes our capture times on where the parsing one makes its own
+  unsigned int from = 0, size = 0;
+  while (size == 0) {
+    while (!rd.cur_open) {
+      if (!rd.work.pop(rd.cur)) {
+        return false;
+      }
+
+      // a bounded delay beats a complete one
+      bool late = rd.cur.start > rd.replay_end &&
+        std::chrono::steady_clock::now() - rd.cur.queued >
+        std::chrono::milliseconds(late_max_);
+      if (rd.cur.kind == LiveStream::Kind::kKey) {
+        rd.wait_key = false;
+      } else if (late && rd.cur.kind == LiveStream::Kind::kRef && !rd.wait_key) {
+        rd.wait_key = true;
+        late_key_cnt_++;
+        if (enc_) {
+          enc_->requestKeyFrame();
+        }
+      }
+      if (rd.wait_key || (late && rd.cur.kind == LiveStream::Kind::kDrop)) {
+        rd.tail = rd.cur.start + rd.cur.length;
+        late_drop_cnt_++;
+        Fate::drop(Fate::Site::kRtspLate, rd.cur.stamp);
+        continue;
+      }
+      rd.cur_open = true;
+      rd.cur_off = 0;
+    }
+    size = nextNal(rd, from);
+  }
+
+  frame_size = std::min(size, max_size);
+  trunc = size - frame_size;
+  std::memcpy(to, ring_.data() + rd.cur.start % ring_len_ + from, frame_size);
+
+  // lapped while copying, part of it may already be newer
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (rd.join.load() != LiveStream::Join::kLive) {
+    return false;
+  }
+
+  // the replayed gop goes out squeezed up to its last frame
+  auto stamp = rd.cur.stamp;
+  if (rd.cur.start <= rd.replay_end) {
+    if (stamp != rd.replay_prev) {
+      rd.replay_left -= (rd.replay_left != 0) ? 1 : 0;
+      rd.replay_prev = stamp;
+    }
+    stamp = rd.replay_last - std::chrono::milliseconds(rd.replay_left);
+  }
+  wallClock(stamp, pts);
+
+  // the sinks only use it to wait before asking for more, and a live
+  // source wants to be asked straight away.  the spacing is in the stamps,
+  // dropped frames included.
+  duration = 0;
+
+  // capture to delivery
+  if (rd.cur_off >= rd.cur.length) {
+    if (rd.cur.stamp.time_since_epoch().count() != 0) {
+      differ_late_.begin(rd.cur.stamp);
+      differ_late_.end();
+      Trace::span(Trace::Hop::kRtsp, rd.cur.stamp, Trace::no_id, rd.cur.queued);
+      PROBE(rtsp_deliver, probe_us(rd.cur.stamp), rd.cur.length);
+      Fate::reach(Fate::kStreamed, rd.cur.stamp);
+    }
+    rd.tail = rd.cur.start + rd.cur.length;
+    rd.cur_open = false;
+  }
+  return true;
+}
+
+
+Rtsp::Rtsp(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Rtsp::~Rtsp() {
+}
+
+std::unique_ptr<Rtsp> Rtsp::create(unsigned int yield_time, bool quiet, 
+    unsigned int bitrate, unsigned int framerate, std::string& unicast,
+    unsigned int sub_bitrate, bool on_demand, unsigned short tunnel,
+    unsigned int send_buf, unsigned int pace, bool rtp_batch, bool meta) {
+  auto obj = std::unique_ptr<Rtsp>(new Rtsp(yield_time));
+  obj->init(quiet, bitrate, framerate, unicast, sub_bitrate, on_demand,
+      tunnel, send_buf, pace, rtp_batch, meta);
+  return obj;
+}
+
+bool Rtsp::init(bool quiet, unsigned int bitrate, unsigned int framerate, 
+    std::string& unicast, unsigned int sub_bitrate, bool on_demand,
+    unsigned short tunnel, unsigned int send_buf, unsigned int pace,
+    bool rtp_batch, bool meta) {
+
+  quiet_ = quiet;
+  bitrate_ = bitrate;
+  framerate_ = framerate;
+  unicast_ = unicast;
+  on_demand_ = on_demand;
+  tunnel_ = tunnel;
+  send_buf_ = send_buf;
+  pace_ = pace;
+  rtp_batch_ = rtp_batch;
+  live_watch_ = 0;
+  rtsp_on_ = false;
+
+  streams_.clear();
+  streams_.push_back(std::unique_ptr<LiveStream>(
+        new LiveStream(this, "camera", bitrate_, 18888)));
+  streams_.back()->meta_ = meta;
+  if (sub_bitrate != 0) {
+    streams_.push_back(std::unique_ptr<LiveStream>(
+          new LiveStream(this, "sub", sub_bitrate, 18890)));
+  }
+
+  return true; 
+}
+
+LiveStream* Rtsp::getStream(unsigned int idx) {
+  return (idx < streams_.size()) ? streams_[idx].get() : nullptr;
+}
+
+LiveStream* Rtsp::addStream(const char* name, unsigned int bitrate, unsigned short port) {
+  if (rtsp_on_) {
+    return nullptr;
+  }
+  streams_.push_back(std::unique_ptr<LiveStream>(new LiveStream(this, name, bitrate, port)));
+  return streams_.back().get();
+}
+
+unsigned int Rtsp::clients() {
+  unsigned int num = 0;
+  if (on_demand_) {
+    for (auto& stream : streams_) {
+      num += stream->readers();
+    }
+  }
+  return num;
+}
+
+void Rtsp::footprint(Footprint& out) {
+  size_t ring = 0, queues = 0, num = 0;
+  for (auto& stream : streams_) {
+    ring += stream->ring_.capacity();
+    for (auto& rd : stream->readers_) {
+      queues += rd->work.bytes();
+    }
+    num += stream->readers_.size();
+  }
+  out.add("nal_ring", streams_.size(), ring);
+  out.add("reader_queues", num, queues);
+}
+
+void Rtsp::metrics(Exposition& out, const std::string& labels) {
+  for (auto& stream : streams_) {
+    std::string lbl = labels + ",stream=\"" + stream->name_ + "\"";
+    unsigned int used = 0;
+    for (auto& rd : stream->readers_) {
+      used += rd->used ? 1 : 0;
+    }
+    out.gauge("detector_rtsp_readers", "readers taking the stream now", lbl, used);
+    out.counter("detector_rtsp_joins_total", "clients that joined", lbl, stream->join_cnt_);
+    out.counter("detector_rtsp_turned_away_total", "clients turned away, every reader taken",
+        lbl, stream->turned_away_cnt_);
+    out.counter("detector_rtsp_lapped_total", "readers the writer lapped", lbl,
+        stream->lap_cnt_);
+    out.counter("detector_rtsp_late_drops_total", "nals dropped as too late to send", lbl,
+        stream->late_drop_cnt_);
+    out.counter("detector_rtsp_receiver_reports_total", "rtcp receiver reports", lbl,
+        stream->rr_cnt_);
+    out.counter("detector_rtsp_rate_cuts_total", "bitrate cuts for loss or delay", lbl,
+        stream->rate_down_cnt_ + stream->rate_delay_cnt_);
+    out.counter("detector_rtsp_rate_raises_total", "bitrate raises", lbl,
+        stream->rate_up_cnt_);
+    if (stream->batched_) {
+      out.counter("detector_rtsp_batch_units_total", "access units sent batched", lbl,
+          stream->batch_.units);
+      out.counter("detector_rtsp_batch_packets_total", "rtp packets sent batched", lbl,
+          stream->batch_.packets);
+      out.counter("detector_rtsp_batch_sends_total", "sendmmsg calls", lbl,
+          stream->batch_.sends);
+      out.counter("detector_rtsp_batch_drops_total", "rtp packets the socket wouldn't take", lbl,
+          stream->batch_.drops);
+    }
+    out.summary("detector_latency_us", "stage latency percentiles", lbl + ",step=\"capture\"", stream->differ_late_.hist);
+  }
+}
+
+void Rtsp::tuneSocket(int fd, unsigned int bitrate) {
+
+  // room for a whole key frame, then let the kernel spread it out
+  if (send_buf_ != 0) {
+    unsigned int len = increaseSendBufferTo(*env_, fd, send_buf_);
+    dbgMsg("send buffer: %u\n", len);
+  }
+#ifdef SO_MAX_PACING_RATE
+  if (pace_ != 0) {
+    unsigned int rate = bitrate / 8 * pace_;
+    if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) < 0) {
+      dbgMsg("failed: pacing rate %u\n", rate);
+    }
+  }
+#endif
 }
 
 void Rtsp::liveProc() {
@@ -178,79 +1135,159 @@ void Rtsp::liveProc() {
   auto schd = std::unique_ptr<BasicTaskScheduler>(BasicTaskScheduler::createNew());
   env_ = BasicUsageEnvironment::createNew(*schd.get());
 
-  // unicast or multicast address
-  dbgMsg("unicast or multicast address\n");
-  struct in_addr dst_addr;
-  if (unicast_.empty()) {
-    dbgMsg("  multicast address\n");
-    dst_addr.s_addr = chooseRandomIPv4SSMAddress(*env_);
-  } else {
-    dbgMsg("  unicast address\n");
-    dst_addr.s_addr = our_inet_addr(unicast_.c_str());
-  }
- 
-  // create ports
-  dbgMsg("create ports\n");
-  const unsigned short rtpPortNum = 18888;
-  const unsigned short rtcpPortNum = rtpPortNum+1;
-  const unsigned char ttl = 255;
-  const Port rtpPort(rtpPortNum);
-  const Port rtcpPort(rtcpPortNum);
-
-  // create sockets
-  dbgMsg("create sockets\n");
-  Groupsock rtp_sock(*env_, dst_addr, rtpPort, ttl);
-  Groupsock rtcp_sock(*env_, dst_addr, rtcpPort, ttl);
-  if (unicast_.empty()) {
-    rtp_sock.multicastSendOnly();
-    rtcp_sock.multicastSendOnly();
-  }
-
-  // create video sink
-  dbgMsg("create video sink\n");
-  OutPacketBuffer::maxSize = output_max_;
-  RTPSink* video_snk = H264VideoRTPSink::createNew(*env_, &rtp_sock, 96);
-  if (video_snk == nullptr) {
-    dbgMsg("failed:  create video sink\n");
-  }
-
-  // create rtcp
-  dbgMsg("create rtcp\n");
-  std::vector<char> cname(cname_len_, 0);
-  gethostname(cname.data(), cname_len_);
-  RTCPInstance* rtcp = RTCPInstance::createNew(*env_, &rtcp_sock,
-    bitrate_ * 10 / 1000, (unsigned char*)cname.data(), video_snk, NULL, 
-    unicast_.empty() ? True : False);
-  if (rtcp == nullptr) {
-    dbgMsg("failed:  create rtcp\n");
-  }
-
   // create rtsp server
   dbgMsg("create rtsp server\n");
-  RTSPServer* rtsp_server = RTSPServer::createNew(*env_, 8554);
+  RTSPServer* rtsp_server = nullptr;
+  {
+    Startup::Scope step("rtsp server");
+    rtsp_server = RTSPServer::createNew(*env_, 8554);
+  }
   if (rtsp_server == nullptr) {
     dbgMsg("failed: create RTSP server %s\n", env_->getResultMsg());
   }
 
-  // create media session
-  dbgMsg("create media session\n");
-  ServerMediaSession* sms = ServerMediaSession::createNew(*env_, "camera", "detector",
-      "Session streamed by -detector-", unicast_.empty() ? True : False);
-  sms->addSubsession(PassiveServerMediaSubsession::createNew(*video_snk, rtcp));
-  rtsp_server->addServerMediaSession(sms);
+  // rtsp and rtp over http for clients behind nat
+  if (rtsp_server != nullptr && tunnel_ != 0) {
+    if (!rtsp_server->setUpTunnelingOverHTTP(tunnel_)) {
+      dbgMsg("failed: http tunnel on port %u\n", tunnel_);
+    } else {
+      fprintf(stderr, "RTSP over HTTP on port %u\n", tunnel_);
+    }
+  }
+
+  std::vector<char> cname(cname_len_, 0);
+  gethostname(cname.data(), cname_len_);
+  OutPacketBuffer::maxSize = output_max_;
+
+  std::vector<std::unique_ptr<Groupsock>> socks;
+  std::vector<RTCPInstance*> rtcps;
+  std::vector<H264VideoStreamDiscreteFramer*> video_srcs;
+  for (auto& stream : streams_) {
+
+    // every client gets its own source and sink, set up when it asks
+    if (on_demand_) {
+      dbgMsg("create on demand session\n");
+      ServerMediaSession* sms = ServerMediaSession::createNew(*env_, 
+          stream->name_.c_str(), "detector",
+          "Session streamed by -detector-", False);
+      sms->addSubsession(LiveOnDemand::createNew(*env_, stream.get()));
+      if (stream->meta_) {
+        sms->addSubsession(LiveMetaOnDemand::createNew(*env_, stream.get()));
+      }
+      rtsp_server->addServerMediaSession(sms);
+
+      char* url = rtsp_server->rtspURL(sms);
+      fprintf(stderr, "Play this stream using: %s\n", url);
+      delete[] url;
+      continue;
+    }
+
+    // unicast or multicast address
+    dbgMsg("unicast or multicast address\n");
+    struct in_addr dst_addr;
+    if (unicast_.empty()) {
+      dbgMsg("  multicast address\n");
+      dst_addr.s_addr = chooseRandomIPv4SSMAddress(*env_);
+    } else {
+      dbgMsg("  unicast address\n");
+      dst_addr.s_addr = our_inet_addr(unicast_.c_str());
+    }
+   
+    // create ports
+    dbgMsg("create ports\n");
+    const unsigned short rtpPortNum = stream->port_;
+    const unsigned short rtcpPortNum = rtpPortNum+1;
+    const unsigned char ttl = 255;
+    const Port rtpPort(rtpPortNum);
+    const Port rtcpPort(rtcpPortNum);
+
+    // create sockets
+    dbgMsg("create sockets\n");
+    socks.push_back(std::unique_ptr<Groupsock>(
+          new Groupsock(*env_, dst_addr, rtpPort, ttl)));
+    Groupsock* rtp_sock = socks.back().get();
+    socks.push_back(std::unique_ptr<Groupsock>(
+          new Groupsock(*env_, dst_addr, rtcpPort, ttl)));
+    Groupsock* rtcp_sock = socks.back().get();
+    if (unicast_.empty()) {
+      rtp_sock->multicastSendOnly();
+      rtcp_sock->multicastSendOnly();
+    }
+    tuneSocket(rtp_sock->socketNum(), stream->bitrate_);
+
+    // create video sink
+    dbgMsg("create video sink\n");
+    RTPSink* video_snk = nullptr;
+    if (rtp_batch_) {
+      video_snk = LiveBatchSink::createNew(*env_, rtp_sock, 96, dst_addr,
+          rtpPortNum, stream->batch_);
+      stream->batched_ = true;
+    } else {
+      video_snk = H264VideoRTPSink::createNew(*env_, rtp_sock, 96);
+    }
+    if (video_snk == nullptr) {
+      dbgMsg("failed:  create video sink\n");
+    }
+
+    // create rtcp
+    dbgMsg("create rtcp\n");
+    RTCPInstance* rtcp = RTCPInstance::createNew(*env_, rtcp_sock,
+      stream->bitrate_ * 10 / 1000, (unsigned char*)cname.data(), video_snk, NULL, 
+      unicast_.empty() ? True : False);
+    if (rtcp == nullptr) {
+      dbgMsg("failed:  create rtcp\n");
+    } else {
+      rtcp->setRRHandler(LiveStream::rrHandler0, stream.get());
+    }
+    rtcps.push_back(rtcp);
+
+    // create media session
+    dbgMsg("create media session\n");
+    ServerMediaSession* sms = ServerMediaSession::createNew(*env_, 
+        stream->name_.c_str(), "detector",
+        "Session streamed by -detector-", unicast_.empty() ? True : False);
+    sms->addSubsession(LiveSubsession::createNew(*video_snk, rtcp, stream.get()));
+
+    // metadata next to the video, same address
+    if (stream->meta_) {
+      dbgMsg("create metadata sink\n");
+      socks.push_back(std::unique_ptr<Groupsock>(
+            new Groupsock(*env_, dst_addr, Port(meta_port_), ttl)));
+      Groupsock* meta_sock = socks.back().get();
+      socks.push_back(std::unique_ptr<Groupsock>(
+            new Groupsock(*env_, dst_addr, Port(meta_port_ + 1), ttl)));
+      Groupsock* meta_rtcp_sock = socks.back().get();
+      if (unicast_.empty()) {
+        meta_sock->multicastSendOnly();
+        meta_rtcp_sock->multicastSendOnly();
+      }
+      RTPSink* meta_snk = SimpleRTPSink::createNew(*env_, meta_sock, 107, 90000,
+          "application", "VND.ONVIF.METADATA", 1, False);
+      RTCPInstance* meta_rtcp = RTCPInstance::createNew(*env_, meta_rtcp_sock,
+          16, (unsigned char*)cname.data(), meta_snk, NULL,
+          unicast_.empty() ? True : False);
+      rtcps.push_back(meta_rtcp);
+      sms->addSubsession(PassiveServerMediaSubsession::createNew(*meta_snk, meta_rtcp));
+      meta_snk->startPlaying(*LiveMeta::createNew(env_, stream.get()), afterPlay, meta_snk);
+      stream->meta_snk_ = meta_snk;
+    }
+    rtsp_server->addServerMediaSession(sms);
 
-  // display stream url
-  dbgMsg("display stream url\n");
-  char* url = rtsp_server->rtspURL(sms);
-  fprintf(stderr, "Play this stream using: %s\n", url);
-  delete[] url;
+    // display stream url
+    dbgMsg("display stream url\n");
+    char* url = rtsp_server->rtspURL(sms);
+    fprintf(stderr, "Play this stream using: %s\n", url);
+    delete[] url;
 
-  // start play
-  dbgMsg("start play...\n");
-  live_src_ = LiveSource::createNew(env_, this);
-  H264VideoStreamFramer* video_src = 
-    H264VideoStreamFramer::createNew(*env_, live_src_, False);
-  video_snk->startPlaying(*video_src, afterPlay, video_snk);
+    // start play
+    dbgMsg("start play...\n");
+    LiveSource* live_src = LiveSource::createNew(env_, stream.get());
+    H264VideoStreamDiscreteFramer* video_src = 
+      H264VideoStreamDiscreteFramer::createNew(*env_, live_src, False);
+    video_snk->startPlaying(*video_src, afterPlay, video_snk);
+    stream->video_snk_ = video_snk;
+    video_srcs.push_back(video_src);
+  }
 
   // run until cancelled
   live_sem_.post();
@@ -258,11 +1295,42 @@ void Rtsp::liveProc() {
 
   // shutdown
   dbgMsg("rtsp shutdown\n");
-  video_snk->stopPlaying();
-  Medium::close(video_snk);
-  Medium::close(video_src);
+  for (auto& stream : streams_) {
+    RTPSink* video_snk = stream->video_snk_;
+    stream->video_snk_ = nullptr;
+    if (video_snk) {
+      video_snk->stopPlaying();
+      Medium::close(video_snk);
+    }
+    RTPSink* meta_snk = stream->meta_snk_;
+    stream->meta_snk_ = nullptr;
+    if (meta_snk) {
+      LiveMeta* meta_src = stream->meta_src_;
+      meta_snk->stopPlaying();
+      Medium::close(meta_snk);
+      Medium::close(meta_src);
+    }
+  }
+  for (auto video_src : video_srcs) {
+    Medium::close(video_src);
+  }
   Medium::close(rtsp_server);
-  Medium::close(rtcp);
+  for (auto rtcp : rtcps) {
+    Medium::close(rtcp);
+  }
+  socks.clear();
+  for (auto& stream : streams_) {
+    for (auto& rd : stream->readers_) {
+      if (rd->evt_id != 0) {
+        env_->taskScheduler().deleteEventTrigger(rd->evt_id);
+        rd->evt_id = 0;
+      }
+    }
+    if (stream->meta_evt_ != 0) {
+      env_->taskScheduler().deleteEventTrigger(stream->meta_evt_);
+      stream->meta_evt_ = 0;
+    }
+  }
   env_->reclaim();
 }
 
@@ -274,10 +1342,10 @@ bool Rtsp::waitingToRun() {
 
   if (!rtsp_on_) {
 
-    // create nal pool
-    dbgMsg("create nal pool\n");
-    for (unsigned int i = 0; i < nal_num_; i++) {
-      nal_pool_.push_back(std::shared_ptr<Rtsp::RtspNal>(new RtspNal(nal_len_)));
+    // create nal rings
+    dbgMsg("create nal rings\n");
+    for (auto& stream : streams_) {
+      stream->reset();
     }
 
     // launch live thread
@@ -301,17 +1369,8 @@ void Rtsp::afterPlay(void* data) {
 }
 
 bool Rtsp::running() {
-  if (rtsp_on_) {
-    env_->taskScheduler().triggerEvent(live_src_->evt_id_, live_src_);
-//    std::unique_lock<std::timed_mutex> lck(nal_lock_, std::defer_lock);
-//    if (lck.try_lock_for(std::chrono::microseconds(Listener::timeout_))) {
-//      if (nal_work_.size() != 0) {
-//        env_->taskScheduler().triggerEvent(live_src_->evt_id_, live_src_);
-//        std::this_thread::sleep_for(std::chrono::microseconds(100));
-//        env_->taskScheduler().triggerEvent(live_src_->evt_id_, live_src_);
-//      }
-//    }
-  }
+
+  // delivery is triggered by the encoder as each nal arrives
   return true;
 }
 
@@ -329,10 +1388,48 @@ bool Rtsp::waitingToHalt() {
     live_.join();
 
     rtsp_on_ = false;
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nRtsp Results...\n");
+      for (auto& stream : streams_) {
+        fprintf(stderr, "  %s:\n", stream->name_.c_str());
+        fprintf(stderr, "    nal latency (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+            stream->differ_late_.pct(.5), stream->differ_late_.pct(.9), stream->differ_late_.pct(.99), stream->differ_late_.pct(.999),
+            stream->differ_late_.high, stream->differ_late_.avg, 
+            stream->differ_late_.low,  stream->differ_late_.cnt);
+        fprintf(stderr, "    readers lapped: %u\n", stream->lap_cnt_.load());
+        fprintf(stderr, "    joined on cached gop: %u key frame: %u\n",
+            stream->replay_cnt_, stream->key_cnt_);
+        fprintf(stderr, "    late nals dropped: %u key frames asked: %u\n",
+            stream->late_drop_cnt_, stream->late_key_cnt_);
+        if (stream->meta_) {
+          fprintf(stderr, "    metadata frames sent: %u\n", stream->meta_cnt_);
+        }
+        fprintf(stderr, "    clients turned away: %u\n", stream->turned_away_cnt_);
+        fprintf(stderr, "    clients joined: %u\n", stream->join_cnt_);
+        fprintf(stderr, "    bitrate cuts: loss %u delay %u raises: %u\n", 
+            stream->rate_down_cnt_, stream->rate_delay_cnt_, stream->rate_up_cnt_);
+        fprintf(stderr, "    receiver reports: %u\n", stream->rr_cnt_);
+        if (stream->batched_) {
+          fprintf(stderr, "    batched units: %u packets: %u sends: %u drops: %u\n",
+              stream->batch_.units.load(), stream->batch_.packets.load(),
+              stream->batch_.sends.load(), stream->batch_.drops.load());
+        }
+        for (auto& it : stream->receivers_) {
+          auto& rcv = it.second;
+          fprintf(stderr, "      ssrc %08x: reports:%u lost:%u loss (%%): last:%.1f high:%.1f\n",
+              it.first, rcv.reports, rcv.lost,
+              rcv.loss * 100.f / 256, rcv.loss_max * 100.f / 256);
+          fprintf(stderr, "        jitter (ms): last:%u high:%u  rtt (ms): last:%u low:%u high:%u\n",
+              rcv.jitter, rcv.jitter_max, rcv.rtt, rcv.rtt_min, rcv.rtt_max);
+        }
+      }
+      fprintf(stderr, "\n");
+    }
   }
 
   return true;
 }
 
 } // namespace detector
-
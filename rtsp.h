@@ -20,16 +20,22 @@
 #define RTSP_H
 
 #include <string>
-#include <deque>
 #include <memory>
 #include <atomic>
 #include <thread>
 #include <mutex>
 #include <vector>
+#include <map>
+#include <chrono>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #include "utils.h"
 #include "listener.h"
+#include "channel.h"
 #include "base.h"
+#include "reserve.h"
 
 #include "liveMedia.hh"
 #include "BasicUsageEnvironment.hh"
@@ -38,44 +44,413 @@
 
 namespace detector {
 
+class Encoder;
+
 class Rtsp;
+class LiveStream;
+// one reader of a stream's nals, null if every reader is taken
 class LiveSource : public FramedSource {
   public:
-    static LiveSource* createNew(UsageEnvironment* env, Rtsp* owner) {
-      return new LiveSource(env, owner);
-    }
+    static LiveSource* createNew(UsageEnvironment* env, LiveStream* owner);
 
   public:
     ~LiveSource();
+    void deliverFrame();
+    int reader() { return reader_; }
 
   protected:
-    LiveSource(UsageEnvironment* env, Rtsp* owner);
+    LiveSource(UsageEnvironment* env, LiveStream* owner);
+
+  private:
+    LiveStream* owner_;
+    int reader_;
+    virtual void doGetNextFrame();
+};
 
+// the stream's detections as onvif xml, one per frame that has boxes
+class LiveMeta : public FramedSource {
   public:
-    EventTriggerId evt_id_;
+    static LiveMeta* createNew(UsageEnvironment* env, LiveStream* owner) {
+      return new LiveMeta(env, owner);
+    }
+
+  public:
+    ~LiveMeta();
+    void deliverFrame();
+
+  protected:
+    LiveMeta(UsageEnvironment* env, LiveStream* owner);
 
   private:
-    UsageEnvironment* env_;
-    Rtsp* owner_;
+    LiveStream* owner_;
+    bool claimed_;    // the sdp's throw away source doesn't get one
     virtual void doGetNextFrame();
+};
+
+// tells the owner when a client starts playing
+class LiveSubsession : public PassiveServerMediaSubsession {
+  public:
+    static LiveSubsession* createNew(RTPSink& snk, RTCPInstance* rtcp, LiveStream* owner) {
+      return new LiveSubsession(snk, rtcp, owner);
+    }
+
+  protected:
+    LiveSubsession(RTPSink& snk, RTCPInstance* rtcp, LiveStream* owner);
+    virtual ~LiveSubsession();
+
+  private:
+    LiveStream* owner_;
+    virtual void startStream(unsigned client_id, void* token, 
+        TaskFunc* rr_handler, void* rr_data, unsigned short& seq_num, 
+        unsigned& timestamp, ServerRequestAlternativeByteHandler* alt_handler,
+        void* alt_data);
+};
+
+// a source and sink per client, all reading the same nal ring
+class LiveOnDemand : public OnDemandServerMediaSubsession {
+  public:
+    static LiveOnDemand* createNew(UsageEnvironment& env, LiveStream* owner) {
+      return new LiveOnDemand(env, owner);
+    }
+
+  protected:
+    LiveOnDemand(UsageEnvironment& env, LiveStream* owner);
+    virtual ~LiveOnDemand();
+
+  private:
+    LiveStream* owner_;
+    virtual FramedSource* createNewStreamSource(unsigned client_id, unsigned& bitrate);
+    virtual RTPSink* createNewRTPSink(Groupsock* sock, unsigned char type,
+        FramedSource* src);
+    virtual RTCPInstance* createRTCP(Groupsock* sock, unsigned bandwidth,
+        unsigned char const* cname, RTPSink* snk);
+    virtual void startStream(unsigned client_id, void* token, 
+        TaskFunc* rr_handler, void* rr_data, unsigned short& seq_num, 
+        unsigned& timestamp, ServerRequestAlternativeByteHandler* alt_handler,
+        void* alt_data);
+
+    // the sdp wants sps/pps, so play a throw away sink until it has them
+    char* aux_sdp_;
+    char aux_done_;
+    unsigned int aux_tries_;
+    RTPSink* aux_snk_;
+    const unsigned int aux_max_ = {100};      // tries
+    const unsigned int aux_wait_ = {20000};   // usec between tries
+    virtual char const* getAuxSDPLine(RTPSink* snk, FramedSource* src);
+    static void checkAuxSDP0(void* data);
+    void checkAuxSDP();
+    static void afterAux(void* data);
+};
+
+// metadata is small, so every client shares the one source and sink
+class LiveMetaOnDemand : public OnDemandServerMediaSubsession {
+  public:
+    static LiveMetaOnDemand* createNew(UsageEnvironment& env, LiveStream* owner) {
+      return new LiveMetaOnDemand(env, owner);
+    }
+
+  protected:
+    LiveMetaOnDemand(UsageEnvironment& env, LiveStream* owner);
+    virtual ~LiveMetaOnDemand();
+
+  private:
+    LiveStream* owner_;
+    virtual FramedSource* createNewStreamSource(unsigned client_id, unsigned& bitrate);
+    virtual RTPSink* createNewRTPSink(Groupsock* sock, unsigned char type,
+        FramedSource* src);
+};
+
+// h264 over rtp that sends each access unit's packets with one sendmmsg
+// rather than a sendto apiece.  it needs the one destination, so it's only
+// for the fixed address streams (multicast or -u).
+class LiveBatchSink : public RTPSink {
+  public:
+    // kept by the stream, so they outlive the sink
+    class Stats {
+      public:
+        std::atomic<unsigned int> units = {0};
+        std::atomic<unsigned int> packets = {0};
+        std::atomic<unsigned int> sends = {0};
+        std::atomic<unsigned int> drops = {0};
+    };
+
+    static LiveBatchSink* createNew(UsageEnvironment& env, Groupsock* sock,
+        unsigned char type, struct in_addr dst, unsigned short port, Stats& stats) {
+      return new LiveBatchSink(env, sock, type, dst, port, stats);
+    }
+
+  public:
+    virtual char const* sdpMediaType() const { return "video"; }
+    virtual char const* auxSDPLine();
+
+  protected:
+    LiveBatchSink(UsageEnvironment& env, Groupsock* sock, unsigned char type,
+        struct in_addr dst, unsigned short port, Stats& stats);
+    virtual ~LiveBatchSink();
+
+  private:
+    struct sockaddr_in dst_;
+    const unsigned int packet_max_ = {1456};  // header included, like live555
+    const unsigned int send_max_ = {64};      // packets a call
+    const unsigned int unit_max_ = {2048};    // packets, sent as is past this
+    std::vector<unsigned char> nal_;
+    std::vector<unsigned char> sps_;
+    std::vector<unsigned char> pps_;
+    std::string fmtp_;
+
+    // the access unit so far, one packet every packet_max_ bytes
+    std::vector<unsigned char> pkts_;
+    std::vector<unsigned int> lens_;
+    std::vector<struct mmsghdr> msgs_;
+    std::vector<struct iovec> iovs_;
+    uint32_t unit_ts_;
+    Stats& stats_;
+
+    virtual Boolean continuePlaying();
+    static void afterNal0(void* data, unsigned size, unsigned trunc,
+        struct timeval pts, unsigned duration);
+    void afterNal(unsigned size, unsigned trunc, struct timeval pts);
+    static void next0(void* data);
+    void packetize(const unsigned char* nal, unsigned int len);
+    void addPacket(const unsigned char* head, unsigned int head_len,
+        const unsigned char* data, unsigned int len);
+    void flush(bool end);
+};
+
+// one session on the server with its own nal ring and encoder.  clients
+// read the ring through their own reader, so a slow one only hurts itself.
+class LiveStream : public Listener<NalBuf>, Listener<MetaBuf> {
+  public:
+    LiveStream() = delete;
+    LiveStream(Rtsp* owner, const char* name, unsigned int bitrate, 
+        unsigned short port);
+    LiveStream(LiveStream const &) = delete;
+    virtual ~LiveStream();
+
+  public:
+    virtual bool addMessage(NalBuf& nal);
+    virtual bool addMessage(MetaBuf& meta);
+
+    // bitrate follows receiver loss.  multicast viewers share one reader
+    // so they need a key frame, unicast ones get the cached gop instead.
+    void setEncoder(Encoder* enc);
+    void clientJoined(bool key);
+
+    bool closing();
+
+    // readers in use
+    unsigned int readers();
+
+    // readers belong to the live thread, -1 if they are all taken
+    int claimReader(LiveSource* src);
+    void releaseReader(int idx);
+    void bindSink(int idx, RTPSink* snk);
+    bool deliverFrame(int idx, unsigned int& max_size, unsigned int& frame_size, 
+      unsigned int& trunc, struct timeval& pts, unsigned int& duration, 
+      unsigned char* fTo);
+
+    // one metadata source at a time
+    bool claimMeta(LiveMeta* src);
+    void releaseMeta();
+    bool deliverMeta(unsigned int& max_size, unsigned int& frame_size, 
+      unsigned int& trunc, struct timeval& pts, unsigned char* fTo);
+
+  private:
+    friend class Rtsp;
+    friend class LiveOnDemand;
+    friend class LiveMetaOnDemand;
+
+    Rtsp* owner_;
+    std::string name_;
+    unsigned int bitrate_;
+    unsigned short port_;
+
+    RTPSink* video_snk_;
+    TaskScheduler* schd_;
+
+    // with --rtp-batch on a fixed address stream
+    bool batched_ = {false};
+    LiveBatchSink::Stats batch_;
+
+    // nals are copied in once and read straight out into each sink's buffer.
+    // each one is contiguous, the writer skips to the front rather than wrap.
+    enum class Kind {
+      kKey,       // sps, pps or idr, never dropped
+      kRef,       // later frames need it
+      kDrop       // nothing refers to it
+    };
+    class RtspNal {
+      public:
+        uint64_t start;     // ring offset, counts up forever
+        unsigned int length;
+        LiveStream::Kind kind;
+        std::chrono::steady_clock::time_point stamp;
+        std::chrono::steady_clock::time_point queued;
+    };
+    const unsigned int nal_num_ = {256};
+    const unsigned int ring_len_ = {2 * 1024 * 1024};
+    Bytes ring_;
+    uint64_t head_ = {0};                     // encoder thread only
+
+    // everything since the last sps/pps/idr, still in the ring.  a reader
+    // joins there and is playing as soon as it's sent, no key frame needed.
+    const unsigned int gop_max_ = {1024};     // buffers, frames can be sliced
+    std::vector<LiveStream::RtspNal> gop_;    // encoder thread only
+    bool gop_ok_ = {false};
+    bool gop_key_ = {false};
+    LiveStream::Kind kindOf(const unsigned char* data, unsigned int len);
+
+    // a reader the writer laps, or whose queue fills, is left out until
+    // it throws away what it had and the writer lets it back in.  the
+    // writer takes it from live to lagging and from rejoining back to live,
+    // or to lagging again if the replay didn't fit, and the reader from
+    // lagging to rejoining once it's emptied.  each only moves it by a
+    // compare and swap from a state it owns.
+    enum class Join {
+      kLive,
+      kLagging,
+      kRejoining
+    };
+    class Reader {
+      public:
+        Reader(unsigned int cap)
+          : work(cap, Channel<LiveStream::RtspNal>::Policy::kDropNewest) {}
+      public:
+        std::atomic<bool> used = {false};
+        std::atomic<LiveStream::Join> join = {LiveStream::Join::kLagging};
+        std::atomic<bool> armed = {false};
+        alignas(64) std::atomic<uint64_t> tail = {0};     // read up to here, by the live thread
+        Channel<LiveStream::RtspNal> work;
+        EventTriggerId evt_id = {0};
+        LiveSource* src = {nullptr};
+        RTPSink* snk = {nullptr};     // on demand only, for its receiver reports
+
+        // a buffer goes out a nal a read.  the sink's buffer is bigger than
+        // any nal we make, one that isn't is cut short.
+        bool cur_open = {false};
+        LiveStream::RtspNal cur;
+        unsigned int cur_off = {0};
+
+        // the cached gop is old on purpose, it goes out whatever its age.
+        // its frames are stamped a msec apart up to the last one's capture
+        // time, so a client doesn't play it out at its own pace behind live.
+        uint64_t replay_end = {0};
+        std::chrono::steady_clock::time_point replay_last;
+        std::chrono::steady_clock::time_point replay_prev;
+        unsigned int replay_left = {0};
+        bool wait_key = {false};
+    };
+
+    // nals queued longer than this are dropped.  whole unreferenced frames
+    // go quietly, after a reference frame the reader skips to a key frame.
+    const unsigned int late_max_ = {300};     // msec
+    unsigned int late_drop_cnt_ = {0};
+    unsigned int late_key_cnt_ = {0};
+    const unsigned int reader_max_ = {8};
+    std::vector<std::unique_ptr<LiveStream::Reader>> readers_;
+    std::atomic<unsigned int> lap_cnt_ = {0};
+    unsigned int turned_away_cnt_;
+    unsigned int replay_cnt_ = {0};
+    unsigned int key_cnt_ = {0};
+    void reset();
+    bool rejoin(LiveStream::Reader& rd, LiveStream::RtspNal& rtsp_nal);
+    static bool move(LiveStream::Reader& rd, LiveStream::Join from, LiveStream::Join to);
+    void trigger(LiveStream::Reader& rd);
+    unsigned int nextNal(LiveStream::Reader& rd, unsigned int& from);
     static void deliverFrame0(void* data);
-    void deliverFrame();
+
+    // video and metadata share the capture clock, that's what keeps them in
+    // step.  it is mapped onto the wall clock rtcp uses by one offset, so
+    // frame spacing goes out as captured, and only a clock step moves it.
+    const int64_t wall_step_ = {100000};      // usec
+    int64_t wall_off_ = {0};                  // live thread only
+    bool wall_set_ = {false};
+    void wallClock(std::chrono::steady_clock::time_point stamp, struct timeval& pts);
+    MicroDiffer<uint32_t> differ_late_;
+
+    // onvif metadata, the live thread formats it
+    bool meta_;
+    Channel<MetaBuf> meta_work_{16, Channel<MetaBuf>::Policy::kDropOldest};
+    std::atomic<bool> meta_used_ = {false};
+    std::atomic<bool> meta_armed_ = {false};
+    EventTriggerId meta_evt_ = {0};
+    LiveMeta* meta_src_ = {nullptr};
+    RTPSink* meta_snk_ = {nullptr};
+    std::string meta_xml_;
+    unsigned int meta_cnt_ = {0};
+    static void deliverMeta0(void* data);
+    void formatMeta(MetaBuf& meta);
+
+    // what each receiver reports, by ssrc.  queueing shows up as rtt over
+    // the lowest one seen, loss as the fraction lost since the last report.
+    class Receiver {
+      public:
+        unsigned int reports = {0};
+        unsigned int loss = {0};          // of 256
+        unsigned int loss_max = {0};
+        unsigned int lost = {0};          // packets, all told
+        unsigned int jitter = {0};        // msec
+        unsigned int jitter_max = {0};
+        unsigned int rtt = {0};           // msec
+        unsigned int rtt_min = {0};
+        unsigned int rtt_max = {0};
+        struct timeval last = {0, 0};
+        std::chrono::steady_clock::time_point seen;
+    };
+    const unsigned int receiver_max_ = {32};
+    const unsigned int receiver_stale_ = {10000};   // msec
+    std::map<unsigned int, LiveStream::Receiver> receivers_;
+    unsigned int rr_cnt_ = {0};
+    void readReports(RTPSink* snk);
+
+    Encoder* enc_;
+    static void rrHandler0(void* data);
+    void rrHandler();
+    const unsigned int loss_high_ = {13};     // of 256, about 5 percent
+    const unsigned int loss_low_  = {3};      // of 256, about 1 percent
+    const unsigned int delay_high_ = {200};   // msec queued in the network
+    const unsigned int delay_low_ = {50};     // msec
+    const unsigned int rate_hold_ = {1000};   // msec between cuts
+    const unsigned int rate_probe_ = {5000};  // msec between raises
+    std::chrono::steady_clock::time_point rate_stamp_;
+    unsigned int join_cnt_;
+    unsigned int rate_down_cnt_;
+    unsigned int rate_delay_cnt_;
+    unsigned int rate_up_cnt_;
 };
 
-class Rtsp : public Base, Listener<NalBuf> {
+class Rtsp : public Base {
   public:
     static std::unique_ptr<Rtsp> create(unsigned int yield_time, bool quiet, 
-        unsigned int bitrate, unsigned int framerate, std::string& unicast);
+        unsigned int bitrate, unsigned int framerate, std::string& unicast,
+        unsigned int sub_bitrate, bool on_demand, unsigned short tunnel,
+        unsigned int send_buf, unsigned int pace, bool rtp_batch, bool meta);
     virtual ~Rtsp();
 
   public:
-    virtual bool addMessage(NalBuf& data);
+    // 0 is 'camera', 1 is the 'sub' stream if there is one
+    LiveStream* getStream(unsigned int idx);
+
+    // another stream on 'port', before start, null once started
+    LiveStream* addStream(const char* name, unsigned int bitrate, unsigned short port);
+
+    // unicast viewers on demand, 0 with multicast where nobody can tell
+    unsigned int clients();
+
+    // the metrics endpoint's samples
+    virtual void metrics(Exposition& out, const std::string& labels);
+    virtual void footprint(Footprint& out);
+
+    // live thread only, for every rtp socket we send on
+    void tuneSocket(int fd, unsigned int bitrate);
 
   protected:
     Rtsp() = delete;
     Rtsp(unsigned int yield_time);
     bool init(bool quiet, unsigned int bitrate, unsigned int framerate, 
-        std::string& unicast);
+        std::string& unicast, unsigned int sub_bitrate, bool on_demand,
+        unsigned short tunnel, unsigned int send_buf, unsigned int pace,
+        bool rtp_batch, bool meta);
 
   protected:
     virtual bool waitingToRun();
@@ -84,15 +459,6 @@ class Rtsp : public Base, Listener<NalBuf> {
     virtual bool waitingToHalt();
 
   public:
-    bool deliverFrame(unsigned int& max_size, unsigned int& frame_size, 
-      unsigned int& trunc, struct timeval& pts, unsigned int& duration, 
-      unsigned char* fTo);
-    static bool deliverFrame0(Rtsp* self, unsigned int& max_size, 
-      unsigned int& frame_size, unsigned int& trunc, struct timeval& pts, 
-      unsigned int& duration, unsigned char* fTo);
-
-  public:
-    LiveSource* live_src_;
     char live_watch_;
 
   private:
@@ -100,36 +466,24 @@ class Rtsp : public Base, Listener<NalBuf> {
     unsigned int bitrate_;
     unsigned int framerate_;
     std::string unicast_;
+    bool on_demand_;
+    unsigned short tunnel_;
+    unsigned int send_buf_;
+    unsigned int pace_;
+    bool rtp_batch_;
+    const unsigned short meta_port_ = {18892};
     UsageEnvironment* env_;
     const unsigned output_max_ = {3 * 1024 * 1024};
     const unsigned cname_len_ = {100};
 
+    std::vector<std::unique_ptr<LiveStream>> streams_;
+
     Semaphore live_sem_;
     std::thread live_;
     void liveProc();
     static void liveProc0(Rtsp* self);
 
-    class RtspNal {
-      public:
-        RtspNal() = delete;
-        RtspNal(unsigned int len) 
-          : length(len), nal(len) {}
-        ~RtspNal() {}
-      public:
-        unsigned int length;
-        std::vector<unsigned char> nal;
-    };
-    std::timed_mutex nal_lock_;
-    const unsigned int nal_timeout_ = {20};
-    const unsigned int nal_num_ = {20};
-    const unsigned int nal_len_ = {20 * 1024};
-    std::deque<std::shared_ptr<Rtsp::RtspNal>> nal_pool_;
-    std::deque<std::shared_ptr<Rtsp::RtspNal>> nal_work_;
-
-    unsigned int overflow_len_ = {0};
-    std::vector<unsigned char> overflow_;
-
-    std::atomic<bool> rtsp_on_;
+    alignas(64) std::atomic<bool> rtsp_on_;
     static void afterPlay(void* data);
 };
 
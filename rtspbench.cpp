@@ -0,0 +1,746 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './rtspbench -h' for usage.
+ *
+ * ----------
+ *
+ *  RTSP viewer load benchmark ('make rtspbench').
+ *
+ *  Plays a running detector's stream (-U for a session per viewer) to
+ *  N clients at once, each on its own thread with its own RTSP session
+ *  and RTP over UDP or interleaved in the RTSP connection, and steps N
+ *  up.  Every step starts its clients fresh, '-r' apart, plays them all
+ *  until '-s' seconds after the last one started and tears them down,
+ *  so each step's time to first frame is a cold join.
+ *
+ *  Per step it prints how many clients got in, their time to the first
+ *  whole key frame (what a gop cache shortens), the frame rate each one
+ *  got whole, the latency from capture to arrival and the packets lost.
+ *  Latency comes from the RTCP sender reports, which tie RTP time to the
+ *  capture's wall clock (see LiveStream::wallClock), so it needs this
+ *  host's clock and the device's in step, the same host or NTP.  With
+ *  '-m' the device's cpu over the step comes from its metrics port, with
+ *  '-p' that of a detector on this host from /proc.
+ *
+ *  '-l' drops that percent of the packets as they arrive, as a lossy link
+ *  would, and '-j' stalls a client up to that many msec after each frame,
+ *  a slow reader, which over tcp pushes back on the server.
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <thread>
+#include <random>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+namespace detector {
+
+class Options {
+  public:
+    std::string url;
+    std::vector<unsigned int> clients{1, 2, 4, 8, 16, 32};
+    bool tcp = false;
+    unsigned int seconds = 20;
+    unsigned int ramp = 100;        // msec between clients starting
+    float loss = 0.f;               // percent of packets dropped as they arrive
+    unsigned int jitter = 0;        // msec at most a client stalls after a frame
+    unsigned int metrics = 0;       // the device's metrics port
+    int pid = 0;                    // a detector on this host
+};
+
+// what a client saw
+class Client {
+  public:
+    bool joined = false;
+    std::string error;
+    double ttff_ms = -1.0;          // to the first whole key frame
+    double play_sec = 0.0;
+    unsigned int frames = 0;        // whole
+    unsigned int broken = 0;        // with packets missing
+    unsigned int packets = 0;
+    unsigned int lost = 0;          // sequence gaps, whether dropped here or not
+    uint64_t bytes = 0;
+    std::vector<double> latency_ms;
+};
+
+// the device's cpu seconds, negative where there is no telling
+class Cpu {
+  public:
+    double proc = -1.0;
+    double busy = -1.0;
+    double idle = -1.0;
+};
+
+static const unsigned int keepalive_sec = 20;
+static const unsigned int io_timeout_ms = 5000;
+static const double ntp_epoch = 2208988800.0;   // 1900 to 1970
+
+static double wall() {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static uint16_t be16(const unsigned char* p) {
+  return (p[0] << 8) | p[1];
+}
+
+static uint32_t be32(const unsigned char* p) {
+  return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// rtsp://host[:port]/path
+static bool parseUrl(const std::string& url, std::string& host, std::string& port) {
+  const std::string scheme = "rtsp://";
+  if (url.compare(0, scheme.size(), scheme) != 0) {
+    return false;
+  }
+  size_t end = url.find('/', scheme.size());
+  std::string auth = url.substr(scheme.size(), end - scheme.size());
+  size_t colon = auth.rfind(':');
+  host = auth.substr(0, colon);
+  port = (colon == std::string::npos) ? "554" : auth.substr(colon + 1);
+  return !host.empty();
+}
+
+static int connectTo(const std::string& host, const std::string& port) {
+  struct addrinfo hints, *res = nullptr;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res) {
+    return -1;
+  }
+  int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+// one viewer's session, on its own thread
+class Viewer {
+  public:
+    Viewer(const Options& opts, Client& res, unsigned int seed)
+      : opts_(opts), res_(res), rng_(seed) {}
+
+    ~Viewer() {
+      for (int fd : { fd_, rtp_fd_, rtcp_fd_ }) {
+        if (fd >= 0) {
+          close(fd);
+        }
+      }
+    }
+
+    void run(std::chrono::steady_clock::time_point until) {
+      start_ = std::chrono::steady_clock::now();
+      if (!open()) {
+        return;
+      }
+      res_.joined = true;
+      auto play = std::chrono::steady_clock::now();
+      if (!stream(until)) {
+        res_.error = res_.error.empty() ? "closed" : res_.error;
+      }
+      res_.play_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - play).count();
+      command("TEARDOWN", base_, "", false);
+    }
+
+  private:
+    const Options& opts_;
+    Client& res_;
+    std::mt19937 rng_;
+    std::chrono::steady_clock::time_point start_;
+
+    int fd_ = -1;
+    int rtp_fd_ = -1;
+    int rtcp_fd_ = -1;
+    unsigned int cseq_ = 0;
+    std::string session_;
+    std::string base_;
+    std::string in_;            // read from the rtsp connection, not yet taken
+
+    bool have_sr_ = false;
+    double sr_wall_ = 0.0;      // capture time of sr_ts_ on the wall clock
+    uint32_t sr_ts_ = 0;
+    bool have_seq_ = false;
+    uint16_t last_seq_ = 0;
+    bool gap_ = false;          // in the frame so far
+    bool key_ = false;
+
+    bool fail(const std::string& why) {
+      res_.error = why;
+      return false;
+    }
+
+    bool send(const std::string& msg) {
+      size_t done = 0;
+      while (done < msg.size()) {
+        ssize_t n = ::send(fd_, msg.data() + done, msg.size() - done, MSG_NOSIGNAL);
+        if (n <= 0) {
+          return false;
+        }
+        done += n;
+      }
+      return true;
+    }
+
+    // more of the connection into 'in_', false when it closed or went quiet
+    bool fill() {
+      struct pollfd pfd = { fd_, POLLIN, 0 };
+      if (poll(&pfd, 1, io_timeout_ms) <= 0) {
+        return false;
+      }
+      char buf[4096];
+      ssize_t n = recv(fd_, buf, sizeof(buf), 0);
+      if (n <= 0) {
+        return false;
+      }
+      in_.append(buf, n);
+      return true;
+    }
+
+    static std::string header(const std::string& head, const char* name) {
+      std::istringstream iss(head);
+      std::string line;
+      size_t len = strlen(name);
+      while (std::getline(iss, line)) {
+        if (line.size() > len && strncasecmp(line.c_str(), name, len) == 0 && line[len] == ':') {
+          std::string val = line.substr(len + 1);
+          val.erase(0, val.find_first_not_of(" \t"));
+          val.erase(val.find_last_not_of(" \t\r") + 1);
+          return val;
+        }
+      }
+      return "";
+    }
+
+    // one whole interleaved packet or reply off the front of 'in_', the
+    // packets go where they would have over udp; false if it isn't all here
+    bool take(std::string* head, std::string* body) {
+      if (in_.empty()) {
+        return false;
+      }
+      if (in_[0] == '$') {
+        if (in_.size() < 4) {
+          return false;
+        }
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(in_.data());
+        size_t len = be16(p + 2);
+        if (in_.size() < 4 + len) {
+          return false;
+        }
+        if (p[1] == 0) {
+          rtp(p + 4, len);
+        } else if (p[1] == 1) {
+          rtcp(p + 4, len);
+        }
+        in_.erase(0, 4 + len);
+        return true;
+      }
+      size_t end = in_.find("\r\n\r\n");
+      if (end == std::string::npos) {
+        return false;
+      }
+      std::string h = in_.substr(0, end + 4);
+      size_t len = strtoul(header(h, "Content-Length").c_str(), nullptr, 10);
+      if (in_.size() < end + 4 + len) {
+        return false;
+      }
+      if (head) {
+        *head = h;
+      }
+      if (body) {
+        *body = in_.substr(end + 4, len);
+      }
+      in_.erase(0, end + 4 + len);
+      return true;
+    }
+
+    bool command(const char* method, const std::string& url, const std::string& extra,
+        bool wait, std::string* head = nullptr, std::string* body = nullptr) {
+      std::string msg = std::string(method) + " " + url + " RTSP/1.0\r\n";
+      msg += "CSeq: " + std::to_string(++cseq_) + "\r\n";
+      msg += "User-Agent: rtspbench\r\n";
+      if (!session_.empty()) {
+        msg += "Session: " + session_ + "\r\n";
+      }
+      msg += extra + "\r\n";
+      if (!send(msg)) {
+        return false;
+      }
+      if (!wait) {
+        return true;
+      }
+      std::string h;
+      while (h.empty()) {
+        if (!take(&h, body) && !fill()) {
+          return false;
+        }
+      }
+      if (head) {
+        *head = h;
+      }
+      return h.compare(0, 12, "RTSP/1.0 200") == 0;
+    }
+
+    // even rtp and odd rtcp ports next to each other
+    bool ports(unsigned int& port) {
+      for (unsigned int tries = 0; tries < 20; tries++) {
+        int a = socket(AF_INET, SOCK_DGRAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        socklen_t len = sizeof(addr);
+        if (a < 0 || bind(a, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+            getsockname(a, reinterpret_cast<struct sockaddr*>(&addr), &len) < 0) {
+          if (a >= 0) {
+            close(a);
+          }
+          return false;
+        }
+        port = ntohs(addr.sin_port);
+        int b = socket(AF_INET, SOCK_DGRAM, 0);
+        addr.sin_port = htons(port + 1);
+        if ((port & 1) == 0 && b >= 0 &&
+            bind(b, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0) {
+          int size = 4 << 20;
+          setsockopt(a, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+          rtp_fd_ = a;
+          rtcp_fd_ = b;
+          return true;
+        }
+        close(a);
+        if (b >= 0) {
+          close(b);
+        }
+      }
+      return false;
+    }
+
+    bool open() {
+      std::string host, port;
+      if (!parseUrl(opts_.url, host, port)) {
+        return fail("bad url");
+      }
+      fd_ = connectTo(host, port);
+      if (fd_ < 0) {
+        return fail("connect");
+      }
+
+      std::string head, sdp;
+      if (!command("DESCRIBE", opts_.url, "Accept: application/sdp\r\n", true, &head, &sdp)) {
+        return fail("describe");
+      }
+      base_ = header(head, "Content-Base");
+      if (base_.empty()) {
+        base_ = opts_.url;
+      }
+
+      // the video's control, relative to the base unless it's a url
+      std::string track = base_, line;
+      std::istringstream iss(sdp);
+      bool video = false;
+      while (std::getline(iss, line)) {
+        line.erase(line.find_last_not_of("\r") + 1);
+        if (line.compare(0, 2, "m=") == 0) {
+          video = line.compare(0, 7, "m=video") == 0;
+        } else if (video && line.compare(0, 10, "a=control:") == 0) {
+          std::string ctl = line.substr(10);
+          if (ctl.compare(0, 7, "rtsp://") == 0) {
+            track = ctl;
+          } else if (ctl != "*") {
+            track = base_ + ((base_.back() == '/') ? "" : "/") + ctl;
+          }
+          break;
+        }
+      }
+
+      std::string transport;
+      if (opts_.tcp) {
+        transport = "RTP/AVP/TCP;unicast;interleaved=0-1";
+      } else {
+        unsigned int p;
+        if (!ports(p)) {
+          return fail("udp ports");
+        }
+        transport = "RTP/AVP;unicast;client_port=" + std::to_string(p) + "-" +
+          std::to_string(p + 1);
+      }
+      if (!command("SETUP", track, "Transport: " + transport + "\r\n", true, &head)) {
+        return fail("setup");
+      }
+      session_ = header(head, "Session");
+      session_ = session_.substr(0, session_.find(';'));
+
+      if (base_.back() == '/') {
+        base_.pop_back();
+      }
+      if (!command("PLAY", base_, "Range: npt=0.000-\r\n", true)) {
+        return fail("play");
+      }
+      return true;
+    }
+
+    bool stream(std::chrono::steady_clock::time_point until) {
+      auto alive = std::chrono::steady_clock::now();
+      unsigned char buf[65536];
+      while (std::chrono::steady_clock::now() < until) {
+        if (std::chrono::steady_clock::now() - alive > std::chrono::seconds(keepalive_sec)) {
+          command("GET_PARAMETER", base_, "", false);
+          alive = std::chrono::steady_clock::now();
+        }
+        struct pollfd pfd[3] = { { fd_, POLLIN, 0 }, { rtp_fd_, POLLIN, 0 }, { rtcp_fd_, POLLIN, 0 } };
+        int n = poll(pfd, opts_.tcp ? 1 : 3, 100);
+        if (n < 0) {
+          return fail("poll");
+        }
+        if (pfd[0].revents & (POLLIN | POLLHUP)) {
+          ssize_t got = recv(fd_, buf, sizeof(buf), 0);
+          if (got <= 0) {
+            return false;
+          }
+          in_.append(reinterpret_cast<char*>(buf), got);
+          while (take(nullptr, nullptr)) {
+          }
+        }
+        if (!opts_.tcp && (pfd[1].revents & POLLIN)) {
+          ssize_t got = recv(rtp_fd_, buf, sizeof(buf), 0);
+          if (got > 0) {
+            rtp(buf, got);
+          }
+        }
+        if (!opts_.tcp && (pfd[2].revents & POLLIN)) {
+          ssize_t got = recv(rtcp_fd_, buf, sizeof(buf), 0);
+          if (got > 0) {
+            rtcp(buf, got);
+          }
+        }
+      }
+      return true;
+    }
+
+    void rtp(const unsigned char* p, size_t len) {
+      res_.packets++;
+      res_.bytes += len;
+      if (opts_.loss > 0.f &&
+          std::uniform_real_distribution<float>(0.f, 100.f)(rng_) < opts_.loss) {
+        return;
+      }
+      if (len < 12 || (p[0] >> 6) != 2) {
+        return;
+      }
+      size_t hdr = 12 + 4 * (p[0] & 0x0f);
+      if ((p[0] & 0x10) && len >= hdr + 4) {
+        hdr += 4 + 4 * be16(p + hdr + 2);
+      }
+      if (p[0] & 0x20) {
+        len -= std::min<size_t>(len, p[len - 1]);
+      }
+      if (len <= hdr) {
+        return;
+      }
+      bool marker = p[1] & 0x80;
+      uint16_t seq = be16(p + 2);
+      uint32_t ts = be32(p + 4);
+      if (have_seq_ && seq != static_cast<uint16_t>(last_seq_ + 1)) {
+        res_.lost += static_cast<uint16_t>(seq - last_seq_ - 1);
+        gap_ = true;
+      }
+      have_seq_ = true;
+      last_seq_ = seq;
+
+      // an idr whole, in a fragment's start or among an aggregate's units
+      const unsigned char* nal = p + hdr;
+      size_t left = len - hdr;
+      unsigned int type = nal[0] & 0x1f;
+      if (type == 28 && left > 1) {
+        key_ |= (nal[1] & 0x1f) == 5;
+      } else if (type == 24) {
+        for (size_t at = 1; at + 2 < left; at += 2 + be16(nal + at)) {
+          key_ |= (nal[at + 2] & 0x1f) == 5;
+        }
+      } else {
+        key_ |= type == 5;
+      }
+
+      if (!marker) {
+        return;
+      }
+      if (gap_) {
+        res_.broken++;
+      } else {
+        res_.frames++;
+        if (key_ && res_.ttff_ms < 0.0) {
+          res_.ttff_ms = std::chrono::duration<double, std::milli>(
+              std::chrono::steady_clock::now() - start_).count();
+        }
+        if (have_sr_) {
+          double capture = sr_wall_ + static_cast<int32_t>(ts - sr_ts_) / 90000.0;
+          res_.latency_ms.push_back((wall() - capture) * 1000.0);
+        }
+      }
+      gap_ = false;
+      key_ = false;
+      if (opts_.jitter) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(
+              std::uniform_int_distribution<unsigned int>(0, opts_.jitter)(rng_)));
+      }
+    }
+
+    // the sender reports in a compound packet
+    void rtcp(const unsigned char* p, size_t len) {
+      while (len >= 8) {
+        size_t size = (be16(p + 2) + 1) * 4;
+        if (size > len) {
+          return;
+        }
+        if (p[1] == 200 && size >= 20) {
+          sr_wall_ = be32(p + 8) - ntp_epoch + be32(p + 12) / 4294967296.0;
+          sr_ts_ = be32(p + 16);
+          have_sr_ = true;
+        }
+        p += size;
+        len -= size;
+      }
+    }
+};
+
+// the metrics endpoint's cpu counters
+static Cpu scrape(const std::string& host, unsigned int port) {
+  Cpu cpu;
+  int fd = connectTo(host, std::to_string(port));
+  if (fd < 0) {
+    return cpu;
+  }
+  std::string req = "GET /metrics HTTP/1.1\r\nHost: " + host + "\r\nConnection: close\r\n\r\n";
+  std::string body;
+  if (send(fd, req.data(), req.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(req.size())) {
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+      body.append(buf, n);
+    }
+  }
+  close(fd);
+  std::istringstream iss(body);
+  std::string line;
+  while (std::getline(iss, line)) {
+    auto value = [&](const char* name, double& out) {
+      if (line.compare(0, strlen(name), name) == 0 && line.size() > strlen(name) &&
+          line[strlen(name)] == ' ') {
+        out = strtod(line.c_str() + strlen(name), nullptr);
+      }
+    };
+    value("detector_process_cpu_seconds_total", cpu.proc);
+    value("detector_host_cpu_seconds_total{mode=\"busy\"}", cpu.busy);
+    value("detector_host_cpu_seconds_total{mode=\"idle\"}", cpu.idle);
+  }
+  return cpu;
+}
+
+// utime and stime of a local process, after the name in parentheses
+static double procCpu(int pid) {
+  FILE* fd = fopen(("/proc/" + std::to_string(pid) + "/stat").c_str(), "r");
+  if (!fd) {
+    return -1.0;
+  }
+  char buf[1024];
+  size_t n = fread(buf, 1, sizeof(buf) - 1, fd);
+  fclose(fd);
+  buf[n] = '\0';
+  const char* p = strrchr(buf, ')');
+  unsigned long utime = 0, stime = 0;
+  if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+        &utime, &stime) != 2) {
+    return -1.0;
+  }
+  return static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static Cpu sample(const Options& opts, const std::string& host) {
+  Cpu cpu;
+  if (opts.metrics) {
+    cpu = scrape(host, opts.metrics);
+  }
+  if (opts.pid) {
+    cpu.proc = procCpu(opts.pid);
+  }
+  return cpu;
+}
+
+static double pct(std::vector<double>& vals, double p) {
+  if (vals.empty()) {
+    return 0.0;
+  }
+  auto it = vals.begin() + std::min(vals.size() - 1, static_cast<size_t>(p * vals.size()));
+  std::nth_element(vals.begin(), it, vals.end());
+  return *it;
+}
+
+static void step(const Options& opts, const std::string& host, unsigned int num) {
+
+  using namespace std::chrono;
+  std::vector<Client> res(num);
+  auto begin = steady_clock::now();
+  auto last = begin + milliseconds(opts.ramp * (num - 1));
+  auto until = last + seconds(opts.seconds);
+  std::vector<std::thread> threads;
+  for (unsigned int i = 0; i < num; i++) {
+    threads.emplace_back([&, i]() {
+      std::this_thread::sleep_until(begin + milliseconds(opts.ramp * i));
+      Viewer v(opts, res[i], i + 1);
+      v.run(until);
+    });
+  }
+
+  // the device's cpu while they're all playing
+  std::this_thread::sleep_until(last + seconds(1));
+  Cpu c0 = sample(opts, host);
+  auto t0 = steady_clock::now();
+  std::this_thread::sleep_until(until);
+  Cpu c1 = sample(opts, host);
+  double span = duration<double>(steady_clock::now() - t0).count();
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  unsigned int joined = 0, frames = 0, broken = 0, packets = 0, lost = 0;
+  uint64_t bytes = 0;
+  double play = 0.0;
+  std::vector<double> ttff, fps, lat;
+  std::string errors;
+  for (auto& r : res) {
+    if (!r.error.empty() && errors.find(r.error) == std::string::npos) {
+      errors += (errors.empty() ? "" : ",") + r.error;
+    }
+    if (!r.joined) {
+      continue;
+    }
+    joined++;
+    if (r.ttff_ms >= 0.0) {
+      ttff.push_back(r.ttff_ms);
+    }
+    fps.push_back(r.play_sec > 0.0 ? r.frames / r.play_sec : 0.0);
+    lat.insert(lat.end(), r.latency_ms.begin(), r.latency_ms.end());
+    frames += r.frames;
+    broken += r.broken;
+    packets += r.packets;
+    lost += r.lost;
+    bytes += r.bytes;
+    play = std::max(play, r.play_sec);
+  }
+  double fps_avg = 0.0;
+  for (auto f : fps) {
+    fps_avg += f / fps.size();
+  }
+
+  char proc[16] = "-", busy[16] = "-";
+  if (c0.proc >= 0.0 && c1.proc >= 0.0 && span > 0.0) {
+    snprintf(proc, sizeof(proc), "%.0f", (c1.proc - c0.proc) * 100.0 / span);
+  }
+  double ticks = (c1.busy - c0.busy) + (c1.idle - c0.idle);
+  if (c0.busy >= 0.0 && c1.busy >= 0.0 && ticks > 0.0) {
+    snprintf(busy, sizeof(busy), "%.0f", (c1.busy - c0.busy) * 100.0 / ticks);
+  }
+  fprintf(stderr, "%7u %6u  %7.0f %7.0f  %6.1f %6.1f  %7.0f %7.0f  %6.2f %6.2f  %7.2f  %5s %5s  %s\n",
+      num, joined, pct(ttff, .5), ttff.empty() ? 0.0 : *std::max_element(ttff.begin(), ttff.end()),
+      fps_avg, fps.empty() ? 0.0 : *std::min_element(fps.begin(), fps.end()),
+      pct(lat, .5), pct(lat, .99),
+      (packets + lost) ? lost * 100.0 / (packets + lost) : 0.0,
+      (frames + broken) ? broken * 100.0 / (frames + broken) : 0.0,
+      play > 0.0 ? bytes * 8.0 / play / 1e6 : 0.0, proc, busy, errors.c_str());
+}
+
+void usage() {
+  std::cout << "rtspbench -?unsrtljmp"             << std::endl;
+  std::cout                                        << std::endl;
+  std::cout << "  where:"                          << std::endl;
+  std::cout << "  ?            = this screen"      << std::endl;
+  std::cout << "  (u)rl        = the detector's stream, e.g. rtsp://pi:8554/camera (default = none)" << std::endl;
+  std::cout << "  (n)umber     = clients per step, comma separated (default = 1,2,4,8,16,32)" << std::endl;
+  std::cout << "  (s)econds    = each step plays after its last client starts (default = 20)" << std::endl;
+  std::cout << "  (r)amp       = msec between clients starting (default = 100)" << std::endl;
+  std::cout << "  (t)ransport  = 'udp' or 'tcp', interleaved in the rtsp connection (default = udp)" << std::endl;
+  std::cout << "  (l)oss       = percent of packets dropped as they arrive (default = 0)" << std::endl;
+  std::cout << "  (j)itter     = msec at most a client stalls after each frame (default = 0)" << std::endl;
+  std::cout << "  (m)etrics    = the device's metrics port, for its cpu (default = none)" << std::endl;
+  std::cout << "  (p)id        = a detector on this host, for its cpu (default = none)" << std::endl;
+}
+
+} // namespace detector
+
+int main(int argc, char** argv) {
+
+  detector::Options opts;
+
+  int c;
+  while ((c = getopt(argc, argv, ":u:n:s:r:t:l:j:m:p:")) != -1) {
+    switch (c) {
+      case 'u': opts.url = optarg;                    break;
+      case 'n': {
+          opts.clients.clear();
+          std::stringstream ss(optarg);
+          std::string item;
+          while (std::getline(ss, item, ',')) {
+            opts.clients.push_back(std::max(1ul, std::stoul(item)));
+          }
+        }
+        break;
+      case 's': opts.seconds = std::max(1ul, std::stoul(optarg)); break;
+      case 'r': opts.ramp = std::stoul(optarg);       break;
+      case 't': opts.tcp = std::string(optarg) == "tcp"; break;
+      case 'l': opts.loss = std::stof(optarg);        break;
+      case 'j': opts.jitter = std::stoul(optarg);     break;
+      case 'm': opts.metrics = std::stoul(optarg);    break;
+      case 'p': opts.pid = std::stoi(optarg);         break;
+      default:  detector::usage();                    return -1;
+    }
+  }
+  std::string host, port;
+  if (!detector::parseUrl(opts.url, host, port)) {
+    detector::usage();
+    return -1;
+  }
+
+  fprintf(stderr, "%s over %s, %u sec a step\n", opts.url.c_str(), opts.tcp ? "tcp" : "udp",
+      opts.seconds);
+  fprintf(stderr, "%7s %6s  %15s  %13s  %15s  %13s  %7s  %11s\n", "", "",
+      "ttff (ms)", "fps", "latency (ms)", "lost %", "", "device cpu%");
+  fprintf(stderr, "%7s %6s  %7s %7s  %6s %6s  %7s %7s  %6s %6s  %7s  %5s %5s  %s\n",
+      "clients", "joined", "p50", "max", "avg", "min", "p50", "p99", "pkts", "frames",
+      "mbit/s", "proc", "host", "errors");
+  for (auto num : opts.clients) {
+    detector::step(opts, host, num);
+    sleep(2);   // the server lets go of the last step's sessions
+  }
+  return 0;
+}
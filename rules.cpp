@@ -0,0 +1,380 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+#include "rules.h"
+#include "metrics.h"
+
+namespace detector {
+
+Rules::Rules(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Rules::~Rules() {
+}
+
+std::unique_ptr<Rules> Rules::create(unsigned int yield_time, bool quiet,
+    const std::string& path, unsigned int width, unsigned int height) {
+  auto obj = std::unique_ptr<Rules>(new Rules(yield_time));
+  if (!obj->init(quiet, path, width, height)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Rules::init(bool quiet, const std::string& path, unsigned int width, unsigned int height) {
+
+  quiet_ = quiet;
+  width_ = width;
+  height_ = height;
+  evt_ = nullptr;
+  cnt_ = nullptr;
+  rules_on_ = false;
+  event_cnt_ = 0;
+  enter_cnt_ = 0;
+  exit_cnt_ = 0;
+  cross_cnt_ = 0;
+  dwell_cnt_ = 0;
+
+  cell_w_ = std::max(1.f, static_cast<float>(width_) / kCells);
+  cell_h_ = std::max(1.f, static_cast<float>(height_) / kCells);
+  if (!load(path)) {
+    return false;
+  }
+  mark_.assign(rules_.size(), 0);
+  pass_ = 0;
+  post_pass_ = 0;
+  return true;
+}
+
+bool Rules::load(const std::string& path) {
+
+  std::ifstream ifs(path.c_str(), std::ifstream::in);
+  if (!ifs) {
+    dbgMsg("could not open rules %s\n", path.c_str());
+    return false;
+  }
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::istringstream iss(line);
+    std::string kind;
+    if (!(iss >> kind) || kind[0] == '#') {
+      continue;
+    }
+
+    Rules::Rule r;
+    r.zone = (kind == "zone");
+    r.dwell = 0;
+    if (!(kind == "zone" || kind == "line") || !(iss >> r.name)) {
+      dbgMsg("bad rule: %s\n", line.c_str());
+      return false;
+    }
+    std::vector<std::pair<float, float>> pts;
+    std::string tok;
+    while (iss >> tok) {
+      float x, y;
+      if (tok == "dwell") {
+        if (!(iss >> r.dwell)) {
+          dbgMsg("bad rule dwell: %s\n", line.c_str());
+          return false;
+        }
+      } else if (sscanf(tok.c_str(), "%f,%f", &x, &y) == 2) {
+        pts.push_back(std::make_pair(x, y));
+      } else {
+        dbgMsg("bad rule point: %s\n", tok.c_str());
+        return false;
+      }
+    }
+    if ((r.zone && pts.size() < 3) || (!r.zone && pts.size() != 2)) {
+      dbgMsg("a zone needs 3 points or more and a line 2: %s\n", line.c_str());
+      return false;
+    }
+
+    r.min_x = r.max_x = pts[0].first;
+    r.min_y = r.max_y = pts[0].second;
+    for (auto& p : pts) {
+      r.min_x = std::min(r.min_x, p.first);
+      r.max_x = std::max(r.max_x, p.first);
+      r.min_y = std::min(r.min_y, p.second);
+      r.max_y = std::max(r.max_y, p.second);
+    }
+    if (r.zone) {
+
+      // the edge table, flat edges never cross a row
+      for (unsigned int i = 0; i < pts.size(); i++) {
+        auto& a = pts[i];
+        auto& b = pts[(i + 1) % pts.size()];
+        if (a.second == b.second) {
+          continue;
+        }
+        auto& lo = (a.second < b.second) ? a : b;
+        auto& hi = (a.second < b.second) ? b : a;
+        r.edges.push_back(Rules::Edge{lo.second, hi.second, lo.first,
+            (hi.first - lo.first) / (hi.second - lo.second)});
+      }
+      r.ax = r.ay = r.bx = r.by = 0.f;
+    } else {
+      r.ax = pts[0].first;
+      r.ay = pts[0].second;
+      r.bx = pts[1].first;
+      r.by = pts[1].second;
+    }
+    rules_.push_back(r);
+    file(rules_.size() - 1);
+  }
+  return true;
+}
+
+void Rules::file(unsigned int n) {
+
+  const Rules::Rule& r = rules_[n];
+  int c0 = std::max(0, std::min(static_cast<int>(kCells) - 1, static_cast<int>(r.min_x / cell_w_)));
+  int c1 = std::max(0, std::min(static_cast<int>(kCells) - 1, static_cast<int>(r.max_x / cell_w_)));
+  int r0 = std::max(0, std::min(static_cast<int>(kCells) - 1, static_cast<int>(r.min_y / cell_h_)));
+  int r1 = std::max(0, std::min(static_cast<int>(kCells) - 1, static_cast<int>(r.max_y / cell_h_)));
+  for (int cy = r0; cy <= r1; cy++) {
+    for (int cx = c0; cx <= c1; cx++) {
+      cell_rules_[cy * kCells + cx].push_back(n);
+    }
+  }
+}
+
+void Rules::candidates(float x0, float y0, float x1, float y1) {
+
+  // the rules filed in the cells the step's bounds cover, each once
+  pass_++;
+  cand_.clear();
+  auto clampCell = [](float v, float size) {
+    return std::max(0, std::min(static_cast<int>(kCells) - 1, static_cast<int>(v / size)));
+  };
+  int c0 = clampCell(std::min(x0, x1), cell_w_);
+  int c1 = clampCell(std::max(x0, x1), cell_w_);
+  int r0 = clampCell(std::min(y0, y1), cell_h_);
+  int r1 = clampCell(std::max(y0, y1), cell_h_);
+  for (int cy = r0; cy <= r1; cy++) {
+    for (int cx = c0; cx <= c1; cx++) {
+      for (auto n : cell_rules_[cy * kCells + cx]) {
+        if (mark_[n] != pass_) {
+          mark_[n] = pass_;
+          cand_.push_back(n);
+        }
+      }
+    }
+  }
+}
+
+bool Rules::inside(const Rules::Rule& r, float x, float y) {
+
+  if (x < r.min_x || x > r.max_x || y < r.min_y || y > r.max_y) {
+    return false;
+  }
+  bool in = false;
+  for (auto& e : r.edges) {
+    if (y >= e.y0 && y < e.y1 && x < e.x0 + (y - e.y0) * e.slope) {
+      in = !in;
+    }
+  }
+  return in;
+}
+
+int Rules::crosses(const Rules::Rule& r, float x0, float y0, float x1, float y1) {
+
+  // the step and the line each have the other's ends on both sides
+  float lx = r.bx - r.ax, ly = r.by - r.ay;
+  float d0 = lx * (y0 - r.ay) - ly * (x0 - r.ax);
+  float d1 = lx * (y1 - r.ay) - ly * (x1 - r.ax);
+  float sx = x1 - x0, sy = y1 - y0;
+  float da = sx * (r.ay - y0) - sy * (r.ax - x0);
+  float db = sx * (r.by - y0) - sy * (r.bx - x0);
+  if (!(d0 * d1 < 0.f && da * db < 0.f)) {
+    return -1;
+  }
+
+  // rows go down, so positive is to the right going from a to b
+  return (d1 > 0.f) ? 1 : 0;
+}
+
+void Rules::emit(Events::Rule::What what, const Rules::State& st, unsigned int id,
+    unsigned int rule, unsigned int value, std::chrono::steady_clock::time_point stamp) {
+
+  switch (what) {
+    case Events::Rule::What::kEnter: enter_cnt_++; break;
+    case Events::Rule::What::kExit:  exit_cnt_++;  break;
+    case Events::Rule::What::kCross: cross_cnt_++; break;
+    case Events::Rule::What::kDwell: dwell_cnt_++; break;
+  }
+  event_cnt_++;
+  Events::Rule hit{what, stamp, st.type, id, rule, value};
+  if (evt_) {
+    evt_->addMessage(hit);
+  }
+  if (cnt_) {
+    cnt_->addMessage(hit);
+  }
+}
+
+void Rules::check(const TrackBuf& track, Rules::State& st, bool fresh) {
+
+  using namespace std::chrono;
+  float x = track.x + track.w / 2.f;
+  float y = track.y + track.h;
+  auto stamp = (track.stamp.time_since_epoch().count() != 0) ?
+    track.stamp : steady_clock::now();
+
+  candidates(fresh ? x : st.x, fresh ? y : st.y, x, y);
+  for (auto n : cand_) {
+    const Rules::Rule& r = rules_[n];
+    if (!r.zone) {
+      int side = fresh ? -1 : crosses(r, st.x, st.y, x, y);
+      if (side >= 0) {
+        emit(Events::Rule::What::kCross, st, track.id, n, side, stamp);
+      }
+      continue;
+    }
+
+    auto it = std::find_if(st.in.begin(), st.in.end(),
+        [&](const Rules::In& in) { return in.rule == n; });
+    bool now_in = inside(r, x, y);
+    if (now_in && it == st.in.end()) {
+      st.in.push_back(Rules::In{n, stamp, false});
+      emit(Events::Rule::What::kEnter, st, track.id, n, 0, stamp);
+    } else if (!now_in && it != st.in.end()) {
+      unsigned int ms = duration_cast<milliseconds>(stamp - it->since).count();
+      st.in.erase(it);
+      emit(Events::Rule::What::kExit, st, track.id, n, ms, stamp);
+    } else if (now_in && r.dwell && !it->dwelled &&
+        stamp - it->since >= milliseconds(r.dwell)) {
+      it->dwelled = true;
+      emit(Events::Rule::What::kDwell, st, track.id, n,
+          duration_cast<milliseconds>(stamp - it->since).count(), stamp);
+    }
+  }
+  st.x = x;
+  st.y = y;
+}
+
+bool Rules::addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks) {
+  if (!rules_on_ || !tracks || !track_chan_.push(tracks)) {
+    return false;
+  }
+  wake();
+  return true;
+}
+
+void Rules::setEvents(Events* evt) {
+  evt_ = evt;
+}
+
+void Rules::setCounts(Counts* cnt) {
+  cnt_ = cnt;
+}
+
+void Rules::metrics(Exposition& out, const std::string& labels) {
+  out.counter("detector_rule_events_total", "zone and line events",
+      labels + ",kind=\"enter\"", enter_cnt_);
+  out.counter("detector_rule_events_total", "zone and line events",
+      labels + ",kind=\"exit\"", exit_cnt_);
+  out.counter("detector_rule_events_total", "zone and line events",
+      labels + ",kind=\"cross\"", cross_cnt_);
+  out.counter("detector_rule_events_total", "zone and line events",
+      labels + ",kind=\"dwell\"", dwell_cnt_);
+  out.gauge("detector_queue_depth", "messages waiting for the stage", labels,
+      track_chan_.size());
+  out.counter("detector_queue_drops_total", "messages the stage's queue dropped", labels,
+      track_chan_.drops());
+}
+
+bool Rules::waitingToRun() {
+
+  if (!rules_on_) {
+    states_.clear();
+    rules_on_ = true;
+  }
+  return true;
+}
+
+bool Rules::running() {
+
+  if (rules_on_) {
+    std::shared_ptr<std::vector<TrackBuf>> tracks;
+    while (track_chan_.pop(tracks)) {
+      differ_check_.begin();
+      post_pass_++;
+      for (auto& track : *tracks) {
+        auto it = states_.find(track.id);
+        bool fresh = (it == states_.end());
+        if (fresh) {
+          it = states_.emplace(track.id, Rules::State()).first;
+          it->second.type = track.type;
+        }
+        it->second.pass = post_pass_;
+        check(track, it->second, fresh);
+      }
+
+      // a track that went is out of its zones
+      auto now = std::chrono::steady_clock::now();
+      for (auto it = states_.begin(); it != states_.end(); ) {
+        if (it->second.pass == post_pass_) {
+          it++;
+          continue;
+        }
+        for (auto& in : it->second.in) {
+          unsigned int ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+              now - in.since).count();
+          emit(Events::Rule::What::kExit, it->second, it->first, in.rule, ms, now);
+        }
+        it = states_.erase(it);
+      }
+      tracks.reset();
+      differ_check_.end();
+    }
+  }
+  return true;
+}
+
+bool Rules::paused() {
+  return true;
+}
+
+bool Rules::waitingToHalt() {
+
+  if (rules_on_) {
+    rules_on_ = false;
+
+    if (!quiet_) {
+      fprintf(stderr, "\nRules Results...\n");
+      fprintf(stderr, "              rules: %zu\n", rules_.size());
+      fprintf(stderr, "  enter/exit events: %u/%u\n", enter_cnt_, exit_cnt_);
+      fprintf(stderr, "       cross events: %u\n", cross_cnt_);
+      fprintf(stderr, "       dwell events: %u\n", dwell_cnt_);
+      fprintf(stderr, "    check time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_check_.pct(.5), differ_check_.pct(.9), differ_check_.pct(.99), differ_check_.pct(.999),
+          differ_check_.high, differ_check_.avg, 
+          differ_check_.low,  differ_check_.cnt);
+      fprintf(stderr, "\n");
+    }
+  }
+  return true;
+}
+
+} // namespace detector
@@ -0,0 +1,162 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Zone and tripwire rules on the tracks.
+ *
+ *  With --rules file the tracker's posted tracks are checked against
+ *  polygons and lines on the frame, one a line of the file:
+ *
+ *    zone name x,y x,y x,y ... [dwell msec]
+ *    line name x,y x,y
+ *
+ *  in frame pixels.  A track is where it stands, the middle of its
+ *  box's bottom edge.  A zone gives enter and exit as the track comes
+ *  and goes, and dwell once it has stayed 'dwell' msec; a line gives a
+ *  cross each time the track's step from its last place cuts it, with
+ *  the side it went to.  They go out with the events (see events.h) as
+ *
+ *    [kind, msec, type, id, rule, value]
+ *
+ *  with kind 6 zone enter, 7 zone exit, 8 cross and 9 zone dwell, rule
+ *  the line number of the rule among the rules and value the direction
+ *  of a cross (0 to the left of the line going from its first point to
+ *  its second, 1 to the right) or the msec in the zone of an exit or
+ *  dwell.  A track that goes is out of its zones.
+ *
+ *  Each polygon's edges are kept as a table of y ranges and slopes and
+ *  every rule is filed in the cells of a coarse grid its bounds cover,
+ *  so a track only tests the rules of the cells it is in or stepped
+ *  across, however many rules there are.
+ */
+
+#ifndef RULES_H
+#define RULES_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <atomic>
+
+#include "utils.h"
+#include "listener.h"
+#include "channel.h"
+#include "base.h"
+#include "events.h"
+#include "counts.h"
+
+namespace detector {
+
+class Rules : public Base, Listener<std::shared_ptr<std::vector<TrackBuf>>> {
+  public:
+    static std::unique_ptr<Rules> create(unsigned int yield_time, bool quiet,
+        const std::string& path, unsigned int width, unsigned int height);
+    virtual ~Rules();
+
+  public:
+    virtual bool addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks);
+
+    // where the rules' events go, set before start
+    void setEvents(Events* evt);
+    void setCounts(Counts* cnt);
+
+    virtual void metrics(Exposition& out, const std::string& labels);
+
+  protected:
+    Rules() = delete;
+    Rules(unsigned int yield_time);
+    bool init(bool quiet, const std::string& path, unsigned int width, unsigned int height);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    unsigned int width_;
+    unsigned int height_;
+    Events* evt_;
+    Counts* cnt_;
+
+    Channel<std::shared_ptr<std::vector<TrackBuf>>> track_chan_{4,
+      Channel<std::shared_ptr<std::vector<TrackBuf>>>::Policy::kDropOldest};
+
+    // an edge of a polygon, crossing rows [y0, y1) at x0 + (y - y0) * slope
+    class Edge {
+      public:
+        float y0, y1;
+        float x0;
+        float slope;
+    };
+    class Rule {
+      public:
+        std::string name;
+        bool zone;
+        std::vector<Rules::Edge> edges;   // a zone's
+        float ax, ay, bx, by;             // a line's
+        unsigned int dwell;               // msec, 0 none
+        float min_x, min_y, max_x, max_y;
+    };
+    std::vector<Rules::Rule> rules_;
+    bool load(const std::string& path);
+    bool inside(const Rules::Rule& r, float x, float y);
+    int crosses(const Rules::Rule& r, float x0, float y0, float x1, float y1);
+
+    // rules by grid cell
+    static constexpr unsigned int kCells = 16;
+    std::vector<unsigned int> cell_rules_[kCells * kCells];
+    float cell_w_, cell_h_;
+    void file(unsigned int n);
+    void candidates(float x0, float y0, float x1, float y1);
+    std::vector<unsigned int> cand_;
+    std::vector<unsigned int> mark_;
+    unsigned int pass_;
+
+    // what each track was doing on the last post
+    class In {
+      public:
+        unsigned int rule;
+        std::chrono::steady_clock::time_point since;
+        bool dwelled;
+    };
+    class State {
+      public:
+        float x, y;
+        BoxBuf::Type type;
+        std::vector<Rules::In> in;
+        unsigned int pass;
+    };
+    std::unordered_map<unsigned int, Rules::State> states_;
+    unsigned int post_pass_;
+    void check(const TrackBuf& track, Rules::State& st, bool fresh);
+    void emit(Events::Rule::What what, const Rules::State& st, unsigned int id,
+        unsigned int rule, unsigned int value, std::chrono::steady_clock::time_point stamp);
+
+    std::atomic<bool> rules_on_;
+    unsigned int event_cnt_;
+    unsigned int enter_cnt_, exit_cnt_, cross_cnt_, dwell_cnt_;
+    MicroDiffer<uint32_t> differ_check_;
+};
+
+} // namespace detector
+
+#endif // RULES_H
@@ -0,0 +1,163 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "screen.h"
+#include "pyramid.h"
+
+namespace detector {
+
+Screen::Screen() {
+}
+
+Screen::~Screen() {
+}
+
+std::unique_ptr<Screen> Screen::create(unsigned int width, unsigned int height,
+    unsigned int pix_fmt, unsigned int stride, const std::string& model, float threshold) {
+  auto obj = std::unique_ptr<Screen>(new Screen());
+  if (!obj->init(width, height, pix_fmt, stride, model, threshold)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Screen::init(unsigned int width, unsigned int height,
+    unsigned int pix_fmt, unsigned int stride, const std::string& model, float threshold) {
+
+  width_ = width;
+  height_ = height;
+  pix_fmt_ = pix_fmt;
+  stride_ = stride;
+  threshold_ = threshold;
+  score_ = 0.f;
+  last_fire_ = {};
+  last_pass_ = {};
+
+  scaler_ = pick_rgb24_scaler(pix_fmt_);
+  if (!scaler_) {
+    dbgMsg("unsupported frame format %s\n", PixelFormatToStr(pix_fmt_));
+    return false;
+  }
+
+  // one thread, it has to keep up with the frame rate and no more
+  model_ = tflite::FlatBufferModel::BuildFromFile(model.c_str());
+  if (!model_) {
+    dbgMsg("failed: screen model %s\n", model.c_str());
+    return false;
+  }
+  tflite::ops::builtin::BuiltinOpResolver resolver;
+  tflite::InterpreterBuilder(*model_, resolver)(&interpreter_);
+  if (!interpreter_) {
+    dbgMsg("failed: screen interpreter\n");
+    return false;
+  }
+  interpreter_->SetNumThreads(1);
+  if (interpreter_->AllocateTensors() != kTfLiteOk) {
+    dbgMsg("failed: screen tensors\n");
+    return false;
+  }
+
+  TfLiteTensor* in = interpreter_->tensor(interpreter_->inputs()[0]);
+  TfLiteTensor* out = interpreter_->tensor(interpreter_->outputs()[0]);
+  if (in->dims->size != 4 || in->dims->data[3] != 3 ||
+      (in->type != kTfLiteUInt8 && in->type != kTfLiteFloat32) ||
+      (out->type != kTfLiteUInt8 && out->type != kTfLiteFloat32)) {
+    dbgMsg("failed: screen model wants a 3 channel uint8 or float input and output\n");
+    return false;
+  }
+  in_height_ = in->dims->data[1];
+  in_width_ = in->dims->data[2];
+  rgb_.resize(in_width_ * in_height_ * 3);
+  return true;
+}
+
+bool Screen::fires(const FrameBuf& frame) {
+
+  if (frame.addr == nullptr) {
+    return true;
+  }
+
+  using namespace std::chrono;
+  auto now = (frame.stamp.time_since_epoch().count() != 0) ?
+    frame.stamp : steady_clock::now();
+  if (now - last_fire_ < milliseconds(hold_time_) ||
+      now - last_pass_ >= milliseconds(idle_time_)) {
+    last_pass_ = now;
+    return true;
+  }
+
+  // the smallest level that still has the pixels the model sees
+  differ_eval.begin();
+  Rect dst = { 0, 0, in_width_, in_height_ };
+  const Level* lvl = nullptr;
+  for (unsigned int k = 1; frame.levels && (width_ >> k) >= in_width_ &&
+      (height_ >> k) >= in_height_; k++) {
+    const Level* next = frame.levels->get(k);
+    if (!next) {
+      break;
+    }
+    lvl = next;
+  }
+  if (lvl) {
+    Rect src = { 0, 0, lvl->width & ~1u, lvl->height & ~1u };
+    scaler_(lvl->addr, lvl->stride, lvl->slice, src,
+        rgb_.data(), in_width_, in_height_, dst, 0);
+  } else {
+    Rect src = { 0, 0, width_ & ~1u, height_ & ~1u };
+    scaler_(frame.addr, stride_, ALIGN_16B(height_), src,
+        rgb_.data(), in_width_, in_height_, dst, 0);
+  }
+
+  TfLiteTensor* in = interpreter_->tensor(interpreter_->inputs()[0]);
+  if (in->type == kTfLiteUInt8) {
+    std::memcpy(in->data.uint8, rgb_.data(), rgb_.size());
+  } else {
+    float scale = (in->params.scale > 0.f) ? in->params.scale : 1.f / 127.5f;
+    float zero = (in->params.scale > 0.f) ? in->params.zero_point : 127.5f;
+    quantise_rgb24(rgb_.data(), in->data.f, rgb_.size(), scale, zero);
+  }
+  if (interpreter_->Invoke() != kTfLiteOk) {
+    dbgMsg("failed: screen invoke\n");
+    differ_eval.end();
+    return true;
+  }
+
+  // the best of the classes past 'nothing', a single output is the score
+  TfLiteTensor* out = interpreter_->tensor(interpreter_->outputs()[0]);
+  unsigned int num = out->bytes / ((out->type == kTfLiteUInt8) ? 1 : sizeof(float));
+  float best = 0.f;
+  for (unsigned int i = (num > 1) ? 1 : 0; i < num; i++) {
+    float s = (out->type == kTfLiteUInt8) ?
+      (out->data.uint8[i] - out->params.zero_point) * out->params.scale : out->data.f[i];
+    best = std::max(best, s);
+  }
+  differ_eval.end();
+  score_ = best;
+
+  if (best >= threshold_) {
+    last_fire_ = now;
+    last_pass_ = now;
+    return true;
+  }
+  return false;
+}
+
+} // namespace detector
@@ -0,0 +1,89 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Screening model in front of the detector.
+ *
+ *  A small classifier (a person / no person model at 96x96, say) runs on
+ *  every frame that gets this far, from the smallest pyramid level that
+ *  still covers its input.  Its best score over the classes past the
+ *  first, which is taken to be 'nothing', says whether the frame is worth
+ *  the detector.  Like the motion gate it lets frames through for a hold
+ *  time after it fires, and once in a while regardless, so whatever it
+ *  misses is still looked at.
+ */
+
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "utils.h"
+#include "listener.h"
+
+#include <tensorflow/lite/interpreter.h>
+#include <tensorflow/lite/kernels/register.h>
+#include <tensorflow/lite/model.h>
+
+namespace detector {
+
+class Screen {
+  public:
+    static std::unique_ptr<Screen> create(unsigned int width, unsigned int height,
+        unsigned int pix_fmt, unsigned int stride, const std::string& model, float threshold);
+    ~Screen();
+
+  public:
+    // true when the frame should go to the detector
+    bool fires(const FrameBuf& frame);
+
+    inline float lastScore() { return score_; }
+    MicroDiffer<uint32_t> differ_eval;
+
+  protected:
+    Screen();
+    bool init(unsigned int width, unsigned int height,
+        unsigned int pix_fmt, unsigned int stride, const std::string& model, float threshold);
+
+  private:
+    unsigned int width_;
+    unsigned int height_;
+    unsigned int pix_fmt_;
+    unsigned int stride_;
+    float threshold_;
+
+    std::unique_ptr<tflite::FlatBufferModel> model_;
+    std::unique_ptr<tflite::Interpreter> interpreter_;
+    Rgb24Scaler scaler_;
+    unsigned int in_width_;
+    unsigned int in_height_;
+    std::vector<unsigned char> rgb_;
+    float score_;
+
+    const unsigned int hold_time_ = {1000};  // msec
+    const unsigned int idle_time_ = {5000};  // msec
+    std::chrono::steady_clock::time_point last_fire_;
+    std::chrono::steady_clock::time_point last_pass_;
+};
+
+} // namespace detector
+
+#endif // SCREEN_H
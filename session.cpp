@@ -0,0 +1,525 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <cmath>
+#include <utility>
+
+#include "session.h"
+#include "control.h"
+#include "watchdog.h"
+#include "encoder.h"
+#include "rtsp.h"
+#include "recorder.h"
+#include "hls.h"
+#include "webrtc.h"
+#include "snapshot.h"
+#include "picture.h"
+#include "preview.h"
+#include "crops.h"
+#include "capturer.h"
+#include "replay.h"
+#include "ingest.h"
+#include "archive.h"
+#include "peer.h"
+#include "tracker.h"
+#include "publish.h"
+#include "events.h"
+#include "rules.h"
+#include "counts.h"
+#include "journal.h"
+#include "metrics.h"
+#include "flight.h"
+#include "trace.h"
+#include "governor.h"
+#include "fate.h"
+#include "shed.h"
+#include "idle.h"
+#include "perf.h"
+#include "startup.h"
+#include "deadline.h"
+
+namespace detector {
+
+Session::~Session() {
+  stop();
+}
+
+std::unique_ptr<Session> Session::create(const Session::Options& opts, Sink* sink) {
+  auto obj = std::unique_ptr<Session>(new Session());
+  if (!obj->init(opts, sink)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+void Session::complete(Session::Options& opts) {
+  if (opts.model.empty()) {
+    opts.model = opts.tpu ? "./models/edgetpu_detect.tflite" : "./models/detect.tflite";
+  }
+  if (opts.labels.empty()) {
+    opts.labels = opts.tpu ? "./models/edgetpu_labels.txt" : "./models/labels.txt";
+  }
+}
+
+bool Session::init(const Session::Options& opts, Sink* sink) {
+
+  opts_ = opts;
+  complete(opts_);
+  auto& o = opts_;
+  unsigned int width = std::abs(o.width);
+  unsigned int height = std::abs(o.height);
+
+  // a quarter turned camera makes the rest of the pipeline portrait
+  if (o.rotate != 0 && (o.isp_device >= 0 || !o.ingest.empty() || !o.archive.empty() ||
+        !o.replay.empty())) {
+    dbgMsg("failed: only a camera's frames are turned\n");
+    return false;
+  }
+  if (o.rotate == 90 || o.rotate == 270) {
+    std::swap(width, height);
+  }
+
+  if (!o.trace.empty()) {
+    Trace::start(o.trace_len);
+  }
+  if (o.perf) {
+    Perf::start();
+  }
+  if (o.fates) {
+    Fate::start();
+  }
+  if (!o.deadlines.empty() && !Deadline::parse(o.deadlines)) {
+    return false;
+  }
+
+  pipe_ = Pipeline::create(o.quiet);
+  if (!o.ctl_path.empty()) {
+    pipe_->add("ctl", 10, Control::create(100000, o.quiet, o.ctl_path, pipe_.get()));
+  }
+  if (o.guard) {
+    pipe_->add("dog", 10, Watchdog::create(2000000, o.quiet, o.guard * 1000, pipe_.get()));
+  }
+  if (!o.governor.empty()) {
+    if (!pipe_->add("gov", 10, Governor::create(1000000, o.quiet, o.governor, pipe_.get()))) {
+      dbgMsg("failed: create governor\n");
+      return false;
+    }
+  } else if (!o.shed.empty()) {
+    if (!pipe_->add("shed", 10, Shed::create(1000000, o.quiet, o.shed, pipe_.get()))) {
+      dbgMsg("failed: create shed\n");
+      return false;
+    }
+  }
+  if (!o.idle.empty()) {
+    if (!pipe_->add("idle", 10, Idle::create(1000000, o.quiet, o.idle, pipe_.get()))) {
+      dbgMsg("failed: create idle\n");
+      return false;
+    }
+  }
+  if (o.metrics) {
+    pipe_->add("met", 10, Metrics::create(100000, o.quiet, o.metrics, pipe_.get()));
+  }
+  if (!o.flight.empty()) {
+    if (!pipe_->add("fly", 10, Flight::create(100000, o.quiet, o.flight, pipe_.get()))) {
+      dbgMsg("failed: create flight recorder\n");
+      return false;
+    }
+  }
+  Rtsp* rtsp = nullptr;
+  Recorder* rec = nullptr;
+  Hls* hls = nullptr;
+  Webrtc* rtc = nullptr;
+  Snapshot* snap = nullptr;
+  Picture* pic = nullptr;
+  Preview* prv = nullptr;
+  Crops* crp = nullptr;
+  Tracker* trk = nullptr;
+  Publisher* pub = nullptr;
+  Events* evt = nullptr;
+  Rules* rul = nullptr;
+  Counts* cnt = nullptr;
+  Journal* jnl = nullptr;
+  if (!o.pub_name.empty()) {
+    pub = pipe_->add("pub", 10, Publisher::create(o.yield_time, o.quiet, o.pub_name,
+        width, height, o.pix_fmt));
+  }
+  if (!o.events.empty()) {
+    evt = pipe_->add("evt", 10, Events::create(o.yield_time, o.quiet, o.events));
+    if (!evt) {
+      dbgMsg("failed: create events\n");
+      return false;
+    }
+    evt->setFlatbuffers(o.events_fb);
+  }
+  if (!o.journal.empty()) {
+    jnl = pipe_->add("jnl", 10, Journal::create(o.yield_time, o.quiet, o.journal));
+    if (!jnl) {
+      dbgMsg("failed: create journal\n");
+      return false;
+    }
+  }
+  if (o.counts != 0 && o.tracking) {
+    cnt = pipe_->add("cnt", 10, Counts::create(o.yield_time, o.quiet, o.counts));
+    if (!cnt) {
+      dbgMsg("failed: create counts\n");
+      return false;
+    }
+    cnt->setEvents(evt);
+  }
+  if (!o.rules.empty() && o.tracking) {
+    rul = pipe_->add("rul", 10, Rules::create(o.yield_time, o.quiet, o.rules,
+          width, height));
+    if (!rul) {
+      dbgMsg("failed: rules %s\n", o.rules.c_str());
+      return false;
+    }
+    rul->setEvents(evt);
+    rul->setCounts(cnt);
+  }
+  if (o.streaming) {
+    rtsp = pipe_->add("rtsp", 90, Rtsp::create(o.yield_time, o.quiet, o.bitrate, o.framerate,
+        o.unicast, o.half ? o.bitrate / 4 : 0, o.on_demand, o.tunnel, o.send_buf, o.pace, o.rtp_batch, o.meta));
+  }
+  if ((o.segment != 0 || o.event_quiet != 0) && !o.output.empty()) {
+    rec = pipe_->add("rec", 10, Recorder::create(o.yield_time, o.quiet, o.output, o.framerate,
+        width, height, o.segment, o.event_quiet, o.preroll));
+    if (rec && o.retain) {
+
+      // a segment's bytes at the bitrate with some headroom, a minute for clips
+      uint64_t len = static_cast<uint64_t>(o.bitrate / 8) * (o.segment ? o.segment : 60) * 5 / 4;
+      len = std::max<uint64_t>(len, 1 << 20);
+      unsigned int slots = std::max<uint64_t>((static_cast<uint64_t>(o.retain) << 20) / len, 2);
+      rec->setRetention(slots, o.retain_pin, len);
+    }
+  }
+  if (o.web) {
+    hls = pipe_->add("hls", 10, Hls::create(o.yield_time, o.quiet, o.web, o.framerate,
+        width, height));
+  }
+  if (o.whep) {
+    rtc = pipe_->add("rtc", 80, Webrtc::create(o.yield_time, o.quiet, o.whep));
+  }
+  if (o.picture != 0 && o.metrics) {
+    pic = pipe_->add("pic", 10, Picture::create(o.yield_time, o.quiet, o.picture,
+        width, height, o.pix_fmt));
+  }
+  if (!o.preview.empty()) {
+    prv = pipe_->add("prv", 10, Preview::create(o.yield_time, o.quiet, o.preview,
+        width, height, o.pix_fmt));
+    if (!prv) {
+      dbgMsg("failed: create preview\n");
+      return false;
+    }
+  }
+  Encoder* enc = pipe_->add("enc", 50, Encoder::create(o.yield_time, o.quiet, o.tracking,
+      rtsp ? rtsp->getStream(0) : nullptr, rec, o.framerate,
+      width, height, o.bitrate, o.output, o.testtime, o.pix_fmt, o.latest, o.roi, o.m2m));
+  if (!enc) {
+    dbgMsg("failed: create encoder\n");
+    return false;
+  }
+  enc->setMeta(o.streaming && o.meta, !o.nodraw);
+  enc->setSei(o.sei);
+  enc->setSlices(o.slices);
+  enc->setStill(o.still_fps, o.motion, o.motion_mask);
+  enc->setGop(o.gop, o.gop_still);
+  if (o.sync_overlay != 0 && !o.tracking) {
+    enc->setSync(o.sync_overlay);
+  }
+  enc->setHls(hls);
+  enc->setPicture(pic);
+  enc->setPreview(prv);
+  enc->setWebrtc(rtc);
+  enc->setTap(sink);
+  if (rtc) {
+    rtc->setEncoder(enc);
+  }
+  if (rtsp) {
+    rtsp->getStream(0)->setEncoder(enc);
+  }
+  if (rtsp && o.half) {
+    std::string none;
+    Encoder* sub = pipe_->add("sub", 40, Encoder::create(o.yield_time, o.quiet, false,
+        rtsp->getStream(1), nullptr, o.framerate, width / 2, height / 2,
+        o.bitrate / 4, none, o.testtime, o.pix_fmt, o.latest, false, o.m2m));
+    if (!sub || !enc->setSubEncoder(sub)) {
+      fprintf(stderr, "\nno %ux%u substream (-H) from %ux%u, it needs an even width and height\n",
+          width / 2, height / 2, width, height);
+      return false;
+    }
+    sub->setSlices(o.slices);
+    rtsp->getStream(1)->setEncoder(sub);
+    sub->setStill(o.still_fps, o.motion, o.motion_mask);
+    sub->setGop(o.gop, o.gop_still);
+  }
+  if (rtsp && o.tracking && !o.crops.empty()) {
+    crp = pipe_->add("crp", 10, Crops::create(o.yield_time, o.quiet, o.crops,
+        width, height, o.pix_fmt));
+    if (!crp) {
+      dbgMsg("failed: create crops\n");
+      return false;
+    }
+    std::string none;
+    LiveStream* stream = rtsp->addStream("crops", crp->bitrate(), 18892);
+    Encoder* cenc = stream ? pipe_->add("cenc", 40, Encoder::create(o.yield_time, o.quiet,
+        false, stream, nullptr, o.framerate, crp->mosaicWidth(), crp->mosaicHeight(),
+        crp->bitrate(), none, o.testtime, o.pix_fmt, o.latest, false, o.m2m)) : nullptr;
+    if (!cenc) {
+      dbgMsg("failed: create crops encoder\n");
+      return false;
+    }
+    cenc->setSei(true);
+    cenc->setMeta(false, false);
+    stream->setEncoder(cenc);
+    crp->setEncoder(cenc);
+    enc->setCrops(crp);
+  }
+  enc->setPrivacy(o.privacy);
+  if (o.tracking) {
+    double dist = std::sqrt(std::pow(o.width, 2) + std::pow(o.height, 2)) * o.track_dist;
+    bool two_stage = o.low_threshold > 0.f && o.low_threshold < o.threshold;
+    trk = pipe_->add("trk", 20, Tracker::create(o.yield_time, o.quiet, enc, dist, o.track_time,
+        two_stage ? Tracker::Match::kIou : Tracker::Match::kDistance, o.threshold));
+    if (trk) {
+      trk->setTap(sink);
+      trk->setPublisher(pub);
+      trk->setEvents(evt);
+      trk->setJournal(jnl);
+      trk->setRules(rul);
+      trk->setCounts(cnt);
+      trk->setState(o.track_state);
+      if (o.fusion) {
+        trk->setFusion(o.fusion->input(o.fusion_camera));
+      }
+    }
+  }
+  if (!o.snap_dir.empty()) {
+    snap = pipe_->add("snap", 10, Snapshot::create(o.yield_time, o.quiet, o.snap_dir,
+        width, height, o.pix_fmt));
+    if (snap) {
+      snap->setPrivacy(o.privacy);
+    }
+  }
+  Tflow* tfl = pipe_->add("tfl", 20, Tflow::create(2*o.yield_time, o.quiet, enc, trk, snap,
+      width, height, o.model.c_str(), o.labels.c_str(), o.threads, o.threshold,
+      (o.low_threshold > 0.f) ? o.low_threshold : o.threshold, o.tpu,
+      o.pix_fmt, o.aspect, o.engines, o.regions, o.motion, o.motion_mask, o.rate));
+  if (!tfl) {
+    dbgMsg("failed: create tflow\n");
+    return false;
+  }
+  if (o.vectors) {
+    enc->setVectors(o.motion ? tfl : nullptr, trk);
+  }
+  if (o.flow && trk) {
+    trk->setFlow(width, height, o.pix_fmt);
+    tfl->setFlow(trk);
+  }
+  tfl->setTap(sink);
+  tfl->setPublisher(pub);
+  tfl->setEvents(evt);
+  tfl->setJournal(jnl);
+  tfl->setDedup(o.dedup);
+  tfl->setBlobs(o.blobs);
+  tfl->setDelegate(o.delegate);
+  if (!o.screen.empty() && !tfl->setScreen(o.screen, o.screen_threshold)) {
+    dbgMsg("failed: screen model %s\n", o.screen.c_str());
+    return false;
+  }
+  if (o.host) {
+    tfl->setHost(o.host);
+  }
+  if (!tfl->setPost(o.classes, o.max_dets, o.nms)) {
+    dbgMsg("failed: classes %s\n", o.classes.c_str());
+    return false;
+  }
+  if (o.tile_cols * o.tile_rows > 1) {
+    tfl->setTiles(o.tile_cols, o.tile_rows, o.tile_per_frame);
+  }
+  if (!o.dewarp.empty() && !tfl->setDewarp(o.dewarp)) {
+    dbgMsg("failed: dewarp %s\n", o.dewarp.c_str());
+    return false;
+  }
+  if (!tfl->setGles(o.gles)) {
+    dbgMsg("failed: no gles, built without it or no egl\n");
+    return false;
+  }
+  if (!o.classify.empty() &&
+      !tfl->setClassify(o.classify, o.classify_labels, o.classify_threads)) {
+    dbgMsg("failed: classify model %s\n", o.classify.c_str());
+    return false;
+  }
+  if (!o.embed.empty() && !tfl->setEmbed(o.embed, o.embed_threads)) {
+    dbgMsg("failed: reid model %s\n", o.embed.c_str());
+    return false;
+  }
+  if (o.tpu) {
+    tfl->setFallback("./models/detect.tflite", "./models/labels.txt");
+  }
+  if (!o.peer.empty() && !tfl->setPeer(o.peer, o.peer_deadline)) {
+    dbgMsg("failed: peer %s\n", o.peer.c_str());
+    return false;
+  }
+  if (o.infer_procs != 0 && !tfl->setWorkers(o.infer_procs, o.infer_deadline, o.infer_core)) {
+    dbgMsg("failed: workers\n");
+    return false;
+  }
+  if (!o.model_sizes.empty() && !tfl->setFamily(o.model_sizes)) {
+    dbgMsg("failed: model sizes %s\n", o.model_sizes.c_str());
+    return false;
+  }
+  if (o.serve_peers) {
+    pipe_->add("peer", 10, PeerServer::create(o.yield_time, o.quiet, tfl, o.serve_peers));
+  }
+  if (!o.ingest.empty()) {
+    if (o.pix_fmt != V4L2_PIX_FMT_YUV420) {
+      dbgMsg("failed: ingest needs an i420 pipeline\n");
+      return false;
+    }
+    auto ing = pipe_->add("ing", 90, Ingest::create(o.yield_time, o.quiet, enc, tfl,
+        o.ingest, width, height, o.direct, o.ingest_tcp));
+    if (ing) {
+      ing->setPublisher(pub);
+      if (o.ingest_copy) {
+        ing->setPassthrough(rec);
+      }
+    }
+  } else if (!o.archive.empty()) {
+    if (o.pix_fmt != V4L2_PIX_FMT_YUV420) {
+      dbgMsg("failed: archive needs an i420 pipeline\n");
+      return false;
+    }
+    auto arc = pipe_->add("arc", 90, Archive::create(o.yield_time, o.quiet, tfl,
+        o.archive, o.framerate, width, height));
+    if (arc) {
+      arc->setJournal(jnl);
+    }
+  } else if (o.replay.empty()) {
+    auto cap = pipe_->add("cap", 90, Capturer::create(o.yield_time, o.quiet, enc, tfl,
+        o.device, o.framerate, o.width, o.height, o.direct, o.pix_fmt));
+    if (cap) {
+      if (!cap->setMjpeg(o.mjpeg)) {
+        dbgMsg("failed: mjpeg needs an i420 pipeline\n");
+        return false;
+      }
+      cap->setPublisher(pub);
+      if (o.camera >= 0 && !cap->setCamera(o.camera, o.camera_width, o.camera_height)) {
+        dbgMsg("failed: built without libcamera\n");
+        return false;
+      }
+      if (!cap->setRotate(o.rotate)) {
+        dbgMsg("failed: rotate %u\n", o.rotate);
+        return false;
+      }
+      if (o.capture_buffers) {
+        cap->setBuffers(o.capture_buffers);
+      }
+      cap->setMemory(o.capture_memory);
+      if (o.crop.w && o.crop.h) {
+        cap->setCrop(o.crop);
+      }
+      cap->setDecimation(Capturer::kTflow, o.tflow_every, o.tflow_fps);
+      cap->setDecimation(Capturer::kEncoder, o.encode_every, o.encode_fps);
+      if (o.capture_host) {
+        cap->setHost(o.capture_host);
+      }
+      if (o.isp_device >= 0) {
+        // flipped the same way as the full frames
+        int w = static_cast<int>(o.isp_width), h = static_cast<int>(o.isp_height);
+        auto isp = pipe_->add("isp", 90, Capturer::create(o.yield_time, o.quiet, nullptr, nullptr,
+            o.isp_device, o.framerate, (o.width < 0) ? -w : w, (o.height < 0) ? -h : h,
+            false, V4L2_PIX_FMT_RGB24));
+        if (isp) {
+          isp->setScaled(cap);
+        }
+      }
+    }
+  } else {
+    auto rpl = pipe_->add("rpl", 90, Replay::create(o.yield_time, o.quiet, enc, tfl,
+        o.replay.c_str(), o.framerate, width, height, o.pix_fmt, o.fast));
+    if (rpl) {
+      rpl->setPublisher(pub);
+      if (o.lockstep) {
+        rpl->setLockstep({tfl, enc, trk});
+      }
+    }
+  }
+
+  // ready once each of what this pipeline makes has come out once
+  Startup::expect(Startup::kFrame | ((enc && o.archive.empty()) ? Startup::kEncode : 0) |
+      (tfl ? Startup::kInference : 0));
+
+  // wire the graph, missing stages just don't get an edge
+  const char* edges[][2] = {
+    {"cap", "enc"}, {"cap", "tfl"},
+    {"rpl", "enc"}, {"rpl", "tfl"},
+    {"ing", "enc"}, {"ing", "tfl"}, {"ing", "pub"}, {"ing", "rec"},
+    {"cap", "pub"}, {"rpl", "pub"}, {"isp", "cap"},
+    {"tfl", "enc"}, {"tfl", "trk"}, {"tfl", "snap"}, {"tfl", "pub"}, {"tfl", "evt"},
+    {"trk", "enc"}, {"trk", "pub"}, {"trk", "evt"}, {"trk", "rul"}, {"rul", "evt"},
+    {"trk", "cnt"}, {"rul", "cnt"}, {"cnt", "evt"}, {"tfl", "jnl"}, {"trk", "jnl"},
+    {"enc", "sub"}, {"enc", "rtsp"}, {"enc", "rec"}, {"enc", "hls"}, {"enc", "rtc"},
+    {"enc", "pic"}, {"enc", "prv"}, {"sub", "rtsp"},
+    {"enc", "crp"}, {"crp", "cenc"}, {"cenc", "rtsp"},
+  };
+  for (auto& e : edges) {
+    pipe_->connect(e[0], e[1]);
+  }
+
+  return true;
+}
+
+bool Session::start() {
+  return pipe_ && pipe_->start();
+}
+
+bool Session::run() {
+  return pipe_ && pipe_->run();
+}
+
+bool Session::done() {
+  Archive* arc = pipe_ ? pipe_->get<Archive>("arc") : nullptr;
+  return arc && arc->done();
+}
+
+bool Session::stop() {
+  if (!pipe_) {
+    return true;
+  }
+  bool res = pipe_->stop(opts_.drain);
+  pipe_.reset(nullptr);
+  if (!opts_.trace.empty()) {
+    Trace::stop();
+    if (!Trace::write(opts_.trace)) {
+      dbgMsg("failed: write trace %s\n", opts_.trace.c_str());
+    }
+  }
+  if (opts_.perf) {
+    Perf::stop();
+    if (!opts_.quiet) {
+      Perf::report();
+    }
+  }
+  Fate::stop();
+  if (!opts_.quiet) {
+    Fate::report();
+  }
+  return res;
+}
+
+} // namespace detector
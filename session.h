@@ -0,0 +1,241 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Embeddable detector.
+ *
+ *  Everything 'detector' builds from its command line, as a library
+ *  (make lib).  Fill in the Options, create a Session, hand it a Sink
+ *  and start it.  The executable is a Session plus option parsing.
+ *
+ *  The sink is called on the stage threads, as results are posted:
+ *
+ *    boxes   the detections of a frame, shared with the encoder
+ *    tracks  the tracker's posted tracks, shared the same way
+ *    nals    each h264 nal, lent only for the call
+ *
+ *  Nothing is copied for the sink.  Boxes and tracks are recycled once
+ *  the last holder lets go, so keeping them makes the stages allocate
+ *  new ones; a nal must be copied if it is needed after the call.  A
+ *  sink that is slow holds up the stage calling it.
+ *
+ *  The shared worker pool, the storage writer and the reserve (see
+ *  reserve.h) are process wide, start them before the session and stop
+ *  them after.
+ *
+ *  Several cameras can share one model and accelerator: give the other
+ *  sessions' Options 'host', the first one's tflow from its pipeline().
+ *  Their cameras can be waited on by the first one's capture thread the
+ *  same way, with 'capture_host' set to its capturer.  Stop them before
+ *  the first.  With 'fusion' set their tracks are also fused across the
+ *  cameras on a shared ground plane.  An ip camera is a session with 'ingest' set to its rtsp
+ *  url, decoded on the VideoCore, so one Pi can watch several.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <string>
+#include <memory>
+#include <vector>
+
+#include "utils.h"
+#include "listener.h"
+#include "pipeline.h"
+#include "tflow.h"
+#include "capturer.h"
+#include "fusion.h"
+
+namespace detector {
+
+class Session {
+  public:
+    class Options {
+      public:
+        bool quiet = false;
+        bool streaming = false;
+        bool tpu = false;
+        bool tracking = false;
+        bool direct = false;
+        bool latest = false;
+        bool roi = false;
+        bool m2m = false;
+        bool mjpeg = false;           // decoded into an i420 pipeline, see Capturer::setMjpeg
+        int          isp_device = -1; // the isp's second output, see Capturer::setScaled
+        int          camera = -1;     // libcamera's, see Capturer::setCamera
+        unsigned int camera_width = 0;
+        unsigned int camera_height = 0;
+        unsigned int rotate = 0;      // degrees clockwise, see Capturer::setRotate
+        unsigned int capture_buffers = 0;   // v4l2 ring, 0 for the capturer's own
+        Capturer::Memory capture_memory = Capturer::Memory::kMmap;
+        Rect         crop = { 0, 0, 0, 0 };   // sensor area, see Capturer::setCrop
+        unsigned int tflow_every = 0; // capture decimation, see Capturer::setDecimation
+        float        tflow_fps = 0.f;
+        unsigned int encode_every = 0;
+        float        encode_fps = 0.f;
+        unsigned int isp_width = 300;
+        unsigned int isp_height = 300;
+        bool half = false;
+        bool on_demand = false;
+        unsigned int tunnel = 0;
+        unsigned int send_buf = 0;
+        unsigned int pace = 0;
+        bool rtp_batch = false;
+        unsigned int web = 0;
+        unsigned int whep = 0;
+        bool meta = false;
+        bool sei = false;
+        unsigned int slices = 0;
+        bool vectors = false;
+        bool flow = false;            // with tracking
+        unsigned int blobs = 0;       // with motion
+        unsigned int still_fps = 0;   // with motion
+        unsigned int gop = 0;
+        unsigned int gop_still = 0;
+        bool nodraw = false;
+        bool fast = false;
+        bool lockstep = false;        // with replay, see replay.h
+        std::string  replay;
+        std::string  ingest;          // rtsp url, see ingest.h
+        bool ingest_tcp = false;
+        bool ingest_copy = false;     // the camera's nals to the recorder
+        std::string  archive;         // recordings, see archive.h
+        std::string  unicast;
+        unsigned int yield_time = 1000;
+        unsigned int testtime = 30;
+        unsigned int device = 0;
+        unsigned int framerate = 20;
+                 int width = 640;     // negative flips
+                 int height = 480;
+        unsigned int bitrate = 1000000;
+        unsigned int threads = 1;
+        unsigned int engines = 1;
+        float        threshold = 0.5f;
+        float        low_threshold = 0.f;
+        unsigned int pix_fmt = V4L2_PIX_FMT_RGB24;
+        Tflow::Aspect aspect = Tflow::Aspect::kStretch;
+        unsigned int regions = 0;
+        unsigned int dedup = 0;       // msec, see Tflow::setDedup
+        Tflow::Delegate delegate = Tflow::Delegate::kAuto;
+        std::string  screen;          // screening model, see Tflow::setScreen
+        float        screen_threshold = 0.5f;
+        std::string  classify;        // crop classifier, see Tflow::setClassify
+        std::string  classify_labels;
+        unsigned int classify_threads = 1;
+        std::string  embed;           // reid embeddings, see Tflow::setEmbed
+        unsigned int embed_threads = 1;
+        unsigned int tile_cols = 0;   // see Tflow::setTiles
+        unsigned int tile_rows = 0;
+        unsigned int tile_per_frame = 0;
+        std::string  dewarp;          // lens[,radius]:pan,tilt,fov[:...] of a fisheye, see dewarp.h, empty for none
+        bool gles = false;            // model input made on the gpu, see gles.h
+        std::string  classes;         // see Tflow::setPost
+        unsigned int max_dets = 0;
+        float        nms = 0.f;
+        Tflow*       host = nullptr;  // another session's tflow to run on, see Tflow::setHost
+        Capturer*    capture_host = nullptr;  // and capturer to capture on, see Capturer::setHost
+        Fusion*      fusion = nullptr;        // cross camera tracks, see fusion.h
+        unsigned int fusion_camera = 0;       // this session's camera there
+        unsigned int motion = 0;
+        Rect         motion_mask = { 0, 0, 0, 0 };
+        float        rate = 0.f;
+        unsigned int segment = 0;
+        unsigned int event_quiet = 0;
+        unsigned int preroll = 5;
+        unsigned int retain = 0;      // mb of segments kept as a ring, 0 for all of them
+        unsigned int retain_pin = 86400;   // sec a segment with tracks is held
+        std::string  model;           // empty picks the default for 'tpu'
+        std::string  labels;
+        std::string  output;
+        std::string  snap_dir;
+        std::string  ctl_path;
+        unsigned int guard = 0;       // sec
+        unsigned int drain = 3000;    // msec at stop for frames in flight to get out
+        std::string  pub_name;        // shared memory segment, empty for none
+        std::string  events;          // mqtt broker, see events.h
+        bool events_fb = false;       // detector.fbs batches instead of cbor
+        std::string  rules;           // zones and lines on the tracks, see rules.h
+        std::string  track_state;     // tracks kept across restarts, empty for none
+        unsigned int track_time = 2000;   // msec a track is kept unseen
+        float        track_dist = 0.2f;   // of the diagonal a track moves at most to a box
+        std::string  journal;         // dir[,mb[,num]] of the detection log, see journal.h
+        unsigned int counts = 0;      // sec a count summary covers, 0 for none, see counts.h
+        unsigned int metrics = 0;     // http port, 0 for none
+        std::string  flight;          // path[,sec] of the flight recorder, see flight.h
+        unsigned int picture = 0;     // msec between /snapshot.jpg pictures, 0 for none
+        std::string  preview;         // port[,fps] of the mjpeg preview, see preview.h, empty for none
+        std::string  crops;           // size[,tiles[,kbps[,fps]]] of the crop stream, see crops.h, empty for none
+        std::string  peer;            // host:port of inference offload, see peer.h
+        unsigned int peer_deadline = 200;     // msec
+        unsigned int serve_peers = 0; // port, 0 for none
+        unsigned int infer_procs = 0; // model processes, see worker.h, 0 for in ours
+        unsigned int infer_deadline = 1000;   // msec
+        int infer_core = -1;          // first core they are pinned to, -1 for none
+        std::string  model_sizes;     // file,file...[:px] of the model at other input sizes, see tflow.h
+        std::string  trace;           // chrome trace json at stop, empty for none
+        unsigned int trace_len = 65536;   // spans kept
+        std::string  governor;        // slo[,model,labels], see governor.h, empty for none
+        std::string  shed;            // slo[,steps[,model,labels]], see shed.h, empty for none
+        std::string  idle;            // sec[,fps[,cpugov]], see idle.h, empty for none
+        bool perf = false;            // hardware counters around the hot stages, see perf.h
+        bool fates = false;           // a record of how far each frame got, see fate.h
+        std::string  deadlines;       // stream,record,analytics msec, see deadline.h, empty for none
+        unsigned int sync_overlay = 0;    // msec a frame may wait for its own boxes, 0 for off
+        std::vector<BlendRect> privacy;   // masked before encoding and in snapshots
+    };
+
+    // takes the results, override only what you want
+    class Sink :
+      public Listener<std::shared_ptr<std::vector<BoxBuf>>>,
+      public Listener<std::shared_ptr<std::vector<TrackBuf>>>,
+      public Listener<NalBuf> {
+      public:
+        virtual ~Sink() {}
+        virtual bool addMessage(std::shared_ptr<std::vector<BoxBuf>>& boxes) { return true; }
+        virtual bool addMessage(std::shared_ptr<std::vector<TrackBuf>>& tracks) { return true; }
+        virtual bool addMessage(NalBuf& nal) { return true; }
+    };
+
+    static std::unique_ptr<Session> create(const Session::Options& opts, Sink* sink = nullptr);
+    virtual ~Session();
+
+    // fills in what depends on the rest, the model and labels
+    static void complete(Session::Options& opts);
+
+    bool start();
+    bool run();
+    bool stop();
+
+    // an archive run has handed out its last frame
+    bool done();
+
+    // the stages, to schedule or look up before start
+    inline Pipeline* pipeline() { return pipe_.get(); }
+
+  protected:
+    Session() = default;
+    bool init(const Session::Options& opts, Sink* sink);
+
+  private:
+    Session::Options opts_;
+    std::unique_ptr<Pipeline> pipe_;
+};
+
+} // namespace detector
+
+#endif // SESSION_H
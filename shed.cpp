@@ -0,0 +1,303 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <algorithm>
+
+#include "shed.h"
+#include "tflow.h"
+#include "encoder.h"
+#include "capturer.h"
+#include "metrics.h"
+
+namespace detector {
+
+const char* Shed::stepStr(Shed::Step step) {
+  switch (step) {
+    case Shed::Step::kLabels: return "labels";
+    case Shed::Step::kRate:   return "rate";
+    case Shed::Step::kLite:   return "lite";
+    case Shed::Step::kFps:    return "fps";
+    case Shed::Step::kSub:    return "sub";
+  }
+  return "unknown";
+}
+
+Shed::Shed(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Shed::~Shed() {
+}
+
+std::unique_ptr<Shed> Shed::create(unsigned int yield_time, bool quiet,
+    const std::string& spec, Pipeline* pipe) {
+  auto obj = std::unique_ptr<Shed>(new Shed(yield_time));
+  if (!obj->init(quiet, spec, pipe)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Shed::init(bool quiet, const std::string& spec, Pipeline* pipe) {
+
+  quiet_ = quiet;
+  pipe_ = pipe;
+
+  // slo[,steps[,model,labels]]
+  std::vector<std::string> parts;
+  size_t pos = 0;
+  while (true) {
+    size_t comma = spec.find(',', pos);
+    parts.push_back(spec.substr(pos, comma - pos));
+    if (comma == std::string::npos) {
+      break;
+    }
+    pos = comma + 1;
+  }
+  if (parts.size() > 4 || parts.size() == 3 ||
+      sscanf(parts[0].c_str(), "%u", &slo_ms_) != 1 || slo_ms_ == 0) {
+    dbgMsg("failed: shed spec %s\n", spec.c_str());
+    return false;
+  }
+  if (parts.size() == 4) {
+    lite_model_ = parts[2];
+    lite_labels_ = parts[3];
+  }
+
+  ladder_.clear();
+  std::string steps = (parts.size() > 1) ? parts[1] : "labels+rate+lite+fps+sub";
+  pos = 0;
+  while (pos <= steps.size()) {
+    size_t plus = steps.find('+', pos);
+    std::string name = steps.substr(pos, plus - pos);
+    bool found = false;
+    for (auto s : { Shed::Step::kLabels, Shed::Step::kRate, Shed::Step::kLite,
+          Shed::Step::kFps, Shed::Step::kSub }) {
+      if (name == stepStr(s)) {
+        if (std::find(ladder_.begin(), ladder_.end(), s) == ladder_.end()) {
+          ladder_.push_back(s);
+        }
+        found = true;
+      }
+    }
+    if (!found) {
+      dbgMsg("failed: shed step %s\n", name.c_str());
+      return false;
+    }
+    if (plus == std::string::npos) {
+      break;
+    }
+    pos = plus + 1;
+  }
+
+  // the default ladder goes without the lite model if there is none
+  if (lite_model_.empty()) {
+    auto it = std::find(ladder_.begin(), ladder_.end(), Shed::Step::kLite);
+    if (it != ladder_.end()) {
+      if (parts.size() > 1) {
+        dbgMsg("failed: shed lite step needs a model\n");
+        return false;
+      }
+      ladder_.erase(it);
+    }
+  }
+
+  based_ = false;
+  base_rate_ = 0.f;
+  free_rate_ = 0.f;
+  base_fps_ = 0;
+  base_threads_ = 1;
+
+  level_ = 0;
+  over_ = false;
+  calm_run_ = false;
+  last_p99_ = 0;
+
+  shed_on_ = false;
+  up_cnt_ = 0;
+  down_cnt_ = 0;
+  peak_level_ = 0;
+
+  return true;
+}
+
+void Shed::apply(Shed::Step step, bool on) {
+
+  auto tfl = pipe_->get<Tflow>("tfl");
+  auto enc = pipe_->get<Encoder>("enc");
+  auto cap = pipe_->get<Capturer>("cap");
+  switch (step) {
+    case Shed::Step::kLabels:
+      if (enc) {
+        enc->setLabels(!on);
+      }
+      break;
+    case Shed::Step::kRate: {
+      // no rate set halves what it managed unlimited
+      float from = (base_rate_ > 0.f) ? base_rate_ : free_rate_;
+      tfl->setRate(on ? from / 2.f : base_rate_);
+      break;
+    }
+    case Shed::Step::kLite: {
+      const std::string& model = on ? lite_model_ : base_model_;
+      const std::string& labels = on ? lite_labels_ : base_labels_;
+      if (!tfl->swapModel(model, labels, base_threads_)) {
+        dbgMsg("failed: shed model %s\n", model.c_str());
+      }
+      break;
+    }
+    case Shed::Step::kFps:
+      if (cap && base_fps_) {
+        cap->setFramerate(on ? std::max(base_fps_ / 2, 1u) : base_fps_);
+      }
+      break;
+    case Shed::Step::kSub:
+      if (enc) {
+        enc->setSubOn(!on);
+      }
+      break;
+  }
+
+  if (!quiet_) {
+    fprintf(stderr, "\nshed: %s %s at p99 %u ms, level %u of %zu\n",
+        on ? "cut" : "restored", stepStr(step), last_p99_ / 1000, level_, ladder_.size());
+  }
+}
+
+void Shed::metrics(Exposition& out, const std::string& labels) {
+  out.gauge("detector_shed_level", "load shedding steps taken", labels, level_);
+  out.counter("detector_shed_steps_total", "load shedding steps", labels + ",dir=\"up\"", up_cnt_);
+  out.counter("detector_shed_steps_total", "load shedding steps", labels + ",dir=\"down\"", down_cnt_);
+}
+
+bool Shed::waitingToRun() {
+
+  if (!shed_on_) {
+    last_read_ = std::chrono::steady_clock::now();
+    over_ = false;
+    calm_run_ = false;
+    shed_on_ = true;
+  }
+
+  return true;
+}
+
+bool Shed::running() {
+
+  if (shed_on_) {
+    auto tfl = pipe_->get<Tflow>("tfl");
+    if (!tfl || tfl->getState() != Base::State::kRunning) {
+      return true;
+    }
+    auto enc = pipe_->get<Encoder>("enc");
+
+    using namespace std::chrono;
+    auto now = steady_clock::now();
+    float secs = duration_cast<duration<float>>(now - last_read_).count();
+    last_read_ = now;
+
+    if (!based_) {
+      base_rate_ = tfl->getRate();
+      auto cap = pipe_->get<Capturer>("cap");
+      base_fps_ = cap ? cap->getFramerate() : 0;
+      base_threads_ = tfl->getThreads();
+      base_model_ = tfl->getModel();
+      base_labels_ = tfl->getLabels();
+      tfl->latency(tfl_mark_);
+      if (enc) {
+        enc->latency(enc_mark_);
+      }
+      based_ = true;
+      return true;
+    }
+
+    auto late = tfl->latency(tfl_mark_);
+    if (level_ == 0 && secs > 0.f && late.cnt) {
+      float rate = late.cnt / secs;
+      free_rate_ = (free_rate_ > 0.f) ? free_rate_ + (rate - free_rate_) / 8.f : rate;
+    }
+    last_p99_ = late.cnt ? late.p99 : 0;
+    if (enc) {
+      auto enc_late = enc->latency(enc_mark_);
+      last_p99_ = std::max(last_p99_, enc_late.cnt ? enc_late.p99 : 0u);
+    }
+    bool over = last_p99_ > slo_ms_ * 1000;
+    bool calm = last_p99_ < slo_ms_ * 1000 * calm_;
+
+    // up a step once it has stayed over, down once it has stayed calm
+    if (over) {
+      calm_run_ = false;
+      if (!over_) {
+        over_ = true;
+        since_ = now;
+      } else if (now - since_ >= milliseconds(up_hold_) && level_ < ladder_.size()) {
+        level_++;
+        apply(ladder_[level_ - 1], true);
+        up_cnt_++;
+        peak_level_ = std::max(peak_level_, level_);
+        since_ = now;
+      }
+    } else if (calm && level_ > 0) {
+      over_ = false;
+      if (!calm_run_) {
+        calm_run_ = true;
+        since_ = now;
+      } else if (now - since_ >= milliseconds(hold_)) {
+        level_--;
+        apply(ladder_[level_], false);
+        down_cnt_++;
+        since_ = now;
+      }
+    } else {
+      over_ = false;
+      calm_run_ = false;
+    }
+  }
+
+  return true;
+}
+
+bool Shed::paused() {
+  return true;
+}
+
+bool Shed::waitingToHalt() {
+
+  if (shed_on_) {
+    shed_on_ = false;
+
+    // report
+    if (!quiet_) {
+      std::string ladder;
+      for (auto s : ladder_) {
+        ladder += std::string(ladder.empty() ? "" : "+") + stepStr(s);
+      }
+      fprintf(stderr, "\nShed Results...\n");
+      fprintf(stderr, "                ladder: %s\n", ladder.c_str());
+      fprintf(stderr, "            peak level: %u\n", peak_level_);
+      fprintf(stderr, "            last level: %u\n", level_);
+      fprintf(stderr, "        steps up, down: %u, %u\n", up_cnt_, down_cnt_);
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
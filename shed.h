@@ -0,0 +1,125 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Load shedding ladder.
+ *
+ *  With --shed slo[,steps[,lite model,labels]] it looks once a second at
+ *  capture to detection and capture to encoded p99, how long frames have
+ *  been waiting by the time each stage is done.  When either one is over
+ *  'slo' msec for 'up_hold_' msec the next step of the ladder is taken,
+ *  and once both have stayed under 'slo' * 'calm_' for 'hold_' msec the
+ *  last step taken is undone.  'steps' is the ladder in order, '+'
+ *  joined, by default all of them:
+ *
+ *    labels  the track id plates are left off the video
+ *    rate    half the detection rate
+ *    lite    the lite model, if one is given
+ *    fps     half the camera frame rate
+ *    sub     no frames go to the substream's encoder
+ *
+ *  The main encoder, what it hands the recorder and rtsp, is never cut,
+ *  so recordings stay whole while the outputs around them thin down.
+ *  Every step is printed.  It owns what it cuts while it runs, like the
+ *  governor, and isn't started with it.
+ */
+
+#ifndef SHED_H
+#define SHED_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+
+#include "utils.h"
+#include "base.h"
+#include "pipeline.h"
+
+namespace detector {
+
+class Shed : public Base {
+  public:
+    enum class Step {
+      kLabels,
+      kRate,
+      kLite,
+      kFps,
+      kSub
+    };
+    static const char* stepStr(Shed::Step step);
+
+  public:
+    static std::unique_ptr<Shed> create(unsigned int yield_time, bool quiet,
+        const std::string& spec, Pipeline* pipe);
+    virtual ~Shed();
+
+    virtual void metrics(Exposition& out, const std::string& labels);
+
+  protected:
+    Shed() = delete;
+    Shed(unsigned int yield_time);
+    bool init(bool quiet, const std::string& spec, Pipeline* pipe);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    unsigned int slo_ms_;
+    std::vector<Shed::Step> ladder_;
+    std::string lite_model_;
+    std::string lite_labels_;
+    Pipeline* pipe_;
+    const unsigned int up_hold_ = {2000};   // msec over before a step
+    const unsigned int hold_ = {10000};     // msec calm before one is undone
+    const float calm_ = {0.7f};
+
+    // what was configured, taken the first time tflow is seen
+    bool based_;
+    float base_rate_;
+    float free_rate_;
+    unsigned int base_fps_;
+    unsigned int base_threads_;
+    std::string base_model_;
+    std::string base_labels_;
+
+    unsigned int level_;      // steps taken
+    std::unique_ptr<uint32_t[]> tfl_mark_;
+    std::unique_ptr<uint32_t[]> enc_mark_;
+    std::chrono::steady_clock::time_point last_read_;
+    std::chrono::steady_clock::time_point since_;
+    bool over_;
+    bool calm_run_;
+    uint32_t last_p99_;       // usec, the worse of the two
+
+    void apply(Shed::Step step, bool on);
+
+    bool shed_on_;
+    unsigned int up_cnt_;
+    unsigned int down_cnt_;
+    unsigned int peak_level_;
+};
+
+} // namespace detector
+
+#endif // SHED_H
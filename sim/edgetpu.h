@@ -0,0 +1,77 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Edge TPU api for the host build (make sim), found ahead of the sdk's.
+ *
+ *  It never finds a tpu, so tflow loads its models on the cpu, or a
+ *  delegate that is built in, just as a Pi does with the tpu unplugged.
+ */
+
+#ifndef SIM_EDGETPU_H
+#define SIM_EDGETPU_H
+
+#include <memory>
+#include <vector>
+#include <string>
+
+#include "tensorflow/lite/context.h"
+
+namespace edgetpu {
+
+enum class DeviceType {
+  kApexPci = 0,
+  kApexUsb = 1
+};
+
+class EdgeTpuContext : public TfLiteExternalContext {
+  public:
+    virtual ~EdgeTpuContext() {}
+};
+
+class EdgeTpuManager {
+  public:
+    struct DeviceEnumerationRecord {
+      DeviceType type;
+      std::string path;
+    };
+
+    static EdgeTpuManager* GetSingleton() {
+      static EdgeTpuManager mgr;
+      return &mgr;
+    }
+
+    std::vector<DeviceEnumerationRecord> EnumerateEdgeTpu() const {
+      return {};
+    }
+
+    std::shared_ptr<EdgeTpuContext> OpenDevice(DeviceType type, const std::string& path) {
+      return nullptr;
+    }
+};
+
+static const char kCustomOp[] = "edgetpu-custom-op";
+
+inline TfLiteRegistration* RegisterCustomOp() {
+  static TfLiteRegistration reg = {};
+  return &reg;
+}
+
+} // namespace edgetpu
+
+#endif // SIM_EDGETPU_H
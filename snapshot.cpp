@@ -0,0 +1,374 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <algorithm>
+
+#include "snapshot.h"
+#include "storage.h"
+#include "pyramid.h"
+#include "names.h"
+#include "frames.h"
+#include "pool.h"
+
+namespace detector {
+
+Snapshot::Snapshot(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Snapshot::~Snapshot() {
+}
+
+std::unique_ptr<Snapshot> Snapshot::create(unsigned int yield_time, bool quiet,
+    std::string& dir, unsigned int width, unsigned int height,
+    unsigned int pix_fmt) {
+  auto obj = std::unique_ptr<Snapshot>(new Snapshot(yield_time));
+  obj->init(quiet, dir, width, height, pix_fmt);
+  return obj;
+}
+
+bool Snapshot::init(bool quiet, std::string& dir, unsigned int width,
+    unsigned int height, unsigned int pix_fmt) {
+
+  quiet_ = quiet;
+  dir_ = dir;
+  width_ = width;
+  height_ = height;
+  pix_fmt_ = pix_fmt;
+  if (pix_fmt_ == V4L2_PIX_FMT_YUV420) {
+    frame_len_ = ALIGN_16B(width_) * ALIGN_16B(height_) * 3 / 2;
+  } else {
+    frame_len_ = ALIGN_16B(width_) * ALIGN_16B(height_) * channels_;
+  }
+
+  busy_ = false;
+  last_ = 0;
+  persons_ = 0;
+  vehicles_ = 0;
+
+  snap_on_ = false;
+
+  shot_cnt_ = 0;
+  thumb_cnt_ = 0;
+  limit_cnt_ = 0;
+  byte_cnt_ = 0;
+
+  return true;
+}
+
+bool Snapshot::wanted() {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return snap_on_ && !busy_ &&
+    now - std::chrono::steady_clock::duration(last_.load()) >= std::chrono::milliseconds(gap_);
+}
+
+bool Snapshot::addMessage(FrameBuf& frame, std::shared_ptr<std::vector<BoxBuf>>& boxes) {
+
+  // a person or vehicle that wasn't there last time
+  unsigned int persons = 0;
+  unsigned int vehicles = 0;
+  if (boxes) {
+    for (auto& box : *boxes) {
+      if (box.type == BoxBuf::Type::kPerson) {
+        persons++;
+      } else if (box.type == BoxBuf::Type::kVehicle) {
+        vehicles++;
+      }
+    }
+  }
+  bool event = persons > persons_ || vehicles > vehicles_;
+  persons_ = persons;
+  vehicles_ = vehicles;
+  if (!event) {
+    return true;
+  }
+
+  if (frame.addr == nullptr || !wanted()) {
+    limit_cnt_++;
+    return true;
+  }
+
+  Snapshot::Shot shot;
+  shot.frame = frame;
+  shot.boxes = boxes;
+  busy_ = true;
+  last_ = std::chrono::steady_clock::now().time_since_epoch().count();
+  if (!shot_chan_.push(shot)) {
+    busy_ = false;
+    return false;
+  }
+  wake();
+  return true;
+}
+
+bool Snapshot::write(const std::string& fname, const unsigned char* data,
+    unsigned int len) {
+
+  // whoever picks the files up only ever sees whole ones, and a card
+  // that is behind loses the shot rather than holding this thread
+  differ_write_.begin();
+  if (!Storage::save(fname, data, len, false)) {
+    dbgMsg("failed: write %s\n", fname.c_str());
+    differ_write_.end();
+    return false;
+  }
+  byte_cnt_ += len;
+  differ_write_.end();
+  return true;
+}
+
+bool Snapshot::encode(M2m& codec, const unsigned char* data, unsigned int len,
+    const std::string& fname) {
+
+  differ_jpeg_.begin();
+  Codec::Input in;
+  while (codec.doneInput(in)) {
+  }
+  if (!codec.getInput(in)) {
+    dbgMsg("no jpeg input buffer\n");
+    return false;
+  }
+  if (len > in.length) {
+    dbgMsg("failed: %u byte frame for a %u byte jpeg input\n", len, in.length);
+    codec.putInput(in);
+    return false;
+  }
+  std::memcpy(in.addr, data, len);
+  if (!codec.encode(in, len)) {
+    return false;
+  }
+
+  // one picture in, one out.  one that comes late would go out under the
+  // next shot's name, so the codec starts over without it.
+  auto limit = std::chrono::steady_clock::now() + std::chrono::milliseconds(jpeg_timeout_);
+  Codec::Output out;
+  while (!codec.getOutput(out)) {
+    if (std::chrono::steady_clock::now() > limit) {
+      dbgMsg("failed: jpeg timeout\n");
+      codec.close();
+      if (!open(codec)) {
+        dbgMsg("failed: reopen jpeg encoder\n");
+      }
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(yield_time_));
+  }
+  differ_jpeg_.end();
+  bool res = out.length != 0 && write(fname, out.data, out.length);
+  codec.putOutput(out);
+  return res;
+}
+
+bool Snapshot::open(M2m& codec) {
+  bool thumb = &codec == thumb_.get();
+  return codec.open(thumb ? thumb_width_ : width_, thumb ? thumb_height_ : height_, 1,
+      thumb ? V4L2_PIX_FMT_RGB24 : pix_fmt_, 0) && codec.setQuality(quality_);
+}
+
+bool Snapshot::waitingToRun() {
+
+  if (!snap_on_) {
+
+    dbgMsg("open jpeg encoders\n");
+    full_ = M2m::create(this, yield_time_, device_, V4L2_PIX_FMT_JPEG);
+    if (!open(*full_)) {
+      dbgMsg("failed: open jpeg encoder\n");
+      return false;
+    }
+    thumb_ = M2m::create(this, yield_time_, device_, V4L2_PIX_FMT_JPEG);
+    if (!open(*thumb_)) {
+      dbgMsg("failed: open jpeg thumbnail encoder\n");
+      return false;
+    }
+    thumbs_.assign(thumb_max_,
+        std::vector<unsigned char>(thumb_width_ * thumb_height_ * channels_));
+
+    snap_on_ = true;
+  }
+  return true;
+}
+
+void Snapshot::setPrivacy(const std::vector<BlendRect>& zones) {
+  privacy_ = zones;
+  if (pix_fmt_ == V4L2_PIX_FMT_YUV420) {
+    for (auto& zone : privacy_) {
+      convert_rgb_to_yuv(zone.c[0], zone.c[1], zone.c[2], zone.c[0], zone.c[1], zone.c[2]);
+    }
+  }
+}
+
+bool Snapshot::running() {
+
+  if (snap_on_) {
+
+    Snapshot::Shot shot;
+    if (!shot_chan_.pop(shot)) {
+      return true;
+    }
+
+    // cut the thumbnails out first so the frame goes back to capture sooner
+    differ_late_.begin(shot.frame.stamp);
+    Pool::Due due(shot.frame.deadline);
+    unsigned char* frame = shot.frame.addr;
+    FrameBuf masked;
+    if (!privacy_.empty()) {
+      Shape shape(width_, height_, pix_fmt_);
+      masked = Frames::take(shape);
+      std::memcpy(masked.addr, frame, frame_len_);
+      shot.frame.ref.reset();
+      shot.frame.addr = nullptr;
+      frame = masked.addr;
+      Planes p(frame, shape);
+      if (p.yuv) {
+        blendYUVRects(p.y, p.stride, p.u, p.uv_stride, p.v, p.uv_stride,
+            width_, height_, privacy_.data(), privacy_.size());
+      } else {
+        blendRGBRects(p.y, p.stride, width_, height_,
+            privacy_.data(), privacy_.size());
+      }
+    }
+    unsigned int num = std::min(static_cast<unsigned int>(shot.boxes->size()), thumb_max_);
+    for (unsigned int i = 0; i < num; i++) {
+      auto& box = (*shot.boxes)[i];
+      Rect src;
+      src.x = std::min(box.x, width_ - 2);
+      src.y = std::min(box.y, height_ - 2);
+      src.w = std::max(std::min(box.w, width_ - src.x) & ~1u, 2u);
+      src.h = std::max(std::min(box.h, height_ - src.y) & ~1u, 2u);
+      float scale = std::min(static_cast<float>(thumb_width_) / src.w,
+          static_cast<float>(thumb_height_) / src.h);
+      Rect dst;
+      dst.w = std::max(std::min(static_cast<unsigned int>(src.w * scale), thumb_width_), 2u);
+      dst.h = std::max(std::min(static_cast<unsigned int>(src.h * scale), thumb_height_), 2u);
+      dst.x = (thumb_width_ - dst.w) / 2;
+      dst.y = (thumb_height_ - dst.h) / 2;
+
+      // a level that is already made will do if it still covers the thumbnail,
+      // the levels aren't masked though
+      unsigned char* addr = frame;
+      unsigned int stride = ALIGN_16B(width_) * (pix_fmt_ == V4L2_PIX_FMT_YUV420 ? 1 : channels_);
+      unsigned int slice = ALIGN_16B(height_);
+      unsigned int k = (privacy_.empty() && shot.frame.levels) ?
+        shot.frame.levels->find(src, dst.w, dst.h) : 0;
+      if (k > 0) {
+        const Level* lvl = shot.frame.levels->get(k);
+        addr = lvl->addr;
+        stride = lvl->stride;
+        slice = lvl->slice;
+        src = { (src.x >> k) & ~1u, (src.y >> k) & ~1u,
+          std::max((src.w >> k) & ~1u, 2u), std::max((src.h >> k) & ~1u, 2u) };
+        src.x = std::min(src.x, lvl->width - src.w) & ~1u;
+        src.y = std::min(src.y, lvl->height - src.h) & ~1u;
+      }
+      if (pix_fmt_ == V4L2_PIX_FMT_YUV420) {
+        convert_yuv420_to_rgb24_scaled(addr, stride, slice, src,
+            thumbs_[i].data(), thumb_width_, thumb_height_, dst, fill_);
+      } else {
+        resize_rgb24(addr, stride, src,
+            thumbs_[i].data(), thumb_width_, thumb_height_, dst, fill_);
+      }
+    }
+
+    // named by wall clock so they sort with whatever else is on the box
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    std::string base = dir_ + "/snap-" + std::to_string(ms);
+    if (encode(*full_, frame, frame_len_, base + ".jpg")) {
+      shot_cnt_++;
+    }
+    shot.frame.ref.reset();
+    shot.frame.addr = nullptr;
+    differ_late_.end();
+
+    for (unsigned int i = 0; i < num; i++) {
+      auto& box = (*shot.boxes)[i];
+      // the model's own label, the kind without one
+      const char* type = Names::get(box.cls);
+      if (*type == 0) {
+        type = "unknown";
+        if (box.type == BoxBuf::Type::kPerson) {
+          type = "person";
+        } else if (box.type == BoxBuf::Type::kPet) {
+          type = "pet";
+        } else if (box.type == BoxBuf::Type::kVehicle) {
+          type = "vehicle";
+        }
+      }
+      std::string fname = base + "-" + std::to_string(i) + "-" + type + ".jpg";
+      if (encode(*thumb_, thumbs_[i].data(), thumbs_[i].size(), fname)) {
+        thumb_cnt_++;
+      }
+    }
+
+    busy_ = false;
+  }
+  return true;
+}
+
+bool Snapshot::paused() {
+  return true;
+}
+
+bool Snapshot::waitingToHalt() {
+
+  if (snap_on_) {
+    snap_on_ = false;
+
+    Snapshot::Shot shot;
+    while (shot_chan_.pop(shot)) {
+    }
+    shot.frame.ref.reset();
+    busy_ = false;
+
+    full_->close();
+    thumb_->close();
+    full_.reset();
+    thumb_.reset();
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nSnapshot Results...\n");
+      fprintf(stderr, "  jpeg time    (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_jpeg_.pct(.5), differ_jpeg_.pct(.9), differ_jpeg_.pct(.99), differ_jpeg_.pct(.999),
+          differ_jpeg_.high, differ_jpeg_.avg,
+          differ_jpeg_.low, differ_jpeg_.cnt);
+      fprintf(stderr, "  write time   (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_write_.pct(.5), differ_write_.pct(.9), differ_write_.pct(.99), differ_write_.pct(.999),
+          differ_write_.high, differ_write_.avg,
+          differ_write_.low, differ_write_.cnt);
+      fprintf(stderr, "  frame held   (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_late_.pct(.5), differ_late_.pct(.9), differ_late_.pct(.99), differ_late_.pct(.999),
+          differ_late_.high, differ_late_.avg,
+          differ_late_.low, differ_late_.cnt);
+      fprintf(stderr, "      snapshots: %u\n", shot_cnt_);
+      fprintf(stderr, "     thumbnails: %u\n", thumb_cnt_);
+      fprintf(stderr, "   rate limited: %u\n", limit_cnt_.load());
+      fprintf(stderr, "  bytes written: %llu\n",
+          static_cast<unsigned long long>(byte_cnt_));
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
@@ -0,0 +1,135 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  JPEG snapshots of detection events.
+ *
+ *  While a snapshot is wanted tflow holds on to the frame it runs the
+ *  model on and hands it over with the boxes.  When a person or vehicle
+ *  shows up that wasn't there before, this thread writes the whole frame
+ *  and a thumbnail of every box as JPEGs made by the hardware encoder.
+ *  Snapshots are at least 'gap' apart so a busy scene can't flood the
+ *  card or whoever picks the files up.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <chrono>
+
+#include "utils.h"
+#include "listener.h"
+#include "channel.h"
+#include "base.h"
+#include "m2m.h"
+
+namespace detector {
+
+class Snapshot : public Base {
+  public:
+    static std::unique_ptr<Snapshot> create(unsigned int yield_time, bool quiet,
+        std::string& dir, unsigned int width, unsigned int height,
+        unsigned int pix_fmt);
+    virtual ~Snapshot();
+
+  public:
+    // tflow holds its frames through inference while this is true
+    bool wanted();
+
+    // boxes and the frame they were found in, the frame may be empty
+    bool addMessage(FrameBuf& frame, std::shared_ptr<std::vector<BoxBuf>>& boxes);
+
+    // zones masked out of every snapshot, see Encoder::setPrivacy
+    void setPrivacy(const std::vector<BlendRect>& zones);
+
+  protected:
+    Snapshot() = delete;
+    Snapshot(unsigned int yield_time);
+    bool init(bool quiet, std::string& dir, unsigned int width,
+        unsigned int height, unsigned int pix_fmt);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    std::string dir_;
+    unsigned int width_;
+    unsigned int height_;
+    unsigned int pix_fmt_;
+    unsigned int frame_len_;
+    const unsigned int channels_ = {3};
+
+    class Shot {
+      public:
+        FrameBuf frame;
+        std::shared_ptr<std::vector<BoxBuf>> boxes;
+    };
+    Channel<Snapshot::Shot> shot_chan_{1, Channel<Snapshot::Shot>::Policy::kDropNewest};
+    std::atomic<bool> busy_;
+
+    // rate limit
+    const unsigned int gap_ = {2000};   // msec
+    std::atomic<int64_t> last_;
+
+    // what tflow saw last time, more of either is an event
+    unsigned int persons_;
+    unsigned int vehicles_;
+
+    // full frames and thumbnails need their own encoder, each has a fixed size
+    const char* device_ = {"/dev/video31"};
+    const unsigned int quality_ = {85};
+    const unsigned int thumb_width_ = {160};
+    const unsigned int thumb_height_ = {160};
+    const unsigned int thumb_max_ = {8};
+    const unsigned char fill_ = {128};
+    std::unique_ptr<M2m> full_;
+    std::unique_ptr<M2m> thumb_;
+    std::vector<std::vector<unsigned char>> thumbs_;
+
+    // a masked copy is taken from the pipeline's frames when there are
+    // privacy zones
+    std::vector<BlendRect> privacy_;
+
+    const unsigned int jpeg_timeout_ = {1000};   // msec
+    bool open(M2m& codec);
+    bool encode(M2m& codec, const unsigned char* data, unsigned int len,
+        const std::string& fname);
+    bool write(const std::string& fname, const unsigned char* data, unsigned int len);
+
+    std::atomic<bool> snap_on_;
+
+    unsigned int shot_cnt_;
+    unsigned int thumb_cnt_;
+    std::atomic<unsigned int> limit_cnt_;
+    uint64_t byte_cnt_;
+    MicroDiffer<uint32_t> differ_jpeg_;
+    MicroDiffer<uint32_t> differ_write_;
+    MicroDiffer<uint32_t> differ_late_;
+};
+
+} // namespace detector
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,182 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+
+#include "startup.h"
+#include "utils.h"
+#include "metrics.h"
+
+namespace detector {
+
+std::mutex Startup::lock_;
+std::vector<Startup::Step> Startup::steps_;
+std::atomic<unsigned int> Startup::want_{Startup::kFrame | Startup::kEncode | Startup::kInference};
+std::atomic<unsigned int> Startup::seen_{0};
+std::atomic<bool> Startup::ready_{false};
+unsigned int Startup::at_ms_[3] = { 0, 0, 0 };
+unsigned int Startup::ready_ms_ = 0;
+
+static const char* ready_names[] = { "frame", "encode", "inference" };
+
+void Startup::expect(unsigned int what) {
+  std::unique_lock<std::mutex> lck(lock_);
+  want_ = what;
+  if (!ready_ && (seen_ & want_) == want_) {
+    ready_ms_ = since_start_ms();
+    ready_ = true;
+    lck.unlock();
+    notify("READY=1\nSTATUS=running");
+  }
+}
+
+void Startup::mark(Startup::Ready what) {
+  std::unique_lock<std::mutex> lck(lock_);
+  unsigned int was = seen_.fetch_or(what);
+  if (was & what) {
+    return;
+  }
+  for (unsigned int i = 0; i < 3; i++) {
+    if (what == (1u << i)) {
+      at_ms_[i] = since_start_ms();
+    }
+  }
+  if (!ready_ && (seen_ & want_) == want_) {
+    ready_ms_ = since_start_ms();
+    ready_ = true;
+    lck.unlock();
+    notify("READY=1\nSTATUS=running");
+  }
+}
+
+void Startup::step(const char* name, std::chrono::steady_clock::duration took) {
+
+  char stage[16] = "";
+  pthread_getname_np(pthread_self(), stage, sizeof(stage));
+  double secs = std::chrono::duration_cast<std::chrono::duration<double>>(took).count();
+  unsigned int at = since_start_ms() - static_cast<unsigned int>(secs * 1000.);
+
+  std::unique_lock<std::mutex> lck(lock_);
+  if (ready_) {
+    return;
+  }
+  for (auto& st : steps_) {
+    if (st.stage == stage && st.name == name) {
+      st.cnt++;
+      st.took += secs;
+      return;
+    }
+  }
+  Startup::Step st;
+  st.stage = stage;
+  st.name = name;
+  st.cnt = 1;
+  st.at_ms = at;
+  st.took = secs;
+  steps_.push_back(st);
+}
+
+// sd_notify without libsystemd, a datagram to the socket systemd gave us
+void Startup::notify(const char* state) {
+
+  const char* path = getenv("NOTIFY_SOCKET");
+  if (!path || (path[0] != '/' && path[0] != '@')) {
+    return;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  size_t len = strlen(path);
+  if (len >= sizeof(addr.sun_path)) {
+    return;
+  }
+  memcpy(addr.sun_path, path, len);
+  if (addr.sun_path[0] == '@') {
+    addr.sun_path[0] = 0;
+  }
+  int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    dbgMsg("failed: notify socket\n");
+    return;
+  }
+  socklen_t alen = offsetof(struct sockaddr_un, sun_path) + len;
+  if (sendto(fd, state, strlen(state), MSG_NOSIGNAL,
+        reinterpret_cast<struct sockaddr*>(&addr), alen) < 0) {
+    dbgMsg("failed: notify %s\n", path);
+  }
+  close(fd);
+}
+
+void Startup::metrics(Exposition& out) {
+  std::unique_lock<std::mutex> lck(lock_);
+  out.gauge("detector_ready", "1 once the first frame, encode and inference are done", "", ready_ ? 1 : 0);
+  if (ready_) {
+    out.gauge("detector_ready_seconds", "start to ready", "", ready_ms_ / 1000.);
+  }
+  for (unsigned int i = 0; i < 3; i++) {
+    if (seen_ & (1u << i)) {
+      out.gauge("detector_first_seconds", "start to the first of each",
+          std::string("what=\"") + ready_names[i] + "\"", at_ms_[i] / 1000.);
+    }
+  }
+  for (auto& st : steps_) {
+    std::string labels = "stage=\"" + st.stage + "\",step=\"" + st.name + "\"";
+    out.gauge("detector_startup_step_seconds", "time in an init step, all its calls", labels, st.took);
+    out.gauge("detector_startup_step_start_seconds", "start to the step's first call", labels, st.at_ms / 1000.);
+  }
+}
+
+void Startup::report() {
+
+  std::unique_lock<std::mutex> lck(lock_);
+  auto steps = steps_;
+  std::sort(steps.begin(), steps.end(),
+      [](const Startup::Step& a, const Startup::Step& b) { return a.took > b.took; });
+
+  fprintf(stderr, "\nStartup Results...\n");
+  if (ready_) {
+    fprintf(stderr, "           ready: %u ms", ready_ms_);
+    for (unsigned int i = 0; i < 3; i++) {
+      if (want_ & (1u << i)) {
+        fprintf(stderr, ", %s %u", ready_names[i], at_ms_[i]);
+      }
+    }
+    fprintf(stderr, "\n");
+  } else {
+    fprintf(stderr, "           ready: never\n");
+  }
+  for (auto& st : steps) {
+    std::string name = st.stage + " " + st.name;
+    fprintf(stderr, "%16s: %.1f ms at %u", name.c_str(), st.took * 1000., st.at_ms);
+    if (st.cnt > 1) {
+      fprintf(stderr, ", %u calls", st.cnt);
+    }
+    fprintf(stderr, "\n");
+  }
+  fprintf(stderr, "\n");
+}
+
+} // namespace detector
@@ -0,0 +1,116 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Startup profile and readiness.
+ *
+ *  The slow parts of coming up (opening the tpu, building the model and
+ *  its tensors, the omx state and port changes, the v4l2 buffer and
+ *  stream calls, the rtsp server) are timed with a 'Scope' and kept per
+ *  stage, the stage being the thread's name, along with how long each
+ *  stage's 'waitingToRun' took as a whole.  Once the first frame, the
+ *  first encoded frame and the first inference that this pipeline has
+ *  have all happened it is ready: that is sent to systemd if it started
+ *  us with a NOTIFY_SOCKET, 'GET /ready' on the metrics port answers 200
+ *  instead of 503, and steps after that aren't kept.
+ */
+
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+namespace detector {
+
+class Exposition;
+
+class Startup {
+  public:
+    enum Ready : unsigned int {
+      kFrame = 1,
+      kEncode = 2,
+      kInference = 4
+    };
+
+    // what has to happen before it is ready
+    static void expect(unsigned int what);
+
+    // the first 'what' of its kind, after that a load
+    static inline void ready(Startup::Ready what) {
+      if (!(seen_.load(std::memory_order_relaxed) & what)) {
+        mark(what);
+      }
+    }
+    static inline bool isReady() { return ready_.load(std::memory_order_relaxed); }
+
+    // an init step on the calling thread, kept until it is ready
+    static void step(const char* name, std::chrono::steady_clock::duration took);
+
+    static void metrics(Exposition& out);
+    static void report();
+
+    // times its own scope
+    class Scope {
+      public:
+        explicit Scope(const char* name)
+          : name_(name), on_(!Startup::isReady()) {
+          if (on_) {
+            begin_ = std::chrono::steady_clock::now();
+          }
+        }
+        ~Scope() {
+          if (on_) {
+            Startup::step(name_, std::chrono::steady_clock::now() - begin_);
+          }
+        }
+      private:
+        const char* name_;
+        bool on_;
+        std::chrono::steady_clock::time_point begin_;
+    };
+
+  private:
+    Startup() = delete;
+
+    static void mark(Startup::Ready what);
+    static void notify(const char* state);
+
+    class Step {
+      public:
+        std::string stage;
+        std::string name;
+        unsigned int cnt;
+        unsigned int at_ms;     // since start, when it first began
+        double took;            // sec, all of them
+    };
+    static std::mutex lock_;
+    static std::vector<Startup::Step> steps_;
+    static std::atomic<unsigned int> want_;
+    static std::atomic<unsigned int> seen_;
+    static std::atomic<bool> ready_;
+    static unsigned int at_ms_[3];
+    static unsigned int ready_ms_;
+};
+
+} // namespace detector
+
+#endif // STARTUP_H
@@ -0,0 +1,355 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "storage.h"
+
+namespace detector {
+
+Storage::File Storage::files_[Storage::kFiles];
+std::mutex Storage::lock_;
+std::mutex Storage::run_lock_;
+std::condition_variable Storage::work_;
+std::condition_variable Storage::room_;
+std::deque<Storage::Op> Storage::queue_;
+size_t Storage::pending_(0);
+size_t Storage::max_pending_(0);
+std::atomic<bool> Storage::on_(false);
+bool Storage::writing_(false);
+std::thread Storage::thread_;
+Storage::Stats Storage::stats_{};
+
+bool Storage::start(size_t max_pending) {
+
+  if (on_ || max_pending == 0) {
+    return !on_;
+  }
+  max_pending_ = max_pending;
+  on_ = true;
+  thread_ = std::thread(writerProc);
+  return true;
+}
+
+void Storage::stop() {
+
+  if (!on_) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lck(lock_);
+    on_ = false;
+  }
+  work_.notify_all();
+  room_.notify_all();
+  thread_.join();
+}
+
+int Storage::open(const std::string& path, uint64_t chunk, bool reuse) {
+
+  int file = -1;
+  {
+    std::unique_lock<std::mutex> lck(lock_);
+    for (unsigned int n = 0; n < kFiles; n++) {
+      if (!files_[n].used) {
+        Storage::File& f = files_[n];
+        f.used = true;
+        f.fd = -1;
+        f.size = 0;
+        f.reserved = 0;
+        f.chunk = chunk;
+        f.reuse = reuse;
+        f.failed = false;
+        file = n;
+        break;
+      }
+    }
+  }
+  if (file < 0) {
+    dbgMsg("failed: no storage file for %s\n", path.c_str());
+    return -1;
+  }
+  Storage::Op op;
+  op.kind = Storage::Op::kOpen;
+  op.file = file;
+  op.path = path;
+  submit(op, true);
+  return file;
+}
+
+bool Storage::write(int file, const void* data, size_t len, bool wait) {
+
+  if (file < 0 || file >= static_cast<int>(kFiles) || files_[file].failed) {
+    return false;
+  }
+  Storage::Op op;
+  op.kind = Storage::Op::kWrite;
+  op.file = file;
+  auto at = static_cast<const unsigned char*>(data);
+  op.data.assign(at, at + len);
+  return submit(op, wait) && !files_[file].failed;
+}
+
+void Storage::close(int file, const std::string& name) {
+
+  if (file < 0 || file >= static_cast<int>(kFiles)) {
+    return;
+  }
+  Storage::Op op;
+  op.kind = Storage::Op::kClose;
+  op.file = file;
+  op.path = name;
+  submit(op, true);
+}
+
+bool Storage::save(const std::string& path, const void* data, size_t len, bool wait) {
+
+  Storage::Op op;
+  op.kind = Storage::Op::kSave;
+  op.file = -1;
+  op.path = path;
+  auto at = static_cast<const unsigned char*>(data);
+  op.data.assign(at, at + len);
+  return submit(op, wait);
+}
+
+Storage::Stats Storage::stats() {
+  std::unique_lock<std::mutex> lck(lock_);
+  Storage::Stats st = stats_;
+  st.pending = pending_;
+  return st;
+}
+
+bool Storage::submit(Storage::Op& op, bool wait) {
+
+  {
+    std::unique_lock<std::mutex> lck(lock_);
+    size_t len = op.data.size();
+    if (on_ && len != 0 && pending_ != 0 && pending_ + len > max_pending_) {
+      if (!wait) {
+        stats_.drops++;
+        return false;
+      }
+      stats_.waits++;
+      room_.wait(lck, [&]() {
+          return pending_ == 0 || pending_ + len <= max_pending_ || !on_;
+        });
+    }
+    if (on_) {
+      pending_ += len;
+      queue_.push_back(std::move(op));
+      work_.notify_one();
+      return true;
+    }
+
+    // stopping under us, what's already queued goes out first
+    room_.wait(lck, []() { return queue_.empty() && !writing_; });
+  }
+
+  // no writer, the caller does the work
+  std::unique_lock<std::mutex> run_lck(run_lock_);
+  std::deque<Storage::Op> ops;
+  bool save = (op.kind == Storage::Op::kSave);
+  ops.push_back(std::move(op));
+  unsigned int fails = stats_.fails;
+  run(ops);
+  return !save || stats_.fails == fails;
+}
+
+bool Storage::pwriteAll(Storage::File& f, struct iovec* iov, unsigned int num, size_t len) {
+
+  while (len != 0) {
+    ssize_t res = pwritev(f.fd, iov, num, f.size);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    f.size += res;
+    len -= res;
+
+    // past what went out, a short write leaves the rest
+    size_t done = res;
+    while (num != 0 && done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      num--;
+    }
+    if (num != 0) {
+      iov->iov_base = static_cast<unsigned char*>(iov->iov_base) + done;
+      iov->iov_len -= done;
+    }
+  }
+  return true;
+}
+
+size_t Storage::run(std::deque<Storage::Op>& ops) {
+
+  using namespace std::chrono;
+  auto start = steady_clock::now();
+  Storage::Stats st{};
+  size_t done = 0;
+  static const unsigned int iov_max = 64;
+  struct iovec iov[iov_max];
+
+  for (size_t i = 0; i < ops.size(); i++) {
+    Storage::Op& op = ops[i];
+    switch (op.kind) {
+      case Storage::Op::kOpen: {
+          Storage::File& f = files_[op.file];
+          f.path = op.path;
+          f.fd = ::open(op.path.c_str(),
+              O_WRONLY | O_CREAT | O_CLOEXEC | (f.reuse ? 0 : O_TRUNC), 0644);
+          if (f.fd < 0) {
+            dbgMsg("failed: open %s\n", op.path.c_str());
+            f.failed = true;
+            st.fails++;
+          } else if (f.reuse) {
+            struct stat sb;
+            f.reserved = (fstat(f.fd, &sb) == 0) ? sb.st_size : 0;
+          }
+        }
+        break;
+
+      case Storage::Op::kWrite: {
+
+          // the writes to the file queued back to back go together
+          Storage::File& f = files_[op.file];
+          unsigned int num = 0;
+          size_t len = 0;
+          size_t j = i;
+          for (; j < ops.size() && num < iov_max && ops[j].kind == Storage::Op::kWrite &&
+              ops[j].file == op.file; j++) {
+            iov[num].iov_base = ops[j].data.data();
+            iov[num].iov_len = ops[j].data.size();
+            len += ops[j].data.size();
+            num++;
+          }
+          i = j - 1;
+          done += len;
+          st.writes += num;
+          if (f.fd < 0 || f.failed) {
+            break;
+          }
+          if (f.chunk != 0 && f.size + len > f.reserved) {
+            uint64_t want = (f.size + len + f.chunk - 1) / f.chunk * f.chunk;
+            if (fallocate(f.fd, FALLOC_FL_KEEP_SIZE, f.reserved, want - f.reserved) == 0) {
+              f.reserved = want;
+            } else {
+              f.chunk = 0;
+            }
+          }
+          if (!pwriteAll(f, iov, num, len)) {
+            dbgMsg("failed: write %s\n", f.path.c_str());
+            f.failed = true;
+            st.fails++;
+          }
+          st.bytes += len;
+        }
+        break;
+
+      case Storage::Op::kClose: {
+          Storage::File& f = files_[op.file];
+          if (f.fd >= 0) {
+            if ((f.reserved > f.size || f.reuse) && ftruncate(f.fd, f.size) != 0) {
+              dbgMsg("failed: trim %s\n", f.path.c_str());
+            }
+            if (::close(f.fd) != 0) {
+              f.failed = true;
+              st.fails++;
+            }
+            if (!op.path.empty() && !f.failed && rename(f.path.c_str(), op.path.c_str()) != 0) {
+              dbgMsg("failed: rename %s\n", f.path.c_str());
+              st.fails++;
+            }
+          }
+          f.fd = -1;
+          std::unique_lock<std::mutex> lck(lock_);
+          f.used = false;
+        }
+        break;
+
+      case Storage::Op::kSave: {
+
+          // whoever picks the file up only ever sees a whole one
+          std::string tmp = op.path + ".tmp";
+          Storage::File f;
+          f.path = tmp;
+          f.fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+          iov[0].iov_base = op.data.data();
+          iov[0].iov_len = op.data.size();
+          bool res = f.fd >= 0 && pwriteAll(f, iov, 1, op.data.size());
+          res = (f.fd >= 0 && ::close(f.fd) == 0) && res;
+          if (!res || rename(tmp.c_str(), op.path.c_str()) != 0) {
+            dbgMsg("failed: write %s\n", op.path.c_str());
+            remove(tmp.c_str());
+            st.fails++;
+          }
+          done += op.data.size();
+          st.writes++;
+          st.bytes += op.data.size();
+        }
+        break;
+    }
+  }
+
+  st.batches = 1;
+  st.high = duration_cast<microseconds>(steady_clock::now() - start).count();
+  std::unique_lock<std::mutex> lck(lock_);
+  stats_.bytes += st.bytes;
+  stats_.batches += st.batches;
+  stats_.writes += st.writes;
+  stats_.fails += st.fails;
+  stats_.high = std::max(stats_.high, st.high);
+  return done;
+}
+
+void Storage::writerProc() {
+
+  std::deque<Storage::Op> ops;
+  while (1) {
+    {
+      std::unique_lock<std::mutex> lck(lock_);
+      work_.wait(lck, []() { return !queue_.empty() || !on_; });
+      if (queue_.empty() && !on_) {
+        break;
+      }
+      ops.swap(queue_);
+      writing_ = true;
+    }
+    size_t done = run(ops);
+    ops.clear();
+    {
+      std::unique_lock<std::mutex> lck(lock_);
+      pending_ -= done;
+      writing_ = false;
+    }
+    room_.notify_all();
+  }
+}
+
+} // namespace detector
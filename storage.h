@@ -0,0 +1,139 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Shared storage writer.
+ *
+ *  Recordings, snapshots, the journal and the raw encoder output hand
+ *  their bytes to one writer thread instead of each blocking on the
+ *  card.  Files are opened, written and closed in the order asked, and
+ *  the writer takes whatever is queued at once, so the writes to a file
+ *  queued back to back go out as one pwritev.  A file can reserve its
+ *  space 'chunk' bytes at a time with fallocate, keeping its size, so
+ *  the card's allocator isn't hit on every write.
+ *
+ *  The bytes queued are capped.  Past the cap a write either waits for
+ *  the writer to catch up or, when it can't, is dropped and counted, so
+ *  a slow card holds up only the threads that chose to wait for it.
+ *  With the writer not started every call does its work on the caller,
+ *  as if there were no writer.
+ */
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+
+#include "utils.h"
+
+namespace detector {
+
+class Storage {
+  public:
+    // 'max_pending' bytes queued before writes wait or drop
+    static bool start(size_t max_pending);
+    static void stop();
+
+    // a file written in the background, -1 when too many are open, with
+    // 'reuse' an old file is written over in place and trimmed at close
+    // instead of being truncated and given new blocks
+    static int open(const std::string& path, uint64_t chunk = 0, bool reuse = false);
+
+    // false if it was dropped, or the file failed before
+    static bool write(int file, const void* data, size_t len, bool wait = true);
+
+    // after its writes, renamed to 'name' if there is one
+    static void close(int file, const std::string& name = "");
+
+    // 'data' as the whole of 'path', by way of 'path.tmp' and a rename
+    static bool save(const std::string& path, const void* data, size_t len,
+        bool wait = false);
+
+    class Stats {
+      public:
+        uint64_t bytes;
+        unsigned int batches;
+        unsigned int writes;
+        unsigned int waits;       // a write held up by the cap
+        unsigned int drops;
+        unsigned int fails;
+        size_t pending;
+        unsigned int high;        // usec, the slowest batch
+    };
+    static Storage::Stats stats();
+
+  private:
+    Storage() = delete;
+
+    class File {
+      public:
+        int fd = -1;
+        std::string path;
+        uint64_t size = 0;
+        uint64_t reserved = 0;
+        uint64_t chunk = 0;
+        bool reuse = false;
+        bool used = false;
+        std::atomic<bool> failed{false};
+    };
+    static constexpr unsigned int kFiles = 64;
+    static Storage::File files_[kFiles];
+
+    class Op {
+      public:
+        enum Kind {
+          kOpen,
+          kWrite,
+          kClose,
+          kSave
+        };
+        Kind kind;
+        int file;
+        std::string path;
+        std::vector<unsigned char> data;
+    };
+    static std::mutex lock_;
+    static std::mutex run_lock_;
+    static std::condition_variable work_;
+    static std::condition_variable room_;
+    static std::deque<Storage::Op> queue_;
+    static size_t pending_;
+    static size_t max_pending_;
+    static std::atomic<bool> on_;
+    // the writer has a batch out of 'queue_' it hasn't finished
+    static bool writing_;
+    static std::thread thread_;
+    static Storage::Stats stats_;
+
+    static bool submit(Storage::Op& op, bool wait);
+    static size_t run(std::deque<Storage::Op>& ops);
+    static bool pwriteAll(Storage::File& f, struct iovec* iov, unsigned int num,
+        size_t len);
+    static void writerProc();
+};
+
+} // namespace detector
+
+#endif // STORAGE_H
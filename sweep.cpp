@@ -0,0 +1,188 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <cmath>
+#include <atomic>
+#include <chrono>
+
+#include "sweep.h"
+#include "tflow.h"
+
+namespace detector {
+
+static unsigned int frameLen(unsigned int width, unsigned int height, unsigned int pix_fmt) {
+  unsigned int len = ALIGN_16B(width) * ALIGN_16B(height);
+  return (pix_fmt == V4L2_PIX_FMT_YUV420) ? len * 3 / 2 : len * 3;
+}
+
+bool Sweep::load(const Session::Options& opts, std::vector<unsigned char>& frames,
+    unsigned int& frame_len) {
+
+  frame_len = frameLen(std::abs(opts.width), std::abs(opts.height), opts.pix_fmt);
+  FILE* fd = fopen(opts.replay.c_str(), "rb");
+  if (!fd) {
+    fprintf(stderr, "can't open %s\n", opts.replay.c_str());
+    return false;
+  }
+  fseek(fd, 0, SEEK_END);
+  long size = ftell(fd);
+  fseek(fd, 0, SEEK_SET);
+  unsigned int num = (size > 0) ? size / frame_len : 0;
+  frames.resize(static_cast<size_t>(num) * frame_len);
+  bool ok = num != 0 && fread(frames.data(), 1, frames.size(), fd) == frames.size();
+  fclose(fd);
+  if (!ok) {
+    fprintf(stderr, "%s holds no %ux%u frames\n", opts.replay.c_str(),
+        std::abs(opts.width), std::abs(opts.height));
+  }
+  return ok;
+}
+
+bool Sweep::once(const Session::Options& opts, unsigned int width, unsigned int height,
+    const std::vector<unsigned char>& frames, unsigned int frame_len) {
+
+  // frames still held when tflow goes hand these back, so they outlive it
+  std::atomic<unsigned int> held{0};
+  Semaphore freed;
+
+  Session::Options o = opts;
+  Session::complete(o);
+  auto tfl = Tflow::create(2*o.yield_time, true, nullptr, nullptr, nullptr,
+      width, height, o.model.c_str(), o.labels.c_str(), o.threads, o.threshold,
+      o.threshold, o.tpu, o.pix_fmt, o.aspect, o.engines, 0, 0, Rect{0, 0, 0, 0}, 0.f);
+  if (tfl) {
+    tfl->setDelegate(o.delegate);
+  }
+  if (!tfl || !tfl->start("tfl", 20) || !tfl->run()) {
+    printf("%4ux%-4u %3s %3u %3u   failed to load %s\n", width, height,
+        o.tpu ? "yes" : "no", o.threads, o.engines, o.model.c_str());
+    return false;
+  }
+
+  // keep tflow's slots full and no more, a dropped frame is wasted work
+  using namespace std::chrono;
+  unsigned int limit = o.engines + 2;
+  unsigned int num = frames.size() / frame_len;
+  unsigned int secs = o.testtime ? o.testtime : 10;
+  auto stop = steady_clock::now() + seconds(secs);
+  for (unsigned int fed = 0; steady_clock::now() < stop; ) {
+    if (held >= limit) {
+      freed.wait_for(10000);
+      continue;
+    }
+    FrameBuf fbuf;
+    fbuf.id = fed;
+    fbuf.length = frame_len;
+    fbuf.addr = const_cast<unsigned char*>(frames.data()) +
+      static_cast<size_t>(fed % num) * frame_len;
+    fbuf.stamp = steady_clock::now();
+    held++;
+    fbuf.ref = std::shared_ptr<void>(fbuf.addr,
+        [&held, &freed](void*) { held--; freed.post(); });
+    tfl->addMessage(fbuf);
+    fbuf.ref.reset();
+    fed++;
+  }
+  tfl->stop();
+
+  auto st = tfl->stats();
+  if (o.tpu && st.tpus == 0) {
+    printf("%4ux%-4u %3s   -   -   no edge tpu found\n", width, height, "yes");
+    return false;
+  }
+  printf("%4ux%-4u %3s %3u %3u %7.1f  %6u %6u  %6u %6u  %6u %6u  %6u %6u\n",
+      width, height, o.tpu ? "yes" : "no", o.tpu ? 0 : o.threads, st.engines,
+      st.secs > 0.0 ? st.detections / st.secs : 0.0,
+      st.prep.p50, st.prep.p99, st.eval.p50, st.eval.p99,
+      st.post.p50, st.post.p99, st.late.p50, st.late.p99);
+  fflush(stdout);
+  return true;
+}
+
+bool Sweep::run(const Session::Options& opts) {
+
+  if (opts.replay.empty()) {
+    fprintf(stderr, "the sweep needs recorded frames, -R <file>\n");
+    return false;
+  }
+  std::vector<unsigned char> frames;
+  unsigned int frame_len;
+  if (!load(opts, frames, frame_len)) {
+    return false;
+  }
+
+  // the recording as it is and at half size
+  unsigned int width = std::abs(opts.width);
+  unsigned int height = std::abs(opts.height);
+  unsigned int half_w = (width / 2) & ~1;
+  unsigned int half_h = (height / 2) & ~1;
+  unsigned int half_len = frameLen(half_w, half_h, opts.pix_fmt);
+  unsigned int num = frames.size() / frame_len;
+  std::vector<unsigned char> halves(static_cast<size_t>(num) * half_len);
+  for (unsigned int i = 0; i < num; i++) {
+    const unsigned char* src = frames.data() + static_cast<size_t>(i) * frame_len;
+    unsigned char* dst = halves.data() + static_cast<size_t>(i) * half_len;
+    if (opts.pix_fmt == V4L2_PIX_FMT_YUV420) {
+      scale_half_yuv420(src, ALIGN_16B(width), ALIGN_16B(height),
+          dst, ALIGN_16B(half_w), ALIGN_16B(half_h), half_w, half_h);
+    } else {
+      scale_half_rgb24(src, ALIGN_16B(width) * 3, dst, ALIGN_16B(half_w) * 3, half_w, half_h);
+    }
+  }
+
+  printf("%9s %3s %3s %3s %7s  %13s  %13s  %13s  %13s\n", "", "", "", "", "",
+      "prep (us)", "eval (us)", "post (us)", "frame (us)");
+  printf("%9s %3s %3s %3s %7s  %6s %6s  %6s %6s  %6s %6s  %6s %6s\n",
+      "size", "tpu", "thr", "eng", "det/s",
+      "p50", "p99", "p50", "p99", "p50", "p99", "p50", "p99");
+
+  class Size {
+    public:
+      unsigned int w, h;
+      const std::vector<unsigned char>* frames;
+      unsigned int len;
+  };
+  const Size sizes[] = {
+    { width, height, &frames, frame_len },
+    { half_w, half_h, &halves, half_len },
+  };
+  bool tpu = !edgetpu::EdgeTpuManager::GetSingleton()->EnumerateEdgeTpu().empty();
+  unsigned int runs = 0;
+  for (auto& sz : sizes) {
+    Session::Options o = opts;
+    o.tpu = false;
+    for (unsigned int threads = 1; threads <= 4; threads++) {
+      o.threads = threads;
+      runs += once(o, sz.w, sz.h, *sz.frames, sz.len) ? 1 : 0;
+    }
+
+    // one interpreter per tpu, threads don't come into it.  without one
+    // tflow would fall back to the cpu with a model built for the tpu
+    if (!tpu) {
+      printf("%4ux%-4u %3s   -   -   no edge tpu found\n", sz.w, sz.h, "yes");
+      continue;
+    }
+    o.tpu = true;
+    o.threads = 1;
+    runs += once(o, sz.w, sz.h, *sz.frames, sz.len) ? 1 : 0;
+  }
+  return runs != 0;
+}
+
+} // namespace detector
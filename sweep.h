@@ -0,0 +1,59 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Model sweep (detector --bench-model -R <frames>).
+ *
+ *  Runs a real tflow stage, loaded the way the pipeline loads it, over
+ *  the recorded frames for every mix of cpu threads 1 to 4, edge tpu on
+ *  and off, and the recording's size and half of it, then prints one
+ *  row per run: detections per second and the prep, eval, post and
+ *  frame to detection percentiles.  Frames are fed as fast as tflow
+ *  frees them, so the rate is what the model can do, not the camera.
+ *  Each run lasts -t seconds (10 if it is 0) and -n engines, -m model
+ *  and the rest of the tflow options apply to all of them.
+ */
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <string>
+#include <vector>
+
+#include "utils.h"
+#include "session.h"
+
+namespace detector {
+
+class Sweep {
+  public:
+    // 'opts' before Session::complete, so each run picks its own model
+    static bool run(const Session::Options& opts);
+
+  private:
+    Sweep() = delete;
+
+    static bool load(const Session::Options& opts, std::vector<unsigned char>& frames,
+        unsigned int& frame_len);
+    static bool once(const Session::Options& opts, unsigned int width, unsigned int height,
+        const std::vector<unsigned char>& frames, unsigned int frame_len);
+};
+
+} // namespace detector
+
+#endif // SWEEP_H
@@ -25,233 +25,1743 @@
 #include <sstream>
 #include <algorithm>
 #include <iterator>
+#include <cmath>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifdef HAVE_XNNPACK
+#include <tensorflow/lite/delegates/xnnpack/xnnpack_delegate.h>
+#endif
+#ifdef HAVE_GPU_DELEGATE
+#include <tensorflow/lite/delegates/gpu/delegate.h>
+#endif
 
 #include "tflow.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "fate.h"
+#include "deadline.h"
+#include "pool.h"
+#include "perf.h"
+#include "pyramid.h"
+#include "startup.h"
+#include "names.h"
 
 namespace detector {
 
 Tflow::Tflow(unsigned int yield_time) 
-  : Base(yield_time),
-    tflow_empty_(true) {
+  : Base(yield_time) {
 }
 
 Tflow::~Tflow() {
+  if (host_) {
+    std::unique_lock<std::mutex> lck(host_->guest_lock_);
+    auto& g = host_->guests_;
+    g.erase(std::remove(g.begin(), g.end(), this), g.end());
+  }
 }
 
 std::unique_ptr<Tflow> Tflow::create(unsigned int yield_time, bool quiet, 
-    Encoder* enc, Tracker* trk, unsigned int width, unsigned int height, 
+    Encoder* enc, Tracker* trk, Snapshot* snap, unsigned int width, unsigned int height, 
     const char* model, const char* labels, unsigned int threads, float threshold, 
-    bool tpu) {
+    float low_threshold, bool tpu, unsigned int pix_fmt, Tflow::Aspect aspect, 
+    unsigned int engines, unsigned int regions, unsigned int motion, 
+    const Rect& motion_mask, float rate) {
   auto obj = std::unique_ptr<Tflow>(new Tflow(yield_time));
-  obj->init(quiet, enc, trk, width, height, model, labels, threads, threshold, tpu);
+  obj->init(quiet, enc, trk, snap, width, height, model, labels, threads, threshold, 
+      low_threshold, tpu, pix_fmt, aspect, engines, regions, motion, motion_mask,
+      rate);
   return obj;
 }
 
-bool Tflow::init(bool quiet, Encoder* enc, Tracker* trk, unsigned int width, 
+bool Tflow::init(bool quiet, Encoder* enc, Tracker* trk, Snapshot* snap, unsigned int width, 
     unsigned int height, const char* model, const char* labels, 
-    unsigned int threads, float threshold, bool tpu) {
+    unsigned int threads, float threshold, float low_threshold, bool tpu, 
+    unsigned int pix_fmt, Tflow::Aspect aspect, unsigned int engines,
+    unsigned int regions, unsigned int motion, const Rect& motion_mask,
+    float rate) {
 
   quiet_ = quiet;
   tpu_ = tpu;
 
   enc_ = enc;
   trk_ = trk;
+  snap_ = snap;
+  pub_ = nullptr;
+  evt_ = nullptr;
+  jnl_ = nullptr;
+  tap_ = nullptr;
+  flow_ = nullptr;
   
   width_ = width;
   height_ = height;
 
-  frame_len_ = ALIGN_16B(width_) * ALIGN_16B(height_) * channels_;
-  frame_.buf.resize(frame_len_);
+  pix_fmt_ = pix_fmt;
+  aspect_ = aspect;
+  if (pix_fmt_ == V4L2_PIX_FMT_YUV420 || pix_fmt_ == V4L2_PIX_FMT_NV12 ||
+      pix_fmt_ == V4L2_PIX_FMT_NV21) {
+    frame_len_ = ALIGN_16B(width_) * ALIGN_16B(height_) * 3 / 2;
+    frame_stride_ = ALIGN_16B(width_);
+  } else if (pix_fmt_ == V4L2_PIX_FMT_YUYV || pix_fmt_ == V4L2_PIX_FMT_YVYU) {
+    frame_len_ = ALIGN_16B(width_) * ALIGN_16B(height_) * 2;
+    frame_stride_ = ALIGN_16B(width_) * 2;
+  } else {
+    frame_len_ = ALIGN_16B(width_) * ALIGN_16B(height_) * channels_;
+    frame_stride_ = ALIGN_16B(width_) * channels_;
+  }
+  scaler_ = nullptr;
 
   model_fname_ = model;
   labels_fname_ = labels;
   model_threads_ = threads;
+  model_engines_ = engines ? engines : 1;
   threshold_ = threshold;
+  low_threshold_ = (trk_ && low_threshold < threshold) ? low_threshold : threshold;
+
+  regions_ = trk_ ? regions : 0;
+  region_cnt_ = 0;
+  region_frames_ = 0;
+  blob_frames_ = 0;
 
+  if (motion) {
+    motion_ = Motion::create(width_, height_, pix_fmt_, motion, motion_mask);
+  }
+  still_cnt_ = 0;
+  active_ms_ = 0;
+  screen_.reset();
+  classify_.reset();
+  embed_.reset();
+  tiles_.clear();
+  tile_per_ = 0;
+  dewarp_.reset();
+  view_cnt_ = 0;
+  gles_.reset();
+  class_spec_.clear();
+  max_dets_ = 0;
+  nms_ = 0.f;
+  result_num_ = 0;
+  model_gen_ = 0;
+  turn_ = 0;
+  host_ = nullptr;
+  host_gen_ = 0;
+  host_engines_ = 0;
+  lent_ = 0;
+  tile_next_ = 0;
+  tile_frames_ = 0;
+  screened_cnt_ = 0;
+  scaled_cnt_ = 0;
+
+  dedup_ = 0;
+  delegate_ = Tflow::Delegate::kAuto;
+  asked_ = Tflow::Delegate::kAuto;
+  cache_.clear();
+  cache_hits_ = 0;
+  camera_ = Tflow::Camera::kOk;
+  camera_seen_ = Tflow::Camera::kOk;
+  camera_since_ = {};
+  last_sum_ = 0;
+
+  peer_deadline_ = 0;
+  workers_ = 0;
+  family_.clear();
+  family_px_ = 24;
+  worker_deadline_ = 0;
+  worker_core_ = -1;
+
+  rate_ = (rate > 0.f) ? rate : 0.f;
+  held_cnt_ = 0;
+  first_ms_ = -1;
+  due_ = {};
+  temp_stamp_ = {};
+  temp_ = 0.f;
+  temp_scale_ = 1.f;
+
+  hung_run_ = 0;
+  tpu_model_.clear();
+  tpu_labels_.clear();
+  tpu_lost_cnt_ = 0;
+  first_eval_ms_ = -1;
+  load_ms_ = 0;
+  reused_ = false;
+  swap_done_ = false;
+  swap_cnt_ = 0;
   tflow_on_ = false;
 
   return true; 
 }
 
+bool Tflow::addMessage(MotionBuf& map) {
+  return vec_chan_.push(map);
+}
+
 bool Tflow::addMessage(FrameBuf& fbuf) {
 
-  std::unique_lock<std::timed_mutex> lck(tflow_lock_, std::defer_lock);
+  if (fbuf.length < frame_len_) {
+    dbgMsg("tflow buffer size mismatch\n");
+    Fate::drop(Fate::Site::kTflowSize, fbuf.stamp);
+    return false;
+  }
+
+  // the newest frame waits for the next inference
+  Trace::Scope trace(Trace::Hop::kTflowCopy, fbuf.stamp, fbuf.id);
+  PROBE(tflow_add, probe_us(fbuf.stamp), fbuf.id, fbuf.length);
+  Perf::Scope perf(Perf::Site::kTflowCopy);
+  differ_copy_.begin();
+  if (flow_) {
+    flow_->addMessage(fbuf);
+  }
+  if (frame_chan_.size() >= frame_chan_.capacity()) {
+    FrameBuf old;
+    if (frame_chan_.pop(old)) {
+      overtaken_cnt_++;
+      Fate::drop(Fate::Site::kTflowOvertaken, old.stamp);
+    }
+  }
+  bool res = frame_chan_.push(fbuf);
+  differ_copy_.end();
+
+  wake();
+  return res;
+}
+
+unsigned int Tflow::credits(const FrameBuf& next) {
+  int64_t stamp = next.stamp.time_since_epoch().count();
+  if (rate_ > 0.f && stamp != 0 && stamp < due_ticks_) {
+    return 0;
+  }
+  return frame_chan_.room() + free_chan_.size();
+}
+
+bool Tflow::shed() {
+  FrameBuf old;
+  return frame_chan_.pop(old);
+}
+
+void Tflow::setThresholds(float threshold, float low_threshold) {
+  low_threshold_ = (trk_ && low_threshold < threshold) ? low_threshold : threshold;
+  threshold_ = threshold;
+}
+
+void Tflow::setRate(float rate) {
+  rate_ = (rate > 0.f) ? rate : 0.f;
+}
+
+void Tflow::setRegions(unsigned int regions) {
+  regions_ = trk_ ? regions : 0;
+}
+
+void Tflow::setDedup(unsigned int ms) {
+  dedup_ = ms;
+}
+
+void Tflow::setBlobs(unsigned int cells) {
+  if (motion_) {
+    motion_->setBlobs(cells);
+  }
+}
+
+void Tflow::setDelegate(Tflow::Delegate d) {
+  delegate_ = d;
+}
+
+bool Tflow::setScreen(const std::string& model, float threshold) {
+  screen_ = Screen::create(width_, height_, pix_fmt_, frame_stride_, model, threshold);
+  return screen_ != nullptr;
+}
+
+bool Tflow::setClassify(const std::string& model, const std::string& labels,
+    unsigned int threads) {
+  classify_ = Classify::create(width_, height_, pix_fmt_, frame_stride_, model, labels, threads);
+  return classify_ != nullptr;
+}
+
+bool Tflow::setEmbed(const std::string& model, unsigned int threads) {
+  embed_ = Embed::create(width_, height_, pix_fmt_, frame_stride_, model, threads);
+  return embed_ != nullptr;
+}
+
+bool Tflow::setPost(const std::string& classes, unsigned int max_dets, float nms) {
+
+  class_spec_.clear();
+  std::istringstream iss(classes);
+  std::string item;
+  while (std::getline(iss, item, ',')) {
+    size_t colon = item.find(':');
+    float thresh = 0.f;
+    if (colon != std::string::npos) {
+      thresh = strtof(item.c_str() + colon + 1, nullptr);
+      if (thresh <= 0.f || thresh > 1.f) {
+        dbgMsg("failed: class threshold %s\n", item.c_str());
+        return false;
+      }
+    }
+    class_spec_[item.substr(0, colon)] = thresh;
+  }
+  max_dets_ = max_dets;
+  nms_ = nms;
+  return true;
+}
+
+void Tflow::setHost(Tflow* host) {
+  if (host == this || host_) {
+    return;
+  }
+  host_ = host;
+  std::unique_lock<std::mutex> lck(host_->guest_lock_);
+  host_->guests_.push_back(this);
+}
+
+void Tflow::setTiles(unsigned int cols, unsigned int rows, unsigned int per_frame) {
+
+  // each a share of the frame plus the overlap, on even pixels
+  tiles_.clear();
+  cols = std::max(cols, 1u);
+  rows = std::max(rows, 1u);
+  unsigned int tw = std::min(static_cast<unsigned int>(
+        width_ * (1.f + tile_overlap_) / cols), width_) & ~1u;
+  unsigned int th = std::min(static_cast<unsigned int>(
+        height_ * (1.f + tile_overlap_) / rows), height_) & ~1u;
+  for (unsigned int r = 0; r < rows; r++) {
+    for (unsigned int c = 0; c < cols; c++) {
+      Rect t;
+      t.x = (cols > 1) ? ((width_ - tw) * c / (cols - 1)) & ~1u : 0;
+      t.y = (rows > 1) ? ((height_ - th) * r / (rows - 1)) & ~1u : 0;
+      t.w = tw;
+      t.h = th;
+      tiles_.push_back(t);
+    }
+  }
+  if (tiles_.size() < 2) {
+    tiles_.clear();
+  }
+  tile_per_ = tiles_.empty() ? 0 :
+    (per_frame == 0) ? tiles_.size() : std::min<unsigned int>(per_frame, tiles_.size());
+}
+
+bool Tflow::setDewarp(const std::string& spec) {
+  if (!tiles_.empty() || host_) {
+    dbgMsg("failed: dewarp not with tiles or a host\n");
+    return false;
+  }
+  dewarp_ = Dewarp::create(spec, width_, height_, pix_fmt_);
+  return dewarp_ != nullptr;
+}
+
+bool Tflow::setGles(bool on) {
+  gles_.reset();
+  if (on) {
+    gles_ = Gles::create(width_, height_, pix_fmt_);
+  }
+  return !on || gles_ != nullptr;
+}
+
+bool Tflow::setModel(const std::string& model, const std::string& labels) {
+  if (getState() != Base::State::kPaused) {
+    return false;
+  }
+  if (access(model.c_str(), R_OK) || access(labels.c_str(), R_OK)) {
+    dbgMsg("failed: model %s or labels %s\n", model.c_str(), labels.c_str());
+    return false;
+  }
+  std::unique_lock<std::mutex> lck(swap_lock_);
+  model_fname_ = model;
+  labels_fname_ = labels;
+  return true;
+}
+
+bool Tflow::swapModel(const std::string& model, const std::string& labels,
+    unsigned int threads) {
+  if (host_) {
+    return false;   // a guest runs its host's model
+  }
+  if (access(model.c_str(), R_OK) || access(labels.c_str(), R_OK)) {
+    dbgMsg("failed: model %s or labels %s\n", model.c_str(), labels.c_str());
+    return false;
+  }
 
-  if (!lck.try_lock_for(std::chrono::microseconds(Listener::timeout_))) {
-//    dbgMsg("tflow busy\n");
+  // nothing to do if it is already what runs, or on its way
+  std::unique_lock<std::mutex> lck(swap_lock_);
+  const Tflow::Loaded* last = swap_want_ ? swap_want_.get() : swap_.get();
+  unsigned int last_threads = last ? last->threads : model_threads_.load();
+  threads = threads ? threads : last_threads;
+  if (model == (last ? last->model_fname : model_fname_) &&
+      labels == (last ? last->labels_fname : labels_fname_) && threads == last_threads) {
+    return true;
+  }
+  swap_want_ = std::make_unique<Tflow::Loaded>();
+  swap_want_->model_fname = model;
+  swap_want_->labels_fname = labels;
+  swap_want_->threads = threads;
+  swap_want_->ok = false;
+  lck.unlock();
+  wake();
+  return true;
+}
+
+bool Tflow::setThreads(unsigned int threads) {
+  if (getState() != Base::State::kPaused || threads == 0) {
     return false;
   }
+  model_threads_ = threads;
+  return true;
+}
+
+Tflow::Stats Tflow::stats() {
+  Tflow::Stats st;
+  auto& engines = (engines_.empty() && parked_) ? parked_->engines : engines_;
+  st.engines = engines.size();
+  st.tpus = 0;
+  Histogram eval;
+  for (auto& eng : engines) {
+    st.tpus += (eng->context || (eng->worker && eng->worker->tpu() >= 0)) ? 1 : 0;
+    eval.merge(eng->differ_eval.hist);
+  }
+  st.detections = differ_post_.cnt;
+  st.secs = differ_tot_.avg / 1000000.0;
+  st.prep = differ_prep_.hist.percentiles();
+  st.eval = eval.percentiles();
+  st.post = differ_post_.hist.percentiles();
+  st.late = differ_late_.hist.percentiles();
+  return st;
+}
 
-  if (tflow_empty_) {
-    if (frame_len_ != fbuf.length) {
-      dbgMsg("tflow buffer size mismatch\n");
+std::string Tflow::getModel() {
+  std::unique_lock<std::mutex> lck(swap_lock_);
+  return model_fname_;
+}
+
+std::string Tflow::getLabels() {
+  std::unique_lock<std::mutex> lck(swap_lock_);
+  return labels_fname_;
+}
+
+void Tflow::setFallback(const std::string& model, const std::string& labels) {
+  fallback_model_ = model;
+  fallback_labels_ = labels;
+}
+
+bool Tflow::setFamily(const std::string& models) {
+  if (getState() != Base::State::kPaused || host_ || workers_ != 0) {
+    return false;
+  }
+
+  // file,file,...[:px], the running model is one of them either way
+  std::string files = models;
+  size_t colon = models.rfind(':');
+  if (colon != std::string::npos) {
+    files = models.substr(0, colon);
+    int px = strtol(models.c_str() + colon + 1, nullptr, 10);
+    if (px <= 0) {
+      dbgMsg("failed: model family %s\n", models.c_str());
+      return false;
+    }
+    family_px_ = px;
+  }
+  std::vector<std::string> names = { getModel() };
+  std::istringstream iss(files);
+  std::string tok;
+  while (std::getline(iss, tok, ',')) {
+    if (tok.empty() || std::find(names.begin(), names.end(), tok) != names.end()) {
+      continue;
+    }
+    if (access(tok.c_str(), R_OK)) {
+      dbgMsg("failed: model %s\n", tok.c_str());
       return false;
     }
-    differ_copy_.begin();
-    frame_.id = fbuf.id;
-    frame_.length = fbuf.length;
-    std::memcpy(frame_.buf.data(), fbuf.addr, fbuf.length);
-    tflow_empty_ = false;
-    differ_copy_.end();
+    names.push_back(tok);
   }
+  if (names.size() < 2) {
+    dbgMsg("failed: model family %s has one size\n", models.c_str());
+    return false;
+  }
+  family_.clear();
+  for (auto& name : names) {
+    family_.emplace_back();
+    family_.back().model_fname = name;
+  }
+  return true;
+}
+
+void Tflow::setTap(Listener<std::shared_ptr<std::vector<BoxBuf>>>* tap) {
+  tap_ = tap;
+}
+
+void Tflow::setFlow(Listener<FrameBuf>* flow) {
+  flow_ = flow;
+}
+
+void Tflow::setPublisher(Publisher* pub) {
+  pub_ = pub;
+}
+
+void Tflow::setEvents(Events* evt) {
+  evt_ = evt;
+}
 
+void Tflow::setJournal(Journal* jnl) {
+  jnl_ = jnl;
+}
+
+bool Tflow::setPeer(const std::string& addr, unsigned int deadline) {
+  peer_ = PeerLink::create(addr);
+  peer_deadline_ = deadline;
+  return peer_ != nullptr;
+}
+
+bool Tflow::setWorkers(unsigned int num, unsigned int deadline, int core) {
+  if (getState() != Base::State::kPaused || host_) {
+    return false;
+  }
+  workers_ = num;
+  worker_deadline_ = std::min(deadline, hang_max_ / 2);
+  worker_core_ = core;
   return true;
 }
 
-bool Tflow::waitingToRun() {
+bool Tflow::serve(std::shared_ptr<PeerJob>& job) {
+  if (!tflow_on_ || host_ || job->width != model_width_ || job->height != model_height_ ||
+      job->channels != model_channels_ ||
+      job->rgb.size() != model_width_ * model_height_ * model_channels_) {
+    return false;
+  }
+  if (!serve_chan_.push(job)) {
+    return false;
+  }
+  eval_sem_.post();
+  return true;
+}
 
+void Tflow::metrics(Exposition& out, const std::string& labels) {
+  out.counter("detector_inferences_total", "frames run through the model", labels,
+      differ_post_.cnt - cache_hits_);
+  out.counter("detector_inference_cache_hits_total", "frames that took an earlier frame's results",
+      labels, cache_hits_);
+  out.gauge("detector_camera_state", "0 ok, 1 frozen, 2 covered", labels,
+      static_cast<int>(camera_.load()));
+  out.gauge("detector_first_inference_ms", "run start to the first invoke done, -1 before it",
+      labels, first_eval_ms_.load());
+  out.counter("detector_model_swaps_total", "models swapped in while running", labels,
+      swap_cnt_);
+  out.counter("detector_model_resizes_total", "changes to another input size of the model",
+      labels, family_cnt_);
+  out.counter("detector_tpu_fallbacks_total", "times the tpu went and the cpu model took over",
+      labels, tpu_lost_cnt_);
+  out.counter("detector_frames_skipped_total", "frames that came too fast to evaluate",
+      labels, frame_chan_.drops() + stale_cnt_ + overtaken_cnt_);
+  out.counter("detector_frames_held_total", "frames held back by the detection rate",
+      labels, held_cnt_);
+  out.counter("detector_frames_late_total", "frames dropped as past their deadline", labels,
+      late_cnt_);
+  if (peer_) {
+    out.counter("detector_peer_offloads_total", "frames evaluated by the peer", labels, peer_cnt_);
+    out.counter("detector_peer_misses_total", "frames the peer didn't answer in time, evaluated here",
+        labels, peer_miss_cnt_);
+    out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"peer\"", differ_peer_.hist);
+  }
+  if (workers_ != 0) {
+    out.counter("detector_worker_misses_total", "frames a worker didn't answer, passed on with nothing found",
+        labels, worker_miss_cnt_);
+  }
+  out.counter("detector_peer_served_total", "peers' inputs evaluated on our engines", labels,
+      served_cnt_);
+  if (gles_) {
+    out.counter("detector_gles_inputs_total", "model inputs the gpu made", labels + ",how=\"upload\"",
+        gles_->scaled() - gles_->imported());
+    out.counter("detector_gles_inputs_total", "model inputs the gpu made", labels + ",how=\"dmabuf\"",
+        gles_->imported());
+    out.counter("detector_gles_busy_total", "model inputs made on a core while the gpu was busy",
+        labels, gles_->busy());
+  }
+  out.counter("detector_classify_cut_total", "frames that classified fewer boxes, post being behind",
+      labels, crop_cut_cnt_);
+  out.counter("detector_frames_still_total", "frames motion found nothing new in", labels,
+      still_cnt_);
+  out.counter("detector_frames_screened_total", "frames the screening model kept from the detector",
+      labels, screened_cnt_);
+  out.counter("detector_batch_misses_total", "batches allocated because the pool was empty",
+      labels, box_pool_.misses());
+  out.gauge("detector_queue_depth", "messages waiting for the stage", labels,
+      frame_chan_.size());
+  out.counter("detector_queue_drops_total", "messages the stage's queue dropped", labels,
+      frame_chan_.drops());
+  out.gauge("detector_detection_rate", "target detections per second, 0 as fast as possible",
+      labels, rate_);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"copy\"", differ_copy_.hist);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"prep\"", differ_prep_.hist);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"post\"", differ_post_.hist);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"capture\"", differ_late_.hist);
+}
+
+// the span of an interpreter's arena, its scratch and activations
+static size_t arenaBytes(tflite::Interpreter& interpreter) {
+  const char* lo = nullptr;
+  const char* hi = nullptr;
+  for (size_t i = 0; i < interpreter.tensors_size(); i++) {
+    TfLiteTensor* t = interpreter.tensor(i);
+    if (t == nullptr || t->allocation_type != kTfLiteArenaRw || t->data.raw == nullptr) {
+      continue;
+    }
+    lo = (lo == nullptr) ? t->data.raw : std::min(lo, (const char*)t->data.raw);
+    hi = (hi == nullptr) ? t->data.raw + t->bytes : std::max(hi, (const char*)t->data.raw + t->bytes);
+  }
+  return hi - lo;
+}
+
+unsigned int Tflow::pending() {
   if (!tflow_on_) {
+    return 0;
+  }
+  unsigned int free = free_chan_.size();
+  return frame_chan_.size() + (slot_num_ > free ? slot_num_ - free : 0);
+}
 
-    // find tpu
-    dbgMsg("find tpu\n");
-    const auto& available_tpus =
-        edgetpu::EdgeTpuManager::GetSingleton()->EnumerateEdgeTpu();
-
-    // make model and interpreter
-    dbgMsg("make model and interpreter\n");
-    if (tpu_ && available_tpus.size()) {
-      model_ = tflite::FlatBufferModel::BuildFromFile(model_fname_.c_str());
-      edgetpu_context_ = edgetpu::EdgeTpuManager::GetSingleton()->OpenDevice();
-      tflite::ops::builtin::BuiltinOpResolver resolver;
-      resolver.AddCustom(edgetpu::kCustomOp, edgetpu::RegisterCustomOp());
-      tflite::InterpreterBuilder builder(*model_, resolver);
-      builder(&model_interpreter_);
-      model_interpreter_->SetExternalContext(kTfLiteEdgeTpuContext, edgetpu_context_.get());
-      model_interpreter_->SetNumThreads(1);
+void Tflow::footprint(Footprint& out) {
+  out.add("tflite_arena", arena_num_, arena_bytes_);
+  out.add("tflite_family", family_num_, family_bytes_);
+  out.add("tflow_slots", slot_cnt_, slot_bytes_);
+  out.add("dewarp_lut", dewarp_bytes_ ? 1 : 0, dewarp_bytes_);
+  out.add("box_batches", box_pool_.size(), box_pool_.bytes());
+}
+
+bool Tflow::checkEngines() {
+
+  if (host_) {
+    return true;    // the host watches its engines
+  }
+
+  using namespace std::chrono;
+  int64_t now = steady_clock::now().time_since_epoch().count();
+  int64_t limit = duration_cast<steady_clock::duration>(milliseconds(hang_max_)).count();
+  bool tpu_lost = false;
+  for (auto it = engines_.begin(); it != engines_.end(); ) {
+    auto& eng = *it;
+    int64_t began = eng->busy;
+    if (began <= 0 || now - began < limit ||
+        !eng->busy.compare_exchange_strong(began, -1)) {
+      ++it;
+      continue;
+    }
+
+    // its frame will never come, don't hold the others back for it
+    dbgMsg("engine stuck for %u msec\n", hang_max_);
+    uint64_t seq = eng->seq;
+    Tflow* owner = eng->owner ? eng->owner : this;
+    owner->skip_chan_.push(seq);
+    owner->post_sem_.post();
+    if (owner != this) {
+      owner->lent_--;
+    }
+    tpu_lost = tpu_lost || eng->context != nullptr;
+    eng->thread.detach();
+    hung_.push_back(eng.release());
+    hung_run_++;
+    it = engines_.erase(it);
+  }
+
+  // carry on with what is left, otherwise give up and get restarted,
+  // on the cpu if the tpu went
+  if (engines_.empty()) {
+    if (tpu_lost && !fallback_model_.empty()) {
+      fallBack();
+    }
+    if (!quiet_) {
+      fprintf(stderr, "\ntflow: every engine is stuck%s\n", 
+          tpu_lost ? ", falling back to the cpu" : "");
+    }
+    return false;
+  }
+  return true;
+}
+
+// run the cpu model until the tpu is back
+void Tflow::fallBack() {
+  tpu_ = false;
+  tpu_lost_cnt_++;
+  std::unique_lock<std::mutex> lck(swap_lock_);
+  if (tpu_model_.empty()) {
+    tpu_model_ = model_fname_;
+    tpu_labels_ = labels_fname_;
+  }
+  model_fname_ = fallback_model_;
+  labels_fname_ = fallback_labels_;
+  swap_want_.reset();
+  lck.unlock();
+
+  // the other sizes may be on the tpu that went, they load again next run
+  for (auto& m : family_) {
+    m.ld.reset();
+  }
+  family_num_ = 0;
+  family_bytes_ = 0;
+}
+
+std::vector<std::shared_ptr<edgetpu::EdgeTpuContext>> Tflow::openTpus() {
+  std::vector<std::shared_ptr<edgetpu::EdgeTpuContext>> contexts;
+  const auto& available_tpus =
+      edgetpu::EdgeTpuManager::GetSingleton()->EnumerateEdgeTpu();
+  for (auto& tpu : available_tpus) {
+    auto context = edgetpu::EdgeTpuManager::GetSingleton()->OpenDevice(
+        tpu.type, tpu.path);
+    if (context == nullptr) {
+      dbgMsg("failed: open tpu %s\n", tpu.path.c_str());
+      continue;
+    }
+    contexts.push_back(context);
+  }
+  return contexts;
+}
+
+// every so often while on the fallback look for the tpu, and load the
+// tpu model on it in the background like a swap when it shows up
+void Tflow::reattach() {
+
+  using namespace std::chrono;
+  auto now = steady_clock::now();
+  if (tpu_ || now - probe_stamp_ < milliseconds(probe_ms_)) {
+    return;
+  }
+  probe_stamp_ = now;
+  std::unique_lock<std::mutex> lck(swap_lock_);
+  if (tpu_model_.empty() || swap_want_ || loader_.joinable()) {
+    return;
+  }
+  lck.unlock();
+  auto contexts = openTpus();
+  if (contexts.empty()) {
+    return;
+  }
+  dbgMsg("tpu is back\n");
+  lck.lock();
+  swap_ = std::make_unique<Tflow::Loaded>();
+  swap_->model_fname = tpu_model_;
+  swap_->labels_fname = tpu_labels_;
+  swap_->threads = model_threads_;
+  swap_->ok = false;
+  loader_ = std::thread(loaderProc0, this, contexts);
+}
+
+// the engines are read on this thread, the dispatchers get the average
+unsigned int Tflow::expected() {
+  unsigned int sum = 0;
+  for (auto& eng : engines_) {
+    sum += eng->eval_avg.load();
+  }
+  eval_us_ = engines_.empty() ? 0 : sum / engines_.size();
+  return differ_prep_.avg + eval_us_;
+}
+
+// dropped if it would still be waiting at its deadline after 'usec' more
+bool Tflow::tooLate(Tflow::Slot& slot, unsigned int usec) {
+  if (!Deadline::late(slot.frame.deadline, pipeline_now(), usec)) {
+    return false;
+  }
+  Fate::drop(Fate::Site::kTflowLate, slot.frame.stamp);
+  slot.frame.ref.reset();
+  slot.frame.addr = nullptr;
+  late_cnt_++;
+  return true;
+}
+
+bool Tflow::schedule(const FrameBuf& frame) {
+
+  float rate = rate_;
+  if (rate == 0.f) {
+    return true;
+  }
+
+  using namespace std::chrono;
+  auto now = (frame.stamp.time_since_epoch().count() != 0) ? 
+    frame.stamp : pipeline_now();
+
+  // check the soc temperature once a second
+  if (now - temp_stamp_ >= seconds(1)) {
+    temp_stamp_ = now;
+    std::ifstream ifs("/sys/class/thermal/thermal_zone0/temp");
+    int milli = 0;
+    if (ifs >> milli) {
+      temp_ = milli / 1000.f;
+      float hot = (temp_ - temp_soft_) / (temp_hard_ - temp_soft_);
+      temp_scale_ = 1.f + fmin(fmax(hot, 0.f), 1.f);
+    }
+  }
+
+  return now >= due_;
+}
+
+// the frame was taken, the next one is due a period on
+void Tflow::advance(const FrameBuf& frame) {
+
+  float rate = rate_;
+  if (rate == 0.f) {
+    return;
+  }
+
+  using namespace std::chrono;
+  auto now = (frame.stamp.time_since_epoch().count() != 0) ? 
+    frame.stamp : pipeline_now();
+
+  // never ask for more than prep and the engines can keep up with
+  float eval_us = 0.f;
+  for (auto& eng : engines_) {
+    eval_us += eng->eval_avg.load();
+  }
+  eval_us /= engines_.size();   // average engine
+  eval_us /= engines_.size();   // all of them at once
+  float period_us = fmax(1000000.f / rate, 
+      fmax(static_cast<float>(differ_prep_.avg), eval_us)) * temp_scale_;
+
+  // keep the phase unless we fell a whole period behind
+  auto period = duration_cast<steady_clock::duration>(
+      duration<float,std::micro>(period_us));
+  due_ += period;
+  if (due_ <= now) {
+    due_ = now + period;
+  }
+  due_ticks_ = due_.time_since_epoch().count();
+}
+
+bool Tflow::load(Tflow::Loaded& ld,
+    const std::vector<std::shared_ptr<edgetpu::EdgeTpuContext>>& contexts) {
+
+  if (workers_ != 0) {
+    return startWorkers(ld) && readLabels(ld);
+  }
+
+  // the model is mapped, read it in now rather than fault it in page by
+  // page during the first invokes
+  int fd = open(ld.model_fname.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+  }
+
+  // make model and one engine per tpu
+  dbgMsg("make model and interpreters\n");
+  {
+    Startup::Scope step("model build");
+    ld.model = tflite::FlatBufferModel::BuildFromFile(ld.model_fname.c_str());
+  }
+  if (!ld.model) {
+    dbgMsg("failed: model %s\n", ld.model_fname.c_str());
+    return false;
+  }
+  // 'tpu_depth_' interpreters a tpu, so one is filled and read while
+  // another invokes and the tpu doesn't wait on the cpu in between
+  for (auto& context : contexts) {
+    for (unsigned int i = 0; i < tpu_depth_; i++) {
+      ld.engines.push_back(makeEngine(*ld.model, context, 1, Tflow::Delegate::kCpu));
+    }
+  }
+  // a pool of cpu engines works on different frames at once
+  ld.asked = delegate_;
+  if (ld.engines.size() == 0) {
+    Tflow::Delegate kind = (ld.asked == Tflow::Delegate::kAuto) ?
+      pick(*ld.model, ld.threads) : ld.asked;
+    for (unsigned int i = 0; i < model_engines_; i++) {
+      ld.engines.push_back(makeEngine(*ld.model, nullptr, ld.threads, kind));
+    }
+  }
+  for (auto& eng : ld.engines) {
+    if (!eng->interpreter) {
+      dbgMsg("failed: interpreter for %s\n", ld.model_fname.c_str());
+      return false;
+    }
+  }
+
+  auto& interpreter = ld.engines[0]->interpreter;
+  int input = interpreter->inputs()[0];
+  TfLiteIntArray* dims = interpreter->tensor(input)->dims;
+  ld.height = dims->data[1];
+  ld.width = dims->data[2];
+  ld.channels = dims->data[3];
+  ld.input_type = interpreter->tensor(input)->type;
+
+  // float models read a pixel through the tensor's quantisation, or as
+  // the usual [-1,1] when it has none
+  auto params = interpreter->tensor(input)->params;
+  ld.in_scale = (params.scale > 0.f) ? params.scale : 1.f / 127.5f;
+  ld.in_zero = (params.scale > 0.f) ? params.zero_point : 127.5f;
+  if (ld.input_type != kTfLiteUInt8 && ld.input_type != kTfLiteFloat32) {
+    dbgMsg("unsupported model input type %d\n", ld.input_type);
+    return false;
+  }
+
+  // how many detections the postprocess op gives
+  const std::vector<int>& res = interpreter->outputs();
+  if (res.size() < 4) {
+    dbgMsg("failed: %s has no detection postprocess outputs\n", ld.model_fname.c_str());
+    return false;
+  }
+  TfLiteIntArray* sdims = interpreter->tensor(res[2])->dims;
+  ld.results = sdims->data[sdims->size - 1];
+  return readLabels(ld);
+}
+
+// a worker a tpu, or 'workers_' on the cpu, then their shape once up
+bool Tflow::startWorkers(Tflow::Loaded& ld) {
+
+  dbgMsg("start workers\n");
+  Startup::Scope step("worker start");
+  unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+  ld.asked = delegate_;
+  for (unsigned int i = 0; i < workers_; i++) {
+    int core = (worker_core_ < 0) ? -1 : (worker_core_ + i) % cores;
+    std::shared_ptr<Worker> w = Worker::create(ld.model_fname, ld.threads,
+        tpu_ ? static_cast<int>(i) : -1, core, worker_deadline_);
+    if (!w) {
+      return false;
+    }
+    for (unsigned int k = 0; k < worker_lanes; k++) {
+      auto eng = std::make_unique<Tflow::Engine>();
+      eng->worker = w;
+      eng->lane = k;
+      ld.engines.push_back(std::move(eng));
+    }
+  }
+  for (auto& eng : ld.engines) {
+    if (eng->lane == 0 && !eng->worker->wait(worker_start_ms_)) {
+      dbgMsg("failed: worker for %s\n", ld.model_fname.c_str());
+      return false;
+    }
+  }
+
+  const WorkerHeader& s = ld.engines[0]->worker->shape();
+  for (auto& eng : ld.engines) {
+    const WorkerHeader& t = eng->worker->shape();
+    if (t.width != s.width || t.height != s.height || t.channels != s.channels ||
+        t.results != s.results || t.input_type != s.input_type) {
+      dbgMsg("failed: workers disagree on %s\n", ld.model_fname.c_str());
+      return false;
+    }
+  }
+  ld.width = s.width;
+  ld.height = s.height;
+  ld.channels = s.channels;
+  ld.results = s.results;
+  ld.input_type = static_cast<TfLiteType>(s.input_type);
+  ld.in_scale = s.in_scale;
+  ld.in_zero = s.in_zero;
+  return true;
+}
+
+bool Tflow::readLabels(Tflow::Loaded& ld) {
+
+  // read labels file, into a table by class id
+  dbgMsg("read labels file\n");
+  ld.classes.clear();
+  std::ifstream ifs(ld.labels_fname.c_str(), std::ifstream::in);
+  if (!ifs) {
+    dbgMsg("could not open labels file\n");
+  }
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::istringstream iss(line);
+    std::vector<std::string> tokens{
+      std::istream_iterator<std::string>{iss},
+      std::istream_iterator<std::string>{}
+    };
+    if (tokens.size() < 2) {
+      continue;
+    }
+    unsigned int id = std::stoul(tokens[0]);
+    if (id >= ld.classes.size()) {
+      ld.classes.resize(id + 1);
+    }
+    Tflow::Class& cls = ld.classes[id];
+    cls.name = Names::intern(tokens[1]);
+    auto it = boxbuf_pairs_.find(tokens[1]);
+    cls.type = (it != boxbuf_pairs_.end()) ? it->second : BoxBuf::Type::kUnknown;
+    auto spec = class_spec_.find(tokens[1]);
+    cls.keep = class_spec_.empty() || spec != class_spec_.end();
+    cls.threshold = (spec != class_spec_.end()) ? spec->second : 0.f;
+  }
+  return true;
+}
+
+void Tflow::install(Tflow::Loaded& ld) {
+
+  model_ = std::move(ld.model);
+  engines_ = std::move(ld.engines);
+  classes_ = std::move(ld.classes);
+  result_num_ = ld.results;
+  model_width_ = ld.width;
+  model_height_ = ld.height;
+  model_channels_ = ld.channels;
+  input_type_ = ld.input_type;
+  in_scale_ = ld.in_scale;
+  in_zero_ = ld.in_zero;
+  model_threads_ = ld.threads;
+  asked_ = ld.asked;
+  {
+    std::unique_lock<std::mutex> lck(swap_lock_);
+    model_fname_ = ld.model_fname;
+    labels_fname_ = ld.labels_fname;
+  }
+  {
+    // another model's results are no good
+    std::unique_lock<std::mutex> lck(cache_lock_);
+    cache_.clear();
+  }
+  {
+    std::unique_lock<std::mutex> lck(shape_lock_);
+    shape_.gen = ++model_gen_;
+    shape_.width = model_width_;
+    shape_.height = model_height_;
+    shape_.channels = model_channels_;
+    shape_.input_type = input_type_;
+    shape_.in_scale = in_scale_;
+    shape_.in_zero = in_zero_;
+    shape_.results = result_num_;
+    shape_.engines = engines_.size();
+    shape_.classes = classes_;
+  }
+  mapInput();
+}
+
+void Tflow::uninstall(Tflow::Loaded& ld) {
+
+  // what install put in, back out with its engines still made
+  {
+    std::unique_lock<std::mutex> lck(swap_lock_);
+    ld.model_fname = model_fname_;
+    ld.labels_fname = labels_fname_;
+  }
+  ld.threads = model_threads_;
+  ld.asked = asked_;
+  ld.model = std::move(model_);
+  ld.engines = std::move(engines_);
+  ld.classes = std::move(classes_);
+  ld.results = result_num_;
+  ld.width = model_width_;
+  ld.height = model_height_;
+  ld.channels = model_channels_;
+  ld.input_type = input_type_;
+  ld.in_scale = in_scale_;
+  ld.in_zero = in_zero_;
+  ld.ok = true;
+  for (auto& eng : ld.engines) {
+    eng->busy = 0;
+    eng->seq = 0;
+  }
+}
+
+// the host's model as it is now, false while it has none running
+bool Tflow::borrow() {
+
+  Tflow::Shape s;
+  {
+    std::unique_lock<std::mutex> lck(host_->shape_lock_);
+    s = host_->shape_;
+  }
+  if (s.gen == 0 || !host_->tflow_on_) {
+    return false;
+  }
+  host_gen_ = s.gen;
+  host_engines_ = s.engines;
+  model_width_ = s.width;
+  model_height_ = s.height;
+  model_channels_ = s.channels;
+  input_type_ = s.input_type;
+  in_scale_ = s.in_scale;
+  in_zero_ = s.in_zero;
+  result_num_ = s.results;
+  classes_ = std::move(s.classes);
+  {
+    std::unique_lock<std::mutex> lck(cache_lock_);
+    cache_.clear();
+  }
+  mapInput();
+  return true;
+}
+
+void Tflow::mapInput() {
+
+  // map the frame onto the model input
+  src_rect_ = { 0, 0, width_, height_ };
+  dst_rect_ = { 0, 0, model_width_, model_height_ };
+  bool wide = width_ * model_height_ > height_ * model_width_;
+  if (aspect_ == Tflow::Aspect::kLetterbox) {
+    if (wide) {
+      dst_rect_.h = height_ * model_width_ / width_;
+      dst_rect_.y = (model_height_ - dst_rect_.h) / 2;
     } else {
-      model_ = tflite::FlatBufferModel::BuildFromFile(model_fname_.c_str());
-      tflite::ops::builtin::BuiltinOpResolver resolver;
-      tflite::InterpreterBuilder builder(*model_, resolver);
-      builder(&model_interpreter_);
-      model_interpreter_->UseNNAPI(false);
-      model_interpreter_->SetNumThreads(model_threads_);
-    }
-    model_interpreter_->AllocateTensors();
-    int input = model_interpreter_->inputs()[0];
-    const std::vector<int> inputs = model_interpreter_->inputs();
-    const std::vector<int> outputs = model_interpreter_->outputs();
-    TfLiteIntArray* dims = model_interpreter_->tensor(input)->dims;
-    model_height_ = dims->data[1];
-    model_width_ = dims->data[2];
-    model_channels_ = dims->data[3];
-
-    // make resize interpreter
-    dbgMsg("make resize interpreter\n");
-    resize_interpreter_ = std::make_unique<tflite::Interpreter>();
-    int base_index = 0;
-    resize_interpreter_->AddTensors(2, &base_index);  // two inputs: input and new_sizes
-    resize_interpreter_->AddTensors(1, &base_index);  // one output
-    resize_interpreter_->SetInputs({0, 1});
-    resize_interpreter_->SetOutputs({2});
-    TfLiteQuantizationParams quant;
-    resize_interpreter_->SetTensorParametersReadWrite(
-        0, kTfLiteFloat32, "input",
-        {1, 
-          static_cast<int>(height_), 
-          static_cast<int>(width_), 
-          static_cast<int>(channels_)
-        }, 
-        quant);
-    resize_interpreter_->SetTensorParametersReadWrite(
-        1, kTfLiteInt32, "new_size", 
-        {2}, 
-        quant);
-    resize_interpreter_->SetTensorParametersReadWrite(
-        2, kTfLiteFloat32, "output",
-        {1, 
-          static_cast<int>(model_height_), 
-          static_cast<int>(model_width_), 
-          static_cast<int>(model_channels_)
-        }, 
-        quant);
-    tflite::ops::builtin::BuiltinOpResolver resize_resolver;
-    const TfLiteRegistration* resize_op =
-        resize_resolver.FindOp(tflite::BuiltinOperator_RESIZE_BILINEAR, 1);
-    auto* params = reinterpret_cast<TfLiteResizeBilinearParams*>(
-        malloc(sizeof(TfLiteResizeBilinearParams)));
-    params->align_corners = false;
-    resize_interpreter_->AddNodeWithParameters(
-        {0, 1}, {2}, nullptr, 0, params, resize_op, nullptr);
-    if (tpu_ && available_tpus.size()) {
-      resize_interpreter_->SetExternalContext(kTfLiteEdgeTpuContext, edgetpu_context_.get());
-      resize_interpreter_->SetNumThreads(1);
+      dst_rect_.w = width_ * model_height_ / height_;
+      dst_rect_.x = (model_width_ - dst_rect_.w) / 2;
+    }
+  } else if (aspect_ == Tflow::Aspect::kCrop) {
+    // keep the crop on even pixels so i420 chroma lines up
+    if (wide) {
+      src_rect_.w = height_ * model_width_ / model_height_;
+      src_rect_.x = ((width_ - src_rect_.w) / 2) & ~1;
     } else {
-      resize_interpreter_->UseNNAPI(false);
-      resize_interpreter_->SetNumThreads(model_threads_);
+      src_rect_.h = width_ * model_height_ / model_width_;
+      src_rect_.y = ((height_ - src_rect_.h) / 2) & ~1;
+    }
+  }
+
+  // the views at the model's size, made again when it changes
+  if (dewarp_) {
+    dewarp_->build(model_width_, model_height_);
+    dewarp_bytes_ = dewarp_->footprint();
+  }
+}
+
+void Tflow::launch() {
+
+  // slots for frames between the stages, one per engine plus prep and post
+  unsigned int engines = host_ ? host_engines_ : engines_.size();
+  unsigned int views = dewarp_ ? dewarp_->views() : 0;
+  slot_num_ = std::min(engines + 2 + tile_per_ + views, slot_max_);
+  slots_.resize(slot_num_);
+  for (unsigned int i = 0; i < slot_num_; i++) {
+    slots_[i].rgb.resize(model_width_ * model_height_ * model_channels_);
+    slots_[i].locs.resize(result_num_ * 4);
+    slots_[i].clas.resize(result_num_);
+    slots_[i].scor.resize(result_num_);
+    free_chan_.push(i);
+  }
+
+  size_t bytes = 0;
+  for (auto& eng : engines_) {
+    bytes += eng->interpreter ? arenaBytes(*eng->interpreter) : 0;
+  }
+  arena_num_ = engines_.size();
+  arena_bytes_ = bytes;
+  bytes = 0;
+  for (auto& s : slots_) {
+    bytes += s.rgb.capacity() + (s.locs.capacity() + s.clas.capacity() +
+        s.scor.capacity()) * sizeof(float);
+  }
+  slot_cnt_ = slot_num_;
+  slot_bytes_ = bytes;
+
+  tflow_on_ = true;
+
+  // prep runs on this thread, each engine and post on their own
+  dbgMsg("launch engine and post threads\n");
+  eval_seq_ = 0;
+  held_ = -1;
+  dispatch_id_ = -1;
+  hung_run_ = 0;
+  post_seq_ = 0;
+  for (auto& eng : engines_) {
+    eng->thread = std::thread(evalProc0, this, eng.get());
+  }
+  post_ = std::thread(postProc0, this);
+  if (peer_ && !host_) {
+    peer_thread_ = std::thread(peerProc0, this);
+  }
+}
+
+void Tflow::land() {
+
+  tflow_on_ = false;
+
+  // a guest gets its slots back from the host's engines first
+  while (lent_ != 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  // stop engines and post
+  dbgMsg("kill engine and post threads\n");
+  for (unsigned int i = 0; i < engines_.size(); i++) {
+    eval_sem_.post();
+  }
+  for (auto& eng : engines_) {
+    eng->thread.join();
+  }
+  if (peer_thread_.joinable()) {
+    peer_thread_.join();
+  }
+  std::shared_ptr<PeerJob> job;
+  while (serve_chan_.pop(job)) {
+    job->done.post();
+  }
+  post_sem_.post();
+  post_.join();
+
+  // finish the frames already in the pipe, oldest first
+  unsigned int idx;
+  uint64_t seq;
+  while (post_chan_.pop(idx)) {
+    deliver(idx, false);
+  }
+  while (dispatch(idx, seq)) {
+    if (engines_.empty()) {
+      continue;
     }
-    resize_interpreter_->AllocateTensors();
+    eval(*engines_[0], slots_[idx]);
+    slots_[idx].seq = seq;
+    deliver(idx, false);
+  }
+  while (free_chan_.pop(idx)) {
+  }
+  pending_.clear();
+  skipped_.clear();
+  while (skip_chan_.pop(seq)) {
+  }
+  slots_.clear();
+  arena_num_ = 0;
+  arena_bytes_ = 0;
+  slot_cnt_ = 0;
+  slot_bytes_ = 0;
+}
 
-    // read labels file
-    dbgMsg("read labels file\n");
-    std::ifstream ifs(labels_fname_.c_str(), std::ifstream::in);
-    if (!ifs) {
-      dbgMsg("could not open labels file\n");
+bool Tflow::swap() {
+
+  // the one loading is ready, put it in between two frames
+  if (swap_done_) {
+    loader_.join();
+    swap_done_ = false;
+    std::unique_ptr<Tflow::Loaded> ld;
+    {
+      std::unique_lock<std::mutex> lck(swap_lock_);
+      ld = std::move(swap_);
     }
-    std::string line;
-    while (std::getline(ifs, line)) {
-      std::istringstream iss(line);
-      std::vector<std::string> tokens{
-        std::istream_iterator<std::string>{iss},
-        std::istream_iterator<std::string>{}
-      };
-      auto it = boxbuf_pairs_.find(tokens[1]);
-      BoxBuf::Type btype = BoxBuf::Type::kUnknown;
-      if (it != boxbuf_pairs_.end()) {
-        btype = it->second;
+    if (ld->ok) {
+      auto begin = std::chrono::steady_clock::now();
+      land();
+      for (auto& eng : engines_) {
+        eng->interpreter.reset();
+      }
+      engines_.clear();
+      if (hung_run_ != 0) {
+        model_.release();   // a stuck invoke may still be reading it
+      }
+      install(*ld);
+      launch();
+      swap_cnt_++;
+      if (!tpu_ && engines_[0]->context) {
+        tpu_ = true;
+        std::unique_lock<std::mutex> lck(swap_lock_);
+        tpu_model_.clear();
+        tpu_labels_.clear();
       }
-      label_pairs_[std::stoul(tokens[0])] = std::make_pair(tokens[1], btype);
+      if (!quiet_) {
+        auto gap = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - begin).count();
+        fprintf(stderr, "\ntflow: swapped in %s, %lld msec between models\n",
+            ld->model_fname.c_str(), static_cast<long long>(gap));
+      }
+    } else if (!quiet_) {
+      fprintf(stderr, "\ntflow: can't load %s, keeping the current model\n",
+          ld->model_fname.c_str());
     }
+  }
 
+  // start on the newest ask, on the tpus in use
+  std::unique_lock<std::mutex> lck(swap_lock_);
+  if (swap_want_ && !loader_.joinable() && workers_ != 0 && tpu_) {
+
+    // workers hold their tpus until they go, so the new model loads in
+    // between two frames instead, and the old one again if it won't
+    std::unique_ptr<Tflow::Loaded> ld = std::move(swap_want_);
+    Tflow::Loaded old;
+    old.model_fname = model_fname_;
+    old.labels_fname = labels_fname_;
+    old.threads = model_threads_;
+    lck.unlock();
+    land();
+    engines_.clear();
+    bool ok = load(*ld, {}) && warm(*ld);
+    if (!ok) {
+      if (!quiet_) {
+        fprintf(stderr, "\ntflow: can't load %s, back to %s\n",
+            ld->model_fname.c_str(), old.model_fname.c_str());
+      }
+      ld->engines.clear();
+      if (!(load(old, {}) && warm(old))) {
+        return false;
+      }
+    }
+    install(ok ? *ld : old);
+    launch();
+    swap_cnt_ += ok ? 1 : 0;
+  } else if (swap_want_ && !loader_.joinable()) {
+    swap_ = std::move(swap_want_);
+    std::vector<std::shared_ptr<edgetpu::EdgeTpuContext>> contexts;
+    for (auto& eng : engines_) {
+      if (eng->context &&
+          std::find(contexts.begin(), contexts.end(), eng->context) == contexts.end()) {
+        contexts.push_back(eng->context);
+      }
+    }
+    loader_ = std::thread(loaderProc0, this, contexts);
+  }
+  return true;
+}
+
+// the family's other sizes, loaded next to the one running and on the
+// same tpus, smallest first
+bool Tflow::loadFamily() {
+
+  if (family_.empty()) {
+    return true;
+  }
+  std::vector<std::shared_ptr<edgetpu::EdgeTpuContext>> contexts;
+  for (auto& eng : engines_) {
+    if (eng->context &&
+        std::find(contexts.begin(), contexts.end(), eng->context) == contexts.end()) {
+      contexts.push_back(eng->context);
+    }
+  }
+  std::string running = getModel();
+  size_t bytes = 0;
+  unsigned int num = 0;
+  for (auto& m : family_) {
+    if (m.model_fname == running) {
+      m.ld.reset();
+      m.width = model_width_;
+      m.height = model_height_;
+      continue;
+    }
+    if (!m.ld || !m.ld->ok) {
+      m.ld = std::make_unique<Tflow::Loaded>();
+      m.ld->model_fname = m.model_fname;
+      m.ld->labels_fname = getLabels();
+      m.ld->threads = model_threads_;
+      m.ld->ok = load(*m.ld, contexts) && warm(*m.ld);
+      if (!m.ld->ok) {
+        dbgMsg("failed: model %s of the family\n", m.model_fname.c_str());
+        return false;
+      }
+      m.width = m.ld->width;
+      m.height = m.ld->height;
+    }
+    for (auto& eng : m.ld->engines) {
+      bytes += eng->interpreter ? arenaBytes(*eng->interpreter) : 0;
+      num++;
+    }
+  }
+  std::sort(family_.begin(), family_.end(), [](const Tflow::Member& a, const Tflow::Member& b) {
+    return a.width * a.height < b.width * b.height;
+  });
+  family_num_ = num;
+  family_bytes_ = bytes;
+  family_stamp_ = std::chrono::steady_clock::now();
+  return true;
+}
+
+// the smallest size that keeps every track's short side at 'family_px_'
+// input pixels, going smaller only with some to spare, -1 to stay
+int Tflow::pickSize() {
+
+  std::string running = getModel();
+  int at = -1;
+  for (unsigned int i = 0; i < family_.size(); i++) {
+    if (!family_[i].ld && family_[i].model_fname == running) {
+      at = i;
+    } else if (!family_[i].ld) {
+      return -1;    // not all loaded, after a fallback
+    }
+  }
+  if (at < 0) {
+    return -1;      // something else runs, a fallback or a swap
+  }
+
+  int want = family_.size() - 1;
+  auto tracks = trk_ ? trk_->getTracks() : nullptr;
+  if (tracks && tracks->size() != 0) {
+    for (unsigned int i = 0; i < family_.size(); i++) {
+      float need = family_px_ * (static_cast<int>(i) < at ? family_margin_ : 1.f);
+      float least = static_cast<float>(family_[i].width);
+      for (auto& t : *tracks) {
+        least = std::min(least, std::min(t.w * family_[i].width / static_cast<float>(width_),
+            t.h * family_[i].height / static_cast<float>(height_)));
+      }
+      if (least >= need) {
+        want = i;
+        break;
+      }
+    }
+  }
+  return (want == at) ? -1 : want;
+}
+
+void Tflow::resize(unsigned int idx) {
+
+  // between two frames, the one running goes back in its place
+  auto begin = std::chrono::steady_clock::now();
+  family_stamp_ = begin;
+  std::string running = getModel();
+  land();
+  std::unique_ptr<Tflow::Loaded> ld = std::move(family_[idx].ld);
+  for (auto& m : family_) {
+    if (!m.ld && m.model_fname == running) {
+      m.ld = std::make_unique<Tflow::Loaded>();
+      uninstall(*m.ld);
+    }
+  }
+  install(*ld);
+  launch();
+  family_cnt_++;
+  if (!quiet_) {
+    auto gap = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - begin).count();
+    fprintf(stderr, "\ntflow: %ux%u input, %lld msec between sizes\n",
+        model_width_, model_height_, static_cast<long long>(gap));
+  }
+}
+
+// the first invoke uploads the model to the tpu or sets up the cpu
+// kernels, pay it before the first frame
+bool Tflow::warm(Tflow::Loaded& ld) {
+  Startup::Scope step("warm up");
+  for (auto& eng : ld.engines) {
+    if (eng->worker) {
+      continue;   // warmed before it said it was up
+    }
+    TfLiteTensor* in = eng->interpreter->tensor(eng->interpreter->inputs()[0]);
+    std::memset(in->data.raw, 0, in->bytes);
+    if (eng->interpreter->Invoke() != kTfLiteOk) {
+      dbgMsg("failed: warm up invoke\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+void Tflow::loaderProc(std::vector<std::shared_ptr<edgetpu::EdgeTpuContext>> contexts) {
+  Tflow::Loaded& ld = *swap_;
+  ld.ok = load(ld, contexts) && warm(ld);
+  swap_done_ = true;
+  wake();
+}
+
+void Tflow::loaderProc0(Tflow* self,
+    std::vector<std::shared_ptr<edgetpu::EdgeTpuContext>> contexts) {
+  self->loaderProc(contexts);
+}
+
+bool Tflow::waitingToRun() {
+
+  // a guest launches once the host has a model, see running
+  if (host_ && !tflow_on_) {
+    run_begin_ = std::chrono::steady_clock::now();
+    first_eval_ms_ = -1;
+    scaler_ = pick_rgb24_scaler(pix_fmt_);
+    if (!scaler_) {
+      dbgMsg("unsupported frame format %s\n", PixelFormatToStr(pix_fmt_));
+      return false;
+    }
     differ_tot_.begin();
-    tflow_on_ = true;
+    return true;
+  }
+
+  if (!tflow_on_) {
+
+    using namespace std::chrono;
+    run_begin_ = steady_clock::now();
+    first_eval_ms_ = -1;
+
+    // a swap asked for while stopped is just the model to load
+    Tflow::Loaded ld;
+    {
+      std::unique_lock<std::mutex> lck(swap_lock_);
+      if (swap_want_) {
+        model_fname_ = swap_want_->model_fname;
+        labels_fname_ = swap_want_->labels_fname;
+        model_threads_ = swap_want_->threads;
+        swap_want_.reset();
+      }
+      ld.model_fname = model_fname_;
+      ld.labels_fname = labels_fname_;
+      ld.threads = model_threads_;
+      ld.ok = false;
+    }
+
+    // the last run's engines if nothing changed, already on the tpu
+    engines_.clear();
+    if (parked_ && parked_->model_fname == ld.model_fname &&
+        parked_->labels_fname == ld.labels_fname && parked_->threads == ld.threads &&
+        parked_->asked == delegate_ &&
+        (workers_ ? parked_->engines[0]->worker != nullptr :
+         (parked_->engines[0]->context != nullptr) == tpu_)) {
+      dbgMsg("reuse parked engines\n");
+      ld = std::move(*parked_);
+    }
+    reused_ = ld.ok;
+    parked_.reset();
+
+    // find tpu, the tpu model won't run without one
+    dbgMsg("find tpu\n");
+    std::vector<std::shared_ptr<edgetpu::EdgeTpuContext>> contexts;
+    if (tpu_ && !ld.ok && workers_ == 0) {
+      Startup::Scope step("tpu open");
+      contexts = openTpus();
+      if (contexts.empty()) {
+        if (fallback_model_.empty()) {
+          dbgMsg("failed: no tpu\n");
+          return false;
+        }
+        if (!quiet_) {
+          fprintf(stderr, "\ntflow: no edge tpu, running %s on the cpu\n",
+              fallback_model_.c_str());
+        }
+        fallBack();
+        ld.model_fname = fallback_model_;
+        ld.labels_fname = fallback_labels_;
+      }
+    }
+
+    if (!ld.ok && !(load(ld, contexts) && warm(ld))) {
+      return false;
+    }
+    load_ms_ = duration_cast<milliseconds>(steady_clock::now() - run_begin_).count();
+    scaler_ = pick_rgb24_scaler(pix_fmt_);
+    if (!scaler_) {
+      dbgMsg("unsupported frame format %s\n", PixelFormatToStr(pix_fmt_));
+      return false;
+    }
+    install(ld);
+    if (!loadFamily()) {
+      return false;
+    }
+
+    // a classifier compiled for the tpu takes turns with us on the first one
+    if (classify_ && classify_->onTpu()) {
+      std::shared_ptr<edgetpu::EdgeTpuContext> context;
+      for (auto& eng : engines_) {
+        if (eng->context) {
+          context = eng->context;
+          break;
+        }
+      }
+      if (!context) {
+        dbgMsg("classify model needs a tpu, not classifying\n");
+      } else if (!classify_->attach(context)) {
+        dbgMsg("failed: classify on the tpu\n");
+      }
+    }
+
+    differ_tot_.begin();
+    launch();
+  }
+
+  return true;
+}
+
+bool Tflow::tracking() {
+  auto tracks = trk_ ? trk_->getTracks() : nullptr;
+  return tracks && tracks->size() != 0;
+}
+
+void Tflow::selectRegion(Tflow::Slot& slot) {
+
+  slot.src = src_rect_;
+  slot.dst = dst_rect_;
+  if (slot.tile >= 0) {
+    slot.src = tiles_[slot.tile];
+    slot.dst = { 0, 0, model_width_, model_height_ };
+    return;
+  }
+  if (slot.view >= 0) {
+    slot.src = { 0, 0, width_, height_ };
+    slot.dst = { 0, 0, model_width_, model_height_ };
+    return;
+  }
+
+  // every 'regions' frames look at everything to find new objects
+  unsigned int regions = regions_;
+  if (regions < 2 || region_cnt_++ % regions == 0) {
+    selectBlobs(slot);
+    return;
+  }
+  auto tracks = trk_->getTracks();
+  if (tracks == nullptr || tracks->size() == 0) {
+    selectBlobs(slot);
+    return;
+  }
+
+  // bound the tracks where they should be in this frame
+  float x0 = width_, y0 = height_, x1 = 0.f, y1 = 0.f;
+  for (auto& t : *tracks) {
+    TrackBuf p;
+    if (Tracker::predict(t, slot.frame.stamp, width_, height_, p)) {
+      float mx = p.w * region_margin_;
+      float my = p.h * region_margin_;
+      x0 = fmin(x0, p.x - mx);
+      y0 = fmin(y0, p.y - my);
+      x1 = fmax(x1, p.x + p.w + mx);
+      y1 = fmax(y1, p.y + p.h + my);
+    }
+  }
+  Rect roi;
+  if (!fitRegion(x0, y0, x1, y1, roi)) {
+    return;
+  }
+  slot.src = roi;
+  slot.dst = { 0, 0, model_width_, model_height_ };
+  region_frames_++;
+}
+
+void Tflow::selectBlobs(Tflow::Slot& slot) {
+
+  // the moving blobs are where the model looks, the whole frame when
+  // they are spread over too much of it
+  if (slot.blobs.empty()) {
+    return;
+  }
+  float x0 = width_, y0 = height_, x1 = 0.f, y1 = 0.f;
+  for (auto& b : slot.blobs) {
+    float mx = b.w * region_margin_;
+    float my = b.h * region_margin_;
+    x0 = fmin(x0, b.x - mx);
+    y0 = fmin(y0, b.y - my);
+    x1 = fmax(x1, b.x + b.w + mx);
+    y1 = fmax(y1, b.y + b.h + my);
+  }
+  Rect roi;
+  if (!fitRegion(x0, y0, x1, y1, roi)) {
+    return;
+  }
+  slot.src = roi;
+  slot.dst = { 0, 0, model_width_, model_height_ };
+  blob_frames_++;
+}
+
+bool Tflow::fitRegion(float x0, float y0, float x1, float y1, Rect& roi) {
+
+  if (x1 <= x0 || y1 <= y0) {
+    return false;
   }
 
-  return true;
+  // grow to the model's shape so nothing is stretched
+  float w = x1 - x0;
+  float h = y1 - y0;
+  if (w * model_height_ < h * model_width_) {
+    w = h * model_width_ / model_height_;
+  } else {
+    h = w * model_height_ / model_width_;
+  }
+  w = fmin(w, static_cast<float>(width_));
+  h = fmin(h, static_cast<float>(height_));
+  if (w * h > region_max_ * width_ * height_) {
+    return false;
+  }
+  float cx = fmin(fmax((x0 + x1) / 2.f, w / 2.f), width_ - w / 2.f);
+  float cy = fmin(fmax((y0 + y1) / 2.f, h / 2.f), height_ - h / 2.f);
+
+  // even pixels so i420 chroma lines up
+  roi.x = static_cast<unsigned int>(cx - w / 2.f) & ~1;
+  roi.y = static_cast<unsigned int>(cy - h / 2.f) & ~1;
+  roi.w = std::min(static_cast<unsigned int>(w) & ~1, width_ - roi.x);
+  roi.h = std::min(static_cast<unsigned int>(h) & ~1, height_ - roi.y);
+  return roi.w >= 2 && roi.h >= 2;
 }
 
-void Tflow::resize(std::unique_ptr<tflite::Interpreter>& interpreter,
-    uint8_t* out, uint8_t* in,
-    int image_height, int image_width, int image_channels, 
-    int wanted_height, int wanted_width, int wanted_channels, 
-    int yield) {
-
-  int number_of_pixels = image_height * image_width * image_channels;
+bool Tflow::lookup(Tflow::Slot& slot) {
 
-  // fill input image
-  // in[] are integers, cannot do memcpy() directly
-  auto input = interpreter->typed_tensor<float>(0);
-  for (int i = 0; i < number_of_pixels; i++) {
-    input[i] = in[i];
+  unsigned int dedup = dedup_;
+  if (dedup == 0) {
+    return false;
+  }
+  std::unique_lock<std::mutex> lck(cache_lock_);
+  for (auto it = cache_.begin(); it != cache_.end(); ++it) {
+    if (it->src.x != slot.src.x || it->src.y != slot.src.y ||
+        it->src.w != slot.src.w || it->src.h != slot.src.h ||
+        hash_distance(it->bits, slot.hash.bits) > hash_dist_ ||
+        slot.frame.stamp - it->stamp >= std::chrono::milliseconds(dedup)) {
+      continue;
+    }
+    slot.locs = it->locs;
+    slot.clas = it->clas;
+    slot.scor = it->scor;
+    slot.total = it->total;
+    std::rotate(cache_.begin(), it, it + 1);
+    cache_hits_++;
+    return true;
   }
+  return false;
+}
 
-  // fill new_sizes
-  interpreter->typed_tensor<int>(1)[0] = wanted_height;
-  interpreter->typed_tensor<int>(1)[1] = wanted_width;
+void Tflow::remember(const Tflow::Slot& slot) {
 
-//  std::this_thread::sleep_for(std::chrono::microseconds(yield));
-  interpreter->Invoke();
+  std::unique_lock<std::mutex> lck(cache_lock_);
+  if (cache_.size() < cache_max_) {
+    cache_.emplace_back();
+  }
+  std::rotate(cache_.begin(), cache_.end() - 1, cache_.end());
+  auto& c = cache_.front();
+  c.bits = slot.hash.bits;
+  c.src = slot.src;
+  c.stamp = slot.frame.stamp;
+  c.locs = slot.locs;
+  c.clas = slot.clas;
+  c.scor = slot.scor;
+  c.total = slot.total;
+}
 
-  auto output = interpreter->typed_tensor<float>(2);
-  auto output_number_of_pixels = wanted_height * wanted_width * wanted_channels;
+void Tflow::watchCamera(const FrameHash& hash, std::chrono::steady_clock::time_point stamp) {
 
-  for (int i = 0; i < output_number_of_pixels; i++) {
-    out[i] = (uint8_t)output[i];
+  Tflow::Camera now = (hash.sum == last_sum_) ? Tflow::Camera::kFrozen :
+    (hash.spread <= covered_spread_) ? Tflow::Camera::kCovered : Tflow::Camera::kOk;
+  last_sum_ = hash.sum;
+  if (now != camera_seen_) {
+    camera_seen_ = now;
+    camera_since_ = stamp;
+  }
+  if (camera_seen_ != camera_ &&
+      stamp - camera_since_ >= std::chrono::milliseconds(camera_ms_)) {
+    camera_ = camera_seen_;
+    if (!quiet_) {
+      const char* what[] = { "ok again", "frozen", "covered" };
+      fprintf(stderr, "\ncamera %s\n", what[static_cast<int>(camera_seen_)]);
+    }
   }
 }
 
-bool Tflow::prep() {
+bool Tflow::prep(Tflow::Slot& slot) {
 
-//  std::this_thread::sleep_for(std::chrono::microseconds(yield_time_));
+  Trace::Scope trace(Trace::Hop::kPrep, slot.frame.stamp, slot.frame.id);
+  PROBE_SCOPE(prep, probe_us(slot.frame.stamp), slot.frame.id, model_width_, model_height_);
+  Perf::Scope perf(Perf::Site::kPrep);
+  Pool::Due due(slot.frame.deadline);
   differ_prep_.begin();
-  int input = model_interpreter_->inputs()[0];
-  if (model_interpreter_->tensor(input)->type == kTfLiteUInt8) {
-    resize(resize_interpreter_,
-        model_interpreter_->typed_tensor<uint8_t>(input), frame_.buf.data(), 
-        height_, width_, channels_,
-        model_height_, model_width_, model_channels_, 
-        yield_time_);
-  } else {
-    dbgMsg("unrecognized output\n");
+  selectRegion(slot);
+
+  // a frame close enough to one just evaluated takes its results
+  slot.cached = slot.tiles == 1 && lookup(slot);
+  if (!slot.cached) {
+
+    // start from the smallest level someone already made that still has
+    // the detail the model sees
+    unsigned int k = slot.frame.levels ?
+      slot.frame.levels->find(slot.src, slot.dst.w, slot.dst.h) : 0;
+    const Level* isp = slot.frame.scaled.get();
+    if (slot.view >= 0) {
+
+      // a fisheye view, straight from the frame through its table
+      dewarp_->apply(slot.view, slot.frame.addr, frame_stride_, ALIGN_16B(height_),
+          slot.rgb.data());
+      view_cnt_++;
+    } else if (isp && isp->width == model_width_ && isp->height == model_height_ &&
+        slot.dst.w == model_width_ && slot.dst.h == model_height_ &&
+        slot.src.x == 0 && slot.src.y == 0 && slot.src.w == width_ && slot.src.h == height_) {
+
+      // the isp already made the model input of the whole frame
+      for (unsigned int y = 0; y < model_height_; y++) {
+        memcpy(slot.rgb.data() + y * model_width_ * 3, isp->addr + y * isp->stride,
+            model_width_ * 3);
+      }
+      scaled_cnt_++;
+    } else if (gles_ && gles_->scale(slot.frame, frame_stride_, ALIGN_16B(height_),
+          slot.src, slot.rgb.data(), model_width_, model_height_, slot.dst, fill_)) {
+
+      // the gpu made it, unless another prep thread has it
+    } else if (k > 0) {
+      const Level* lvl = slot.frame.levels->get(k);
+      Rect src = { (slot.src.x >> k) & ~1u, (slot.src.y >> k) & ~1u,
+        (slot.src.w >> k) & ~1u, (slot.src.h >> k) & ~1u };
+      src.w = std::min(src.w, lvl->width - src.x);
+      src.h = std::min(src.h, lvl->height - src.y);
+      scaler_(lvl->addr, lvl->stride, lvl->slice,
+          src, slot.rgb.data(), model_width_, model_height_, slot.dst, fill_);
+    } else {
+      scaler_(slot.frame.addr, frame_stride_, ALIGN_16B(height_),
+          slot.src, slot.rgb.data(), model_width_, model_height_, slot.dst, fill_);
+    }
   }
   differ_prep_.end();
 
@@ -269,140 +1779,909 @@ bool Tflow::prep() {
         dbgMsg("  writing resized - fmt:rgb24 len:%d\n",
             model_height_ * model_width_ * model_channels_);
 #endif
-        fwrite(model_interpreter_->typed_tensor<uint8_t>(input), 1, 
-            model_height_ * model_width_ * model_channels_, fd);
+        fwrite(slot.rgb.data(), 1, slot.rgb.size(), fd);
         fclose(fd);
 
-        sprintf(buf, "./frm_%dx%d_fullsize.rgb24", width_, height_);
+        sprintf(buf, "./frm_%dx%d_fullsize.%s", width_, height_, 
+            PixelFormatToStr(pix_fmt_));
         fd = fopen(buf, "wb");
         if (fd == nullptr) {
           dbgMsg("failed: open full frame file\n");
         }
 #ifdef OUTPUT_VARIOUS_BITS_OF_INFO
-        dbgMsg("  writing fullsize - fmt:rgb24 len:%d\n",
-            height_ * width_ * channels_);
+        dbgMsg("  writing fullsize - fmt:%s len:%d\n",
+            PixelFormatToStr(pix_fmt_), frame_len_);
 #endif
-        fwrite(frame_.buf.data(), 1, 
-            height_ * width_ * channels_, fd);
+        fwrite(slot.frame.addr, 1, frame_len_, fd);
         fclose(fd);
       }
     }
 #endif
 
+  // done with the pixels, let capture have the buffer back
+  slot.frame.scaled.reset();
+  if (snap_ && snap_->wanted()) {
+    slot.snap = slot.frame;
+  }
+  if (classify_ || embed_) {
+    slot.crop = slot.frame;
+  }
+  slot.frame.ref.reset();
+  slot.frame.addr = nullptr;
+
   return true;
 }
 
-bool Tflow::eval() {
-  differ_eval_.begin();
-  if (model_interpreter_->Invoke() != kTfLiteOk) {
+unsigned int Tflow::mapX(Tflow::Slot& slot, float x) {
+  float pos = x * model_width_ - slot.dst.x;
+  pos = slot.src.x + pos * slot.src.w / slot.dst.w;
+  return round(fmin(fmax(pos, 0.f), static_cast<float>(width_)));
+}
+
+unsigned int Tflow::mapY(Tflow::Slot& slot, float y) {
+  float pos = y * model_height_ - slot.dst.y;
+  pos = slot.src.y + pos * slot.src.h / slot.dst.h;
+  return round(fmin(fmax(pos, 0.f), static_cast<float>(height_)));
+}
+
+const char* Tflow::delegateStr(Tflow::Delegate d) {
+  switch (d) {
+    case Tflow::Delegate::kAuto:    return "auto";
+    case Tflow::Delegate::kCpu:     return "cpu";
+    case Tflow::Delegate::kXnnpack: return "xnnpack";
+    case Tflow::Delegate::kGpu:     return "gpu";
+  }
+  return "unknown";
+}
+
+// null when the delegate isn't built in
+static std::unique_ptr<TfLiteDelegate, void (*)(TfLiteDelegate*)> makeDelegate(
+    Tflow::Delegate kind, unsigned int threads) {
+
+#ifdef HAVE_XNNPACK
+  if (kind == Tflow::Delegate::kXnnpack) {
+    TfLiteXNNPackDelegateOptions opts = TfLiteXNNPackDelegateOptionsDefault();
+    opts.num_threads = threads;
+    return { TfLiteXNNPackDelegateCreate(&opts), TfLiteXNNPackDelegateDelete };
+  }
+#endif
+#ifdef HAVE_GPU_DELEGATE
+  if (kind == Tflow::Delegate::kGpu) {
+    TfLiteGpuDelegateOptionsV2 opts = TfLiteGpuDelegateOptionsV2Default();
+    opts.experimental_flags |= TFLITE_GPU_EXPERIMENTAL_FLAGS_ENABLE_QUANT;
+    opts.inference_priority1 = TFLITE_GPU_INFERENCE_PRIORITY_MIN_LATENCY;
+    return { TfLiteGpuDelegateV2Create(&opts), TfLiteGpuDelegateV2Delete };
+  }
+#endif
+  return { nullptr, [](TfLiteDelegate*) {} };
+}
+
+std::unique_ptr<Tflow::Engine> Tflow::makeEngine(tflite::FlatBufferModel& model,
+    std::shared_ptr<edgetpu::EdgeTpuContext> context, unsigned int threads,
+    Tflow::Delegate kind) {
+
+  auto eng = std::make_unique<Tflow::Engine>();
+  eng->context = context;
+  if (context) {
+    eng->share = TpuShare::get(context.get());
+    eng->model = &model;
+  }
+  eng->kind = context ? Tflow::Delegate::kCpu : kind;
+
+  tflite::ops::builtin::BuiltinOpResolver resolver;
+  if (context) {
+    resolver.AddCustom(edgetpu::kCustomOp, edgetpu::RegisterCustomOp());
+  }
+  tflite::InterpreterBuilder builder(model, resolver);
+  if (builder(&eng->interpreter) != kTfLiteOk || !eng->interpreter) {
+    eng->interpreter.reset();
+    return eng;
+  }
+  if (context) {
+    eng->interpreter->SetExternalContext(kTfLiteEdgeTpuContext, context.get());
+  } else {
+    eng->interpreter->UseNNAPI(false);
+  }
+  eng->interpreter->SetNumThreads(threads);
+
+  // a delegate that won't take the graph leaves it to the builtin kernels
+  if (eng->kind != Tflow::Delegate::kCpu) {
+    eng->delegate = makeDelegate(eng->kind, threads);
+    if (!eng->delegate ||
+        eng->interpreter->ModifyGraphWithDelegate(eng->delegate.get()) != kTfLiteOk) {
+      dbgMsg("failed: %s delegate, using the cpu\n", delegateStr(eng->kind));
+      eng->interpreter.reset();
+      return makeEngine(model, nullptr, threads, Tflow::Delegate::kCpu);
+    }
+  }
+  {
+    Startup::Scope step("allocate tensors");
+    eng->interpreter->AllocateTensors();
+  }
+
+  return eng;
+}
+
+// a few invokes on each delegate built in, the fastest runs the engines
+Tflow::Delegate Tflow::pick(tflite::FlatBufferModel& model, unsigned int threads) {
+
+  std::vector<Tflow::Delegate> kinds = { Tflow::Delegate::kCpu };
+#ifdef HAVE_XNNPACK
+  kinds.push_back(Tflow::Delegate::kXnnpack);
+#endif
+#ifdef HAVE_GPU_DELEGATE
+  kinds.push_back(Tflow::Delegate::kGpu);
+#endif
+  if (kinds.size() == 1) {
+    return Tflow::Delegate::kCpu;
+  }
+
+  using namespace std::chrono;
+  Tflow::Delegate best = Tflow::Delegate::kCpu;
+  int64_t best_us = -1;
+  std::string times;
+  for (auto kind : kinds) {
+    auto eng = makeEngine(model, nullptr, threads, kind);
+    if (!eng->interpreter || eng->kind != kind) {
+      continue;
+    }
+    TfLiteTensor* in = eng->interpreter->tensor(eng->interpreter->inputs()[0]);
+    std::memset(in->data.raw, 0, in->bytes);
+    bool ok = eng->interpreter->Invoke() == kTfLiteOk;   // sets itself up
+    auto begin = steady_clock::now();
+    for (unsigned int i = 0; ok && i < pick_runs_; i++) {
+      ok = eng->interpreter->Invoke() == kTfLiteOk;
+    }
+    if (!ok) {
+      continue;
+    }
+    int64_t us = duration_cast<microseconds>(steady_clock::now() - begin).count() / pick_runs_;
+    times += std::string(times.empty() ? "" : ", ") + delegateStr(kind) + " " +
+      std::to_string(us / 1000) + " ms";
+    if (best_us < 0 || us < best_us) {
+      best = kind;
+      best_us = us;
+    }
+  }
+  if (!quiet_) {
+    fprintf(stderr, "\ntflow: %s, using %s\n", times.c_str(), delegateStr(best));
+  }
+  return best;
+}
+
+bool Tflow::eval(Tflow::Engine& eng, Tflow::Slot& slot) {
+  Trace::Scope trace(Trace::Hop::kEval, slot.frame.stamp, slot.frame.id);
+  PROBE_SCOPE(eval, probe_us(slot.frame.stamp), slot.frame.id, eng.lane);
+  Perf::Scope perf(Perf::Site::kEval);
+  eng.differ_eval.begin();
+  if (eng.worker) {
+    return evalWorker(eng, slot);
+  }
+  auto& interpreter = eng.interpreter;
+  int input = interpreter->inputs()[0];
+  if (input_type_ == kTfLiteUInt8) {
+    std::memcpy(interpreter->typed_tensor<uint8_t>(input), 
+        slot.rgb.data(), slot.rgb.size());
+  } else {
+    quantise_rgb24(slot.rgb.data(), interpreter->typed_tensor<float>(input),
+        slot.rgb.size(), in_scale_, in_zero_);
+  }
+  if (eng.share) {
+    eng.share->begin(eng.model);
+  }
+  if (interpreter->Invoke() != kTfLiteOk) {
     dbgMsg("failed invoke\n");
   }
-  differ_eval_.end();
+  if (eng.share) {
+    eng.share->end();
+  }
+
+  // too late if the watch on the engines already gave up on us
+  int64_t began = eng.busy;
+  if (began != 0 && !eng.busy.compare_exchange_strong(began, 0)) {
+    return false;
+  }
+
+  // keep the results, the next invoke overwrites the tensors
+  const std::vector<int>& res = interpreter->outputs();
+  std::memcpy(slot.locs.data(), 
+      tflite::GetTensorData<float>(interpreter->tensor(res[0])),
+      slot.locs.size() * sizeof(float));
+  std::memcpy(slot.clas.data(), 
+      tflite::GetTensorData<float>(interpreter->tensor(res[1])),
+      slot.clas.size() * sizeof(float));
+  std::memcpy(slot.scor.data(), 
+      tflite::GetTensorData<float>(interpreter->tensor(res[2])),
+      slot.scor.size() * sizeof(float));
+  slot.total = *tflite::GetTensorData<float>(interpreter->tensor(res[3]));
+  eng.differ_eval.end();
+  eng.eval_avg = eng.differ_eval.avg;
   return true;
 }
 
-bool Tflow::post(bool report) {
+// a worker that's down or missed lets the frame through with nothing found,
+// rather than hold the others back or try it again on a worker that isn't up
+bool Tflow::evalWorker(Tflow::Engine& eng, Tflow::Slot& slot) {
+  bool ok = eng.worker->infer(eng.lane, slot.rgb.data(), slot.rgb.size(),
+      slot.locs.data(), slot.clas.data(), slot.scor.data(), slot.total);
 
-  differ_post_.begin();
-  
-  auto boxes = std::make_shared<std::vector<BoxBuf>>();
+  int64_t began = eng.busy;
+  if (began != 0 && !eng.busy.compare_exchange_strong(began, 0)) {
+    return false;
+  }
+  if (!ok) {
+    std::fill(slot.scor.begin(), slot.scor.end(), 0.f);
+    slot.total = 0.f;
+    slot.missed = true;
+    worker_miss_cnt_++;
+    return true;
+  }
+  eng.differ_eval.end();
+  eng.eval_avg = eng.differ_eval.avg;
+  return true;
+}
 
-  const std::vector<int>& res = model_interpreter_->outputs();
-  float* locs = tflite::GetTensorData<float>(model_interpreter_->tensor(res[0]));
-  float* clas = tflite::GetTensorData<float>(model_interpreter_->tensor(res[1]));
-  float* scor = tflite::GetTensorData<float>(model_interpreter_->tensor(res[2]));
-#if DEBUG_MESSAGES
-  float* tot  = tflite::GetTensorData<float>(model_interpreter_->tensor(res[3]));
-  dbgMsg("total results: %d\n", static_cast<unsigned int>(tot[0]));
-#endif
-  for (unsigned int i = 0; i < result_num_; i++, locs += 4) {
+// class aware nms, a box over 'iou' with a better one of its class goes
+static void suppress(std::vector<BoxBuf>& boxes, float iou) {
+  std::stable_sort(boxes.begin(), boxes.end(),
+      [](const BoxBuf& a, const BoxBuf& b) { return a.score > b.score; });
+  std::vector<BoxBuf> kept;
+  for (auto& box : boxes) {
+    bool dup = false;
+    for (auto& k : kept) {
+      if (k.cls != box.cls) {
+        continue;
+      }
+      int iw = static_cast<int>(std::min(k.x + k.w, box.x + box.w)) -
+        static_cast<int>(std::max(k.x, box.x));
+      int ih = static_cast<int>(std::min(k.y + k.h, box.y + box.h)) -
+        static_cast<int>(std::max(k.y, box.y));
+      if (iw <= 0 || ih <= 0) {
+        continue;
+      }
+      float inter = static_cast<float>(iw) * ih;
+      if (inter >= iou * (static_cast<float>(k.w) * k.h + static_cast<float>(box.w) * box.h - inter)) {
+        dup = true;
+        break;
+      }
+    }
+    if (!dup) {
+      kept.push_back(box);
+    }
+  }
+  boxes.swap(kept);
+}
 
-    unsigned int class_id = static_cast<unsigned int>(clas[i]);
+// the same object seen by the whole frame and a tile, or by two tiles,
+// keeps its best box: one mostly inside a better one of its type goes
+static void mergeTiles(std::vector<BoxBuf>& boxes, float overlap) {
+  std::stable_sort(boxes.begin(), boxes.end(),
+      [](const BoxBuf& a, const BoxBuf& b) { return a.score > b.score; });
+  std::vector<BoxBuf> kept;
+  for (auto& box : boxes) {
+    bool dup = false;
+    for (auto& k : kept) {
+      if (k.type != box.type) {
+        continue;
+      }
+      int iw = static_cast<int>(std::min(k.x + k.w, box.x + box.w)) -
+        static_cast<int>(std::max(k.x, box.x));
+      int ih = static_cast<int>(std::min(k.y + k.h, box.y + box.h)) -
+        static_cast<int>(std::max(k.y, box.y));
+      if (iw > 0 && ih > 0 && static_cast<float>(iw) * ih >=
+          overlap * std::min(k.w * k.h, box.w * box.h)) {
+        dup = true;
+        break;
+      }
+    }
+    if (!dup) {
+      kept.push_back(box);
+    }
+  }
+  boxes.swap(kept);
+}
 
-    auto it = label_pairs_.find(class_id);
-    if ( it != label_pairs_.end()) {
-      if (scor[i] >= threshold_ && scor[i] <= 1.f) {
+bool Tflow::post(Tflow::Slot& slot, bool report) {
 
-        // clamp
-        float top    = fmin(fmax(locs[0], 0.f), 1.f);
-        float left   = fmin(fmax(locs[1], 0.f), 1.f);
-        float bottom = fmin(fmax(locs[2], 0.f), 1.f);
-        float right  = fmin(fmax(locs[3], 0.f), 1.f);
+  Trace::Scope trace(Trace::Hop::kPost, slot.frame.stamp, slot.frame.id);
+  PROBE_SCOPE(post, probe_us(slot.frame.stamp), slot.frame.id,
+      static_cast<int>(slot.total));
+  differ_post_.begin();
+  Startup::ready(Startup::kInference);
+  
+  // low score boxes only help the tracker keep its tracks
+  auto boxes = box_pool_.get();
+  auto scored = (low_threshold_ < threshold_) ? box_pool_.get() : boxes;
+
+  float* locs = slot.locs.data();
+  float* clas = slot.clas.data();
+  float* scor = slot.scor.data();
+  dbgMsg("total results: %d\n", static_cast<unsigned int>(slot.total));
+  float threshold = threshold_;
+  float low_threshold = low_threshold_;
+  unsigned int num = std::min(static_cast<unsigned int>(fmax(slot.total, 0.f)), result_num_);
+  unsigned int classes = classes_.size();
+  for (unsigned int i = 0; i < num; i++, locs += 4) {
 
-        if (top < bottom) {
-          if (left < right) {
+    unsigned int class_id = static_cast<unsigned int>(clas[i]);
+    if (class_id >= classes || !classes_[class_id].keep) {
+      continue;
+    }
+    const Tflow::Class& cls = classes_[class_id];
+    float high_thresh = (cls.threshold > 0.f) ? cls.threshold : threshold;
+    float low_thresh = std::min(low_threshold, high_thresh);
+    if (scor[i] < low_thresh || scor[i] > 1.f) {
+      continue;
+    }
+    bool high = scor[i] >= high_thresh;
+
+    // clamp
+    float top    = fmin(fmax(locs[0], 0.f), 1.f);
+    float left   = fmin(fmax(locs[1], 0.f), 1.f);
+    float bottom = fmin(fmax(locs[2], 0.f), 1.f);
+    float right  = fmin(fmax(locs[3], 0.f), 1.f);
+    if (top >= bottom || left >= right) {
+      continue;
+    }
 
 #if DEBUG_MESSAGES
-            dbgMsg("t:%f,l:%f,b:%f,r:%f, scor:%f, class:%d (%s)\n",
-                top, left, bottom, right, scor[i], class_id, label_pairs_[class_id].first.c_str());
+    dbgMsg("t:%f,l:%f,b:%f,r:%f, scor:%f, class:%d (%s)\n",
+        top, left, bottom, right, scor[i], class_id, Names::get(cls.name));
 #else
-            if (report && !quiet_) {
-              fprintf(stderr, "<%s>", label_pairs_[class_id].first.c_str());
-              fflush(stderr);
-            }
+    if (high && report && !quiet_) {
+      fprintf(stderr, "<%s>", Names::get(cls.name));
+      fflush(stderr);
+    }
 #endif
-            unsigned int top_uint    = round(top    * height_);
-            unsigned int bottom_uint = round(bottom * height_);
-            unsigned int left_uint   = round(left   * width_);
-            unsigned int right_uint  = round(right  * width_);
-
-            unsigned int width_uint  = right_uint  - left_uint;
-            unsigned int height_uint = bottom_uint - top_uint;
-
-            BoxBuf::Type btype = label_pairs_[class_id].second;
-            boxes->push_back(BoxBuf(
-                btype, frame_.id, left_uint, top_uint, width_uint, height_uint));
-          }
+    // model input back to the frame
+    unsigned int top_uint    = mapY(slot, top);
+    unsigned int bottom_uint = mapY(slot, bottom);
+    unsigned int left_uint   = mapX(slot, left);
+    unsigned int right_uint  = mapX(slot, right);
+    Rect seen;
+    if (slot.view >= 0) {
+      if (!dewarp_->bound(slot.view, left, top, right, bottom, seen)) {
+        continue;
+      }
+      left_uint = seen.x;
+      top_uint = seen.y;
+      right_uint = seen.x + seen.w;
+      bottom_uint = seen.y + seen.h;
+    }
+    if (top_uint >= bottom_uint || left_uint >= right_uint) {
+      continue;
+    }
+
+    BoxBuf box(cls.type, slot.frame.id, left_uint, top_uint, right_uint - left_uint,
+        bottom_uint - top_uint, slot.frame.stamp, scor[i]);
+    box.cls = cls.name;
+    if (high) {
+      boxes->push_back(box);
+    }
+    if (scored != boxes) {
+      scored->push_back(box);
+    }
+  }
+  if (nms_ > 0.f) {
+    suppress(*boxes, nms_);
+    if (scored != boxes) {
+      suppress(*scored, nms_);
+    }
+  }
+  if (max_dets_ && boxes->size() > max_dets_) {
+    boxes->resize(max_dets_);
+  }
+
+  // a frame's tiles come in one after the other, the last posts them all
+  if (slot.tiles > 1) {
+    if (tile_boxes_ && tile_group_ == slot.frame.id) {
+      tile_boxes_->insert(tile_boxes_->end(), boxes->begin(), boxes->end());
+      if (scored != boxes) {
+        tile_scored_->insert(tile_scored_->end(), scored->begin(), scored->end());
+        scored = tile_scored_;
+      } else {
+        scored = tile_boxes_;
+      }
+      boxes = tile_boxes_;
+    }
+    tile_boxes_.reset();
+    tile_scored_.reset();
+    if (!slot.last) {
+      tile_boxes_ = boxes;
+      tile_scored_ = scored;
+      tile_group_ = slot.frame.id;
+      slot.snap = FrameBuf();
+      slot.crop = FrameBuf();
+      differ_post_.end();
+      return true;
+    }
+    mergeTiles(*boxes, tile_merge_);
+    if (scored != boxes) {
+      mergeTiles(*scored, tile_merge_);
+    }
+  }
+
+  if (embed_ && trk_ && trk_->wantsEmbeddings()) {
+    embed_->run(slot.crop, *scored);
+  }
+  if (classify_) {
+
+    // fewer crops while other frames' results wait behind this one
+    unsigned int waiting = post_chan_.size();
+    unsigned int most = credit_any;
+    if (waiting != 0 && boxes->size() > 1) {
+      most = std::max<unsigned int>(1, boxes->size() >> waiting);
+      crop_cut_cnt_ += (most < boxes->size()) ? 1 : 0;
+    }
+    classify_->run(slot.crop, *boxes, most);
+    if (report && !quiet_) {
+      for (auto& box : *boxes) {
+        if (box.attr >= 0) {
+          fprintf(stderr, "<%s>", Names::get(box.attr));
         }
       }
     }
   }
+  slot.crop = FrameBuf();
 
   // send boxes if new
-  if (post_id_ <= frame_.id) {
+  if (post_id_ <= slot.frame.id) {
+    if (!boxes->empty()) {
+      active_ms_ = since_start_ms();
+    }
     if (enc_) {
-      if (!enc_->addMessage(boxes)) {
+      if (!enc_->addMessage(boxes, slot.frame.stamp)) {
         dbgMsg("encoder busy\n");
       }
     }
     if (trk_) {
-      if (!trk_->addMessage(boxes)) {
+      if (!trk_->addMessage(scored)) {
         dbgMsg("tracker busy\n");
       }
     }
-    post_id_ = frame_.id;
+    if (snap_) {
+      if (!snap_->addMessage(slot.snap, boxes)) {
+        dbgMsg("snapshot busy\n");
+      }
+    }
+    if (pub_) {
+      pub_->addMessage(boxes);
+    }
+    if (evt_) {
+      evt_->addMessage(boxes);
+    }
+    if (jnl_) {
+      jnl_->addMessage(boxes);
+    }
+    if (tap_) {
+      tap_->addMessage(boxes);
+    }
+    post_id_ = slot.frame.id;
+    if (first_ms_ < 0) {
+      first_ms_ = since_start_ms();
+    }
   }
+  slot.snap = FrameBuf();
   differ_post_.end();
 
+  // capture to detection
+  differ_late_.begin(slot.frame.stamp);
+  differ_late_.end();
+  Fate::reach(Fate::kInferred, slot.frame.stamp);
+
   return true;
 }
 
-bool Tflow::oneRun(bool report) {
+bool Tflow::dispatch(unsigned int& idx, uint64_t& seq) {
 
-  if (!tflow_empty_) {
+  std::unique_lock<std::mutex> lck(dispatch_lock_);
 
-    // prepare image
-    prep();
-    std::this_thread::sleep_for(std::chrono::microseconds(yield_time_));
+  // one the peer missed keeps its place in line
+  std::pair<unsigned int, uint64_t> back;
+  if (again_chan_.pop(back)) {
+    idx = back.first;
+    seq = back.second;
+    return true;
+  }
 
-    // evaluate image
-    eval();
-    std::this_thread::sleep_for(std::chrono::microseconds(yield_time_));
+  if (held_ >= 0) {
+    idx = held_;
+    held_ = -1;
+  } else if (!eval_chan_.pop(idx)) {
+    due_order_ = INT64_MAX;
+    return false;
+  }
+
+  // only the newest prepped frame is worth evaluating, but all of its
+  // tiles and all of one already started on
+  unsigned int newer;
+  while (slots_[idx].frame.id != dispatch_id_ && eval_chan_.pop(newer)) {
+    if (slots_[newer].frame.id == slots_[idx].frame.id) {
+      held_ = newer;
+      break;
+    }
+    free_chan_.push(idx);
+    wake();
+    stale_cnt_++;
+    Fate::drop(Fate::Site::kTflowStale, slots_[idx].frame.stamp);
+    idx = newer;
+  }
+
+  // a frame not started on that can't be evaluated in time makes way
+  if (slots_[idx].frame.id != dispatch_id_ && held_ < 0 &&
+      tooLate(slots_[idx], eval_us_)) {
+    free_chan_.push(idx);
+    wake();
+    if (!eval_chan_.pop(idx)) {
+      due_order_ = INT64_MAX;
+      return false;
+    }
+  }
+  dispatch_id_ = slots_[idx].frame.id;
+
+  // results are posted in dispatch order
+  seq = eval_seq_++;
+  return true;
+}
+
+void Tflow::evalProc(Tflow::Engine* eng) {
+  while (tflow_on_) {
+    idle_engines_++;
+    eval_sem_.wait_for(yield_time_);
+    idle_engines_--;
+
+    // our frames and our guests' first, then what peers sent
+    Tflow* src;
+    unsigned int idx;
+    uint64_t seq;
+    std::shared_ptr<PeerJob> job;
+    while (true) {
+      if (next(src, idx, seq)) {
+        int64_t began = std::chrono::steady_clock::now().time_since_epoch().count();
+        eng->owner = src;
+        eng->seq = seq;
+        eng->busy = began;
+        if (!src->eval(*eng, src->slots_[idx])) {
+          return;   // given up on, nothing here is ours any more
+        }
+        src->evaluated(idx, seq);
+        if (src != this) {
+          src->lent_--;
+        }
+      } else if (serve_chan_.pop(job)) {
+        evalJob(*eng, *job);
+        job.reset();
+      } else {
+        break;
+      }
+    }
+  }
+}
+
+void Tflow::again(unsigned int idx, uint64_t seq) {
+  std::pair<unsigned int, uint64_t> back(idx, seq);
+  again_chan_.push(back);
+  (host_ ? host_->eval_sem_ : eval_sem_).post();
+}
+
+void Tflow::evalJob(Tflow::Engine& eng, PeerJob& job) {
+  if (eng.worker) {
+    job.locs.resize(result_num_ * 4);
+    job.clas.resize(result_num_);
+    job.scor.resize(result_num_);
+    float total = 0.f;
+    job.ok = job.rgb.size() == model_width_ * model_height_ * model_channels_ &&
+      eng.worker->infer(eng.lane, job.rgb.data(), job.rgb.size(), job.locs.data(),
+          job.clas.data(), job.scor.data(), total);
+    job.total = total;
+    served_cnt_ += job.ok ? 1 : 0;
+    job.done.post();
+    return;
+  }
+  auto& interpreter = eng.interpreter;
+  int input = interpreter->inputs()[0];
+
+  // a model swapped in since it was taken may not fit it
+  size_t want = job.rgb.size() * ((input_type_ == kTfLiteUInt8) ? 1 : sizeof(float));
+  if (interpreter->tensor(input)->bytes != want) {
+    job.done.post();
+    return;
+  }
+  if (input_type_ == kTfLiteUInt8) {
+    std::memcpy(interpreter->typed_tensor<uint8_t>(input), job.rgb.data(), job.rgb.size());
+  } else {
+    quantise_rgb24(job.rgb.data(), interpreter->typed_tensor<float>(input),
+        job.rgb.size(), in_scale_, in_zero_);
+  }
+  if (eng.share) {
+    eng.share->begin(eng.model);
+  }
+  bool ok = interpreter->Invoke() == kTfLiteOk;
+  if (eng.share) {
+    eng.share->end();
+  }
+  if (!ok) {
+    dbgMsg("failed invoke for a peer\n");
+    job.done.post();
+    return;
+  }
+  const std::vector<int>& res = interpreter->outputs();
+  const float* locs = tflite::GetTensorData<float>(interpreter->tensor(res[0]));
+  const float* clas = tflite::GetTensorData<float>(interpreter->tensor(res[1]));
+  const float* scor = tflite::GetTensorData<float>(interpreter->tensor(res[2]));
+  job.locs.assign(locs, locs + result_num_ * 4);
+  job.clas.assign(clas, clas + result_num_);
+  job.scor.assign(scor, scor + result_num_);
+  job.total = *tflite::GetTensorData<float>(interpreter->tensor(res[3]));
+  served_cnt_++;
+  job.ok = true;
+  job.done.post();
+}
 
-    // post image
-    post(report);
+// an extra engine that runs on the peer, only while ours are all busy
+void Tflow::peerProc() {
+  while (tflow_on_) {
     std::this_thread::sleep_for(std::chrono::microseconds(yield_time_));
+    if (!peer_->ready()) {
+      continue;
+    }
+
+    Tflow* src;
+    unsigned int idx;
+    uint64_t seq;
+    while (tflow_on_ && idle_engines_ == 0 && next(src, idx, seq)) {
+      Tflow::Slot& slot = src->slots_[idx];
+      differ_peer_.begin();
+      bool ok = peer_->infer(slot.rgb.data(), slot.rgb.size(), model_width_, model_height_,
+          model_channels_, slot.locs, slot.clas, slot.scor, slot.total, peer_deadline_);
+      if (ok) {
+        differ_peer_.end();
+        peer_cnt_++;
+        src->evaluated(idx, seq);
+      } else {
+        peer_miss_cnt_++;
+        src->again(idx, seq);
+      }
+      if (src != this) {
+        src->lent_--;
+      }
+      if (!ok) {
+        break;
+      }
+    }
+  }
+}
+
+void Tflow::peerProc0(Tflow* self) {
+  self->peerProc();
+}
 
-    tflow_empty_ = true;
+// the next slot of this tflow or a guest, the one due first and otherwise
+// each in turn
+bool Tflow::next(Tflow*& src, unsigned int& idx, uint64_t& seq) {
+
+  std::unique_lock<std::mutex> lck(guest_lock_);
+  unsigned int num = guests_.size() + 1;
+  std::vector<std::pair<int64_t, unsigned int>> order;
+  order.reserve(num);
+  for (unsigned int k = 0; k < num; k++) {
+    unsigned int at = (turn_ + k) % num;
+    Tflow* t = (at == 0) ? this : guests_[at - 1];
+    order.emplace_back(t->due_order_.load(), at);
   }
+  std::stable_sort(order.begin(), order.end(),
+      [](const std::pair<int64_t, unsigned int>& a, const std::pair<int64_t, unsigned int>& b) {
+        return a.first < b.first;
+      });
+  for (auto& o : order) {
+    unsigned int at = o.second;
+    Tflow* t = (at == 0) ? this : guests_[at - 1];
+    if ((t == this) ? dispatch(idx, seq) : t->lend(idx, seq)) {
+      turn_ = at + 1;
+      src = t;
+      return true;
+    }
+  }
+  return false;
+}
 
+// a guest's slot if its slots are made for the host's model as it is
+bool Tflow::lend(unsigned int& idx, uint64_t& seq) {
+  lent_++;
+  if (!tflow_on_ || host_gen_ != host_->model_gen_ || !dispatch(idx, seq)) {
+    lent_--;
+    return false;
+  }
   return true;
 }
 
+void Tflow::evaluated(unsigned int idx, uint64_t seq) {
+  if (first_eval_ms_ < 0) {
+    int none = -1;
+    first_eval_ms_.compare_exchange_strong(none, 
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - run_begin_).count());
+  }
+  if (dedup_ && !slots_[idx].missed) {
+    remember(slots_[idx]);
+  }
+  slots_[idx].missed = false;
+  slots_[idx].seq = seq;
+  post_chan_.push(idx);
+  post_sem_.post();
+}
+
+void Tflow::evalProc0(Tflow* self, Tflow::Engine* eng) {
+  self->evalProc(eng);
+}
+
+void Tflow::deliver(unsigned int idx, bool report) {
+
+  // hold results that finished ahead of an earlier frame
+  pending_[slots_[idx].seq] = idx;
+  uint64_t skip;
+  while (skip_chan_.pop(skip)) {
+    skipped_.insert(skip);
+  }
+  while (true) {
+    if (pending_.size() != 0 && pending_.begin()->first == post_seq_) {
+      unsigned int next = pending_.begin()->second;
+      pending_.erase(pending_.begin());
+      post(slots_[next], report);
+      free_chan_.push(next);
+      wake();
+    } else if (skipped_.erase(post_seq_) == 0) {
+      break;
+    }
+    post_seq_++;
+  }
+}
+
+void Tflow::postProc() {
+  while (tflow_on_) {
+    post_sem_.wait_for(yield_time_);
+
+    unsigned int idx;
+    while (post_chan_.pop(idx)) {
+      deliver(idx, true);
+    }
+  }
+}
+
+void Tflow::postProc0(Tflow* self) {
+  self->postProc();
+}
+
 bool Tflow::running() {
 
+  // a guest follows its host's model, and waits while there is none
+  if (host_) {
+    if (tflow_on_ && (host_gen_ != host_->model_gen_ || !host_->tflow_on_)) {
+      land();
+    }
+    if (!tflow_on_) {
+      if (!borrow()) {
+        FrameBuf frame;
+        while (frame_chan_.pop(frame)) {
+        }
+        return true;
+      }
+      launch();
+    }
+  }
+
   if (tflow_on_) {
-    return oneRun(true);
+
+    if (!swap()) {
+      return false;
+    }
+    reattach();
+    if (!family_.empty() && hung_run_ == 0 &&
+        std::chrono::steady_clock::now() - family_stamp_ >=
+        std::chrono::milliseconds(family_hold_)) {
+      int idx = pickSize();
+      if (idx >= 0) {
+        resize(idx);
+      }
+    }
+
+    // the motion gate goes by the encoder's vectors when it has them
+    MotionBuf map;
+    if (motion_ && vec_chan_.pop(map)) {
+      motion_->vectors(map);
+    }
+
+    // newest frame into the next free slot
+    unsigned int idx;
+    while (free_chan_.pop(idx)) {
+      if (!frame_chan_.pop(slots_[idx].frame)) {
+        free_chan_.push(idx);
+        break;
+      }
+      if (tooLate(slots_[idx], expected())) {
+        free_chan_.push(idx);
+        continue;
+      }
+      auto& frame = slots_[idx].frame;
+      slots_[idx].hash = hash_frame(frame.addr, frame_stride_, width_, height_,
+          frame_stride_ / ALIGN_16B(width_));
+      watchCamera(slots_[idx].hash, frame.stamp);
+      if (!schedule(slots_[idx].frame)) {
+        Fate::drop(Fate::Site::kTflowRate, slots_[idx].frame.stamp);
+        slots_[idx].frame.ref.reset();
+        slots_[idx].frame.addr = nullptr;
+        free_chan_.push(idx);
+        held_cnt_++;
+        continue;
+      }
+      if (motion_ && !motion_->changed(slots_[idx].frame)) {
+        Fate::drop(Fate::Site::kTflowStill, slots_[idx].frame.stamp);
+        slots_[idx].frame.ref.reset();
+        slots_[idx].frame.addr = nullptr;
+        free_chan_.push(idx);
+        still_cnt_++;
+        continue;
+      }
+      advance(slots_[idx].frame);
+      if (motion_) {
+        active_ms_ = since_start_ms();
+        slots_[idx].blobs = motion_->blobs();
+      }
+      if (screen_ && !tracking() && !screen_->fires(slots_[idx].frame)) {
+        Fate::drop(Fate::Site::kTflowScreened, slots_[idx].frame.stamp);
+        slots_[idx].frame.ref.reset();
+        slots_[idx].frame.addr = nullptr;
+        free_chan_.push(idx);
+        screened_cnt_++;
+        continue;
+      }
+
+      // the whole frame and the next few tiles or the fisheye views, as
+      // many as there are slots
+      std::vector<unsigned int> group = { idx };
+      unsigned int more;
+      for (unsigned int t = 0; t < tile_per_ && free_chan_.pop(more); t++) {
+        slots_[more].frame = slots_[idx].frame;
+        slots_[more].hash = slots_[idx].hash;
+        slots_[more].tile = tile_next_++ % tiles_.size();
+        slots_[more].view = -1;
+        group.push_back(more);
+      }
+      for (unsigned int v = 0; dewarp_ && v < dewarp_->views() && free_chan_.pop(more); v++) {
+        slots_[more].frame = slots_[idx].frame;
+        slots_[more].hash = slots_[idx].hash;
+        slots_[more].tile = -1;
+        slots_[more].view = v;
+        group.push_back(more);
+      }
+      slots_[idx].tile = -1;
+      slots_[idx].view = -1;
+      for (unsigned int i = 0; i < group.size(); i++) {
+        slots_[group[i]].tiles = group.size();
+        slots_[group[i]].last = i + 1 == group.size();
+      }
+      tile_frames_ += (group.size() > 1) ? 1 : 0;
+
+      for (auto i : group) {
+        prep(slots_[i]);
+
+        // cached results skip the engines but keep their place in line
+        if (slots_[i].cached) {
+          std::unique_lock<std::mutex> lck(dispatch_lock_);
+          slots_[i].seq = eval_seq_++;
+          post_chan_.push(i);
+          post_sem_.post();
+          continue;
+        }
+        due_order_ = Deadline::order(slots_[i].frame.deadline);
+        eval_chan_.push(i);
+        (host_ ? host_->eval_sem_ : eval_sem_).post();
+      }
+    }
+
+    if (!checkEngines()) {
+      return false;
+    }
   }
   return true;
 }
@@ -414,41 +2693,176 @@ bool Tflow::paused() {
 bool Tflow::waitingToHalt() {
 
   if (tflow_on_) {
-    tflow_on_ = false;
     differ_tot_.end();
+    land();
 
-    // finish processing
-    while (!tflow_empty_) {
-      oneRun(false);
+    // a model still loading is dropped, the newest ask is what the next
+    // run loads unless it was for the tpus that just went
+    if (loader_.joinable()) {
+      loader_.join();
+    }
+    swap_done_ = false;
+    {
+      std::unique_lock<std::mutex> lck(swap_lock_);
+      if (!swap_want_ && swap_ && swap_->ok && (tpu_ || !swap_->engines[0]->context)) {
+        swap_want_ = std::move(swap_);
+      }
+      swap_.reset();
+      if (swap_want_) {
+        swap_want_->engines.clear();
+        swap_want_->model.reset();
+      }
     }
 
-    // reset tensorflow ojects
-    model_interpreter_.reset();
-    resize_interpreter_.reset();
-    edgetpu_context_.reset();
-    model_.reset();
+    // let go of anything still queued
+    FrameBuf fbuf;
+    while (frame_chan_.pop(fbuf)) {
+    }
 
     // report
     if (!quiet_) {
       fprintf(stderr, "\nTflow Results...\n");
-      fprintf(stderr, "  image copy time (us): high:%u avg:%u low:%u cnt:%u\n", 
+      fprintf(stderr, "  image copy time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_copy_.pct(.5), differ_copy_.pct(.9), differ_copy_.pct(.99), differ_copy_.pct(.999),
           differ_copy_.high, differ_copy_.avg, 
           differ_copy_.low,  differ_copy_.cnt);
-      fprintf(stderr, "  image prep time (us): high:%u avg:%u low:%u cnt:%u\n", 
+      fprintf(stderr, "  image prep time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_prep_.pct(.5), differ_prep_.pct(.9), differ_prep_.pct(.99), differ_prep_.pct(.999),
           differ_prep_.high, differ_prep_.avg, 
           differ_prep_.low,  differ_prep_.cnt);
-      fprintf(stderr, "  image eval time (us): high:%u avg:%u low:%u cnt:%u\n", 
-          differ_eval_.high, differ_eval_.avg, 
-          differ_eval_.low,  differ_eval_.cnt);
-      fprintf(stderr, "  image post time (us): high:%u avg:%u low:%u cnt:%u\n", 
+      for (unsigned int i = 0; i < engines_.size(); i++) {
+        auto& differ_eval = engines_[i]->differ_eval;
+        fprintf(stderr, "  image eval time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u (engine %u, %s)\n", 
+            differ_eval.pct(.5), differ_eval.pct(.9), differ_eval.pct(.99), differ_eval.pct(.999),
+            differ_eval.high, differ_eval.avg, 
+            differ_eval.low,  differ_eval.cnt, i,
+            engines_[i]->worker ? (engines_[i]->worker->tpu() >= 0 ? "worker, edgetpu" : "worker") :
+            engines_[i]->context ? "edgetpu" : delegateStr(engines_[i]->kind));
+      }
+      fprintf(stderr, "  image post time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_post_.pct(.5), differ_post_.pct(.9), differ_post_.pct(.99), differ_post_.pct(.999),
           differ_post_.high, differ_post_.avg, 
           differ_post_.low,  differ_post_.cnt);
+      fprintf(stderr, "  image latency   (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_late_.pct(.5), differ_late_.pct(.9), differ_late_.pct(.99), differ_late_.pct(.999),
+          differ_late_.high, differ_late_.avg, 
+          differ_late_.low,  differ_late_.cnt);
+      if (rate_ > 0.f) {
+        fprintf(stderr, "           held frames: %u\n", held_cnt_);
+        fprintf(stderr, "      last temperature: %.1f C\n", temp_);
+      }
+      if (motion_) {
+        fprintf(stderr, "          still frames: %u\n", still_cnt_);
+      }
+      if (scaled_cnt_) {
+        fprintf(stderr, "     isp scaled frames: %u\n", scaled_cnt_);
+      }
+      if (!tiles_.empty()) {
+        fprintf(stderr, "           tile frames: %u, %u of %zu tiles each\n",
+            tile_frames_, tile_per_, tiles_.size());
+      }
+      if (dewarp_) {
+        fprintf(stderr, "          dewarp views: %u, %u a frame\n", view_cnt_, dewarp_->views());
+      }
+      if (gles_) {
+        fprintf(stderr, "     gles model inputs: %u (%u imported, %u on a core)\n",
+            gles_->scaled(), gles_->imported(), gles_->busy());
+      }
+      if (classify_) {
+        auto& differ_classify = classify_->differ_eval;
+        fprintf(stderr, "      classified crops: %u (%u frames cut short)\n", classify_->crop_cnt,
+            crop_cut_cnt_.load());
+        fprintf(stderr, "classify eval time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+            differ_classify.pct(.5), differ_classify.pct(.9), differ_classify.pct(.99), differ_classify.pct(.999),
+            differ_classify.high, differ_classify.avg, 
+            differ_classify.low,  differ_classify.cnt);
+      }
+      TpuShare::report();
+      if (embed_) {
+        auto& differ_embed = embed_->differ_eval;
+        fprintf(stderr, "        embedded crops: %u\n", embed_->crop_cnt);
+        fprintf(stderr, "   embed eval time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+            differ_embed.pct(.5), differ_embed.pct(.9), differ_embed.pct(.99), differ_embed.pct(.999),
+            differ_embed.high, differ_embed.avg, 
+            differ_embed.low,  differ_embed.cnt);
+      }
+      if (screen_) {
+        auto& differ_screen = screen_->differ_eval;
+        fprintf(stderr, "       screened frames: %u\n", screened_cnt_);
+        fprintf(stderr, "  screen eval time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+            differ_screen.pct(.5), differ_screen.pct(.9), differ_screen.pct(.99), differ_screen.pct(.999),
+            differ_screen.high, differ_screen.avg, 
+            differ_screen.low,  differ_screen.cnt);
+      }
+      if (blob_frames_) {
+        fprintf(stderr, "           blob frames: %u\n", blob_frames_);
+      }
+      if (regions_ > 1) {
+        fprintf(stderr, "         region frames: %u\n", region_frames_);
+      }
+      if (dedup_) {
+        fprintf(stderr, "        cached results: %u\n", cache_hits_.load());
+      }
+      fprintf(stderr, "        frames skipped: %llu\n", 
+          static_cast<unsigned long long>(frame_chan_.drops() + stale_cnt_ + overtaken_cnt_));
+      if (late_cnt_ != 0) {
+        fprintf(stderr, "           frames late: %u\n", late_cnt_.load());
+      }
+      if (!family_.empty()) {
+        fprintf(stderr, "    input size changes: %u\n", family_cnt_.load());
+      }
+      if (peer_) {
+        fprintf(stderr, "    peer frames (late): %u (%u)\n", peer_cnt_.load(), peer_miss_cnt_.load());
+        fprintf(stderr, "   peer round trip (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+            differ_peer_.pct(.5), differ_peer_.pct(.9), differ_peer_.pct(.99), differ_peer_.pct(.999),
+            differ_peer_.high, differ_peer_.avg,
+            differ_peer_.low,  differ_peer_.cnt);
+      }
+      if (served_cnt_) {
+        fprintf(stderr, "  peers' frames served: %u\n", served_cnt_.load());
+      }
+      if (workers_ != 0) {
+        unsigned int starts = 0;
+        for (auto& eng : engines_) {
+          starts += (eng->lane == 0) ? eng->worker->starts() : 0;
+        }
+        fprintf(stderr, "worker starts (missed): %u (%u)\n", starts, worker_miss_cnt_.load());
+      }
+      fprintf(stderr, "      box batch misses: %u\n", box_pool_.misses());
+      fprintf(stderr, "  first detection (ms): %d\n", first_ms_.load());
+      if (reused_) {
+        fprintf(stderr, "  first inference (ms): %d (engines reused)\n", first_eval_ms_.load());
+      } else {
+        fprintf(stderr, "  first inference (ms): %d (%d loading)\n", first_eval_ms_.load(),
+            load_ms_);
+      }
       fprintf(stderr, "       total test time: %f sec\n", 
           differ_tot_.avg / 1000000.f);
       fprintf(stderr, "     frames per second: %f fps\n", 
           differ_post_.cnt * 1000000.f / differ_tot_.avg);
       fprintf(stderr, "\n");
     }
+
+    // park the engines for the next run, unless one got stuck
+    if (hung_run_ == 0 && !engines_.empty()) {
+      parked_ = std::make_unique<Tflow::Loaded>();
+      uninstall(*parked_);
+      size_t bytes = 0;
+      for (auto& eng : parked_->engines) {
+        bytes += eng->interpreter ? arenaBytes(*eng->interpreter) : 0;
+      }
+      arena_num_ = parked_->engines.size();
+      arena_bytes_ = bytes;
+    } else {
+      for (auto& eng : engines_) {
+        eng->interpreter.reset();
+        eng->context.reset();
+      }
+      if (hung_run_ != 0) {
+        model_.release();   // a stuck invoke may still be reading it
+      }
+      model_.reset();
+    }
   }
   return true;
 }
@@ -25,14 +25,32 @@
 #include <thread>
 #include <mutex>
 #include <map>
+#include <set>
+#include <vector>
 
 #include "utils.h"
 #include "listener.h"
+#include "channel.h"
 #include "base.h"
+#include "reserve.h"
+#include "batch.h"
 #include "encoder.h"
+#include "publish.h"
+#include "events.h"
+#include "journal.h"
 #include "tracker.h"
+#include "snapshot.h"
+#include "motion.h"
+#include "screen.h"
+#include "classify.h"
+#include "embed.h"
+#include "peer.h"
+#include "worker.h"
+#include "dewarp.h"
+#include "gles.h"
 
 #include "edgetpu.h"
+#include "tpushare.h"
 
 #include <tensorflow/lite/builtin_op_data.h>
 #include <tensorflow/lite/interpreter.h>
@@ -42,23 +60,194 @@
 
 namespace detector {
 
-class Tflow : public Base, Listener<FrameBuf> {
+class Tflow : public Base, Listener<FrameBuf>, public Listener<MotionBuf> {
+  public:
+    // how the frame is fit to the model input
+    enum class Aspect {
+      kStretch,
+      kLetterbox,
+      kCrop
+    };
+
+    // what runs the model on the cpu engines, 'kAuto' times the delegates
+    // built in (HAVE_XNNPACK, HAVE_GPU_DELEGATE) and takes the fastest
+    enum class Delegate {
+      kAuto,
+      kCpu,
+      kXnnpack,
+      kGpu
+    };
+    static const char* delegateStr(Tflow::Delegate d);
+
   public:
     static std::unique_ptr<Tflow> create(unsigned int yield_time, bool quiet, 
-        Encoder* enc, Tracker* trk, unsigned int width, unsigned int height, 
+        Encoder* enc, Tracker* trk, Snapshot* snap, unsigned int width, unsigned int height, 
         const char* model, const char* labels, unsigned int threads, 
-        float threshold, bool tpu);
+        float threshold, float low_threshold, bool tpu, unsigned int pix_fmt, 
+        Tflow::Aspect aspect, unsigned int engines, unsigned int regions,
+        unsigned int motion, const Rect& motion_mask, float rate);
     virtual ~Tflow();
 
   public:
     virtual bool addMessage(FrameBuf& data);
 
+    // none for a frame the detection rate would hold, otherwise the room
+    // to wait and the free slots
+    virtual unsigned int credits(const FrameBuf& next);
+
+    // the encoder's macroblock vectors, for the motion gate
+    virtual bool addMessage(MotionBuf& map);
+
+    // give back the frame waiting for a slot, for a capturer short of buffers
+    bool shed();
+
+    // runtime controls, picked up with the next frame
+    void setThresholds(float threshold, float low_threshold);
+    void setRate(float rate);
+    void setRegions(unsigned int regions);
+    // msec a result is reused for near identical frames, 0 never
+    void setDedup(unsigned int ms);
+
+    // with the motion gate, blobs against the background wake the model
+    // and it looks only around them (see motion.h), 0 for off
+    void setBlobs(unsigned int cells);
+    inline float getThreshold()       { return threshold_; }
+    inline float getLowThreshold()    { return low_threshold_; }
+    inline float getRate()            { return rate_; }
+
+    // msec since start of the last frame that moved past the motion gate
+    // or had boxes
+    inline unsigned int lastActive()  { return active_ms_; }
+    inline unsigned int getRegions()  { return regions_; }
+
+    // nothing waiting for a slot or an engine, so a frame handed in now
+    // is evaluated rather than dropped for a newer one (see archive.h)
+    inline bool hungry() { return frame_chan_.size() == 0 && eval_chan_.size() == 0; }
+
+    // capture to posted, since the last call
+    inline Histogram::Percentiles latency() { return differ_late_.hist.interval(); }
+    inline Histogram::Percentiles latency(std::unique_ptr<uint32_t[]>& last) {
+      return differ_late_.hist.interval(last);
+    }
+
+    // what a run came to, only once it has stopped
+    class Stats {
+      public:
+        unsigned int engines;
+        unsigned int tpus;          // engines on an edge tpu
+        unsigned int detections;
+        double secs;
+        Histogram::Percentiles prep, eval, post, late;
+    };
+    Tflow::Stats stats();
+
+    // a new model is only taken while paused, run() loads it
+    bool setModel(const std::string& model, const std::string& labels);
+
+    // a new model, built and warmed up on a thread of its own while the
+    // current one carries on, then swapped in between two frames.  The
+    // last one asked for wins, 'threads' 0 keeps the threads per engine.
+    bool swapModel(const std::string& model, const std::string& labels,
+        unsigned int threads = 0);
+    std::string getModel();
+    std::string getLabels();
+
+    // the same model at other input sizes, 'models' is file,file,...[:px]
+    // with the one given to create among them or not.  All are kept
+    // loaded and the smallest input that still has every track at 'px'
+    // pixels (default 24) on its short side runs, the biggest while there
+    // are no tracks.  Set before start, not with workers or a host.
+    bool setFamily(const std::string& models);
+
+    // taken with the next model load, a delegate that fails falls back
+    // to the builtin kernels
+    void setDelegate(Tflow::Delegate d);
+    inline Tflow::Delegate getDelegate() { return delegate_; }
+
+    // a small model every frame has to get past before the detector, when
+    // no tracks are up, set before start
+    bool setScreen(const std::string& model, float threshold);
+
+    // a classifier run on the crops of the boxes, with its own threads,
+    // set before start
+    bool setClassify(const std::string& model, const std::string& labels,
+        unsigned int threads);
+
+    // an embedding model run on the tracker's boxes when it asks for them,
+    // set before start
+    bool setEmbed(const std::string& model, unsigned int threads);
+
+    // cols x rows overlapping tiles of the frame, 'per_frame' of them in
+    // turn evaluated with each frame besides the whole of it (0 all),
+    // set before start
+    void setTiles(unsigned int cols, unsigned int rows, unsigned int per_frame);
+
+    // a fisheye's views evaluated with each frame besides the whole of it,
+    // 'spec' as in dewarp.h, not with tiles; set before start
+    bool setDewarp(const std::string& spec);
+
+    // make the model's input on the gpu, see gles.h; false without it,
+    // set before start
+    bool setGles(bool on);
+
+    // post processing, set before start: 'classes' is name[:threshold],...
+    // and keeps only those (empty all), 'max_dets' caps the boxes of a
+    // frame (0 all the model gives) and 'nms' drops a box over that iou
+    // with a better one of its class (0 off)
+    bool setPost(const std::string& classes, unsigned int max_dets, float nms);
+
+    // run on 'host', the tflow of another camera, instead of loading a
+    // model: this one scales its frames and posts its boxes, the host's
+    // engines evaluate them taking each source in turn.  Set before
+    // start and stop guests before their host goes.
+    void setHost(Tflow* host);
+
+    // threads per cpu engine, taken the same way
+    bool setThreads(unsigned int threads);
+    inline unsigned int getThreads()  { return model_threads_; }
+
+    // cpu model to fall back to if the tpu hangs or isn't there, the tpu
+    // model comes back when the tpu does
+    void setFallback(const std::string& model, const std::string& labels);
+
+    // frames go to a peer's engines when none of ours is free, back in
+    // line here if the answer takes more than 'deadline' msec (see
+    // peer.h), false for an address that isn't host:port; before start
+    bool setPeer(const std::string& addr, unsigned int deadline);
+
+    // the model runs in 'num' worker processes instead of here, pinned
+    // from 'core' on unless it is -1, and a frame a worker doesn't answer
+    // within 'deadline' msec goes through with nothing found (see
+    // worker.h); before start
+    bool setWorkers(unsigned int num, unsigned int deadline, int core);
+
+    // a peer's model input, run on our engines in between our own frames,
+    // false if it isn't our model's or there is no room for it
+    bool serve(std::shared_ptr<PeerJob>& job);
+
+    // the posted boxes also go here, set before start
+    void setTap(Listener<std::shared_ptr<std::vector<BoxBuf>>>* tap);
+
+    // every frame in also goes to the tracker's optical flow
+    void setFlow(Listener<FrameBuf>* flow);
+    void setPublisher(Publisher* pub);
+    void setEvents(Events* evt);
+    void setJournal(Journal* jnl);
+
+    // the metrics endpoint's samples
+    virtual void metrics(Exposition& out, const std::string& labels);
+    virtual void footprint(Footprint& out);
+    virtual unsigned int pending();
+
   protected:
     Tflow() = delete;
     Tflow(unsigned int yield_time);
-    bool init(bool quiet, Encoder* enc, Tracker* trk, unsigned int width, 
+    bool init(bool quiet, Encoder* enc, Tracker* trk, Snapshot* snap, unsigned int width, 
         unsigned int height, const char* model, const char* labels, 
-        unsigned int threads, float threshold, bool tpu);
+        unsigned int threads, float threshold, float low_threshold, bool tpu, 
+        unsigned int pix_fmt, Tflow::Aspect aspect, unsigned int engines,
+        unsigned int regions, unsigned int motion, const Rect& motion_mask,
+        float rate);
 
   protected:
     virtual bool waitingToRun();
@@ -71,19 +260,111 @@ class Tflow : public Base, Listener<FrameBuf> {
     bool tpu_;
     Encoder* enc_;
     Tracker* trk_;
+    Snapshot* snap_;
+    Publisher* pub_;
+    Events* evt_;
+    Journal* jnl_;
+    Listener<std::shared_ptr<std::vector<BoxBuf>>>* tap_;
+    Listener<FrameBuf>* flow_;
     unsigned int width_;
     unsigned int height_;
+    unsigned int pix_fmt_;
+    Tflow::Aspect aspect_;
+    Rect src_rect_;
+    Rect dst_rect_;
+
+    // between full frames only the area around the tracks is evaluated
+    std::atomic<unsigned int> regions_;
+    unsigned int region_cnt_;
+    unsigned int region_frames_;
+    const float region_margin_ = {0.5f};
+    const float region_max_ = {0.5f};
+    unsigned int blob_frames_;
+
+    // still scenes skip inference
+    std::unique_ptr<Motion> motion_;
+    unsigned int still_cnt_;
+    std::atomic<unsigned int> active_ms_;
+    std::unique_ptr<Screen> screen_;
+    unsigned int screened_cnt_;
+    unsigned int scaled_cnt_;     // inputs the isp scaled for us
+    bool tracking();
+    std::unique_ptr<Classify> classify_;
+    std::unique_ptr<Embed> embed_;
+
+    // results of the last few evaluations by frame hash, newest first, a
+    // frame within 'hash_dist_' bits of one on the same area takes them
+    class Cached {
+      public:
+        uint64_t bits;
+        Rect src;
+        std::chrono::steady_clock::time_point stamp;
+        std::vector<float> locs;
+        std::vector<float> clas;
+        std::vector<float> scor;
+        float total;
+    };
+    std::atomic<unsigned int> dedup_;
+    std::mutex cache_lock_;
+    std::vector<Tflow::Cached> cache_;
+    const unsigned int cache_max_ = {8};
+    const unsigned int hash_dist_ = {2};
+    std::atomic<unsigned int> cache_hits_;
+
+    // the same samples frame after frame is a stuck camera, no detail
+    // at all a covered lens, once it lasts 'camera_ms_'
+    enum class Camera {
+      kOk = 0,
+      kFrozen,
+      kCovered
+    };
+    std::atomic<Tflow::Camera> camera_;
+    Tflow::Camera camera_seen_;
+    std::chrono::steady_clock::time_point camera_since_;
+    uint32_t last_sum_;
+    const unsigned int camera_ms_ = {3000};
+    const unsigned char covered_spread_ = {4};
+    void watchCamera(const FrameHash& hash, std::chrono::steady_clock::time_point stamp);
+
+    // steady detection cadence, stretched by the engines' cost and heat
+    std::atomic<float> rate_;
+    std::atomic<int64_t> due_ticks_{0};   // due_, for the capturer's thread
+    unsigned int held_cnt_;
+    std::atomic<int> first_ms_;
+    std::chrono::steady_clock::time_point due_;
+    std::chrono::steady_clock::time_point temp_stamp_;
+    float temp_;
+    float temp_scale_;
+    const float temp_soft_ = {70.f};
+    const float temp_hard_ = {80.f};
+    bool schedule(const FrameBuf& frame);
+    void advance(const FrameBuf& frame);
+    const unsigned char fill_ = {128};
     const unsigned int channels_ = {3};
     unsigned int model_width_;
     unsigned int model_height_;
     unsigned int model_channels_;
-    float threshold_;
+    std::atomic<float> threshold_;
+    std::atomic<float> low_threshold_;   // boxes down to this score go to the tracker only
 
     std::string model_fname_;
-    unsigned int model_threads_;
+    std::atomic<unsigned int> model_threads_;
+    unsigned int model_engines_;
 
     std::string labels_fname_;
-    std::map<unsigned int, std::pair<std::string, BoxBuf::Type>> label_pairs_;
+
+    // what post needs of a class, indexed by class id
+    class Class {
+      public:
+        int name = {-1};             // interned, see names.h
+        BoxBuf::Type type = {BoxBuf::Type::kUnknown};
+        float threshold = {0.f};     // 0 takes 'threshold_'
+        bool keep = {false};
+    };
+    std::vector<Tflow::Class> classes_;
+    std::map<std::string, float> class_spec_;
+    unsigned int max_dets_;
+    float nms_;
     const std::map<std::string, BoxBuf::Type> boxbuf_pairs_ = 
     {
       { "person",     BoxBuf::Type::kPerson  },
@@ -96,45 +377,301 @@ class Tflow : public Base, Listener<FrameBuf> {
       { "motorcycle", BoxBuf::Type::kVehicle }
     };
 
-    class Frame {
+    unsigned int frame_len_;
+    unsigned int frame_stride_;
+    Rgb24Scaler scaler_;
+    TfLiteType input_type_;
+    float in_scale_;
+    float in_zero_;
+
+    std::unique_ptr<tflite::FlatBufferModel> model_;
+
+    // an interpreter with its own thread, on a tpu if it has a context
+    class Engine {
       public:
-        Frame() {}
-        ~Frame() {}
+        std::shared_ptr<edgetpu::EdgeTpuContext> context;
+        std::shared_ptr<TpuShare> share;   // with a context, and its model
+        const void* model = {nullptr};
+        Tflow* owner = {nullptr};    // of the slot it is on, a guest or us
+        std::unique_ptr<TfLiteDelegate, void (*)(TfLiteDelegate*)> delegate{
+          nullptr, [](TfLiteDelegate*) {}};   // outlives the interpreter
+        Tflow::Delegate kind = {Tflow::Delegate::kCpu};
+        std::unique_ptr<tflite::Interpreter> interpreter;
+        std::shared_ptr<Worker> worker;   // in place of the interpreter
+        unsigned int lane = {0};
+        std::thread thread;
+        MicroDiffer<uint32_t> differ_eval;
+        std::atomic<uint32_t> eval_avg{0};  // differ_eval's, for the other threads
+        std::atomic<int64_t> busy{0};   // when the invoke began, -1 once given up on
+        std::atomic<uint64_t> seq{0};
+    };
+    std::vector<std::unique_ptr<Tflow::Engine>> engines_;
+
+    // an invoke that never returns (a tpu pulled out) keeps its engine,
+    // so those are let go of and never freed
+    const unsigned int hang_max_ = {5000};   // msec
+    std::vector<Tflow::Engine*> hung_;
+    const unsigned int tpu_depth_ = {2};     // engines a tpu
+    unsigned int hung_run_;
+    std::string fallback_model_;
+    std::string fallback_labels_;
+    std::string tpu_model_;      // set while on the fallback
+    std::string tpu_labels_;
+    std::atomic<unsigned int> tpu_lost_cnt_;
+    const unsigned int probe_ms_ = {2000};
+    std::chrono::steady_clock::time_point probe_stamp_;
+    void fallBack();
+    void reattach();
+    std::vector<std::shared_ptr<edgetpu::EdgeTpuContext>> openTpus();
+    Channel<uint64_t> skip_chan_{16, Channel<uint64_t>::Policy::kDropNewest};
+    std::set<uint64_t> skipped_;
+    bool checkEngines();
+
+    // engines that are lanes of worker processes, two a worker
+    unsigned int workers_;
+    unsigned int worker_deadline_;
+    int worker_core_;
+    const unsigned int worker_start_ms_ = {30000};
+    std::atomic<unsigned int> worker_miss_cnt_{0};
+    std::atomic<unsigned int> crop_cut_cnt_{0};
+    std::unique_ptr<Tflow::Engine> makeEngine(tflite::FlatBufferModel& model,
+        std::shared_ptr<edgetpu::EdgeTpuContext> context, unsigned int threads,
+        Tflow::Delegate kind);
+    std::atomic<Tflow::Delegate> delegate_;
+    Tflow::Delegate asked_;      // what the engines in use were made for
+    const unsigned int pick_runs_ = {3};
+    Tflow::Delegate pick(tflite::FlatBufferModel& model, unsigned int threads);
+
+    // a model with its engines and labels, ready to be put in
+    class Loaded {
       public:
-        unsigned int id;
-        unsigned int length;
-        std::vector<unsigned char> buf;
+        std::string model_fname;
+        std::string labels_fname;
+        unsigned int threads;
+        Tflow::Delegate asked;
+        std::unique_ptr<tflite::FlatBufferModel> model;
+        std::vector<std::unique_ptr<Tflow::Engine>> engines;
+        std::vector<Tflow::Class> classes;
+        unsigned int results;
+        unsigned int width;
+        unsigned int height;
+        unsigned int channels;
+        TfLiteType input_type;
+        float in_scale;
+        float in_zero;
+        bool ok;
     };
-    unsigned int frame_len_;
-    Tflow::Frame frame_;
+    bool load(Tflow::Loaded& ld,
+        const std::vector<std::shared_ptr<edgetpu::EdgeTpuContext>>& contexts);
+    bool startWorkers(Tflow::Loaded& ld);
+    bool readLabels(Tflow::Loaded& ld);
+    bool warm(Tflow::Loaded& ld);
+    void install(Tflow::Loaded& ld);
+    void uninstall(Tflow::Loaded& ld);
+    void launch();
+    void land();
 
-    std::unique_ptr<tflite::FlatBufferModel> model_;
-    std::shared_ptr<edgetpu::EdgeTpuContext> edgetpu_context_;
-    std::unique_ptr<tflite::Interpreter> model_interpreter_;
-    std::unique_ptr<tflite::Interpreter> resize_interpreter_;
+    // names are read from other threads, 'swap_want_' is the newest ask and
+    // 'swap_' the one loading
+    std::mutex swap_lock_;
+    std::unique_ptr<Tflow::Loaded> swap_want_;
+    std::unique_ptr<Tflow::Loaded> swap_;
+    std::atomic<bool> swap_done_;
+    std::thread loader_;
+    unsigned int swap_cnt_;
+    bool swap();
+
+    // the model at each input size, smallest first, loaded and warmed at
+    // start so a change of size is only a land and a launch
+    class Member {
+      public:
+        std::string model_fname;
+        unsigned int width = {0};             // of its input, once loaded
+        unsigned int height = {0};
+        std::unique_ptr<Tflow::Loaded> ld;    // null while it runs
+    };
+    std::vector<Tflow::Member> family_;
+    unsigned int family_px_;
+    std::chrono::steady_clock::time_point family_stamp_;
+    const unsigned int family_hold_ = {2000};   // msec at a size at least
+    const float family_margin_ = {1.25f};       // over 'px' to go smaller
+    std::atomic<unsigned int> family_cnt_{0};
+    std::atomic<unsigned int> family_num_{0};
+    std::atomic<size_t> family_bytes_{0};
+    bool loadFamily();
+    int pickSize();
+    void resize(unsigned int idx);
+
+    // the engines of the last run, kept for the next one when nothing
+    // changed so a restart doesn't load and upload the model again
+    std::unique_ptr<Tflow::Loaded> parked_;
+
+    // run start to the first invoke done, and how much of it was loading
+    std::chrono::steady_clock::time_point run_begin_;
+    std::atomic<int> first_eval_ms_;
+    int load_ms_;
+    bool reused_;
+    void loaderProc(std::vector<std::shared_ptr<edgetpu::EdgeTpuContext>> contexts);
+    static void loaderProc0(Tflow* self,
+        std::vector<std::shared_ptr<edgetpu::EdgeTpuContext>> contexts);
 
     MicroDiffer<uint32_t> differ_copy_;
     MicroDiffer<uint32_t> differ_prep_;
-    MicroDiffer<uint32_t> differ_eval_;
     MicroDiffer<uint32_t> differ_post_;
+    MicroDiffer<uint32_t> differ_late_;
     MicroDiffer<uint32_t> differ_tot_;
 
     unsigned int post_id_ = {0};
-    const unsigned int result_num_ = {10};
-
-    void resize(std::unique_ptr<tflite::Interpreter>& interpreter,
-        uint8_t* out, uint8_t* in,
-        int image_height, int image_width, int image_channels, 
-        int wanted_height, int wanted_width, int wanted_channels, 
-        int yield);
-    bool prep();
-    bool eval();
-    bool post(bool report);
-    bool oneRun(bool report);
-
-    std::timed_mutex tflow_lock_;
-    std::atomic<bool> tflow_on_;
-    std::atomic<bool> tflow_empty_;
+    unsigned int result_num_;    // the model's detections a frame
+    BatchPool<BoxBuf> box_pool_{16, 10};
+
+
+    // a frame on its way through prep, eval and post
+    class Slot {
+      public:
+        FrameBuf frame;
+        FrameBuf snap;    // kept through eval while a snapshot is wanted
+        FrameBuf crop;    // and while there is a classifier
+        Rect src;
+        Rect dst;
+        Bytes rgb;
+        std::vector<float> locs;
+        std::vector<float> clas;
+        std::vector<float> scor;
+        float total;
+        uint64_t seq;
+        FrameHash hash;
+        bool cached;
+        bool missed = {false};  // by a worker, no results to remember
+        int tile;               // -1 the whole frame
+        int view = {-1};        // of the dewarp, -1 none
+        unsigned int tiles;     // slots the frame went out in
+        bool last;              // of them
+        std::vector<Rect> blobs;    // where the motion is, empty for anywhere
+    };
+    const unsigned int slot_max_ = {16};
+    unsigned int slot_num_;
+    unsigned int stale_cnt_ = {0};
+    std::atomic<unsigned int> late_cnt_ = {0};
+    std::atomic<int64_t> due_order_ = {INT64_MAX};   // of the newest waiting for an engine
+    std::atomic<unsigned int> eval_us_ = {0};         // an engine's average
+    unsigned int expected();                          // usec to prep and evaluate a frame
+    bool tooLate(Tflow::Slot& slot, unsigned int usec);
+    std::atomic<unsigned int> overtaken_cnt_ = {0};
+    std::vector<Tflow::Slot> slots_;
+
+    // sizes taken once the engines and slots are made, read from another thread
+    std::atomic<unsigned int> arena_num_{0};
+    std::atomic<size_t> arena_bytes_{0};
+    std::atomic<unsigned int> slot_cnt_{0};
+    std::atomic<size_t> slot_bytes_{0};
+    Channel<unsigned int> free_chan_{slot_max_, Channel<unsigned int>::Policy::kDropNewest};
+    Channel<unsigned int> eval_chan_{slot_max_, Channel<unsigned int>::Policy::kDropNewest};
+    Channel<unsigned int> post_chan_{slot_max_, Channel<unsigned int>::Policy::kDropNewest};
+
+    unsigned int mapX(Tflow::Slot& slot, float x);
+    unsigned int mapY(Tflow::Slot& slot, float y);
+    void selectRegion(Tflow::Slot& slot);
+    void selectBlobs(Tflow::Slot& slot);
+    bool fitRegion(float x0, float y0, float x1, float y1, Rect& roi);
+
+    // a frame's tiles go out together and their boxes are merged when the
+    // last is posted
+    std::vector<Rect> tiles_;
+    unsigned int tile_per_;
+    unsigned int tile_next_;
+    unsigned int tile_frames_;
+    const float tile_overlap_ = {0.2f};
+    const float tile_merge_ = {0.6f};     // of the smaller box
+    std::unique_ptr<Dewarp> dewarp_;
+    unsigned int view_cnt_;
+    std::atomic<size_t> dewarp_bytes_{0};
+    std::unique_ptr<Gles> gles_;
+    std::shared_ptr<std::vector<BoxBuf>> tile_boxes_;
+    std::shared_ptr<std::vector<BoxBuf>> tile_scored_;
+    unsigned int tile_group_;
+
+    bool lookup(Tflow::Slot& slot);
+    void remember(const Tflow::Slot& slot);
+    bool prep(Tflow::Slot& slot);
+    bool eval(Tflow::Engine& eng, Tflow::Slot& slot);
+    bool evalWorker(Tflow::Engine& eng, Tflow::Slot& slot);
+    bool post(Tflow::Slot& slot, bool report);
+
+    // the engines' threads all come here for each frame
+    alignas(64) std::mutex dispatch_lock_;
+    uint64_t eval_seq_;
+    int held_;                  // popped, of the frame being dispatched
+    int64_t dispatch_id_;
+    bool dispatch(unsigned int& idx, uint64_t& seq);
+
+    // what a guest needs of the host's model, bumped with every install
+    class Shape {
+      public:
+        unsigned int gen = {0};
+        unsigned int width;
+        unsigned int height;
+        unsigned int channels;
+        TfLiteType input_type;
+        float in_scale;
+        float in_zero;
+        unsigned int results;
+        unsigned int engines;
+        std::vector<Tflow::Class> classes;
+    };
+    std::mutex shape_lock_;
+    Tflow::Shape shape_;
+    std::atomic<unsigned int> model_gen_;
+
+    // host: the guests and whose turn it is, guest: the host, the model
+    // its slots are for and how many of them are out on its engines
+    alignas(64) std::mutex guest_lock_;
+    std::vector<Tflow*> guests_;
+    unsigned int turn_;
+    Tflow* host_;
+    unsigned int host_gen_;
+    unsigned int host_engines_;
+    std::atomic<unsigned int> lent_;
+    bool next(Tflow*& src, unsigned int& idx, uint64_t& seq);
+    bool lend(unsigned int& idx, uint64_t& seq);
+    bool borrow();
+    void mapInput();
+    void evaluated(unsigned int idx, uint64_t seq);
+
+    Semaphore eval_sem_;
+    void evalProc(Tflow::Engine* eng);
+    static void evalProc0(Tflow* self, Tflow::Engine* eng);
+
+    uint64_t post_seq_;
+    std::map<uint64_t, unsigned int> pending_;
+    void deliver(unsigned int idx, bool report);
+
+    Semaphore post_sem_;
+    std::thread post_;
+    void postProc();
+    static void postProc0(Tflow* self);
+
+    // offload to a peer, and the inputs of peers on our engines
+    std::unique_ptr<PeerLink> peer_;
+    unsigned int peer_deadline_;
+    std::thread peer_thread_;
+    std::atomic<unsigned int> idle_engines_{0};
+    Channel<std::pair<unsigned int, uint64_t>> again_chan_{slot_max_,
+      Channel<std::pair<unsigned int, uint64_t>>::Policy::kDropNewest};
+    Channel<std::shared_ptr<PeerJob>> serve_chan_{8,
+      Channel<std::shared_ptr<PeerJob>>::Policy::kDropNewest};
+    std::atomic<unsigned int> peer_cnt_{0};
+    std::atomic<unsigned int> peer_miss_cnt_{0};
+    std::atomic<unsigned int> served_cnt_{0};
+    MicroDiffer<uint32_t> differ_peer_;
+    void again(unsigned int idx, uint64_t seq);
+    void evalJob(Tflow::Engine& eng, PeerJob& job);
+    void peerProc();
+    static void peerProc0(Tflow* self);
+
+    Channel<FrameBuf> frame_chan_{1, Channel<FrameBuf>::Policy::kDropOldest};
+    Channel<MotionBuf> vec_chan_{1, Channel<MotionBuf>::Policy::kDropOldest};
+    alignas(64) std::atomic<bool> tflow_on_;    // read by every engine thread
 
 #ifdef CAPTURE_ONE_RAW_FRAME
     unsigned int counter = {10};
@@ -0,0 +1,116 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+
+#include "tpushare.h"
+#include "metrics.h"
+
+namespace detector {
+
+std::mutex TpuShare::shares_lock_;
+std::vector<std::pair<const void*, std::shared_ptr<TpuShare>>> TpuShare::shares_;
+
+std::shared_ptr<TpuShare> TpuShare::get(const void* context) {
+  std::unique_lock<std::mutex> lck(shares_lock_);
+  for (auto& s : shares_) {
+    if (s.first == context) {
+      return s.second;
+    }
+  }
+  auto share = std::shared_ptr<TpuShare>(new TpuShare());
+  share->index_ = shares_.size();
+  shares_.push_back({context, share});
+  return share;
+}
+
+void TpuShare::begin(const void* model) {
+
+  std::unique_lock<std::mutex> lck(lock_);
+  waiting_[model]++;
+
+  // the loaded model's invokes go first for a while, then anyone's
+  auto limit = std::chrono::steady_clock::now() + std::chrono::milliseconds(wait_max_);
+  bool free = turn_.wait_until(lck, limit, [&]() {
+    return busy_ == 0 &&
+      (model == loaded_ || streak_ >= streak_max_ || waiting_[loaded_] == 0);
+  });
+  waiting_[model]--;
+  if (!free) {
+    overrun_cnt_++;
+  }
+  busy_++;
+  swapped_ = model != loaded_;
+  if (swapped_) {
+    swap_cnt_ += (loaded_ != nullptr) ? 1 : 0;
+    loaded_ = model;
+    streak_ = 0;
+  }
+  streak_++;
+  began_ = std::chrono::steady_clock::now();
+}
+
+void TpuShare::end() {
+
+  std::unique_lock<std::mutex> lck(lock_);
+  if (busy_ == 1) {
+    auto& differ = swapped_ ? differ_swap_ : differ_same_;
+    differ.begin(began_);
+    differ.end();
+  }
+  busy_--;
+  lck.unlock();
+  turn_.notify_all();
+}
+
+void TpuShare::metrics(Exposition& out) {
+  std::unique_lock<std::mutex> lck(shares_lock_);
+  for (auto& s : shares_) {
+    TpuShare& sh = *s.second;
+    std::unique_lock<std::mutex> slck(sh.lock_);
+    std::string labels = "tpu=\"" + std::to_string(sh.index_) + "\"";
+    out.counter("detector_tpu_model_swaps_total", "invokes of another model than the tpu last ran",
+        labels, sh.swap_cnt_);
+    out.counter("detector_tpu_turn_overruns_total", "invokes that went ahead after waiting too long",
+        labels, sh.overrun_cnt_);
+    out.summary("detector_tpu_invoke_us", "tpu invoke time", labels + ",after=\"swap\"",
+        sh.differ_swap_.hist);
+    out.summary("detector_tpu_invoke_us", "tpu invoke time", labels + ",after=\"same\"",
+        sh.differ_same_.hist);
+  }
+}
+
+void TpuShare::report() {
+  std::unique_lock<std::mutex> lck(shares_lock_);
+  for (auto& s : shares_) {
+    TpuShare& sh = *s.second;
+    std::unique_lock<std::mutex> slck(sh.lock_);
+    if (sh.swap_cnt_ == 0) {
+      continue;
+    }
+
+    // what a swap costs is how much longer the invoke after one takes
+    int cost = static_cast<int>(sh.differ_swap_.pct(.5)) - static_cast<int>(sh.differ_same_.pct(.5));
+    fprintf(stderr, "  tpu %u model swaps: %llu, %d us each at p50 (%u after one, %u otherwise), %llu overruns\n",
+        sh.index_, static_cast<unsigned long long>(sh.swap_cnt_), cost,
+        sh.differ_swap_.pct(.5), sh.differ_same_.pct(.5),
+        static_cast<unsigned long long>(sh.overrun_cnt_));
+  }
+}
+
+} // namespace detector
@@ -0,0 +1,91 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Models sharing an Edge TPU.
+ *
+ *  The tpu holds the parameters of the model it last ran, so a detector
+ *  and a classifier taking turns on it reload both every frame unless
+ *  they were compiled together (edgetpu_compiler with both models), when
+ *  their parameters are cached side by side.  Every interpreter on a tpu
+ *  takes its turn here around each invoke: whoever runs the model the
+ *  tpu has loaded goes first while it has invokes waiting, up to
+ *  'streak_max_' in a row, so the models' runs come in groups rather
+ *  than alternating.  The swaps and what the first invoke after one costs
+ *  over the rest are counted per tpu, so a pair that wasn't co-compiled
+ *  shows.  A turn that waits longer than 'wait_max_' goes ahead anyway,
+ *  a hung tpu is tflow's to deal with.
+ */
+
+#ifndef TPUSHARE_H
+#define TPUSHARE_H
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <string>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+
+#include "utils.h"
+
+namespace detector {
+
+class Exposition;
+
+class TpuShare {
+  public:
+    // the one for 'context', made on first use
+    static std::shared_ptr<TpuShare> get(const void* context);
+
+    // around an invoke, a model is known by its FlatBufferModel
+    void begin(const void* model);
+    void end();
+
+    static void metrics(Exposition& out);
+    static void report();
+
+  private:
+    TpuShare() = default;
+
+    std::mutex lock_;
+    std::condition_variable turn_;
+    const void* loaded_ = {nullptr};
+    unsigned int busy_ = {0};
+    unsigned int streak_ = {0};
+    bool swapped_ = {false};
+    std::chrono::steady_clock::time_point began_;
+    std::map<const void*, unsigned int> waiting_;
+    const unsigned int streak_max_ = {4};
+    const unsigned int wait_max_ = {250};   // msec
+
+    unsigned int index_ = {0};
+    uint64_t swap_cnt_ = {0};
+    uint64_t overrun_cnt_ = {0};
+    MicroDiffer<uint32_t> differ_swap_;    // the first invoke after a swap
+    MicroDiffer<uint32_t> differ_same_;    // the rest
+
+    static std::mutex shares_lock_;
+    static std::vector<std::pair<const void*, std::shared_ptr<TpuShare>>> shares_;
+};
+
+} // namespace detector
+
+#endif // TPUSHARE_H
@@ -0,0 +1,232 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+
+#include "utils.h"
+#include "trace.h"
+
+namespace detector {
+
+std::unique_ptr<Trace::Event[]> Trace::ring_;
+unsigned int Trace::len_ = 0;
+std::atomic<uint64_t> Trace::head_ = {0};
+std::atomic<bool> Trace::on_ = {false};
+
+static const char* hop_names[] = {
+  "dqbuf", "tflow copy", "prep", "eval", "post", "track",
+  "encode copy", "overlay", "encode", "rtsp send"
+};
+
+static inline int64_t nsec(std::chrono::steady_clock::time_point t) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+bool Trace::start(unsigned int events) {
+  if (on_ || events == 0) {
+    return on_;
+  }
+
+  // writers that saw the old ring may still be in it, so it only grows
+  if (events > len_) {
+    ring_ = std::unique_ptr<Trace::Event[]>(new Trace::Event[events]);
+    len_ = events;
+  }
+  for (unsigned int i = 0; i < len_; i++) {
+    ring_[i].seq.store(0, std::memory_order_relaxed);
+  }
+  head_ = 0;
+  on_ = true;
+  return true;
+}
+
+void Trace::stop() {
+  on_ = false;
+}
+
+void Trace::span(Trace::Hop hop, std::chrono::steady_clock::time_point stamp,
+    unsigned int id, std::chrono::steady_clock::time_point begin,
+    std::chrono::steady_clock::time_point end) {
+
+  if (!on_) {
+    return;
+  }
+  static thread_local uint32_t tid = syscall(SYS_gettid);
+
+  uint64_t pos = head_.fetch_add(1, std::memory_order_relaxed);
+  auto& ev = ring_[pos % len_];
+  ev.seq.store(2 * pos + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  ev.hop = hop;
+  ev.tid = tid;
+  ev.id = id;
+  ev.stamp = nsec(stamp);
+  ev.begin = nsec(begin);
+  ev.end = nsec(end);
+  ev.seq.store(2 * pos + 2, std::memory_order_release);
+}
+
+const char* Trace::hopStr(Trace::Hop hop) {
+  unsigned int i = static_cast<unsigned int>(hop);
+  return (i < static_cast<unsigned int>(Trace::Hop::kNum)) ? hop_names[i] : "?";
+}
+
+void Trace::take(uint64_t& pos, std::vector<Trace::Span>& out) {
+
+  if (len_ == 0) {
+    return;
+  }
+  uint64_t head = head_.load(std::memory_order_acquire);
+  if (head - pos > len_) {
+    pos = head - len_;
+  }
+  for (; pos < head; pos++) {
+    auto& ev = ring_[pos % len_];
+    uint64_t seq = ev.seq.load(std::memory_order_acquire);
+    if (seq != 2 * pos + 2) {
+      continue;
+    }
+    Trace::Span s = { ev.hop, ev.id, ev.stamp, ev.begin, ev.end };
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (ev.seq.load(std::memory_order_relaxed) == seq) {
+      out.push_back(s);
+    }
+  }
+}
+
+std::string Trace::json() {
+
+  // copy out what isn't being written over right now
+  class Copy {
+    public:
+      Trace::Hop hop;
+      uint32_t tid, id;
+      int64_t stamp, begin, end;
+  };
+  std::vector<Copy> copies;
+  copies.reserve(len_);
+  for (unsigned int i = 0; i < len_; i++) {
+    auto& ev = ring_[i];
+    uint64_t seq = ev.seq.load(std::memory_order_acquire);
+    if (seq == 0 || (seq & 1)) {
+      continue;
+    }
+    Copy c = { ev.hop, ev.tid, ev.id, ev.stamp, ev.begin, ev.end };
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (ev.seq.load(std::memory_order_relaxed) != seq) {
+      continue;
+    }
+    copies.push_back(c);
+  }
+  std::sort(copies.begin(), copies.end(),
+      [](const Copy& a, const Copy& b) { return a.begin < b.begin; });
+
+  // hops that only had the stamp take the id the others gave it
+  std::map<int64_t, uint32_t> ids;
+  std::set<uint32_t> tids;
+  for (auto& c : copies) {
+    if (c.id != no_id && c.stamp != 0) {
+      ids[c.stamp] = c.id;
+    }
+    tids.insert(c.tid);
+  }
+
+  std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  char buf[256];
+  bool first = true;
+  auto add = [&out, &first](const char* ev) {
+    out += first ? "" : ",\n";
+    out += ev;
+    first = false;
+  };
+  for (auto tid : tids) {
+    std::string name = "thread " + std::to_string(tid);
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%u/comm", tid);
+    FILE* fd = fopen(path, "r");
+    if (fd) {
+      char comm[32];
+      if (fgets(comm, sizeof(comm), fd)) {
+        name = comm;
+        name.erase(name.find_last_not_of("\n") + 1);
+      }
+      fclose(fd);
+    }
+    snprintf(buf, sizeof(buf),
+        "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+        tid, name.c_str());
+    add(buf);
+  }
+
+  // a flow per frame, from its first hop through to its last
+  std::map<uint32_t, unsigned int> left;
+  for (auto& c : copies) {
+    auto it = ids.find(c.stamp);
+    if (it != ids.end()) {
+      left[it->second]++;
+    }
+  }
+  std::set<uint32_t> started;
+  for (auto& c : copies) {
+    auto it = ids.find(c.stamp);
+    long long frame = (it == ids.end()) ? -1 : it->second;
+    double ts = c.begin / 1000.0;
+    double dur = (c.end - c.begin) / 1000.0;
+    double since = (c.stamp != 0) ? (c.end - c.stamp) / 1000.0 : 0.0;
+    const char* name = hop_names[static_cast<unsigned int>(c.hop)];
+    snprintf(buf, sizeof(buf),
+        "{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%lld,\"capture_us\":%.0f}}",
+        name, c.tid, ts, dur, frame, since);
+    add(buf);
+    if (frame < 0 || left[frame] < 2) {
+      continue;
+    }
+    const char* ph = started.insert(frame).second ? "s" : (--left[frame] == 1 ? "f" : "t");
+    snprintf(buf, sizeof(buf),
+        "{\"name\":\"frame\",\"cat\":\"frame\",\"ph\":\"%s\",\"bp\":\"e\",\"id\":%lld,"
+        "\"pid\":1,\"tid\":%u,\"ts\":%.3f}",
+        ph, frame, c.tid, ts);
+    add(buf);
+  }
+  out += "\n]}\n";
+  return out;
+}
+
+bool Trace::write(const std::string& path) {
+  if (!ring_) {
+    return false;
+  }
+  FILE* fd = fopen(path.c_str(), "w");
+  if (!fd) {
+    dbgMsg("failed: open trace %s\n", path.c_str());
+    return false;
+  }
+  std::string out = json();
+  bool ok = fwrite(out.data(), 1, out.size(), fd) == out.size();
+  fclose(fd);
+  return ok;
+}
+
+} // namespace detector
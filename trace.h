@@ -0,0 +1,134 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Per frame tracing.
+ *
+ *  Every hop a frame makes, from the dequeue through tflow, the tracker
+ *  and the encoder to the rtsp send, records a span keyed by the frame's
+ *  capture stamp and, where the hop has it, the frame id.  Spans go into
+ *  a fixed ring that any thread writes without locks, the oldest are
+ *  overwritten.  'json' hands back what the ring holds as Chrome trace
+ *  events, one lane per thread and the hops of each frame joined by a
+ *  flow, so ui.perfetto.dev or chrome://tracing shows where one slow
+ *  frame spent its time.  Hops that only know the stamp get the id from
+ *  the frame's other spans.
+ *
+ *  Off until 'start', and then a span is a clock read and a few stores.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace detector {
+
+class Trace {
+  public:
+    enum class Hop : uint8_t {
+      kDqbuf = 0,     // sensor stamp to dequeued
+      kTflowCopy,
+      kPrep,
+      kEval,
+      kPost,
+      kTrack,
+      kEncodeCopy,
+      kOverlay,
+      kEncode,        // submitted to the codec to the last of its nal
+      kRtsp,          // queued for a reader to sent
+      kNum
+    };
+    static const unsigned int no_id = UINT32_MAX;
+
+    // 'events' spans are kept, the oldest overwritten
+    static bool start(unsigned int events);
+    static void stop();
+    static inline bool on() { return on_.load(std::memory_order_relaxed); }
+
+    static void span(Trace::Hop hop, std::chrono::steady_clock::time_point stamp,
+        unsigned int id, std::chrono::steady_clock::time_point begin,
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now());
+
+    static std::string json();
+    static bool write(const std::string& path);
+
+    // a span as 'take' copies it out, steady clock nsec
+    class Span {
+      public:
+        Trace::Hop hop;
+        uint32_t id;
+        int64_t stamp;
+        int64_t begin;
+        int64_t end;
+    };
+
+    // the spans written since 'pos', which it moves on to the head; any
+    // written over before they were read are gone
+    static void take(uint64_t& pos, std::vector<Trace::Span>& out);
+    static const char* hopStr(Trace::Hop hop);
+
+    // spans its own scope
+    class Scope {
+      public:
+        Scope(Trace::Hop hop, std::chrono::steady_clock::time_point stamp, unsigned int id)
+          : hop_(hop), stamp_(stamp), id_(id), on_(Trace::on()) {
+          if (on_) {
+            begin_ = std::chrono::steady_clock::now();
+          }
+        }
+        ~Scope() {
+          if (on_) {
+            Trace::span(hop_, stamp_, id_, begin_);
+          }
+        }
+      private:
+        Trace::Hop hop_;
+        std::chrono::steady_clock::time_point stamp_;
+        unsigned int id_;
+        bool on_;
+        std::chrono::steady_clock::time_point begin_;
+    };
+
+  private:
+    Trace() = delete;
+
+    class Event {
+      public:
+        std::atomic<uint64_t> seq;    // odd while it is written
+        Trace::Hop hop;
+        uint32_t tid;
+        uint32_t id;
+        int64_t stamp;                // nsec, steady clock
+        int64_t begin;
+        int64_t end;
+    };
+    static std::unique_ptr<Trace::Event[]> ring_;
+    static unsigned int len_;
+    static std::atomic<uint64_t> head_;
+    static std::atomic<bool> on_;
+};
+
+} // namespace detector
+
+#endif // TRACE_H
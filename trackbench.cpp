@@ -0,0 +1,406 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './trackbench -h' for usage.
+ *
+ * ----------
+ *
+ *  Tracker benchmark ('make trackbench').
+ *
+ *  Drives 'Tracker::step' straight from a loop, no thread and no encoder,
+ *  with either synthetic targets (count, speed, clutter and occlusion
+ *  are options) or MOT challenge det.txt/gt.txt files.  Frames are
+ *  stamped 1/fps apart and the tracks age by those stamps, so a run goes
+ *  as fast as the tracker can and still sees camera time.
+ *
+ *  Each run prints the step time percentiles, the tracker's own
+ *  association, predict and cleanup percentiles, and against the ground
+ *  truth the tracks started, id switches and MOTA.  A track only counts
+ *  on the frames a box was matched to it, pairs need an overlap of 0.5.
+ *  With no files it sweeps 5 to 200 objects, '-n' picks the counts.
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <map>
+#include <set>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <unistd.h>
+
+#include "utils.h"
+#include "tracker.h"
+
+namespace detector {
+
+// the largest camera size, synthetic targets move around in this
+static const unsigned int frame_w = 1920;
+static const unsigned int frame_h = 1080;
+
+class Frame {
+  public:
+    std::vector<BoxBuf> boxes;    // what the tracker sees
+    std::vector<BoxBuf> truth;    // id is the object's
+};
+
+class Options {
+  public:
+    std::vector<unsigned int> objects{5, 10, 20, 50, 100, 200};
+    unsigned int frames = 300;
+    float speed = 4.f;            // pixels per frame
+    unsigned int clutter = 0;     // false boxes per frame
+    unsigned int occlusion = 0;   // percent chance per frame an object hides
+    Tracker::Match match = Tracker::Match::kDistance;
+    float high_score = 0.5f;
+    double max_dist = std::sqrt(std::pow(frame_w, 2) + std::pow(frame_h, 2)) / 5.0;
+    unsigned int max_time = 2000;
+    unsigned int fps = 30;
+    std::string det;
+    std::string gt;
+};
+
+class Result {
+  public:
+    std::vector<double> step_us;
+    Tracker::Stats stats;
+    unsigned int truths = 0;
+    unsigned int matched = 0;
+    unsigned int false_pos = 0;
+    unsigned int switches = 0;
+    unsigned int objects = 0;
+};
+
+static std::vector<Frame> synthetic(const Options& opts, unsigned int objects) {
+
+  class Object {
+    public:
+      float x, y, vx, vy;
+      unsigned int w, h;
+      unsigned int hidden;
+  };
+
+  std::mt19937 rng(objects);
+  std::uniform_real_distribution<float> unit(0.f, 1.f);
+  std::uniform_int_distribution<int> jitter(-2, 2);
+  std::vector<Object> objs(objects);
+  for (auto& ob : objs) {
+    ob.w = 24 + unit(rng) * 72;
+    ob.h = std::min(ob.w * 2, frame_h / 2);
+    ob.x = unit(rng) * (frame_w - ob.w);
+    ob.y = unit(rng) * (frame_h - ob.h);
+    float dir = unit(rng) * 2.f * M_PI;
+    ob.vx = opts.speed * std::cos(dir);
+    ob.vy = opts.speed * std::sin(dir);
+    ob.hidden = 0;
+  }
+
+  std::vector<Frame> frames(opts.frames);
+  for (unsigned int f = 0; f < opts.frames; f++) {
+    for (unsigned int i = 0; i < objs.size(); i++) {
+      auto& ob = objs[i];
+      ob.x += ob.vx;
+      ob.y += ob.vy;
+      if (ob.x < 0.f || ob.x > frame_w - ob.w) {
+        ob.vx = -ob.vx;
+        ob.x = std::min(std::max(ob.x, 0.f), static_cast<float>(frame_w - ob.w));
+      }
+      if (ob.y < 0.f || ob.y > frame_h - ob.h) {
+        ob.vy = -ob.vy;
+        ob.y = std::min(std::max(ob.y, 0.f), static_cast<float>(frame_h - ob.h));
+      }
+
+      // gone for a few frames, then back where it would have been
+      if (ob.hidden) {
+        ob.hidden--;
+        continue;
+      }
+      if (unit(rng) * 100.f < opts.occlusion) {
+        ob.hidden = 2 + unit(rng) * 14;
+        continue;
+      }
+      BoxBuf truth(BoxBuf::Type::kPerson, i, ob.x, ob.y, ob.w, ob.h);
+      frames[f].truth.push_back(truth);
+      frames[f].boxes.push_back(BoxBuf(BoxBuf::Type::kPerson, f,
+            std::max(0, static_cast<int>(ob.x) + jitter(rng)),
+            std::max(0, static_cast<int>(ob.y) + jitter(rng)),
+            ob.w + jitter(rng), ob.h + jitter(rng), {}, 0.9f));
+    }
+    for (unsigned int c = 0; c < opts.clutter; c++) {
+      unsigned int w = 16 + unit(rng) * 80;
+      unsigned int h = 16 + unit(rng) * 160;
+      frames[f].boxes.push_back(BoxBuf(BoxBuf::Type::kPerson, f,
+            unit(rng) * (frame_w - w), unit(rng) * (frame_h - h), w, h, {}, 0.3f));
+    }
+  }
+  return frames;
+}
+
+// frame,id,left,top,width,height,conf[,class,visibility] with frames from 1
+static bool mot(const std::string& path, bool truth, std::vector<Frame>& frames) {
+  FILE* fd = fopen(path.c_str(), "r");
+  if (!fd) {
+    fprintf(stderr, "can't open %s\n", path.c_str());
+    return false;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), fd)) {
+    int frame, id, cls = -1;
+    float x, y, w, h, conf;
+    float vis;
+    int num = sscanf(line, "%d,%d,%f,%f,%f,%f,%f,%d,%f", &frame, &id, &x, &y, &w, &h,
+        &conf, &cls, &vis);
+    if (num < 7 || frame < 1) {
+      continue;
+    }
+    // ground truth marks what to ignore with a 0, and people are class 1
+    if (truth && (conf == 0.f || (num >= 8 && cls != -1 && cls != 1))) {
+      continue;
+    }
+    float x1 = x + w, y1 = y + h;
+    x = std::max(x, 0.f);
+    y = std::max(y, 0.f);
+    if (x1 - x < 1.f || y1 - y < 1.f) {
+      continue;
+    }
+    if (frames.size() < static_cast<unsigned int>(frame)) {
+      frames.resize(frame);
+    }
+    auto& fr = frames[frame - 1];
+    if (truth) {
+      fr.truth.push_back(BoxBuf(BoxBuf::Type::kPerson, id, x, y, x1 - x, y1 - y));
+    } else {
+      float score = (conf >= 0.f && conf <= 1.f) ? conf : 1.f;
+      fr.boxes.push_back(BoxBuf(BoxBuf::Type::kPerson, frame - 1, x, y, x1 - x, y1 - y,
+            {}, score));
+    }
+  }
+  fclose(fd);
+  return true;
+}
+
+static float iou(const BoxBuf& a, const BoxBuf& b) {
+  float iw = std::min(a.x + a.w, b.x + b.w) - static_cast<float>(std::max(a.x, b.x));
+  float ih = std::min(a.y + a.h, b.y + b.h) - static_cast<float>(std::max(a.y, b.y));
+  if (iw <= 0.f || ih <= 0.f) {
+    return 0.f;
+  }
+  float inter = iw * ih;
+  return inter / (static_cast<float>(a.w * a.h) + b.w * b.h - inter);
+}
+
+// pair the tracks updated this frame with the truth, best overlap first
+static void score(const std::vector<BoxBuf>& truth, const std::vector<TrackBuf>& tracks,
+    std::map<unsigned int, unsigned int>& last, Result& res) {
+
+  class Pair {
+    public:
+      float iou;
+      unsigned int truth;
+      unsigned int track;
+  };
+  std::vector<Pair> pairs;
+  for (unsigned int t = 0; t < truth.size(); t++) {
+    for (unsigned int k = 0; k < tracks.size(); k++) {
+      float ov = iou(truth[t], tracks[k]);
+      if (ov >= 0.5f) {
+        pairs.push_back({ov, t, k});
+      }
+    }
+  }
+  std::sort(pairs.begin(), pairs.end(),
+      [](const Pair& a, const Pair& b) { return a.iou > b.iou; });
+
+  std::vector<uint8_t> truth_used(truth.size(), 0);
+  std::vector<uint8_t> track_used(tracks.size(), 0);
+  unsigned int matched = 0;
+  for (auto& p : pairs) {
+    if (truth_used[p.truth] || track_used[p.track]) {
+      continue;
+    }
+    truth_used[p.truth] = track_used[p.track] = 1;
+    matched++;
+    auto it = last.find(truth[p.truth].id);
+    if (it != last.end() && it->second != tracks[p.track].id) {
+      res.switches++;
+    }
+    last[truth[p.truth].id] = tracks[p.track].id;
+  }
+  res.truths += truth.size();
+  res.matched += matched;
+  res.false_pos += tracks.size() - matched;
+}
+
+static Result run(const Options& opts, const std::vector<Frame>& frames) {
+
+  Result res;
+  auto trk = Tracker::create(0, true, nullptr, opts.max_dist, opts.max_time,
+      opts.match, opts.high_score);
+
+  using namespace std::chrono;
+  auto period = duration_cast<steady_clock::duration>(duration<double>(1.0 / opts.fps));
+  auto stamp = steady_clock::now();
+  std::map<unsigned int, unsigned int> last;
+  std::set<unsigned int> objects;
+  std::vector<TrackBuf> live;
+  res.step_us.reserve(frames.size());
+  for (auto& fr : frames) {
+    stamp += period;
+    auto boxes = std::make_shared<std::vector<BoxBuf>>(fr.boxes);
+    for (auto& b : *boxes) {
+      b.stamp = stamp;
+    }
+
+    auto t0 = steady_clock::now();
+    trk->step(boxes, stamp);
+    auto t1 = steady_clock::now();
+    res.step_us.push_back(duration<double, std::micro>(t1 - t0).count());
+
+    live.clear();
+    auto tracks = trk->getTracks();
+    if (tracks) {
+      for (auto& t : *tracks) {
+        if (t.stamp == stamp) {
+          live.push_back(t);
+        }
+      }
+    }
+    score(fr.truth, live, last, res);
+    for (auto& t : fr.truth) {
+      objects.insert(t.id);
+    }
+  }
+  res.stats = trk->stats();
+  res.objects = objects.size();
+  return res;
+}
+
+static double pct(std::vector<double>& vals, double p) {
+  if (vals.empty()) {
+    return 0.0;
+  }
+  auto it = vals.begin() + std::min(vals.size() - 1, static_cast<size_t>(p * vals.size()));
+  std::nth_element(vals.begin(), it, vals.end());
+  return *it;
+}
+
+static void print(const char* name, bool scored, Result& res) {
+  char mota[16] = "-", switches[16] = "-";
+  if (scored) {
+    double miss = res.truths - res.matched;
+    snprintf(mota, sizeof(mota), "%.3f", res.truths ?
+        1.0 - (miss + res.false_pos + res.switches) / res.truths : 0.0);
+    snprintf(switches, sizeof(switches), "%u", res.switches);
+  }
+  fprintf(stderr, "%-10s %7.1f %7.1f  %5u %5u  %5u %5u  %5u %5u  %7u %7u %7s %7s\n",
+      name, pct(res.step_us, .5), pct(res.step_us, .99),
+      res.stats.associate.p50, res.stats.associate.p99,
+      res.stats.predict.p50, res.stats.predict.p99,
+      res.stats.cleanup.p50, res.stats.cleanup.p99,
+      res.objects, res.stats.tracks, switches, mota);
+}
+
+void usage() {
+  std::cout << "trackbench -?nfscomlxtrdg"         << std::endl;
+  std::cout                                        << std::endl;
+  std::cout << "  where:"                          << std::endl;
+  std::cout << "  ?            = this screen"      << std::endl;
+  std::cout << "  (n)umber     = objects per run, comma separated (default = 5,10,20,50,100,200)" << std::endl;
+  std::cout << "  (f)rames     = frames per run (default = 300)" << std::endl;
+  std::cout << "  (s)peed      = pixels per frame (default = 4)" << std::endl;
+  std::cout << "  (c)lutter    = false low score boxes per frame (default = 0)" << std::endl;
+  std::cout << "  (o)cclusion  = percent chance per frame an object hides (default = 0)" << std::endl;
+  std::cout << "  (m)atch      = 'distance' or 'iou' (default = distance)" << std::endl;
+  std::cout << "  (l)ow        = high score for iou matching (default = 0.5)" << std::endl;
+  std::cout << "  ma(x) dist   = distance gate in pixels (default = diagonal/5)" << std::endl;
+  std::cout << "  (t)ime       = msec a track lives unmatched (default = 2000)" << std::endl;
+  std::cout << "  (r)ate       = frames per second (default = 30)" << std::endl;
+  std::cout << "  (d)et        = MOT det.txt to track (default = none)" << std::endl;
+  std::cout << "  (g)t         = MOT gt.txt to score against (default = none)" << std::endl;
+}
+
+} // namespace detector
+
+int main(int argc, char** argv) {
+
+  detector::Options opts;
+
+  int c;
+  while ((c = getopt(argc, argv, ":n:f:s:c:o:m:l:x:t:r:d:g:")) != -1) {
+    switch (c) {
+      case 'n': {
+          opts.objects.clear();
+          std::stringstream ss(optarg);
+          std::string item;
+          while (std::getline(ss, item, ',')) {
+            opts.objects.push_back(std::stoul(item));
+          }
+        }
+        break;
+      case 'f': opts.frames = std::stoul(optarg);    break;
+      case 's': opts.speed = std::stof(optarg);      break;
+      case 'c': opts.clutter = std::stoul(optarg);   break;
+      case 'o': opts.occlusion = std::stoul(optarg); break;
+      case 'm': opts.match = (std::string(optarg) == "iou") ?
+                  detector::Tracker::Match::kIou : detector::Tracker::Match::kDistance;
+                break;
+      case 'l': opts.high_score = std::stof(optarg); break;
+      case 'x': opts.max_dist = std::stod(optarg);   break;
+      case 't': opts.max_time = std::stoul(optarg);  break;
+      case 'r': opts.fps = std::max(1ul, std::stoul(optarg)); break;
+      case 'd': opts.det = optarg;                   break;
+      case 'g': opts.gt = optarg;                    break;
+      default:  detector::usage();                   return -1;
+    }
+  }
+
+  fprintf(stderr, "%-10s %15s  %11s  %11s  %11s\n", "",
+      "step (us)", "assoc (us)", "pred (us)", "clean (us)");
+  fprintf(stderr, "%-10s %7s %7s  %5s %5s  %5s %5s  %5s %5s  %7s %7s %7s %7s\n",
+      "run", "p50", "p99", "p50", "p99", "p50", "p99", "p50", "p99",
+      "objects", "tracks", "id sw", "mota");
+
+  if (!opts.det.empty() || !opts.gt.empty()) {
+    std::vector<detector::Frame> frames;
+    if ((!opts.det.empty() && !detector::mot(opts.det, false, frames)) ||
+        (!opts.gt.empty() && !detector::mot(opts.gt, true, frames))) {
+      return -1;
+    }
+    // the ground truth alone tracks its own boxes
+    if (opts.det.empty()) {
+      for (unsigned int f = 0; f < frames.size(); f++) {
+        for (auto& t : frames[f].truth) {
+          frames[f].boxes.push_back(detector::BoxBuf(t.type, f, t.x, t.y, t.w, t.h));
+        }
+      }
+    }
+    auto res = detector::run(opts, frames);
+    detector::print("mot", !opts.gt.empty(), res);
+    return 0;
+  }
+
+  for (auto num : opts.objects) {
+    auto frames = detector::synthetic(opts, num);
+    auto res = detector::run(opts, frames);
+    std::string name = std::to_string(num) + " obj";
+    detector::print(name.c_str(), true, res);
+  }
+  return 0;
+}
@@ -26,105 +26,356 @@
 #include <algorithm>
 #include <iterator>
 #include <limits>
+#include <cmath>
 
 #include "tracker.h"
-#include "third_party/Hungarian/Hungarian.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "pool.h"
+#include "storage.h"
 
 namespace detector {
 
-const Eigen::Matrix<double, 6, 6> Tracker::Track::A_{
-  { 1, 0, 1, 0, 0, 0 },
-  { 0, 1, 0, 1, 0, 0 },
-  { 0, 0, 1, 0, 1, 0 },
-  { 0, 0, 0, 1, 0, 1 },
-  { 0, 0, 0, 0, 0, 0 },
-  { 0, 0, 0, 0, 0, 0 }
-};
-const Eigen::Matrix<double, 2, 6> Tracker::Track::H_{
-  { 1, 0, 0, 0, 0, 0 },
-  { 0, 1, 0, 0, 0, 0 }
-};
+// the constant velocity model is separable, so each axis is its own
+// 3 state filter (position, velocity, acceleration) measured on position:
+//
+//   A = | 1 1 0 |   H = | 1 0 0 |
+//       | 0 1 1 |
+//       | 0 0 0 |
+//
+// Acceleration is zeroed on every predict and never gains from a
+// measurement (p02 and p12 stay 0), so only position, velocity, p00, p01,
+// p11 and p22 are stored.  P does not depend on the measurements, so x and
+// y share it.
+
+void Tracker::Tracks::add(unsigned int track_id, const BoxBuf& box, float err) {
+  slot[track_id] = id.size();
+  id.push_back(track_id);
+  type.push_back(box.type);
+  cls.push_back(box.cls);
+  stamp.push_back(std::chrono::steady_clock::time_point());
+  seen(id.size() - 1, (box.stamp.time_since_epoch().count() != 0) ? 
+    box.stamp : pipeline_now());
+  x.push_back(box.x);
+  y.push_back(box.y);
+  w.push_back(box.w);
+  h.push_back(box.h);
+  touched.push_back(1);
+  active.push_back(0);
+  ring.push_back(Tracker::Ring());
+  if (box.emb) {
+    ring.back().add(box.emb);
+  }
+  path.push_back(paths.take());
+  sample(id.size() - 1);
+
+  // initialize state with inital position
+  px.push_back(box.x + box.w / 2.f);
+  vx.push_back(0.f);
+  py.push_back(box.y + box.h / 2.f);
+  vy.push_back(0.f);
+  p00.push_back(err);
+  p01.push_back(0.f);
+  p11.push_back(err);
+  p22.push_back(err);
+}
 
-Tracker::Track::Track(unsigned int track_id, const BoxBuf& box)
-  : id(track_id), type(box.type),
-    x(box.x), y(box.y), w(box.w), h(box.h),
-    touched(true) {
+void Tracker::Tracks::remove(unsigned int i) {
+  unsigned int last = id.size() - 1;
+  slot.erase(id[i]);
+  paths.give(path[i]);
+  path[i] = path[last];
+  if (i != last) {
+    slot[id[last]] = i;
+    id[i] = id[last];
+    type[i] = type[last];
+    cls[i] = cls[last];
+    stamp[i] = stamp[last];
+    x[i] = x[last];
+    y[i] = y[last];
+    w[i] = w[last];
+    h[i] = h[last];
+    touched[i] = touched[last];
+    active[i] = active[last];
+    ring[i] = ring[last];
+    px[i] = px[last];
+    vx[i] = vx[last];
+    py[i] = py[last];
+    vy[i] = vy[last];
+    p00[i] = p00[last];
+    p01[i] = p01[last];
+    p11[i] = p11[last];
+    p22[i] = p22[last];
+  }
+  id.pop_back();
+  type.pop_back();
+  cls.pop_back();
+  stamp.pop_back();
+  x.pop_back();
+  y.pop_back();
+  w.pop_back();
+  h.pop_back();
+  touched.pop_back();
+  active.pop_back();
+  ring.pop_back();
+  path.pop_back();
+  px.pop_back();
+  vx.pop_back();
+  py.pop_back();
+  vy.pop_back();
+  p00.pop_back();
+  p01.pop_back();
+  p11.pop_back();
+  p22.pop_back();
+}
 
-  stamp = std::chrono::steady_clock::now();
-  state_ = Tracker::Track::State::kInit;
+void Tracker::Tracks::seen(unsigned int i, std::chrono::steady_clock::time_point at) {
+  stamp[i] = at;
+  due.push_back(Due(at, id[i]));
+  std::push_heap(due.begin(), due.end(), std::greater<Due>());
 
-  // initialize state vector with inital position
-  double mid_x = x + w / 2.0;
-  double mid_y = y + h / 2.0;
-  X_ << mid_x,mid_y,0,0,0,0;
+  // too many left behind, start over from the live tracks
+  if (due.size() > 4 * id.size() + 64) {
+    due.clear();
+    for (unsigned int k = 0; k < id.size(); k++) {
+      due.push_back(Due(stamp[k], id[k]));
+    }
+    std::make_heap(due.begin(), due.end(), std::greater<Due>());
+  }
+}
 
-  // initialize error covariance matrix
-  P_ << initial_error_,0,0,0,0,0,
-        0,initial_error_,0,0,0,0,
-        0,0,initial_error_,0,0,0,
-        0,0,0,initial_error_,0,0,
-        0,0,0,0,initial_error_,0,
-        0,0,0,0,0,initial_error_;
+unsigned int Tracker::Tracks::expire(std::chrono::steady_clock::time_point now,
+    std::chrono::milliseconds age, std::chrono::steady_clock::time_point& next,
+    const std::function<void(unsigned int)>& gone) {
+
+  unsigned int num = 0;
+  next = std::chrono::steady_clock::time_point::max();
+  while (!due.empty()) {
+    const Due& top = due.front();
+    auto it = slot.find(top.second);
+    if (it != slot.end() && stamp[it->second] == top.first) {
+      if (now - top.first < age) {
+        next = top.first + age;
+        break;
+      }
+      unsigned int i = it->second;
+      gone(i);
+      remove(i);
+      num++;
+    }
+    std::pop_heap(due.begin(), due.end(), std::greater<Due>());
+    due.pop_back();
+  }
+  return num;
+}
 
-  // initialize measurement covariance matrix
-  R_ << measure_variance_,0,
-        0,measure_variance_;
+size_t Tracker::Tracks::bytes() {
+  return id.capacity() * sizeof(unsigned int) + type.capacity() * sizeof(BoxBuf::Type) +
+    cls.capacity() * sizeof(int) +
+    stamp.capacity() * sizeof(std::chrono::steady_clock::time_point) +
+    due.capacity() * sizeof(Due) + slot.size() * 2 * sizeof(unsigned int) +
+    touched.capacity() + active.capacity() + ring.capacity() * sizeof(Tracker::Ring) +
+    path.capacity() * sizeof(unsigned int) + paths.bytes() +
+    (x.capacity() + y.capacity() + w.capacity() + h.capacity() +
+     px.capacity() + vx.capacity() + py.capacity() + vy.capacity() +
+     p00.capacity() + p01.capacity() + p11.capacity() + p22.capacity()) * sizeof(float);
+}
 
-  // initialize process covariance matrix
-  Q_ << process_variance_,0,0,0,0,0,
-        0,process_variance_,0,0,0,0,
-        0,0,process_variance_,0,0,0,
-        0,0,0,process_variance_,0,0,
-        0,0,0,0,process_variance_,0,
-        0,0,0,0,0,process_variance_;
+void Tracker::Tracks::sample(unsigned int i) {
+  paths.add(path[i], stamp[i], x[i], y[i], w[i], h[i]);
 }
 
-void Tracker::Track::updateTime() {
+unsigned int Tracker::Paths::take() {
 
-  touched = true;
+  // a slot off the free list, or the arena grows by one
+  if (!free.empty()) {
+    unsigned int s = free.back();
+    free.pop_back();
+    head[s] = 0;
+    num[s] = 0;
+    return s;
+  }
+  unsigned int s = head.size();
+  head.push_back(0);
+  num.push_back(0);
+  origin.push_back({});
+  size_t len = head.size() * kLen;
+  t.resize(len);
+  x.resize(len);
+  y.resize(len);
+  w.resize(len);
+  h.resize(len);
+  return s;
+}
 
-  //  predict state transition
-  X_ = A_ * X_;
+void Tracker::Paths::give(unsigned int s) {
+  free.push_back(s);
+}
 
-  //  update error matrix
-  P_ = A_ * (P_ * A_.transpose()) + Q_;
+void Tracker::Paths::add(unsigned int s, std::chrono::steady_clock::time_point at,
+    float bx, float by, float bw, float bh) {
+
+  using namespace std::chrono;
+  size_t base = static_cast<size_t>(s) * kLen;
+  if (num[s] == 0) {
+    origin[s] = at;
+  } else {
+    unsigned int last = base + (head[s] + kLen - 1) % kLen;
+    if (at < origin[s] + milliseconds(t[last] + kStep)) {
+      return;
+    }
+  }
+  unsigned int at_ms = duration_cast<milliseconds>(at - origin[s]).count();
+  size_t k = base + head[s];
+  t[k] = at_ms;
+  x[k] = static_cast<uint16_t>(std::min(std::max(bx, 0.f), 65535.f));
+  y[k] = static_cast<uint16_t>(std::min(std::max(by, 0.f), 65535.f));
+  w[k] = static_cast<uint16_t>(std::min(std::max(bw, 0.f), 65535.f));
+  h[k] = static_cast<uint16_t>(std::min(std::max(bh, 0.f), 65535.f));
+  head[s] = (head[s] + 1) % kLen;
+  num[s] = std::min(num[s] + 1, kLen);
 }
 
-void Tracker::Track::updateMeasure() {
-  //  compute kalman gain
-  auto K_ = P_ * H_.transpose() * (H_ * P_ * H_.transpose() + R_).inverse();
+static void put_varint(std::vector<uint8_t>& out, uint64_t val) {
+  do {
+    uint8_t b = val & 0x7f;
+    val >>= 7;
+    out.push_back(val ? (b | 0x80) : b);
+  } while (val);
+}
 
-  //  fuse new measurement
-  X_ = X_ + K_ * (Z_ - H_ * X_);
+static void put_zigzag(std::vector<uint8_t>& out, int64_t val) {
+  put_varint(out, (static_cast<uint64_t>(val) << 1) ^ static_cast<uint64_t>(val >> 63));
+}
 
-  //  update error matrix
-  P_ = (Eigen::Matrix<double,6,6>::Identity() - K_ * H_) * P_;
+void Tracker::Paths::encode(unsigned int s, std::vector<uint8_t>& out) {
+
+  size_t base = static_cast<size_t>(s) * kLen;
+  unsigned int n = num[s];
+  unsigned int k = (head[s] + kLen - n) % kLen;
+  int64_t pt = t[base + k], px = 0, py = 0, pw = 0, ph = 0;
+  out.clear();
+  put_varint(out, n);
+  for (unsigned int j = 0; j < n; j++, k = (k + 1) % kLen) {
+    size_t at = base + k;
+    put_zigzag(out, static_cast<int64_t>(t[at]) - pt);
+    put_zigzag(out, x[at] - px);
+    put_zigzag(out, y[at] - py);
+    put_zigzag(out, w[at] - pw);
+    put_zigzag(out, h[at] - ph);
+    pt = t[at];
+    px = x[at];
+    py = y[at];
+    pw = w[at];
+    ph = h[at];
+  }
 }
 
-double Tracker::Track::getDistance(double mid_x, double mid_y) {
-  return std::sqrt(std::pow(mid_x - X_(0), 2) + std::pow(mid_y - X_(1), 2));
+std::chrono::steady_clock::time_point Tracker::Paths::first(unsigned int s) {
+  size_t base = static_cast<size_t>(s) * kLen;
+  unsigned int k = (head[s] + kLen - num[s]) % kLen;
+  return origin[s] + std::chrono::milliseconds(t[base + k]);
 }
 
-void Tracker::Track::addTarget(const BoxBuf& box) {
+size_t Tracker::Paths::bytes() {
+  return t.capacity() * sizeof(uint32_t) +
+    (x.capacity() + y.capacity() + w.capacity() + h.capacity()) * sizeof(uint16_t) +
+    origin.capacity() * sizeof(std::chrono::steady_clock::time_point) +
+    (head.capacity() + num.capacity() + free.capacity()) * sizeof(unsigned int);
+}
 
-  stamp = std::chrono::steady_clock::now();
-  x = box.x;
-  y = box.y;
-  w = box.w;
-  h = box.h;
-  double mid_x = x + w / 2.0;
-  double mid_y = y + h / 2.0;
+void Tracker::Ring::add(const std::shared_ptr<const std::vector<float>>& e) {
+  for (unsigned int k = std::min(num, kSize - 1); k > 0; k--) {
+    emb[k] = emb[k - 1];
+  }
+  emb[0] = e;
+  num = std::min(num + 1, kSize);
+}
 
-  if (state_ == Tracker::Track::State::kInit) {
-    X_(2) = (mid_x - X_(0));
-    X_(3) = (mid_y - X_(1));
+float Tracker::Ring::distance(const std::shared_ptr<const std::vector<float>>& e) const {
+  float best = 2.f;
+  if (!e) {
+    return best;
   }
-  updateTime();
+  for (unsigned int k = 0; k < num; k++) {
+    if (emb[k]->size() == e->size()) {
+      best = std::min(best, 1.f - dot_f32(emb[k]->data(), e->data(), e->size()));
+    }
+  }
+  return best;
+}
+
+float Tracker::trackDistance(unsigned int i, float mid_x, float mid_y) {
+  float dx = mid_x - tracks_.px[i];
+  float dy = mid_y - tracks_.py[i];
+  return std::sqrt(dx * dx + dy * dy);
+}
 
-  state_ = Tracker::Track::State::kActive;
+void Tracker::addTarget(unsigned int i, const BoxBuf& box) {
 
-  Z_ << mid_x, mid_y;
-  updateMeasure();
+  tracks_.seen(i, (box.stamp.time_since_epoch().count() != 0) ? 
+    box.stamp : pipeline_now());
+  tracks_.x[i] = box.x;
+  tracks_.y[i] = box.y;
+  tracks_.w[i] = box.w;
+  tracks_.h[i] = box.h;
+  if (box.emb) {
+    tracks_.ring[i].add(box.emb);
+  }
+  tracks_.sample(i);
+  filter(i, box.x + box.w / 2.f, box.y + box.h / 2.f);
+}
+
+void Tracker::filter(unsigned int i, float mid_x, float mid_y) {
+
+  float& px = tracks_.px[i];
+  float& vx = tracks_.vx[i];
+  float& py = tracks_.py[i];
+  float& vy = tracks_.vy[i];
+  float& p00 = tracks_.p00[i];
+  float& p01 = tracks_.p01[i];
+  float& p11 = tracks_.p11[i];
+  float& p22 = tracks_.p22[i];
+
+  if (!tracks_.active[i]) {
+    vx = mid_x - px;
+    vy = mid_y - py;
+  }
+
+  // X = A * X,  P = A * P * A' + Q
+  const float q = process_variance_;
+  px += vx;
+  py += vy;
+  float n00 = p00 + 2.f * p01 + p11 + q;
+  float n01 = p01 + p11;
+  float n11 = p11 + p22 + q;
+  p00 = n00;
+  p01 = n01;
+  p11 = n11;
+  p22 = q;
+
+  tracks_.touched[i] = 1;
+  tracks_.active[i] = 1;
+
+  // K = P * H' / (H * P * H' + R)
+  float inv = 1.f / (p00 + measure_variance_);
+  float k0 = p00 * inv;
+  float k1 = p01 * inv;
+
+  // X = X + K * (Z - H * X)
+  float ex = mid_x - px;
+  float ey = mid_y - py;
+  px += k0 * ex;
+  vx += k1 * ex;
+  py += k0 * ey;
+  vy += k1 * ey;
+
+  // P = (I - K * H) * P
+  float o01 = p01;
+  p00 -= k0 * p00;
+  p01 -= k0 * o01;
+  p11 -= k1 * o01;
 }
 
 
@@ -137,44 +388,189 @@ Tracker::~Tracker() {
 
 std::unique_ptr<Tracker> Tracker::create(
     unsigned int yield_time, bool quiet, 
-    Encoder* enc, double max_dist, unsigned int max_time) {
+    Encoder* enc, double max_dist, unsigned int max_time,
+    Tracker::Match match, float high_score) {
   auto obj = std::unique_ptr<Tracker>(new Tracker(yield_time));
-  obj->init(quiet, enc, max_dist, max_time);
+  obj->init(quiet, enc, max_dist, max_time, match, high_score);
   return obj;
 }
 
-bool Tracker::init(bool quiet, Encoder* enc, double max_dist, unsigned int max_time) {
+bool Tracker::init(bool quiet, Encoder* enc, double max_dist, unsigned int max_time,
+    Tracker::Match match, float high_score) {
 
   quiet_ = quiet;
   enc_ = enc;
+  tap_ = nullptr;
+  fuse_ = nullptr;
+  rul_ = nullptr;
+  cnt_ = nullptr;
+  pub_ = nullptr;
+  evt_ = nullptr;
+  jnl_ = nullptr;
   max_dist_ = max_dist;
   max_time_ = max_time;
+  match_ = match;
+  high_score_ = (match_ == Tracker::Match::kIou) ? high_score : 0.f;
+  cell_ = max_dist_;
+
+  step_stamp_ = {};
+  step_sec_ = 0.f;
 
   track_cnt_ = 0;
+  gated_cnt_ = 0;
+  par_cnt_ = 0;
+  ambiguous_ = 0;
+  reid_cnt_ = 0;
+  path_cnt_ = 0;
+  restore_cnt_ = 0;
+  state_at_ = {};
+  emb_stamp_ = {};
+  post_dirty_ = true;
 
   tracker_on_ = false;
   
   return true; 
 }
 
+bool Tracker::addMessage(MotionBuf& map) {
+  return vec_chan_.push(map);
+}
+
+bool Tracker::addMessage(FrameBuf& frame) {
+
+  if (!flow_) {
+    return false;
+  }
+  bool res = frame_chan_.push(frame);
+  wake();
+  return res;
+}
+
 bool Tracker::addMessage(std::shared_ptr<std::vector<BoxBuf>>& boxes) {
 
-  std::unique_lock<std::timed_mutex> lck(targets_lock_, std::defer_lock);
+  bool res = boxes_chan_.push(boxes);
+  wake();
+  return res;
+}
+
+bool Tracker::predict(const TrackBuf& track, std::chrono::steady_clock::time_point at,
+    unsigned int width, unsigned int height, TrackBuf& out) {
 
-  if (!lck.try_lock_for(std::chrono::microseconds(
-          Listener<std::shared_ptr<std::vector<BoxBuf>>>::timeout_))) {
-    dbgMsg("encoder target lock busy\n");
+  out = track;
+
+  using namespace std::chrono;
+  if (at <= track.stamp || track.stamp.time_since_epoch().count() == 0) {
+    return true;
+  }
+  float lead = duration_cast<duration<float>>(
+      std::min(at - track.stamp, steady_clock::duration(milliseconds(max_lead_)))).count();
+
+  float x0 = track.x + track.vx * lead;
+  float y0 = track.y + track.vy * lead;
+  float x1 = std::min(x0 + track.w, static_cast<float>(width));
+  float y1 = std::min(y0 + track.h, static_cast<float>(height));
+  x0 = std::max(x0, 0.f);
+  y0 = std::max(y0, 0.f);
+  if (x1 - x0 < 1.f || y1 - y0 < 1.f) {
     return false;
   }
 
-  // only copy targets types we are tracking
-  targets_.resize(boxes->size());
-  std::copy_if(boxes->begin(), boxes->end(), targets_.begin(),
-      [&](const BoxBuf& box) {
-        return target_types_.find(box.type) != target_types_.end();
-      });
+  out.x = round(x0);
+  out.y = round(y0);
+  out.w = std::min(static_cast<unsigned int>(round(x1 - x0)), width - out.x);
+  out.h = std::min(static_cast<unsigned int>(round(y1 - y0)), height - out.y);
+  return out.w != 0 && out.h != 0;
+}
 
-  return true;
+void Tracker::setHighScore(float high_score) {
+  high_score_ = (match_ == Tracker::Match::kIou) ? high_score : 0.f;
+}
+
+bool Tracker::wantsEmbeddings() {
+  return want_emb_;
+}
+
+void Tracker::setTap(Listener<std::shared_ptr<std::vector<TrackBuf>>>* tap) {
+  tap_ = tap;
+}
+
+void Tracker::setFusion(Listener<std::shared_ptr<std::vector<TrackBuf>>>* fuse) {
+  fuse_ = fuse;
+}
+
+void Tracker::setRules(Rules* rul) {
+  rul_ = rul;
+}
+
+void Tracker::setCounts(Counts* cnt) {
+  cnt_ = cnt;
+}
+
+void Tracker::setState(const std::string& path) {
+  state_ = path;
+}
+
+void Tracker::setFlow(unsigned int width, unsigned int height, unsigned int pix_fmt) {
+  frame_width_ = width;
+  frame_height_ = height;
+  flow_ = Flow::create(width, height, pix_fmt);
+}
+
+void Tracker::setPublisher(Publisher* pub) {
+  pub_ = pub;
+}
+
+void Tracker::setEvents(Events* evt) {
+  evt_ = evt;
+}
+
+void Tracker::setJournal(Journal* jnl) {
+  jnl_ = jnl;
+}
+
+unsigned int Tracker::pending() {
+  return tracker_on_ ? boxes_chan_.size() + frame_chan_.size() + (stepping_ ? 1 : 0) : 0;
+}
+
+void Tracker::metrics(Exposition& out, const std::string& labels) {
+  out.counter("detector_tracks_total", "tracks started", labels, track_cnt_);
+  out.counter("detector_tracks_reidentified_total", "lost tracks brought back on appearance",
+      labels, reid_cnt_);
+  out.counter("detector_batch_misses_total", "batches allocated because the pool was empty",
+      labels, track_pool_.misses());
+  out.gauge("detector_queue_depth", "messages waiting for the stage", labels,
+      boxes_chan_.size());
+  out.counter("detector_queue_drops_total", "messages the stage's queue dropped", labels,
+      boxes_chan_.drops());
+  if (flow_) {
+    out.counter("detector_flow_steps_total", "frames the tracks followed by optical flow", labels,
+        flow_cnt_);
+    out.counter("detector_flow_lost_total", "tracks optical flow couldn't follow on a frame", labels,
+        flow_lost_cnt_);
+    out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"flow\"", differ_flow_.hist);
+  }
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"associate\"", differ_associate_.hist);
+  out.summary("detector_latency_us", "stage latency percentiles", labels + ",step=\"capture\"", differ_late_.hist);
+}
+
+void Tracker::footprint(Footprint& out) {
+  out.add("tracks", track_num_, track_bytes_);
+  out.add("track_batches", track_pool_.size(), track_pool_.bytes());
+}
+
+Tracker::Stats Tracker::stats() {
+  Tracker::Stats st;
+  st.tracks = track_cnt_;
+  st.associate = differ_associate_.hist.percentiles();
+  st.predict = differ_touch_.hist.percentiles();
+  st.cleanup = differ_cleanup_.hist.percentiles();
+  st.post = differ_post_.hist.percentiles();
+  return st;
+}
+
+std::shared_ptr<std::vector<TrackBuf>> Tracker::getTracks() {
+  std::unique_lock<std::mutex> lck(posted_lock_);
+  return posted_;
 }
 
 bool Tracker::waitingToRun() {
@@ -182,83 +578,372 @@ bool Tracker::waitingToRun() {
   if (!tracker_on_) {
 
     differ_tot_.begin();
+    post_dirty_ = true;
+    expire_at_ = std::chrono::steady_clock::time_point::max();
+    if (!state_.empty() && track_cnt_ == 0 && tracks_.size() == 0) {
+      restoreState();
+    }
     tracker_on_ = true;
   }
 
   return true;
 }
 
+void Tracker::updateStep(std::chrono::steady_clock::time_point stamp) {
+
+  // smoothed time between filter steps, gaps with nothing to track don't count
+  using namespace std::chrono;
+  if (step_stamp_.time_since_epoch().count() != 0 && stamp > step_stamp_ &&
+      stamp - step_stamp_ < milliseconds(max_lead_)) {
+    float sec = duration_cast<duration<float>>(stamp - step_stamp_).count();
+    step_sec_ = (step_sec_ > 0.f) ? step_sec_ + (sec - step_sec_) / 8.f : sec;
+  }
+  step_stamp_ = stamp;
+}
+
 bool Tracker::untouchTracks() {
 
   differ_untouch_.begin();
 
-  std::for_each(tracks_.begin(), tracks_.end(), 
-      [](Tracker::Track& track) {
-        track.touched = false;
-        });
+  std::fill(tracks_.touched.begin(), tracks_.touched.end(), 0);
 
   differ_untouch_.end();
 
   return true;
 }
 
-bool Tracker::associateTracks() {
+int64_t Tracker::cellKey(double x, double y) {
+  int64_t cx = static_cast<int64_t>(std::floor(x / cell_));
+  int64_t cy = static_cast<int64_t>(std::floor(y / cell_));
+  // shifted unsigned, a cell left of or above the origin is negative
+  return static_cast<int64_t>((static_cast<uint64_t>(cy) << 32) ^
+      (static_cast<uint64_t>(cx) & 0xffffffff));
+}
+
+unsigned int Tracker::findRoot(unsigned int n) {
+  while (parent_[n] != n) {
+    parent_[n] = parent_[parent_[n]];
+    n = parent_[n];
+  }
+  return n;
+}
 
-  if (tracks_.size() && targets_.size()) {
+double Tracker::trackCost(unsigned int i, const BoxBuf& box) {
+  float mid_x = box.x + box.w / 2.f;
+  float mid_y = box.y + box.h / 2.f;
+  if (match_ == Tracker::Match::kDistance) {
+    return trackDistance(i, mid_x, mid_y);
+  }
 
-    differ_associate_.begin();
+  // 1 - iou of the predicted box and the target
+  float tw = tracks_.w[i];
+  float th = tracks_.h[i];
+  float tx = tracks_.px[i] - tw / 2.f;
+  float ty = tracks_.py[i] - th / 2.f;
+  float iw = std::min(tx + tw, static_cast<float>(box.x + box.w)) - 
+    std::max(tx, static_cast<float>(box.x));
+  float ih = std::min(ty + th, static_cast<float>(box.y + box.h)) - 
+    std::max(ty, static_cast<float>(box.y));
+  if (iw <= 0.f || ih <= 0.f) {
+    return 1.0;
+  }
+  float inter = iw * ih;
+  return 1.0 - inter / (tw * th + static_cast<float>(box.w * box.h) - inter);
+}
+
+bool Tracker::trackGate(unsigned int i, const BoxBuf& box) {
+
+  // the filter's noise is in units of the centre noise, a common scale
+  // leaves its gains alone, so the innovation covariance in pixels is
+  // H * P * H' + R at the prediction, times that unit squared
+  float unit = centre_noise_ * std::max(1.f,
+      std::min(tracks_.w[i], tracks_.h[i]) * 0.5f + std::min(box.w, box.h) * 0.5f);
+  float s = tracks_.p00[i] + 2.f * tracks_.p01[i] + tracks_.p11[i] +
+    process_variance_ + measure_variance_;
+  float pred_x = tracks_.px[i] + (tracks_.active[i] ? tracks_.vx[i] : 0.f);
+  float pred_y = tracks_.py[i] + (tracks_.active[i] ? tracks_.vy[i] : 0.f);
+  float ex = box.x + box.w / 2.f - pred_x;
+  float ey = box.y + box.h / 2.f - pred_y;
+
+  // both axes share the covariance, so d^2 = e' * S^-1 * e is a sum
+  return (ex * ex + ey * ey) <= gate_chi2_ * s * unit * unit;
+}
+
+void Tracker::solveGroup(Tracker::Group& g) {
+
+  unsigned int grows = g.tracks.size();
+  unsigned int gcols = g.targets.size();
+  g.mat = g.assign.costs(grows, gcols);
+  std::fill(g.mat, g.mat + grows * gcols, 1.0e7);
+  for (unsigned int e = g.e0; e < g.e1; e++) {
+    unsigned int r = std::lower_bound(g.tracks.begin(), g.tracks.end(), 
+        edges_[e].track) - g.tracks.begin();
+    unsigned int c = std::lower_bound(g.targets.begin(), g.targets.end(), 
+        edges_[e].target) - g.targets.begin();
+    g.mat[r * gcols + c] = edges_[e].dist;
+  }
+  g.assign.solve(g.assignments);
+}
+
+bool Tracker::matchTargets(std::vector<BoxBuf>& targets, bool untouched, 
+    double max_cost) {
+
+  unsigned int rows = tracks_.size();
+  unsigned int cols = targets.size();
+
+  // centre distance gates on max_dist_, overlap on the largest box
+  cell_ = max_dist_;
+  if (match_ == Tracker::Match::kIou) {
+    cell_ = 1.0;
+    for (unsigned int i = 0; i < rows; i++) {
+      cell_ = std::max(cell_, static_cast<double>(std::max(tracks_.w[i], tracks_.h[i])));
+    }
+    for (auto& b : targets) {
+      cell_ = std::max(cell_, static_cast<double>(std::max(b.w, b.h)));
+    }
+  }
+
+  // bucket track predictions into cell_ sized cells
+  grid_.clear();
+  for (unsigned int i = 0; i < rows; i++) {
+    if (untouched && tracks_.touched[i]) {
+      continue;
+    }
+    grid_.push_back(std::make_pair(cellKey(tracks_.px[i], tracks_.py[i]), i));
+  }
+  if (grid_.empty()) {
+    return true;
+  }
+  std::sort(grid_.begin(), grid_.end());
 
-    // compute cost matrix
-    std::vector<std::vector<double>> mat(tracks_.size(),
-        std::vector<double>(targets_.size(), 1.0e7));
-    for (unsigned int k = 0; k < targets_.size(); k++) {
-      double mid_x = targets_[k].x + targets_[k].w / 2.0;
-      double mid_y = targets_[k].y + targets_[k].h / 2.0;
-      for (unsigned int i = 0; i < tracks_.size(); i++) {
-        if (tracks_[i].type == targets_[k].type) {
-          mat[i][k] = tracks_[i].getDistance(mid_x, mid_y);
+  // only tracks in the 3x3 cells around a target can reach it
+  edges_.clear();
+  parent_.resize(rows + cols);
+  for (unsigned int n = 0; n < rows + cols; n++) {
+    parent_[n] = n;
+  }
+  for (unsigned int k = 0; k < cols; k++) {
+    double mid_x = targets[k].x + targets[k].w / 2.0;
+    double mid_y = targets[k].y + targets[k].h / 2.0;
+    for (int dy = -1; dy <= 1; dy++) {
+      for (int dx = -1; dx <= 1; dx++) {
+        int64_t key = cellKey(mid_x + dx * cell_, mid_y + dy * cell_);
+        auto it = std::lower_bound(grid_.begin(), grid_.end(), 
+            std::make_pair(key, 0u));
+        for (; it != grid_.end() && it->first == key; it++) {
+          unsigned int i = it->second;
+          if (tracks_.type[i] != targets[k].type) {
+            continue;
+          }
+          if (!trackGate(i, targets[k])) {
+            gated_cnt_++;
+            continue;
+          }
+          double cost = trackCost(i, targets[k]);
+          if (cost <= max_cost && targets[k].emb && tracks_.ring[i].num) {
+            float app = std::min(tracks_.ring[i].distance(targets[k].emb), 1.f);
+            cost = (1.0 - appear_weight_) * cost + appear_weight_ * app * max_cost;
+          }
+          if (cost <= max_cost) {
+            edges_.push_back(Tracker::Edge{i, k, cost});
+            parent_[findRoot(i)] = findRoot(rows + k);
+          }
         }
       }
     }
+  }
+
+  // a group never spans classes, only pairs of a type link, so sorting
+  // by class then root lays out each class's groups in turn
+  std::sort(edges_.begin(), edges_.end(), 
+      [&](const Tracker::Edge& a, const Tracker::Edge& b) {
+        return std::make_pair(tracks_.type[a.track], findRoot(a.track)) <
+          std::make_pair(tracks_.type[b.track], findRoot(b.track));
+      });
+  unsigned int num = 0;
+  for (unsigned int e0 = 0; e0 < edges_.size(); ) {
+    unsigned int root = findRoot(edges_[e0].track);
+    unsigned int e1 = e0;
+    while (e1 < edges_.size() && findRoot(edges_[e1].track) == root) {
+      e1++;
+    }
+
+    // local indices for this group
+    if (groups_.size() <= num) {
+      groups_.emplace_back();
+    }
+    Tracker::Group& g = groups_[num++];
+    g.e0 = e0;
+    g.e1 = e1;
+    g.tracks.clear();
+    g.targets.clear();
+    for (unsigned int e = e0; e < e1; e++) {
+      g.tracks.push_back(edges_[e].track);
+      g.targets.push_back(edges_[e].target);
+    }
+    std::sort(g.tracks.begin(), g.tracks.end());
+    g.tracks.erase(std::unique(g.tracks.begin(), g.tracks.end()), g.tracks.end());
+    std::sort(g.targets.begin(), g.targets.end());
+    g.targets.erase(std::unique(g.targets.begin(), g.targets.end()), g.targets.end());
+    if (g.tracks.size() > 1 || g.targets.size() > 1) {
+      ambiguous_++;
+    }
+
+    e0 = e1;
+  }
+
+  // the big groups are solved on the pool, each on its own scratch,
+  // the small ones aren't worth handing out
+  big_.clear();
+  for (unsigned int n = 0; n < num; n++) {
+    if (groups_[n].tracks.size() * groups_[n].targets.size() >= par_cells_) {
+      big_.push_back(n);
+    } else {
+      solveGroup(groups_[n]);
+    }
+  }
+  if (!big_.empty()) {
+    par_cnt_ += big_.size();
+    Pool::stripes(big_.size(), 1, [&](unsigned int begin, unsigned int end) {
+      for (unsigned int b = begin; b < end; b++) {
+        solveGroup(groups_[big_[b]]);
+      }
+    });
+  }
 
-    // assign targets to tracks
-    HungarianAlgorithm hung_algo;
-    vector<int> assignments;
-    hung_algo.Solve(mat, assignments);
-
-    // add targets to tracks
-    for (unsigned int i = 0; i < assignments.size(); i++) {
-      int k = assignments[i];
-      double mid_x = targets_[k].x + targets_[k].w / 2.0;
-      double mid_y = targets_[k].y + targets_[k].h / 2.0;
-      if (tracks_[i].getDistance(mid_x, mid_y) <= max_dist_) {
-        tracks_[i].addTarget(targets_[k]);
-        targets_[k].id = std::numeric_limits<unsigned int>::max();
+  // add targets to tracks, gaps in a group stay unassigned
+  for (unsigned int n = 0; n < num; n++) {
+    Tracker::Group& g = groups_[n];
+    unsigned int gcols = g.targets.size();
+    for (unsigned int r = 0; r < g.assignments.size(); r++) {
+      int c = g.assignments[r];
+      if (c < 0 || g.mat[r * gcols + c] > max_cost) {
+        continue;
       }
+      unsigned int i = g.tracks[r];
+      unsigned int k = g.targets[c];
+      addTarget(i, targets[k]);
+      targets[k].id = std::numeric_limits<unsigned int>::max();
     }
+  }
+
+  // remove used targets
+  targets.erase(
+      std::remove_if(targets.begin(), targets.end(),
+        [&] (const BoxBuf& b) {
+          return b.id == std::numeric_limits<unsigned int>::max();
+        }), 
+      targets.end());
+
+  return true;
+}
+
+bool Tracker::associateTracks() {
 
-    // remove used targets
-    targets_.erase(
-        std::remove_if(targets_.begin(), targets_.end(),
-          [&] (const BoxBuf& b) {
-            return b.id == std::numeric_limits<unsigned int>::max();
-          }), 
-        targets_.end());
+  if (tracks_.size() && (targets_.size() || low_targets_.size())) {
+
+    differ_associate_.begin();
+
+    if (match_ == Tracker::Match::kDistance) {
+      matchTargets(targets_, false, max_dist_);
+    } else {
+
+      // high scores first, then low scores keep the tracks they left over
+      matchTargets(targets_, false, 1.0 - min_iou_);
+      if (low_targets_.size()) {
+        matchTargets(low_targets_, true, 1.0 - min_low_iou_);
+      }
+    }
 
     differ_associate_.end();
   }
 
+  // low scores never start tracks
+  low_targets_.clear();
+
   return true;
 }
 
+unsigned int Tracker::revive(const BoxBuf& box, Tracker::Ring& ring) {
+
+  // the lost track of the type that looks most like the box, if close enough
+  if (!box.emb) {
+    return 0;
+  }
+  unsigned int best = lost_.size();
+  float best_dist = reid_dist_;
+  for (unsigned int n = 0; n < lost_.size(); n++) {
+    if (lost_[n].type == box.type) {
+      float dist = lost_[n].ring.distance(box.emb);
+      if (dist < best_dist) {
+        best = n;
+        best_dist = dist;
+      }
+    }
+  }
+  if (best == lost_.size()) {
+    return 0;
+  }
+  unsigned int id = lost_[best].id;
+  ring = lost_[best].ring;
+  lost_.erase(lost_.begin() + best);
+  reid_cnt_++;
+  return id;
+}
+
+void Tracker::priorVelocity(unsigned int i, const BoxBuf& box) {
+
+  if (!map_.vec || map_.vec->size() < map_.cols * map_.rows * 2 ||
+      step_sec_ <= 0.f || map_.fps == 0 ||
+      box.stamp - map_.stamp > std::chrono::milliseconds(map_fresh_)) {
+    return;
+  }
+
+  // the mean vector of the macroblocks under the box, the vectors point
+  // back to where the block came from so the box moves the other way
+  unsigned int x0 = std::min(box.x / 16, map_.cols);
+  unsigned int y0 = std::min(box.y / 16, map_.rows);
+  unsigned int x1 = std::min((box.x + box.w + 15) / 16, map_.cols);
+  unsigned int y1 = std::min((box.y + box.h + 15) / 16, map_.rows);
+  int sx = 0, sy = 0, num = 0;
+  for (unsigned int r = y0; r < y1; r++) {
+    const int8_t* v = map_.vec->data() + (r * map_.cols + x0) * 2;
+    for (unsigned int c = x0; c < x1; c++, v += 2) {
+      sx += v[0];
+      sy += v[1];
+      num++;
+    }
+  }
+  if (num == 0) {
+    return;
+  }
+  float scale = -static_cast<float>(map_.fps) * step_sec_ / num;
+  tracks_.vx[i] = sx * scale;
+  tracks_.vy[i] = sy * scale;
+}
+
 bool Tracker::createNewTracks() {
 
   differ_create_.begin();
 
+  MotionBuf map;
+  if (vec_chan_.pop(map)) {
+    map_ = map;
+  }
+
   if (targets_.size()) {
+    Tracker::Ring ring;
     std::for_each(targets_.begin(), targets_.end(),
         [&](const BoxBuf& b) {
-          tracks_.push_back(Tracker::Track(++track_cnt_, b));
+          unsigned int id = revive(b, ring);
+          if (id) {
+            tracks_.add(id, b, initial_error_);
+            tracks_.ring.back() = ring;
+            tracks_.ring.back().add(b.emb);
+          } else {
+            tracks_.add(++track_cnt_, b, initial_error_);
+          }
+          priorVelocity(tracks_.size() - 1, b);
         });
   }
 
@@ -272,33 +957,70 @@ bool Tracker::createNewTracks() {
 bool Tracker::touchTracks() {
   differ_touch_.begin();
 
-  std::for_each(tracks_.begin(), tracks_.end(),
-      [&](Tracker::Track& track) {
-        if (!track.touched) {
-          track.updateTime();
-        }
-      });
+  // predict every untouched track in one pass, selects instead of
+  // branches so the loop vectorizes
+  const float q = process_variance_;
+  unsigned int num = tracks_.size();
+  const uint8_t* touched = tracks_.touched.data();
+  float* px = tracks_.px.data();
+  float* vx = tracks_.vx.data();
+  float* py = tracks_.py.data();
+  float* vy = tracks_.vy.data();
+  float* p00 = tracks_.p00.data();
+  float* p01 = tracks_.p01.data();
+  float* p11 = tracks_.p11.data();
+  float* p22 = tracks_.p22.data();
+  for (unsigned int i = 0; i < num; i++) {
+    bool keep = touched[i];
+    float n00 = p00[i] + 2.f * p01[i] + p11[i] + q;
+    float n01 = p01[i] + p11[i];
+    float n11 = p11[i] + p22[i] + q;
+    px[i]  = keep ? px[i]  : px[i] + vx[i];
+    py[i]  = keep ? py[i]  : py[i] + vy[i];
+    p00[i] = keep ? p00[i] : n00;
+    p01[i] = keep ? p01[i] : n01;
+    p11[i] = keep ? p11[i] : n11;
+    p22[i] = keep ? p22[i] : q;
+  }
+  std::fill(tracks_.touched.begin(), tracks_.touched.end(), 1);
 
   differ_touch_.end();
   return true;
 }
 
-bool Tracker::cleanupTracks() {
+bool Tracker::cleanupTracks(std::chrono::steady_clock::time_point now) {
 
   differ_cleanup_.begin();
 
-  auto now = std::chrono::steady_clock::now();
+  // remove old tracks, older than max_time_ by a whole msec as before
+  tracks_.expire(now, std::chrono::milliseconds(max_time_ + 1), expire_at_,
+      [&](unsigned int i) {
+        if (tracks_.ring[i].num) {
+          lost_.push_back(Tracker::Lost{tracks_.id[i], tracks_.type[i],
+              tracks_.stamp[i], tracks_.ring[i]});
+        }
 
-  // remove old tracks
-  tracks_.erase(
-      std::remove_if(tracks_.begin(), tracks_.end(),
-        [&] (const Tracker::Track& t) {
-          using namespace std::chrono;
-          duration<unsigned int,std::milli> span = 
-            duration_cast<duration<unsigned int,std::milli>>(now - t.stamp);
-          return max_time_ < span.count();
-        }), 
-      tracks_.end());
+        // the closed path, for the events
+        unsigned int s = tracks_.path[i];
+        if (evt_ && tracks_.paths.num[s] > 1) {
+          Events::Path path;
+          path.id = tracks_.id[i];
+          path.type = tracks_.type[i];
+          path.stamp = tracks_.paths.first(s);
+          tracks_.paths.encode(s, path.data);
+          evt_->addMessage(path);
+          path_cnt_++;
+        }
+      });
+
+  // lost tracks only come back for a while, the oldest go first
+  lost_.erase(std::remove_if(lost_.begin(), lost_.end(),
+        [&](const Tracker::Lost& l) {
+          return now - l.stamp > std::chrono::milliseconds(lost_time_);
+        }), lost_.end());
+  if (lost_.size() > lost_max_) {
+    lost_.erase(lost_.begin(), lost_.begin() + (lost_.size() - lost_max_));
+  }
 
   differ_cleanup_.end();
 
@@ -309,40 +1031,380 @@ bool Tracker::postTracks() {
 
   differ_post_.begin();
 
-  auto tracks = std::make_shared<std::vector<TrackBuf>>();
+  auto tracks = track_pool_.get();
+
+  tracks->reserve(tracks_.size());
+  float rate = (step_sec_ > 0.f) ? 1.f / step_sec_ : 0.f;
+  for (unsigned int i = 0; i < tracks_.size(); i++) {
+    tracks->push_back(TrackBuf(
+          tracks_.type[i], tracks_.id[i],
+          round(tracks_.x[i]), round(tracks_.y[i]), 
+          round(tracks_.w[i]), round(tracks_.h[i]),
+          tracks_.stamp[i]));
+    tracks->back().cls = tracks_.cls[i];
+    tracks->back().vx = tracks_.vx[i] * rate;
+    tracks->back().vy = tracks_.vy[i] * rate;
+  }
 
-  std::for_each(tracks_.begin(), tracks_.end(),
-      [&](const Tracker::Track& t) {
-        tracks->push_back(TrackBuf(
-              t.type, t.id,
-              round(t.x), round(t.y), round(t.w), round(t.h)));
-      });
+  {
+    std::unique_lock<std::mutex> lck(posted_lock_);
+    posted_ = tracks;
+  }
 
   if (enc_) {
     if (!enc_->addMessage(tracks)) {
       dbgMsg("encoder busy");
     }
   }
+  if (pub_) {
+    pub_->addMessage(tracks);
+  }
+  if (evt_) {
+    evt_->addMessage(tracks);
+  }
+  if (jnl_) {
+    jnl_->addMessage(tracks);
+  }
+  if (tap_) {
+    tap_->addMessage(tracks);
+  }
+  if (fuse_) {
+    fuse_->addMessage(tracks);
+  }
+  if (rul_) {
+    rul_->addMessage(tracks);
+  }
+  if (cnt_) {
+    cnt_->addMessage(tracks);
+  }
 
   differ_post_.end();
   return true;
 }
 
-bool Tracker::running() {
+bool Tracker::step(std::shared_ptr<std::vector<BoxBuf>>& boxes,
+    std::chrono::steady_clock::time_point now) {
 
-  if (tracker_on_) {
+  // only copy targets types we are tracking
+  if (boxes != nullptr) {
+    targets_.clear();
+    low_targets_.clear();
+    for (auto& box : *boxes) {
+      if (target_types_.find(box.type) != target_types_.end()) {
+        if (box.score >= high_score_) {
+          targets_.push_back(box);
+        } else {
+          low_targets_.push_back(box);
+        }
+      }
+    }
+  } else {
+    targets_.clear();
+    low_targets_.clear();
+  }
 
-    std::unique_lock<std::timed_mutex> lck(targets_lock_);
+  if (targets_.size() != 0 || low_targets_.size() != 0) {
+
+    // capture to tracking
+    auto stamp = targets_.size() ? 
+        targets_.front().stamp : low_targets_.front().stamp;
+    auto id = targets_.size() ? targets_.front().id : low_targets_.front().id;
+    Trace::Scope trace(Trace::Hop::kTrack, stamp, id);
+    PROBE_SCOPE(track, probe_us(stamp), id, targets_.size() + low_targets_.size(),
+        tracks_.size());
+    differ_late_.begin(stamp);
+
+    // with the flow stepping the tracks, a late detection isn't a step
+    bool flow = flowFresh(stamp);
+    if (!flow) {
+      updateStep(stamp);
+    } else {
+      drift(stamp, -1.f);
+    }
 
-    if (targets_.size() != 0) {
-      untouchTracks();
-      associateTracks();
-      createNewTracks();
-      touchTracks();
+    ambiguous_ = 0;
+    untouchTracks();
+    associateTracks();
+    createNewTracks();
+    touchTracks();
+    if (flow) {
+      drift(stamp, 1.f);
     }
 
-    cleanupTracks();
+    differ_late_.end();
+    post_dirty_ = true;
+  }
+
+  // appearance only on pairings with a choice, a new track's first look,
+  // lost tracks that could come back and a refresh now and then
+  if (boxes != nullptr) {
+    for (auto& box : *boxes) {
+      if (box.emb) {
+        emb_stamp_ = now;
+        break;
+      }
+    }
+    bool unseen = std::any_of(tracks_.ring.begin(), tracks_.ring.end(),
+        [](const Tracker::Ring& r) { return r.num == 0; });
+    want_emb_ = ambiguous_ != 0 || unseen || !lost_.empty() ||
+      now - emb_stamp_ > std::chrono::milliseconds(refresh_time_);
+  }
+
+  // between batches only the expiry of the oldest track needs a look
+  unsigned int num = tracks_.size();
+  if (boxes != nullptr || now >= expire_at_) {
+    cleanupTracks(now);
+    cycle_cnt_++;
+  }
+
+  // nothing new, the receivers still have the last ones
+  if (post_dirty_ || num != tracks_.size()) {
     postTracks();
+    post_dirty_ = false;
+  }
+  track_num_ = tracks_.size();
+  track_bytes_ = tracks_.bytes();
+
+  if (!state_.empty() && now - state_at_ >= std::chrono::milliseconds(state_time_)) {
+    saveState(now);
+  }
+
+  return true;
+}
+
+// the state file is a header and then a record per track, stamps are kept
+// as an age at the wall clock time it was written, since the steady clock
+// starts over with the process
+class StateHeader {
+  public:
+    uint32_t magic;
+    uint32_t version;
+    uint32_t track_cnt;
+    uint32_t num;
+    int64_t wall_ms;
+    float step_sec;
+    uint32_t pad;
+};
+
+class StateTrack {
+  public:
+    uint32_t id;
+    uint32_t type;
+    uint32_t age_ms;
+    uint32_t active;
+    float x, y, w, h;
+    float px, vx, py, vy;
+    float p00, p01, p11, p22;
+};
+
+bool Tracker::saveState(std::chrono::steady_clock::time_point now) {
+
+  using namespace std::chrono;
+  state_at_ = now;
+  StateHeader hdr;
+  hdr.magic = state_magic_;
+  hdr.version = state_version_;
+  hdr.track_cnt = track_cnt_;
+  hdr.num = tracks_.size();
+  hdr.wall_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+  hdr.step_sec = step_sec_;
+  hdr.pad = 0;
+
+  std::vector<unsigned char> buf(sizeof(hdr) + hdr.num * sizeof(StateTrack));
+  memcpy(buf.data(), &hdr, sizeof(hdr));
+  auto recs = reinterpret_cast<StateTrack*>(buf.data() + sizeof(hdr));
+  for (unsigned int i = 0; i < hdr.num; i++) {
+    StateTrack& r = recs[i];
+    r.id = tracks_.id[i];
+    r.type = static_cast<uint32_t>(tracks_.type[i]);
+    r.age_ms = (now > tracks_.stamp[i]) ?
+      duration_cast<milliseconds>(now - tracks_.stamp[i]).count() : 0;
+    r.active = tracks_.active[i];
+    r.x = tracks_.x[i];
+    r.y = tracks_.y[i];
+    r.w = tracks_.w[i];
+    r.h = tracks_.h[i];
+    r.px = tracks_.px[i];
+    r.vx = tracks_.vx[i];
+    r.py = tracks_.py[i];
+    r.vy = tracks_.vy[i];
+    r.p00 = tracks_.p00[i];
+    r.p01 = tracks_.p01[i];
+    r.p11 = tracks_.p11[i];
+    r.p22 = tracks_.p22[i];
+  }
+
+  // a restart only ever reads a whole file
+  if (!Storage::save(state_, buf.data(), buf.size(), false)) {
+    dbgMsg("failed: write %s\n", state_.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool Tracker::restoreState() {
+
+  FILE* fd = fopen(state_.c_str(), "rb");
+  if (fd == nullptr) {
+    return false;
+  }
+  StateHeader hdr;
+  std::vector<StateTrack> recs;
+  bool res = fread(&hdr, sizeof(hdr), 1, fd) == 1 &&
+    hdr.magic == state_magic_ && hdr.version == state_version_ && hdr.num < 65536;
+  if (res) {
+    recs.resize(hdr.num);
+    res = recs.empty() || fread(recs.data(), sizeof(StateTrack), recs.size(), fd) == recs.size();
+  }
+  fclose(fd);
+  if (!res) {
+    dbgMsg("failed: read %s\n", state_.c_str());
+    return false;
+  }
+
+  // ids carry on from where they were, tracks older than the expiry by
+  // the time we are back are left to go
+  using namespace std::chrono;
+  int64_t wall_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+  int64_t gone_ms = std::max<int64_t>(wall_ms - hdr.wall_ms, 0);
+  auto now = steady_clock::now();
+  track_cnt_ = std::max(track_cnt_, hdr.track_cnt);
+  step_sec_ = hdr.step_sec;
+  for (auto& r : recs) {
+    int64_t age = gone_ms + r.age_ms;
+    if (age > static_cast<int64_t>(max_time_) || r.type > static_cast<uint32_t>(BoxBuf::Type::kVehicle) ||
+        tracks_.slot.count(r.id)) {
+      continue;
+    }
+    BoxBuf box(static_cast<BoxBuf::Type>(r.type), r.id, r.x, r.y, r.w, r.h,
+        now - milliseconds(age));
+    tracks_.add(r.id, box, initial_error_);
+    unsigned int i = tracks_.size() - 1;
+    tracks_.x[i] = r.x;
+    tracks_.y[i] = r.y;
+    tracks_.w[i] = r.w;
+    tracks_.h[i] = r.h;
+    tracks_.touched[i] = 0;
+    tracks_.active[i] = r.active;
+    tracks_.px[i] = r.px;
+    tracks_.vx[i] = r.vx;
+    tracks_.py[i] = r.py;
+    tracks_.vy[i] = r.vy;
+    tracks_.p00[i] = r.p00;
+    tracks_.p01[i] = r.p01;
+    tracks_.p11[i] = r.p11;
+    tracks_.p22[i] = r.p22;
+    restore_cnt_++;
+  }
+  expire_at_ = now;
+  state_at_ = now;
+  return true;
+}
+
+bool Tracker::flowFresh(std::chrono::steady_clock::time_point stamp) {
+  return flow_ && flow_stamp_.time_since_epoch().count() != 0 &&
+    flow_stamp_ > stamp && flow_stamp_ - stamp < std::chrono::milliseconds(max_lead_);
+}
+
+void Tracker::drift(std::chrono::steady_clock::time_point since, float sign) {
+
+  // the tracks are the ones the flow moved, by id as some may have gone
+  for (auto& d : drifts_) {
+    if (d.stamp <= since) {
+      continue;
+    }
+    for (unsigned int k = 0; k < d.id.size(); k++) {
+      auto it = tracks_.slot.find(d.id[k]);
+      if (it == tracks_.slot.end()) {
+        continue;
+      }
+      unsigned int i = it->second;
+      tracks_.x[i] += sign * d.dx[k];
+      tracks_.y[i] += sign * d.dy[k];
+      tracks_.px[i] += sign * d.dx[k];
+      tracks_.py[i] += sign * d.dy[k];
+    }
+  }
+}
+
+bool Tracker::flowStep(FrameBuf& frame) {
+
+  auto stamp = (frame.stamp.time_since_epoch().count() != 0) ?
+    frame.stamp : pipeline_now();
+  bool ready = flow_->add(frame);
+  frame = FrameBuf();
+  if (!ready || tracks_.size() == 0) {
+    return true;
+  }
+
+  differ_flow_.begin();
+  updateStep(stamp);
+  untouchTracks();
+  Tracker::Drift d;
+  d.stamp = stamp;
+  for (unsigned int i = 0; i < tracks_.size(); i++) {
+    float dx, dy;
+    if (!flow_->follow(tracks_.x[i], tracks_.y[i], tracks_.w[i], tracks_.h[i], dx, dy)) {
+      flow_lost_cnt_++;
+      continue;
+    }
+    float x = std::min(std::max(tracks_.x[i] + dx, 0.f),
+        std::max(frame_width_ - tracks_.w[i], 0.f));
+    float y = std::min(std::max(tracks_.y[i] + dy, 0.f),
+        std::max(frame_height_ - tracks_.h[i], 0.f));
+    d.id.push_back(tracks_.id[i]);
+    d.dx.push_back(x - tracks_.x[i]);
+    d.dy.push_back(y - tracks_.y[i]);
+    tracks_.x[i] = x;
+    tracks_.y[i] = y;
+    tracks_.sample(i);
+    filter(i, x + tracks_.w[i] / 2.f, y + tracks_.h[i] / 2.f);
+  }
+  touchTracks();
+
+  // only as far back as a detection can be
+  drifts_.push_back(std::move(d));
+  while (!drifts_.empty() &&
+      stamp - drifts_.front().stamp > std::chrono::milliseconds(max_lead_)) {
+    drifts_.pop_front();
+  }
+  flow_stamp_ = stamp;
+  flow_cnt_++;
+  post_dirty_ = true;
+  differ_flow_.end();
+  return true;
+}
+
+bool Tracker::running() {
+
+  if (tracker_on_) {
+    std::shared_ptr<std::vector<BoxBuf>> boxes;
+    auto now = pipeline_now();
+    stepping_ = true;
+    if (boxes_chan_.pop(boxes)) {
+
+      // tracks age by capture time while frames come in
+      if (boxes && !boxes->empty() &&
+          boxes->front().stamp.time_since_epoch().count() != 0) {
+        now = boxes->front().stamp;
+      }
+      step(boxes, now);
+    } else if (now >= expire_at_) {
+      boxes = nullptr;
+      step(boxes, now);
+      expire_cnt_++;
+    }
+
+    // the flow's steps post as any other
+    FrameBuf frame;
+    if (flow_ && frame_chan_.pop(frame)) {
+      flowStep(frame);
+      if (post_dirty_) {
+        postTracks();
+        post_dirty_ = false;
+      }
+    }
+    stepping_ = false;
   }
 
   return true;
@@ -357,28 +1419,57 @@ bool Tracker::waitingToHalt() {
   if (tracker_on_) {
     differ_tot_.end();
     tracker_on_ = false;
+    if (!state_.empty()) {
+      saveState(std::chrono::steady_clock::now());
+    }
 
     if (!quiet_) {
       fprintf(stderr, "\nTracker Results...\n");
-      fprintf(stderr, "      target untouch time (us): high:%u avg:%u low:%u cnt:%u\n", 
+      fprintf(stderr, "      target untouch time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_untouch_.pct(.5), differ_untouch_.pct(.9), differ_untouch_.pct(.99), differ_untouch_.pct(.999),
           differ_untouch_.high, differ_untouch_.avg, 
           differ_untouch_.low,  differ_untouch_.cnt);
-      fprintf(stderr, "  target association time (us): high:%u avg:%u low:%u cnt:%u\n", 
+      fprintf(stderr, "  target association time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_associate_.pct(.5), differ_associate_.pct(.9), differ_associate_.pct(.99), differ_associate_.pct(.999),
           differ_associate_.high, differ_associate_.avg, 
           differ_associate_.low,  differ_associate_.cnt);
-      fprintf(stderr, "        track create time (us): high:%u avg:%u low:%u cnt:%u\n", 
+      fprintf(stderr, "        track create time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_create_.pct(.5), differ_create_.pct(.9), differ_create_.pct(.99), differ_create_.pct(.999),
           differ_create_.high, differ_create_.avg, 
           differ_create_.low,  differ_create_.cnt);
-      fprintf(stderr, "        target touch time (us): high:%u avg:%u low:%u cnt:%u\n", 
+      fprintf(stderr, "        target touch time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_touch_.pct(.5), differ_touch_.pct(.9), differ_touch_.pct(.99), differ_touch_.pct(.999),
           differ_touch_.high, differ_touch_.avg, 
           differ_touch_.low,  differ_touch_.cnt);
-      fprintf(stderr, "       track cleanup time (us): high:%u avg:%u low:%u cnt:%u\n", 
+      fprintf(stderr, "       track cleanup time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_cleanup_.pct(.5), differ_cleanup_.pct(.9), differ_cleanup_.pct(.99), differ_cleanup_.pct(.999),
           differ_cleanup_.high, differ_cleanup_.avg, 
           differ_cleanup_.low,  differ_cleanup_.cnt);
-      fprintf(stderr, "          track post time (us): high:%u avg:%u low:%u cnt:%u\n", 
+      fprintf(stderr, "          track post time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_post_.pct(.5), differ_post_.pct(.9), differ_post_.pct(.99), differ_post_.pct(.999),
           differ_post_.high, differ_post_.avg, 
           differ_post_.low,  differ_post_.cnt);
+      if (flow_) {
+        fprintf(stderr, "           track flow time (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+            differ_flow_.pct(.5), differ_flow_.pct(.9), differ_flow_.pct(.99), differ_flow_.pct(.999),
+            differ_flow_.high, differ_flow_.avg, 
+            differ_flow_.low,  differ_flow_.cnt);
+      }
+      fprintf(stderr, "         target latency   (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n", 
+          differ_late_.pct(.5), differ_late_.pct(.9), differ_late_.pct(.99), differ_late_.pct(.999),
+          differ_late_.high, differ_late_.avg, 
+          differ_late_.low,  differ_late_.cnt);
       fprintf(stderr, "                  total tracks: %u\n", track_cnt_);
+      fprintf(stderr, "            track batch misses: %u\n", track_pool_.misses());
+      fprintf(stderr, "             pairs out of gate: %u\n", gated_cnt_);
+      fprintf(stderr, "           tracks brought back: %u\n", reid_cnt_);
+      fprintf(stderr, "                  paths closed: %u\n", path_cnt_);
+      fprintf(stderr, "            groups on the pool: %u\n", par_cnt_);
+      fprintf(stderr, "               tracks restored: %u\n", restore_cnt_);
+      if (flow_) {
+        fprintf(stderr, "      flow steps (tracks lost): %u (%u)\n", flow_cnt_.load(), flow_lost_cnt_.load());
+      }
+      fprintf(stderr, "          cycles (expiry only): %u (%u)\n", cycle_cnt_, expire_cnt_);
       fprintf(stderr, "               total test time: %f sec\n", 
           differ_tot_.avg / 1000000.f);
       fprintf(stderr, "\n");
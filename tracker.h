@@ -25,78 +25,109 @@
 #include <thread>
 #include <mutex>
 #include <set>
+#include <deque>
+#include <unordered_map>
 #include <chrono>
+#include <vector>
+#include <cstdint>
+#include <functional>
 
 #include "utils.h"
 #include "listener.h"
+#include "channel.h"
 #include "base.h"
+#include "batch.h"
 #include "encoder.h"
+#include "publish.h"
+#include "events.h"
+#include "journal.h"
+#include "rules.h"
+#include "assign.h"
+#include "flow.h"
 
-#include "Eigen/Dense"
 
 namespace detector {
 
-class Tracker : public Base, Listener<std::shared_ptr<std::vector<BoxBuf>>> {
+class Tracker : public Base, Listener<std::shared_ptr<std::vector<BoxBuf>>>,
+  public Listener<MotionBuf>, public Listener<FrameBuf> {
   
   public:
-    class Track {
-      public:
-        enum class State {
-          kUnknown = 0,
-          kInit,
-          kActive
-        };
-
-      public: 
-        Track() = default;
-        Track(unsigned int track_id, const BoxBuf& box);
-        Track(const Tracker::Track& t) = default;
-        Tracker::Track& operator=(Tracker::Track&& t) { return *this; }
-        ~Track() {}
+    // kDistance pairs on centre distance, kIou pairs high score boxes
+    // on overlap first and then low score boxes with the leftover tracks
+    enum class Match {
+      kDistance,
+      kIou
+    };
 
-      public:
-        double getDistance(double mid_x, double mid_y);
-        void addTarget(const BoxBuf& box);
-        void updateTime();
+  public:
+    static std::unique_ptr<Tracker> create(unsigned int yield_time, bool quiet, 
+        Encoder* enc, double max_dist, unsigned int max_time,
+        Tracker::Match match, float high_score);
+    virtual ~Tracker();
 
-      public:
-        unsigned int id;
-        std::chrono::steady_clock::time_point stamp;
-        BoxBuf::Type type;
-        double x, y, w, h;
-        bool touched;
+  public:
+    virtual bool addMessage(std::shared_ptr<std::vector<BoxBuf>>& boxes);
 
-      private:
-        Track::State state_{Track::State::kInit};
+    // the encoder's macroblock vectors, a new track starts at their speed
+    virtual bool addMessage(MotionBuf& map);
 
-        const double initial_error_{1.0};
-        const double process_variance_{1.0};
-        const double measure_variance_{1.0};
+    // every frame, with 'setFlow', to move the tracks between detections
+    virtual bool addMessage(FrameBuf& frame);
 
-        const static Eigen::Matrix<double, 6, 6> A_;
-        const static Eigen::Matrix<double, 2, 6> H_;
+    // move a posted track to 'at' along its velocity, clipped to the frame
+    static bool predict(const TrackBuf& track, std::chrono::steady_clock::time_point at,
+        unsigned int width, unsigned int height, TrackBuf& out);
 
-        Eigen::Matrix<double, 6, 1> X_;
-        Eigen::Matrix<double, 6, 6> P_;
-        Eigen::Matrix<double, 2, 2> R_;
-        Eigen::Matrix<double, 6, 6> Q_;
-        Eigen::Matrix<double, 2, 1> Z_;
+    // the tracks last posted to the encoder, may be null
+    std::shared_ptr<std::vector<TrackBuf>> getTracks();
 
-        void updateMeasure();
-    };
+    // the score a box needs to start or hold a track on its own
+    void setHighScore(float high_score);
 
-  public:
-    static std::unique_ptr<Tracker> create(unsigned int yield_time, bool quiet, 
-        Encoder* enc, double max_dist, unsigned int max_time);
-    virtual ~Tracker();
+    // whether the next boxes should carry their embeddings (see embed.h),
+    // for pairings with a choice to make, new tracks, lost tracks that
+    // could come back, and a refresh now and then
+    bool wantsEmbeddings();
 
-  public:
-    virtual bool addMessage(std::shared_ptr<std::vector<BoxBuf>>& boxes);
+    // the posted tracks also go here, set before start
+    void setTap(Listener<std::shared_ptr<std::vector<TrackBuf>>>* tap);
+    void setPublisher(Publisher* pub);
+    void setEvents(Events* evt);
+    void setJournal(Journal* jnl);
+    void setFusion(Listener<std::shared_ptr<std::vector<TrackBuf>>>* fuse);
+    void setRules(Rules* rul);
+    void setCounts(Counts* cnt);
+
+    // where the tracks are kept between runs, a file in /dev/shm survives
+    // a restart of the process, set before start (see saveState)
+    void setState(const std::string& path);
+
+    // follow the tracks' boxes with optical flow on the frames in between
+    // the detections, the frame's size and format, set before start
+    void setFlow(unsigned int width, unsigned int height, unsigned int pix_fmt);
+
+    // the metrics endpoint's samples
+    virtual void metrics(Exposition& out, const std::string& labels);
+    virtual void footprint(Footprint& out);
+    virtual unsigned int pending();
+
+    class Stats {
+      public:
+        unsigned int tracks;
+        Histogram::Percentiles associate, predict, cleanup, post;
+    };
+    Tracker::Stats stats();
+
+    // one pass of the stage without its thread, 'now' is the clock the
+    // tracks age by (see trackbench.cpp)
+    bool step(std::shared_ptr<std::vector<BoxBuf>>& boxes,
+        std::chrono::steady_clock::time_point now);
 
   protected:
     Tracker() = delete;
     Tracker(unsigned int yield_time);
-    bool init(bool quiet, Encoder* enc, double max_dist, unsigned int max_time);
+    bool init(bool quiet, Encoder* enc, double max_dist, unsigned int max_time,
+        Tracker::Match match, float high_score);
 
   protected:
     virtual bool waitingToRun();
@@ -107,11 +138,177 @@ class Tracker : public Base, Listener<std::shared_ptr<std::vector<BoxBuf>>> {
   private:
     bool quiet_;
     Encoder* enc_;
+    Listener<std::shared_ptr<std::vector<TrackBuf>>>* tap_;
+    Listener<std::shared_ptr<std::vector<TrackBuf>>>* fuse_;
+    Rules* rul_;
+    Counts* cnt_;
+    Publisher* pub_;
+    Events* evt_;
+    Journal* jnl_;
     double max_dist_;
     unsigned int max_time_;
+    Tracker::Match match_;
+    std::atomic<float> high_score_;
+
+    static constexpr unsigned int max_lead_{1000};  // msec
+
+    // filter steps arrive once per detection, this converts them to seconds
+    std::chrono::steady_clock::time_point step_stamp_;
+    float step_sec_;
+
+    static constexpr float min_iou_{0.2f};
+    static constexpr float min_low_iou_{0.5f};
+
+    // innovation gate, chi-square 99% for 2 dof, and the measurement
+    // noise of a box centre as a part of the box's smaller side
+    static constexpr float gate_chi2_{9.21f};
+    static constexpr float centre_noise_{0.15f};
+    unsigned int gated_cnt_;
 
     unsigned int track_cnt_;
-    std::vector<Track> tracks_;
+
+    static constexpr float initial_error_{1.f};
+    static constexpr float process_variance_{1.f};
+    static constexpr float measure_variance_{1.f};
+
+    // the last few appearances of a track
+    class Ring {
+      public:
+        static constexpr unsigned int kSize = 4;
+        std::shared_ptr<const std::vector<float>> emb[kSize];
+        unsigned int num = 0;
+        void add(const std::shared_ptr<const std::vector<float>>& e);
+
+        // the smallest cosine distance to 'e', 2 with nothing to go on
+        float distance(const std::shared_ptr<const std::vector<float>>& e) const;
+    };
+
+    // a track that expired with its appearance, for a while
+    class Lost {
+      public:
+        unsigned int id;
+        BoxBuf::Type type;
+        std::chrono::steady_clock::time_point stamp;
+        Tracker::Ring ring;
+    };
+
+    // the sightings of each track, at most one every 'kStep' msec and the
+    // last 'kLen' of them, in slots of one arena that are handed back when
+    // the track goes
+    class Paths {
+      public:
+        static constexpr unsigned int kLen = 128;
+        static constexpr unsigned int kStep = 100;   // msec
+        std::vector<uint32_t> t;                      // msec since the origin
+        std::vector<uint16_t> x, y, w, h;
+        std::vector<std::chrono::steady_clock::time_point> origin;   // a slot
+        std::vector<unsigned int> head, num;
+        std::vector<unsigned int> free;
+        unsigned int take();
+        void give(unsigned int s);
+        void add(unsigned int s, std::chrono::steady_clock::time_point at,
+            float bx, float by, float bw, float bh);
+
+        // num, then (dt msec, dx, dy, dw, dh) of each sighting from the one
+        // before, the first from 0, as zigzag varints
+        void encode(unsigned int s, std::vector<uint8_t>& out);
+        std::chrono::steady_clock::time_point first(unsigned int s);
+        size_t bytes();
+    };
+
+    // one array per field so the filter loops stream over contiguous
+    // floats, and removing a track is a swap with the last one
+    class Tracks {
+      public:
+        std::vector<unsigned int> id;
+        std::vector<BoxBuf::Type> type;
+        std::vector<int> cls;
+        std::vector<std::chrono::steady_clock::time_point> stamp;
+        std::vector<float> x, y, w, h;
+        std::vector<uint8_t> touched;
+        std::vector<uint8_t> active;
+        std::vector<Tracker::Ring> ring;
+        std::vector<unsigned int> path;
+        Tracker::Paths paths;
+        void sample(unsigned int i);
+
+        // constant velocity filter per axis, both axes share the covariance
+        std::vector<float> px, vx;
+        std::vector<float> py, vy;
+        std::vector<float> p00, p01, p11, p22;
+
+        inline unsigned int size() { return id.size(); }
+        void add(unsigned int track_id, const BoxBuf& box, float err);
+        void remove(unsigned int i);
+        size_t bytes();
+
+        // a min-heap of (last seen, id) so expiry only looks at the tracks
+        // that are due, entries left behind by a later sighting or a
+        // removal are dropped when they reach the top
+        typedef std::pair<std::chrono::steady_clock::time_point, unsigned int> Due;
+        std::vector<Due> due;
+        std::unordered_map<unsigned int, unsigned int> slot;   // id to index
+        void seen(unsigned int i, std::chrono::steady_clock::time_point at);
+        unsigned int expire(std::chrono::steady_clock::time_point now,
+            std::chrono::milliseconds age,
+            std::chrono::steady_clock::time_point& next,
+            const std::function<void(unsigned int)>& gone);
+    };
+    Tracker::Tracks tracks_;
+    std::atomic<unsigned int> track_num_{0};
+    std::atomic<size_t> track_bytes_{0};
+
+    // appearance, its share of a pairing's cost, the distance that brings
+    // a lost track back, and how long and how many lost tracks are kept
+    static constexpr float appear_weight_{0.3f};
+    static constexpr float reid_dist_{0.3f};
+    static constexpr unsigned int lost_time_{10000};  // msec
+    static constexpr unsigned int lost_max_{32};
+    static constexpr unsigned int refresh_time_{1000};  // msec
+    std::vector<Tracker::Lost> lost_;
+    std::atomic<bool> want_emb_{true};
+    std::chrono::steady_clock::time_point emb_stamp_;
+    unsigned int ambiguous_;
+    unsigned int reid_cnt_;
+    unsigned int path_cnt_;
+    unsigned int revive(const BoxBuf& box, Tracker::Ring& ring);
+
+    float trackDistance(unsigned int i, float mid_x, float mid_y);
+    double trackCost(unsigned int i, const BoxBuf& box);
+    bool trackGate(unsigned int i, const BoxBuf& box);
+    void addTarget(unsigned int i, const BoxBuf& box);
+    void filter(unsigned int i, float mid_x, float mid_y);
+
+    // candidate pairing of a track and a target inside the gate
+    class Edge {
+      public:
+        unsigned int track;
+        unsigned int target;
+        double dist;
+    };
+    std::vector<std::pair<int64_t, unsigned int>> grid_;
+    std::vector<Tracker::Edge> edges_;
+    std::vector<unsigned int> parent_;
+    double cell_;
+    int64_t cellKey(double x, double y);
+    unsigned int findRoot(unsigned int n);
+
+    // a connected group of tracks and targets, edges [e0, e1), solved on
+    // its own with its own scratch, kept between steps
+    class Group {
+      public:
+        unsigned int e0, e1;
+        std::vector<unsigned int> tracks;
+        std::vector<unsigned int> targets;
+        Assignment assign;
+        std::vector<int> assignments;
+        double* mat;
+    };
+    std::vector<Tracker::Group> groups_;
+    std::vector<unsigned int> big_;
+    static constexpr unsigned int par_cells_{256};  // rows x cols worth a worker
+    unsigned int par_cnt_;
+    void solveGroup(Tracker::Group& g);
 
     MicroDiffer<uint32_t> differ_tot_;
     MicroDiffer<uint32_t> differ_untouch_;
@@ -120,23 +317,76 @@ class Tracker : public Base, Listener<std::shared_ptr<std::vector<BoxBuf>>> {
     MicroDiffer<uint32_t> differ_touch_;
     MicroDiffer<uint32_t> differ_cleanup_;
     MicroDiffer<uint32_t> differ_post_;
+    MicroDiffer<uint32_t> differ_late_;
 
-    std::timed_mutex targets_lock_;
+    Channel<std::shared_ptr<std::vector<BoxBuf>>> boxes_chan_{1,
+      Channel<std::shared_ptr<std::vector<BoxBuf>>>::Policy::kDropOldest};
     std::vector<BoxBuf> targets_;
+    Channel<MotionBuf> vec_chan_{1, Channel<MotionBuf>::Policy::kDropOldest};
+    MotionBuf map_;
+    const unsigned int map_fresh_ = {500};   // msec
+    void priorVelocity(unsigned int i, const BoxBuf& box);
+    std::vector<BoxBuf> low_targets_;
     std::set<BoxBuf::Type> target_types_{ 
       BoxBuf::Type::kPerson, 
       BoxBuf::Type::kPet, 
       BoxBuf::Type::kVehicle
     };
 
+    std::mutex posted_lock_;
+    std::shared_ptr<std::vector<TrackBuf>> posted_;
+    BatchPool<TrackBuf> track_pool_{8, 64};
+    bool post_dirty_;     // the tracks changed since they were last posted
+    std::chrono::steady_clock::time_point expire_at_{   // the oldest track goes
+      std::chrono::steady_clock::time_point::max()};
+    unsigned int cycle_cnt_{0};
+    unsigned int expire_cnt_{0};
+    std::atomic<bool> stepping_{false};   // boxes or a frame taken but not done
+
+    // each frame moves the tracks by the flow of their boxes, a measurement
+    // that isn't a sighting.  A detection is of a frame some way back, so
+    // the tracks are moved back to it by the flow since, matched and moved
+    // forward again.
+    class Drift {
+      public:
+        std::chrono::steady_clock::time_point stamp;
+        std::vector<unsigned int> id;
+        std::vector<float> dx, dy;
+    };
+    std::unique_ptr<Flow> flow_;
+    Channel<FrameBuf> frame_chan_{1, Channel<FrameBuf>::Policy::kDropOldest};
+    std::deque<Tracker::Drift> drifts_;
+    std::chrono::steady_clock::time_point flow_stamp_;
+    std::atomic<unsigned int> flow_cnt_{0};
+    std::atomic<unsigned int> flow_lost_cnt_{0};
+    MicroDiffer<uint32_t> differ_flow_;
+    unsigned int frame_width_{0};
+    unsigned int frame_height_{0};
+    bool flowStep(FrameBuf& frame);
+    bool flowFresh(std::chrono::steady_clock::time_point stamp);
+    void drift(std::chrono::steady_clock::time_point since, float sign);
+
     std::atomic<bool> tracker_on_;
 
+    void updateStep(std::chrono::steady_clock::time_point stamp);
     bool untouchTracks();
+    bool matchTargets(std::vector<BoxBuf>& targets, bool untouched, double max_cost);
     bool associateTracks();
     bool createNewTracks();
     bool touchTracks();
-    bool cleanupTracks();
+    bool cleanupTracks(std::chrono::steady_clock::time_point now);
     bool postTracks();
+
+    // the tracks, their filters and the last id, at most once a second
+    // and at halt, read back at start if the tracker has nothing yet
+    static constexpr uint32_t state_magic_{0x4b525444};   // "DTRK"
+    static constexpr uint32_t state_version_{1};
+    static constexpr unsigned int state_time_{1000};      // msec
+    std::string state_;
+    std::chrono::steady_clock::time_point state_at_;
+    unsigned int restore_cnt_;
+    bool saveState(std::chrono::steady_clock::time_point now);
+    bool restoreState();
 };
 
 } // namespace detector
@@ -16,16 +16,46 @@
  * Try './detector -h' for usage.
  */
 
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
 #include "utils.h"
+#include "pool.h"
+#include "kernels.h"
 
 #include "third_party/font8x8/font8x8_basic.h"
 
 namespace detector {
 
-static void yuv420_to_yuv420(
+// smallest piece of an image worth handing to the pool
+static const unsigned int stripe_rows = 32;
+
+static const std::chrono::steady_clock::time_point start_time =
+    std::chrono::steady_clock::now();
+
+// the common capture sizes get their own specialisations, 0 is any size
+static const unsigned int fixed_sizes[][2] = {
+  { 640, 480 }, { 1280, 720 }, { 1920, 1080 }
+};
+
+template<unsigned int W, unsigned int H>
+static inline void yuv420_to_yuv420(
     unsigned char* src, unsigned int src_width, unsigned int src_height,
     unsigned char* dst, unsigned int dst_width, unsigned int dst_height)
 {
+  if (W) {
+    src_width = dst_width = W;
+    src_height = dst_height = H;
+  }
+
   unsigned int   src_blk     = src_width * src_height;
   unsigned int   src_qtr_blk = src_blk / 4;
   unsigned char* src_y       = src;
@@ -38,7 +68,9 @@ static void yuv420_to_yuv420(
   unsigned char* dst_u       = dst + dst_blk;
   unsigned char* dst_v       = dst + dst_blk + dst_qtr_blk;
 
-  std::memset(dst_y, 0, dst_width * dst_height * 3 / 2);
+  if (dst_width != src_width || dst_height != src_height) {
+    std::memset(dst_y, 0, dst_width * dst_height * 3 / 2);
+  }
 
   for (unsigned int i = 0; i < dst_height; i++) {
     std::memcpy(dst_y, src_y, src_width);
@@ -56,102 +88,92 @@ static void yuv420_to_yuv420(
   }
 }
 
-static void yuyv_or_yvyu_to_yuv420(
-    unsigned char* source, unsigned int src_width, unsigned int src_height,
-    unsigned char* dst,    unsigned int dst_width, unsigned int dst_height, bool flip) {
-
-  struct yuyv {
-    unsigned char y0;
-    unsigned char u;
-    unsigned char y1;
-    unsigned char v;
-  };
-  struct yuv420_y {
-    unsigned char y0;
-    unsigned char y1;
-    unsigned char y2;
-    unsigned char y3;
-  };
-  struct yuv420_u {
-    unsigned char u;
-  };
-  struct yuv420_v {
-    unsigned char v;
-  };
-
-  unsigned int dst_blk = dst_width * dst_height;
-  unsigned int dst_qtr_blk = dst_blk / 4;
-
-  unsigned int diff = dst_width - src_width;
-
-  struct yuyv*     src    = (struct yuyv*)source;
-  struct yuv420_y* dst_y  = (struct yuv420_y*)(dst);
-  struct yuv420_u* dst_u  = (struct yuv420_u*)(dst + dst_blk);
-  struct yuv420_v* dst_v  = (struct yuv420_v*)(dst + dst_blk + dst_qtr_blk);
-
-  std::memset(dst_y, 0, dst_width * dst_height * 3 / 2);
-
-  for (unsigned int i = 1; i <= src_height; i++) {
-    for (unsigned int j = 1; j <= src_width / 2; j++) {
-      if (j % 2) {
-        dst_y->y0 = src->y0;
-        dst_y->y1 = src->y1;
-      } else {
-        dst_y->y2 = src->y0;
-        dst_y->y3 = src->y1;
-        dst_y++;
-      }
-
-      if (i % 2) {
-        dst_u->u = (flip) ? src->v : src->u;
-        dst_v->v = (flip) ? src->u : src->v;
-        dst_u++;
-        dst_v++;
-      }
-      src++;
+// packed 4:2:2 to planar, chroma from the even rows like the camera sends it
+static inline void yuyv_row_to_yuv420(const unsigned char* src, unsigned char* dst_y,
+    unsigned char* dst_u, unsigned char* dst_v, unsigned int width) {
+
+  const Kernels& kern = Kernels::get();
+  unsigned int i = kern.yuyv_to_yuv420 ? kern.yuyv_to_yuv420(src, dst_y, dst_u, dst_v, width) : 0;
+  for (; i + 2 <= width; i += 2) {
+    dst_y[i] = src[i * 2];
+    dst_y[i + 1] = src[i * 2 + 2];
+    if (dst_u) {
+      dst_u[i / 2] = src[i * 2 + 1];
+      dst_v[i / 2] = src[i * 2 + 3];
     }
-    dst_y += diff;
-    dst_u += diff / 2;
-    dst_v += diff / 2;
   }
 }
 
-static void yuyv_to_yuv420(
+template<bool Flip, unsigned int W, unsigned int H>
+static inline void yuyv_or_yvyu_to_yuv420(
     unsigned char* src, unsigned int src_width, unsigned int src_height,
     unsigned char* dst, unsigned int dst_width, unsigned int dst_height) {
-  yuyv_or_yvyu_to_yuv420(src, src_width, src_height, dst, dst_width, dst_height, false);
+
+  if (W) {
+    src_width = dst_width = W;
+    src_height = dst_height = H;
+  }
+
+  unsigned int   dst_blk     = dst_width * dst_height;
+  unsigned int   dst_qtr_blk = dst_blk / 4;
+
+  unsigned char* dst_y  = dst;
+  unsigned char* dst_u  = dst + dst_blk;
+  unsigned char* dst_v  = dst + dst_blk + dst_qtr_blk;
+  if (Flip) {
+    std::swap(dst_u, dst_v);
+  }
+
+  if (dst_width != src_width || dst_height != src_height) {
+    std::memset(dst, 0, dst_width * dst_height * 3 / 2);
+  }
+
+  for (unsigned int i = 0; i < src_height; i++) {
+    bool even = (i % 2) == 0;
+    yuyv_row_to_yuv420(src + i * src_width * 2, dst_y + i * dst_width,
+        even ? dst_u + (i / 2) * (dst_width / 2) : nullptr,
+        even ? dst_v + (i / 2) * (dst_width / 2) : nullptr, src_width);
+  }
 }
 
-static void yvyu_to_yuv420(
-    unsigned char* src, unsigned int src_width, unsigned int src_height,
-    unsigned char* dst, unsigned int dst_width, unsigned int dst_height) {
-  yuyv_or_yvyu_to_yuv420(src, src_width, src_height, dst, dst_width, dst_height, true);
+// one row of interleaved chroma to its two planes, 'num' pairs
+static inline void uv_row_to_planes(const unsigned char* src, unsigned char* dst_u,
+    unsigned char* dst_v, unsigned int num) {
+
+  const Kernels& kern = Kernels::get();
+  unsigned int i = kern.uv_to_planes ? kern.uv_to_planes(src, dst_u, dst_v, num) : 0;
+  for (; i < num; i++) {
+    dst_u[i] = src[i * 2];
+    dst_v[i] = src[i * 2 + 1];
+  }
 }
 
-static void nv12_or_nv21_to_yuv420(
+template<bool Flip, unsigned int W, unsigned int H>
+static inline void nv12_or_nv21_to_yuv420(
     unsigned char* src, unsigned int src_width, unsigned int src_height,
-    unsigned char* dst, unsigned int dst_width, unsigned int dst_height, bool flip) {
+    unsigned char* dst, unsigned int dst_width, unsigned int dst_height) {
 
-  struct uv {
-    unsigned char u;
-    unsigned char v;
-  };
+  if (W) {
+    src_width = dst_width = W;
+    src_height = dst_height = H;
+  }
 
   unsigned int   dst_blk     = dst_width * dst_height;
   unsigned int   dst_qtr_blk = dst_blk / 4;
 
-  unsigned int   src_blk     = src_width * src_height;
-
-  unsigned int   diff        = dst_width - src_width;
-
   unsigned char* src_y  = src;
-  struct uv*     src_uv = (struct uv*)(src + src_blk);
+  unsigned char* src_uv = src + src_width * src_height;
 
   unsigned char* dst_y  = dst;
   unsigned char* dst_u  = dst + dst_blk;
   unsigned char* dst_v  = dst + dst_blk + dst_qtr_blk;
+  if (Flip) {
+    std::swap(dst_u, dst_v);
+  }
 
-  std::memset(dst_y, 0, dst_width * dst_height * 3 / 2);
+  if (dst_width != src_width || dst_height != src_height) {
+    std::memset(dst, 0, dst_width * dst_height * 3 / 2);
+  }
 
   for (unsigned int i = 0; i < src_height; i++) {
     std::memcpy(dst_y, src_y, src_width);
@@ -159,99 +181,962 @@ static void nv12_or_nv21_to_yuv420(
     dst_y += dst_width;
   }
 
-  // de-interlace uv data
+  // de-interlace uv data, a row of pairs covers two rows of luma
   for (unsigned int i = 0; i < src_height / 2; i++) {
-    for (unsigned int j = 0; j < src_width / 4; j++) {
-      *dst_u++ = (flip) ? src_uv->v : src_uv->u;
-      *dst_v++ = (flip) ? src_uv->u : src_uv->v;
-      src_uv++;
-    }
-    dst_u += diff / 2;
-    dst_v += diff / 2;
+    uv_row_to_planes(src_uv, dst_u, dst_v, src_width / 2);
+    src_uv += src_width;
+    dst_u += dst_width / 2;
+    dst_v += dst_width / 2;
   }
 }
 
-static void nv12_to_yuv420(
+template<int Fmt, unsigned int W, unsigned int H>
+static void frame_to_yuv420(
     unsigned char* src, unsigned int src_width, unsigned int src_height,
     unsigned char* dst, unsigned int dst_width, unsigned int dst_height) {
-  nv12_or_nv21_to_yuv420(src, src_width, src_height, dst, dst_width, dst_height, false);
+
+  if constexpr (Fmt == V4L2_PIX_FMT_YUV420) {
+    yuv420_to_yuv420<W, H>(src, src_width, src_height, dst, dst_width, dst_height);
+  } else if constexpr (Fmt == V4L2_PIX_FMT_YUYV || Fmt == V4L2_PIX_FMT_YVYU) {
+    yuyv_or_yvyu_to_yuv420<Fmt == V4L2_PIX_FMT_YVYU, W, H>(
+        src, src_width, src_height, dst, dst_width, dst_height);
+  } else {
+    nv12_or_nv21_to_yuv420<Fmt == V4L2_PIX_FMT_NV21, W, H>(
+        src, src_width, src_height, dst, dst_width, dst_height);
+  }
 }
 
-static void nv21_to_yuv420(
-    unsigned char* src, unsigned int src_width, unsigned int src_height,
-    unsigned char* dst, unsigned int dst_width, unsigned int dst_height) {
-  nv12_or_nv21_to_yuv420(src, src_width, src_height, dst, dst_width, dst_height, true);
+template<int Fmt>
+static Yuv420Converter pick_yuv420(unsigned int width, unsigned int height) {
+  if (width == fixed_sizes[0][0] && height == fixed_sizes[0][1]) {
+    return frame_to_yuv420<Fmt, 640, 480>;
+  } else if (width == fixed_sizes[1][0] && height == fixed_sizes[1][1]) {
+    return frame_to_yuv420<Fmt, 1280, 720>;
+  } else if (width == fixed_sizes[2][0] && height == fixed_sizes[2][1]) {
+    return frame_to_yuv420<Fmt, 1920, 1080>;
+  }
+  return frame_to_yuv420<Fmt, 0, 0>;
+}
+
+Yuv420Converter pick_yuv420_converter(int fmt, unsigned int src_width, unsigned int src_height,
+    unsigned int dst_width, unsigned int dst_height) {
+
+  // the fixed sizes only when nothing is padded
+  bool same = src_width == dst_width && src_height == dst_height;
+  unsigned int w = same ? src_width : 0;
+  unsigned int h = same ? src_height : 0;
+  switch (fmt) {
+    case V4L2_PIX_FMT_YUV420: return pick_yuv420<V4L2_PIX_FMT_YUV420>(w, h);
+    case V4L2_PIX_FMT_YUYV:   return pick_yuv420<V4L2_PIX_FMT_YUYV>(w, h);
+    case V4L2_PIX_FMT_YVYU:   return pick_yuv420<V4L2_PIX_FMT_YVYU>(w, h);
+    case V4L2_PIX_FMT_NV12:   return pick_yuv420<V4L2_PIX_FMT_NV12>(w, h);
+    case V4L2_PIX_FMT_NV21:   return pick_yuv420<V4L2_PIX_FMT_NV21>(w, h);
+  }
+  return nullptr;
 }
 
 void convert_to_yuv420(int fmt, 
     unsigned char* src, unsigned int src_width, unsigned int src_height,
     unsigned char* dst, unsigned int dst_width, unsigned int dst_height) {
 
-  switch (fmt) {
-    case V4L2_PIX_FMT_YUV420:
-      yuv420_to_yuv420(src, src_width, src_height, dst, dst_width, dst_height);
-      break;
-    case V4L2_PIX_FMT_YUYV:
-      yuyv_to_yuv420(src, src_width, src_height, dst, dst_width, dst_height);
-      break;
-    case V4L2_PIX_FMT_YVYU:
-      yvyu_to_yuv420(src, src_width, src_height, dst, dst_width, dst_height);
-      break;
-    case V4L2_PIX_FMT_NV12:
-      nv12_to_yuv420(src, src_width, src_height, dst, dst_width, dst_height);
-      break;
-    case V4L2_PIX_FMT_NV21:
-      nv21_to_yuv420(src, src_width, src_height, dst, dst_width, dst_height);
-      break;
-  }
-}
-
-// this converstion is done with integers with the byte values left shifted 
-// by 10 places to give it precision.  So the max rgb value would be = 2 ^ 18 - 1.
-#define RGB_MAXVAL  262143  // = 2 ^ 18 - 1
-#define RGB_MAX(a,b) (((a)>(b))?(a):(b))
-#define RGB_MIN(a,b) (((a)<(b))?(a):(b))
-static unsigned char* yuv2rgb(unsigned char* dst, int y, int u, int v) {
-  y -= 16;
+  auto fn = pick_yuv420_converter(fmt, src_width, src_height, dst_width, dst_height);
+  if (fn) {
+    fn(src, src_width, src_height, dst, dst_width, dst_height);
+  }
+}
+
+// bt.601 studio swing in 6 bit fixed point.  Every sum fits a 16 bit lane
+// (blue saturates, but only past full scale) so the neon rows below give
+// the same bytes as this.
+static inline unsigned char clamp_rgb(int x) {
+  x = (x + 32) >> 6;
+  return static_cast<unsigned char>((x < 0) ? 0 : (x > 255) ? 255 : x);
+}
+
+static inline unsigned char* yuv2rgb(unsigned char* dst, int y, int u, int v, bool bgr) {
+  int l = (y - 16) * 74;
   u -= 128;
   v -= 128;
 
-  int r = 1192 * y + 1634 * v;
-  int g = 1192 * y - 833 * v - 400 * u;
-  int b = 1192 * y + 2066 * u;
+  unsigned char r = clamp_rgb(l + 102 * v);
+  unsigned char g = clamp_rgb(l - 52 * v - 25 * u);
+  unsigned char b = clamp_rgb(l + 129 * u);
 
-  r = RGB_MIN(RGB_MAXVAL, RGB_MAX(0,r));
-  g = RGB_MIN(RGB_MAXVAL, RGB_MAX(0,g));
-  b = RGB_MIN(RGB_MAXVAL, RGB_MAX(0,b));
-
-  *dst++ = (r >> 10) & 0xff;
-  *dst++ = (g >> 10) & 0xff;
-  *dst++ = (b >> 10) & 0xff;
+  *dst++ = bgr ? b : r;
+  *dst++ = g;
+  *dst++ = bgr ? r : b;
   return dst;
 }
 
+// a row with half width chroma, planar ('Step' 1) or interleaved (2)
+template<unsigned int Step, bool Bgr>
+static inline void yuv_row_to_rgb24(const unsigned char* y, const unsigned char* u,
+    const unsigned char* v, unsigned char* dst, unsigned int width) {
+
+  const Kernels& kern = Kernels::get();
+  unsigned int i = kern.yuv_to_rgb24 ? kern.yuv_to_rgb24(y, u, v, dst, width, Step, Bgr) : 0;
+  for (; i < width; i++) {
+    yuv2rgb(dst + i * 3, y[i], u[(i / 2) * Step], v[(i / 2) * Step], Bgr);
+  }
+}
+
+// a packed 4:2:2 row, 'Flip' when v comes before u
+template<bool Flip, bool Bgr>
+static inline void yuyv_row_to_rgb24(const unsigned char* src, unsigned char* dst,
+    unsigned int width) {
+
+  const Kernels& kern = Kernels::get();
+  unsigned int i = kern.yuyv_to_rgb24 ? kern.yuyv_to_rgb24(src, dst, width, Flip, Bgr) : 0;
+  for (; i + 2 <= width; i += 2) {
+    const unsigned char* p = src + i * 2;
+    int u = Flip ? p[3] : p[1];
+    int v = Flip ? p[1] : p[3];
+    yuv2rgb(dst + i * 3, p[0], u, v, Bgr);
+    yuv2rgb(dst + i * 3 + 3, p[2], u, v, Bgr);
+  }
+}
+
+// a row with a chroma sample per pixel, what the scaler gathers
+static void yuv444_row_to_rgb24(const unsigned char* y, const unsigned char* u,
+    const unsigned char* v, unsigned char* dst, unsigned int width) {
+
+  const Kernels& kern = Kernels::get();
+  unsigned int i = kern.yuv444_to_rgb24 ? kern.yuv444_to_rgb24(y, u, v, dst, width) : 0;
+  for (; i < width; i++) {
+    yuv2rgb(dst + i * 3, y[i], u[i], v[i], false);
+  }
+}
+
+template<int Fmt, bool Bgr, unsigned int W, unsigned int H>
+static void frame_to_rgb24(const unsigned char* src, unsigned int src_stride,
+    unsigned int src_slice, unsigned char* dst, unsigned int dst_stride,
+    unsigned int width, unsigned int height) {
+
+  if (W) {
+    width = W;
+    height = H;
+  }
+  const unsigned char* chroma = src + src_stride * src_slice;
+  Pool::stripes(height, stripe_rows, [&](unsigned int begin, unsigned int end) {
+    for (unsigned int j = begin; j < end; j++) {
+      const unsigned char* row = src + j * src_stride;
+      unsigned char* out = dst + j * dst_stride;
+      if constexpr (Fmt == V4L2_PIX_FMT_YUV420) {
+        const unsigned char* u = chroma + (j / 2) * (src_stride / 2);
+        const unsigned char* v = chroma + (src_stride / 2) * (src_slice / 2) +
+          (j / 2) * (src_stride / 2);
+        yuv_row_to_rgb24<1, Bgr>(row, u, v, out, width);
+      } else if constexpr (Fmt == V4L2_PIX_FMT_NV12 || Fmt == V4L2_PIX_FMT_NV21) {
+        const unsigned char* uv = chroma + (j / 2) * src_stride;
+        bool nv21 = Fmt == V4L2_PIX_FMT_NV21;
+        yuv_row_to_rgb24<2, Bgr>(row, nv21 ? uv + 1 : uv, nv21 ? uv : uv + 1, out, width);
+      } else {
+        yuyv_row_to_rgb24<Fmt == V4L2_PIX_FMT_YVYU, Bgr>(row, out, width);
+      }
+    }
+  });
+}
+
+template<int Fmt, bool Bgr>
+static Rgb24Converter pick_rgb24(unsigned int width, unsigned int height) {
+  if (width == fixed_sizes[0][0] && height == fixed_sizes[0][1]) {
+    return frame_to_rgb24<Fmt, Bgr, 640, 480>;
+  } else if (width == fixed_sizes[1][0] && height == fixed_sizes[1][1]) {
+    return frame_to_rgb24<Fmt, Bgr, 1280, 720>;
+  } else if (width == fixed_sizes[2][0] && height == fixed_sizes[2][1]) {
+    return frame_to_rgb24<Fmt, Bgr, 1920, 1080>;
+  }
+  return frame_to_rgb24<Fmt, Bgr, 0, 0>;
+}
+
+template<int Fmt>
+static Rgb24Converter pick_rgb24(unsigned int width, unsigned int height, bool bgr) {
+  return bgr ? pick_rgb24<Fmt, true>(width, height) : pick_rgb24<Fmt, false>(width, height);
+}
+
+Rgb24Converter pick_rgb24_converter(int fmt, unsigned int width, unsigned int height,
+    bool bgr) {
+
+  switch (fmt) {
+    case V4L2_PIX_FMT_YUV420: return pick_rgb24<V4L2_PIX_FMT_YUV420>(width, height, bgr);
+    case V4L2_PIX_FMT_NV12:   return pick_rgb24<V4L2_PIX_FMT_NV12>(width, height, bgr);
+    case V4L2_PIX_FMT_NV21:   return pick_rgb24<V4L2_PIX_FMT_NV21>(width, height, bgr);
+    case V4L2_PIX_FMT_YUYV:   return pick_rgb24<V4L2_PIX_FMT_YUYV>(width, height, bgr);
+    case V4L2_PIX_FMT_YVYU:   return pick_rgb24<V4L2_PIX_FMT_YVYU>(width, height, bgr);
+  }
+  return nullptr;
+}
+
+void convert_to_rgb24(int fmt, const unsigned char* src, unsigned int src_stride,
+    unsigned int src_slice, unsigned char* dst, unsigned int dst_stride,
+    unsigned int width, unsigned int height, bool bgr) {
+
+  auto fn = pick_rgb24_converter(fmt, width, height, bgr);
+  if (fn) {
+    fn(src, src_stride, src_slice, dst, dst_stride, width, height);
+  }
+}
+
 void convert_yuv420_to_rgb24(unsigned char* src, unsigned char* dst, 
     unsigned int width, unsigned int height) {
+  convert_to_rgb24(V4L2_PIX_FMT_YUV420, src, width, height, dst, width * 3,
+      width, height, false);
+}
+
+// the same bt.601 as convert_rgb_to_yuv, chroma from each 2x2 average.
+// offset so the chroma sums stay positive, the neon lanes are unsigned.
+static inline unsigned char rgb2y(int r, int g, int b) {
+  return static_cast<unsigned char>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+static inline unsigned char rgb2u(int r, int g, int b) {
+  return static_cast<unsigned char>((112 * b - 38 * r - 74 * g + 32896) >> 8);
+}
+static inline unsigned char rgb2v(int r, int g, int b) {
+  return static_cast<unsigned char>((112 * r - 94 * g - 18 * b + 32896) >> 8);
+}
+
+// two rows, 'src1' under 'src0'
+static void rgb24_rows_to_yuv420(const unsigned char* src0, const unsigned char* src1,
+    unsigned char* y0, unsigned char* y1, unsigned char* u, unsigned char* v,
+    unsigned int width, bool bgr) {
+
+  const Kernels& kern = Kernels::get();
+  unsigned int i = kern.rgb24_to_yuv420 ?
+    kern.rgb24_to_yuv420(src0, src1, y0, y1, u, v, width, bgr) : 0;
+  const unsigned int ri = bgr ? 2 : 0, bi = bgr ? 0 : 2;
+  for (; i + 2 <= width; i += 2) {
+    const unsigned char* p0 = src0 + i * 3;
+    const unsigned char* p1 = src1 + i * 3;
+    y0[i] = rgb2y(p0[ri], p0[1], p0[bi]);
+    y0[i + 1] = rgb2y(p0[3 + ri], p0[4], p0[3 + bi]);
+    y1[i] = rgb2y(p1[ri], p1[1], p1[bi]);
+    y1[i + 1] = rgb2y(p1[3 + ri], p1[4], p1[3 + bi]);
+    int r = (p0[ri] + p0[3 + ri] + p1[ri] + p1[3 + ri] + 2) >> 2;
+    int g = (p0[1] + p0[4] + p1[1] + p1[4] + 2) >> 2;
+    int b = (p0[bi] + p0[3 + bi] + p1[bi] + p1[3 + bi] + 2) >> 2;
+    u[i / 2] = rgb2u(r, g, b);
+    v[i / 2] = rgb2v(r, g, b);
+  }
+}
+
+void convert_rgb24_to_yuv420(const unsigned char* src, unsigned int src_stride,
+    unsigned char* dst, unsigned int dst_stride, unsigned int dst_slice,
+    unsigned int width, unsigned int height, bool bgr) {
+
+  unsigned char* pU = dst + dst_stride * dst_slice;
+  unsigned char* pV = pU + (dst_stride / 2) * (dst_slice / 2);
+  Pool::stripes(height / 2, stripe_rows / 2, [&](unsigned int begin, unsigned int end) {
+    for (unsigned int j = begin; j < end; j++) {
+      rgb24_rows_to_yuv420(src + 2 * j * src_stride, src + (2 * j + 1) * src_stride,
+          dst + 2 * j * dst_stride, dst + (2 * j + 1) * dst_stride,
+          pU + j * (dst_stride / 2), pV + j * (dst_stride / 2), width, bgr);
+    }
+  });
+}
+
+// paint everything outside 'rect' (letterbox bars)
+static void fill_rgb24_border(unsigned char* dst, 
+    unsigned int dst_width, unsigned int dst_height, 
+    const Rect& rect, unsigned char fill) {
+
+  unsigned int stride = dst_width * 3;
+  for (unsigned int j = 0; j < dst_height; j++) {
+    unsigned char* row = dst + j * stride;
+    if (j < rect.y || j >= rect.y + rect.h) {
+      std::memset(row, fill, stride);
+    } else {
+      std::memset(row, fill, rect.x * 3);
+      std::memset(row + (rect.x + rect.w) * 3, fill, 
+          (dst_width - rect.x - rect.w) * 3);
+    }
+  }
+}
+
+// vertical blend of two rows with 7 bit weights so products fit in 16 bits
+static void blend_rows(const unsigned char* row0, const unsigned char* row1,
+    unsigned int wy, unsigned char* out, unsigned int len) {
+
+  const Kernels& kern = Kernels::get();
+  unsigned int i = kern.blend_rows ? kern.blend_rows(row0, row1, wy, out, len) : 0;
+  for (; i < len; i++) {
+    out[i] = (row0[i] * (128 - wy) + row1[i] * wy + 64) >> 7;
+  }
+}
+
+// source offsets and 7 bit weights for each destination column, kept per
+// thread so a frame doesn't allocate them; the stripes only get pointers
+// since a worker naming the thread_local would see its own
+struct ScaleCols {
+  std::vector<unsigned int> off0;
+  std::vector<unsigned int> off1;
+  std::vector<unsigned char> wgt;
+};
+
+static const ScaleCols& scale_cols(unsigned int width, unsigned int src_w,
+    uint32_t step_x, unsigned int bpp) {
+
+  static thread_local ScaleCols cols;
+  cols.off0.resize(width);
+  cols.off1.resize(width);
+  cols.wgt.resize(width);
+  for (unsigned int i = 0; i < width; i++) {
+    uint32_t fx = i * step_x;
+    unsigned int x0 = fx >> 16;
+    unsigned int x1 = (x0 + 1 < src_w) ? x0 + 1 : x0;
+    cols.off0[i] = x0 * bpp;
+    cols.off1[i] = x1 * bpp;
+    cols.wgt[i] = (fx >> 9) & 0x7f;
+  }
+  return cols;
+}
+
+// bilinear scale of 'src_rect' into 'dst_rect', 16.16 fixed point steps
+void resize_rgb24(unsigned char* src, unsigned int src_stride, const Rect& src_rect,
+    unsigned char* dst, unsigned int dst_width, unsigned int dst_height,
+    const Rect& dst_rect, unsigned char fill) {
+
+  if (!src || !dst || src_rect.w == 0 || src_rect.h == 0 || 
+      dst_rect.w == 0 || dst_rect.h == 0) {
+    return;
+  }
+
+  fill_rgb24_border(dst, dst_width, dst_height, dst_rect, fill);
+
+  uint32_t step_x = (src_rect.w << 16) / dst_rect.w;
+  uint32_t step_y = (src_rect.h << 16) / dst_rect.h;
+
+  // the same columns are sampled on every row
+  const ScaleCols& cols = scale_cols(dst_rect.w, src_rect.w, step_x, 3);
+  const unsigned int* off0 = cols.off0.data();
+  const unsigned int* off1 = cols.off1.data();
+  const unsigned char* wgt = cols.wgt.data();
+
+  unsigned char* base = src + src_rect.y * src_stride + src_rect.x * 3;
+
+  Pool::stripes(dst_rect.h, stripe_rows, [&](unsigned int begin, unsigned int end) {
+    static thread_local std::vector<unsigned char> line;
+    line.resize(src_rect.w * 3);
+    for (unsigned int j = begin; j < end; j++) {
+      uint32_t fy = j * step_y;
+      unsigned int y0 = fy >> 16;
+      unsigned int y1 = (y0 + 1 < src_rect.h) ? y0 + 1 : y0;
+      unsigned int wy = (fy >> 9) & 0x7f;
+
+      const unsigned char* row = base + y0 * src_stride;
+      if (wy != 0) {
+        blend_rows(row, base + y1 * src_stride, wy, line.data(), src_rect.w * 3);
+        row = line.data();
+      }
+
+      unsigned char* out = dst + ((dst_rect.y + j) * dst_width + dst_rect.x) * 3;
+      for (unsigned int i = 0; i < dst_rect.w; i++) {
+        const unsigned char* p0 = row + off0[i];
+        const unsigned char* p1 = row + off1[i];
+        unsigned int w1 = wgt[i];
+        unsigned int w0 = 128 - w1;
+        *out++ = (p0[0] * w0 + p1[0] * w1 + 64) >> 7;
+        *out++ = (p0[1] * w0 + p1[1] * w1 + 64) >> 7;
+        *out++ = (p0[2] * w0 + p1[2] * w1 + 64) >> 7;
+      }
+    }
+  });
+}
+
+// the same for one plane of 'bpp' byte pixels into a 'dst_stride' window
+void resize_plane(const unsigned char* src, unsigned int src_stride, const Rect& src_rect,
+    unsigned int bpp, unsigned char* dst, unsigned int dst_stride,
+    unsigned int dst_width, unsigned int dst_height) {
+
+  if (!src || !dst || src_rect.w == 0 || src_rect.h == 0 ||
+      dst_width == 0 || dst_height == 0) {
+    return;
+  }
+
+  uint32_t step_x = (src_rect.w << 16) / dst_width;
+  uint32_t step_y = (src_rect.h << 16) / dst_height;
+
+  const ScaleCols& cols = scale_cols(dst_width, src_rect.w, step_x, bpp);
+  const unsigned int* off0 = cols.off0.data();
+  const unsigned int* off1 = cols.off1.data();
+  const unsigned char* wgt = cols.wgt.data();
+
+  const unsigned char* base = src + src_rect.y * src_stride + src_rect.x * bpp;
+
+  Pool::stripes(dst_height, stripe_rows, [&](unsigned int begin, unsigned int end) {
+    static thread_local std::vector<unsigned char> line;
+    line.resize(src_rect.w * bpp);
+    for (unsigned int j = begin; j < end; j++) {
+      uint32_t fy = j * step_y;
+      unsigned int y0 = fy >> 16;
+      unsigned int y1 = (y0 + 1 < src_rect.h) ? y0 + 1 : y0;
+      unsigned int wy = (fy >> 9) & 0x7f;
+
+      const unsigned char* row = base + y0 * src_stride;
+      if (wy != 0) {
+        blend_rows(row, base + y1 * src_stride, wy, line.data(), src_rect.w * bpp);
+        row = line.data();
+      }
+
+      unsigned char* out = dst + j * dst_stride;
+      for (unsigned int i = 0; i < dst_width; i++) {
+        const unsigned char* p0 = row + off0[i];
+        const unsigned char* p1 = row + off1[i];
+        unsigned int w1 = wgt[i];
+        unsigned int w0 = 128 - w1;
+        for (unsigned int c = 0; c < bpp; c++) {
+          *out++ = (p0[c] * w0 + p1[c] * w1 + 64) >> 7;
+        }
+      }
+    }
+  });
+}
+
+// 'swap' reads the source a column at a time, 8 of them together so each
+// source row is read once for 8 destination bytes
+void orient_plane(const unsigned char* src, unsigned int src_stride,
+    unsigned int width, unsigned int height, unsigned int bpp,
+    unsigned char* dst, unsigned int dst_stride, bool swap, bool mirror, bool flip) {
+
+  const Kernels& kern = Kernels::get();
+  if (!swap) {
+    Pool::stripes(height, stripe_rows, [&](unsigned int begin, unsigned int end) {
+      for (unsigned int r = begin; r < end; r++) {
+        const unsigned char* s = src + (flip ? height - 1 - r : r) * src_stride;
+        unsigned char* d = dst + r * dst_stride;
+        if (!mirror) {
+          std::memcpy(d, s, width * bpp);
+          continue;
+        }
+        unsigned int c = kern.mirror_row ? kern.mirror_row(s, d, width, bpp) : 0;
+        for (; c < width; c++) {
+          std::memcpy(d + c * bpp, s + (width - 1 - c) * bpp, bpp);
+        }
+      }
+    });
+    return;
+  }
+
+  // the destination is 'height' wide and 'width' high
+  unsigned int blocks = (height + 7) / 8;
+  Pool::stripes(blocks, stripe_rows / 8, [&](unsigned int begin, unsigned int end) {
+    for (unsigned int b = begin; b < end; b++) {
+      unsigned int x0 = b * 8;
+      unsigned int c = 0;
+      if (bpp == 1 && kern.transpose8 && x0 + 8 <= height) {
+        int ss = static_cast<int>(src_stride);
+        int ds = static_cast<int>(dst_stride);
+        c = kern.transpose8(src + (mirror ? height - 1 - x0 : x0) * src_stride,
+            mirror ? -ss : ss, dst + (flip ? (width - 1) * dst_stride : 0) + x0,
+            flip ? -ds : ds, width);
+      }
+      for (unsigned int x = x0; x < std::min(x0 + 8, height); x++) {
+        const unsigned char* s = src + (mirror ? height - 1 - x : x) * src_stride;
+        for (unsigned int col = c; col < width; col++) {
+          unsigned int y = flip ? width - 1 - col : col;
+          std::memcpy(dst + y * dst_stride + x * bpp, s + col * bpp, bpp);
+        }
+      }
+    }
+  });
+}
+
+// average luma of each 8x8 block, a 1/8 scale thumbnail
+void scale_luma_yuv420(const unsigned char* src, unsigned int stride,
+    unsigned int width, unsigned int height, unsigned char* dst) {
+
+  unsigned int dst_width = width / 8;
+  unsigned int dst_height = height / 8;
+  const Kernels& kern = Kernels::get();
+  for (unsigned int r = 0; r < dst_height; r++) {
+    const unsigned char* row = src + r * 8 * stride;
+    unsigned int c = kern.luma8_yuv420 ? kern.luma8_yuv420(row, stride, dst, dst_width) : 0;
+    for (; c < dst_width; c++) {
+      unsigned int sum = 0;
+      for (unsigned int k = 0; k < 8; k++) {
+        const unsigned char* p = row + k * stride + c * 8;
+        for (unsigned int i = 0; i < 8; i++) {
+          sum += p[i];
+        }
+      }
+      dst[c] = (sum + 32) >> 6;
+    }
+    dst += dst_width;
+  }
+}
+
+// same for rgb24 with luma approximated as (r + 2g + b) / 4
+void scale_luma_rgb24(const unsigned char* src, unsigned int stride,
+    unsigned int width, unsigned int height, unsigned char* dst) {
+
+  unsigned int dst_width = width / 8;
+  unsigned int dst_height = height / 8;
+  const Kernels& kern = Kernels::get();
+  for (unsigned int r = 0; r < dst_height; r++) {
+    const unsigned char* row = src + r * 8 * stride;
+    unsigned int c = kern.luma8_rgb24 ? kern.luma8_rgb24(row, stride, dst, dst_width) : 0;
+    for (; c < dst_width; c++) {
+      unsigned int sum = 0;
+      for (unsigned int k = 0; k < 8; k++) {
+        const unsigned char* p = row + k * stride + c * 24;
+        for (unsigned int i = 0; i < 8; i++, p += 3) {
+          sum += p[0] + 2 * p[1] + p[2];
+        }
+      }
+      dst[c] = (sum + 128) >> 8;
+    }
+    dst += dst_width;
+  }
+}
+
+// number of bytes under a 0/0xff mask that differ by more than 'threshold'
+unsigned int count_changed(const unsigned char* a, const unsigned char* b,
+    const unsigned char* mask, unsigned int len, unsigned char threshold) {
+
+  unsigned int cnt = 0;
+  const Kernels& kern = Kernels::get();
+  unsigned int i = kern.count_changed ?
+    kern.count_changed(a, b, mask, len, threshold, cnt) : 0;
+  for (; i < len; i++) {
+    unsigned int d = (a[i] > b[i]) ? a[i] - b[i] : b[i] - a[i];
+    if (mask[i] && d > threshold) {
+      cnt++;
+    }
+  }
+  return cnt;
+}
+
+void update_background(const unsigned char* cur, int16_t* bg,
+    const unsigned char* mask, unsigned char* fg, unsigned int len,
+    unsigned char threshold, unsigned int shift) {
+
+  const Kernels& kern = Kernels::get();
+  unsigned int i = kern.update_background ?
+    kern.update_background(cur, bg, mask, fg, len, threshold, shift) : 0;
+  for (; i < len; i++) {
+    int b = bg[i];
+    int d = std::abs(cur[i] - (b >> 4));
+    fg[i] = (d > threshold) ? mask[i] : 0;
+    bg[i] = static_cast<int16_t>(b + (((cur[i] << 4) - b) >> shift));
+  }
+}
+
+FrameHash hash_frame(const unsigned char* src, unsigned int stride,
+    unsigned int width, unsigned int height, unsigned int bpp) {
+
+  FrameHash hash = { 0, 2166136261u, 0, 0 };
+  if (width < 9 * 8 || height < 8 * 8) {
+    return hash;
+  }
+
+  // rgb luma as (r + 2g + b) / 4 like the motion thumbnail, otherwise the
+  // first byte of each pixel is luma
+  unsigned char means[8][9];
+  unsigned int total = 0, lo = 255, hi = 0;
+  for (unsigned int r = 0; r < 8; r++) {
+    for (unsigned int c = 0; c < 9; c++) {
+      unsigned int sum = 0;
+      for (unsigned int i = 0; i < 8; i++) {
+        const unsigned char* row = src + ((r * 8 + i) * height / 64) * stride;
+        for (unsigned int j = 0; j < 8; j++) {
+          const unsigned char* p = row + ((c * 8 + j) * width / 72) * bpp;
+          unsigned int y = (bpp == 3) ? (p[0] + 2 * p[1] + p[2] + 2) >> 2 : p[0];
+          hash.sum = (hash.sum ^ y) * 16777619u;
+          sum += y;
+        }
+      }
+      means[r][c] = (sum + 32) >> 6;
+      total += means[r][c];
+      lo = std::min(lo, static_cast<unsigned int>(means[r][c]));
+      hi = std::max(hi, static_cast<unsigned int>(means[r][c]));
+    }
+  }
+  for (unsigned int r = 0; r < 8; r++) {
+    for (unsigned int c = 0; c < 8; c++) {
+      if (means[r][c + 1] > means[r][c]) {
+        hash.bits |= 1ull << (r * 8 + c);
+      }
+    }
+  }
+  hash.mean = (total + 36) / 72;
+  hash.spread = hi - lo;
+  return hash;
+}
+
+// average 2x2 blocks of one 8 bit plane into a half size plane
+void scale_half_plane(const unsigned char* src, unsigned int src_stride,
+    unsigned char* dst, unsigned int dst_stride, 
+    unsigned int dst_width, unsigned int dst_height) {
+
+  const Kernels& kern = Kernels::get();
+  Pool::stripes(dst_height, stripe_rows, [&](unsigned int begin, unsigned int end) {
+    for (unsigned int r = begin; r < end; r++) {
+      const unsigned char* s0 = src + 2 * r * src_stride;
+      const unsigned char* s1 = s0 + src_stride;
+      unsigned char* d = dst + r * dst_stride;
+      unsigned int c = kern.half_row ? kern.half_row(s0, s1, d, dst_width) : 0;
+      for (; c < dst_width; c++) {
+        d[c] = (s0[2 * c] + s0[2 * c + 1] + s1[2 * c] + s1[2 * c + 1] + 2) >> 2;
+      }
+    }
+  });
+}
+
+// half size i420 for a substream, one pass per plane
+void scale_half_yuv420(const unsigned char* src, unsigned int src_stride, 
+    unsigned int src_slice, unsigned char* dst, unsigned int dst_stride, 
+    unsigned int dst_slice, unsigned int dst_width, unsigned int dst_height) {
+
+  const unsigned char* src_u = src + src_stride * src_slice;
+  const unsigned char* src_v = src_u + (src_stride / 2) * (src_slice / 2);
+  unsigned char* dst_u = dst + dst_stride * dst_slice;
+  unsigned char* dst_v = dst_u + (dst_stride / 2) * (dst_slice / 2);
+  scale_half_plane(src, src_stride, dst, dst_stride, dst_width, dst_height);
+  scale_half_plane(src_u, src_stride / 2, dst_u, dst_stride / 2, 
+      dst_width / 2, dst_height / 2);
+  scale_half_plane(src_v, src_stride / 2, dst_v, dst_stride / 2, 
+      dst_width / 2, dst_height / 2);
+}
+
+void scale_half_rgb24(const unsigned char* src, unsigned int src_stride,
+    unsigned char* dst, unsigned int dst_stride, 
+    unsigned int dst_width, unsigned int dst_height) {
+
+  const Kernels& kern = Kernels::get();
+  Pool::stripes(dst_height, stripe_rows, [&](unsigned int begin, unsigned int end) {
+    for (unsigned int r = begin; r < end; r++) {
+      const unsigned char* s0 = src + 2 * r * src_stride;
+      const unsigned char* s1 = s0 + src_stride;
+      unsigned char* d = dst + r * dst_stride;
+      unsigned int c = kern.half_row_rgb24 ? kern.half_row_rgb24(s0, s1, d, dst_width) : 0;
+      for (; c < dst_width; c++) {
+        for (unsigned int k = 0; k < 3; k++) {
+          d[3 * c + k] = (s0[6 * c + k] + s0[6 * c + 3 + k] + 
+              s1[6 * c + k] + s1[6 * c + 3 + k] + 2) >> 2;
+        }
+      }
+    }
+  });
+}
+
+// set every 4x4 block of one plane to its mean, skipping macroblocks marked
+// in 'keep'.  'mb' is the macroblock size in this plane's pixels.
+static void flatten_plane(unsigned char* data, unsigned int stride, 
+    unsigned int channels, unsigned int width, unsigned int height, 
+    unsigned int mb, const unsigned char* keep, unsigned int mb_cols) {
+
+  // stripes of whole 4 row blocks
+  Pool::stripes(height / 4, stripe_rows / 4, [&](unsigned int begin, unsigned int end) {
+    for (unsigned int y = begin * 4; y < end * 4; y += 4) {
+      const unsigned char* keep_row = keep + (y / mb) * mb_cols;
+      for (unsigned int x = 0; x + 4 <= width; x += 4) {
+        if (keep_row[x / mb]) {
+          continue;
+        }
+        for (unsigned int ch = 0; ch < channels; ch++) {
+          unsigned char* p = data + y * stride + x * channels + ch;
+          unsigned int sum = 0;
+          for (unsigned int k = 0; k < 4; k++) {
+            unsigned char* q = p + k * stride;
+            sum += q[0] + q[channels] + q[2 * channels] + q[3 * channels];
+          }
+          unsigned char avg = (sum + 8) >> 4;
+          for (unsigned int k = 0; k < 4; k++) {
+            unsigned char* q = p + k * stride;
+            q[0] = q[channels] = q[2 * channels] = q[3 * channels] = avg;
+          }
+        }
+      }
+    }
+  });
+}
+
+// flat 4x4 blocks leave only the dc of h264's 4x4 transform, so the encoder
+// spends almost nothing outside the kept macroblocks.  'keep' has one byte
+// per 16x16 macroblock, row major.
+void flatten_yuv420(unsigned char* data, unsigned int stride, unsigned int slice,
+    unsigned int width, unsigned int height, const unsigned char* keep) {
+
+  unsigned int mb_cols = (width + 15) / 16;
+  unsigned char* u = data + stride * slice;
+  unsigned char* v = u + (stride / 2) * (slice / 2);
+  flatten_plane(data, stride, 1, width, height, 16, keep, mb_cols);
+  flatten_plane(u, stride / 2, 1, width / 2, height / 2, 8, keep, mb_cols);
+  flatten_plane(v, stride / 2, 1, width / 2, height / 2, 8, keep, mb_cols);
+}
+
+void flatten_rgb24(unsigned char* data, unsigned int stride,
+    unsigned int width, unsigned int height, const unsigned char* keep) {
+
+  unsigned int mb_cols = (width + 15) / 16;
+  flatten_plane(data, stride, 3, width, height, 16, keep, mb_cols);
+}
+
+// resize and convert in one pass straight from the captured frame, so only
+// model sized rgb is ever produced.  Luma is bilinear, chroma is nearest
+// since it is already half resolution.  'src_stride' is the bytes in a row
+// of luma.
+template<int Fmt>
+static void frame_to_rgb24_scaled(const unsigned char* src,
+    unsigned int src_stride, unsigned int src_slice, const Rect& src_rect,
+    unsigned char* dst, unsigned int dst_width, unsigned int dst_height,
+    const Rect& dst_rect, unsigned char fill) {
+
+  if (!src || !dst || src_rect.w == 0 || src_rect.h == 0 || 
+      dst_rect.w == 0 || dst_rect.h == 0) {
+    return;
+  }
+
+  // where a pixel's luma and chroma sit in their rows
+  constexpr bool packed = Fmt == V4L2_PIX_FMT_YUYV || Fmt == V4L2_PIX_FMT_YVYU;
+  constexpr bool semi = Fmt == V4L2_PIX_FMT_NV12 || Fmt == V4L2_PIX_FMT_NV21;
+  constexpr unsigned int luma_step = packed ? 2 : 1;
+  constexpr unsigned int chroma_step = packed ? 4 : semi ? 2 : 1;
+  const unsigned char* chroma = src + src_stride * src_slice;
+  const unsigned char* pU;
+  const unsigned char* pV;
+  if constexpr (packed) {
+    pU = src + (Fmt == V4L2_PIX_FMT_YVYU ? 3 : 1);
+    pV = src + (Fmt == V4L2_PIX_FMT_YVYU ? 1 : 3);
+  } else if constexpr (semi) {
+    pU = chroma + (Fmt == V4L2_PIX_FMT_NV21 ? 1 : 0);
+    pV = chroma + (Fmt == V4L2_PIX_FMT_NV21 ? 0 : 1);
+  } else {
+    pU = chroma;
+    pV = chroma + (src_stride / 2) * (src_slice / 2);
+  }
+  unsigned int chroma_stride = semi ? src_stride : src_stride / 2;
+
+  fill_rgb24_border(dst, dst_width, dst_height, dst_rect, fill);
+
+  // 16.16 fixed point steps through the source, the same columns every row
+  uint32_t step_x = (src_rect.w << 16) / dst_rect.w;
+  uint32_t step_y = (src_rect.h << 16) / dst_rect.h;
+  std::vector<unsigned int> off0(dst_rect.w), off1(dst_rect.w), offc(dst_rect.w);
+  std::vector<unsigned int> wgt(dst_rect.w);
+  for (unsigned int i = 0; i < dst_rect.w; i++) {
+    uint32_t fx = i * step_x;
+    unsigned int x0 = fx >> 16;
+    unsigned int x1 = (x0 + 1 < src_rect.w) ? x0 + 1 : x0;
+    x0 += src_rect.x;
+    x1 += src_rect.x;
+    off0[i] = x0 * luma_step;
+    off1[i] = x1 * luma_step;
+    offc[i] = (x0 / 2) * chroma_step;
+    wgt[i] = (fx >> 8) & 0xff;
+  }
+
+  Pool::stripes(dst_rect.h, stripe_rows, [&](unsigned int begin, unsigned int end) {
+    for (unsigned int j = begin; j < end; j++) {
+      uint32_t fy = j * step_y;
+      unsigned int y0 = fy >> 16;
+      unsigned int y1 = (y0 + 1 < src_rect.h) ? y0 + 1 : y0;
+      unsigned int wy = (fy >> 8) & 0xff;
+      y0 += src_rect.y;
+      y1 += src_rect.y;
+
+      const unsigned char* row0 = src + y0 * src_stride;
+      const unsigned char* row1 = src + y1 * src_stride;
+      const unsigned char* rowU = pU + (packed ? y0 * src_stride : (y0 / 2) * chroma_stride);
+      const unsigned char* rowV = pV + (packed ? y0 * src_stride : (y0 / 2) * chroma_stride);
+
+      // gather the row, then convert it all at once
+      static thread_local std::vector<unsigned char> luma, cu, cv;
+      luma.resize(dst_rect.w);
+      cu.resize(dst_rect.w);
+      cv.resize(dst_rect.w);
+      for (unsigned int i = 0; i < dst_rect.w; i++) {
+        unsigned int wx = wgt[i];
+        unsigned int top = row0[off0[i]] * (256 - wx) + row0[off1[i]] * wx;
+        unsigned int bot = row1[off0[i]] * (256 - wx) + row1[off1[i]] * wx;
+        luma[i] = (top * (256 - wy) + bot * wy) >> 16;
+        cu[i] = rowU[offc[i]];
+        cv[i] = rowV[offc[i]];
+      }
+      yuv444_row_to_rgb24(luma.data(), cu.data(), cv.data(),
+          dst + ((dst_rect.y + j) * dst_width + dst_rect.x) * 3, dst_rect.w);
+    }
+  });
+}
+
+static void rgb24_to_rgb24_scaled(const unsigned char* src,
+    unsigned int src_stride, unsigned int src_slice, const Rect& src_rect,
+    unsigned char* dst, unsigned int dst_width, unsigned int dst_height,
+    const Rect& dst_rect, unsigned char fill) {
+  resize_rgb24(const_cast<unsigned char*>(src), src_stride, src_rect,
+      dst, dst_width, dst_height, dst_rect, fill);
+}
 
-  unsigned int y_size = width * height;
-  unsigned int uv_size = y_size / 4;
+Rgb24Scaler pick_rgb24_scaler(int fmt) {
+  switch (fmt) {
+    case V4L2_PIX_FMT_RGB24:  return rgb24_to_rgb24_scaled;
+    case V4L2_PIX_FMT_YUV420: return frame_to_rgb24_scaled<V4L2_PIX_FMT_YUV420>;
+    case V4L2_PIX_FMT_NV12:   return frame_to_rgb24_scaled<V4L2_PIX_FMT_NV12>;
+    case V4L2_PIX_FMT_NV21:   return frame_to_rgb24_scaled<V4L2_PIX_FMT_NV21>;
+    case V4L2_PIX_FMT_YUYV:   return frame_to_rgb24_scaled<V4L2_PIX_FMT_YUYV>;
+    case V4L2_PIX_FMT_YVYU:   return frame_to_rgb24_scaled<V4L2_PIX_FMT_YVYU>;
+  }
+  return nullptr;
+}
+
+void convert_to_rgb24_scaled(int fmt, const unsigned char* src,
+    unsigned int src_stride, unsigned int src_slice, const Rect& src_rect,
+    unsigned char* dst, unsigned int dst_width, unsigned int dst_height,
+    const Rect& dst_rect, unsigned char fill) {
+
+  auto fn = pick_rgb24_scaler(fmt);
+  if (!fn) {
+    dbgMsg("unsupported scaled conversion %s\n", PixelFormatToStr(fmt));
+    return;
+  }
+  fn(src, src_stride, src_slice, src_rect, dst, dst_width, dst_height, dst_rect, fill);
+}
+
+void convert_yuv420_to_rgb24_scaled(unsigned char* src, 
+    unsigned int src_stride, unsigned int src_slice, const Rect& src_rect,
+    unsigned char* dst, unsigned int dst_width, unsigned int dst_height,
+    const Rect& dst_rect, unsigned char fill) {
+  convert_to_rgb24_scaled(V4L2_PIX_FMT_YUV420, src, src_stride, src_slice, src_rect,
+      dst, dst_width, dst_height, dst_rect, fill);
+}
 
-  unsigned char* pY = src;
-  unsigned char* pU = src + y_size;
-  unsigned char* pV = src + y_size + uv_size;
+// model input for float tensors, (pixel - zero) * scale
+// the table never points at the last row or column, so the 2x2 around a
+// sample is always there
+static inline unsigned char remap_sample(const unsigned char* plane, unsigned int stride,
+    const uint16_t* xy, unsigned int shift, unsigned char fill) {
+  if (xy[0] == remap_none) {
+    return fill;
+  }
+  unsigned int x = xy[0] >> shift;
+  unsigned int y = xy[1] >> shift;
+  const unsigned char* p = plane + (y >> 4) * stride + (x >> 4);
+  unsigned int wx = x & 15;
+  unsigned int wy = y & 15;
+  unsigned int top = p[0] * (16 - wx) + p[1] * wx;
+  unsigned int bot = p[stride] * (16 - wx) + p[stride + 1] * wx;
+  return (top * (16 - wy) + bot * wy + 128) >> 8;
+}
+
+static void remap_row(const unsigned char* plane, unsigned int stride,
+    const uint16_t* lut, unsigned int shift, unsigned char fill,
+    unsigned char* dst, unsigned int num) {
+
+  const Kernels& kern = Kernels::get();
+  unsigned int i = kern.remap_row ? kern.remap_row(plane, stride, lut, shift, fill, dst, num) : 0;
+  for (; i < num; i++) {
+    dst[i] = remap_sample(plane, stride, lut + i * 2, shift, fill);
+  }
+}
+
+// like the scaler, gather a row of luma and chroma then convert it at once
+void remap_to_rgb24(const unsigned char* src, unsigned int src_stride,
+    unsigned int src_slice, unsigned int pix_fmt, const RemapXY* lut,
+    unsigned char* dst, unsigned int width, unsigned int height) {
+
+  if (!src || !dst || !lut || width == 0 || height == 0) {
+    return;
+  }
+
+  if (pix_fmt == V4L2_PIX_FMT_RGB24) {
+    Pool::stripes(height, stripe_rows, [&](unsigned int begin, unsigned int end) {
+      for (unsigned int j = begin; j < end; j++) {
+        const RemapXY* xy = lut + j * width;
+        unsigned char* out = dst + j * width * 3;
+        for (unsigned int i = 0; i < width; i++, out += 3) {
+          if (xy[i].x == remap_none) {
+            out[0] = out[1] = out[2] = 0;
+            continue;
+          }
+          unsigned int wx = xy[i].x & 15;
+          unsigned int wy = xy[i].y & 15;
+          const unsigned char* p = src + (xy[i].y >> 4) * src_stride + (xy[i].x >> 4) * 3;
+          for (unsigned int c = 0; c < 3; c++) {
+            unsigned int top = p[c] * (16 - wx) + p[c + 3] * wx;
+            unsigned int bot = p[src_stride + c] * (16 - wx) + p[src_stride + c + 3] * wx;
+            out[c] = (top * (16 - wy) + bot * wy + 128) >> 8;
+          }
+        }
+      }
+    });
+    return;
+  }
 
-  for (unsigned int y = 0; y < height; y++) {
-    for (unsigned int x = 0; x < width; x++) {
-      dst = yuv2rgb(dst, pY[x], pU[x/2], pV[x/2]);
+  const unsigned char* pU = src + src_stride * src_slice;
+  const unsigned char* pV = pU + (src_stride / 2) * (src_slice / 2);
+  Pool::stripes(height, stripe_rows, [&](unsigned int begin, unsigned int end) {
+    static thread_local std::vector<unsigned char> luma, cu, cv;
+    luma.resize(width);
+    cu.resize(width);
+    cv.resize(width);
+    for (unsigned int j = begin; j < end; j++) {
+      const uint16_t* xy = reinterpret_cast<const uint16_t*>(lut + j * width);
+      remap_row(src, src_stride, xy, 0, 16, luma.data(), width);
+      remap_row(pU, src_stride / 2, xy, 1, 128, cu.data(), width);
+      remap_row(pV, src_stride / 2, xy, 1, 128, cv.data(), width);
+      yuv444_row_to_rgb24(luma.data(), cu.data(), cv.data(), dst + j * width * 3, width);
     }
-    pY += width;
-    if (y % 2) {
-      pU += width / 2;
-      pV += width / 2;
+  });
+}
+
+void quantise_rgb24(const unsigned char* src, float* dst, unsigned int len,
+    float scale, float zero) {
+
+  const Kernels& kern = Kernels::get();
+  unsigned int i = kern.quantise ? kern.quantise(src, dst, len, scale, zero) : 0;
+  for (; i < len; i++) {
+    dst[i] = src[i] * scale - zero * scale;
+  }
+}
+
+void sample_patch(const unsigned char* src, unsigned int stride, float x, float y,
+    unsigned int w, unsigned int h, float* dst) {
+
+  const Kernels& kern = Kernels::get();
+  int ix = static_cast<int>(std::floor(x));
+  int iy = static_cast<int>(std::floor(y));
+  unsigned int wx = static_cast<unsigned int>((x - ix) * 256.f + .5f);
+  unsigned int wy = static_cast<unsigned int>((y - iy) * 256.f + .5f);
+  if (wx == 256) {
+    ix++;
+    wx = 0;
+  }
+  if (wy == 256) {
+    iy++;
+    wy = 0;
+  }
+  const float f00 = (256 - wx) * (256 - wy) / 65536.f;
+  const float f01 = wx * (256 - wy) / 65536.f;
+  const float f10 = (256 - wx) * wy / 65536.f;
+  const float f11 = wx * wy / 65536.f;
+  for (unsigned int r = 0; r < h; r++, dst += w) {
+    const unsigned char* row0 = src + (iy + r) * stride + ix;
+    const unsigned char* row1 = row0 + stride;
+    unsigned int c = kern.sample_row ? kern.sample_row(row0, row1, wx, wy, dst, w) : 0;
+    for (; c < w; c++) {
+      dst[c] = row0[c] * f00 + row0[c + 1] * f01 + row1[c] * f10 + row1[c + 1] * f11;
     }
   }
 }
 
+float dot_f32(const float* a, const float* b, unsigned int len) {
+
+  const Kernels& kern = Kernels::get();
+  float sum = 0.f;
+  unsigned int i = kern.dot_f32 ? kern.dot_f32(a, b, len, sum) : 0;
+  for (; i < len; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+// bt.601 studio swing, the inverse of yuv2rgb()
+void convert_rgb_to_yuv(unsigned char r, unsigned char g, unsigned char b,
+    unsigned char& y, unsigned char& u, unsigned char& v) {
+  y = static_cast<unsigned char>(( 66 * r + 129 * g +  25 * b + 128) / 256 +  16);
+  u = static_cast<unsigned char>((-38 * r -  74 * g + 112 * b + 128) / 256 + 128);
+  v = static_cast<unsigned char>((112 * r -  94 * g -  18 * b + 128) / 256 + 128);
+}
+
 bool drawYUVHorizontalLine(unsigned int thick, unsigned char* start, 
     unsigned int stride, unsigned int width, unsigned char val) {
 
@@ -272,99 +1157,244 @@ bool drawYUVVerticalLine(unsigned int thick, unsigned char* start,
   return true;
 }
 
-bool drawYUVBox(unsigned int thick,
+// a run of one rgb24 colour
+static inline void fill_rgb24(unsigned char* dst, unsigned int len, const unsigned char* c) {
+
+  const Kernels& kern = Kernels::get();
+  unsigned int i = kern.fill_rgb24 ? kern.fill_rgb24(dst, len, c) : 0;
+  for (; i < len; i++) {
+    dst[i * 3] = c[0];
+    dst[i * 3 + 1] = c[1];
+    dst[i * 3 + 2] = c[2];
+  }
+}
+
+// the clipped part of [x0, x1) on a row
+template<unsigned int Bpp>
+static inline void fill_span(unsigned char* row, int x0, int x1, int width,
+    const unsigned char* c) {
+
+  x0 = std::max(x0, 0);
+  x1 = std::min(x1, width);
+  if (x0 >= x1) {
+    return;
+  }
+  if (Bpp == 1) {
+    std::memset(row + x0, c[0], x1 - x0);
+  } else {
+    fill_rgb24(row + x0 * 3, x1 - x0, c);
+  }
+}
+
+// outlines on one plane a row at a time, so each row is visited once for
+// all the boxes.  Boxes join the rows' list at their top and leave it at
+// their bottom, so a row only looks at the boxes across it and the rows
+// between boxes are skipped, and they stay in list order so overlaps come
+// out the same.  'shift' 1 halves the boxes for the chroma planes and
+// 'plane' picks the box's colour byte when 'Bpp' is 1.
+template<unsigned int Bpp>
+static void draw_plane_boxes(unsigned int thick, unsigned char* dst, unsigned int stride,
+    unsigned int width, unsigned int height, const DrawBox* boxes, unsigned int num,
+    unsigned int shift, unsigned int plane) {
+
+  int t = thick >> shift;
+  if (t == 0 || num == 0) {
+    return;
+  }
+  static thread_local std::vector<unsigned int> order, across;
+  order.clear();
+  across.clear();
+  for (unsigned int k = 0; k < num; k++) {
+    const Rect& r = boxes[k].rect;
+    if ((r.h >> shift) != 0 && (r.y >> shift) < height) {
+      order.push_back(k);
+    }
+  }
+  std::stable_sort(order.begin(), order.end(), [boxes](unsigned int a, unsigned int b) {
+    return boxes[a].rect.y < boxes[b].rect.y;
+  });
+
+  size_t next = 0;
+  int bottom = static_cast<int>(height);
+  for (int j = 0; j < bottom && (next < order.size() || !across.empty()); j++) {
+    if (across.empty()) {
+      j = std::max(j, static_cast<int>(boxes[order[next]].rect.y >> shift));
+    }
+    for (; next < order.size() && static_cast<int>(boxes[order[next]].rect.y >> shift) <= j; next++) {
+      across.insert(std::lower_bound(across.begin(), across.end(), order[next]), order[next]);
+    }
+    unsigned char* row = dst + j * stride;
+    for (size_t i = 0; i < across.size();) {
+      const Rect& r = boxes[across[i]].rect;
+      int x = r.x >> shift, y = r.y >> shift;
+      int w = r.w >> shift, h = r.h >> shift;
+      if (j >= y + h) {
+        across.erase(across.begin() + i);
+        continue;
+      }
+      const unsigned char* c = boxes[across[i]].c + (Bpp == 1 ? plane : 0);
+      if (j < y + t || j >= y + h - t) {
+        fill_span<Bpp>(row, x, x + w, width, c);
+      } else {
+        fill_span<Bpp>(row, x, x + t, width, c);
+        fill_span<Bpp>(row, x + w - t, x + w, width, c);
+      }
+      i++;
+    }
+  }
+}
+
+bool drawYUVBoxes(unsigned int thick,
     unsigned char* dst_y, unsigned int dst_stride_y,
     unsigned char* dst_u, unsigned int dst_stride_u,
     unsigned char* dst_v, unsigned int dst_stride_v,
-    unsigned int x, 
-    unsigned int y, 
-    unsigned int width, 
-    unsigned int height,
-    unsigned char val_y, 
-    unsigned char val_u, 
-    unsigned char val_v) {
-  unsigned int half_thick = thick / 2;
-  unsigned int half_width = width / 2;
-  unsigned int half_height = height / 2;
-  unsigned char* start_y = dst_y + y * dst_stride_y + x;
-  unsigned char* start_u = dst_u + (y / 2) * dst_stride_u + (x / 2);
-  unsigned char* start_v = dst_v + (y / 2) * dst_stride_v + (x / 2);
+    unsigned int width, unsigned int height,
+    const DrawBox* boxes, unsigned int num) {
+
   if (!dst_y || !dst_u || !dst_v || thick == 0) {
     return false;
   }
   if (width == 0 || height == 0) {
     return true;
   }
+  draw_plane_boxes<1>(thick, dst_y, dst_stride_y, width, height, boxes, num, 0, 0);
+  draw_plane_boxes<1>(thick, dst_u, dst_stride_u, width / 2, height / 2, boxes, num, 1, 1);
+  draw_plane_boxes<1>(thick, dst_v, dst_stride_v, width / 2, height / 2, boxes, num, 1, 2);
+  return true;
+}
 
-  // draw horizontal lines
-  drawYUVHorizontalLine(thick, start_y, dst_stride_y, width, val_y);
-  drawYUVHorizontalLine(thick, start_y + (height - thick) * dst_stride_y, 
-      dst_stride_y, width, val_y);
-
-  drawYUVHorizontalLine(half_thick, start_u, dst_stride_u, half_width, val_u);
-  drawYUVHorizontalLine(half_thick, start_u + (half_height - half_thick) * dst_stride_u, 
-      dst_stride_u, half_width, val_u);
-
-  drawYUVHorizontalLine(half_thick, start_v, dst_stride_v, half_width, val_v);
-  drawYUVHorizontalLine(half_thick, start_v + (half_height - half_thick) * dst_stride_v, 
-      dst_stride_v, half_width, val_v);
-
-  // draw vertical lines
-  drawYUVVerticalLine(thick, start_y, dst_stride_y, height, val_y);
-  drawYUVVerticalLine(thick, start_y + width - thick, 
-      dst_stride_y, height, val_y);
+bool drawYUVBox(unsigned int thick,
+    unsigned char* dst_y, unsigned int dst_stride_y,
+    unsigned char* dst_u, unsigned int dst_stride_u,
+    unsigned char* dst_v, unsigned int dst_stride_v,
+    unsigned int width, unsigned int height,
+    unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    unsigned char val_y, unsigned char val_u, unsigned char val_v) {
 
-  drawYUVVerticalLine(half_thick, start_u, dst_stride_u, half_height, val_u);
-  drawYUVVerticalLine(half_thick, start_u + half_width - half_thick,
-      dst_stride_u, half_height, val_u);
+  DrawBox box = { { x, y, w, h }, { val_y, val_u, val_v } };
+  return drawYUVBoxes(thick, dst_y, dst_stride_y, dst_u, dst_stride_u,
+      dst_v, dst_stride_v, width, height, &box, 1);
+}
 
-  drawYUVVerticalLine(half_thick, start_v, dst_stride_v, half_height, val_v);
-  drawYUVVerticalLine(half_thick, start_v + half_width - half_thick,
-      dst_stride_v, half_height, val_v);
+bool drawRGBBoxes(unsigned int thick, unsigned char* dst, unsigned int stride,
+    unsigned int width, unsigned int height, const DrawBox* boxes, unsigned int num) {
 
+  if (!dst) {
+    return false;
+  }
+  if (width == 0 || height == 0) {
+    return true;
+  }
+  draw_plane_boxes<3>(thick, dst, stride, width, height, boxes, num, 0, 0);
   return true;
 }
 
-struct draw_rgb {
-  unsigned char r;
-  unsigned char g;
-  unsigned char b;
-};
-static void drawRGBHorizontalLine(unsigned int thick,
-    struct draw_rgb* start, unsigned int len, unsigned int stride,
+bool drawRGBBox(unsigned int thick, unsigned char* dst, unsigned int stride,
+    unsigned int width, unsigned int height,
+    unsigned int x, unsigned int y, unsigned int w, unsigned int h,
     unsigned char val_r, unsigned char val_g, unsigned char val_b) {
 
-  for (unsigned int t = 0; t < thick; t++) {
-    for (unsigned int l = 0; l < len; l++) {
-      struct draw_rgb* p = start + l;
-      p->r = val_r;
-      p->g = val_g;
-      p->b = val_b;
-    }
-    start += stride;
-  }
+  DrawBox box = { { x, y, w, h }, { val_r, val_g, val_b } };
+  return drawRGBBoxes(thick, dst, stride, width, height, &box, 1);
 }
-static void drawRGBVerticalLine(unsigned int thick,
-    struct draw_rgb* start, unsigned int len, unsigned int stride, 
-    unsigned char val_r, unsigned char val_g, unsigned char val_b) {
-  for (unsigned int l = 0; l < len; l++) {
-    for (unsigned int t = 0; t < thick; t++) {
-      struct draw_rgb* p = start + t;
-      p->r = val_r;
-      p->g = val_g;
-      p->b = val_b;
+
+// the font expanded once per colour pair, and the labels drawn with it,
+// so text on a frame is a row copy per line of pixels
+class TextCache {
+  public:
+    // 8 rows of strlen(txt) * 8 pixels, 'bpp' bytes each
+    const std::vector<unsigned char>& label(const char* txt,
+        const unsigned char* fg, const unsigned char* bg, unsigned int bpp) {
+
+      key_.assign(reinterpret_cast<const char*>(fg), bpp);
+      key_.append(reinterpret_cast<const char*>(bg), bpp);
+      size_t colours = key_.size();
+      key_ += txt;
+      auto it = labels_.find(key_);
+      if (it != labels_.end()) {
+        return it->second;
+      }
+
+      const std::vector<unsigned char>& font = glyphs(key_.substr(0, colours), fg, bg, bpp);
+      if (labels_.size() >= label_max_) {
+        labels_.clear();
+        epoch_++;
+      }
+      std::vector<unsigned char>& out = labels_[key_];
+      unsigned int len = key_.size() - colours;
+      unsigned int glyph_row = 8 * bpp;
+      out.resize(8 * len * glyph_row);
+      for (unsigned int i = 0; i < len; i++) {
+        unsigned int c = static_cast<unsigned char>(txt[i]) & 0x7f;
+        for (unsigned int row = 0; row < 8; row++) {
+          std::memcpy(out.data() + (row * len + i) * glyph_row,
+              font.data() + (c * 8 + row) * glyph_row, glyph_row);
+        }
+      }
+      return out;
     }
-    start += stride;
+
+    // bumped when the labels handed out go away
+    unsigned int epoch() { return epoch_; }
+
+  private:
+    unsigned int epoch_ = 0;
+
+    const std::vector<unsigned char>& glyphs(const std::string& colours,
+        const unsigned char* fg, const unsigned char* bg, unsigned int bpp) {
+
+      auto it = glyphs_.find(colours);
+      if (it != glyphs_.end()) {
+        return it->second;
+      }
+      if (glyphs_.size() >= glyphs_max_) {
+        glyphs_.clear();
+      }
+      std::vector<unsigned char>& font = glyphs_[colours];
+      font.resize(128 * 8 * 8 * bpp);
+      unsigned char* p = font.data();
+      for (unsigned int c = 0; c < 128; c++) {
+        for (unsigned int row = 0; row < 8; row++) {
+          for (unsigned int col = 0; col < 8; col++) {
+            bool set = font8x8_basic[c][row] & 1 << col;
+            std::memcpy(p, set ? fg : bg, bpp);
+            p += bpp;
+          }
+        }
+      }
+      return font;
+    }
+
+    static const unsigned int glyphs_max_ = 16;
+    static const unsigned int label_max_ = 256;
+    std::string key_;
+    std::unordered_map<std::string, std::vector<unsigned char>> glyphs_;
+    std::unordered_map<std::string, std::vector<unsigned char>> labels_;
+};
+static thread_local TextCache text_cache;
+
+// a cached label into the frame, clipped to it
+static void blit_label(const std::vector<unsigned char>& label, unsigned int bpp,
+    unsigned char* dst, unsigned int stride, unsigned int width, unsigned int height,
+    unsigned int x, unsigned int y) {
+
+  if (x >= width || y >= height) {
+    return;
+  }
+  unsigned int label_w = label.size() / (8 * bpp);
+  unsigned int w = std::min(label_w, width - x);
+  unsigned int h = std::min(8u, height - y);
+  for (unsigned int row = 0; row < h; row++) {
+    std::memcpy(dst + (y + row) * stride + x * bpp,
+        label.data() + row * label_w * bpp, w * bpp);
   }
 }
-bool drawRGBBox(unsigned int thick, 
-    unsigned char* dst, unsigned int width, unsigned int height,
-    unsigned int x, unsigned int y, unsigned int w, unsigned int h,
-    unsigned char val_r, unsigned char val_g, unsigned char val_b) {
 
-//  dbgMsg("width: %d, height: %d\n", width, height);
-//  dbgMsg("x: %d, y: %d, w: %d, h: %d\n", x, y, w, h);
-//  dbgMsg("val_r: 0x%x, val_g: 0x%x, val_b: 0x%x\n", val_r, val_g, val_b);
+bool drawRGBText(unsigned char* dst, unsigned int stride,
+    unsigned int width, unsigned int height,
+    unsigned int x, unsigned int y, const char* txt,
+    unsigned char fg_r, unsigned char fg_g, unsigned char fg_b,
+    unsigned char bg_r, unsigned char bg_g, unsigned char bg_b) {
 
   if (!dst) {
     return false;
@@ -372,64 +1402,288 @@ bool drawRGBBox(unsigned int thick,
   if (width == 0 || height == 0) {
     return true;
   }
+  if (!txt || *txt == 0) {
+    return true;
+  }
 
-  unsigned int size_rgb = sizeof(struct draw_rgb);
-  unsigned int stride_y   = width * size_rgb;
-  struct draw_rgb* start  = nullptr;
+  const unsigned char fg[3] = { fg_r, fg_g, fg_b };
+  const unsigned char bg[3] = { bg_r, bg_g, bg_b };
+  blit_label(text_cache.label(txt, fg, bg, 3), 3,
+      dst, stride, width, height, x, y);
 
-  // draw horizontal lines
-  start = (struct draw_rgb*)(dst + (y * stride_y) + (x * size_rgb));
-  drawRGBHorizontalLine(thick, start, w, width, val_r, val_g, val_b);
-  start += (h - thick) * width;
-  drawRGBHorizontalLine(thick, start, w, width, val_r, val_g, val_b);
+  return true;
+}
 
-  // draw vertical lines
-  start = (struct draw_rgb*)(dst + (y * stride_y) + (x * size_rgb));
-  drawRGBVerticalLine(thick, start, h, width, val_r, val_g, val_b);
-  start += (w - thick);
-  drawRGBVerticalLine(thick, start, h, width, val_r, val_g, val_b);
+// a label with its own alpha, 4 bytes a pixel, 8 rows
+const std::vector<unsigned char>& labelSprite(const char* txt,
+    const unsigned char* fg, const unsigned char* bg) {
+  return text_cache.label(txt, fg, bg, 4);
+}
 
-  return true;
+unsigned int labelEpoch() {
+  return text_cache.epoch();
 }
 
-bool drawRGBText(unsigned char* dst,
-    unsigned int width, unsigned int height,
-    unsigned int x, unsigned int y, const char* txt,
-    unsigned char fg_r, unsigned char fg_g, unsigned char fg_b,
-    unsigned char bg_r, unsigned char bg_g, unsigned char bg_b) {
+// c over p, 'a' of 255 covers it; x / 255 as (x + (x + 128) / 256 + 128) / 256
+static inline unsigned char blend(unsigned int p, unsigned int c, unsigned int a) {
+  unsigned int t = c * a + p * (255 - a);
+  return (t + ((t + 128) >> 8) + 128) >> 8;
+}
+
+// one colour at one alpha over a clipped run
+template<unsigned int Bpp>
+static void blend_span(unsigned char* row, unsigned int len, const unsigned char* c,
+    unsigned char a) {
+
+  const Kernels& kern = Kernels::get();
+  unsigned int i = kern.blend_span ? kern.blend_span(row, len, c, a, Bpp) : 0;
+  for (; i < len; i++) {
+    for (unsigned int k = 0; k < Bpp; k++) {
+      row[i * Bpp + k] = blend(row[i * Bpp + k], c[k], a);
+    }
+  }
+}
+
+// filled rectangles on one plane, 'shift' 1 for the chroma planes
+template<unsigned int Bpp>
+static void blend_plane_rects(unsigned char* dst, unsigned int stride,
+    unsigned int width, unsigned int height, const BlendRect* rects, unsigned int num,
+    unsigned int shift, unsigned int plane) {
+
+  for (unsigned int k = 0; k < num; k++) {
+    const Rect& r = rects[k].rect;
+    unsigned int x0 = r.x >> shift;
+    unsigned int y0 = r.y >> shift;
+    unsigned int x1 = std::min((r.x + r.w + shift) >> shift, width);
+    unsigned int y1 = std::min((r.y + r.h + shift) >> shift, height);
+    if (x0 >= x1 || y0 >= y1) {
+      continue;
+    }
+    const unsigned char* c = rects[k].c + (Bpp == 1 ? plane : 0);
+    for (unsigned int j = y0; j < y1; j++) {
+      unsigned char* row = dst + j * stride;
+      if (rects[k].alpha == 255) {
+        fill_span<Bpp>(row, x0, x1, width, c);
+      } else {
+        blend_span<Bpp>(row + x0 * Bpp, x1 - x0, c, rects[k].alpha);
+      }
+    }
+  }
+}
+
+bool blendRGBRects(unsigned char* dst, unsigned int stride,
+    unsigned int width, unsigned int height, const BlendRect* rects, unsigned int num) {
 
   if (!dst) {
     return false;
   }
-  if (width == 0 || height == 0) {
+  blend_plane_rects<3>(dst, stride, width, height, rects, num, 0, 0);
+  return true;
+}
+
+bool blendYUVRects(unsigned char* dst_y, unsigned int dst_stride_y,
+    unsigned char* dst_u, unsigned int dst_stride_u,
+    unsigned char* dst_v, unsigned int dst_stride_v,
+    unsigned int width, unsigned int height, const BlendRect* rects, unsigned int num) {
+
+  if (!dst_y || !dst_u || !dst_v) {
+    return false;
+  }
+  blend_plane_rects<1>(dst_y, dst_stride_y, width, height, rects, num, 0, 0);
+  blend_plane_rects<1>(dst_u, dst_stride_u, width / 2, height / 2, rects, num, 1, 1);
+  blend_plane_rects<1>(dst_v, dst_stride_v, width / 2, height / 2, rects, num, 1, 2);
+  return true;
+}
+
+bool blendRGBSprite(unsigned char* dst, unsigned int stride,
+    unsigned int width, unsigned int height, unsigned int x, unsigned int y,
+    const unsigned char* sprite, unsigned int sprite_w, unsigned int sprite_h) {
+
+  if (!dst || !sprite) {
+    return false;
+  }
+  if (x >= width || y >= height) {
     return true;
   }
-  if (!txt || *txt == 0) {
+  unsigned int w = std::min(sprite_w, width - x);
+  unsigned int h = std::min(sprite_h, height - y);
+  const Kernels& kern = Kernels::get();
+  for (unsigned int j = 0; j < h; j++) {
+    const unsigned char* src = sprite + j * sprite_w * 4;
+    unsigned char* row = dst + (y + j) * stride + x * 3;
+    unsigned int i = kern.blend_rgba ? kern.blend_rgba(row, src, w) : 0;
+    for (; i < w; i++) {
+      const unsigned char* s = src + i * 4;
+      row[i * 3] = blend(row[i * 3], s[0], s[3]);
+      row[i * 3 + 1] = blend(row[i * 3 + 1], s[1], s[3]);
+      row[i * 3 + 2] = blend(row[i * 3 + 2], s[2], s[3]);
+    }
+  }
+  return true;
+}
+
+// chroma from the top left pixel of each 2x2, so the sprite lands on even
+// coordinates
+bool blendYUVSprite(unsigned char* dst_y, unsigned int dst_stride_y,
+    unsigned char* dst_u, unsigned int dst_stride_u,
+    unsigned char* dst_v, unsigned int dst_stride_v,
+    unsigned int width, unsigned int height, unsigned int x, unsigned int y,
+    const unsigned char* sprite, unsigned int sprite_w, unsigned int sprite_h) {
+
+  if (!dst_y || !dst_u || !dst_v || !sprite) {
+    return false;
+  }
+  x &= ~1u;
+  y &= ~1u;
+  if (x >= width || y >= height) {
     return true;
   }
+  unsigned int w = std::min(sprite_w, width - x);
+  unsigned int h = std::min(sprite_h, height - y);
+  const Kernels& kern = Kernels::get();
+  for (unsigned int j = 0; j < h; j++) {
+    const unsigned char* src = sprite + j * sprite_w * 4;
+    unsigned char* row = dst_y + (y + j) * dst_stride_y + x;
+    unsigned int i = kern.blend_luma ? kern.blend_luma(row, src, w) : 0;
+    for (; i < w; i++) {
+      row[i] = blend(row[i], src[i * 4], src[i * 4 + 3]);
+    }
+
+    if (j % 2) {
+      continue;
+    }
+    unsigned char* row_u = dst_u + ((y + j) / 2) * dst_stride_u + x / 2;
+    unsigned char* row_v = dst_v + ((y + j) / 2) * dst_stride_v + x / 2;
+    i = kern.blend_chroma ? kern.blend_chroma(row_u, row_v, src, w) : 0;
+    for (; i + 2 <= w; i += 2) {
+      const unsigned char* s = src + i * 4;
+      row_u[i / 2] = blend(row_u[i / 2], s[1], s[3]);
+      row_v[i / 2] = blend(row_v[i / 2], s[2], s[3]);
+    }
+  }
+  return true;
+}
+
+void rgba_to_yuva(const unsigned char* src, unsigned char* dst, unsigned int num) {
+  for (unsigned int i = 0; i < num; i++) {
+    convert_rgb_to_yuv(src[0], src[1], src[2], dst[0], dst[1], dst[2]);
+    dst[3] = src[3];
+    src += 4;
+    dst += 4;
+  }
+}
+
+bool parse_cpus(const std::string& str, std::vector<unsigned int>& cpus) {
+
+  cpus.clear();
+  size_t pos = 0;
+  while (pos < str.size()) {
+    size_t plus = str.find('+', pos);
+    std::string item = str.substr(pos, plus == std::string::npos ? plus : plus - pos);
+    pos = (plus == std::string::npos) ? str.size() : plus + 1;
+    unsigned int lo, hi;
+    int n = sscanf(item.c_str(), "%u-%u", &lo, &hi);
+    if (n < 1 || lo >= CPU_SETSIZE) {
+      return false;
+    }
+    if (n == 1) {
+      hi = lo;
+    }
+    for (unsigned int i = lo; i <= hi && i < CPU_SETSIZE; i++) {
+      cpus.push_back(i);
+    }
+  }
+  return true;
+}
 
-  unsigned int size_rgb = sizeof(struct draw_rgb);
-  unsigned int stride_y = width * size_rgb;
+bool parse_zones(const std::string& str, std::vector<BlendRect>& zones) {
+
+  zones.clear();
+  size_t pos = 0;
+  while (pos < str.size()) {
+    size_t colon = str.find(':', pos);
+    std::string item = str.substr(pos, colon == std::string::npos ? colon : colon - pos);
+    pos = (colon == std::string::npos) ? str.size() : colon + 1;
+    BlendRect zone = { { 0, 0, 0, 0 }, { 0, 0, 0 }, 255 };
+    unsigned int alpha = 255;
+    int n = sscanf(item.c_str(), "%u,%u,%u,%u,%u", &zone.rect.x, &zone.rect.y,
+        &zone.rect.w, &zone.rect.h, &alpha);
+    if (n < 4 || zone.rect.w == 0 || zone.rect.h == 0 || alpha > 255) {
+      return false;
+    }
+    zone.alpha = alpha;
+    zones.push_back(zone);
+  }
+  return true;
+}
 
-  for (int i = 0; *txt; i++) {
+unsigned int since_start_ms() {
+  using namespace std::chrono;
+  return duration_cast<milliseconds>(steady_clock::now() - start_time).count();
+}
 
-    char* bitmap = font8x8_basic[(int)*txt];
-    struct draw_rgb* start = (struct draw_rgb*)(dst + (y * stride_y) + (x * size_rgb) + (i * size_rgb * 8));
+// 0 until a lockstep replay steps it
+static std::atomic<int64_t> pipeline_ticks{0};
 
-    for (int row = 0; row < 8; row++) {
-      for (int col = 0; col < 8; col++) {
-        int set = bitmap[row] & 1 << col;
-        struct draw_rgb* p = start + col;
-        p->r = set ? fg_r : bg_r;
-        p->g = set ? fg_g : bg_g;
-        p->b = set ? fg_b : bg_b;
+std::chrono::steady_clock::time_point pipeline_now() {
+  int64_t ticks = pipeline_ticks.load(std::memory_order_acquire);
+  if (ticks == 0) {
+    return std::chrono::steady_clock::now();
+  }
+  return std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(ticks));
+}
+
+void pipeline_step(std::chrono::steady_clock::time_point at) {
+  pipeline_ticks.store(at.time_since_epoch().count(), std::memory_order_release);
+}
+
+static_assert(sizeof(std::atomic<int>) == sizeof(int), "futex words are plain ints");
+
+void futex_wait(std::atomic<int>& word, int val, unsigned int usec) {
+  struct timespec ts;
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
+  syscall(SYS_futex, reinterpret_cast<int*>(&word), FUTEX_WAIT_PRIVATE, val,
+      usec ? &ts : nullptr, nullptr, 0);
+}
+
+void futex_wake(std::atomic<int>& word, int num) {
+  syscall(SYS_futex, reinterpret_cast<int*>(&word), FUTEX_WAKE_PRIVATE, num,
+      nullptr, nullptr, 0);
+}
+
+// the word is rechecked in the kernel, a post between the last look and
+// the sleep makes the wait return at once
+template<typename T>
+static bool futex_sleep(T& obj, std::atomic<int>& word,
+    std::atomic<int>& waiters, unsigned int usec) {
+
+  using namespace std::chrono;
+  auto until = steady_clock::now() + microseconds(usec);
+  waiters.fetch_add(1);
+  bool got = false;
+  while (!(got = obj.try_wait())) {
+    unsigned int left = 0;
+    if (usec) {
+      auto now = steady_clock::now();
+      if (now >= until) {
+        break;
       }
-      start += width;
+      left = std::max(static_cast<unsigned int>(
+            duration_cast<microseconds>(until - now).count()), 1u);
     }
-    txt++;
+    futex_wait(word, 0, left);
   }
+  waiters.fetch_sub(1);
+  return got;
+}
 
-  return true;
+bool Semaphore::sleep(unsigned int usec) {
+  return futex_sleep(*this, cnt_, waiters_, usec);
+}
+
+bool Event::sleep(unsigned int usec) {
+  return futex_sleep(*this, set_, waiters_, usec);
 }
 
 const char* BufTypeToStr(unsigned int bt) {
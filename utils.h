@@ -25,9 +25,15 @@
 #include <time.h>
 #include <stdint.h>
 #include <limits>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
 #include <cstring>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
 
 namespace detector {
 
@@ -48,33 +54,246 @@ void convert_to_yuv420(int fmt,
     unsigned char* src, unsigned int src_width, unsigned int src_height,
     unsigned char* dst, unsigned int dst_width, unsigned int dst_height);
 
+// the converters below come specialised on the format, and on 640x480,
+// 1280x720 and 1920x1080, so a stream picks its own once at start; the
+// convert_* calls pick on every call
+typedef void (*Yuv420Converter)(
+    unsigned char* src, unsigned int src_width, unsigned int src_height,
+    unsigned char* dst, unsigned int dst_width, unsigned int dst_height);
+Yuv420Converter pick_yuv420_converter(int fmt, unsigned int src_width, unsigned int src_height,
+    unsigned int dst_width, unsigned int dst_height);
+
 void convert_yuv420_to_rgb24(unsigned char* src, unsigned char* dst, 
     unsigned int width, unsigned int height);
 
+// yuv420, nv12, nv21, yuyv or yvyu to packed rgb (or bgr).  strides are in
+// bytes, the chroma starts 'src_slice' luma rows in.  neon when built for it.
+void convert_to_rgb24(int fmt, const unsigned char* src, unsigned int src_stride,
+    unsigned int src_slice, unsigned char* dst, unsigned int dst_stride,
+    unsigned int width, unsigned int height, bool bgr);
+
+typedef void (*Rgb24Converter)(const unsigned char* src, unsigned int src_stride,
+    unsigned int src_slice, unsigned char* dst, unsigned int dst_stride,
+    unsigned int width, unsigned int height);
+Rgb24Converter pick_rgb24_converter(int fmt, unsigned int width, unsigned int height,
+    bool bgr);
+
+// and back to yuv420, chroma from each 2x2 average, even sizes only
+void convert_rgb24_to_yuv420(const unsigned char* src, unsigned int src_stride,
+    unsigned char* dst, unsigned int dst_stride, unsigned int dst_slice,
+    unsigned int width, unsigned int height, bool bgr);
+
+// a region of an image in pixels
+class Rect {
+  public:
+    unsigned int x;
+    unsigned int y;
+    unsigned int w;
+    unsigned int h;
+};
+
+void convert_to_rgb24_scaled(int fmt, const unsigned char* src,
+    unsigned int src_stride, unsigned int src_slice, const Rect& src_rect,
+    unsigned char* dst, unsigned int dst_width, unsigned int dst_height,
+    const Rect& dst_rect, unsigned char fill);
+
+typedef void (*Rgb24Scaler)(const unsigned char* src,
+    unsigned int src_stride, unsigned int src_slice, const Rect& src_rect,
+    unsigned char* dst, unsigned int dst_width, unsigned int dst_height,
+    const Rect& dst_rect, unsigned char fill);
+Rgb24Scaler pick_rgb24_scaler(int fmt);
+
+void convert_yuv420_to_rgb24_scaled(unsigned char* src, 
+    unsigned int src_stride, unsigned int src_slice, const Rect& src_rect,
+    unsigned char* dst, unsigned int dst_width, unsigned int dst_height,
+    const Rect& dst_rect, unsigned char fill);
+
+void resize_rgb24(unsigned char* src, unsigned int src_stride, const Rect& src_rect,
+    unsigned char* dst, unsigned int dst_width, unsigned int dst_height,
+    const Rect& dst_rect, unsigned char fill);
+
+// 'src_rect' of a plane of 'bpp' byte pixels onto all of a dst_width x
+// dst_height window of another, bilinear, leaving the rest of it alone
+void resize_plane(const unsigned char* src, unsigned int src_stride, const Rect& src_rect,
+    unsigned int bpp, unsigned char* dst, unsigned int dst_stride,
+    unsigned int dst_width, unsigned int dst_height);
+
+// a width x height plane of 'bpp' byte pixels into another, its columns
+// made rows with 'swap', then each row reversed with 'mirror' and the
+// order of the rows with 'flip'.  A quarter turn clockwise is swap and
+// mirror, anticlockwise swap and flip, a half turn mirror and flip.
+void orient_plane(const unsigned char* src, unsigned int src_stride,
+    unsigned int width, unsigned int height, unsigned int bpp,
+    unsigned char* dst, unsigned int dst_stride, bool swap, bool mirror, bool flip);
+
+// a remap table's entry for a pixel, where it comes from in 16ths of a
+// pixel, 'remap_none' for nowhere
+struct RemapXY {
+  uint16_t x;
+  uint16_t y;
+};
+const uint16_t remap_none = 0xffff;
+
+// a width x height rgb24 image, each pixel sampled bilinear from an i420
+// or rgb24 frame where 'lut' says, black where it says nowhere
+void remap_to_rgb24(const unsigned char* src, unsigned int src_stride,
+    unsigned int src_slice, unsigned int pix_fmt, const RemapXY* lut,
+    unsigned char* dst, unsigned int width, unsigned int height);
+
+void quantise_rgb24(const unsigned char* src, float* dst, unsigned int len,
+    float scale, float zero);
+
+float dot_f32(const float* a, const float* b, unsigned int len);
+
+void scale_luma_yuv420(const unsigned char* src, unsigned int stride,
+    unsigned int width, unsigned int height, unsigned char* dst);
+
+void scale_luma_rgb24(const unsigned char* src, unsigned int stride,
+    unsigned int width, unsigned int height, unsigned char* dst);
+
+unsigned int count_changed(const unsigned char* a, const unsigned char* b,
+    const unsigned char* mask, unsigned int len, unsigned char threshold);
+
+// move a running average background 'bg', 8.4 fixed point, 1 / 2^shift of
+// the way to 'cur' and mark in 'fg' the cells under 'mask' that differ
+// from it by more than 'threshold'
+void update_background(const unsigned char* cur, int16_t* bg,
+    const unsigned char* mask, unsigned char* fg, unsigned int len,
+    unsigned char threshold, unsigned int shift);
+
+// a difference hash of a frame's luma on a 9x8 grid of block means, taken
+// from 8x8 samples a block.  'sum' is a checksum of the samples themselves,
+// 'mean' and 'spread' the average and range of the block means.
+class FrameHash {
+  public:
+    uint64_t bits;
+    uint32_t sum;
+    unsigned char mean;
+    unsigned char spread;
+};
+FrameHash hash_frame(const unsigned char* src, unsigned int stride,
+    unsigned int width, unsigned int height, unsigned int bpp);
+inline unsigned int hash_distance(uint64_t a, uint64_t b) {
+  return __builtin_popcountll(a ^ b);
+}
+
+void scale_half_yuv420(const unsigned char* src, unsigned int src_stride, 
+    unsigned int src_slice, unsigned char* dst, unsigned int dst_stride, 
+    unsigned int dst_slice, unsigned int dst_width, unsigned int dst_height);
+
+void scale_half_rgb24(const unsigned char* src, unsigned int src_stride,
+    unsigned char* dst, unsigned int dst_stride, 
+    unsigned int dst_width, unsigned int dst_height);
+
+void scale_half_plane(const unsigned char* src, unsigned int src_stride,
+    unsigned char* dst, unsigned int dst_stride, 
+    unsigned int dst_width, unsigned int dst_height);
+
+// a w x h patch of an 8 bit plane at x,y, bilinear, in floats.  It reads
+// up to x + w + 1 and y + h + 1.
+void sample_patch(const unsigned char* src, unsigned int stride, float x, float y,
+    unsigned int w, unsigned int h, float* dst);
+
+void flatten_yuv420(unsigned char* data, unsigned int stride, unsigned int slice,
+    unsigned int width, unsigned int height, const unsigned char* keep);
+
+void flatten_rgb24(unsigned char* data, unsigned int stride,
+    unsigned int width, unsigned int height, const unsigned char* keep);
+
+void convert_rgb_to_yuv(unsigned char r, unsigned char g, unsigned char b,
+    unsigned char& y, unsigned char& u, unsigned char& v);
+
 bool drawYUVHorizontalLine(unsigned int thick, 
     unsigned char* start, unsigned int stride, 
     unsigned int width, unsigned char val);
 bool drawYUVVerticalLine(unsigned int thick, 
     unsigned char* start, unsigned int stride, 
     unsigned int height, unsigned char val);
+
+// a box outline for the batched drawing, its rgb or yuv colour in 'c'.
+// the boxes are clipped to the frame, strides are in bytes.
+class DrawBox {
+  public:
+    Rect rect;
+    unsigned char c[3];
+};
+
+bool drawYUVBoxes(unsigned int thick,
+    unsigned char* dst_y, unsigned int dst_stride_y,
+    unsigned char* dst_u, unsigned int dst_stride_u,
+    unsigned char* dst_v, unsigned int dst_stride_v,
+    unsigned int width, unsigned int height,
+    const DrawBox* boxes, unsigned int num);
 bool drawYUVBox(unsigned int thick,
     unsigned char* dst_y, unsigned int dst_stride_y,
     unsigned char* dst_u, unsigned int dst_stride_u,
     unsigned char* dst_v, unsigned int dst_stride_v,
+    unsigned int width, unsigned int height,
     unsigned int x, unsigned int y, unsigned int w, unsigned int h,
     unsigned char val_y, unsigned char val_u, unsigned char val_v);
 
-bool drawRGBBox(unsigned int thick, unsigned char* dst,
+bool drawRGBBoxes(unsigned int thick, unsigned char* dst, unsigned int stride,
+    unsigned int width, unsigned int height, const DrawBox* boxes, unsigned int num);
+bool drawRGBBox(unsigned int thick, unsigned char* dst, unsigned int stride,
     unsigned int width, unsigned int height,
     unsigned int x, unsigned int y, unsigned int w, unsigned int h,
     unsigned char val_r, unsigned char val_g, unsigned char val_b);
 
-bool drawRGBText(unsigned char* dst,
+bool drawRGBText(unsigned char* dst, unsigned int stride,
     unsigned int width, unsigned int height,
     unsigned int x, unsigned int y, const char* txt,
     unsigned char fg_r, unsigned char fg_g, unsigned char fg_b,
     unsigned char bg_r, unsigned char bg_g, unsigned char bg_b);
 
+// alpha blending, 255 covers what's under it.  a rect's colour is rgb or
+// yuv like the frame, sprites are 4 bytes a pixel, rgba over rgb24 or
+// yuva over yuv420, and all of it is clipped to the frame.
+class BlendRect {
+  public:
+    Rect rect;
+    unsigned char c[3];
+    unsigned char alpha;
+};
+
+bool blendRGBRects(unsigned char* dst, unsigned int stride,
+    unsigned int width, unsigned int height, const BlendRect* rects, unsigned int num);
+bool blendYUVRects(unsigned char* dst_y, unsigned int dst_stride_y,
+    unsigned char* dst_u, unsigned int dst_stride_u,
+    unsigned char* dst_v, unsigned int dst_stride_v,
+    unsigned int width, unsigned int height, const BlendRect* rects, unsigned int num);
+
+bool blendRGBSprite(unsigned char* dst, unsigned int stride,
+    unsigned int width, unsigned int height, unsigned int x, unsigned int y,
+    const unsigned char* sprite, unsigned int sprite_w, unsigned int sprite_h);
+bool blendYUVSprite(unsigned char* dst_y, unsigned int dst_stride_y,
+    unsigned char* dst_u, unsigned int dst_stride_u,
+    unsigned char* dst_v, unsigned int dst_stride_v,
+    unsigned int width, unsigned int height, unsigned int x, unsigned int y,
+    const unsigned char* sprite, unsigned int sprite_w, unsigned int sprite_h);
+void rgba_to_yuva(const unsigned char* src, unsigned char* dst, unsigned int num);
+
+// 'txt' as a cached sprite 8 rows high, 'fg' and 'bg' 4 bytes with alpha
+const std::vector<unsigned char>& labelSprite(const char* txt,
+    const unsigned char* fg, const unsigned char* bg);
+
+// changes when the sprites labelSprite returned on this thread are gone
+unsigned int labelEpoch();
+
+
+// a cpu list like 2-3 or 0+2, empty is none
+bool parse_cpus(const std::string& str, std::vector<unsigned int>& cpus);
+
+// x,y,w,h[,alpha][:x,y,w,h[,alpha]...], black and opaque unless given
+bool parse_zones(const std::string& str, std::vector<BlendRect>& zones);
+
+// msec since the process started, for cold start timing
+unsigned int since_start_ms();
+
+// the clock stages age things by where there is no capture time to hand.
+// A lockstep replay (see replay.h) steps it to each frame's made up
+// capture time, so nothing downstream reads the wall clock
+std::chrono::steady_clock::time_point pipeline_now();
+void pipeline_step(std::chrono::steady_clock::time_point at);
 
 const char* BufTypeToStr(unsigned int bt);
 const char* BufFieldToStr(unsigned int bf);
@@ -83,34 +302,78 @@ const char* BufMemoryToStr(unsigned int bm);
 const char* ColorspaceToStr(unsigned int cs) ;
 const char* PixelFormatToStr(unsigned int pix);
 
-class Semaphore {
+// sleep on / wake sleepers of a futex word, 'usec' 0 waits forever
+void futex_wait(std::atomic<int>& word, int val, unsigned int usec);
+void futex_wake(std::atomic<int>& word, int num);
+
+// counting semaphore on a futex, post and an uncontended wait stay in
+// user space and only a sleeper or a post to one goes to the kernel.
+// it has a cache line to itself, the poster and the waiter are on
+// different cores and nothing else should bounce with it.
+class alignas(64) Semaphore {
   public:
     Semaphore (int count = 0) 
-      : cnt_(count) {}
+      : cnt_(count), waiters_(0) {}
 
     inline void post() {
-      std::unique_lock<std::mutex> lck(mtx_);
-      cnt_++;
-      cv_.notify_one();
+      cnt_.fetch_add(1);
+      if (waiters_.load() > 0) {
+        futex_wake(cnt_, 1);
+      }
     }
     inline void wait() {
-      std::unique_lock<std::mutex> lck(mtx_);
-      cv_.wait(lck, [this]() { return cnt_ > 0; });
-      cnt_--;
+      if (!try_wait()) {
+        sleep(0);
+      }
+    }
+    inline bool wait_for(unsigned int usec) {
+      return try_wait() || (usec != 0 && sleep(usec));
     }
     inline bool try_wait() {
-      std::lock_guard<std::mutex> lck(mtx_);
-      if (cnt_ > 0) {
-        --cnt_;
-        return true;
+      int c = cnt_.load(std::memory_order_relaxed);
+      while (c > 0) {
+        if (cnt_.compare_exchange_weak(c, c - 1)) {
+          return true;
+        }
       }
       return false;
     }
 
   private:
-    std::mutex mtx_;
-    std::condition_variable cv_;
-    int cnt_;
+    bool sleep(unsigned int usec);
+
+    std::atomic<int> cnt_;
+    std::atomic<int> waiters_;
+};
+
+// auto-reset event, any number of sets before a wait wake it once,
+// on its own cache line the same way
+class alignas(64) Event {
+  public:
+    Event() : set_(0), waiters_(0) {}
+
+    inline void set() {
+      if (set_.exchange(1) == 0 && waiters_.load() > 0) {
+        futex_wake(set_, 1);
+      }
+    }
+    inline void wait() {
+      if (!try_wait()) {
+        sleep(0);
+      }
+    }
+    inline bool wait_for(unsigned int usec) {
+      return try_wait() || (usec != 0 && sleep(usec));
+    }
+    inline bool try_wait() {
+      return set_.load(std::memory_order_relaxed) != 0 && set_.exchange(0) != 0;
+    }
+
+  private:
+    bool sleep(unsigned int usec);
+
+    std::atomic<int> set_;
+    std::atomic<int> waiters_;
 };
 
 template<typename U, typename T>
@@ -127,6 +390,9 @@ class Differ {
     inline void begin() { 
       begin_ = std::chrono::steady_clock::now();
     }
+    inline void begin(std::chrono::steady_clock::time_point t) { 
+      begin_ = t;
+    }
 
     inline void end() { 
       using namespace std::chrono;
@@ -143,13 +409,19 @@ class Differ {
 
       cnt++;
       avg = diff_sum_ / cnt;
+
+      hist.record(diff_);
     }
 
+    // 'p' is 0 to 1, e.g. .99
+    inline U pct(double p) { return static_cast<U>(hist.percentile(p)); }
+
   public:
     U cnt;
     U avg;
     U high;
     U low;
+    Histogram hist;
 
   private:
     std::chrono::steady_clock::time_point begin_;
@@ -0,0 +1,122 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "watchdog.h"
+#include "flight.h"
+
+namespace detector {
+
+Watchdog::Watchdog(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Watchdog::~Watchdog() {
+}
+
+std::unique_ptr<Watchdog> Watchdog::create(unsigned int yield_time, bool quiet,
+    unsigned int stall_ms, Pipeline* pipe) {
+  auto obj = std::unique_ptr<Watchdog>(new Watchdog(yield_time));
+  obj->init(quiet, stall_ms, pipe);
+  return obj;
+}
+
+bool Watchdog::init(bool quiet, unsigned int stall_ms, Pipeline* pipe) {
+
+  quiet_ = quiet;
+  stall_ms_ = stall_ms;
+  pipe_ = pipe;
+
+  watch_on_ = false;
+  restart_cnt_ = 0;
+  stall_cnt_ = 0;
+
+  return true;
+}
+
+bool Watchdog::waitingToRun() {
+
+  if (!watch_on_) {
+    stalled_.clear();
+    watch_on_ = true;
+  }
+
+  return true;
+}
+
+bool Watchdog::running() {
+
+  if (watch_on_) {
+    unsigned int restarted = pipe_->recover();
+    restart_cnt_ += restarted;
+
+    // what led up to it, if there's a recorder
+    Flight* fly = pipe_->get<Flight>("fly");
+    if (restarted && fly) {
+      fly->dump("a stage was restarted");
+    }
+
+    // the same stages stuck for long enough, nothing short of a restart helps
+    auto now = std::chrono::steady_clock::now();
+    std::string stalled = pipe_->stalled(stall_ms_);
+    if (stalled != stalled_) {
+      stalled_ = stalled;
+      stall_start_ = now;
+      if (!stalled.empty()) {
+        stall_cnt_++;
+        if (!quiet_) {
+          fprintf(stderr, "\nstalled: %s\n", stalled.c_str());
+        }
+      }
+    } else if (!stalled.empty() && now - stall_start_ >= 
+        std::chrono::milliseconds(stall_ms_ * stall_max_)) {
+      fprintf(stderr, "\nstill stalled: %s, exiting\n", stalled.c_str());
+      if (fly) {
+        fly->dump("still stalled, exiting");
+      }
+      _exit(2);
+    }
+  }
+
+  return true;
+}
+
+bool Watchdog::paused() {
+  return true;
+}
+
+bool Watchdog::waitingToHalt() {
+
+  if (watch_on_) {
+    watch_on_ = false;
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nWatchdog Results...\n");
+      fprintf(stderr, "  stages restarted: %u\n", restart_cnt_);
+      fprintf(stderr, "    stalls noticed: %u\n", stall_cnt_);
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
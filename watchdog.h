@@ -0,0 +1,78 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Stage watchdog.
+ *
+ *  Every couple of seconds it looks over the pipeline.  A stage that gave
+ *  up (the camera went quiet, the codec errored, the tpu hung) has
+ *  already let go of its device, so it is started and run again on its
+ *  own while everything else carries on.  A stage whose loop hasn't gone
+ *  round within the stall time is stuck inside a driver and can't be
+ *  stopped from here.  It is reported, and if it is still stuck after
+ *  'stall_max_' stall times the process exits so whatever started it
+ *  (systemd, a shell loop) can start it clean.
+ */
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <string>
+#include <memory>
+#include <chrono>
+
+#include "utils.h"
+#include "base.h"
+#include "pipeline.h"
+
+namespace detector {
+
+class Watchdog : public Base {
+  public:
+    static std::unique_ptr<Watchdog> create(unsigned int yield_time, bool quiet,
+        unsigned int stall_ms, Pipeline* pipe);
+    virtual ~Watchdog();
+
+  protected:
+    Watchdog() = delete;
+    Watchdog(unsigned int yield_time);
+    bool init(bool quiet, unsigned int stall_ms, Pipeline* pipe);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    unsigned int stall_ms_;
+    Pipeline* pipe_;
+
+    const unsigned int stall_max_ = {3};
+    std::string stalled_;
+    std::chrono::steady_clock::time_point stall_start_;
+
+    bool watch_on_;
+    unsigned int restart_cnt_;
+    unsigned int stall_cnt_;
+};
+
+} // namespace detector
+
+#endif // WATCHDOG_H
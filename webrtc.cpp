@@ -0,0 +1,555 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <cstring>
+#include <algorithm>
+
+#include "webrtc.h"
+#include "encoder.h"
+
+namespace detector {
+
+Webrtc::Webrtc(unsigned int yield_time)
+  : Base(yield_time) {
+}
+
+Webrtc::~Webrtc() {
+}
+
+std::unique_ptr<Webrtc> Webrtc::create(unsigned int yield_time, bool quiet,
+    unsigned short port) {
+  auto obj = std::unique_ptr<Webrtc>(new Webrtc(yield_time));
+  obj->init(quiet, port);
+  return obj;
+}
+
+bool Webrtc::init(bool quiet, unsigned short port) {
+
+  quiet_ = quiet;
+  port_ = port;
+  enc_ = nullptr;
+
+  nal_gap_ = false;
+  nal_drops_ = 0;
+
+  peer_seq_ = 0;
+  key_stamp_ = 0;
+
+  sig_on_ = false;
+  listen_fd_ = -1;
+
+  join_cnt_ = 0;
+  turned_away_cnt_ = 0;
+  pli_cnt_ = 0;
+  key_cnt_ = 0;
+  frame_cnt_ = 0;
+  skip_cnt_ = 0;
+  fail_cnt_ = 0;
+
+  rtc_on_ = false;
+
+  return true;
+}
+
+void Webrtc::setEncoder(Encoder* enc) {
+  enc_ = enc;
+}
+
+void Webrtc::footprint(Footprint& out) {
+  out.add("nal_pool", nal_bytes_ ? nal_num_ : 0, nal_bytes_);
+}
+
+bool Webrtc::addMessage(NalBuf& nal) {
+
+  // the encoder never waits on us, a lost access unit means a key frame
+  std::shared_ptr<Webrtc::RtcNal> rtc_nal;
+  if (!nal_pool_.pop(rtc_nal)) {
+    nal_drops_++;
+    nal_gap_ = true;
+    return false;
+  }
+
+  if (nal.length > rtc_nal->nal.size()) {
+    nal_bytes_ += nal.length - rtc_nal->nal.size();
+    rtc_nal->nal.resize(nal.length, 0);
+  }
+  std::memcpy(rtc_nal->nal.data(), nal.addr, nal.length);
+  rtc_nal->length = nal.length;
+  rtc_nal->stamp = nal.stamp;
+
+  nal_work_.push(rtc_nal);
+  wake();
+
+  return true;
+}
+
+bool Webrtc::isKey(const unsigned char* data, unsigned int len) {
+
+  // headers and idr lead the buffer, so stop at the first other slice
+  for (unsigned int i = 0; i + 3 < len; i++) {
+    if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+      unsigned int type = data[i + 3] & 0x1f;
+      if (type == 5 || type == 7 || type == 8) {
+        return true;
+      } else if (type == 1) {
+        return false;
+      }
+      i += 3;
+    }
+  }
+  return false;
+}
+
+void Webrtc::keyRequest() {
+
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  int64_t last = key_stamp_.load();
+  if (enc_ == nullptr ||
+      now - std::chrono::steady_clock::duration(last) < std::chrono::milliseconds(key_gap_)) {
+    return;
+  }
+  if (key_stamp_.compare_exchange_strong(last, now.count())) {
+    enc_->requestKeyFrame();
+    key_cnt_++;
+  }
+}
+
+bool Webrtc::addPeer(const std::string& offer, std::string& answer, std::string& id) {
+
+  {
+    std::lock_guard<std::mutex> lk(lock_);
+    if (peers_.size() >= peer_max_) {
+      turned_away_cnt_++;
+      return false;
+    }
+  }
+
+  // answer on the offer's video mid and its h264 payload, packetization mode 1 first
+  rtc::Description remote(offer, rtc::Description::Type::Offer);
+  std::string mid;
+  int pt = -1;
+  std::string fmtp;
+  for (int i = 0; i < remote.mediaCount() && pt < 0; i++) {
+    auto entry = remote.media(i);
+    if (!std::holds_alternative<rtc::Description::Media*>(entry)) {
+      continue;
+    }
+    auto media = std::get<rtc::Description::Media*>(entry);
+    if (media->type() != "video") {
+      continue;
+    }
+    for (int p : media->payloadTypes()) {
+      auto map = media->rtpMap(p);
+      if (map == nullptr || strcasecmp(map->format.c_str(), "H264") != 0) {
+        continue;
+      }
+      std::string params;
+      for (auto& f : map->fmtps) {
+        params += (params.empty() ? "" : ";") + f;
+      }
+      bool mode1 = params.find("packetization-mode=1") != std::string::npos;
+      if (pt < 0 || mode1) {
+        mid = media->mid();
+        pt = p;
+        fmtp = params;
+      }
+      if (mode1) {
+        break;
+      }
+    }
+  }
+  if (pt < 0) {
+    dbgMsg("whep offer has no h264\n");
+    return false;
+  }
+
+  auto peer = std::make_shared<Webrtc::Peer>();
+  peer->id = std::to_string(++peer_seq_);
+  uint32_t ssrc = 0x10000000 + (peer_seq_ & 0x0fffffff);
+  std::string cname = "detector";
+
+  rtc::Configuration config;
+  config.disableAutoNegotiation = true;
+  peer->pc = std::make_shared<rtc::PeerConnection>(config);
+
+  std::weak_ptr<Webrtc::Peer> weak = peer;
+  peer->pc->onStateChange([weak](rtc::PeerConnection::State state) {
+    auto p = weak.lock();
+    if (p && (state == rtc::PeerConnection::State::Disconnected ||
+          state == rtc::PeerConnection::State::Failed ||
+          state == rtc::PeerConnection::State::Closed)) {
+      p->gone = true;
+    }
+  });
+  auto gathered = std::make_shared<Semaphore>();
+  peer->pc->onGatheringStateChange([gathered](rtc::PeerConnection::GatheringState state) {
+    if (state == rtc::PeerConnection::GatheringState::Complete) {
+      gathered->post();
+    }
+  });
+
+  rtc::Description::Video video(mid, rtc::Description::Direction::SendOnly);
+  if (fmtp.empty()) {
+    video.addH264Codec(pt);
+  } else {
+    video.addH264Codec(pt, fmtp);
+  }
+  video.addSSRC(ssrc, cname, std::string("detector"), std::string("camera"));
+  peer->track = peer->pc->addTrack(video);
+
+  // packetise, report, answer nacks from history and plis with a key frame
+  peer->rtp = std::make_shared<rtc::RtpPacketizationConfig>(ssrc, cname, pt,
+      rtc::H264RtpPacketizer::defaultClockRate);
+  auto pack = std::make_shared<rtc::H264RtpPacketizer>(
+      rtc::NalUnit::Separator::StartSequence, peer->rtp);
+  pack->addToChain(std::make_shared<rtc::RtcpSrReporter>(peer->rtp));
+  pack->addToChain(std::make_shared<rtc::RtcpNackResponder>(nack_max_));
+  pack->addToChain(std::make_shared<rtc::PliHandler>([this]() {
+    pli_cnt_++;
+    keyRequest();
+  }));
+  peer->track->setMediaHandler(pack);
+  peer->track->onOpen([this, weak]() {
+    if (auto p = weak.lock()) {
+      p->open = true;
+      join_cnt_++;
+      keyRequest();
+    }
+  });
+  peer->track->onClosed([weak]() {
+    if (auto p = weak.lock()) {
+      p->gone = true;
+    }
+  });
+
+  // no trickle ice, the answer carries every candidate
+  peer->pc->setRemoteDescription(remote);
+  peer->pc->setLocalDescription(rtc::Description::Type::Answer);
+  if (!gathered->wait_for(gather_max_ * 1000)) {
+    dbgMsg("whep ice gathering timed out\n");
+  }
+  auto local = peer->pc->localDescription();
+  if (!local) {
+    peer->pc->close();
+    return false;
+  }
+  answer = std::string(*local);
+  id = peer->id;
+
+  std::lock_guard<std::mutex> lk(lock_);
+  peers_.push_back(peer);
+  return true;
+}
+
+bool Webrtc::dropPeer(const std::string& id) {
+  std::lock_guard<std::mutex> lk(lock_);
+  for (auto& peer : peers_) {
+    if (peer->id == id) {
+      peer->gone = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+void Webrtc::reply(int fd, const char* status, const char* type,
+    const std::string& body, const std::string& location) {
+
+  std::string head = std::string("HTTP/1.1 ") + status + "\r\n";
+  head += std::string("Content-Type: ") + type + "\r\n";
+  head += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+  if (!location.empty()) {
+    head += "Location: " + location + "\r\n";
+  }
+  head += "Access-Control-Allow-Origin: *\r\n";
+  head += "Access-Control-Allow-Methods: POST, DELETE, OPTIONS\r\n";
+  head += "Access-Control-Allow-Headers: Content-Type\r\n";
+  head += "Access-Control-Expose-Headers: Location\r\n";
+  head += "Connection: close\r\n\r\n";
+  head += body;
+
+  size_t done = 0;
+  while (done < head.size()) {
+    ssize_t n = ::send(fd, head.data() + done, head.size() - done, MSG_NOSIGNAL);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    done += n;
+  }
+}
+
+void Webrtc::handle(int fd) {
+
+  struct timeval tv;
+  tv.tv_sec = req_timeout_ / 1000;
+  tv.tv_usec = (req_timeout_ % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  // headers, then as much body as they say
+  std::string req;
+  size_t end = std::string::npos;
+  size_t want = 0;
+  char buf[2048];
+  while (req.size() < req_max_) {
+    if (end != std::string::npos && req.size() >= end + 4 + want) {
+      break;
+    }
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    req.append(buf, n);
+    if (end == std::string::npos && (end = req.find("\r\n\r\n")) != std::string::npos) {
+      std::string head = req.substr(0, end);
+      std::transform(head.begin(), head.end(), head.begin(), ::tolower);
+      size_t cl = head.find("content-length:");
+      if (cl != std::string::npos) {
+        want = strtoul(head.c_str() + cl + 15, nullptr, 10);
+      }
+    }
+  }
+  if (end == std::string::npos || req.size() < end + 4 + want) {
+    return;
+  }
+
+  std::string line = req.substr(0, req.find("\r\n"));
+  size_t sp1 = line.find(' ');
+  size_t sp2 = (sp1 == std::string::npos) ? sp1 : line.find(' ', sp1 + 1);
+  if (sp2 == std::string::npos) {
+    return;
+  }
+  std::string method = line.substr(0, sp1);
+  std::string path = line.substr(sp1 + 1, sp2 - sp1 - 1);
+  std::string body = req.substr(end + 4, want);
+
+  if (method == "OPTIONS") {
+    reply(fd, "204 No Content", "text/plain", "", "");
+  } else if (method == "POST" && path == "/whep") {
+    std::string answer;
+    std::string id;
+    if (addPeer(body, answer, id)) {
+      reply(fd, "201 Created", "application/sdp", answer, "/whep/" + id);
+    } else {
+      fail_cnt_++;
+      reply(fd, "503 Service Unavailable", "text/plain", "", "");
+    }
+  } else if (method == "DELETE" && path.compare(0, 6, "/whep/") == 0) {
+    bool found = dropPeer(path.substr(6));
+    reply(fd, found ? "200 OK" : "404 Not Found", "text/plain", "", "");
+  } else {
+    reply(fd, "404 Not Found", "text/plain", "", "");
+  }
+}
+
+void Webrtc::sigLoop() {
+
+  while (sig_on_) {
+    struct pollfd pfd = {listen_fd_, POLLIN, 0};
+    int res = poll(&pfd, 1, poll_timeout_);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      dbgMsg("failed: whep poll\n");
+      break;
+    }
+    if (res == 0) {
+      continue;
+    }
+    int fd = accept(listen_fd_, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    handle(fd);
+    close(fd);
+  }
+}
+
+bool Webrtc::waitingToRun() {
+
+  if (!rtc_on_) {
+
+    // create nal pool
+    dbgMsg("create nal pool\n");
+    for (unsigned int i = 0; i < nal_num_; i++) {
+      auto rtc_nal = std::shared_ptr<Webrtc::RtcNal>(new RtcNal(nal_len_));
+      nal_pool_.push(rtc_nal);
+    }
+    nal_bytes_ = nal_num_ * nal_len_;
+
+    dbgMsg("open whep port %u\n", port_);
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd_ < 0) {
+      dbgMsg("failed: whep socket\n");
+      return false;
+    }
+    int on = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port_);
+    if (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(listen_fd_, peer_max_) < 0) {
+      dbgMsg("failed: whep bind port %u\n", port_);
+      close(listen_fd_);
+      listen_fd_ = -1;
+      return false;
+    }
+
+    sig_on_ = true;
+    sig_thread_ = std::thread(&Webrtc::sigLoop, this);
+
+    rtc_on_ = true;
+  }
+
+  return true;
+}
+
+bool Webrtc::running() {
+
+  if (rtc_on_) {
+
+    // peers that hung up or were deleted
+    std::vector<std::shared_ptr<Webrtc::Peer>> peers;
+    {
+      std::lock_guard<std::mutex> lk(lock_);
+      for (auto it = peers_.begin(); it != peers_.end(); ) {
+        if ((*it)->gone) {
+          (*it)->pc->close();
+          it = peers_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      peers = peers_;
+    }
+
+    std::shared_ptr<Webrtc::RtcNal> rtc_nal;
+    while (nal_work_.pop(rtc_nal)) {
+      bool key = isKey(rtc_nal->nal.data(), rtc_nal->length);
+      if (nal_gap_.exchange(false)) {
+        for (auto& peer : peers) {
+          peer->wait_key = true;
+        }
+        keyRequest();
+      }
+
+      for (auto& peer : peers) {
+        if (!peer->open || peer->gone) {
+          continue;
+        }
+        if (peer->wait_key && !key) {
+          skip_cnt_++;
+          continue;
+        }
+        peer->wait_key = false;
+        if (!peer->started) {
+          peer->start = rtc_nal->stamp;
+          peer->started = true;
+        }
+
+        // rtp time follows the capture clock
+        double sec = std::chrono::duration<double>(rtc_nal->stamp - peer->start).count();
+        peer->rtp->timestamp = peer->rtp->startTimestamp + peer->rtp->secondsToTimestamp(sec);
+        if (!peer->track->send(reinterpret_cast<const std::byte*>(rtc_nal->nal.data()),
+              rtc_nal->length)) {
+          peer->wait_key = true;
+        }
+      }
+      frame_cnt_++;
+
+      // capture to sent
+      differ_late_.begin(rtc_nal->stamp);
+      differ_late_.end();
+
+      nal_pool_.push(rtc_nal);
+    }
+  }
+  return true;
+}
+
+bool Webrtc::paused() {
+  return true;
+}
+
+bool Webrtc::waitingToHalt() {
+
+  if (rtc_on_) {
+    rtc_on_ = false;
+
+    sig_on_ = false;
+    if (sig_thread_.joinable()) {
+      sig_thread_.join();
+    }
+    close(listen_fd_);
+    listen_fd_ = -1;
+
+    {
+      std::lock_guard<std::mutex> lk(lock_);
+      for (auto& peer : peers_) {
+        peer->pc->close();
+      }
+      peers_.clear();
+    }
+
+    std::shared_ptr<Webrtc::RtcNal> rtc_nal;
+    while (nal_work_.pop(rtc_nal)) {
+    }
+    while (nal_pool_.pop(rtc_nal)) {
+    }
+    nal_bytes_ = 0;
+
+    // report
+    if (!quiet_) {
+      fprintf(stderr, "\nWebrtc Results...\n");
+      fprintf(stderr, "  send latency (us): p50:%u p90:%u p99:%u p999:%u high:%u avg:%u low:%u cnt:%u\n",
+          differ_late_.pct(.5), differ_late_.pct(.9), differ_late_.pct(.99), differ_late_.pct(.999),
+          differ_late_.high, differ_late_.avg,
+          differ_late_.low, differ_late_.cnt);
+      fprintf(stderr, "        frames: %u\n", frame_cnt_);
+      fprintf(stderr, "  skipped for key: %u\n", skip_cnt_);
+      fprintf(stderr, "  viewers joined: %u\n", join_cnt_.load());
+      fprintf(stderr, "   turned away: %u\n", turned_away_cnt_.load());
+      fprintf(stderr, "  failed offers: %u\n", fail_cnt_);
+      fprintf(stderr, "  plis: %u key frames asked: %u\n", pli_cnt_.load(), key_cnt_.load());
+      fprintf(stderr, "  nals dropped: %u\n", nal_drops_.load());
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return true;
+}
+
+} // namespace detector
@@ -0,0 +1,159 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  WebRTC egress (libdatachannel).
+ *
+ *  Viewers sign on with WHEP: they POST an SDP offer and get the answer
+ *  back, ICE candidates and all.  Each one gets its own peer connection
+ *  and a send only H264 track.  The encoder's access units go out as
+ *  they are, packetised to SRTP without a re-encode.  NACKs are answered
+ *  from a short packet history and a PLI, or a new viewer, asks the
+ *  encoder for a key frame.  Nothing in front of a key frame is sent.
+ */
+
+#ifndef WEBRTC_H
+#define WEBRTC_H
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include <rtc/rtc.hpp>
+
+#include "utils.h"
+#include "listener.h"
+#include "channel.h"
+#include "base.h"
+#include "reserve.h"
+
+namespace detector {
+
+class Encoder;
+
+class Webrtc : public Base, Listener<NalBuf> {
+  public:
+    static std::unique_ptr<Webrtc> create(unsigned int yield_time, bool quiet,
+        unsigned short port);
+    virtual ~Webrtc();
+
+  public:
+    virtual bool addMessage(NalBuf& nal);
+
+    // the nal pool and what it holds on to
+    virtual void footprint(Footprint& out);
+
+    // key frames for new viewers and picture loss
+    void setEncoder(Encoder* enc);
+
+  protected:
+    Webrtc() = delete;
+    Webrtc(unsigned int yield_time);
+    bool init(bool quiet, unsigned short port);
+
+  protected:
+    virtual bool waitingToRun();
+    virtual bool running();
+    virtual bool paused();
+    virtual bool waitingToHalt();
+
+  private:
+    bool quiet_;
+    unsigned short port_;
+    Encoder* enc_;
+
+    class RtcNal {
+      public:
+        RtcNal() = delete;
+        RtcNal(unsigned int len)
+          : length(len), nal(len) {}
+        ~RtcNal() {}
+      public:
+        unsigned int length;
+        Bytes nal;
+        std::chrono::steady_clock::time_point stamp;
+    };
+    const unsigned int nal_num_ = {32};
+    const unsigned int nal_len_ = {64 * 1024};
+    Channel<std::shared_ptr<Webrtc::RtcNal>> nal_pool_{nal_num_,
+      Channel<std::shared_ptr<Webrtc::RtcNal>>::Policy::kDropNewest};
+    Channel<std::shared_ptr<Webrtc::RtcNal>> nal_work_{nal_num_,
+      Channel<std::shared_ptr<Webrtc::RtcNal>>::Policy::kDropNewest};
+    std::atomic<size_t> nal_bytes_{0};   // the pool's, grown nals included
+    std::atomic<bool> nal_gap_;
+    std::atomic<unsigned int> nal_drops_;
+    bool isKey(const unsigned char* data, unsigned int len);
+
+    // callbacks come in on libdatachannel's threads, peers go away on ours
+    class Peer {
+      public:
+        std::string id;
+        std::shared_ptr<rtc::PeerConnection> pc;
+        std::shared_ptr<rtc::Track> track;
+        std::shared_ptr<rtc::RtpPacketizationConfig> rtp;
+        std::atomic<bool> open = {false};
+        std::atomic<bool> gone = {false};
+        bool wait_key = {true};
+        bool started = {false};
+        std::chrono::steady_clock::time_point start;
+    };
+    std::mutex lock_;
+    std::vector<std::shared_ptr<Webrtc::Peer>> peers_;
+    const unsigned int peer_max_ = {4};
+    const unsigned int gather_max_ = {2000};   // msec to find candidates
+    const unsigned int nack_max_ = {512};      // packets kept for resends
+    unsigned int peer_seq_;     // signalling thread only
+    bool addPeer(const std::string& offer, std::string& answer, std::string& id);
+    bool dropPeer(const std::string& id);
+
+    // pli from every viewer at once shouldn't mean a key frame each
+    const unsigned int key_gap_ = {500};       // msec
+    std::atomic<int64_t> key_stamp_;
+    void keyRequest();
+
+    // whep signalling, one short request at a time
+    std::thread sig_thread_;
+    std::atomic<bool> sig_on_;
+    int listen_fd_;
+    const unsigned int poll_timeout_ = {100};  // msec
+    const unsigned int req_timeout_ = {2000};  // msec
+    const size_t req_max_ = {64 * 1024};
+    void sigLoop();
+    void handle(int fd);
+    void reply(int fd, const char* status, const char* type,
+        const std::string& body, const std::string& location);
+
+    std::atomic<bool> rtc_on_;
+
+    std::atomic<unsigned int> join_cnt_;
+    std::atomic<unsigned int> turned_away_cnt_;
+    std::atomic<unsigned int> pli_cnt_;
+    std::atomic<unsigned int> key_cnt_;
+    unsigned int frame_cnt_;
+    unsigned int skip_cnt_;
+    unsigned int fail_cnt_;
+    MicroDiffer<uint32_t> differ_late_;
+};
+
+} // namespace detector
+
+#endif // WEBRTC_H
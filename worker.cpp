@@ -0,0 +1,446 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ */
+
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+
+#include "worker.h"
+
+#include "edgetpu.h"
+
+#include <tensorflow/lite/interpreter.h>
+#include <tensorflow/lite/kernels/register.h>
+#include <tensorflow/lite/kernels/internal/tensor_ctypes.h>
+#include <tensorflow/lite/model.h>
+
+namespace detector {
+
+const size_t worker_header_len = 4096;
+
+static WorkerSlot* laneAt(unsigned char* map, unsigned int lane_len, unsigned int i) {
+  return reinterpret_cast<WorkerSlot*>(map + worker_header_len +
+      static_cast<size_t>(i) * lane_len);
+}
+
+static unsigned char* laneInput(WorkerSlot* s) {
+  return reinterpret_cast<unsigned char*>(s) + sizeof(WorkerSlot);
+}
+
+static float* laneResults(WorkerSlot* s, size_t input_max) {
+  return reinterpret_cast<float*>(laneInput(s) + input_max);
+}
+
+Worker::~Worker() {
+  {
+    std::unique_lock<std::mutex> lck(lock_);
+    stop();
+  }
+  if (map_) {
+    munmap(map_, map_len_);
+  }
+  for (int fd : { mem_fd_, req_fd_, rep_fd_[0], rep_fd_[1], life_fd_[0], life_fd_[1] }) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+std::unique_ptr<Worker> Worker::create(const std::string& model, unsigned int threads,
+    int tpu, int core, unsigned int deadline) {
+  auto obj = std::unique_ptr<Worker>(new Worker());
+  if (!obj->init(model, threads, tpu, core, deadline)) {
+    return nullptr;
+  }
+  return obj;
+}
+
+bool Worker::init(const std::string& model, unsigned int threads, int tpu, int core,
+    unsigned int deadline) {
+
+  model_ = model;
+  threads_ = threads;
+  tpu_ = tpu;
+  core_ = core;
+  deadline_ = deadline;
+
+  // a lane holds the biggest input and result set it will be asked for,
+  // pages only get used as far as the model's really are
+  size_t lane_len = sizeof(WorkerSlot) + input_max_ + result_max_ * 6 * sizeof(float);
+  lane_len = (lane_len + 4095) & ~static_cast<size_t>(4095);
+  map_len_ = worker_header_len + worker_lanes * lane_len;
+
+  mem_fd_ = memfd_create("detector-worker", MFD_CLOEXEC);
+  if (mem_fd_ < 0 || ftruncate(mem_fd_, map_len_) < 0) {
+    dbgMsg("failed: worker memory\n");
+    return false;
+  }
+  void* map = mmap(nullptr, map_len_, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd_, 0);
+  if (map == MAP_FAILED) {
+    dbgMsg("failed: map worker memory\n");
+    return false;
+  }
+  map_ = static_cast<unsigned char*>(map);
+  header_ = reinterpret_cast<WorkerHeader*>(map_);
+  header_->magic = worker_magic;
+  header_->input_max = input_max_;
+  header_->result_max = result_max_;
+  header_->lane_len = lane_len;
+
+  // the worker blocks on its eventfd, ours are polled
+  req_fd_ = eventfd(0, EFD_CLOEXEC);
+  for (unsigned int i = 0; i < worker_lanes; i++) {
+    rep_fd_[i] = eventfd(0, EFD_CLOEXEC);
+  }
+  if (req_fd_ < 0 || rep_fd_[0] < 0 || rep_fd_[1] < 0 || pipe2(life_fd_, O_CLOEXEC) < 0) {
+    dbgMsg("failed: worker eventfd\n");
+    return false;
+  }
+
+  std::unique_lock<std::mutex> lck(lock_);
+  return start();
+}
+
+WorkerSlot* Worker::lane(unsigned int i) {
+  return laneAt(map_, header_->lane_len, i);
+}
+
+bool Worker::start() {
+
+  header_->up = 0;
+  for (unsigned int i = 0; i < worker_lanes; i++) {
+    uint64_t cnt;
+    struct pollfd pfd = { rep_fd_[i], POLLIN, 0 };
+    while (poll(&pfd, 1, 0) > 0 && read(rep_fd_[i], &cnt, sizeof(cnt)) > 0) {
+    }
+  }
+
+  // everything the child needs is made before the fork, it only execs
+  std::vector<std::string> args = { "detector", "--worker",
+    std::to_string(mem_fd_), std::to_string(req_fd_),
+    std::to_string(rep_fd_[0]), std::to_string(rep_fd_[1]), std::to_string(life_fd_[0]),
+    model_, std::to_string(threads_), std::to_string(tpu_), std::to_string(core_) };
+  std::vector<char*> argv;
+  for (auto& a : args) {
+    argv.push_back(const_cast<char*>(a.c_str()));
+  }
+  argv.push_back(nullptr);
+  int fds[] = { mem_fd_, req_fd_, rep_fd_[0], rep_fd_[1], life_fd_[0] };
+
+  started_ = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid < 0) {
+    dbgMsg("failed: fork worker\n");
+    return false;
+  }
+  if (pid == 0) {
+    for (int fd : fds) {
+      fcntl(fd, F_SETFD, 0);
+    }
+    execv("/proc/self/exe", argv.data());
+    _exit(127);
+  }
+  pid_ = pid;
+  start_cnt_++;
+  dbgMsg("worker %d started\n", pid_);
+  return true;
+}
+
+void Worker::stop() {
+  if (pid_ > 0) {
+    kill(pid_, SIGKILL);
+    waitpid(pid_, nullptr, 0);
+    dbgMsg("worker %d stopped\n", pid_);
+    pid_ = -1;
+  }
+  header_->up = 0;
+}
+
+bool Worker::alive() {
+  if (pid_ <= 0) {
+    return false;
+  }
+  int status;
+  if (waitpid(pid_, &status, WNOHANG) == 0) {
+    return true;
+  }
+  dbgMsg("worker %d exited\n", pid_);
+  pid_ = -1;
+  header_->up = 0;
+  return false;
+}
+
+bool Worker::ready() {
+  std::unique_lock<std::mutex> lck(lock_);
+  if (!alive()) {
+    if (std::chrono::steady_clock::now() - started_ >= std::chrono::milliseconds(backoff_)) {
+      start();
+    }
+    return false;
+  }
+  return header_->up.load(std::memory_order_acquire) == 1;
+}
+
+bool Worker::wait(unsigned int ms) {
+  auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+  while (std::chrono::steady_clock::now() < end) {
+    {
+      std::unique_lock<std::mutex> lck(lock_);
+      if (!alive()) {
+        return false;
+      }
+      if (header_->up.load(std::memory_order_acquire) == 1) {
+        return true;
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(slice_));
+  }
+  return false;
+}
+
+bool Worker::infer(unsigned int i, const unsigned char* rgb, size_t len, float* locs,
+    float* clas, float* scor, float& total) {
+
+  if (i >= worker_lanes || len > header_->input_max || !ready()) {
+    return false;
+  }
+
+  WorkerSlot* s = lane(i);
+  std::memcpy(laneInput(s), rgb, len);
+  s->len = len;
+  s->seq = ++seq_[i];
+  s->ok = 0;
+  s->state.store(WorkerSlot::kQueued, std::memory_order_release);
+  uint64_t one = 1;
+  if (write(req_fd_, &one, sizeof(one)) != sizeof(one)) {
+    return false;
+  }
+
+  using namespace std::chrono;
+  auto end = steady_clock::now() + milliseconds(deadline_);
+  bool done = false;
+  while (!done && steady_clock::now() < end) {
+    struct pollfd pfd = { rep_fd_[i], POLLIN, 0 };
+    if (poll(&pfd, 1, slice_) > 0) {
+      uint64_t cnt;
+      if (read(rep_fd_[i], &cnt, sizeof(cnt)) < 0) {
+        break;
+      }
+    }
+    done = s->state.load(std::memory_order_acquire) == WorkerSlot::kDone;
+    if (!done) {
+      std::unique_lock<std::mutex> lck(lock_);
+      if (!alive()) {
+        break;
+      }
+    }
+  }
+
+  // gone or stuck, a new one starts once the backoff is over
+  if (!done) {
+    miss_cnt_++;
+    std::unique_lock<std::mutex> lck(lock_);
+    if (pid_ > 0) {
+      stop();
+      started_ = steady_clock::now();
+    }
+    return false;
+  }
+
+  bool ok = s->ok != 0;
+  if (ok) {
+    unsigned int num = header_->results;
+    const float* res = laneResults(s, header_->input_max);
+    std::memcpy(locs, res, num * 4 * sizeof(float));
+    std::memcpy(clas, res + header_->result_max * 4, num * sizeof(float));
+    std::memcpy(scor, res + header_->result_max * 5, num * sizeof(float));
+    total = s->total;
+  }
+  s->state.store(WorkerSlot::kFree, std::memory_order_release);
+  return ok;
+}
+
+int Worker::main(int argc, char** argv) {
+
+  if (argc != 11) {
+    fprintf(stderr, "--worker is started by detector, see --workers\n");
+    return 1;
+  }
+
+  // leave ctrl-c to the pipeline, it stops us
+  signal(SIGINT, SIG_IGN);
+
+  int mem_fd = atoi(argv[2]);
+  int req_fd = atoi(argv[3]);
+  int rep_fd[worker_lanes] = { atoi(argv[4]), atoi(argv[5]) };
+  int life_fd = atoi(argv[6]);
+  std::string model_fname = argv[7];
+  int threads = atoi(argv[8]);
+  int tpu = atoi(argv[9]);
+  int core = atoi(argv[10]);
+
+  if (core >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+      dbgMsg("failed: worker affinity %d\n", core);
+    }
+  }
+
+  struct stat st;
+  if (fstat(mem_fd, &st) < 0 || static_cast<size_t>(st.st_size) < worker_header_len) {
+    return 1;
+  }
+  void* map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+  if (map == MAP_FAILED) {
+    return 1;
+  }
+  unsigned char* base = static_cast<unsigned char*>(map);
+  WorkerHeader* hdr = reinterpret_cast<WorkerHeader*>(base);
+  if (hdr->magic != worker_magic) {
+    return 1;
+  }
+  auto fail = [&](const char* why) {
+    dbgMsg("failed: worker %s\n", why);
+    hdr->up.store(2, std::memory_order_release);
+    return 1;
+  };
+
+  auto model = tflite::FlatBufferModel::BuildFromFile(model_fname.c_str());
+  if (!model) {
+    return fail("model");
+  }
+  std::shared_ptr<edgetpu::EdgeTpuContext> context;
+  if (tpu >= 0) {
+    const auto& tpus = edgetpu::EdgeTpuManager::GetSingleton()->EnumerateEdgeTpu();
+    if (static_cast<size_t>(tpu) < tpus.size()) {
+      context = edgetpu::EdgeTpuManager::GetSingleton()->OpenDevice(
+          tpus[tpu].type, tpus[tpu].path);
+    }
+    if (!context) {
+      return fail("no tpu");
+    }
+  }
+  tflite::ops::builtin::BuiltinOpResolver resolver;
+  if (context) {
+    resolver.AddCustom(edgetpu::kCustomOp, edgetpu::RegisterCustomOp());
+  }
+  std::unique_ptr<tflite::Interpreter> interpreter;
+  if (tflite::InterpreterBuilder(*model, resolver)(&interpreter) != kTfLiteOk ||
+      !interpreter) {
+    return fail("interpreter");
+  }
+  if (context) {
+    interpreter->SetExternalContext(kTfLiteEdgeTpuContext, context.get());
+  }
+  interpreter->SetNumThreads(threads);
+  if (interpreter->AllocateTensors() != kTfLiteOk) {
+    return fail("tensors");
+  }
+
+  // the same checks and shape as an engine of our own
+  int input = interpreter->inputs()[0];
+  TfLiteTensor* in = interpreter->tensor(input);
+  const std::vector<int>& res = interpreter->outputs();
+  if ((in->type != kTfLiteUInt8 && in->type != kTfLiteFloat32) || res.size() < 4) {
+    return fail("model outputs");
+  }
+  TfLiteIntArray* sdims = interpreter->tensor(res[2])->dims;
+  hdr->height = in->dims->data[1];
+  hdr->width = in->dims->data[2];
+  hdr->channels = in->dims->data[3];
+  hdr->results = sdims->data[sdims->size - 1];
+  hdr->input_type = in->type;
+  hdr->in_scale = (in->params.scale > 0.f) ? in->params.scale : 1.f / 127.5f;
+  hdr->in_zero = (in->params.scale > 0.f) ? in->params.zero_point : 127.5f;
+  size_t want = static_cast<size_t>(hdr->width) * hdr->height * hdr->channels;
+  if (want > hdr->input_max || hdr->results > hdr->result_max) {
+    return fail("model too big");
+  }
+
+  // pay the first invoke before saying we're up
+  std::memset(in->data.raw, 0, in->bytes);
+  if (interpreter->Invoke() != kTfLiteOk) {
+    return fail("warm up");
+  }
+  hdr->up.store(1, std::memory_order_release);
+
+  // until the pipeline goes, whichever thread of it started us
+  while (true) {
+    struct pollfd pfd[2] = { { req_fd, POLLIN, 0 }, { life_fd, POLLIN, 0 } };
+    if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+      break;
+    }
+    if (pfd[1].revents) {
+      break;
+    }
+    uint64_t cnt;
+    if (!(pfd[0].revents & POLLIN) || read(req_fd, &cnt, sizeof(cnt)) != sizeof(cnt)) {
+      continue;
+    }
+    for (unsigned int i = 0; i < worker_lanes; i++) {
+      WorkerSlot* s = laneAt(base, hdr->lane_len, i);
+      uint32_t queued = WorkerSlot::kQueued;
+      if (!s->state.compare_exchange_strong(queued, WorkerSlot::kRunning,
+            std::memory_order_acquire)) {
+        continue;
+      }
+      s->ok = 0;
+      if (s->len == want) {
+        if (hdr->input_type == kTfLiteUInt8) {
+          std::memcpy(interpreter->typed_tensor<uint8_t>(input), laneInput(s), want);
+        } else {
+          quantise_rgb24(laneInput(s), interpreter->typed_tensor<float>(input),
+              want, hdr->in_scale, hdr->in_zero);
+        }
+        if (interpreter->Invoke() == kTfLiteOk) {
+          float* out = laneResults(s, hdr->input_max);
+          unsigned int num = hdr->results;
+          std::memcpy(out, tflite::GetTensorData<float>(interpreter->tensor(res[0])),
+              num * 4 * sizeof(float));
+          std::memcpy(out + hdr->result_max * 4,
+              tflite::GetTensorData<float>(interpreter->tensor(res[1])), num * sizeof(float));
+          std::memcpy(out + hdr->result_max * 5,
+              tflite::GetTensorData<float>(interpreter->tensor(res[2])), num * sizeof(float));
+          s->total = *tflite::GetTensorData<float>(interpreter->tensor(res[3]));
+          s->ok = 1;
+        }
+      }
+      s->state.store(WorkerSlot::kDone, std::memory_order_release);
+      uint64_t one = 1;
+      if (write(rep_fd[i], &one, sizeof(one)) != sizeof(one)) {
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+} // namespace detector
@@ -0,0 +1,153 @@
+/*
+ * Copyright © 2019 Tyler J. Brooks <tylerjbrooks@digispeaker.com> <https://www.digispeaker.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * <http://www.apache.org/licenses/LICENSE-2.0>
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Try './detector -h' for usage.
+ *
+ * ----------
+ *
+ *  Inference in worker processes.
+ *
+ *  With --infer-procs num[,ms[,core]] the model runs in 'num' copies of this
+ *  program started with --worker, not in ours, so a tflite or edge tpu
+ *  crash or an invoke that never returns (a usb tpu that glitched) takes
+ *  a worker down and not capture and recording.  Each worker loads the
+ *  model itself, on its own tpu when there are tpus, and is pinned to
+ *  'core' + its index when a core is given.
+ *
+ *  A worker shares one memfd with us: a WorkerHeader with the model's
+ *  input and output shape, filled in by the worker once it is up, then
+ *  'worker_lanes' WorkerSlots, each with room for an input and its
+ *  results.  Two engines a worker each own a lane, so one is filled and
+ *  read while the other invokes.  A lane is queued with its state and a
+ *  write to the worker's eventfd, and answered the same way on the
+ *  lane's own eventfd.  An answer that doesn't come within 'ms' has the
+ *  worker killed; its frames go through with nothing found and a new
+ *  worker is started in the background, no sooner than 'backoff_' after
+ *  the last.
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <sys/types.h>
+
+#include "utils.h"
+
+namespace detector {
+
+const uint32_t worker_magic = 0x44575231;   // "DWR1"
+const unsigned int worker_lanes = 2;
+
+class WorkerHeader {
+  public:
+    uint32_t magic;
+    std::atomic<uint32_t> up;   // 0 loading, 1 running, 2 gave up
+    uint32_t width, height, channels;
+    uint32_t results;           // boxes a frame
+    int32_t input_type;         // TfLiteType
+    float in_scale, in_zero;
+    uint32_t input_max;         // bytes a lane's input can hold
+    uint32_t result_max;        // and boxes
+    uint32_t lane_len;          // bytes a lane, header included
+};
+
+class WorkerSlot {
+  public:
+    enum State : uint32_t {
+      kFree = 0,
+      kQueued,
+      kRunning,
+      kDone
+    };
+    std::atomic<uint32_t> state;
+    uint32_t seq;
+    uint32_t len;               // input bytes
+    uint32_t ok;
+    float total;
+    uint32_t pad[3];
+    // the input, then 'result_max' boxes as locations, classes and scores
+};
+
+class Worker {
+  public:
+    static std::unique_ptr<Worker> create(const std::string& model, unsigned int threads,
+        int tpu, int core, unsigned int deadline);
+    ~Worker();
+
+  public:
+    // running, and starts another once one that died has been gone long enough
+    bool ready();
+
+    // up within 'ms', for the model's shape at start
+    bool wait(unsigned int ms);
+    inline const WorkerHeader& shape() { return *header_; }
+    inline int tpu() { return tpu_; }
+
+    // the model's results for 'rgb' on 'lane' by the deadline, false on a
+    // miss, which also kills the worker
+    bool infer(unsigned int lane, const unsigned char* rgb, size_t len, float* locs,
+        float* clas, float* scor, float& total);
+
+    inline unsigned int starts() { return start_cnt_; }
+    inline unsigned int misses() { return miss_cnt_; }
+
+    // the worker's side, main for --worker
+    static int main(int argc, char** argv);
+
+  protected:
+    Worker() = default;
+    bool init(const std::string& model, unsigned int threads, int tpu, int core,
+        unsigned int deadline);
+
+  private:
+    std::string model_;
+    unsigned int threads_;
+    int tpu_;
+    int core_;
+    unsigned int deadline_;
+
+    const size_t input_max_ = {4 * 1024 * 1024};
+    const unsigned int result_max_ = {256};
+    const unsigned int backoff_ = {2000};    // msec
+    const unsigned int slice_ = {10};        // msec a wait is checked in
+    int mem_fd_ = {-1};
+    int req_fd_ = {-1};
+    int rep_fd_[worker_lanes] = {-1, -1};
+    int life_fd_[2] = {-1, -1};   // the worker sees a hangup when we go
+    size_t map_len_ = {0};
+    unsigned char* map_ = {nullptr};
+    WorkerHeader* header_ = {nullptr};
+    WorkerSlot* lane(unsigned int i);
+
+    std::mutex lock_;
+    pid_t pid_ = {-1};
+    uint32_t seq_[worker_lanes] = {0, 0};
+    std::chrono::steady_clock::time_point started_;
+    std::atomic<unsigned int> start_cnt_{0};
+    std::atomic<unsigned int> miss_cnt_{0};
+    bool start();
+    void stop();
+    bool alive();
+};
+
+} // namespace detector
+
+#endif // WORKER_H